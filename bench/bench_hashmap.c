@@ -0,0 +1,106 @@
+/**
+ * Micro-benchmark for the hashmap implementations.
+ * This is linked against each implementation, so that
+ * `bench_hashmap_chained` and `bench_hashmap_open` can
+ * be compared directly.
+ *
+ * Usage: bench_hashmap [num_keys] [rounds]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "hashmap.h"
+
+/**
+ * Returns the current monotonic time in seconds
+ */
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int iter_cb(void *data, const char *key, void *value) {
+    *(uint64_t*)data += (uintptr_t)value;
+    return 0;
+}
+
+static void report(char *phase, uint64_t ops, double elapsed) {
+    printf("%-16s %10llu ops %8.3f sec %8.1f ns/op\n", phase,
+            (unsigned long long)ops, elapsed, elapsed * 1e9 / ops);
+}
+
+int main(int argc, char **argv) {
+    int num_keys = (argc > 1) ? atoi(argv[1]) : 1000000;
+    int rounds = (argc > 2) ? atoi(argv[2]) : 5;
+    if (num_keys <= 0 || rounds <= 0) {
+        fprintf(stderr, "Usage: %s [num_keys] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    // Generate metric-like keys up front
+    char **keys = malloc(num_keys * sizeof(char*));
+    for (int i=0; i < num_keys; i++) {
+        keys[i] = malloc(64);
+        snprintf(keys[i], 64, "servers.host%d.requests.api.endpoint%d", i % 512, i);
+    }
+
+    hashmap *map;
+    hashmap_init(0, &map);
+
+    // Insert every key
+    double start = now();
+    void **slot;
+    for (int i=0; i < num_keys; i++) {
+        hashmap_get_or_insert(map, keys[i], &slot);
+        *slot = (void*)(uintptr_t)i;
+    }
+    report("insert", num_keys, now() - start);
+
+    // Look up every key, in a scattered order
+    void *value;
+    uint64_t sum = 0;
+    start = now();
+    for (int r=0; r < rounds; r++) {
+        for (int i=0; i < num_keys; i++) {
+            hashmap_get(map, keys[(i * 7919ULL) % num_keys], &value);
+            sum += (uintptr_t)value;
+        }
+    }
+    report("get", (uint64_t)num_keys * rounds, now() - start);
+
+    // The common hot path, updating existing keys
+    start = now();
+    for (int r=0; r < rounds; r++) {
+        for (int i=0; i < num_keys; i++) {
+            hashmap_get_or_insert(map, keys[i], &slot);
+            *slot = (void*)((uintptr_t)*slot + 1);
+        }
+    }
+    report("get_or_insert", (uint64_t)num_keys * rounds, now() - start);
+
+    // Iterate as done at flush
+    start = now();
+    for (int r=0; r < rounds; r++) {
+        hashmap_iter(map, iter_cb, &sum);
+    }
+    report("iter", (uint64_t)num_keys * rounds, now() - start);
+
+    // Lookups of missing keys
+    char buf[64];
+    start = now();
+    for (int i=0; i < num_keys; i++) {
+        snprintf(buf, sizeof(buf), "missing.key.%d", i);
+        sum += hashmap_get(map, buf, &value);
+    }
+    report("get_missing", num_keys, now() - start);
+
+    hashmap_destroy(map);
+    for (int i=0; i < num_keys; i++) free(keys[i]);
+    free(keys);
+
+    // Print the checksum so the work is not optimized away
+    printf("checksum %llu\n", (unsigned long long)sum);
+    return 0;
+}
@@ -0,0 +1,73 @@
+/**
+ * The input functions of networking.h over the canned buffer
+ * of bench_input.h.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "bench_input.h"
+
+void close_client_connection(statsite_conn_info *conn) {
+}
+
+void** client_state(statsite_conn_info *conn) {
+    return &conn->state;
+}
+
+uint64_t available_bytes(statsite_conn_info *conn) {
+    return conn->len - conn->pos;
+}
+
+int peek_client_byte(statsite_conn_info *conn, unsigned char* byte) {
+    if (conn->pos == conn->len) return -1;
+    *byte = conn->buf[conn->pos];
+    return 0;
+}
+
+int peek_client_bytes(statsite_conn_info *conn, int bytes, char** buf, int* should_free) {
+    if (conn->len - conn->pos < bytes) return -1;
+    *buf = conn->buf + conn->pos;
+    *should_free = 0;
+    return 0;
+}
+
+int peek_client_contiguous(statsite_conn_info *conn, char **buf, int *buf_len) {
+    if (conn->pos == conn->len) return -1;
+    *buf = conn->buf + conn->pos;
+    *buf_len = conn->len - conn->pos;
+    return 0;
+}
+
+int seek_client_bytes(statsite_conn_info *conn, int bytes) {
+    if (conn->len - conn->pos < bytes) return -1;
+    conn->pos += bytes;
+    return 0;
+}
+
+int read_client_bytes(statsite_conn_info *conn, int bytes, char** buf, int* should_free) {
+    if (peek_client_bytes(conn, bytes, buf, should_free)) return -1;
+    conn->pos += bytes;
+    return 0;
+}
+
+int extract_to_terminator(statsite_conn_info *conn, char terminator, char **buf, int *buf_len, int *should_free) {
+    char *start = conn->buf + conn->pos;
+    char *term = memchr(start, terminator, conn->len - conn->pos);
+    if (!term) return -1;
+    *buf = start;
+    *buf_len = term - start + 1;
+    *should_free = 0;
+    conn->pos += *buf_len;
+    return 0;
+}
+
+// Every line of the canned input is complete, so nothing is partial
+void mark_client_scanned(statsite_conn_info *conn, int bytes) {
+}
+
+int client_scanned_bytes(statsite_conn_info *conn) {
+    return 0;
+}
+
+void discard_to_terminator(statsite_conn_info *conn, char terminator) {
+    conn->pos = conn->len;
+}
@@ -0,0 +1,18 @@
+/**
+ * A canned input buffer, in place of a connection, for the
+ * benchmarks that drive handle_client_connect directly. It
+ * provides the input functions of networking.h, and every
+ * command is contiguous, so nothing is copied out.
+ */
+#ifndef BENCH_INPUT_H
+#define BENCH_INPUT_H
+#include "networking.h"
+
+struct conn_info {
+    char *buf;
+    int len;
+    int pos;
+    void *state;
+};
+
+#endif
@@ -0,0 +1,550 @@
+/**
+ * Micro-benchmarks for the core data structures and the
+ * parsers. Each benchmark reports the time and the number of
+ * allocations per operation, which are counted by wrapping
+ * malloc when built with BENCH_WRAP_ALLOC.
+ *
+ * The parsers are run through handle_client_connect, on a
+ * canned buffer provided by the minimal input layer of
+ * bench_input.c, in place of the networking stack.
+ *
+ * The flush benchmarks fill an interval synthetically, and time
+ * streaming it in the ASCII and binary formats into a null stream,
+ * apart from destroying it, and report the bytes of each flush.
+ * The interval benchmarks time the key setup of repeated intervals
+ * of the same keys, with and without interning the names.
+ *
+ * Usage: bench_runner [filter]
+ * Only the groups whose name contains the filter are run, these
+ * are hashmap/<keys>, cm_quantile, hll, set, radix, flush_ascii,
+ * flush_binary, flush_ascii_histograms, intervals/copy, intervals/interned, parse_ascii
+ * and parse_binary.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/time.h>
+#include "hashmap.h"
+#include "cm_quantile.h"
+#include "hll.h"
+#include "set.h"
+#include "radix.h"
+#include "metrics.h"
+#include "config.h"
+#include "conn_handler.h"
+#include "bench_input.h"
+
+#ifdef BENCH_WRAP_ALLOC
+static uint64_t ALLOCS;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t num, size_t size);
+void* __real_realloc(void *ptr, size_t size);
+char* __real_strdup(const char *s);
+
+void* __wrap_malloc(size_t size) {
+    __atomic_add_fetch(&ALLOCS, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t num, size_t size) {
+    __atomic_add_fetch(&ALLOCS, 1, __ATOMIC_RELAXED);
+    return __real_calloc(num, size);
+}
+
+void* __wrap_realloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&ALLOCS, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+char* __wrap_strdup(const char *s) {
+    __atomic_add_fetch(&ALLOCS, 1, __ATOMIC_RELAXED);
+    return __real_strdup(s);
+}
+
+#define ALLOC_COUNT() __atomic_load_n(&ALLOCS, __ATOMIC_RELAXED)
+#else
+#define ALLOC_COUNT() 0
+#endif
+
+// The operations each benchmark runs, roughly
+#define BENCH_OPS 2000000
+
+// The keys of the parser benchmarks
+#define PARSER_KEYS 10000
+
+// The interval of the flush benchmarks, and the
+// samples of each of its timers and sets
+#define FLUSH_COUNTERS 100000
+#define FLUSH_TIMERS 20000
+#define FLUSH_SETS 10000
+#define FLUSH_TIMER_SAMPLES 50
+#define FLUSH_SET_MEMBERS 20
+#define FLUSH_ROUNDS 3
+
+// The intervals of the interning benchmarks, each with the same keys
+#define INTERVAL_ROUNDS 10
+
+static char *FILTER;
+static uint64_t CHECKSUM;
+
+/**
+ * Returns the current monotonic time in seconds
+ */
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Times a phase of a benchmark, and counts its allocations
+typedef struct {
+    double start;
+    uint64_t allocs;
+} bench_timer;
+
+static void bench_start(bench_timer *t) {
+    t->allocs = ALLOC_COUNT();
+    t->start = now();
+}
+
+static void bench_report(bench_timer *t, char *name, uint64_t ops) {
+    double elapsed = now() - t->start;
+    uint64_t allocs = ALLOC_COUNT() - t->allocs;
+#ifdef BENCH_WRAP_ALLOC
+    printf("%-28s %10llu ops %9.1f ns/op %9.3f allocs/op\n", name,
+            (unsigned long long)ops, elapsed * 1e9 / ops, (double)allocs / ops);
+#else
+    (void)allocs;
+    printf("%-28s %10llu ops %9.1f ns/op\n", name, (unsigned long long)ops, elapsed * 1e9 / ops);
+#endif
+}
+
+// Checks if a group of benchmarks should run
+static int bench_enabled(char *name) {
+    return !FILTER || strstr(name, FILTER);
+}
+
+// Generates metric-like keys
+static char** make_keys(int num) {
+    char **keys = malloc(num * sizeof(char*));
+    for (int i=0; i < num; i++) {
+        keys[i] = malloc(64);
+        snprintf(keys[i], 64, "servers.host%d.requests.api.endpoint%d", i % 512, i);
+    }
+    return keys;
+}
+
+static void free_keys(char **keys, int num) {
+    for (int i=0; i < num; i++) free(keys[i]);
+    free(keys);
+}
+
+static void bench_hashmap(int num_keys) {
+    char name[64];
+    snprintf(name, sizeof(name), "hashmap/%d", num_keys);
+    if (!bench_enabled(name)) return;
+    char **keys = make_keys(num_keys);
+    int rounds = (num_keys < BENCH_OPS) ? BENCH_OPS / num_keys : 1;
+    bench_timer t;
+
+    // Insert every key, into a fresh map each round
+    snprintf(name, sizeof(name), "hashmap_put/%d", num_keys);
+    hashmap *map = NULL;
+    bench_start(&t);
+    for (int r=0; r < rounds; r++) {
+        if (map) hashmap_destroy(map);
+        hashmap_init(0, &map);
+        for (int i=0; i < num_keys; i++) {
+            hashmap_put(map, keys[i], keys[i]);
+        }
+    }
+    bench_report(&t, name, (uint64_t)num_keys * rounds);
+
+    // Look up every key, in a scattered order
+    snprintf(name, sizeof(name), "hashmap_get/%d", num_keys);
+    void *value;
+    bench_start(&t);
+    for (int r=0; r < rounds; r++) {
+        for (int i=0; i < num_keys; i++) {
+            hashmap_get(map, keys[(i * 7919ULL) % num_keys], &value);
+            CHECKSUM += (uintptr_t)value;
+        }
+    }
+    bench_report(&t, name, (uint64_t)num_keys * rounds);
+
+    hashmap_destroy(map);
+    free_keys(keys, num_keys);
+}
+
+static void bench_cm_quantile() {
+    if (!bench_enabled("cm_quantile")) return;
+    double quantiles[] = {0.5, 0.9, 0.95, 0.99};
+    cm_quantile cm;
+    init_cm_quantile(0.01, quantiles, 4, &cm);
+    bench_timer t;
+
+    // Samples spread over a few orders of magnitude
+    uint64_t x = 88172645463325252ULL;
+    bench_start(&t);
+    for (int i=0; i < BENCH_OPS; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        cm_add_sample(&cm, (x % 100000) / 10.0);
+    }
+    bench_report(&t, "cm_add_sample", BENCH_OPS);
+
+    int queries = BENCH_OPS / 100;
+    bench_start(&t);
+    for (int i=0; i < queries; i++) {
+        CHECKSUM += cm_query(&cm, quantiles[i % 4]);
+    }
+    bench_report(&t, "cm_query", queries);
+    destroy_cm_quantile(&cm);
+}
+
+static void bench_hll() {
+    if (!bench_enabled("hll")) return;
+    hll_t h;
+    hll_init(14, &h);
+    bench_timer t;
+
+    bench_start(&t);
+    for (uint64_t i=0; i < BENCH_OPS; i++) {
+        hll_add_hash(&h, i * 0x9E3779B97F4A7C15ULL);
+    }
+    bench_report(&t, "hll_add_hash", BENCH_OPS);
+
+    int queries = BENCH_OPS / 1000;
+    bench_start(&t);
+    for (int i=0; i < queries; i++) {
+        CHECKSUM += hll_size(&h);
+    }
+    bench_report(&t, "hll_size", queries);
+    hll_destroy(&h);
+}
+
+static void bench_set() {
+    if (!bench_enabled("set")) return;
+    int num_keys = BENCH_OPS / 2;
+    char **keys = make_keys(num_keys);
+    set_t s;
+    set_init(14, &s);
+    bench_timer t;
+
+    // Each key twice, past the exact limit and into the HLL
+    bench_start(&t);
+    for (int r=0; r < 2; r++) {
+        for (int i=0; i < num_keys; i++) {
+            set_add(&s, keys[i]);
+        }
+    }
+    bench_report(&t, "set_add", (uint64_t)num_keys * 2);
+    CHECKSUM += set_size(&s);
+    set_destroy(&s);
+    free_keys(keys, num_keys);
+}
+
+static void bench_radix() {
+    if (!bench_enabled("radix")) return;
+    radix_tree tree;
+    radix_init(&tree);
+
+    // Prefixes like the histogram and timer sections
+    char prefix[64];
+    void *value;
+    for (int i=0; i < 1000; i++) {
+        snprintf(prefix, sizeof(prefix), "servers.host%d.", i);
+        value = (void*)(uintptr_t)(i + 1);
+        radix_insert(&tree, prefix, &value);
+    }
+
+    int num_keys = 100000;
+    char **keys = make_keys(num_keys);
+    bench_timer t;
+    bench_start(&t);
+    for (int r=0; r < BENCH_OPS / num_keys; r++) {
+        for (int i=0; i < num_keys; i++) {
+            CHECKSUM += radix_longest_prefix(&tree, keys[i], &value);
+        }
+    }
+    bench_report(&t, "radix_longest_prefix", (uint64_t)num_keys * (BENCH_OPS / num_keys));
+    radix_destroy(&tree);
+    free_keys(keys, num_keys);
+}
+
+// Discards the flushed output, counting its bytes
+static ssize_t null_write(void *cookie, const char *buf, size_t len) {
+    *(uint64_t*)cookie += len;
+    return len;
+}
+
+// Fills an interval with the counters, timers and sets of the flush benchmarks
+static void fill_interval(metrics *m, char **keys) {
+    char member[32];
+    for (int i=0; i < FLUSH_COUNTERS; i++) {
+        metrics_add_sample(m, COUNTER, keys[i], i % 100);
+    }
+    for (int i=0; i < FLUSH_TIMERS; i++) {
+        for (int j=0; j < FLUSH_TIMER_SAMPLES; j++) {
+            metrics_add_sample(m, TIMER, keys[i], (i + j * 37) % 1000);
+        }
+    }
+    for (int i=0; i < FLUSH_SETS; i++) {
+        for (int j=0; j < FLUSH_SET_MEMBERS; j++) {
+            snprintf(member, sizeof(member), "user%d", (i + j) % 1000);
+            metrics_set_update(m, keys[i], member);
+        }
+    }
+}
+
+/**
+ * Times flushing a fresh interval in an output format each round,
+ * with metrics_iter and the formatter, and then its destruction.
+ * The times are per metric.
+ */
+static void bench_flush(char *name, statsite_config *config) {
+    if (!bench_enabled(name)) return;
+    char **keys = make_keys(FLUSH_COUNTERS);
+    stream_callback cb = output_formatter(config);
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    uint64_t bytes = 0;
+    cookie_io_functions_t null_io = {NULL, null_write, NULL, NULL};
+    FILE *null = fopencookie(&bytes, "w", null_io);
+
+    double flush_time = 0, destroy_time = 0;
+    uint64_t flush_allocs = 0, destroy_allocs = 0;
+    uint64_t num_metrics = FLUSH_COUNTERS + FLUSH_TIMERS + FLUSH_SETS;
+    bench_timer t;
+    for (int r=0; r < FLUSH_ROUNDS; r++) {
+        metrics *m = malloc(sizeof(metrics));
+        init_metrics_defaults(m);
+        m->histograms = config->histograms;
+        fill_interval(m, keys);
+
+        bench_start(&t);
+        if (stream_to_handle(null, m, &tv, cb) || fflush(null)) {
+            fprintf(stderr, "%s: failed to stream the interval\n", name);
+            exit(1);
+        }
+        flush_time += now() - t.start;
+        flush_allocs += ALLOC_COUNT() - t.allocs;
+
+        bench_start(&t);
+        destroy_metrics(m);
+        free(m);
+        destroy_time += now() - t.start;
+        destroy_allocs += ALLOC_COUNT() - t.allocs;
+    }
+    fclose(null);
+
+    // Report the rounds together
+    char phase[64];
+    t.start = now() - flush_time;
+    t.allocs = ALLOC_COUNT() - flush_allocs;
+    bench_report(&t, name, num_metrics * FLUSH_ROUNDS);
+    t.start = now() - destroy_time;
+    t.allocs = ALLOC_COUNT() - destroy_allocs;
+    snprintf(phase, sizeof(phase), "%s/destroy", name);
+    bench_report(&t, phase, num_metrics * FLUSH_ROUNDS);
+    printf("%-28s %10llu bytes %9.1f ms/flush %7.1f bytes/metric\n", name,
+            (unsigned long long)(bytes / FLUSH_ROUNDS), flush_time * 1e3 / FLUSH_ROUNDS,
+            (double)bytes / FLUSH_ROUNDS / num_metrics);
+    free_keys(keys, FLUSH_COUNTERS);
+}
+
+/**
+ * Times the key setup of consecutive intervals of the same keys,
+ * on one metrics object that is cleared between them, copying the
+ * names into the arena each interval or interning them once.
+ * The times are per key of an interval, including the clear.
+ */
+static void bench_intervals(char *name, uint32_t max_idle) {
+    if (!bench_enabled(name)) return;
+    char **keys = make_keys(FLUSH_COUNTERS);
+    metrics m;
+    init_metrics_defaults(&m);
+    metrics_set_interning(&m, max_idle);
+
+    // The first interval copies the names either way
+    for (int i=0; i < FLUSH_COUNTERS; i++) {
+        metrics_add_sample(&m, COUNTER, keys[i], 1);
+        metrics_add_sample(&m, TIMER, keys[i % FLUSH_TIMERS], 1);
+    }
+    metrics_clear(&m);
+
+    bench_timer t;
+    bench_start(&t);
+    for (int r=0; r < INTERVAL_ROUNDS; r++) {
+        for (int i=0; i < FLUSH_COUNTERS; i++) {
+            metrics_add_sample(&m, COUNTER, keys[i], 1);
+            metrics_add_sample(&m, TIMER, keys[i % FLUSH_TIMERS], 1);
+        }
+        metrics_clear(&m);
+    }
+    bench_report(&t, name, (uint64_t)FLUSH_COUNTERS * INTERVAL_ROUNDS);
+    destroy_metrics(&m);
+    free_keys(keys, FLUSH_COUNTERS);
+}
+
+// Appends to a growing buffer
+static void append(char **buf, int *len, int *size, const void *data, int data_len) {
+    if (*len + data_len > *size) {
+        *size = (*size + data_len) * 2;
+        *buf = realloc(*buf, *size);
+    }
+    memcpy(*buf + *len, data, data_len);
+    *len += data_len;
+}
+
+/**
+ * Parses the canned buffer repeatedly. The ASCII parser
+ * writes into the buffer, so each round gets a fresh copy.
+ */
+static void bench_parser(char *name, statsite_config *config, char *canned, int len, uint64_t cmds) {
+    struct conn_info conn = {malloc(len), len, 0, NULL};
+    statsite_conn_handler handle = {config, &conn, 0};
+    int rounds = BENCH_OPS / cmds + 1;
+    double elapsed = 0;
+    uint64_t allocs = 0;
+    bench_timer t;
+    for (int r=0; r < rounds; r++) {
+        memcpy(conn.buf, canned, len);
+        conn.pos = 0;
+        bench_start(&t);
+        if (handle_client_connect(&handle) || conn.pos != len) {
+            fprintf(stderr, "%s: failed to parse the canned input\n", name);
+            exit(1);
+        }
+        elapsed += now() - t.start;
+        allocs += ALLOC_COUNT() - t.allocs;
+    }
+
+    // Report the rounds together
+    t.start = now() - elapsed;
+    t.allocs = ALLOC_COUNT() - allocs;
+    bench_report(&t, name, cmds * rounds);
+    if (conn.state) free_client_state(conn.state);
+    free(conn.buf);
+}
+
+static void bench_parsers(statsite_config *config) {
+    char **keys = make_keys(PARSER_KEYS);
+    char *buf = NULL, line[128];
+    int len = 0, size = 0, cmds = 0;
+
+    // A mix of the ASCII types, mostly counters and timers
+    if (bench_enabled("parse_ascii")) {
+        for (int i=0; i < PARSER_KEYS * 4; i++) {
+            char *key = keys[i % PARSER_KEYS];
+            int n;
+            switch (i % 8) {
+                case 0: case 1: case 2:
+                    n = snprintf(line, sizeof(line), "%s:%d|c\n", key, i % 10);
+                    break;
+                case 3:
+                    n = snprintf(line, sizeof(line), "%s:1|c|@0.1\n", key);
+                    break;
+                case 4: case 5:
+                    n = snprintf(line, sizeof(line), "%s:%d.%d|ms\n", key, i % 1000, i % 10);
+                    break;
+                case 6:
+                    n = snprintf(line, sizeof(line), "%s:%d|g\n", key, i);
+                    break;
+                default:
+                    n = snprintf(line, sizeof(line), "%s:user%d|s\n", key, i % 97);
+                    break;
+            }
+            append(&buf, &len, &size, line, n);
+            cmds++;
+        }
+        bench_parser("parse_ascii", config, buf, len, cmds);
+    }
+
+    // Single value frames, and multi-value timer frames
+    len = cmds = 0;
+    if (bench_enabled("parse_binary")) {
+        for (int i=0; i < PARSER_KEYS * 4; i++) {
+            char *key = keys[i % PARSER_KEYS];
+            uint16_t key_len = strlen(key) + 1;
+            double val = i % 1000;
+            if (i % 4 == 3) {
+                unsigned char header[6] = {0xaa, 0x83};
+                uint16_t num = 8;
+                double vals[8];
+                for (int j=0; j < 8; j++) vals[j] = val + j;
+                memcpy(header + 2, &key_len, 2);
+                memcpy(header + 4, &num, 2);
+                append(&buf, &len, &size, header, sizeof(header));
+                append(&buf, &len, &size, vals, sizeof(vals));
+                cmds += num;
+            } else {
+                unsigned char header[12] = {0xaa, (i % 4 == 2) ? 0x3 : 0x2};
+                memcpy(header + 2, &key_len, 2);
+                memcpy(header + 4, &val, 8);
+                append(&buf, &len, &size, header, sizeof(header));
+                cmds++;
+            }
+            append(&buf, &len, &size, key, key_len);
+        }
+        bench_parser("parse_binary", config, buf, len, cmds);
+    }
+    free(buf);
+    free_keys(keys, PARSER_KEYS);
+}
+
+int main(int argc, char **argv) {
+    FILTER = (argc > 1) ? argv[1] : NULL;
+    setlogmask(LOG_UPTO(LOG_WARNING));
+
+    int cardinalities[] = {1000, 100000, 1000000};
+    for (int i=0; i < 3; i++) {
+        bench_hashmap(cardinalities[i]);
+    }
+    bench_cm_quantile();
+    bench_hll();
+    bench_set();
+    bench_radix();
+
+    // The flushes of an interval, without a sink
+    statsite_config output = {0};
+    bench_flush("flush_ascii", &output);
+    output.binary_stream = true;
+    bench_flush("flush_binary", &output);
+
+    // The same interval with a histogram of 22 bins for every timer
+    histogram_config hist = {"servers.", 0, 1000, 50, 0, NULL, 15};
+    statsite_config hist_output = {0};
+    hist_output.hist_configs = &hist;
+    if (bench_enabled("flush_ascii_histograms") &&
+            (sane_histograms(&hist) || build_prefix_tree(&hist_output))) {
+        fprintf(stderr, "Failed to setup the histograms\n");
+        return 1;
+    }
+    bench_flush("flush_ascii_histograms", &hist_output);
+
+    // Consecutive intervals of the same keys
+    bench_intervals("intervals/copy", 0);
+    bench_intervals("intervals/interned", 6);
+
+    // The parsers update the metrics of the default configuration
+    if (bench_enabled("parse_")) {
+        statsite_config *config = calloc(1, sizeof(statsite_config));
+        if (config_from_filename(NULL, config) || validate_config(config) || build_prefix_tree(config)) {
+            fprintf(stderr, "Failed to setup the default configuration\n");
+            return 1;
+        }
+        init_conn_handler(config);
+        bench_parsers(config);
+    }
+
+    // Print the checksum so the work is not optimized away
+    printf("checksum %llu\n", (unsigned long long)CHECKSUM);
+    return 0;
+}
@@ -0,0 +1,506 @@
+/**
+ * A load generator for statsite. Each thread sends a mix of
+ * metric types over its own socket, using the ASCII protocol over
+ * UDP or TCP, or the binary protocol over TCP. The keys are drawn
+ * uniformly, or with a Zipfian popularity, and a total target rate
+ * can be set.
+ *
+ * The samples sent are compared with the samples.* counters of
+ * statsite's internal_stats, read from its stream_cmd output, to
+ * report what was lost. The output must use the ASCII format.
+ *
+ * Usage: statsite-bench [options], see usage() below.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// The metric types that can be mixed
+typedef enum {
+    TYPE_COUNTER,
+    TYPE_TIMER,
+    TYPE_GAUGE,
+    TYPE_SET,
+    TYPE_KV,
+    NUM_TYPES
+} bench_type;
+
+static const char *TYPE_NAMES[NUM_TYPES] = {"c", "ms", "g", "s", "kv"};
+
+// The internal stats counting the samples received of each type
+static const char *STAT_NAMES[NUM_TYPES] = {
+    "statsite.samples.counters",
+    "statsite.samples.timers",
+    "statsite.samples.gauges",
+    "statsite.samples.sets",
+    "statsite.samples.kv",
+};
+
+// The binary protocol
+#define BIN_MAGIC 0xaa
+#define BIN_MULTI 0x80
+static const unsigned char BIN_TYPES[NUM_TYPES] = {0x2, 0x3, 0x5, 0x4, 0x1};
+
+// The largest key and record generated
+#define MAX_KEY 64
+#define MAX_RECORD (16 + 8 * 1024 + 2 * MAX_KEY)
+
+typedef enum {
+    MODE_UDP,
+    MODE_TCP,
+    MODE_BINARY
+} bench_mode;
+
+// The options of the run
+typedef struct {
+    char *host;
+    char *port;
+    bench_mode mode;
+    int threads;
+    int keys;
+    double zipf;
+    int weights[NUM_TYPES];
+    int values;         // Values per binary timer frame
+    double rate;        // Samples per second over all threads, 0 for no limit
+    double duration;
+    int batch;          // Bytes per datagram or write
+    char *stats_file;
+    double wait;
+} bench_options;
+
+// The state of each sender thread
+typedef struct {
+    pthread_t thread;
+    int id;
+    int fd;
+    uint64_t rng;
+    uint64_t sent[NUM_TYPES];
+    uint64_t errors;    // Datagrams or writes that failed
+} bench_thread;
+
+static bench_options OPTS;
+static char **KEYS;
+static double *ZIPF_CDF;
+static int TOTAL_WEIGHT;
+
+/**
+ * Returns the current monotonic time in seconds
+ */
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A xorshift generator per thread
+static inline uint64_t next_rand(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// Draws a key, uniformly or from the Zipfian popularity
+static int next_key(bench_thread *t) {
+    uint64_t r = next_rand(&t->rng);
+    if (!ZIPF_CDF) return r % OPTS.keys;
+
+    double u = (r >> 11) * (1.0 / 9007199254740992.0);
+    int low = 0, high = OPTS.keys - 1;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (ZIPF_CDF[mid] < u)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+// Draws a type from the mix
+static bench_type next_type(bench_thread *t) {
+    int r = next_rand(&t->rng) % TOTAL_WEIGHT;
+    for (int i=0; i < NUM_TYPES; i++) {
+        if (r < OPTS.weights[i]) return i;
+        r -= OPTS.weights[i];
+    }
+    return TYPE_COUNTER;
+}
+
+// Writes an unsigned integer, returning the bytes written
+static int write_uint(char *buf, uint64_t val) {
+    char tmp[20];
+    int len = 0;
+    do {
+        tmp[len++] = '0' + val % 10;
+        val /= 10;
+    } while (val);
+    for (int i=0; i < len; i++) buf[i] = tmp[len - 1 - i];
+    return len;
+}
+
+/**
+ * Formats an ASCII line of a type for a key
+ * @return The bytes written.
+ */
+static int format_ascii(bench_thread *t, char *buf, bench_type type, char *key) {
+    int len = strlen(key);
+    memcpy(buf, key, len);
+    buf[len++] = ':';
+    uint64_t r = next_rand(&t->rng);
+    if (type == TYPE_SET) buf[len++] = 'u';
+    len += write_uint(buf + len, (type == TYPE_COUNTER) ? 1 : r % 1000);
+    buf[len++] = '|';
+    int type_len = strlen(TYPE_NAMES[type]);
+    memcpy(buf + len, TYPE_NAMES[type], type_len);
+    len += type_len;
+    buf[len++] = '\n';
+    return len;
+}
+
+/**
+ * Formats a binary frame of a type for a key. Timers
+ * carry several values when OPTS.values is above 1.
+ * @return The bytes written.
+ */
+static int format_binary(bench_thread *t, char *buf, bench_type type, char *key, int *samples) {
+    uint16_t key_len = strlen(key) + 1, num;
+    uint64_t r = next_rand(&t->rng);
+    double val = (type == TYPE_COUNTER) ? 1 : r % 1000;
+    int len;
+    buf[0] = BIN_MAGIC;
+    buf[1] = BIN_TYPES[type];
+    memcpy(buf + 2, &key_len, 2);
+    *samples = 1;
+
+    if (type == TYPE_SET) {
+        char member[24] = "u";
+        uint16_t member_len = write_uint(member + 1, r % 1000) + 2;
+        memcpy(buf + 4, &member_len, 2);
+        memcpy(buf + 6, key, key_len);
+        memcpy(buf + 6 + key_len, member, member_len);
+        return 6 + key_len + member_len;
+    }
+
+    if (type == TYPE_TIMER && OPTS.values > 1) {
+        num = OPTS.values;
+        buf[1] |= BIN_MULTI;
+        memcpy(buf + 4, &num, 2);
+        len = 6;
+        for (int i=0; i < num; i++) {
+            val = next_rand(&t->rng) % 1000;
+            memcpy(buf + len, &val, 8);
+            len += 8;
+        }
+        memcpy(buf + len, key, key_len);
+        *samples = num;
+        return len + key_len;
+    }
+
+    memcpy(buf + 4, &val, 8);
+    memcpy(buf + 12, key, key_len);
+    return 12 + key_len;
+}
+
+// Connects a socket of the mode to the target
+static int connect_target() {
+    struct addrinfo hints, *addrs, *addr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = (OPTS.mode == MODE_UDP) ? SOCK_DGRAM : SOCK_STREAM;
+    int res = getaddrinfo(OPTS.host, OPTS.port, &hints, &addrs);
+    if (res) {
+        fprintf(stderr, "Failed to resolve %s: %s\n", OPTS.host, gai_strerror(res));
+        return -1;
+    }
+
+    int fd = -1;
+    for (addr = addrs; addr && fd < 0; addr = addr->ai_next) {
+        fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (fd >= 0 && connect(fd, addr->ai_addr, addr->ai_addrlen)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+    if (fd < 0) fprintf(stderr, "Failed to connect to %s:%s\n", OPTS.host, OPTS.port);
+    return fd;
+}
+
+// Sends a batch, all of it for streams
+static int send_batch(bench_thread *t, char *buf, int len) {
+    int sent = 0;
+    while (sent < len) {
+        ssize_t res = send(t->fd, buf + sent, len - sent, MSG_NOSIGNAL);
+        if (res < 0 && errno == EINTR) continue;
+        if (res < 0) return -1;
+        if (OPTS.mode == MODE_UDP) return 0;
+        sent += res;
+    }
+    return 0;
+}
+
+/**
+ * Sends batches until the duration is up, pacing them
+ * to the share of the target rate of this thread.
+ */
+static void* sender_main(void *arg) {
+    bench_thread *t = arg;
+    char *buf = malloc(OPTS.batch + MAX_RECORD);
+    double rate = OPTS.rate / OPTS.threads;
+    double start = now(), end = start + OPTS.duration;
+    uint64_t total = 0, batch_sent[NUM_TYPES];
+    int samples;
+
+    while (1) {
+        // Fill a batch with whole records
+        int len = 0;
+        memset(batch_sent, 0, sizeof(batch_sent));
+        while (len < OPTS.batch) {
+            bench_type type = next_type(t);
+            char *key = KEYS[next_key(t)];
+            int rec_len;
+            if (OPTS.mode == MODE_BINARY) {
+                rec_len = format_binary(t, buf + len, type, key, &samples);
+            } else {
+                rec_len = format_ascii(t, buf + len, type, key);
+                samples = 1;
+            }
+
+            // Datagrams never exceed the batch size
+            if (OPTS.mode == MODE_UDP && len && len + rec_len > OPTS.batch) break;
+            len += rec_len;
+            batch_sent[type] += samples;
+        }
+
+        if (send_batch(t, buf, len)) {
+            t->errors++;
+            if (OPTS.mode != MODE_UDP) {
+                fprintf(stderr, "Thread %d failed to send: %s\n", t->id, strerror(errno));
+                break;
+            }
+        } else {
+            for (int i=0; i < NUM_TYPES; i++) {
+                t->sent[i] += batch_sent[i];
+                total += batch_sent[i];
+            }
+        }
+
+        // Stop at the end, or wait until the rate allows more
+        double current = now();
+        if (current >= end) break;
+        if (rate > 0) {
+            double ahead = total / rate - (current - start);
+            if (ahead > 0) {
+                struct timespec ts = {(time_t)ahead, (long)((ahead - (time_t)ahead) * 1e9)};
+                nanosleep(&ts, NULL);
+            }
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Sums the samples.* counters that statsite flushed to the
+ * stats file past an offset, which are the samples it received.
+ * @return 0 on success.
+ */
+static int read_received(long offset, uint64_t *received) {
+    FILE *f = fopen(OPTS.stats_file, "r");
+    if (!f) {
+        fprintf(stderr, "Failed to open %s: %s\n", OPTS.stats_file, strerror(errno));
+        return -1;
+    }
+    fseek(f, offset, SEEK_SET);
+
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        char *sep = strchr(line, '|');
+        if (!sep) continue;
+        *sep = '\0';
+        for (int i=0; i < NUM_TYPES; i++) {
+            if (!strcmp(line, STAT_NAMES[i])) received[i] += strtod(sep + 1, NULL);
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+// Returns the size of the stats file, which may not exist yet
+static long stats_offset() {
+    FILE *f = fopen(OPTS.stats_file, "r");
+    if (!f) return 0;
+    fseek(f, 0, SEEK_END);
+    long offset = ftell(f);
+    fclose(f);
+    return offset;
+}
+
+/**
+ * Parses a type mix of the form c:60,ms:30
+ * @return 0 on success.
+ */
+static int parse_mix(char *mix) {
+    memset(OPTS.weights, 0, sizeof(OPTS.weights));
+    char *list = strdup(mix), *save = NULL, *item;
+    int res = 0;
+    for (item = strtok_r(list, ",", &save); item && !res; item = strtok_r(NULL, ",", &save)) {
+        char *sep = strchr(item, ':');
+        res = -1;
+        if (!sep) break;
+        *sep = '\0';
+        for (int i=0; i < NUM_TYPES; i++) {
+            if (!strcmp(item, TYPE_NAMES[i])) {
+                OPTS.weights[i] = atoi(sep + 1);
+                res = (OPTS.weights[i] < 0) ? -1 : 0;
+            }
+        }
+    }
+    free(list);
+
+    TOTAL_WEIGHT = 0;
+    for (int i=0; i < NUM_TYPES; i++) TOTAL_WEIGHT += OPTS.weights[i];
+    return (res || !TOTAL_WEIGHT) ? -1 : 0;
+}
+
+static void usage(char *name) {
+    fprintf(stderr, "Usage: %s [options]\n\
+  -H host     Host to send to, defaults to 127.0.0.1\n\
+  -p port     Port to send to, defaults to 8125\n\
+  -m mode     udp, tcp, or binary over TCP, defaults to udp\n\
+  -t threads  Sender threads, defaults to 4\n\
+  -k keys     Number of distinct keys, defaults to 10000\n\
+  -z s        Zipf exponent of the key popularity, 0 for uniform, the default\n\
+  -x mix      Weights of the types c, ms, g, s and kv, defaults to c:60,ms:30,g:5,s:5\n\
+  -v values   Values per binary timer frame, sent as multi-value frames above 1\n\
+  -r rate     Target samples per second over all threads, 0 for no limit, the default\n\
+  -d secs     Duration of the run, defaults to 10\n\
+  -b bytes    Bytes per datagram or write, defaults to 1400 for UDP and 65536 for TCP\n\
+  -s file     The stream_cmd output of statsite with internal_stats, to report loss\n\
+  -w secs     Time to wait for the last flush when using -s, defaults to 12\n", name);
+}
+
+int main(int argc, char **argv) {
+    OPTS.host = "127.0.0.1";
+    OPTS.port = "8125";
+    OPTS.mode = MODE_UDP;
+    OPTS.threads = 4;
+    OPTS.keys = 10000;
+    OPTS.values = 1;
+    OPTS.duration = 10;
+    OPTS.wait = 12;
+    parse_mix("c:60,ms:30,g:5,s:5");
+
+    int c;
+    while ((c = getopt(argc, argv, "H:p:m:t:k:z:x:v:r:d:b:s:w:h")) != -1) {
+        switch (c) {
+            case 'H': OPTS.host = optarg; break;
+            case 'p': OPTS.port = optarg; break;
+            case 'm':
+                if (!strcmp(optarg, "udp")) OPTS.mode = MODE_UDP;
+                else if (!strcmp(optarg, "tcp")) OPTS.mode = MODE_TCP;
+                else if (!strcmp(optarg, "binary")) OPTS.mode = MODE_BINARY;
+                else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 't': OPTS.threads = atoi(optarg); break;
+            case 'k': OPTS.keys = atoi(optarg); break;
+            case 'z': OPTS.zipf = atof(optarg); break;
+            case 'x':
+                if (parse_mix(optarg)) {
+                    fprintf(stderr, "Invalid type mix: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'v': OPTS.values = atoi(optarg); break;
+            case 'r': OPTS.rate = atof(optarg); break;
+            case 'd': OPTS.duration = atof(optarg); break;
+            case 'b': OPTS.batch = atoi(optarg); break;
+            case 's': OPTS.stats_file = optarg; break;
+            case 'w': OPTS.wait = atof(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (!OPTS.batch) OPTS.batch = (OPTS.mode == MODE_UDP) ? 1400 : 65536;
+    if (OPTS.threads < 1 || OPTS.keys < 1 || OPTS.values < 1 || OPTS.values > 1024 ||
+            OPTS.duration <= 0 || OPTS.batch < 64 || OPTS.zipf < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Generate the keys, and the popularity of each
+    KEYS = malloc(OPTS.keys * sizeof(char*));
+    for (int i=0; i < OPTS.keys; i++) {
+        KEYS[i] = malloc(MAX_KEY);
+        snprintf(KEYS[i], MAX_KEY, "bench.host%d.key%d", i % 64, i);
+    }
+    if (OPTS.zipf > 0) {
+        ZIPF_CDF = malloc(OPTS.keys * sizeof(double));
+        double sum = 0;
+        for (int i=0; i < OPTS.keys; i++) {
+            sum += 1.0 / pow(i + 1, OPTS.zipf);
+            ZIPF_CDF[i] = sum;
+        }
+        for (int i=0; i < OPTS.keys; i++) ZIPF_CDF[i] /= sum;
+    }
+
+    // Connect every thread before any starts sending
+    bench_thread *threads = calloc(OPTS.threads, sizeof(bench_thread));
+    for (int i=0; i < OPTS.threads; i++) {
+        threads[i].id = i;
+        threads[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        threads[i].fd = connect_target();
+        if (threads[i].fd < 0) return 1;
+    }
+    long offset = (OPTS.stats_file) ? stats_offset() : 0;
+
+    double start = now();
+    for (int i=0; i < OPTS.threads; i++) {
+        pthread_create(&threads[i].thread, NULL, sender_main, threads + i);
+    }
+    uint64_t sent[NUM_TYPES] = {0}, total = 0, errors = 0;
+    for (int i=0; i < OPTS.threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        close(threads[i].fd);
+        for (int j=0; j < NUM_TYPES; j++) sent[j] += threads[i].sent[j];
+        errors += threads[i].errors;
+    }
+    double elapsed = now() - start;
+    for (int i=0; i < NUM_TYPES; i++) total += sent[i];
+
+    printf("sent %llu samples in %.2f sec, %.0f samples/sec, %llu send errors\n",
+            (unsigned long long)total, elapsed, total / elapsed, (unsigned long long)errors);
+
+    // Compare with what statsite counted once it has flushed
+    if (OPTS.stats_file) {
+        sleep((unsigned)ceil(OPTS.wait));
+        uint64_t received[NUM_TYPES] = {0}, total_received = 0;
+        if (read_received(offset, received)) return 1;
+        printf("%-6s %12s %12s %8s\n", "type", "sent", "received", "loss");
+        for (int i=0; i < NUM_TYPES; i++) {
+            if (!sent[i] && !received[i]) continue;
+            total_received += received[i];
+            printf("%-6s %12llu %12llu %7.3f%%\n", TYPE_NAMES[i], (unsigned long long)sent[i],
+                    (unsigned long long)received[i], (sent[i]) ? 100.0 * ((double)sent[i] - received[i]) / sent[i] : 0);
+        }
+        printf("%-6s %12llu %12llu %7.3f%%\n", "total", (unsigned long long)total,
+                (unsigned long long)total_received, (total) ? 100.0 * ((double)total - total_received) / total : 0);
+    }
+    return 0;
+}
@@ -0,0 +1,345 @@
+/**
+ * Replays captured UDP traffic into the parsers, to benchmark them
+ * on real key lengths, type mixes and packing of lines per packet.
+ * The payloads are read from a pcap file, or from a raw capture of
+ * length prefixed payloads, and each one is handed to
+ * handle_client_connect the way a UDP datagram is, through the
+ * canned input of bench_input.c instead of a socket.
+ *
+ * The parsers run with the configuration given, so the settings that
+ * change the ingest path, such as parse_tags, histograms or the ingest
+ * filter, are measured too. The lines per second and, on x86, the
+ * cycles per line are reported for all the rounds.
+ *
+ * Usage: statsite-replay [options] capture, see usage() below.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <syslog.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+#include "config.h"
+#include "conn_handler.h"
+#include "bench_input.h"
+
+// The pcap magic numbers, for microsecond and nanosecond timestamps
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAPNG_MAGIC 0x0a0d0d0a
+
+// The link types of the captures we can take apart
+#define LINK_NULL 0
+#define LINK_ETHERNET 1
+#define LINK_RAW 101
+#define LINK_RAW_OLD 12
+#define LINK_LINUX_SLL 113
+#define LINK_LINUX_SLL2 276
+
+// The payloads of a capture, each followed by room for a newline
+typedef struct {
+    char *data;         // The payloads, back to back
+    uint64_t len;       // The bytes used in data
+    uint64_t size;      // The bytes allocated for data
+    uint32_t *lens;     // The length of each payload
+    uint64_t num;       // The number of payloads
+    uint64_t num_size;  // The lengths allocated
+    uint64_t lines;     // The newline terminated lines of all the payloads
+} capture;
+
+static void usage() {
+    fprintf(stderr, "usage: statsite-replay [-h] [-f config] [-n rounds] [-p port] [-r] capture\n\
+\n\
+    -f : Reads the configuration of the parsers from this file\n\
+    -n : Replays the capture this many times, 1 by default\n\
+    -p : Only replays the pcap packets sent to this UDP port\n\
+    -r : Reads a raw capture, a 4 byte little endian length before each payload\n\
+\n");
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t cycles() {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Adds a payload to the capture, with a newline appended
+ * if it does not end in one, as the UDP listener does.
+ */
+static void add_payload(capture *c, const unsigned char *payload, uint32_t len) {
+    if (!len) return;
+    if (c->len + len + 1 > c->size) {
+        c->size = (c->size + len + 1) * 2;
+        c->data = realloc(c->data, c->size);
+    }
+    if (c->num == c->num_size) {
+        c->num_size = (c->num_size) ? c->num_size * 2 : 1024;
+        c->lens = realloc(c->lens, c->num_size * sizeof(uint32_t));
+    }
+    char *dst = c->data + c->len;
+    memcpy(dst, payload, len);
+    if (dst[len - 1] != '\n') dst[len++] = '\n';
+    for (uint32_t i=0; i < len; i++) c->lines += (dst[i] == '\n');
+    c->lens[c->num++] = len;
+    c->len += len;
+}
+
+static uint16_t get_be16(const unsigned char *p) {
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t get_u32(const unsigned char *p, int swapped) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (swapped) ? __builtin_bswap32(v) : v;
+}
+
+/**
+ * Adds the payload of a UDP datagram over IPv4 or IPv6,
+ * skipping fragments and other protocols.
+ */
+static void add_ip_packet(capture *c, const unsigned char *p, uint32_t len, int port) {
+    const unsigned char *udp;
+    uint32_t left;
+    if (len < 1) return;
+    if ((p[0] >> 4) == 4) {
+        uint32_t ihl = (p[0] & 0xf) * 4;
+        if (len < 20 || ihl < 20 || len < ihl || p[9] != 17) return;
+        if (get_be16(p + 6) & 0x3fff) return;
+        udp = p + ihl;
+        left = len - ihl;
+    } else if ((p[0] >> 4) == 6) {
+        if (len < 40 || p[6] != 17) return;
+        udp = p + 40;
+        left = len - 40;
+    } else
+        return;
+
+    if (left < 8) return;
+    if (port && get_be16(udp + 2) != port) return;
+    uint32_t udp_len = get_be16(udp + 4);
+    if (udp_len < 8) return;
+    udp_len -= 8;
+    if (udp_len > left - 8) udp_len = left - 8;
+    add_payload(c, udp + 8, udp_len);
+}
+
+/**
+ * Adds a captured frame, removing its link layer header
+ */
+static void add_frame(capture *c, uint32_t link, const unsigned char *p, uint32_t len, int port) {
+    uint16_t proto;
+    switch (link) {
+        case LINK_ETHERNET:
+            if (len < 14) return;
+            proto = get_be16(p + 12);
+            p += 14;
+            len -= 14;
+            while (proto == 0x8100 || proto == 0x88a8) {
+                if (len < 4) return;
+                proto = get_be16(p + 2);
+                p += 4;
+                len -= 4;
+            }
+            if (proto != 0x0800 && proto != 0x86dd) return;
+            break;
+        case LINK_LINUX_SLL:
+            if (len < 16) return;
+            p += 16;
+            len -= 16;
+            break;
+        case LINK_LINUX_SLL2:
+            if (len < 20) return;
+            p += 20;
+            len -= 20;
+            break;
+        case LINK_NULL:
+            if (len < 4) return;
+            p += 4;
+            len -= 4;
+            break;
+        case LINK_RAW:
+        case LINK_RAW_OLD:
+            break;
+        default:
+            return;
+    }
+    add_ip_packet(c, p, len, port);
+}
+
+/**
+ * Reads the UDP payloads of a pcap file
+ * @return 0 on success.
+ */
+static int read_pcap(const unsigned char *buf, uint64_t len, int port, capture *c) {
+    if (len < 24) {
+        fprintf(stderr, "The capture is too short for a pcap file\n");
+        return -1;
+    }
+    uint32_t magic = get_u32(buf, 0);
+    int swapped;
+    if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NS)
+        swapped = 0;
+    else if (magic == __builtin_bswap32(PCAP_MAGIC) || magic == __builtin_bswap32(PCAP_MAGIC_NS))
+        swapped = 1;
+    else if (magic == PCAPNG_MAGIC) {
+        fprintf(stderr, "pcapng is not supported, convert it with editcap -F pcap\n");
+        return -1;
+    } else {
+        fprintf(stderr, "Not a pcap file, use -r for a raw capture\n");
+        return -1;
+    }
+
+    uint32_t link = get_u32(buf + 20, swapped) & 0xffff;
+    uint64_t pos = 24;
+    while (pos + 16 <= len) {
+        uint32_t incl = get_u32(buf + pos + 8, swapped);
+        pos += 16;
+        if (incl > len - pos) break;
+        add_frame(c, link, buf + pos, incl, port);
+        pos += incl;
+    }
+    return 0;
+}
+
+/**
+ * Reads a raw capture, of payloads each after their
+ * length as a 4 byte little endian integer.
+ * @return 0 on success.
+ */
+static int read_raw(const unsigned char *buf, uint64_t len, capture *c) {
+    uint64_t pos = 0;
+    while (pos + 4 <= len) {
+        uint32_t plen = buf[pos] | (buf[pos+1] << 8) | (buf[pos+2] << 16) | ((uint32_t)buf[pos+3] << 24);
+        pos += 4;
+        if (plen > len - pos) {
+            fprintf(stderr, "The raw capture is truncated\n");
+            return -1;
+        }
+        add_payload(c, buf + pos, plen);
+        pos += plen;
+    }
+    return 0;
+}
+
+// Reads a whole file into memory
+static unsigned char* read_file(const char *path, uint64_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror("Failed to open the capture");
+        return NULL;
+    }
+    unsigned char *buf = NULL;
+    uint64_t size = 0, n;
+    *len = 0;
+    do {
+        if (*len == size) {
+            size = (size) ? size * 2 : 1 << 20;
+            buf = realloc(buf, size);
+        }
+        n = fread(buf + *len, 1, size - *len, f);
+        *len += n;
+    } while (n);
+    fclose(f);
+    return buf;
+}
+
+int main(int argc, char **argv) {
+    char *config_file = NULL;
+    int rounds = 1, port = 0, raw = 0, c;
+    while ((c = getopt(argc, argv, "hf:n:p:r")) != -1) {
+        switch (c) {
+            case 'f': config_file = optarg; break;
+            case 'n': rounds = atoi(optarg); break;
+            case 'p': port = atoi(optarg); break;
+            case 'r': raw = 1; break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (optind != argc - 1 || rounds < 1) {
+        usage();
+        return 1;
+    }
+    setlogmask(LOG_UPTO(LOG_WARNING));
+
+    // Take the payloads out of the capture
+    uint64_t file_len;
+    unsigned char *file = read_file(argv[optind], &file_len);
+    if (!file) return 1;
+    capture cap = {0};
+    int res = (raw) ? read_raw(file, file_len, &cap) : read_pcap(file, file_len, port, &cap);
+    free(file);
+    if (res) return 1;
+    if (!cap.num) {
+        fprintf(stderr, "The capture has no UDP payloads\n");
+        return 1;
+    }
+
+    // The parsers update the metrics of the configuration
+    statsite_config *config = calloc(1, sizeof(statsite_config));
+    if (config_from_filename(config_file, config) || validate_config(config) || build_prefix_tree(config)) {
+        fprintf(stderr, "Failed to setup the configuration\n");
+        return 1;
+    }
+    config->proxy_upstreams = NULL;
+    config->snapshot_file = NULL;
+    config->ingest_pipeline = false;
+    init_conn_handler(config);
+
+    // The parser writes into the payloads, so each round gets a fresh copy
+    char *copy = malloc(cap.len);
+    struct conn_info conn = {NULL, 0, 0, NULL};
+    statsite_conn_handler handle = {config, &conn, 0};
+    double elapsed = 0;
+    uint64_t ticks = 0;
+    for (int r=0; r < rounds; r++) {
+        memcpy(copy, cap.data, cap.len);
+        double start = now();
+        uint64_t start_ticks = cycles();
+        char *p = copy;
+        for (uint64_t i=0; i < cap.num; i++) {
+            conn.buf = p;
+            conn.len = cap.lens[i];
+            conn.pos = 0;
+            handle_client_connect(&handle);
+            p += cap.lens[i];
+        }
+        ticks += cycles() - start_ticks;
+        elapsed += now() - start;
+    }
+
+    uint64_t lines = cap.lines * rounds;
+    printf("packets      %llu\n", (unsigned long long)cap.num);
+    printf("lines        %llu\n", (unsigned long long)cap.lines);
+    printf("lines/packet %.2f\n", (double)cap.lines / cap.num);
+    printf("bytes/line   %.1f\n", (double)cap.len / cap.lines);
+    printf("rounds       %d\n", rounds);
+    printf("lines/sec    %.0f\n", lines / elapsed);
+    printf("ns/line      %.1f\n", elapsed * 1e9 / lines);
+#ifdef HAVE_RDTSC
+    printf("cycles/line  %.1f\n", (double)ticks / lines);
+#endif
+
+    if (conn.state) free_client_state(conn.state);
+    free(copy);
+    free(cap.data);
+    free(cap.lens);
+    return 0;
+}
@@ -21,7 +21,12 @@ except ImportError:
 
 BINARY_HEADER = struct.Struct("<BBHd")
 BINARY_SET_HEADER = struct.Struct("<BBHH")
+BINARY_MULTI_HEADER = struct.Struct("<BBHH")
+BIN_MULTI = 0x80
+BIN_ID = 0x40
+BIN_BIND = 7
 BIN_TYPES = {"kv": 1, "c": 2, "ms": 3, "set": 4, "g": 5, "delta": 6}
+BIN_SET_HASH = 9
 
 
 def pytest_funcarg__servers(request):
@@ -105,6 +110,39 @@ def format_set(key, val):
     mesg = "".join([header, key, "\0", val, "\0"])
     return mesg
 
+def format_set_hash(key, hashes):
+    "Formats a binary message adding hashed members to a set"
+    key = str(key)
+    key_len = len(key) + 1
+    if len(hashes) == 1:
+        header = struct.pack("<BBHQ", 170, BIN_SET_HASH, key_len, hashes[0])
+        return header + key + "\0"
+    header = BINARY_MULTI_HEADER.pack(170, BIN_SET_HASH | BIN_MULTI, key_len, len(hashes))
+    body = struct.pack("<%dQ" % len(hashes), *hashes)
+    return "".join([header, body, key, "\0"])
+
+def format_multi(key, type, vals):
+    "Formats a multi-value binary message for statsite"
+    key = str(key)
+    key_len = len(key) + 1
+    type_num = BIN_TYPES[type] | BIN_MULTI
+    header = BINARY_MULTI_HEADER.pack(170, type_num, key_len, len(vals))
+    body = struct.pack("<%dd" % len(vals), *[float(v) for v in vals])
+    mesg = "".join([header, body, key, "\0"])
+    return mesg
+
+def format_bind(key, id):
+    "Formats a binary message binding a key to an ID"
+    key = str(key)
+    key_len = len(key) + 1
+    header = BINARY_SET_HEADER.pack(170, BIN_BIND, key_len, id)
+    return header + key + "\0"
+
+
+def format_id(id, type, val):
+    "Formats a binary message for a bound key"
+    return BINARY_HEADER.pack(170, BIN_TYPES[type] | BIN_ID, id, float(val))
+
 
 def wait_file(path, timeout=5):
     "Waits on a file to be make"
@@ -189,6 +227,38 @@ class TestInteg(object):
         assert "timers.noobs.p95|95.000000" in out
         assert "timers.noobs.p99|99.000000" in out
 
+    def test_multi_meters(self, servers):
+        "Tests adding timers with multi-value frames"
+        server, _, output = servers
+        server.sendall(format_multi("noobs", "ms", range(50)))
+        server.sendall(format_multi("noobs", "ms", range(50, 100)))
+        wait_file(output)
+        out = open(output).read()
+        assert "timers.noobs.sum|4950" in out
+        assert "timers.noobs.lower|0.000000" in out
+        assert "timers.noobs.upper|99.000000" in out
+        assert "timers.noobs.count|100" in out
+
+    def test_multi_counters(self, servers):
+        "Tests adding counters with multi-value frames"
+        server, _, output = servers
+        server.sendall(format_multi("foobar", "c", [100, 200, 300]))
+        wait_file(output)
+        now = time.time()
+        out = open(output).read()
+        assert out in ("counts.foobar|600.000000|%d\n" % now, "counts.foobar|600.000000|%d\n" % (now - 1))
+
+    def test_bound_keys(self, servers):
+        "Tests adding counters using a bound key"
+        server, _, output = servers
+        server.sendall(format_bind("foobar", 12))
+        server.sendall(format_id(12, "c", 100))
+        server.sendall(format_id(12, "c", 200))
+        wait_file(output)
+        now = time.time()
+        out = open(output).read()
+        assert out in ("counts.foobar|300.000000|%d\n" % now, "counts.foobar|300.000000|%d\n" % (now - 1))
+
     def test_sets(self, servers):
         "Tests adding kv pairs"
         server, _, output = servers
@@ -199,6 +269,44 @@ class TestInteg(object):
         out = open(output).read()
         assert "sets.zip|3|" in out
 
+    def test_set_hashes(self, servers):
+        "Tests adding hashed members to sets"
+        server, _, output = servers
+        server.sendall(format_set_hash("zip", [0x9e3779b97f4a7c15]))
+        server.sendall(format_set_hash("zip", [0x9e3779b97f4a7c15, 0xbf58476d1ce4e5b9, 0]))
+        wait_file(output)
+        out = open(output).read()
+        assert "sets.zip|3|" in out
+
+    def test_split_frames(self, servers):
+        "Tests frames split across reads"
+        server, _, output = servers
+        frames = [format("foobar", "c", 100), format_multi("foobar", "c", [200, 300]),
+                  format_bind("foobar", 3), format_id(3, "c", 400)]
+        for frame in frames:
+            # Split in the header and in the rest of the frame
+            for part in (frame[:3], frame[3:10], frame[10:]):
+                server.sendall(part)
+                time.sleep(0.02)
+        wait_file(output)
+        now = time.time()
+        out = open(output).read()
+        assert out in ("counts.foobar|1000.000000|%d\n" % now, "counts.foobar|1000.000000|%d\n" % (now - 1))
+
+    def test_wrapped_headers(self, servers):
+        "Tests frames that wrap around the end of the buffer"
+        server, _, output = servers
+        # The chunks end within a frame, so the buffer is never empty
+        # and the frames wrap around its end, 32K, once in a while
+        mesg = format("wrap", "c", 1) * 4000
+        for i in xrange(0, len(mesg), 1000):
+            server.sendall(mesg[i:i+1000])
+            time.sleep(0.002)
+        wait_file(output)
+        now = time.time()
+        out = open(output).read()
+        assert out in ("counts.wrap|4000.000000|%d\n" % now, "counts.wrap|4000.000000|%d\n" % (now - 1))
+
 
 class TestIntegUDP(object):
     def test_kv(self, servers):
@@ -0,0 +1,108 @@
+"""
+A load test of the UDP ingest path. The native load generator,
+statsite-bench, sends a fixed rate across several flush intervals,
+and the samples.* internal stats that statsite flushed are compared
+with what was sent to get the loss. The start of each flush is
+recorded by the stream_cmd, to get the skew of the flushes from
+the flush_interval.
+
+The rate, duration and limits can be set with the environment:
+STATSITE_LOAD_RATE, STATSITE_LOAD_SECS, STATSITE_LOAD_MAX_LOSS (in
+percent) and STATSITE_LOAD_MAX_SKEW (in seconds). The test is skipped
+unless statsite-bench was built, with `make bench`.
+"""
+import os
+import os.path
+import random
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+try:
+    import pytest
+except ImportError:
+    print >> sys.stderr, "Integ tests require pytests!"
+    sys.exit(1)
+
+BENCH = "./statsite-bench"
+RATE = int(os.environ.get("STATSITE_LOAD_RATE", 200000))
+SECS = int(os.environ.get("STATSITE_LOAD_SECS", 5))
+MAX_LOSS = float(os.environ.get("STATSITE_LOAD_MAX_LOSS", 0.5))
+MAX_SKEW = float(os.environ.get("STATSITE_LOAD_MAX_SKEW", 0.25))
+FLUSH_INTERVAL = 1
+
+
+def pytest_funcarg__load_server(request):
+    "Starts a statsite that records the start of each flush"
+    if not os.path.isfile(BENCH):
+        pytest.skip("statsite-bench is not built")
+    tmpdir = tempfile.mkdtemp()
+
+    # Each flush stamps its start before the output
+    output = os.path.join(tmpdir, "output")
+    starts = os.path.join(tmpdir, "starts")
+    cmd = "date +%%s.%%N >> %s; cat >> %s" % (starts, output)
+
+    port = random.randrange(10000, 65000)
+    config_path = os.path.join(tmpdir, "config.cfg")
+    conf = """[statsite]
+flush_interval = %d
+port = %d
+udp_port = %d
+udp_rcvbuf = 8388608
+worker_threads = 2
+internal_stats = true
+stream_cmd = %s
+""" % (FLUSH_INTERVAL, port, port, cmd)
+    open(config_path, "w").write(conf)
+
+    proc = subprocess.Popen(["./statsite", "-f", config_path])
+    time.sleep(0.5)
+    proc.poll()
+    assert proc.returncode is None
+
+    def cleanup():
+        try:
+            proc.kill()
+            proc.wait()
+        except:
+            pass
+    request.addfinalizer(cleanup)
+    return port, output, starts
+
+
+def run_bench(port, output):
+    "Runs the load generator, returning its report"
+    args = [BENCH, "-m", "udp", "-p", str(port), "-t", "2", "-k", "10000",
+            "-r", str(RATE), "-d", str(SECS), "-s", output, "-w", str(FLUSH_INTERVAL * 3)]
+    return subprocess.check_output(args).decode()
+
+
+def flush_skews(starts):
+    "Returns the skew of each flush start from the interval"
+    times = [float(l) for l in open(starts).read().split()]
+    return [abs(b - a - FLUSH_INTERVAL) for a, b in zip(times, times[1:])]
+
+
+class TestLoad(object):
+    def test_udp_loss_and_skew(self, load_server):
+        "Tests the loss and the flush skew at a fixed UDP rate"
+        port, output, starts = load_server
+        report = run_bench(port, output)
+        sys.stdout.write(report)
+
+        # The last line of the report has the totals
+        total = re.search(r"^total\s+(\d+)\s+(\d+)\s+(-?[\d.]+)%", report, re.M)
+        assert total, "No totals in the report"
+        sent, received, loss = int(total.group(1)), int(total.group(2)), float(total.group(3))
+        assert sent > 0
+        assert loss <= MAX_LOSS, "Lost %.3f%% of %d samples" % (loss, sent)
+        assert received <= sent
+
+        # The flushes kept to the interval while under load
+        skews = flush_skews(starts)
+        assert len(skews) >= SECS - 1
+        sys.stdout.write("flushes %d, max skew %.3f sec\n" % (len(skews) + 1, max(skews)))
+        assert max(skews) <= MAX_SKEW, "A flush was %.3f sec off the interval" % max(skews)
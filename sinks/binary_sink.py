@@ -11,6 +11,23 @@ LINE = struct.Struct("<QBBHd")
 COUNTER = struct.Struct("<I")
 PREFIX_SIZE = 20
 
+# Grouped format, with binary_stream_grouped. We have:
+# 8 byte unsigned timestamp
+# 1 byte metric type
+# 2 byte number of values
+# 2 byte number of histogram counts
+# 2 byte key length
+# Followed by the key, the values as 1 byte value type and
+# 8 byte value, and the counts as 8 byte unsigned integers.
+GROUP = struct.Struct("<QBHHH")
+GROUP_VALUE = struct.Struct("<Bd")
+GROUP_COUNTER = struct.Struct("<Q")
+
+# Front coded format, with binary_stream_front_coded. The grouped
+# key length is replaced by the 2 byte length of the prefix shared
+# with the key before, and the 2 byte length of the rest of the key.
+FRONT = struct.Struct("<QBHHHH")
+
 TYPE_MAP = {
     1: "kv",
     2: "counter",
@@ -37,7 +54,65 @@ for x in xrange(1, 100):
     VAL_TYPE_MAP[128 | x] = "P%02d" % x
 
 
+def main_grouped():
+    while True:
+        # Read the prefix
+        prefix = sys.stdin.read(GROUP.size)
+        if not prefix or len(prefix) != GROUP.size:
+            return
+
+        # Unpack the record, a zero key length delimits flushes
+        (ts, type, num_values, num_counts, key_len) = GROUP.unpack(prefix)
+        if key_len == 0:
+            continue
+        type = TYPE_MAP[type]
+        key = sys.stdin.read(key_len)
+        vals = [GROUP_VALUE.unpack(sys.stdin.read(GROUP_VALUE.size)) for x in xrange(num_values)]
+        counts = [GROUP_COUNTER.unpack(sys.stdin.read(GROUP_COUNTER.size))[0] for x in xrange(num_counts)]
+
+        # Print, the counts belong to the histogram values in order
+        counts.reverse()
+        for val_type, val in vals:
+            val_type = VAL_TYPE_MAP[val_type]
+            if val_type.startswith("hist"):
+                print ts, type, val_type, key, val, counts.pop()
+            else:
+                print ts, type, val_type, key, val
+
+
+def main_front_coded():
+    key = ""
+    while True:
+        # Read the prefix
+        prefix = sys.stdin.read(FRONT.size)
+        if not prefix or len(prefix) != FRONT.size:
+            return
+
+        # Unpack the record, a zero suffix length delimits flushes
+        (ts, type, num_values, num_counts, shared_len, suffix_len) = FRONT.unpack(prefix)
+        if suffix_len == 0:
+            key = ""
+            continue
+        type = TYPE_MAP[type]
+        key = key[:shared_len] + sys.stdin.read(suffix_len)
+        vals = [GROUP_VALUE.unpack(sys.stdin.read(GROUP_VALUE.size)) for x in xrange(num_values)]
+        counts = [GROUP_COUNTER.unpack(sys.stdin.read(GROUP_COUNTER.size))[0] for x in xrange(num_counts)]
+
+        counts.reverse()
+        for val_type, val in vals:
+            val_type = VAL_TYPE_MAP[val_type]
+            if val_type.startswith("hist"):
+                print ts, type, val_type, key, val, counts.pop()
+            else:
+                print ts, type, val_type, key, val
+
+
 def main():
+    if "--grouped" in sys.argv:
+        return main_grouped()
+    if "--front-coded" in sys.argv:
+        return main_front_coded()
+
     while True:
         # Read the prefix
         prefix = sys.stdin.read(20)
@@ -0,0 +1,81 @@
+"""
+Reads the blocks of a columnar_stream from stdin, and prints
+each value of each metric. A columnar store can instead load
+each column of a block as a whole array.
+"""
+import array
+import struct
+import sys
+
+# Block format. We have:
+# 8 byte unsigned timestamp
+# 1 byte metric type
+# 2 byte number of columns
+# 4 byte number of metrics
+# 4 byte length of the names
+# Followed by a 1 byte value type and an 8 byte parameter for each
+# column, the NULL terminated names, and then for each column an
+# array of an 8 byte double for each metric.
+BLOCK = struct.Struct("<QBHII")
+COLUMN = struct.Struct("<Bd")
+
+TYPE_MAP = {
+    1: "kv",
+    2: "counter",
+    3: "timer",
+    4: "set",
+    5: "gauge"
+}
+VAL_TYPE_MAP = {
+    0: "kv",
+    1: "sum",
+    2: "sum sq",
+    3: "mean",
+    4: "count",
+    5: "stddev",
+    6: "min",
+    7: "max",
+    8: "hist_min",
+    9: "hist_bin",
+    10: "hist_max",
+}
+for x in range(1, 100):
+    VAL_TYPE_MAP[128 | x] = "P%02d" % x
+
+
+def main():
+    stream = getattr(sys.stdin, "buffer", sys.stdin)
+    while True:
+        header = stream.read(BLOCK.size)
+        if not header or len(header) != BLOCK.size:
+            return
+
+        # A block without metrics delimits flushes
+        (ts, type, num_columns, num_metrics, names_len) = BLOCK.unpack(header)
+        if num_metrics == 0:
+            continue
+        columns = [COLUMN.unpack(stream.read(COLUMN.size)) for x in range(num_columns)]
+        names = stream.read(names_len).split(b"\0")[:num_metrics]
+
+        # Load each column at once
+        values = []
+        for x in range(num_columns):
+            col = array.array("d")
+            data = stream.read(8 * num_metrics)
+            if hasattr(col, "frombytes"):
+                col.frombytes(data)
+            else:
+                col.fromstring(data)
+            values.append(col)
+
+        for i, name in enumerate(names):
+            for (val_type, param), col in zip(columns, values):
+                line = "%d %s %s %s %s" % (ts, TYPE_MAP[type], VAL_TYPE_MAP[val_type],
+                                           name.decode(), repr(col[i]))
+                if val_type >= 8 and val_type <= 10:
+                    line += " %s" % repr(param)
+                sys.stdout.write(line + "\n")
+
+
+if __name__ == "__main__":
+    main()
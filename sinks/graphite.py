@@ -112,9 +112,17 @@ if __name__ == "__main__":
     # Intialize from our arguments
     graphite = GraphiteStore(*sys.argv[1:])
 
-    # Get all the inputs
-    metrics = sys.stdin.read()
+    # Get the inputs. With persistent_sink each flush is followed
+    # by an empty line, otherwise there is a single flush until EOF.
+    metrics = []
+    for line in iter(sys.stdin.readline, ""):
+        line = line.strip()
+        if line:
+            metrics.append(line)
+        else:
+            graphite.flush(metrics)
+            metrics = []
 
     # Flush
-    graphite.flush(metrics.splitlines())
+    graphite.flush(metrics)
     graphite.close()
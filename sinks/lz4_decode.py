@@ -0,0 +1,115 @@
+"""
+Decodes the LZ4 frames written with output_compression = lz4,
+from stdin to stdout. Each frame is written out once it ends, so
+this can be piped into a persistent sink, for example:
+
+    stream_cmd = ssh collector 'python lz4_decode.py | python graphite.py'
+
+The lz4 tool decodes the same frames, with lz4 -dc.
+"""
+import struct
+import sys
+
+MAGIC = 0x184D2204
+UNCOMPRESSED = 0x80000000
+BLOCK_CHECKSUM = 0x10
+CONTENT_SIZE = 0x08
+CONTENT_CHECKSUM = 0x04
+DICT_ID = 0x01
+
+
+def read_exact(stream, n):
+    data = stream.read(n)
+    if len(data) != n:
+        raise ValueError("Truncated frame")
+    return data
+
+
+def decompress_block(block):
+    """
+    Decompresses an LZ4 block, returning a bytearray.
+    """
+    src = bytearray(block)
+    out = bytearray()
+    i, end = 0, len(src)
+    while i < end:
+        token = src[i]
+        i += 1
+
+        # Copy the literals
+        lits = token >> 4
+        if lits == 15:
+            while True:
+                b = src[i]
+                i += 1
+                lits += b
+                if b != 255:
+                    break
+        out += src[i:i + lits]
+        i += lits
+        if i >= end:
+            break
+
+        # Copy the match, which may overlap its output
+        offset = src[i] | (src[i + 1] << 8)
+        i += 2
+        if not offset or offset > len(out):
+            raise ValueError("Invalid match offset")
+        length = token & 15
+        if length == 15:
+            while True:
+                b = src[i]
+                i += 1
+                length += b
+                if b != 255:
+                    break
+        length += 4
+        start = len(out) - offset
+        if length <= offset:
+            out += out[start:start + length]
+        else:
+            for j in range(length):
+                out.append(out[start + j])
+    return out
+
+
+def decode_frame(stream, out):
+    """
+    Decodes the rest of a frame after its magic number.
+    """
+    flg, bd = bytearray(read_exact(stream, 2))
+    if flg >> 6 != 1:
+        raise ValueError("Unsupported frame version")
+    skip = (8 if flg & CONTENT_SIZE else 0) + (4 if flg & DICT_ID else 0)
+    read_exact(stream, skip + 1)
+
+    while True:
+        size = struct.unpack("<I", read_exact(stream, 4))[0]
+        if not size:
+            break
+        block = read_exact(stream, size & ~UNCOMPRESSED)
+        if flg & BLOCK_CHECKSUM:
+            read_exact(stream, 4)
+        if size & UNCOMPRESSED:
+            out.write(block)
+        else:
+            out.write(decompress_block(block))
+    if flg & CONTENT_CHECKSUM:
+        read_exact(stream, 4)
+    out.flush()
+
+
+def main():
+    stream = getattr(sys.stdin, "buffer", sys.stdin)
+    out = getattr(sys.stdout, "buffer", sys.stdout)
+    while True:
+        magic = stream.read(4)
+        if not magic:
+            return
+        if len(magic) != 4 or struct.unpack("<I", magic)[0] != MAGIC:
+            raise ValueError("Not an LZ4 frame")
+        decode_frame(stream, out)
+
+
+if __name__ == "__main__":
+    main()
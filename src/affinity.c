@@ -0,0 +1,70 @@
+/**
+ * This file implements the CPU pinning declared in affinity.h
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include "affinity.h"
+
+// Parses a CPU number, advancing past it
+static int parse_cpu(const char **p) {
+    char *end;
+    if (**p < '0' || **p > '9') return -1;
+    long cpu = strtol(*p, &end, 10);
+    if (cpu >= MAX_CPUS) return -1;
+    *p = end;
+    return cpu;
+}
+
+int cpu_list_parse(const char *list, int *cpus, int max) {
+    const char *p = list;
+    int num = 0;
+    while (1) {
+        while (*p == ' ') p++;
+        int first = parse_cpu(&p), last = first;
+        if (first < 0) return -1;
+        if (*p == '-') {
+            p++;
+            last = parse_cpu(&p);
+            if (last < first) return -1;
+        }
+        for (int cpu=first; cpu <= last; cpu++) {
+            if (cpus && num < max) cpus[num] = cpu;
+            num++;
+        }
+        while (*p == ' ') p++;
+        if (!*p) return num;
+        if (*p++ != ',') return -1;
+    }
+}
+
+int cpu_pin_thread(const char *list, int index) {
+    if (!list) return 0;
+    int *cpus = malloc(MAX_CPUS * sizeof(int));
+    int num = cpu_list_parse(list, cpus, MAX_CPUS);
+    if (num <= 0) {
+        free(cpus);
+        return -1;
+    }
+    if (num > MAX_CPUS) num = MAX_CPUS;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (index >= 0) {
+        CPU_SET(cpus[index % num], &set);
+    } else {
+        for (int i=0; i < num; i++) CPU_SET(cpus[i], &set);
+    }
+    free(cpus);
+    int res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (res) syslog(LOG_WARNING, "Failed to pin a thread to CPUs '%s'! Err: %s", list, strerror(res));
+    return res;
+#else
+    free(cpus);
+    syslog(LOG_WARNING, "Pinning threads to CPUs is not supported on this platform.");
+    return -1;
+#endif
+}
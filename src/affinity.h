@@ -0,0 +1,34 @@
+/**
+ * This module pins threads to CPUs. The CPUs are given as
+ * lists such as "0-3,8,10-11", in the order they are used.
+ * A thread started by a pinned thread inherits its CPUs, and
+ * so does a child process. On Linux, the memory a thread
+ * touches first is also placed on the NUMA node of its CPU.
+ * Pinning is only supported on Linux.
+ */
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+// The most CPUs in a list
+#define MAX_CPUS 1024
+
+/**
+ * Parses a list of CPUs
+ * @arg list The list
+ * @arg cpus Output, the CPUs in the order listed. May be NULL.
+ * @arg max The most CPUs to output
+ * @return The number of CPUs in the list, or -1 if it is invalid.
+ */
+int cpu_list_parse(const char *list, int *cpus, int max);
+
+/**
+ * Pins the calling thread to the CPUs of a list
+ * @arg list The list, or NULL to leave the thread as is
+ * @arg index If not negative, the thread is pinned to the
+ * CPU at this index in the list, modulo its length. Otherwise
+ * the thread may run on any CPU of the list.
+ * @return 0 on success
+ */
+int cpu_pin_thread(const char *list, int index);
+
+#endif
@@ -0,0 +1,104 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "arena.h"
+#include "page_alloc.h"
+#include "stats.h"
+
+// Allocations are rounded up to this alignment
+#define ARENA_ALIGN 16
+#define ALIGN_UP(x) (((x) + (ARENA_ALIGN - 1)) & ~((size_t)ARENA_ALIGN - 1))
+
+/**
+ * Initializes an arena
+ * @arg chunk_size The size of each chunk, 0 for the default
+ * @arg a The arena to initialize
+ * @return 0 on success.
+ */
+int arena_init(size_t chunk_size, arena *a) {
+    a->chunk_size = (chunk_size) ? chunk_size : ARENA_DEFAULT_CHUNK;
+    a->allocated = 0;
+    a->head = NULL;
+    return 0;
+}
+
+/**
+ * Destroys an arena, releasing all allocations.
+ * @return 0 on success.
+ */
+int arena_destroy(arena *a) {
+    return arena_reset(a);
+}
+
+/**
+ * Releases all allocations, leaving the arena
+ * ready to be re-used.
+ * @return 0 on success.
+ */
+int arena_reset(arena *a) {
+    arena_chunk *chunk = a->head, *next;
+    while (chunk) {
+        next = chunk->next;
+        size_t size = ALIGN_UP(sizeof(arena_chunk)) + chunk->size;
+        page_free(chunk, size);
+        stats_mem_add(MEM_ARENAS, -(int64_t)size);
+        chunk = next;
+    }
+    a->head = NULL;
+    a->allocated = 0;
+    return 0;
+}
+
+/**
+ * Allocates memory from the arena. The memory is not zeroed,
+ * and is aligned for any type.
+ * @arg size The number of bytes to allocate
+ * @return A pointer to the memory, or NULL on failure.
+ */
+void* arena_alloc(arena *a, size_t size) {
+    size = ALIGN_UP(size);
+
+    // Allocate a new chunk if the current one is full.
+    // Large requests get a dedicated chunk.
+    arena_chunk *chunk = a->head;
+    if (!chunk || chunk->used + size > chunk->size) {
+        size_t chunk_size = (size > a->chunk_size) ? size : a->chunk_size;
+        chunk = page_alloc(ALIGN_UP(sizeof(arena_chunk)) + chunk_size);
+        if (!chunk) return NULL;
+        stats_mem_add(MEM_ARENAS, ALIGN_UP(sizeof(arena_chunk)) + chunk_size);
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = a->head;
+        a->head = chunk;
+        a->allocated += chunk_size;
+    }
+
+    // Bump the pointer
+    void *ptr = ((char*)chunk) + ALIGN_UP(sizeof(arena_chunk)) + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+/**
+ * Allocates zeroed memory from the arena
+ * @arg count The number of items
+ * @arg size The size of each item
+ * @return A pointer to the memory, or NULL on failure.
+ */
+void* arena_calloc(arena *a, size_t count, size_t size) {
+    void *ptr = arena_alloc(a, count * size);
+    if (ptr) memset(ptr, 0, count * size);
+    return ptr;
+}
+
+/**
+ * Copies a null terminated string into the arena
+ * @arg str The string to copy
+ * @return The copy, or NULL on failure.
+ */
+char* arena_strdup(arena *a, const char *str) {
+    size_t len = strlen(str) + 1;
+    char *copy = arena_alloc(a, len);
+    if (copy) memcpy(copy, str, len);
+    return copy;
+}
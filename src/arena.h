@@ -0,0 +1,75 @@
+/**
+ * This module implements a simple bump allocator.
+ * Memory is carved out of large chunks, and is only
+ * released all at once when the arena is reset or destroyed.
+ * This makes it suitable for objects that share a lifetime,
+ * such as everything allocated during a flush interval.
+ * An arena is not thread safe.
+ */
+#ifndef ARENA_H
+#define ARENA_H
+#include <stddef.h>
+#include "page_alloc.h"
+
+#define ARENA_DEFAULT_CHUNK 65536
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;    // Usable size of the chunk
+    size_t used;    // Bytes handed out
+} arena_chunk;
+
+// The chunk size that fills a huge page with the chunk header
+#define ARENA_HUGE_CHUNK (HUGE_PAGE_SIZE - ((sizeof(arena_chunk) + 15) & ~(size_t)15))
+
+typedef struct {
+    size_t chunk_size;     // Size of new chunks
+    size_t allocated;      // Total bytes in all chunks
+    arena_chunk *head;     // Current chunk, linked to older ones
+} arena;
+
+/**
+ * Initializes an arena
+ * @arg chunk_size The size of each chunk, 0 for the default
+ * @arg a The arena to initialize
+ * @return 0 on success.
+ */
+int arena_init(size_t chunk_size, arena *a);
+
+/**
+ * Destroys an arena, releasing all allocations.
+ * @return 0 on success.
+ */
+int arena_destroy(arena *a);
+
+/**
+ * Releases all allocations, leaving the arena
+ * ready to be re-used.
+ * @return 0 on success.
+ */
+int arena_reset(arena *a);
+
+/**
+ * Allocates memory from the arena. The memory is not zeroed,
+ * and is aligned for any type.
+ * @arg size The number of bytes to allocate
+ * @return A pointer to the memory, or NULL on failure.
+ */
+void* arena_alloc(arena *a, size_t size);
+
+/**
+ * Allocates zeroed memory from the arena
+ * @arg count The number of items
+ * @arg size The size of each item
+ * @return A pointer to the memory, or NULL on failure.
+ */
+void* arena_calloc(arena *a, size_t count, size_t size);
+
+/**
+ * Copies a null terminated string into the arena
+ * @arg str The string to copy
+ * @return The copy, or NULL on failure.
+ */
+char* arena_strdup(arena *a, const char *str);
+
+#endif
@@ -0,0 +1,319 @@
+/**
+ * Single pass tokenizer for the ASCII protocol.
+ *
+ * Each block of input is compared against every delimiter at
+ * once, giving a bitmask of the interesting bytes. Metric lines
+ * only have a handful of delimiters, so walking the set bits is
+ * much cheaper than visiting every byte. The positions are only
+ * recorded while scanning, and the null terminators are written
+ * once the newline is found.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "ascii_scan.h"
+#include "cpu_features.h"
+#if defined(HAVE_SIMD_X86)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Scanner states, which delimiter we expect next
+#define STATE_KEY    0
+#define STATE_VALUE  1
+#define STATE_TYPE   2
+#define STATE_SAMPLE 3
+#define STATE_TAGS   4
+
+/*
+ * Each of the kernels returns a bitmask of the delimiters in a
+ * block of its width. They are compiled for their instruction
+ * set along with a copy of the scanner, see scan_lines.
+ */
+
+// Checks the bytes one at a time, 8 per block
+static inline uint64_t mask_scalar(const char *p) {
+    uint64_t mask = 0;
+    for (int i=0; i < 8; i++) {
+        switch (p[i]) {
+            case '\n': case ':': case '|': case '@':
+                mask |= 1ULL << i;
+        }
+    }
+    return mask;
+}
+
+#ifdef HAVE_SIMD_X86
+__attribute__((target("sse2")))
+static inline uint64_t mask_sse2(const char *p) {
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8(':'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('|')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('@'))));
+    return (uint32_t)_mm_movemask_epi8(m);
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t mask_avx2(const char *p) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)p);
+    __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8(':'))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('|')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('@'))));
+    return (uint32_t)_mm256_movemask_epi8(m);
+}
+
+// The compares give masks directly, without a movemask
+__attribute__((target("avx512bw")))
+static inline uint64_t mask_avx512(const char *p) {
+    __m512i v = _mm512_loadu_si512((const void*)p);
+    return _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\n')) |
+           _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(':')) |
+           _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('|')) |
+           _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('@'));
+}
+#endif
+
+#ifdef __ARM_NEON
+// NEON has no movemask, so each lane keeps its own bit and they are summed
+static inline uint64_t mask_neon(const char *p) {
+    static const uint8_t bits[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t v = vld1q_u8((const uint8_t*)p);
+    uint8x16_t m = vorrq_u8(
+            vorrq_u8(vceqq_u8(v, vdupq_n_u8('\n')), vceqq_u8(v, vdupq_n_u8(':'))),
+            vorrq_u8(vceqq_u8(v, vdupq_n_u8('|')), vceqq_u8(v, vdupq_n_u8('@'))));
+    m = vandq_u8(m, vld1q_u8(bits));
+    return vaddv_u8(vget_low_u8(m)) | ((uint64_t)vaddv_u8(vget_high_u8(m)) << 8);
+}
+#endif
+
+/**
+ * Scans a buffer for complete newline terminated lines.
+ * Only complete lines are modified, so a trailing partial
+ * line can be scanned again once the rest of it arrives.
+ * @arg buf The buffer to scan
+ * @arg len The length of the buffer
+ * @arg lines Output. The lines that were found
+ * @arg max_lines The maximum number of lines to return
+ * @arg num_lines Output. The number of lines found
+ * @arg width The bytes in a block of the kernel
+ * @arg block_mask The kernel, which masks the delimiters of a block
+ * @return The number of bytes consumed by the lines found.
+ */
+static inline __attribute__((always_inline)) int scan_lines(char *buf, int len,
+        ascii_line *lines, int max_lines, int *num_lines,
+        int width, uint64_t (*block_mask)(const char*)) {
+    int state = STATE_KEY, start = 0, n = 0;
+    int value = -1, type = -1, sample = -1, tags = -1;
+    uint64_t mask;
+    int pos;
+
+    for (int block=0; block < len && n < max_lines; block += width) {
+        // Use a full block when possible, and mask the scalar tail
+        if (block + width <= len) {
+            mask = block_mask(buf + block);
+        } else {
+            mask = 0;
+            for (int i=block; i < len; i++) {
+                switch (buf[i]) {
+                    case '\n': case ':': case '|': case '@':
+                        mask |= 1ULL << (i - block);
+                }
+            }
+        }
+
+        // Visit each delimiter in the block
+        while (mask) {
+            pos = block + __builtin_ctzll(mask);
+            mask &= mask - 1;
+            switch (buf[pos]) {
+                case ':':
+                    if (state == STATE_KEY) {
+                        value = pos;
+                        state = STATE_VALUE;
+                    }
+                    break;
+                case '|':
+                    if (state == STATE_VALUE) {
+                        type = pos;
+                        state = STATE_TYPE;
+                    } else if ((state == STATE_TYPE || state == STATE_SAMPLE) &&
+                            pos + 1 < len && buf[pos + 1] == '#') {
+                        tags = pos;
+                        state = STATE_TAGS;
+                    }
+                    break;
+                case '@':
+                    if (state == STATE_TYPE) {
+                        sample = pos;
+                        state = STATE_SAMPLE;
+                    }
+                    break;
+                case '\n':
+                    // Terminate the fields of the complete line
+                    buf[pos] = '\0';
+                    lines[n].key = buf + start;
+                    lines[n].len = pos - start;
+                    lines[n].value = lines[n].type = lines[n].sample = lines[n].tags = NULL;
+                    if (value >= 0) {
+                        buf[value] = '\0';
+                        lines[n].value = buf + value + 1;
+                    }
+                    if (type >= 0) {
+                        buf[type] = '\0';
+                        lines[n].type = buf + type + 1;
+                    }
+                    if (sample >= 0) {
+                        buf[sample] = '\0';
+                        lines[n].sample = buf + sample + 1;
+                    }
+                    if (tags >= 0) {
+                        buf[tags] = '\0';
+                        lines[n].tags = buf + tags + 2;
+                    }
+
+                    // Reset for the next line
+                    n++;
+                    start = pos + 1;
+                    state = STATE_KEY;
+                    value = type = sample = tags = -1;
+                    if (n == max_lines) mask = 0;
+                    break;
+            }
+        }
+    }
+
+    *num_lines = n;
+    return start;
+}
+
+/*
+ * The scanner compiled for each instruction set. The scanner is
+ * inlined into each, so the kernel is inlined into its loop.
+ */
+static int scan_scalar(char *buf, int len, ascii_line *lines, int max_lines, int *num_lines) {
+    return scan_lines(buf, len, lines, max_lines, num_lines, 8, mask_scalar);
+}
+
+#ifdef HAVE_SIMD_X86
+__attribute__((target("sse2")))
+static int scan_sse2(char *buf, int len, ascii_line *lines, int max_lines, int *num_lines) {
+    return scan_lines(buf, len, lines, max_lines, num_lines, 16, mask_sse2);
+}
+
+__attribute__((target("avx2")))
+static int scan_avx2(char *buf, int len, ascii_line *lines, int max_lines, int *num_lines) {
+    return scan_lines(buf, len, lines, max_lines, num_lines, 32, mask_avx2);
+}
+
+__attribute__((target("avx512bw")))
+static int scan_avx512(char *buf, int len, ascii_line *lines, int max_lines, int *num_lines) {
+    return scan_lines(buf, len, lines, max_lines, num_lines, 64, mask_avx512);
+}
+#endif
+
+#ifdef __ARM_NEON
+static int scan_neon(char *buf, int len, ascii_line *lines, int max_lines, int *num_lines) {
+    return scan_lines(buf, len, lines, max_lines, num_lines, 16, mask_neon);
+}
+#endif
+
+int ascii_scan_lines(char *buf, int len, ascii_line *lines, int max_lines, int *num_lines) {
+    switch (simd_current()) {
+#ifdef HAVE_SIMD_X86
+        case SIMD_AVX512:
+            return scan_avx512(buf, len, lines, max_lines, num_lines);
+        case SIMD_AVX2:
+            return scan_avx2(buf, len, lines, max_lines, num_lines);
+        case SIMD_SSE2:
+            return scan_sse2(buf, len, lines, max_lines, num_lines);
+#endif
+#ifdef __ARM_NEON
+        case SIMD_NEON:
+            return scan_neon(buf, len, lines, max_lines, num_lines);
+#endif
+        default:
+            return scan_scalar(buf, len, lines, max_lines, num_lines);
+    }
+}
+
+// A tag of a line, in the input
+typedef struct {
+    const char *start;
+    int len;
+} tag_ref;
+
+// Orders the tags bytewise, a tag before the longer tags it prefixes
+static inline int tag_cmp(const tag_ref *a, const tag_ref *b) {
+    int res = memcmp(a->start, b->start, a->len < b->len ? a->len : b->len);
+    return res ? res : a->len - b->len;
+}
+
+/**
+ * Rewrites a line with tags, so that its key is the canonical name
+ * of the tagged metric. See ascii_scan.h for the format.
+ * @arg line A scanned line, with tags
+ * @return 0 on success, -1 if the line has more than MAX_LINE_TAGS
+ * tags, or is longer than MAX_TAGGED_LINE.
+ */
+int ascii_canonical_tags(ascii_line *line) {
+    char buf[MAX_TAGGED_LINE];
+    tag_ref tags[MAX_LINE_TAGS];
+    if (line->len >= MAX_TAGGED_LINE) return -1;
+
+    // Split the tags, up to the end of the line or another field
+    int num = 0;
+    const char *p = line->tags, *end;
+    while (1) {
+        for (end = p; *end && *end != ',' && *end != '|'; end++);
+        if (end > p) {
+            if (num == MAX_LINE_TAGS) return -1;
+            tags[num].start = p;
+            tags[num++].len = end - p;
+        }
+        if (*end != ',') break;
+        p = end + 1;
+    }
+    line->tags = NULL;
+    if (!num) return 0;
+
+    // Insertion sort, there are only a few tags
+    for (int i=1; i < num; i++) {
+        tag_ref t = tags[i];
+        int j = i;
+        for (; j > 0 && tag_cmp(tags + j - 1, &t) > 0; j--) tags[j] = tags[j - 1];
+        tags[j] = t;
+    }
+
+    // Build the canonical line, it is always shorter than the input
+    int key_len = strlen(line->key);
+    char *out = buf + key_len;
+    memcpy(buf, line->key, key_len);
+    for (int i=0; i < num; i++) {
+        if (i && !tag_cmp(tags + i - 1, tags + i)) continue;
+        *out++ = ';';
+        const char *c = tags[i].start, *tag_end = c + tags[i].len;
+        for (; c < tag_end && *c != ':'; c++) *out++ = *c;
+        if (c < tag_end) {
+            *out++ = '=';
+            c++;
+        }
+        for (; c < tag_end; c++) *out++ = *c;
+    }
+    *out++ = '\0';
+
+    // Move the other fields after the key
+    char **fields[] = {&line->value, &line->type, &line->sample};
+    for (int i=0; i < 3; i++) {
+        if (!*fields[i]) continue;
+        int field_len = strlen(*fields[i]) + 1;
+        memcpy(out, *fields[i], field_len);
+        *fields[i] = line->key + (out - buf);
+        out += field_len;
+    }
+    memcpy(line->key, buf, out - buf);
+    return 0;
+}
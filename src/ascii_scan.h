@@ -0,0 +1,58 @@
+/**
+ * This module tokenizes the ASCII protocol. A chunk of input is
+ * scanned once for all the delimiters, with the widest of SSE2,
+ * AVX2, AVX-512 or NEON that the host supports, see cpu_features.h,
+ * and each complete line is split into its key, value,
+ * type, sample rate and tags. This replaces a separate memchr()
+ * pass over each line for every delimiter.
+ */
+#ifndef ASCII_SCAN_H
+#define ASCII_SCAN_H
+
+// The most tags of a line that is canonicalized
+#define MAX_LINE_TAGS 64
+
+// The longest line with tags that is canonicalized
+#define MAX_TAGGED_LINE 4096
+
+/**
+ * The fields of a line of the form key:value|type[|@sample][|#tags].
+ * The delimiters are replaced by null terminators in place.
+ */
+typedef struct {
+    char *key;      // Start of the line
+    char *value;    // After the first ':', or NULL if missing
+    char *type;     // After the first '|' past the value, or NULL if missing
+    char *sample;   // After the first '@' past the type, or NULL if missing
+    char *tags;     // After the first '|#' past the type, or NULL if missing
+    int len;        // Length of the line, without the newline
+} ascii_line;
+
+/**
+ * Scans a buffer for complete newline terminated lines.
+ * Only complete lines are modified, so a trailing partial
+ * line can be scanned again once the rest of it arrives.
+ * @arg buf The buffer to scan
+ * @arg len The length of the buffer
+ * @arg lines Output. The lines that were found
+ * @arg max_lines The maximum number of lines to return
+ * @arg num_lines Output. The number of lines found
+ * @return The number of bytes consumed by the lines found.
+ */
+int ascii_scan_lines(char *buf, int len, ascii_line *lines, int max_lines, int *num_lines);
+
+/**
+ * Rewrites a line with tags, so that its key is the canonical name
+ * of the tagged metric. That is the name followed by the distinct
+ * tags in sorted order, each after a ';' and with its first ':' as
+ * a '=', which is the tagged series format of Graphite. The sort
+ * uses a stack buffer, and the fields are moved in place, as the
+ * canonical line is always shorter. The tags end at the next '|',
+ * and the tags field is cleared.
+ * @arg line A scanned line, with tags
+ * @return 0 on success, -1 if the line has more than MAX_LINE_TAGS
+ * tags, or is longer than MAX_TAGGED_LINE.
+ */
+int ascii_canonical_tags(ascii_line *line);
+
+#endif
@@ -3,6 +3,12 @@
  * for computation of biased quantiles over data streams from
  * "Effective Computation of Biased Quantiles over Data Streams"
  *
+ * The samples are kept in a sorted array. New values are
+ * appended to a flat buffer, which is radix sorted and merged
+ * into the array in batches of CM_BUFFER_SIZE, followed by a
+ * single compression pass. Weighted values are buffered apart in
+ * a typed heap, and merged in after the batch with their weight
+ * as their width.
  */
 #include <stdint.h>
 #include <iso646.h>
@@ -11,33 +17,84 @@
 #include <math.h>
 #include <limits.h>
 #include <stdio.h>
-#include "heap.h"
 #include "cm_quantile.h"
+#include "probes.h"
+#include "stats.h"
+
+// Number of values buffered before they are merged in
+#define CM_BUFFER_SIZE 512
 
 /* Static declarations */
-static void cm_add_to_buffer(cm_quantile *cm, double value);
-static double cm_insert_point_value(cm_quantile *cm);
-static void cm_reset_insert_cursor(cm_quantile *cm);
-static int cm_cursor_increment(cm_quantile *cm);
-static void cm_insert_sample(cm_quantile *cm, cm_sample *position, cm_sample *new);
-static void cm_append_sample(cm_quantile *cm, cm_sample *new);
 static void cm_insert(cm_quantile *cm);
+static void cm_insert_values(cm_quantile *cm);
+static void cm_insert_weighted(cm_quantile *cm);
 static void cm_compress(cm_quantile *cm);
-static uint64_t cm_threshold(cm_quantile *cm, uint64_t rank);
-
-// This is a comparison function that treats keys as doubles
-static int compare_double_keys(register void* key1, register void* key2) {
-    // Cast them as double* and read them in
-    register double val1 = *((double*)key1);
-    register double val2 = *((double*)key2);
-
-    // Perform the comparison
-    if (val1 < val2)
-        return -1;
-    else if (val1 == val2)
-        return 0;
-    else
-        return 1;
+static void cm_build_segments(cm_quantile *cm);
+static inline uint64_t cm_threshold(cm_quantile *cm, uint64_t rank, uint32_t *seg);
+
+/**
+ * Maps a double to an unsigned integer with the same ordering,
+ * so that it can be radix sorted.
+ */
+static inline uint64_t double_to_key(double val) {
+    uint64_t u;
+    memcpy(&u, &val, sizeof(u));
+    return (u >> 63) ? ~u : u | (1ULL << 63);
+}
+
+// Inverse of double_to_key
+static inline double key_to_double(uint64_t u) {
+    u = (u >> 63) ? u & ~(1ULL << 63) : ~u;
+    double val;
+    memcpy(&val, &u, sizeof(u));
+    return val;
+}
+
+/**
+ * Sorts an array of doubles using an LSD radix sort on
+ * the bytes of their integer keys. Passes where every key
+ * shares the same byte are skipped, which is common since
+ * timer values tend to fall in a narrow range.
+ * @arg vals The values to sort, at most CM_BUFFER_SIZE
+ * @arg num The number of values
+ */
+static void radix_sort_doubles(double *vals, uint32_t num) {
+    uint64_t keys[CM_BUFFER_SIZE], tmp[CM_BUFFER_SIZE];
+    uint32_t counts[8][256];
+    memset(counts, 0, sizeof(counts));
+
+    // Build the keys and all the histograms in one pass
+    for (uint32_t i=0; i < num; i++) {
+        uint64_t k = double_to_key(vals[i]);
+        keys[i] = k;
+        for (int b=0; b < 8; b++) counts[b][(k >> (b*8)) & 0xff]++;
+    }
+
+    uint64_t *src = keys, *dst = tmp, *swap;
+    for (int b=0; b < 8; b++) {
+        uint32_t *c = counts[b];
+        int shift = b * 8;
+
+        // Skip the pass if all keys share this byte
+        if (c[(src[0] >> shift) & 0xff] == num) continue;
+
+        // Convert the counts to offsets
+        uint32_t sum = 0, cur;
+        for (int i=0; i < 256; i++) {
+            cur = c[i];
+            c[i] = sum;
+            sum += cur;
+        }
+
+        for (uint32_t i=0; i < num; i++) {
+            dst[c[(src[i] >> shift) & 0xff]++] = src[i];
+        }
+        swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    for (uint32_t i=0; i < num; i++) vals[i] = key_to_double(src[i]);
 }
 
 /**
@@ -67,62 +124,44 @@ int init_cm_quantile(double eps, double *quantiles, uint32_t num_quants, cm_quan
     cm->num_samples = 0;
     cm->num_values = 0;
     cm->samples = NULL;
-    cm->end = NULL;
+    cm->samples_size = 0;
 
-    // Copy the quantiles
-    cm->quantiles = malloc(num_quants * sizeof(double));
+    // Copy the quantiles, the segments of the threshold follow them
+    cm->quantiles = malloc(num_quants * (sizeof(double) + 2 * sizeof(cm_segment)));
+    if (!cm->quantiles) return -1;
     memcpy(cm->quantiles, quantiles, num_quants * sizeof(double));
     cm->num_quantiles = num_quants;
-
-    // Initialize the buffers
-    heap *heaps = malloc(2*sizeof(heap));
-    cm->bufLess = heaps;
-    cm->bufMore = heaps+1;
-    heap_create(cm->bufLess, 0, compare_double_keys);
-    heap_create(cm->bufMore, 0, compare_double_keys);
-
-    // Setup the cursors
-    cm->insert.curs = NULL;
-    cm->compress.curs = NULL;
-
+    cm->segments = (cm_segment*)(cm->quantiles + num_quants);
+    cm_build_segments(cm);
+    stats_mem_add(MEM_TIMERS, num_quants * (sizeof(double) + 2 * sizeof(cm_segment)));
+
+    // The buffer is allocated on demand
+    cm->buffer = NULL;
+    cm->buffer_len = 0;
+    cm->buffer_size = 0;
+    cm_sample_heap_init(&cm->weighted);
     return 0;
 }
 
-/*
- * Callback function to delete the sample inside the
- * heap buffer.
- */
-static void free_buffer_sample(void *key, void *val) {
-    free(val);
-}
-
 /**
  * Destroy the CM quantile struct.
  * @arg cm_quantile The cm_quantile to destroy
  * @return 0 on success.
  */
 int destroy_cm_quantile(cm_quantile *cm) {
-    // Free the quantiles
+    stats_mem_add(MEM_TIMERS, -(int64_t)((cm->num_quantiles + cm->buffer_size) * sizeof(double) +
+                cm->num_quantiles * 2 * sizeof(cm_segment) +
+                cm->samples_size * sizeof(cm_sample)));
+
+    // Free the quantiles, and the segments with them
     free(cm->quantiles);
 
-    // Destroy everything in the buffer
-    heap_foreach(cm->bufLess, free_buffer_sample);
-    heap_destroy(cm->bufLess);
-    heap_foreach(cm->bufMore, free_buffer_sample);
-    heap_destroy(cm->bufMore);
-
-    // Free the lower address, since they are allocated to be adjacent
-    free((cm->bufLess < cm->bufMore) ? cm->bufLess : cm->bufMore);
-
-    // Iterate through the linked list, free all
-    cm_sample *next;
-    cm_sample *current = cm->samples;
-    while (current) {
-        next = current->next;
-        free(current);
-        current = next;
-    }
+    // Free the buffers
+    free(cm->buffer);
+    cm_sample_heap_destroy(&cm->weighted);
 
+    // Free the samples
+    free(cm->samples);
     return 0;
 }
 
@@ -133,9 +172,39 @@ int destroy_cm_quantile(cm_quantile *cm) {
  * @return 0 on success.
  */
 int cm_add_sample(cm_quantile *cm, double sample) {
-    cm_add_to_buffer(cm, sample);
-    cm_insert(cm);
-    cm_compress(cm);
+    // Grow the buffer as needed, up to the batch size
+    if (cm->buffer_len == cm->buffer_size) {
+        stats_mem_add(MEM_TIMERS, ((cm->buffer_size) ? cm->buffer_size : 16) * sizeof(double));
+        cm->buffer_size = (cm->buffer_size) ? cm->buffer_size * 2 : 16;
+        cm->buffer = realloc(cm->buffer, cm->buffer_size * sizeof(double));
+    }
+    cm->buffer[cm->buffer_len++] = sample;
+
+    if (cm->buffer_len >= CM_BUFFER_SIZE) {
+        cm_insert(cm);
+        cm_compress(cm);
+    }
+    return 0;
+}
+
+/**
+ * Adds a new sample that stands for a number of values, such
+ * as a sampled timer. It is inserted once, spanning that many
+ * ranks, so the cost does not depend on the weight.
+ * @arg cm_quantile The cm_quantile to add to
+ * @arg sample The new sample value
+ * @arg weight The number of values the sample stands for, at least 1
+ * @return 0 on success.
+ */
+int cm_add_weighted(cm_quantile *cm, double sample, uint64_t weight) {
+    if (weight <= 1) return cm_add_sample(cm, sample);
+
+    cm_sample s = {sample, weight, 0};
+    if (cm_sample_heap_push(&cm->weighted, s)) return -1;
+    if (cm_sample_heap_size(&cm->weighted) >= CM_BUFFER_SIZE) {
+        cm_insert(cm);
+        cm_compress(cm);
+    }
     return 0;
 }
 
@@ -146,16 +215,61 @@ int cm_add_sample(cm_quantile *cm, double sample) {
  * @return 0 on success.
  */
 int cm_flush(cm_quantile *cm) {
-    int rounds = 0;
-    while (heap_size(cm->bufLess) or heap_size(cm->bufMore)) {
-        if (heap_size(cm->bufMore) == 0) cm_reset_insert_cursor(cm);
+    if (cm->buffer_len || cm_sample_heap_size(&cm->weighted)) {
         cm_insert(cm);
         cm_compress(cm);
-        rounds++;
     }
     return 0;
 }
 
+/**
+ * Merges the samples of one CM quantile into another.
+ * Both are flushed, and the merged samples are compressed
+ * using the settings of the destination.
+ * @arg dst The cm_quantile to merge into
+ * @arg src The cm_quantile to merge from, it is not modified
+ * beyond being flushed.
+ * @return 0 on success.
+ */
+int cm_merge(cm_quantile *dst, cm_quantile *src) {
+    cm_flush(dst);
+    cm_flush(src);
+    if (!src->num_samples) return 0;
+
+    /*
+     * Merge the two sorted sample arrays. The rank of a sample
+     * is only known within its own array, so we widen its delta
+     * by the rank uncertainty of the next sample in the other array.
+     */
+    uint64_t total = dst->num_samples + src->num_samples;
+    cm_sample *merged = malloc(total * sizeof(cm_sample));
+    cm_sample *a = dst->samples, *a_end = a + dst->num_samples;
+    cm_sample *b = src->samples, *b_end = b + src->num_samples;
+    cm_sample *s = merged;
+    while (a < a_end or b < b_end) {
+        if (b == b_end or (a < a_end and a->value <= b->value)) {
+            *s = *a++;
+            if (b < b_end) s->delta += b->width + b->delta - 1;
+        } else {
+            *s = *b++;
+            if (a < a_end) s->delta += a->width + a->delta - 1;
+        }
+        s++;
+    }
+
+    // Update the destination
+    stats_mem_add(MEM_TIMERS, ((int64_t)total - (int64_t)dst->samples_size) * (int64_t)sizeof(cm_sample));
+    free(dst->samples);
+    dst->samples = merged;
+    dst->samples_size = total;
+    dst->num_samples = total;
+    dst->num_values += src->num_values;
+
+    // Perform a compression pass
+    cm_compress(dst);
+    return 0;
+}
+
 /**
  * Queries for a quantile value
  * @arg cm_quantile The cm_quantile to query
@@ -163,213 +277,243 @@ int cm_flush(cm_quantile *cm) {
  * @return The value on success or 0.
  */
 double cm_query(cm_quantile *cm, double quantile) {
+    // Make sure the buffered values are included
+    cm_flush(cm);
+    if (!cm->num_samples) return 0;
+
     uint64_t rank = ceil(quantile * cm->num_values);
-	uint64_t min_rank=0;
+    uint64_t min_rank=0;
     uint64_t max_rank;
-	uint64_t threshold = ceil(cm_threshold(cm, rank) / 2.);
+    uint32_t seg = 0;
+    uint64_t threshold = ceil(cm_threshold(cm, rank, &seg) / 2.);
 
-    cm_sample *prev = cm->samples;
-    cm_sample *current = cm->samples;
-    while (current) {
-        max_rank = min_rank + current->width + current->delta;
+    cm_sample *samples = cm->samples;
+    uint64_t prev = 0;
+    for (uint64_t i=0; i < cm->num_samples; i++) {
+        max_rank = min_rank + samples[i].width + samples[i].delta;
         if (max_rank > rank + threshold) {
             break;
         }
-        min_rank += current->width;
-        prev = current;
-        current = current->next;
+        min_rank += samples[i].width;
+        prev = i;
     }
-    return (prev) ? prev->value : 0;
+    return samples[prev].value;
 }
 
 /**
- * Adds a new sample to the buffer
+ * Queries for several quantile values in a single
+ * walk of the samples. The results match cm_query.
+ * @arg cm_quantile The cm_quantile to query
+ * @arg quantiles A sorted array of the quantiles to query
+ * @arg num_quants The number of quantiles
+ * @arg values Output. The value of each quantile, or 0.
  */
-static void cm_add_to_buffer(cm_quantile *cm, double value) {
-    // Allocate a new sample
-    cm_sample *s = calloc(1, sizeof(cm_sample));
-    s->value = value;
+void cm_query_many(cm_quantile *cm, const double *quantiles, int num_quants, double *values) {
+    // Make sure the buffered values are included
+    cm_flush(cm);
+
+    cm_sample *samples = cm->samples;
+    uint64_t i = 0, min_rank = 0, prev = 0, last_limit = 0;
+    uint32_t seg = 0;
+    for (int q=0; q < num_quants; q++) {
+        if (!cm->num_samples) {
+            values[q] = 0;
+            continue;
+        }
 
-    /*
-     * Check the cursor value.
-     * Only use bufLess if we have at least a single value.
-     */
-    if (cm->num_values && value < cm_insert_point_value(cm)) {
-        heap_insert(cm->bufLess, &s->value, s);
-    } else {
-        heap_insert(cm->bufMore, &s->value, s);
+        /*
+         * The walk for each quantile stops at the first sample whose
+         * max rank passes the limit, so it resumes from there for the
+         * next one. The limit rises with the rank for any sane epsilon,
+         * but restart the walk if it ever falls.
+         */
+        uint64_t rank = ceil(quantiles[q] * cm->num_values);
+        uint64_t limit = rank + ceil(cm_threshold(cm, rank, &seg) / 2.);
+        if (limit < last_limit) {
+            i = min_rank = prev = 0;
+        }
+        last_limit = limit;
+
+        for (; i < cm->num_samples; i++) {
+            if (min_rank + samples[i].width + samples[i].delta > limit) break;
+            min_rank += samples[i].width;
+            prev = i;
+        }
+        values[q] = samples[prev].value;
     }
 }
 
-// Returns the value under the insertion cursor or 0
-static double cm_insert_point_value(cm_quantile *cm) {
-    return (cm->insert.curs) ? cm->insert.curs->value : 0;
+// Grows the samples array to hold a total number of samples
+static void cm_reserve(cm_quantile *cm, uint64_t total) {
+    if (total <= cm->samples_size) return;
+    uint64_t size = (cm->samples_size) ? cm->samples_size : CM_BUFFER_SIZE;
+    while (size < total) size *= 2;
+    stats_mem_add(MEM_TIMERS, (size - cm->samples_size) * sizeof(cm_sample));
+    cm->samples = realloc(cm->samples, size * sizeof(cm_sample));
+    cm->samples_size = size;
 }
 
-// Resets the insert cursor
-static void cm_reset_insert_cursor(cm_quantile *cm) {
-    // Swap the buffers, reset the cursor
-    heap *tmp = cm->bufLess;
-    cm->bufLess = cm->bufMore;
-    cm->bufMore = tmp;
-    cm->insert.curs = NULL;
+/**
+ * Merges the buffered values and weighted values into the samples
+ */
+static void cm_insert(cm_quantile *cm) {
+    if (cm->buffer_len) cm_insert_values(cm);
+    if (cm_sample_heap_size(&cm->weighted)) cm_insert_weighted(cm);
 }
 
-// Computes the number of items to process in one iteration
-static int cm_cursor_increment(cm_quantile *cm) {
-    return ceil(cm->num_samples * cm->eps);
-}
+/**
+ * Merges the buffered values into the samples. The
+ * sorted buffer and the samples are merged from the
+ * back, so it is done in place in a single pass.
+ */
+static void cm_insert_values(cm_quantile *cm) {
+    // Sort the buffered values
+    int64_t num_new = cm->buffer_len;
+    double *batch = cm->buffer;
+    radix_sort_doubles(batch, num_new);
+    cm->buffer_len = 0;
 
-/* Inserts a new sample before the position sample */
-static void cm_insert_sample(cm_quantile *cm, cm_sample *position, cm_sample *new) {
-    // Inserting at the head
-    if (!position->prev) {
-        position->prev = new;
-        cm->samples = new;
-        new->next = position;
-    } else {
-        cm_sample *prev = position->prev;
-        prev->next = new;
-        position->prev = new;
-        new->prev = prev;
-        new->next = position;
+    // Ensure there is space for the new samples
+    uint64_t total = cm->num_samples + num_new;
+    cm_reserve(cm, total);
+
+    /*
+     * Merge from the back. A new value goes before any existing
+     * samples of equal value, and inherits the rank uncertainty
+     * of the sample following it. Values outside the existing
+     * range have an exact rank.
+     */
+    cm_sample *s = cm->samples;
+    int64_t i = cm->num_samples - 1;
+    int64_t j = num_new - 1;
+    int64_t k = total - 1;
+    while (j >= 0) {
+        if (i >= 0 && s[i].value >= batch[j]) {
+            s[k--] = s[i--];
+        } else {
+            s[k].value = batch[j--];
+            s[k].width = 1;
+            s[k].delta = (i >= 0 && k + 1 < total) ? s[k+1].width + s[k+1].delta - 1 : 0;
+            k--;
+        }
     }
-}
 
-/* Inserts a new sample at the end */
-static void cm_append_sample(cm_quantile *cm, cm_sample *new) {
-    new->prev = cm->end;
-    cm->end->next = new;
-    cm->end = new;
+    cm->num_values += num_new;
+    cm->num_samples = total;
 }
 
 /**
- * Incrementally processes inserts by moving
- * data from the buffer to the samples using a cursor
+ * Merges the buffered weighted values into the samples, as
+ * cm_insert_values does. Each spans its weight in ranks. The
+ * heap gives them largest first, for the merge from the back.
  */
-static void cm_insert(cm_quantile *cm) {
-    // Check if this is the first element
-    cm_sample *samp;
-    if (!cm->samples) {
-        if (!heap_delmin(cm->bufMore, NULL, (void**)&samp)) return;
-        samp->width = 1;
-        samp->delta = 0;
-        cm->samples = samp;
-        cm->end = samp;
-        cm->num_values++;
-        cm->num_samples++;
-        cm->insert.curs = samp;
-		return;
-	}
-
-    // Check if we need to initialize the cursor
-    if (!cm->insert.curs) {
-        cm->insert.curs = cm->samples;
-    }
+static void cm_insert_weighted(cm_quantile *cm) {
+    int64_t num_new = cm_sample_heap_size(&cm->weighted);
 
-    // Handle adding values in the middle
-    int incr_size = cm_cursor_increment(cm);
-    double *val;
-    for (int i=0; i < incr_size and cm->insert.curs; i++) {
-        while (heap_min(cm->bufMore, (void**)&val, NULL) && *val <= cm_insert_point_value(cm)) {
-            heap_delmin(cm->bufMore, NULL, (void**)&samp);
-            samp->width = 1;
-            samp->delta = cm->insert.curs->width + cm->insert.curs->delta - 1;
-            cm_insert_sample(cm, cm->insert.curs, samp);
-            cm->num_values++;
-            cm->num_samples++;
-
-            // Check if we need to update the compress cursor
-            if (cm->compress.curs && cm->compress.curs->value >= samp->value) {
-                cm->compress.min_rank++;
-            }
-        }
-        // Increment the cursor
-        cm->insert.curs = cm->insert.curs->next;
-	}
-
-    // Handle adding values at the end
-    if (cm->insert.curs == NULL) {
-        while (heap_min(cm->bufMore, (void**)&val, NULL) && *val > cm->end->value) {
-            heap_delmin(cm->bufMore, NULL, (void**)&samp);
-            samp->width = 1;
-            samp->delta = 0;
-            cm_append_sample(cm, samp);
-            cm->num_values++;
-            cm->num_samples++;
+    uint64_t total = cm->num_samples + num_new;
+    cm_reserve(cm, total);
+
+    /*
+     * Unlike a plain value, the width of a new sample is not 1, so
+     * the uncertainty comes from the existing sample that follows
+     * it rather than from whichever sample was placed last.
+     */
+    cm_sample *s = cm->samples;
+    int64_t i = cm->num_samples - 1;
+    int64_t k = total - 1;
+    int64_t next = -1;
+    uint64_t added = 0;
+    cm_sample top;
+    while (cm_sample_heap_top(&cm->weighted, &top)) {
+        if (i >= 0 && s[i].value >= top.value) {
+            next = k;
+            s[k--] = s[i--];
+        } else {
+            cm_sample_heap_pop(&cm->weighted, &top);
+            s[k].value = top.value;
+            s[k].width = top.width;
+            s[k].delta = (i >= 0 && next >= 0) ? s[next].width + s[next].delta - 1 : 0;
+            added += top.width;
+            k--;
         }
+    }
 
-        // Reset the cursor
-        cm_reset_insert_cursor(cm);
-	}
+    cm->num_values += added;
+    cm->num_samples = total;
 }
 
-/* Incrementally processes compression by using a cursor */
+/**
+ * Compresses the samples in a single pass from the back,
+ * merging each sample into its successor when the combined
+ * error is within the threshold. The minimum and maximum
+ * values are always kept.
+ */
 static void cm_compress(cm_quantile *cm) {
     // Bail early if there is nothing to really compress..
     if (cm->num_samples < 3) return;
-
-    // Check if we need to initialize the cursor
-    if (!cm->compress.curs) {
-        cm->compress.curs = cm->end->prev;
-        cm->compress.min_rank = cm->num_values - 1 - cm->compress.curs->width;
-        cm->compress.curs = cm->compress.curs->prev;
-    }
-
-    int incr_size = cm_cursor_increment(cm);
-    cm_sample *next, *prev;
-    uint64_t threshold;
-    uint64_t max_rank, test_val;
-    for (int i=0; i < incr_size and cm->compress.curs != cm->samples; i++) {
-        next = cm->compress.curs->next;
-        max_rank = cm->compress.min_rank + cm->compress.curs->width + cm->compress.curs->delta;
-        cm->compress.min_rank -= cm->compress.curs->width;
-
-        threshold = cm_threshold(cm, max_rank);
-        test_val = cm->compress.curs->width + next->width + next->delta;
-        if (test_val <= threshold) {
-            // Make sure we don't stomp the insertion cursor
-            if (cm->insert.curs == cm->compress.curs) {
-                cm->insert.curs = next;
-            }
-
-            // Combine the widths
-            next->width += cm->compress.curs->width;
-
-            // Remove the tuple
-            prev = cm->compress.curs->prev;
-            prev->next = next;
-            next->prev = prev;
-            free(cm->compress.curs);
-            cm->compress.curs = prev;
-
-            // Reduce the sample count
-            cm->num_samples--;
+    STATSITE_PROBE1(cm_compress_start, cm->num_samples);
+
+    cm_sample *s = cm->samples;
+    uint64_t n = cm->num_samples;
+    uint64_t w = n - 1;
+    uint64_t min_rank = cm->num_values - s[n-1].width;
+    uint64_t max_rank, threshold;
+    uint32_t seg = 2 * cm->num_quantiles - 1;
+    for (uint64_t i=n-2; i > 0; i--) {
+        min_rank -= s[i].width;
+        max_rank = min_rank + s[i].width + s[i].delta;
+        threshold = cm_threshold(cm, max_rank, &seg);
+        if (s[i].width + s[w].width + s[w].delta <= threshold) {
+            // Combine into the successor
+            s[w].width += s[i].width;
         } else {
-            cm->compress.curs = cm->compress.curs->prev;
+            s[--w] = s[i];
         }
     }
 
-    // Reset the cursor if we hit the start
-    if (cm->compress.curs == cm->samples) cm->compress.curs = NULL;
+    // Keep the minimum, and shift everything down
+    s[--w] = s[0];
+    if (w) memmove(s, s + w, (n - w) * sizeof(cm_sample));
+    cm->num_samples = n - w;
+    STATSITE_PROBE1(cm_compress_done, cm->num_samples);
 }
 
-/* Computes the minimum threshold value */
-static uint64_t cm_threshold(cm_quantile *cm, uint64_t rank) {
-    uint64_t min_val = LLONG_MAX;
-
-    uint64_t quant_min;
-    double   quant;
-    for (int i=0; i < cm->num_quantiles; i++) {
-        quant = cm->quantiles[i];
-        if (rank >= quant * cm->num_values) {
-            quant_min = 2 * cm->eps * rank / quant;
-        } else {
-            quant_min = 2 * cm->eps * (cm->num_values - rank) / (1 - quant);
-        }
-        if (quant_min < min_val) min_val = quant_min;
+/**
+ * Builds the segments of the threshold for the current number
+ * of values. With the quantiles in order, up to the rank of the
+ * first the threshold is its falling line, and from the rank of
+ * each it is its rising line until that crosses the falling line
+ * of the next, which then holds until the rank of the next.
+ */
+static void cm_build_segments(cm_quantile *cm) {
+    double n = cm->num_values, e = 2 * cm->eps;
+    cm_segment *seg = cm->segments;
+
+    double *q = cm->quantiles;
+    *seg++ = (cm_segment){0, e * n / (1 - q[0]), -e / (1 - q[0])};
+    for (uint32_t i=0; i < cm->num_quantiles; i++) {
+        *seg++ = (cm_segment){q[i] * n, 0, e / q[i]};
+        if (i + 1 == cm->num_quantiles) break;
+        double next = q[i + 1];
+        *seg++ = (cm_segment){q[i] * n / (1 - next + q[i]), e * n / (1 - next), -e / (1 - next)};
     }
-
-    return min_val;
+    cm->segments_values = cm->num_values;
 }
 
+/**
+ * Computes the minimum threshold value, the least allowed error
+ * of all the quantiles at a rank. The segments are rebuilt when
+ * the number of values changed.
+ * @arg seg The segment of the last rank, updated for this one.
+ * Nearby ranks find it in a step or two.
+ */
+static inline uint64_t cm_threshold(cm_quantile *cm, uint64_t rank, uint32_t *seg) {
+    if (cm->segments_values != cm->num_values) cm_build_segments(cm);
+    cm_segment *segs = cm->segments;
+    uint32_t last = 2 * cm->num_quantiles - 1, i = *seg;
+    double r = rank;
+    while (i && r < segs[i].start) i--;
+    while (i < last && r >= segs[i + 1].start) i++;
+    *seg = i;
+    return segs[i].base + segs[i].slope * r;
+}
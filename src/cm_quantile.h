@@ -7,24 +7,29 @@
 #ifndef CM_QUANTILE_H
 #define CM_QUANTILE_H
 #include <stdint.h>
-#include "heap.h"
+#include "typed_heap.h"
 
 typedef struct cm_sample {
     double value;       // The sampled value
     uint64_t width;     // The number of ranks represented
     uint64_t delta;     // Delta between min/max rank
-    struct cm_sample *next;
-    struct cm_sample *prev;
 } cm_sample;
 
-struct cm_insert_cursor {
-    cm_sample *curs;
-};
+/**
+ * A piece of the error threshold over the ranks. The threshold
+ * is the least of a line per quantile, falling up to its rank
+ * and rising after it, so between two quantiles it is one of
+ * two lines, and it is kept as those lines and where they start.
+ */
+typedef struct {
+    double start;       // The first rank of the segment
+    double base;        // The threshold of the line at rank 0
+    double slope;       // The change of the threshold per rank
+} cm_segment;
 
-struct cm_compress_cursor {
-    cm_sample *curs;
-    uint64_t min_rank;
-};
+// The weighted values come out of the heap largest first
+#define CM_SAMPLE_AFTER(a, b) ((a).value > (b).value)
+TYPED_HEAP_DEFINE(cm_sample_heap, cm_sample, CM_SAMPLE_AFTER, MEM_TIMERS)
 
 typedef struct {
     double eps;  // Desired epsilon
@@ -35,12 +40,15 @@ typedef struct {
     uint64_t num_samples;   // Number of samples
     uint64_t num_values;    // Number of values added
 
-    cm_sample *samples;     // Sorted linked list of samples
-    cm_sample *end;         // Pointer to the end of the sampels
-    heap *bufLess, *bufMore;// Sample buffer
+    cm_sample *samples;     // Sorted array of samples
+    uint64_t samples_size;  // Allocated size of the samples array
+    double *buffer;         // Buffered values, merged in batches
+    uint32_t buffer_len;    // Number of buffered values
+    uint32_t buffer_size;   // Allocated size of the buffer
+    cm_sample_heap weighted; // Buffered values with a weight, merged with the values
 
-    struct cm_insert_cursor insert;     // Insertion cursor
-    struct cm_compress_cursor compress; // Compression cursor
+    cm_segment *segments;   // The threshold, two segments per quantile
+    uint64_t segments_values; // The num_values the segments were built for
 } cm_quantile;
 
 
@@ -69,6 +77,17 @@ int destroy_cm_quantile(cm_quantile *cm);
  */
 int cm_add_sample(cm_quantile *cm, double sample);
 
+/**
+ * Adds a new sample that stands for a number of values, such
+ * as a sampled timer. It is inserted once, spanning that many
+ * ranks, so the cost does not depend on the weight.
+ * @arg cm_quantile The cm_quantile to add to
+ * @arg sample The new sample value
+ * @arg weight The number of values the sample stands for, at least 1
+ * @return 0 on success.
+ */
+int cm_add_weighted(cm_quantile *cm, double sample, uint64_t weight);
+
 /**
  * Queries for a quantile value
  * @arg cm_quantile The cm_quantile to query
@@ -77,6 +96,27 @@ int cm_add_sample(cm_quantile *cm, double sample);
  */
 double cm_query(cm_quantile *cm, double quantile);
 
+/**
+ * Queries for several quantile values in a single
+ * walk of the samples. The results match cm_query.
+ * @arg cm_quantile The cm_quantile to query
+ * @arg quantiles A sorted array of the quantiles to query
+ * @arg num_quants The number of quantiles
+ * @arg values Output. The value of each quantile, or 0.
+ */
+void cm_query_many(cm_quantile *cm, const double *quantiles, int num_quants, double *values);
+
+/**
+ * Merges the samples of one CM quantile into another.
+ * Both are flushed, and the merged samples are compressed
+ * using the settings of the destination.
+ * @arg dst The cm_quantile to merge into
+ * @arg src The cm_quantile to merge from, it is not modified
+ * beyond being flushed.
+ * @return 0 on success.
+ */
+int cm_merge(cm_quantile *dst, cm_quantile *src);
+
 /**
  * Forces the internal buffers to be flushed,
  * this allows query to have maximum accuracy.
@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,6 +12,8 @@
 #include "config.h"
 #include "ini.h"
 #include "hll.h"
+#include "affinity.h"
+#include "name_map.h"
 
 /**
  * Static pointer used for
@@ -20,6 +23,58 @@
 static char* histogram_section;
 static histogram_config *in_progress;
 
+/**
+ * Static pointers used while we are still
+ * parsing the configs for a timer section.
+ */
+static char* timer_section;
+static timer_config *timer_in_progress;
+
+/**
+ * The counter section being parsed, and the config in progress
+ */
+static char* counter_section;
+static counter_config *counter_in_progress;
+
+/**
+ * The key/value section being parsed, and the config in progress
+ */
+static char* kv_section;
+static kv_config *kv_in_progress;
+
+/**
+ * The set section being parsed, and the config in progress
+ */
+static char* set_section;
+static set_config *set_in_progress;
+
+/**
+ * The limit section being parsed, and the config in progress
+ */
+static char* limit_section;
+static limit_config *limit_in_progress;
+
+/**
+ * The rollup section being parsed, and the config in progress
+ */
+static char* rollup_section;
+static rollup_config *rollup_in_progress;
+
+/**
+ * The sink section being parsed, and the config in progress
+ */
+static char* sink_section;
+static sink_config *sink_in_progress;
+
+/**
+ * The listener section being parsed, and the config in progress
+ */
+static char* listener_section;
+static listener_config *listener_in_progress;
+
+// The quantiles tracked for timers by default
+static double DEFAULT_QUANTILES[] = {0.5, 0.9, 0.95, 0.99};
+
 /**
  * Default statsite_config values. Should create
  * filters that are about 300KB initially, and suited
@@ -43,6 +98,108 @@ static const statsite_config DEFAULT_CONFIG = {
     NULL,
     0.02,               // 2% goal uses precision 12
     12,                 // Set precision 12, 1.6% variance
+    1,                  // Single ingest worker
+    false,              // Start the stream_cmd on every flush
+    NULL,               // No native Graphite output
+    2003,               // Carbon plaintext port
+    "statsite.",        // Graphite key prefix
+    16777216,           // Retain up to 16MB for Graphite
+    TIMER_ENGINE_CM,    // Biased quantiles for timers
+    100,                // t-digest compression
+    NULL,               // No per-prefix timer engines
+    NULL,
+    64,                 // Count up to 64 set items exactly
+    4194304,            // Connection buffers up to 4MB
+    0,                  // No connection buffer budget
+    1024,               // TCP listen backlog
+    0,                  // Kernel default UDP receive buffer
+    NULL,               // Do not track dropped datagrams
+    false,              // Do not emit internal stats
+    false,              // One binary record per value
+    1,                  // Serialize flushes on one thread
+    1,                  // One flush worker
+    4,                  // Up to 4 intervals waiting to be flushed
+    FLUSH_MERGE,        // Merge intervals when the queue is full
+    NULL,               // No spill directory
+    DEFAULT_QUANTILES,  // Track the median, p90, p95 and p99
+    4,
+    false,              // Counters keep all their statistics
+    NULL,               // No per-prefix counter modes
+    NULL,
+    false,              // Flush workers stream to the sink directly
+    67108864,           // Spool segments of 64MB
+    NULL,               // No snapshot, the last interval is flushed on shutdown
+    false,              // Receive UDP with recvmmsg
+    NULL,               // No Unix stream socket
+    NULL,               // No Unix datagram socket
+    NULL,               // No shared memory ring
+    4194304,            // 4MB shared memory ring
+    false,              // Stream metrics, not sketches
+    NULL,               // Aggregate, do not proxy
+    128,                // 128 points per proxy upstream
+    false,              // Proxy over TCP
+    NULL,               // No cardinality limits
+    NULL,
+    0,
+    NULL,               // Do not drop any prefixes
+    NULL,
+    false,              // Keep the keys without a matching rule
+    NULL,
+    0,                  // Do not track the heaviest keys
+    0,                  // Copy the key names every interval
+    0,                  // Lines are only bounded by the max buffer
+    true,               // Receive coalesced UDP datagrams, if supported
+    NULL,               // No AF_XDP ingest
+    1,
+    false,              // Filter the keys in userspace only
+    NULL,               // Threads run on any CPU
+    NULL,
+    NULL,
+    HUGE_PAGES_OFF,     // Tables and arenas use small pages
+    false,              // Workers aggregate their own samples
+    NULL,               // No rollups
+    COMPRESS_NONE,      // Output is not compressed
+    false,              // Keys are streamed in the order of the maps
+    false,
+    false,              // Output is streamed a metric at a time
+    NULL,               // No other sinks
+    0,                  // Wait for the stream_cmd to exit
+    false,              // Every gauge is streamed each interval
+    60,                 // With changes only, stream all the gauges every 60 intervals
+    NULL,               // No admin socket
+    0,                  // No memory budget
+    NULL,               // No set precisions by prefix
+    NULL,
+    NULL,               // No other listeners
+    false,              // The tags of a line are ignored
+    0,                  // Clients are not rate limited
+    0,                  // The burst is a second at the rate
+    NULL,               // No characters of the names are replaced
+    NULL,
+    NULL,               // No prefix on the output names
+    NULL,               // No suffix on the output names
+    false,              // The output is written to the stream_cmd
+    NULL,               // No output ring
+    16777216,           // 16MB output ring
+    false,              // The stream output is written through stdio
+    NULL,               // No InfluxDB output
+    8086,               // InfluxDB HTTP port
+    NULL,               // Write to the statsite database
+    5000,               // Post 5000 points at a time
+    4,                  // With 4 requests in flight
+    false,              // ASCII output
+    0,                  // The output is written by the flush thread
+    0,                  // Counters and gauges are kept by each shard
+    0,                  // The workers sleep until their sockets are ready
+    1,                  // A single stream_cmd takes each flush
+    0,                  // No priority connection buffer budget
+    0,                  // Timers insert every sample into their quantiles
+    SIMD_AUTO,          // The kernels of the widest instruction set of the host
+    NULL,               // No long windows for the sets
+    0,
+    12,                 // Each set window slides by a twelfth
+    NULL,               // Every key/value sample is streamed
+    NULL,
 };
 
 /**
@@ -81,6 +238,23 @@ static int value_to_int(const char *val, int *result) {
     return 1;
 }
 
+/**
+ * Attempts to convert a string to an unsigned 64bit
+ * integer, and write the value out.
+ * @arg val The string value
+ * @arg result The destination for the result
+ * @return 1 on success, 0 on error.
+ */
+static int value_to_uint64(const char *val, uint64_t *result) {
+    char *end;
+    unsigned long long res = strtoull(val, &end, 10);
+    if (end == val) {
+        return 0;
+    }
+    *result = res;
+    return 1;
+}
+
 /**
  * Attempts to convert a string to a double,
  * and write the value out.
@@ -92,6 +266,231 @@ static int value_to_double(const char *val, double *result) {
     return sscanf(val, "%lf", result);
 }
 
+// Orders doubles for qsort
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(double*)a, y = *(double*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Converts a comma or space separated list of quantiles
+ * to a sorted array, and writes out the array.
+ * @arg val The string value
+ * @arg result The destination for the malloc'ed array
+ * @arg num The destination for the number of quantiles
+ * @return 1 on success, 0 on error.
+ */
+static int value_to_quantiles(const char *val, double **result, int *num) {
+    double *quants = malloc(MAX_QUANTILES * sizeof(double));
+    int n = 0;
+    const char *pos = val;
+    char *end;
+    while (*pos) {
+        if (*pos == ',' || *pos == ' ' || *pos == '\t') {
+            pos++;
+            continue;
+        }
+        if (n == MAX_QUANTILES) {
+            syslog(LOG_ERR, "Cannot track more than %d quantiles!", MAX_QUANTILES);
+            free(quants);
+            return 0;
+        }
+        quants[n] = strtod(pos, &end);
+        if (end == pos) {
+            syslog(LOG_ERR, "Invalid quantile list: %s", val);
+            free(quants);
+            return 0;
+        }
+        n++;
+        pos = end;
+    }
+    qsort(quants, n, sizeof(double), compare_doubles);
+    *result = quants;
+    *num = n;
+    return 1;
+}
+
+// Orders ints for qsort
+static int compare_ints(const void *a, const void *b) {
+    int x = *(int*)a, y = *(int*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Converts a comma or space separated list of the seconds
+ * of set windows to a sorted array, and writes out the array.
+ * @arg val The string value
+ * @arg result The destination for the malloc'ed array
+ * @arg num The destination for the number of windows
+ * @return 1 on success, 0 on error.
+ */
+static int value_to_set_windows(const char *val, int **result, int *num) {
+    int *windows = malloc(MAX_SET_WINDOWS * sizeof(int));
+    int n = 0;
+    const char *pos = val;
+    char *end;
+    while (*pos) {
+        if (*pos == ',' || *pos == ' ' || *pos == '\t') {
+            pos++;
+            continue;
+        }
+        if (n == MAX_SET_WINDOWS) {
+            syslog(LOG_ERR, "Cannot keep more than %d set windows!", MAX_SET_WINDOWS);
+            free(windows);
+            return 0;
+        }
+        long window = strtol(pos, &end, 10);
+        if (end == pos || window <= 0 || window > INT32_MAX) {
+            syslog(LOG_ERR, "Invalid set window list: %s", val);
+            free(windows);
+            return 0;
+        }
+        windows[n++] = window;
+        pos = end;
+    }
+    qsort(windows, n, sizeof(int), compare_ints);
+    free(*result);
+    *result = windows;
+    *num = n;
+    return 1;
+}
+
+/**
+ * Attempts to convert a string to a timer engine,
+ * and write the value out.
+ * @arg val The string value
+ * @arg result The destination for the result
+ * @return 1 on success, 0 on error.
+ */
+static int value_to_timer_engine(const char *val, timer_engine *result) {
+    if (VAL_MATCH("cm")) {
+        *result = TIMER_ENGINE_CM;
+        return 1;
+    } else if (VAL_MATCH("tdigest")) {
+        *result = TIMER_ENGINE_TDIGEST;
+        return 1;
+    } else if (VAL_MATCH("hdr")) {
+        *result = TIMER_ENGINE_HDR;
+        return 1;
+    } else if (VAL_MATCH("stats")) {
+        *result = TIMER_ENGINE_STATS;
+        return 1;
+    }
+    syslog(LOG_ERR, "Unknown timer engine: %s", val);
+    return 0;
+}
+
+/**
+ * Converts a string to a key/value coalescing mode
+ * @return 1 on success, 0 on error
+ */
+static int value_to_kv_mode(const char *val, kv_mode *result) {
+    if (VAL_MATCH("all")) {
+        *result = KV_ALL;
+        return 1;
+    } else if (VAL_MATCH("last")) {
+        *result = KV_LAST;
+        return 1;
+    } else if (VAL_MATCH("sum")) {
+        *result = KV_SUM;
+        return 1;
+    } else if (VAL_MATCH("min")) {
+        *result = KV_MIN;
+        return 1;
+    } else if (VAL_MATCH("max")) {
+        *result = KV_MAX;
+        return 1;
+    } else if (VAL_MATCH("mean")) {
+        *result = KV_MEAN;
+        return 1;
+    }
+    syslog(LOG_ERR, "Unknown key/value coalescing: %s", val);
+    return 0;
+}
+
+/**
+ * Converts a string to a flush queue policy
+ * @return 1 on success, 0 on error
+ */
+static int value_to_flush_policy(const char *val, flush_policy *result) {
+    if (VAL_MATCH("merge")) {
+        *result = FLUSH_MERGE;
+        return 1;
+    } else if (VAL_MATCH("spill")) {
+        *result = FLUSH_SPILL;
+        return 1;
+    } else if (VAL_MATCH("drop")) {
+        *result = FLUSH_DROP;
+        return 1;
+    }
+    syslog(LOG_ERR, "Unknown flush queue policy: %s", val);
+    return 0;
+}
+
+/**
+ * Converts a string to a histogram scale
+ * @return 1 on success, 0 on error
+ */
+static int value_to_histogram_scale(const char *val, histogram_scale *result) {
+    if (VAL_MATCH("linear")) {
+        *result = HISTOGRAM_LINEAR;
+        return 1;
+    } else if (VAL_MATCH("log")) {
+        *result = HISTOGRAM_LOG;
+        return 1;
+    } else if (VAL_MATCH("auto")) {
+        *result = HISTOGRAM_AUTO;
+        return 1;
+    }
+    syslog(LOG_ERR, "Unknown histogram scale: %s", val);
+    return 0;
+}
+
+/**
+ * Converts a string to a huge pages mode
+ * @return 1 on success, 0 on error
+ */
+static int value_to_huge_pages(const char *val, huge_pages_mode *result) {
+    if (VAL_MATCH("off")) {
+        *result = HUGE_PAGES_OFF;
+        return 1;
+    } else if (VAL_MATCH("transparent")) {
+        *result = HUGE_PAGES_TRANSPARENT;
+        return 1;
+    } else if (VAL_MATCH("explicit")) {
+        *result = HUGE_PAGES_EXPLICIT;
+        return 1;
+    }
+    syslog(LOG_ERR, "Unknown huge pages mode: %s", val);
+    return 0;
+}
+
+/**
+ * Converts a string to an output compression
+ * @return 1 on success, 0 on error
+ */
+static int value_to_output_compression(const char *val, output_compression *result) {
+    if (VAL_MATCH("none")) {
+        *result = COMPRESS_NONE;
+        return 1;
+    } else if (VAL_MATCH("lz4")) {
+        *result = COMPRESS_LZ4;
+        return 1;
+    }
+    syslog(LOG_ERR, "Unknown output compression: %s", val);
+    return 0;
+}
+
+/**
+ * Converts a string to an instruction set for the kernels
+ * @return 1 on success, 0 on error
+ */
+static int value_to_simd_level(const char *val, simd_level *result) {
+    if (!simd_parse(val, result)) return 1;
+    syslog(LOG_ERR, "Unknown instruction set: %s", val);
+    return 0;
+}
+
 /**
  * Callback function to use with INIH for parsing histogram configs
  * @arg user Opaque value. Actually a statsite_config pointer
@@ -106,284 +505,1564 @@ static int histogram_callback(void* user, const char* section, const char* name,
         return 0;
     }
 
+    // Cast the user handle
+    statsite_config *config = (statsite_config*)user;
+
+    // Optional settings may follow the required ones,
+    // so those update the config that was just finished
+    histogram_config *conf = in_progress;
+    if (!conf && histogram_section && !strcasecmp(histogram_section, section)) {
+        conf = config->hist_configs;
+
     // Ensure we have something in progress
-    if (!in_progress) {
-        in_progress = calloc(1, sizeof(histogram_config));
+    } else if (!conf) {
+        free(histogram_section);
+        conf = in_progress = calloc(1, sizeof(histogram_config));
         histogram_section = strdup(section);
+        conf->eps = HISTOGRAM_AUTO_EPS;
+        conf->max_bins = HISTOGRAM_AUTO_MAX_BINS;
     }
 
-    // Cast the user handle
-    statsite_config *config = (statsite_config*)user;
-
     // Switch on the config
     #define NAME_MATCH(param) (strcasecmp(param, name) == 0)
 
     int res = 1;
     if (NAME_MATCH("prefix")) {
-        in_progress->parts |= 1;
-        in_progress->prefix = strdup(value);
+        conf->parts |= 1;
+        free(conf->prefix);
+        conf->prefix = strdup(value);
 
     } else if (NAME_MATCH("min")) {
-        in_progress->parts |= 1 << 1;
-        res = value_to_double(value, &in_progress->min_val);
+        conf->parts |= 1 << 1;
+        res = value_to_double(value, &conf->min_val);
 
     } else if (NAME_MATCH("max")) {
-        in_progress->parts |= 1 << 2;
-        res = value_to_double(value, &in_progress->max_val);
+        conf->parts |= 1 << 2;
+        res = value_to_double(value, &conf->max_val);
 
     } else if (NAME_MATCH("width")) {
-        in_progress->parts |= 1 << 3;
-        res = value_to_double(value, &in_progress->bin_width);
+        conf->parts |= 1 << 3;
+        res = value_to_double(value, &conf->bin_width);
+
+    } else if (NAME_MATCH("scale")) {
+        res = value_to_histogram_scale(value, &conf->scale);
+
+    } else if (NAME_MATCH("eps")) {
+        res = value_to_double(value, &conf->eps);
+
+    } else if (NAME_MATCH("max_bins")) {
+        res = value_to_int(value, &conf->max_bins);
+
+    } else if (NAME_MATCH("skip_empty")) {
+        res = value_to_bool(value, &conf->skip_empty);
 
     } else {
         syslog(LOG_NOTICE, "Unrecognized histogram config parameter: %s", value);
     }
 
-    // Check if this config is done, and push into the list of configs
-    if (in_progress->parts == 15) {
+    // Check if this config is done, and push into the list of configs.
+    // Automatic histograms only need the prefix. The section is kept
+    // until the next one, for the optional settings.
+    if (in_progress && (in_progress->parts == 15 ||
+                (in_progress->scale == HISTOGRAM_AUTO && (in_progress->parts & 1)))) {
         in_progress->next = config->hist_configs;
         config->hist_configs = in_progress;
         in_progress = NULL;
-        free(histogram_section);
-        histogram_section = NULL;
     }
     return res;
 }
 
 /**
- * Callback function to use with INI-H.
- * @arg user Opaque user value. We use the statsite_config pointer
- * @arg section The INI seciton
+ * Callback function to use with INIH for parsing timer configs
+ * @arg user Opaque value. Actually a statsite_config pointer
  * @arg name The config name
- * @arg value The config value
- * @return 1 on success.
+ * @value = The config value
+ * @return 1 on success
  */
-static int config_callback(void* user, const char* section, const char* name, const char* value) {
-    // Specially handle histogram sections
-    if (strncasecmp("histogram", section, 9) == 0) {
-        return histogram_callback(user, section, name, value);
-    }
-
-    // Ignore any non-statsite sections
-    if (strcasecmp("statsite", section) != 0) {
+static int timer_callback(void* user, const char* section, const char* name, const char* value) {
+    // Make sure we don't change sections with an unfinished config
+    if (timer_in_progress && strcasecmp(timer_section, section)) {
+        syslog(LOG_WARNING, "Unfinished configuration for section: %s", timer_section);
         return 0;
     }
 
     // Cast the user handle
     statsite_config *config = (statsite_config*)user;
 
-    // Switch on the config
-    #define NAME_MATCH(param) (strcasecmp(param, name) == 0)
+    // Only the prefix is required, so the optional settings
+    // that follow it update the config that was just finished
+    timer_config *conf = timer_in_progress;
+    if (!conf && timer_section && !strcasecmp(timer_section, section)) {
+        conf = config->timer_configs;
 
-    // Handle the int cases
-    if (NAME_MATCH("port")) {
-        return value_to_int(value, &config->tcp_port);
-    } else if (NAME_MATCH("tcp_port")) {
-        return value_to_int(value, &config->tcp_port);
-    } else if (NAME_MATCH("udp_port")) {
-        return value_to_int(value, &config->udp_port);
-    } else if (NAME_MATCH("flush_interval")) {
-         return value_to_int(value, &config->flush_interval);
-    } else if (NAME_MATCH("parse_stdin")) {
-        return value_to_bool(value, &config->parse_stdin);
-    } else if (NAME_MATCH("daemonize")) {
-        return value_to_bool(value, &config->daemonize);
-    } else if (NAME_MATCH("binary_stream")) {
-        return value_to_bool(value, &config->binary_stream);
+    // Ensure we have something in progress
+    } else if (!conf) {
+        free(timer_section);
+        conf = timer_in_progress = calloc(1, sizeof(timer_config));
+        timer_section = strdup(section);
+    }
 
-    // Handle the double cases
-    } else if (NAME_MATCH("timer_eps")) {
-        return value_to_double(value, &config->timer_eps);
-    } else if (NAME_MATCH("set_eps")) {
-        return value_to_double(value, &config->set_eps);
+    int res = 1;
+    if (NAME_MATCH("prefix")) {
+        conf->parts |= 1;
+        free(conf->prefix);
+        conf->prefix = strdup(value);
 
-    // Copy the string values
-    } else if (NAME_MATCH("log_level")) {
-        config->log_level = strdup(value);
-    } else if (NAME_MATCH("stream_cmd")) {
-        config->stream_cmd = strdup(value);
-    } else if (NAME_MATCH("pid_file")) {
-        config->pid_file = strdup(value);
-    } else if (NAME_MATCH("input_counter")) {
-        config->input_counter = strdup(value);
-    } else if (NAME_MATCH("bind_address")) {
-        config->bind_address = strdup(value);
+    } else if (NAME_MATCH("engine")) {
+        conf->has_engine = true;
+        res = value_to_timer_engine(value, &conf->engine);
+
+    } else if (NAME_MATCH("quantiles")) {
+        free(conf->quantiles);
+        conf->quantiles = NULL;
+        res = value_to_quantiles(value, &conf->quantiles, &conf->num_quantiles);
+
+    } else if (NAME_MATCH("eps")) {
+        res = value_to_double(value, &conf->eps);
+
+    } else if (NAME_MATCH("compression")) {
+        res = value_to_double(value, &conf->compression);
 
-    // Unknown parameter?
     } else {
-        // Log it, but ignore
-        syslog(LOG_NOTICE, "Unrecognized config parameter: %s", value);
+        syslog(LOG_NOTICE, "Unrecognized timer config parameter: %s", value);
     }
 
-    // Success
-    return 1;
+    // Check if this config is done, and push into the list of configs.
+    // The section is kept until the next one, for the optional settings.
+    if (timer_in_progress && timer_in_progress->parts == 1) {
+        timer_in_progress->next = config->timer_configs;
+        config->timer_configs = timer_in_progress;
+        timer_in_progress = NULL;
+    }
+    return res;
 }
 
 /**
- * Initializes the configuration from a filename.
- * Reads the file as an INI configuration, and sets up the
- * config object.
- * @arg filename The name of the file to read. NULL for defaults.
- * @arg config Output. The config object to initialize.
- * @return 0 on success, negative on error.
+ * Callback function to use with INIH for parsing counter configs
+ * @arg user Opaque value. Actually a statsite_config pointer
+ * @arg name The config name
+ * @value = The config value
+ * @return 1 on success
  */
-int config_from_filename(char *filename, statsite_config *config) {
-    // Initialize to the default values
-    memcpy(config, &DEFAULT_CONFIG, sizeof(statsite_config));
-
-    // If there is no filename, return now
-    if (filename == NULL)
+static int counter_callback(void* user, const char* section, const char* name, const char* value) {
+    // Make sure we don't change sections with an unfinished config
+    if (counter_in_progress && strcasecmp(counter_section, section)) {
+        syslog(LOG_WARNING, "Unfinished configuration for section: %s", counter_section);
         return 0;
-
-    // Try to open the file
-    int res = ini_parse(filename, config_callback, config);
-    if (res == -1) {
-        return -ENOENT;
-    } else if (res) {
-        syslog(LOG_ERR, "Failed to parse config on line: %d", res);
-        return -res;
     }
 
-    // Check for an unfinished histogram
-    if (in_progress) {
-        syslog(LOG_WARNING, "Unfinished configuration for section: %s", histogram_section);
-        free(histogram_section);
-        free(in_progress);
-        in_progress = NULL;
-        histogram_section = NULL;
+    // Cast the user handle
+    statsite_config *config = (statsite_config*)user;
+
+    // Only the prefix is required, so the optional settings
+    // that follow it update the config that was just finished
+    counter_config *conf = counter_in_progress;
+    if (!conf && counter_section && !strcasecmp(counter_section, section)) {
+        conf = config->counter_configs;
+
+    // Ensure we have something in progress
+    } else if (!conf) {
+        free(counter_section);
+        conf = counter_in_progress = calloc(1, sizeof(counter_config));
+        conf->sum_only = true;
+        counter_section = strdup(section);
     }
 
-    return 0;
-}
+    int res = 1;
+    if (NAME_MATCH("prefix")) {
+        conf->parts |= 1;
+        free(conf->prefix);
+        conf->prefix = strdup(value);
+
+    } else if (NAME_MATCH("sum_only")) {
+        res = value_to_bool(value, &conf->sum_only);
+
+    } else {
+        syslog(LOG_NOTICE, "Unrecognized counter config parameter: %s", value);
+    }
+
+    // Check if this config is done, and push into the list of configs.
+    // The section is kept until the next one, for the optional settings.
+    if (counter_in_progress && counter_in_progress->parts == 1) {
+        counter_in_progress->next = config->counter_configs;
+        config->counter_configs = counter_in_progress;
+        counter_in_progress = NULL;
+    }
+    return res;
+}
 
 /**
- * Joins two strings as part of a path,
- * and adds a separating slash if needed.
- * @param path Part one of the path
- * @param part2 The second part of the path
- * @return A new string, that uses a malloc()'d buffer.
+ * Callback function to use with INIH for parsing key/value configs
+ * @arg user Opaque value. Actually a statsite_config pointer
+ * @arg name The config name
+ * @value = The config value
+ * @return 1 on success
  */
-char* join_path(char *path, char *part2) {
-    // Check for the end slash
-    int len = strlen(path);
-    int has_end_slash = path[len-1] == '/';
+static int kv_callback(void* user, const char* section, const char* name, const char* value) {
+    // Make sure we don't change sections with an unfinished config
+    if (kv_in_progress && strcasecmp(kv_section, section)) {
+        syslog(LOG_WARNING, "Unfinished configuration for section: %s", kv_section);
+        return 0;
+    }
 
-    // Use the proper format string
-    char *buf;
-    int res;
-    if (has_end_slash)
-        res = asprintf(&buf, "%s%s", path, part2);
-    else
-        res = asprintf(&buf, "%s/%s", path, part2);
-    assert(res != -1);
+    // Cast the user handle
+    statsite_config *config = (statsite_config*)user;
 
-    // Return the new buffer
-    return buf;
+    // Only the prefix is required, so the optional settings
+    // that follow it update the config that was just finished
+    kv_config *conf = kv_in_progress;
+    if (!conf && kv_section && !strcasecmp(kv_section, section)) {
+        conf = config->kv_configs;
+
+    // Ensure we have something in progress
+    } else if (!conf) {
+        free(kv_section);
+        conf = kv_in_progress = calloc(1, sizeof(kv_config));
+        conf->mode = KV_LAST;
+        kv_section = strdup(section);
+    }
+
+    int res = 1;
+    if (NAME_MATCH("prefix")) {
+        conf->parts |= 1;
+        free(conf->prefix);
+        conf->prefix = strdup(value);
+
+    } else if (NAME_MATCH("coalesce")) {
+        res = value_to_kv_mode(value, &conf->mode);
+
+    } else {
+        syslog(LOG_NOTICE, "Unrecognized key/value config parameter: %s", value);
+    }
+
+    // Check if this config is done, and push into the list of configs.
+    // The section is kept until the next one, for the optional settings.
+    if (kv_in_progress && kv_in_progress->parts == 1) {
+        kv_in_progress->next = config->kv_configs;
+        config->kv_configs = kv_in_progress;
+        kv_in_progress = NULL;
+    }
+    return res;
 }
 
-int sane_log_level(char *log_level, int *syslog_level) {
-    #define LOG_MATCH(lvl) (strcasecmp(lvl, log_level) == 0)
-    if (LOG_MATCH("DEBUG")) {
-        *syslog_level = LOG_UPTO(LOG_DEBUG);
-    } else if (LOG_MATCH("INFO")) {
-        *syslog_level = LOG_UPTO(LOG_INFO);
-    } else if (LOG_MATCH("WARN")) {
-        *syslog_level = LOG_UPTO(LOG_WARNING);
-    } else if (LOG_MATCH("ERROR")) {
-        *syslog_level = LOG_UPTO(LOG_ERR);
-    } else if (LOG_MATCH("CRITICAL")) {
-        *syslog_level = LOG_UPTO(LOG_CRIT);
+/**
+ * Callback function to use with INIH for parsing set configs
+ * @arg user Opaque value. Actually a statsite_config pointer
+ * @arg name The config name
+ * @value = The config value
+ * @return 1 on success
+ */
+static int set_callback(void* user, const char* section, const char* name, const char* value) {
+    // Make sure we don't change sections with an unfinished config
+    if (set_in_progress && strcasecmp(set_section, section)) {
+        syslog(LOG_WARNING, "Unfinished configuration for section: %s", set_section);
+        return 0;
+    }
+
+    // Cast the user handle
+    statsite_config *config = (statsite_config*)user;
+
+    // Ensure we have something in progress
+    set_config *conf = set_in_progress;
+    if (!conf) {
+        free(set_section);
+        conf = set_in_progress = calloc(1, sizeof(set_config));
+        set_section = strdup(section);
+    }
+
+    int res = 1;
+    if (NAME_MATCH("prefix")) {
+        conf->parts |= 1;
+        free(conf->prefix);
+        conf->prefix = strdup(value);
+
+    } else if (NAME_MATCH("eps")) {
+        conf->parts |= 1 << 1;
+        res = value_to_double(value, &conf->eps);
+
     } else {
-        syslog(LOG_ERR, "Unknown log level!");
+        syslog(LOG_NOTICE, "Unrecognized set config parameter: %s", value);
+    }
+
+    // Check if this config is done, and push into the list of configs
+    if (set_in_progress && set_in_progress->parts == 3) {
+        set_in_progress->next = config->set_configs;
+        config->set_configs = set_in_progress;
+        set_in_progress = NULL;
+    }
+    return res;
+}
+
+/**
+ * Callback function to use with INIH for parsing limit configs
+ * @arg user Opaque value. Actually a statsite_config pointer
+ * @arg name The config name
+ * @value = The config value
+ * @return 1 on success
+ */
+static int limit_callback(void* user, const char* section, const char* name, const char* value) {
+    // Make sure we don't change sections with an unfinished config
+    if (limit_in_progress && strcasecmp(limit_section, section)) {
+        syslog(LOG_WARNING, "Unfinished configuration for section: %s", limit_section);
+        return 0;
+    }
+
+    // Cast the user handle
+    statsite_config *config = (statsite_config*)user;
+
+    // Ensure we have something in progress
+    limit_config *conf = limit_in_progress;
+    if (!conf) {
+        free(limit_section);
+        conf = limit_in_progress = calloc(1, sizeof(limit_config));
+        limit_section = strdup(section);
+    }
+
+    int res = 1;
+    if (NAME_MATCH("prefix")) {
+        conf->parts |= 1;
+        free(conf->prefix);
+        conf->prefix = strdup(value);
+
+    } else if (NAME_MATCH("max_keys")) {
+        conf->parts |= 1 << 1;
+        res = value_to_int(value, &conf->max_keys);
+
+    } else {
+        syslog(LOG_NOTICE, "Unrecognized limit config parameter: %s", value);
+    }
+
+    // Check if this config is done, and push into the list of configs
+    if (limit_in_progress && limit_in_progress->parts == 3) {
+        limit_in_progress->next = config->limit_configs;
+        config->limit_configs = limit_in_progress;
+        limit_in_progress = NULL;
+    }
+    return res;
+}
+
+/**
+ * Callback function to use with INIH for parsing rollup configs
+ * @arg user Opaque value. Actually a statsite_config pointer
+ * @arg name The config name
+ * @value = The config value
+ * @return 1 on success
+ */
+static int rollup_callback(void* user, const char* section, const char* name, const char* value) {
+    // Make sure we don't change sections with an unfinished config
+    if (rollup_in_progress && strcasecmp(rollup_section, section)) {
+        syslog(LOG_WARNING, "Unfinished configuration for section: %s", rollup_section);
+        return 0;
+    }
+
+    // Cast the user handle
+    statsite_config *config = (statsite_config*)user;
+
+    // Ensure we have something in progress
+    rollup_config *conf = rollup_in_progress;
+    if (!conf) {
+        free(rollup_section);
+        conf = rollup_in_progress = calloc(1, sizeof(rollup_config));
+        rollup_section = strdup(section);
+    }
+
+    int res = 1;
+    if (NAME_MATCH("interval")) {
+        conf->parts |= 1;
+        res = value_to_int(value, &conf->interval);
+
+    } else if (NAME_MATCH("stream_cmd")) {
+        conf->parts |= 1 << 1;
+        free(conf->stream_cmd);
+        conf->stream_cmd = strdup(value);
+
+    } else {
+        syslog(LOG_NOTICE, "Unrecognized rollup config parameter: %s", value);
+    }
+
+    // Check if this config is done, and push into the list of configs
+    if (rollup_in_progress && rollup_in_progress->parts == 3) {
+        rollup_in_progress->next = config->rollup_configs;
+        config->rollup_configs = rollup_in_progress;
+        rollup_in_progress = NULL;
+    }
+    return res;
+}
+
+/**
+ * Callback function to use with INIH for parsing sink configs
+ * @arg user Opaque user value. We use the statsite_config pointer
+ * @arg section The INI seciton
+ * @arg name The config name
+ * @arg value The config value
+ * @return 1 on success.
+ */
+static int sink_callback(void* user, const char* section, const char* name, const char* value) {
+    // Make sure we don't change sections with an unfinished config
+    if (sink_in_progress && strcasecmp(sink_section, section)) {
+        syslog(LOG_WARNING, "Unfinished configuration for section: %s", sink_section);
+        return 0;
+    }
+
+    // Cast the user handle
+    statsite_config *config = (statsite_config*)user;
+
+    // Ensure we have something in progress. The timeout is optional,
+    // so it may follow the command of a finished section.
+    sink_config *conf = sink_in_progress;
+    if (!conf && sink_section && !strcasecmp(sink_section, section)) {
+        conf = config->sink_configs;
+    }
+    if (!conf) {
+        free(sink_section);
+        conf = sink_in_progress = calloc(1, sizeof(sink_config));
+        sink_section = strdup(section);
+        conf->name = strdup(section + 5);
+    }
+
+    int res = 1;
+    if (NAME_MATCH("stream_cmd")) {
+        conf->parts |= 1;
+        free(conf->stream_cmd);
+        conf->stream_cmd = strdup(value);
+
+    } else if (NAME_MATCH("timeout_ms")) {
+        res = value_to_int(value, &conf->timeout_ms);
+
+    } else {
+        syslog(LOG_NOTICE, "Unrecognized sink config parameter: %s", value);
+    }
+
+    // Check if this config is done, and push into the list of configs
+    if (sink_in_progress && sink_in_progress->parts == 1) {
+        sink_in_progress->next = config->sink_configs;
+        config->sink_configs = sink_in_progress;
+        sink_in_progress = NULL;
+    }
+    return res;
+}
+
+/**
+ * Callback function to use with INIH for parsing listener configs
+ * @arg user Opaque user value. We use the statsite_config pointer
+ * @arg section The INI seciton
+ * @arg name The config name
+ * @arg value The config value
+ * @return 1 on success.
+ */
+static int listener_callback(void* user, const char* section, const char* name, const char* value) {
+    // Make sure we don't change sections with an unfinished config
+    if (listener_in_progress && strcasecmp(listener_section, section)) {
+        syslog(LOG_WARNING, "Unfinished configuration for section: %s", listener_section);
+        return 0;
+    }
+
+    // Cast the user handle
+    statsite_config *config = (statsite_config*)user;
+
+    // Ensure we have something in progress. The other options are
+    // optional, so they may follow the port of a finished section.
+    listener_config *conf = listener_in_progress;
+    if (!conf && listener_section && !strcasecmp(listener_section, section)) {
+        conf = config->listener_configs;
+    }
+    if (!conf) {
+        free(listener_section);
+        conf = listener_in_progress = calloc(1, sizeof(listener_config));
+        listener_section = strdup(section);
+        conf->name = strdup(section + 9);
+        conf->worker = -1;
+    }
+
+    int res = 1;
+    if (NAME_MATCH("protocol")) {
+        if (!strcasecmp(value, "tcp")) {
+            conf->protocol = LISTEN_TCP;
+        } else if (!strcasecmp(value, "udp")) {
+            conf->protocol = LISTEN_UDP;
+        } else {
+            syslog(LOG_ERR, "Unknown listener protocol: %s", value);
+            return 0;
+        }
+        conf->parts |= 1;
+
+    } else if (NAME_MATCH("port")) {
+        conf->parts |= 1 << 1;
+        res = value_to_int(value, &conf->port);
+
+    } else if (NAME_MATCH("bind_address")) {
+        free(conf->bind_address);
+        conf->bind_address = strdup(value);
+
+    } else if (NAME_MATCH("udp_rcvbuf")) {
+        res = value_to_int(value, &conf->udp_rcvbuf);
+
+    } else if (NAME_MATCH("worker")) {
+        res = value_to_int(value, &conf->worker);
+
+    } else if (NAME_MATCH("priority")) {
+        res = value_to_bool(value, &conf->priority);
+
+    } else {
+        syslog(LOG_NOTICE, "Unrecognized listener config parameter: %s", value);
+    }
+
+    // Check if this config is done, and push into the list of configs
+    if (listener_in_progress && listener_in_progress->parts == 3) {
+        listener_in_progress->next = config->listener_configs;
+        config->listener_configs = listener_in_progress;
+        listener_in_progress = NULL;
+    }
+    return res;
+}
+
+/**
+ * Callback function to use with INI-H.
+ * @arg user Opaque user value. We use the statsite_config pointer
+ * @arg section The INI seciton
+ * @arg name The config name
+ * @arg value The config value
+ * @return 1 on success.
+ */
+static int config_callback(void* user, const char* section, const char* name, const char* value) {
+    // Specially handle histogram sections
+    if (strncasecmp("histogram", section, 9) == 0) {
+        return histogram_callback(user, section, name, value);
+    }
+
+    // Specially handle timer sections
+    if (strncasecmp("timer_", section, 6) == 0) {
+        return timer_callback(user, section, name, value);
+    }
+
+    // Specially handle counter sections
+    if (strncasecmp("counter_", section, 8) == 0) {
+        return counter_callback(user, section, name, value);
+    }
+
+    // Specially handle key/value sections
+    if (strncasecmp("kv_", section, 3) == 0) {
+        return kv_callback(user, section, name, value);
+    }
+
+    // Specially handle set sections
+    if (strncasecmp("set_", section, 4) == 0) {
+        return set_callback(user, section, name, value);
+    }
+
+    // Specially handle limit sections
+    if (strncasecmp("limit_", section, 6) == 0) {
+        return limit_callback(user, section, name, value);
+    }
+
+    // Specially handle rollup sections
+    if (strncasecmp("rollup_", section, 7) == 0) {
+        return rollup_callback(user, section, name, value);
+    }
+
+    // Specially handle sink sections
+    if (strncasecmp("sink_", section, 5) == 0) {
+        return sink_callback(user, section, name, value);
+    }
+
+    // Specially handle listener sections
+    if (strncasecmp("listener_", section, 9) == 0) {
+        return listener_callback(user, section, name, value);
+    }
+
+    // Ignore any non-statsite sections
+    if (strcasecmp("statsite", section) != 0) {
+        return 0;
+    }
+
+    // Cast the user handle
+    statsite_config *config = (statsite_config*)user;
+
+    // Switch on the config
+    #define NAME_MATCH(param) (strcasecmp(param, name) == 0)
+
+    // Handle the int cases
+    if (NAME_MATCH("port")) {
+        return value_to_int(value, &config->tcp_port);
+    } else if (NAME_MATCH("tcp_port")) {
+        return value_to_int(value, &config->tcp_port);
+    } else if (NAME_MATCH("udp_port")) {
+        return value_to_int(value, &config->udp_port);
+    } else if (NAME_MATCH("flush_interval")) {
+         return value_to_int(value, &config->flush_interval);
+    } else if (NAME_MATCH("worker_threads")) {
+         return value_to_int(value, &config->worker_threads);
+    } else if (NAME_MATCH("graphite_port")) {
+         return value_to_int(value, &config->graphite_port);
+    } else if (NAME_MATCH("graphite_max_buffer")) {
+         return value_to_int(value, &config->graphite_max_buffer);
+    } else if (NAME_MATCH("stream_async_buffers")) {
+         return value_to_int(value, &config->stream_async_buffers);
+    } else if (NAME_MATCH("shared_counter_keys")) {
+         return value_to_int(value, &config->shared_counter_keys);
+    } else if (NAME_MATCH("busy_poll_us")) {
+         return value_to_int(value, &config->busy_poll_us);
+    } else if (NAME_MATCH("sink_parallelism")) {
+         return value_to_int(value, &config->sink_parallelism);
+    } else if (NAME_MATCH("timer_admission_threshold")) {
+         return value_to_int(value, &config->timer_admission_threshold);
+    } else if (NAME_MATCH("set_window_slots")) {
+         return value_to_int(value, &config->set_window_slots);
+    } else if (NAME_MATCH("influx_port")) {
+         return value_to_int(value, &config->influx_port);
+    } else if (NAME_MATCH("influx_batch_size")) {
+         return value_to_int(value, &config->influx_batch_size);
+    } else if (NAME_MATCH("influx_connections")) {
+         return value_to_int(value, &config->influx_connections);
+    } else if (NAME_MATCH("intern_idle_intervals")) {
+        return value_to_int(value, &config->intern_idle_intervals);
+    } else if (NAME_MATCH("stream_timeout_ms")) {
+        return value_to_int(value, &config->stream_timeout_ms);
+    } else if (NAME_MATCH("gauge_refresh_intervals")) {
+        return value_to_int(value, &config->gauge_refresh_intervals);
+    } else if (NAME_MATCH("max_line_length")) {
+        return value_to_int(value, &config->max_line_length);
+    } else if (NAME_MATCH("top_keys")) {
+        return value_to_int(value, &config->top_keys);
+    } else if (NAME_MATCH("set_max_exact")) {
+        return value_to_int(value, &config->set_max_exact);
+    } else if (NAME_MATCH("conn_max_buffer")) {
+        return value_to_int(value, &config->conn_max_buffer);
+    } else if (NAME_MATCH("conn_buffer_budget")) {
+        return value_to_uint64(value, &config->conn_buffer_budget);
+    } else if (NAME_MATCH("priority_buffer_budget")) {
+        return value_to_uint64(value, &config->priority_buffer_budget);
+    } else if (NAME_MATCH("memory_budget")) {
+        return value_to_uint64(value, &config->memory_budget);
+    } else if (NAME_MATCH("tcp_backlog")) {
+        return value_to_int(value, &config->tcp_backlog);
+    } else if (NAME_MATCH("udp_rcvbuf")) {
+        return value_to_int(value, &config->udp_rcvbuf);
+    } else if (NAME_MATCH("udp_drop_filter")) {
+        return value_to_bool(value, &config->udp_drop_filter);
+    } else if (NAME_MATCH("client_rate_limit")) {
+        return value_to_int(value, &config->client_rate_limit);
+    } else if (NAME_MATCH("client_rate_burst")) {
+        return value_to_int(value, &config->client_rate_burst);
+    } else if (NAME_MATCH("name_map_from")) {
+        config->name_map_from = strdup(value);
+    } else if (NAME_MATCH("name_map_to")) {
+        config->name_map_to = strdup(value);
+    } else if (NAME_MATCH("name_prefix")) {
+        config->name_prefix = strdup(value);
+    } else if (NAME_MATCH("name_suffix")) {
+        config->name_suffix = strdup(value);
+    } else if (NAME_MATCH("ingest_pipeline")) {
+        return value_to_bool(value, &config->ingest_pipeline);
+    } else if (NAME_MATCH("udp_gro")) {
+        return value_to_bool(value, &config->udp_gro);
+    } else if (NAME_MATCH("udp_drop_counter")) {
+        config->udp_drop_counter = strdup(value);
+    } else if (NAME_MATCH("internal_stats")) {
+        return value_to_bool(value, &config->internal_stats);
+    } else if (NAME_MATCH("binary_stream_grouped")) {
+        return value_to_bool(value, &config->binary_stream_grouped);
+    } else if (NAME_MATCH("binary_stream_front_coded")) {
+        return value_to_bool(value, &config->binary_stream_front_coded);
+    } else if (NAME_MATCH("columnar_stream")) {
+        return value_to_bool(value, &config->columnar_stream);
+    } else if (NAME_MATCH("json_stream")) {
+        return value_to_bool(value, &config->json_stream);
+    } else if (NAME_MATCH("gauge_changes_only")) {
+        return value_to_bool(value, &config->gauge_changes_only);
+    } else if (NAME_MATCH("stream_splice")) {
+        return value_to_bool(value, &config->stream_splice);
+    } else if (NAME_MATCH("stream_gather")) {
+        return value_to_bool(value, &config->stream_gather);
+    } else if (NAME_MATCH("sorted_output")) {
+        return value_to_bool(value, &config->sorted_output);
+    } else if (NAME_MATCH("flush_threads")) {
+         return value_to_int(value, &config->flush_threads);
+    } else if (NAME_MATCH("flush_workers")) {
+         return value_to_int(value, &config->flush_workers);
+    } else if (NAME_MATCH("flush_queue")) {
+         return value_to_int(value, &config->flush_queue);
+    } else if (NAME_MATCH("flush_queue_policy")) {
+        return value_to_flush_policy(value, &config->flush_queue_policy);
+    } else if (NAME_MATCH("flush_spill_dir")) {
+        config->flush_spill_dir = strdup(value);
+    } else if (NAME_MATCH("quantiles")) {
+        return value_to_quantiles(value, &config->quantiles, &config->num_quantiles);
+    } else if (NAME_MATCH("set_windows")) {
+        return value_to_set_windows(value, &config->set_windows, &config->num_set_windows);
+    } else if (NAME_MATCH("counter_sum_only")) {
+        return value_to_bool(value, &config->counter_sum_only);
+    } else if (NAME_MATCH("flush_spool")) {
+        return value_to_bool(value, &config->flush_spool);
+    } else if (NAME_MATCH("flush_spool_segment")) {
+        return value_to_int(value, &config->flush_spool_segment);
+    } else if (NAME_MATCH("xdp_queues")) {
+        return value_to_int(value, &config->xdp_queues);
+    } else if (NAME_MATCH("shm_ring_size")) {
+        return value_to_int(value, &config->shm_ring_size);
+    } else if (NAME_MATCH("output_ring_size")) {
+        return value_to_int(value, &config->output_ring_size);
+    } else if (NAME_MATCH("proxy_vnodes")) {
+        return value_to_int(value, &config->proxy_vnodes);
+    } else if (NAME_MATCH("io_uring")) {
+        return value_to_bool(value, &config->io_uring);
+    } else if (NAME_MATCH("parse_stdin")) {
+        return value_to_bool(value, &config->parse_stdin);
+    } else if (NAME_MATCH("parse_tags")) {
+        return value_to_bool(value, &config->parse_tags);
+    } else if (NAME_MATCH("daemonize")) {
+        return value_to_bool(value, &config->daemonize);
+    } else if (NAME_MATCH("sketch_stream")) {
+        return value_to_bool(value, &config->sketch_stream);
+    } else if (NAME_MATCH("proxy_udp")) {
+        return value_to_bool(value, &config->proxy_udp);
+    } else if (NAME_MATCH("drop_unmatched")) {
+        return value_to_bool(value, &config->drop_unmatched);
+    } else if (NAME_MATCH("binary_stream")) {
+        return value_to_bool(value, &config->binary_stream);
+    } else if (NAME_MATCH("persistent_sink")) {
+        return value_to_bool(value, &config->persistent_sink);
+
+    // Handle the double cases
+    } else if (NAME_MATCH("timer_eps")) {
+        return value_to_double(value, &config->timer_eps);
+    } else if (NAME_MATCH("set_eps")) {
+        return value_to_double(value, &config->set_eps);
+    } else if (NAME_MATCH("tdigest_compression")) {
+        return value_to_double(value, &config->tdigest_compression);
+
+    // Handle the enum cases
+    } else if (NAME_MATCH("timer_engine")) {
+        return value_to_timer_engine(value, &config->timer_engine);
+    } else if (NAME_MATCH("huge_pages")) {
+        return value_to_huge_pages(value, &config->huge_pages);
+    } else if (NAME_MATCH("output_compression")) {
+        return value_to_output_compression(value, &config->output_compression);
+    } else if (NAME_MATCH("simd")) {
+        return value_to_simd_level(value, &config->simd);
+
+    // Copy the string values
+    } else if (NAME_MATCH("log_level")) {
+        config->log_level = strdup(value);
+    } else if (NAME_MATCH("stream_cmd")) {
+        config->stream_cmd = strdup(value);
+    } else if (NAME_MATCH("pid_file")) {
+        config->pid_file = strdup(value);
+    } else if (NAME_MATCH("input_counter")) {
+        config->input_counter = strdup(value);
+    } else if (NAME_MATCH("bind_address")) {
+        config->bind_address = strdup(value);
+    } else if (NAME_MATCH("graphite_host")) {
+        config->graphite_host = strdup(value);
+    } else if (NAME_MATCH("graphite_prefix")) {
+        config->graphite_prefix = strdup(value);
+    } else if (NAME_MATCH("influx_host")) {
+        config->influx_host = strdup(value);
+    } else if (NAME_MATCH("influx_db")) {
+        config->influx_db = strdup(value);
+    } else if (NAME_MATCH("snapshot_file")) {
+        config->snapshot_file = strdup(value);
+    } else if (NAME_MATCH("unix_stream_path")) {
+        config->unix_stream_path = strdup(value);
+    } else if (NAME_MATCH("unix_dgram_path")) {
+        config->unix_dgram_path = strdup(value);
+    } else if (NAME_MATCH("admin_socket_path")) {
+        config->admin_socket_path = strdup(value);
+    } else if (NAME_MATCH("shm_ring_path")) {
+        config->shm_ring_path = strdup(value);
+    } else if (NAME_MATCH("output_ring_path")) {
+        config->output_ring_path = strdup(value);
+    } else if (NAME_MATCH("xdp_interface")) {
+        config->xdp_interface = strdup(value);
+    } else if (NAME_MATCH("worker_cpus")) {
+        config->worker_cpus = strdup(value);
+    } else if (NAME_MATCH("flush_cpus")) {
+        config->flush_cpus = strdup(value);
+    } else if (NAME_MATCH("stream_cpus")) {
+        config->stream_cpus = strdup(value);
+
+    } else if (NAME_MATCH("proxy_upstreams")) {
+        config->proxy_upstreams = strdup(value);
+    } else if (NAME_MATCH("drop_prefixes")) {
+        config->drop_prefixes = strdup(value);
+    } else if (NAME_MATCH("allow_prefixes")) {
+        config->allow_prefixes = strdup(value);
+
+    // Unknown parameter?
+    } else {
+        // Log it, but ignore
+        syslog(LOG_NOTICE, "Unrecognized config parameter: %s", value);
+    }
+
+    // Success
+    return 1;
+}
+
+/**
+ * Initializes the configuration from a filename.
+ * Reads the file as an INI configuration, and sets up the
+ * config object.
+ * @arg filename The name of the file to read. NULL for defaults.
+ * @arg config Output. The config object to initialize.
+ * @return 0 on success, negative on error.
+ */
+int config_from_filename(char *filename, statsite_config *config) {
+    // Initialize to the default values
+    memcpy(config, &DEFAULT_CONFIG, sizeof(statsite_config));
+
+    // If there is no filename, return now
+    if (filename == NULL)
+        return 0;
+
+    // Try to open the file
+    int res = ini_parse(filename, config_callback, config);
+    if (res == -1) {
+        return -ENOENT;
+    } else if (res) {
+        syslog(LOG_ERR, "Failed to parse config on line: %d", res);
+        return -res;
+    }
+
+    // Check for an unfinished histogram
+    if (in_progress) {
+        syslog(LOG_WARNING, "Unfinished configuration for section: %s", histogram_section);
+        free(in_progress->prefix);
+        free(in_progress);
+        in_progress = NULL;
+    }
+    free(histogram_section);
+    histogram_section = NULL;
+
+    // Check for an unfinished timer section
+    if (timer_in_progress) {
+        syslog(LOG_WARNING, "Unfinished configuration for section: %s", timer_section);
+        free(timer_in_progress->prefix);
+        free(timer_in_progress->quantiles);
+        free(timer_in_progress);
+        timer_in_progress = NULL;
+    }
+    free(timer_section);
+    timer_section = NULL;
+
+    // Check for an unfinished counter section
+    if (counter_in_progress) {
+        syslog(LOG_WARNING, "Unfinished configuration for section: %s", counter_section);
+        free(counter_in_progress->prefix);
+        free(counter_in_progress);
+        counter_in_progress = NULL;
+    }
+    free(counter_section);
+    counter_section = NULL;
+
+    // Check for an unfinished key/value section
+    if (kv_in_progress) {
+        syslog(LOG_WARNING, "Unfinished configuration for section: %s", kv_section);
+        free(kv_in_progress->prefix);
+        free(kv_in_progress);
+        kv_in_progress = NULL;
+    }
+    free(kv_section);
+    kv_section = NULL;
+
+    // Check for an unfinished set section
+    if (set_in_progress) {
+        syslog(LOG_WARNING, "Unfinished configuration for section: %s", set_section);
+        free(set_in_progress->prefix);
+        free(set_in_progress);
+        set_in_progress = NULL;
+    }
+    free(set_section);
+    set_section = NULL;
+
+    // Check for an unfinished limit section
+    if (limit_in_progress) {
+        syslog(LOG_WARNING, "Unfinished configuration for section: %s", limit_section);
+        free(limit_in_progress->prefix);
+        free(limit_in_progress);
+        limit_in_progress = NULL;
+    }
+    free(limit_section);
+    limit_section = NULL;
+
+    // Check for an unfinished rollup section
+    if (rollup_in_progress) {
+        syslog(LOG_WARNING, "Unfinished configuration for section: %s", rollup_section);
+        free(rollup_in_progress->stream_cmd);
+        free(rollup_in_progress);
+        rollup_in_progress = NULL;
+    }
+    free(rollup_section);
+    rollup_section = NULL;
+
+    // Check for an unfinished sink section
+    if (sink_in_progress) {
+        syslog(LOG_WARNING, "Unfinished configuration for section: %s", sink_section);
+        free(sink_in_progress->name);
+        free(sink_in_progress);
+        sink_in_progress = NULL;
+    }
+    free(sink_section);
+    sink_section = NULL;
+
+    // Check for an unfinished listener section
+    if (listener_in_progress) {
+        syslog(LOG_WARNING, "Unfinished configuration for section: %s", listener_section);
+        free(listener_in_progress->name);
+        free(listener_in_progress->bind_address);
+        free(listener_in_progress);
+        listener_in_progress = NULL;
+    }
+    free(listener_section);
+    listener_section = NULL;
+
+    return 0;
+}
+
+/**
+ * Joins two strings as part of a path,
+ * and adds a separating slash if needed.
+ * @param path Part one of the path
+ * @param part2 The second part of the path
+ * @return A new string, that uses a malloc()'d buffer.
+ */
+char* join_path(char *path, char *part2) {
+    // Check for the end slash
+    int len = strlen(path);
+    int has_end_slash = path[len-1] == '/';
+
+    // Use the proper format string
+    char *buf;
+    int res;
+    if (has_end_slash)
+        res = asprintf(&buf, "%s%s", path, part2);
+    else
+        res = asprintf(&buf, "%s/%s", path, part2);
+    assert(res != -1);
+
+    // Return the new buffer
+    return buf;
+}
+
+int sane_log_level(char *log_level, int *syslog_level) {
+    #define LOG_MATCH(lvl) (strcasecmp(lvl, log_level) == 0)
+    if (LOG_MATCH("DEBUG")) {
+        *syslog_level = LOG_UPTO(LOG_DEBUG);
+    } else if (LOG_MATCH("INFO")) {
+        *syslog_level = LOG_UPTO(LOG_INFO);
+    } else if (LOG_MATCH("WARN")) {
+        *syslog_level = LOG_UPTO(LOG_WARNING);
+    } else if (LOG_MATCH("ERROR")) {
+        *syslog_level = LOG_UPTO(LOG_ERR);
+    } else if (LOG_MATCH("CRITICAL")) {
+        *syslog_level = LOG_UPTO(LOG_CRIT);
+    } else {
+        syslog(LOG_ERR, "Unknown log level!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_timer_eps(double eps) {
+    if (eps>= 0.5) {
+        syslog(LOG_ERR,
+               "Timer epsilon cannot be equal-to or greater than 0.5!");
+        return 1;
+    } else if (eps > 0.10) {
+        syslog(LOG_WARNING, "Timer epsilon very high!");
+    } else if (eps<= 0) {
+        syslog(LOG_ERR,
+               "Timer epsilon cannot less than or equal to 0!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_flush_interval(int intv) {
+    if (intv <= 0) {
+        syslog(LOG_ERR, "Flush interval cannot be negative!");
+        return 1;
+    } else if (intv >= 600)  {
+        syslog(LOG_WARNING,
+               "Flushing set to be very infrequent! Increased risk of data loss.");
+    }
+    return 0;
+}
+
+/**
+ * Sets the values derived from the scale of a histogram,
+ * so indexing a sample multiplies instead of divides.
+ */
+static void set_histogram_scale(histogram_config *config) {
+    if (config->scale == HISTOGRAM_AUTO) {
+        // Bins are gamma times wider than the last, so the middle of
+        // each is within eps of its values. They start on the powers
+        // of gamma, so the bins of all the timers line up.
+        if (!(config->parts & (1 << 1))) config->min_val = HISTOGRAM_AUTO_MIN;
+        config->bin_width = (1 + config->eps) / (1 - config->eps);
+        config->inv_bin_width = 1 / log(config->bin_width);
+        config->log_min = log(config->min_val);
+        config->num_bins = 0;
+    } else if (config->scale == HISTOGRAM_LOG) {
+        config->log_min = log(config->min_val);
+        config->inv_bin_width = 1 / log(config->bin_width);
+    } else {
+        config->inv_bin_width = 1 / config->bin_width;
+    }
+}
+
+/**
+ * Checks an automatic histogram, whose bins are
+ * set by the error and bounded in number.
+ * @return 0 if sane
+ */
+static int sane_auto_histogram(histogram_config *config) {
+    if (!(config->eps > 0 && config->eps < 0.5)) {
+        syslog(LOG_ERR, "Histogram eps must be between 0 and 0.5! Prefix: %s", config->prefix);
+        return 1;
+    }
+    if (config->max_bins < 2 || config->max_bins > 4096) {
+        syslog(LOG_ERR, "Histogram max bins must be between 2 and 4096! Prefix: %s", config->prefix);
+        return 1;
+    }
+    if ((config->parts & (1 << 1)) && !(config->min_val > 0)) {
+        syslog(LOG_ERR, "Automatic histograms need a min value above 0! Prefix: %s", config->prefix);
+        return 1;
+    }
+    set_histogram_scale(config);
+    return 0;
+}
+
+int sane_histograms(histogram_config *config) {
+    while (config) {
+        if (config->scale == HISTOGRAM_AUTO) {
+            if (sane_auto_histogram(config)) return 1;
+            config = config->next;
+            continue;
+        }
+
+        // Ensure sane upper / lower
+        if (config->min_val >= config->max_val) {
+            syslog(LOG_ERR, "Histogram min value must be less than max value! Prefix: %s", config->prefix);
+            return 1;
+        }
+
+        // Check width
+        if (config->bin_width <= 0) {
+            syslog(LOG_ERR, "Histogram bin width must be greater than 0! Prefix: %s", config->prefix);
+            return 1;
+        }
+
+        // Log bins start at the min, and each is width times wider
+        if (config->scale == HISTOGRAM_LOG && (config->min_val <= 0 || config->bin_width <= 1)) {
+            syslog(LOG_ERR, "Log histograms need a min value above 0, and a width above 1! Prefix: %s",
+                    config->prefix);
+            return 1;
+        }
+        set_histogram_scale(config);
+
+        // Compute the number of bins
+        // We divide the range by bin width, and add 2 for the less than min, and more than max bins
+        if (config->scale == HISTOGRAM_LOG) {
+            // Allow for rounding, so max=1000,min=1,width=10 has 3 bins
+            config->num_bins = (log(config->max_val / config->min_val) * config->inv_bin_width + 1e-9) + 2;
+        } else
+            config->num_bins = ((config->max_val - config->min_val) / config->bin_width) + 2;
+
+        // Check that the count is sane
+        if (config->num_bins > 1024) {
+            syslog(LOG_ERR, "Histogram bin count cannot exceed 1024! Prefix: %s", config->prefix);
+            return 1;
+        } else if (config->num_bins > 128) {
+            syslog(LOG_WARNING, "Histogram bin count very high! Bins: %d Prefix: %s",
+                    config->num_bins, config->prefix);
+        }
+
+        // Inspect the next config
+        config = config->next;
+    }
+    return 0;
+}
+
+int sane_set_precision(double eps, unsigned char *precision) {
+    // Determine the minimum precision needed
+    int minimum_prec = hll_precision_for_error(eps);
+    if (minimum_prec < 0) {
+        syslog(LOG_ERR, "Set epsilon must be between 0 and 1!");
+        return 1;
+    }
+
+    // Check if the precision is within range
+    if (minimum_prec < HLL_MIN_PRECISION) {
+        syslog(LOG_ERR, "Set epsilon too high!");
+        return 1;
+    }
+    if (minimum_prec > HLL_MAX_PRECISION) {
+        syslog(LOG_ERR, "Set epsilon too low! Memory use would be prohibitive.");
+        return 1;
+    }
+
+    // Warn if the precision is very high
+    if (minimum_prec > 15) {
+        syslog(LOG_WARNING, "Set epsilon low, high precision could \
+cause increased memory use.");
+    }
+
+    *precision = minimum_prec;
+    return 0;
+}
+
+int sane_worker_threads(int threads) {
+    if (threads <= 0) {
+        syslog(LOG_ERR, "Must have at least one worker thread!");
+        return 1;
+    } else if (threads > 64) {
+        syslog(LOG_ERR, "Worker thread count cannot exceed 64!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_graphite(char *host, int port, int max_buffer) {
+    if (!host) return 0;
+    if (port <= 0 || port > 65535) {
+        syslog(LOG_ERR, "Graphite port must be between 1 and 65535!");
+        return 1;
+    } else if (max_buffer < 0) {
+        syslog(LOG_ERR, "Graphite max buffer cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_influx(char *host, int port, char *db, int batch_size, int connections,
+        char *graphite_host, bool spooled) {
+    if (!host) return 0;
+    if (strlen(host) > 255) {
+        syslog(LOG_ERR, "The InfluxDB host name is too long!");
+        return 1;
+    } else if (port <= 0 || port > 65535) {
+        syslog(LOG_ERR, "InfluxDB port must be between 1 and 65535!");
+        return 1;
+    } else if (db && (!*db || strlen(db) > 64 ||
+                strspn(db, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-.") != strlen(db))) {
+        syslog(LOG_ERR, "The InfluxDB database must be at most 64 letters, digits, '_', '-' or '.'!");
+        return 1;
+    } else if (batch_size < 1) {
+        syslog(LOG_ERR, "The InfluxDB batch size must be at least 1!");
+        return 1;
+    } else if (connections < 1 || connections > 64) {
+        syslog(LOG_ERR, "The InfluxDB connections must be between 1 and 64!");
+        return 1;
+    } else if (graphite_host) {
+        syslog(LOG_ERR, "Cannot use both the InfluxDB and the Graphite outputs!");
+        return 1;
+    } else if (spooled) {
+        syslog(LOG_ERR, "Intervals cannot be spooled or spilled with the InfluxDB output!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_tdigest_compression(double compression) {
+    if (compression < 20) {
+        syslog(LOG_ERR, "The t-digest compression must be at least 20!");
+        return 1;
+    } else if (compression > 10000) {
+        syslog(LOG_WARNING, "The t-digest compression is very high, \
+timers will use a lot of memory.");
+    }
+    return 0;
+}
+
+int sane_set_max_exact(int max_exact) {
+    if (max_exact < 0) {
+        syslog(LOG_ERR, "The set max exact cannot be negative!");
+        return 1;
+    } else if (max_exact > 1 << 20) {
+        syslog(LOG_ERR, "The set max exact cannot be more than 1048576!");
+        return 1;
+    } else if (max_exact > 4096) {
+        syslog(LOG_WARNING, "The set max exact is very high, \
+sets will use a lot of memory.");
+    }
+    return 0;
+}
+
+int sane_conn_buffers(int max_buffer, uint64_t budget) {
+    if (max_buffer < 32768) {
+        syslog(LOG_ERR, "The connection max buffer must be at least 32768 bytes!");
+        return 1;
+    } else if (budget && budget < (uint64_t)max_buffer) {
+        syslog(LOG_WARNING, "The connection buffer budget is less than the max buffer, \
+large commands may stall.");
+    }
+    return 0;
+}
+
+int sane_tcp_backlog(int backlog) {
+    if (backlog <= 0) {
+        syslog(LOG_ERR, "The TCP backlog must be positive!");
+        return 1;
+    } else if (backlog > 65535) {
+        syslog(LOG_WARNING, "The TCP backlog is very high, \
+it is likely limited by net.core.somaxconn.");
+    }
+    return 0;
+}
+
+int sane_udp_rcvbuf(int rcvbuf) {
+    if (rcvbuf < 0) {
+        syslog(LOG_ERR, "The UDP receive buffer cannot be negative!");
+        return 1;
+    } else if (rcvbuf > 0 && rcvbuf < 4096) {
+        syslog(LOG_WARNING, "The UDP receive buffer is very small, \
+datagrams will likely be dropped.");
+    }
+    return 0;
+}
+
+int sane_client_rate(int rate, int burst) {
+    if (rate < 0 || burst < 0) {
+        syslog(LOG_ERR, "The client rate limit and burst cannot be negative!");
+        return 1;
+    } else if (burst && !rate) {
+        syslog(LOG_WARNING, "The client rate burst only applies with a client_rate_limit.");
+    }
+    return 0;
+}
+
+int sane_name_map(char *from, char *to, char *prefix, char *suffix) {
+    name_map m;
+    if (init_name_map(from, to, prefix, suffix, &m)) {
+        syslog(LOG_ERR, "The name_map_to characters must pair up with name_map_from, \
+using \\s, \\t or \\\\ for a space, tab or backslash!");
+        return 1;
+    }
+    destroy_name_map(&m);
+    return 0;
+}
+
+int sane_flush_threads(int threads) {
+    if (threads <= 0) {
+        syslog(LOG_ERR, "Must have at least one flush thread!");
+        return 1;
+    } else if (threads > 64) {
+        syslog(LOG_ERR, "Flush thread count cannot exceed 64!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_quantiles(double *quantiles, int num_quantiles) {
+    if (num_quantiles <= 0) {
+        syslog(LOG_ERR, "Must track at least one quantile!");
+        return 1;
+    }
+    for (int i=0; i < num_quantiles; i++) {
+        if (quantiles[i] <= 0 || quantiles[i] >= 1) {
+            syslog(LOG_ERR, "Quantiles must be between 0 and 1 exclusive!");
+            return 1;
+        } else if (i && quantiles[i] == quantiles[i-1]) {
+            syslog(LOG_ERR, "Quantile %f is listed twice!", quantiles[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int sane_flush_queue(int workers, int queue, flush_policy policy,
+        char *spill_dir, char *graphite_host) {
+    if (workers <= 0) {
+        syslog(LOG_ERR, "Must have at least one flush worker!");
+        return 1;
+    } else if (workers > 64) {
+        syslog(LOG_ERR, "Flush worker count cannot exceed 64!");
+        return 1;
+    } else if (queue <= 0) {
+        syslog(LOG_ERR, "The flush queue must hold at least one interval!");
+        return 1;
+    }
+    if (policy == FLUSH_SPILL) {
+        if (!spill_dir) {
+            syslog(LOG_ERR, "The spill flush queue policy needs a flush_spill_dir!");
+            return 1;
+        } else if (graphite_host) {
+            syslog(LOG_ERR, "Intervals cannot be spilled with the Graphite output!");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int sane_flush_spool(bool spool, int segment_size, char *spill_dir, char *graphite_host) {
+    if (!spool) return 0;
+    if (!spill_dir) {
+        syslog(LOG_ERR, "The flush spool needs a flush_spill_dir!");
+        return 1;
+    } else if (graphite_host) {
+        syslog(LOG_ERR, "Intervals cannot be spooled with the Graphite output!");
+        return 1;
+    } else if (segment_size < 65536) {
+        syslog(LOG_ERR, "Spool segments must be at least 64KB!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_shm_ring_size(int size) {
+    if (size < 65536 || (size & (size - 1))) {
+        syslog(LOG_ERR, "The shm ring size must be a power of two, of at least 64KB!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_output_ring(char *path, int size, char *graphite_host) {
+    if (!path) return 0;
+    if (size < 65536 || (size & (size - 1))) {
+        syslog(LOG_ERR, "The output ring size must be a power of two, of at least 64KB!");
+        return 1;
+    } else if (graphite_host) {
+        syslog(LOG_ERR, "Cannot use an output ring with the graphite_host!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_json_stream(bool json, bool binary, bool columnar, bool sketch) {
+    if (json && (binary || columnar || sketch)) {
+        syslog(LOG_ERR, "The JSON stream cannot be used with the binary, columnar or sketch streams!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_xdp_queues(int queues) {
+    if (queues < 1 || queues > 256) {
+        syslog(LOG_ERR, "The XDP queues must be between 1 and 256!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_cpu_list(char *name, char *list) {
+    if (list && cpu_list_parse(list, NULL, 0) <= 0) {
+        syslog(LOG_ERR, "The %s must be a list of CPUs like 0-3,8!", name);
+        return 1;
+    }
+    return 0;
+}
+
+int sane_proxy(char *upstreams, int vnodes) {
+    if (!upstreams) return 0;
+    if (vnodes < 1 || vnodes > 4096) {
+        syslog(LOG_ERR, "The proxy vnodes must be between 1 and 4096!");
+        return 1;
+    }
+
+    // Each upstream needs a host and a port
+    char *list = strdup(upstreams), *save = NULL, *spec, *sep, *end;
+    int res = 0, num = 0;
+    for (spec = strtok_r(list, ", ", &save); spec; spec = strtok_r(NULL, ", ", &save)) {
+        sep = strrchr(spec, ':');
+        long port = (sep) ? strtol(sep + 1, &end, 10) : 0;
+        if (!sep || sep == spec || *end || port < 1 || port > 65535) {
+            syslog(LOG_ERR, "Proxy upstreams must be host:port, got: %s", spec);
+            res = 1;
+        }
+        num++;
+    }
+    free(list);
+    if (!num) {
+        syslog(LOG_ERR, "The proxy needs at least one upstream!");
+        res = 1;
+    }
+    return res;
+}
+
+int sane_limits(limit_config *config) {
+    for (; config; config = config->next) {
+        if (config->max_keys < 1) {
+            syslog(LOG_ERR, "The max keys of a limit must be at least 1! Prefix: %s", config->prefix);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int sane_rollups(rollup_config *config, int flush_interval) {
+    for (; config; config = config->next) {
+        if (flush_interval <= 0 || config->interval <= flush_interval ||
+                config->interval % flush_interval) {
+            syslog(LOG_ERR, "The interval of a rollup must be a larger multiple of the flush interval! \
+Interval: %d", config->interval);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int sane_sinks(sink_config *config, bool persistent_sink, char *graphite_host) {
+    if (config && (persistent_sink || graphite_host)) {
+        syslog(LOG_ERR, "Sinks cannot be used with a persistent sink or graphite!");
+        return 1;
+    }
+    for (; config; config = config->next) {
+        if (config->timeout_ms < 0) {
+            syslog(LOG_ERR, "The timeout of a sink cannot be negative! Sink: %s", config->name);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int sane_top_keys(int top_keys, bool internal_stats) {
+    if (top_keys < 0) {
+        syslog(LOG_ERR, "The top keys cannot be negative!");
+        return 1;
+    } else if (top_keys > 1000) {
+        syslog(LOG_ERR, "The top keys cannot be more than 1000!");
+        return 1;
+    } else if (top_keys && !internal_stats) {
+        syslog(LOG_WARNING, "The top keys are reported with the internal stats, \
+which are disabled.");
+    }
+    return 0;
+}
+
+int sane_intern_idle_intervals(int intervals) {
+    if (intervals < 0) {
+        syslog(LOG_ERR, "The intern idle intervals cannot be negative!");
         return 1;
     }
     return 0;
 }
 
-int sane_timer_eps(double eps) {
-    if (eps>= 0.5) {
-        syslog(LOG_ERR,
-               "Timer epsilon cannot be equal-to or greater than 0.5!");
+int sane_stream_timeout(int timeout_ms) {
+    if (timeout_ms < 0) {
+        syslog(LOG_ERR, "The stream timeout cannot be negative!");
         return 1;
-    } else if (eps > 0.10) {
-        syslog(LOG_WARNING, "Timer epsilon very high!");
-    } else if (eps<= 0) {
-        syslog(LOG_ERR,
-               "Timer epsilon cannot less than or equal to 0!");
+    }
+    return 0;
+}
+
+int sane_stream_async_buffers(int buffers) {
+    if (buffers && (buffers < 2 || buffers > 64)) {
+        syslog(LOG_ERR, "The stream async buffers must be 0, or between 2 and 64!");
         return 1;
     }
     return 0;
 }
 
-int sane_flush_interval(int intv) {
-    if (intv <= 0) {
-        syslog(LOG_ERR, "Flush interval cannot be negative!");
+int sane_shared_counter_keys(int keys) {
+    if (keys < 0 || keys > (1 << 30)) {
+        syslog(LOG_ERR, "The shared counter keys must be between 0 and 2^30!");
         return 1;
-    } else if (intv >= 600)  {
-        syslog(LOG_WARNING,
-               "Flushing set to be very infrequent! Increased risk of data loss.");
     }
     return 0;
 }
 
-int sane_histograms(histogram_config *config) {
-    while (config) {
-        // Ensure sane upper / lower
-        if (config->min_val >= config->max_val) {
-            syslog(LOG_ERR, "Histogram min value must be less than max value! Prefix: %s", config->prefix);
-            return 1;
-        }
+int sane_busy_poll_us(int busy_poll_us) {
+    if (busy_poll_us < 0 || busy_poll_us > 1000000) {
+        syslog(LOG_ERR, "The busy poll must be between 0 and 1000000 microseconds!");
+        return 1;
+    }
+    return 0;
+}
 
-        // Check width
-        if (config->bin_width <= 0) {
-            syslog(LOG_ERR, "Histogram bin width must be greater than 0! Prefix: %s", config->prefix);
-            return 1;
-        }
+int sane_sink_parallelism(int parallelism) {
+    if (parallelism < 1 || parallelism > 64) {
+        syslog(LOG_ERR, "The sink parallelism must be between 1 and 64!");
+        return 1;
+    }
+    return 0;
+}
 
-        // Compute the number of bins
-        // We divide the range by bin width, and add 2 for the less than min, and more than max bins
-        config->num_bins = ((config->max_val - config->min_val) / config->bin_width) + 2;
+int sane_timer_admission_threshold(int threshold) {
+    if (threshold < 0) {
+        syslog(LOG_ERR, "The timer admission threshold can not be negative!");
+        return 1;
+    } else if (threshold && threshold < TIMER_EXACT_MAX) {
+        syslog(LOG_ERR, "The timer admission threshold must be 0 or at least %d!", TIMER_EXACT_MAX);
+        return 1;
+    }
+    return 0;
+}
 
-        // Check that the count is sane
-        if (config->num_bins > 1024) {
-            syslog(LOG_ERR, "Histogram bin count cannot exceed 1024! Prefix: %s", config->prefix);
+int sane_set_windows(int *windows, int num_windows, int num_slots, int flush_interval) {
+    if (!num_windows) return 0;
+    if (num_slots < 1 || num_slots > MAX_SET_WINDOW_SLOTS) {
+        syslog(LOG_ERR, "The set window slots must be between 1 and %d!", MAX_SET_WINDOW_SLOTS);
+        return 1;
+    }
+    for (int i=0; i < num_windows; i++) {
+        if (windows[i] <= flush_interval || windows[i] % num_slots ||
+                (windows[i] / num_slots) % flush_interval) {
+            syslog(LOG_ERR, "A set window must be longer than the flush interval, and split into \
+slots that are multiples of it! Window: %d", windows[i]);
+            return 1;
+        } else if (i && windows[i] == windows[i-1]) {
+            syslog(LOG_ERR, "Set window %d is listed twice!", windows[i]);
             return 1;
-        } else if (config->num_bins > 128) {
-            syslog(LOG_WARNING, "Histogram bin count very high! Bins: %d Prefix: %s",
-                    config->num_bins, config->prefix);
         }
-
-        // Inspect the next config
-        config = config->next;
     }
     return 0;
 }
 
-int sane_set_precision(double eps, unsigned char *precision) {
-    // Determine the minimum precision needed
-    int minimum_prec = hll_precision_for_error(eps);
-    if (minimum_prec < 0) {
-        syslog(LOG_ERR, "Set epsilon must be between 0 and 1!");
+int sane_gauge_refresh_intervals(bool changes_only, int intervals) {
+    if (changes_only && intervals < 1) {
+        syslog(LOG_ERR, "The gauge refresh intervals must be at least 1!");
         return 1;
     }
+    return 0;
+}
 
-    // Check if the precision is within range
-    if (minimum_prec < HLL_MIN_PRECISION) {
-        syslog(LOG_ERR, "Set epsilon too high!");
-        return 1;
+int sane_timer_configs(timer_config *config) {
+    int res = 0;
+    for (; config; config = config->next) {
+        if (config->quantiles) res |= sane_quantiles(config->quantiles, config->num_quantiles);
+        if (config->eps) res |= sane_timer_eps(config->eps);
+        if (config->compression) res |= sane_tdigest_compression(config->compression);
     }
-    if (minimum_prec > HLL_MAX_PRECISION) {
-        syslog(LOG_ERR, "Set epsilon too low! Memory use would be prohibitive.");
-        return 1;
+    return res;
+}
+
+int sane_set_configs(set_config *config) {
+    int res = 0;
+    for (; config; config = config->next) {
+        res |= sane_set_precision(config->eps, &config->precision);
     }
+    return res;
+}
 
-    // Warn if the precision is very high
-    if (minimum_prec > 15) {
-        syslog(LOG_WARNING, "Set epsilon low, high precision could \
-cause increased memory use.");
+int sane_listeners(listener_config *config, int worker_threads) {
+    for (; config; config = config->next) {
+        if (config->port <= 0 || config->port > 65535) {
+            syslog(LOG_ERR, "The port of a listener must be between 1 and 65535! Listener: %s",
+                    config->name);
+            return 1;
+        } else if (config->worker < -1 || config->worker >= worker_threads) {
+            syslog(LOG_ERR, "The worker of a listener must be one of the worker threads! Listener: %s",
+                    config->name);
+            return 1;
+        } else if (sane_udp_rcvbuf(config->udp_rcvbuf)) {
+            return 1;
+        } else if (config->udp_rcvbuf && config->protocol != LISTEN_UDP) {
+            syslog(LOG_WARNING, "The receive buffer only applies to UDP listeners. Listener: %s",
+                    config->name);
+        }
     }
+    return 0;
+}
 
-    *precision = minimum_prec;
+int sane_max_line_length(int length, int max_buffer) {
+    if (length < 0) {
+        syslog(LOG_ERR, "The max line length cannot be negative!");
+        return 1;
+    } else if (length > max_buffer) {
+        syslog(LOG_WARNING, "The max line length is more than the connection max buffer, \
+longer lines close the connection instead.");
+    }
     return 0;
 }
 
@@ -400,15 +2079,64 @@ int validate_config(statsite_config *config) {
     res |= sane_flush_interval(config->flush_interval);
     res |= sane_histograms(config->hist_configs);
     res |= sane_set_precision(config->set_eps, &config->set_precision);
+    res |= sane_worker_threads(config->worker_threads);
+    res |= sane_graphite(config->graphite_host, config->graphite_port,
+            config->graphite_max_buffer);
+    res |= sane_influx(config->influx_host, config->influx_port, config->influx_db,
+            config->influx_batch_size, config->influx_connections, config->graphite_host,
+            config->flush_spool || config->flush_queue_policy == FLUSH_SPILL);
+    res |= sane_tdigest_compression(config->tdigest_compression);
+    res |= sane_set_max_exact(config->set_max_exact);
+    res |= sane_conn_buffers(config->conn_max_buffer, config->conn_buffer_budget);
+    res |= sane_conn_buffers(config->conn_max_buffer, config->priority_buffer_budget);
+    res |= sane_tcp_backlog(config->tcp_backlog);
+    res |= sane_udp_rcvbuf(config->udp_rcvbuf);
+    res |= sane_client_rate(config->client_rate_limit, config->client_rate_burst);
+    res |= sane_name_map(config->name_map_from, config->name_map_to,
+            config->name_prefix, config->name_suffix);
+    res |= sane_flush_threads(config->flush_threads);
+    res |= sane_flush_queue(config->flush_workers, config->flush_queue,
+            config->flush_queue_policy, config->flush_spill_dir, config->graphite_host);
+    res |= sane_flush_spool(config->flush_spool, config->flush_spool_segment,
+            config->flush_spill_dir, config->graphite_host);
+    res |= sane_shm_ring_size(config->shm_ring_size);
+    res |= sane_output_ring(config->output_ring_path, config->output_ring_size,
+            config->graphite_host);
+    res |= sane_json_stream(config->json_stream, config->binary_stream,
+            config->columnar_stream, config->sketch_stream);
+    res |= sane_proxy(config->proxy_upstreams, config->proxy_vnodes);
+    res |= sane_limits(config->limit_configs);
+    res |= sane_top_keys(config->top_keys, config->internal_stats);
+    res |= sane_intern_idle_intervals(config->intern_idle_intervals);
+    res |= sane_max_line_length(config->max_line_length, config->conn_max_buffer);
+    res |= sane_xdp_queues(config->xdp_queues);
+    res |= sane_cpu_list("worker_cpus", config->worker_cpus);
+    res |= sane_cpu_list("flush_cpus", config->flush_cpus);
+    res |= sane_cpu_list("stream_cpus", config->stream_cpus);
+    res |= sane_rollups(config->rollup_configs, config->flush_interval);
+    res |= sane_sinks(config->sink_configs, config->persistent_sink, config->graphite_host);
+    res |= sane_stream_timeout(config->stream_timeout_ms);
+    res |= sane_stream_async_buffers(config->stream_async_buffers);
+    res |= sane_shared_counter_keys(config->shared_counter_keys);
+    res |= sane_busy_poll_us(config->busy_poll_us);
+    res |= sane_sink_parallelism(config->sink_parallelism);
+    res |= sane_timer_admission_threshold(config->timer_admission_threshold);
+    res |= sane_set_windows(config->set_windows, config->num_set_windows,
+            config->set_window_slots, config->flush_interval);
+    res |= sane_gauge_refresh_intervals(config->gauge_changes_only, config->gauge_refresh_intervals);
+    res |= sane_quantiles(config->quantiles, config->num_quantiles);
+    res |= sane_timer_configs(config->timer_configs);
+    res |= sane_set_configs(config->set_configs);
+    res |= sane_listeners(config->listener_configs, config->worker_threads);
 
     return res;
 }
 
 /**
- * Builds the radix tree for prefix matching
+ * Builds the radix tree for histogram prefix matching
  * @return 0 on success
  */
-int build_prefix_tree(statsite_config *config) {
+static int build_histogram_tree(statsite_config *config) {
     // Do nothing if there is no config
     if (!config->hist_configs)
         return 0;
@@ -423,6 +2151,168 @@ int build_prefix_tree(statsite_config *config) {
     histogram_config *current = config->hist_configs;
     void **val;
     while (!res && current) {
+        // The tree may be built from configs that were not validated
+        set_histogram_scale(current);
+        val = (void**)&current;
+        res = radix_insert(t, current->prefix, val);
+        current = current->next;
+    }
+
+    if (!res)
+        return res;
+ERR:
+    free(t);
+    return 1;
+}
+
+/**
+ * Builds the radix tree for timer engine prefix matching
+ * @return 0 on success
+ */
+static int build_timer_tree(statsite_config *config) {
+    // Do nothing if there is no config
+    if (!config->timer_configs)
+        return 0;
+
+    // Initialize the radix tree
+    radix_tree *t = malloc(sizeof(radix_tree));
+    config->timer_engines = t;
+    int res = radix_init(t);
+    if (res) goto ERR;
+
+    // Add all the prefixes
+    timer_config *current = config->timer_configs;
+    void **val;
+    while (!res && current) {
+        val = (void**)&current;
+        res = radix_insert(t, current->prefix, val);
+        current = current->next;
+    }
+
+    if (!res)
+        return res;
+ERR:
+    free(t);
+    return 1;
+}
+
+/**
+ * Builds the radix tree for counter mode prefix matching
+ * @return 0 on success
+ */
+static int build_counter_tree(statsite_config *config) {
+    // Do nothing if there is no config
+    if (!config->counter_configs)
+        return 0;
+
+    // Initialize the radix tree
+    radix_tree *t = malloc(sizeof(radix_tree));
+    config->counter_modes = t;
+    int res = radix_init(t);
+    if (res) goto ERR;
+
+    // Add all the prefixes
+    counter_config *current = config->counter_configs;
+    void **val;
+    while (!res && current) {
+        val = (void**)&current;
+        res = radix_insert(t, current->prefix, val);
+        current = current->next;
+    }
+
+    if (!res)
+        return res;
+ERR:
+    free(t);
+    return 1;
+}
+
+/**
+ * Builds the radix tree for key/value mode prefix matching
+ * @return 0 on success
+ */
+static int build_kv_tree(statsite_config *config) {
+    // Do nothing if there is no config
+    if (!config->kv_configs)
+        return 0;
+
+    // Initialize the radix tree
+    radix_tree *t = malloc(sizeof(radix_tree));
+    config->kv_modes = t;
+    int res = radix_init(t);
+    if (res) goto ERR;
+
+    // Add all the prefixes
+    kv_config *current = config->kv_configs;
+    void **val;
+    while (!res && current) {
+        val = (void**)&current;
+        res = radix_insert(t, current->prefix, val);
+        current = current->next;
+    }
+
+    if (!res)
+        return res;
+ERR:
+    free(t);
+    return 1;
+}
+
+/**
+ * Builds the radix tree for set precision prefix matching
+ * @return 0 on success
+ */
+static int build_set_tree(statsite_config *config) {
+    // Do nothing if there is no config
+    if (!config->set_configs)
+        return 0;
+
+    // Initialize the radix tree
+    radix_tree *t = malloc(sizeof(radix_tree));
+    config->set_precisions = t;
+    int res = radix_init(t);
+    if (res) goto ERR;
+
+    // Add all the prefixes
+    set_config *current = config->set_configs;
+    void **val;
+    while (!res && current) {
+        val = (void**)&current;
+        res = radix_insert(t, current->prefix, val);
+        current = current->next;
+    }
+
+    if (!res)
+        return res;
+ERR:
+    free(t);
+    return 1;
+}
+
+/**
+ * Builds the radix tree for limit prefix matching, and
+ * numbers the limits for the key counts of the metrics
+ * @return 0 on success
+ */
+static int build_limit_tree(statsite_config *config) {
+    // Do nothing if there is no config
+    if (!config->limit_configs)
+        return 0;
+
+    // Initialize the radix tree
+    radix_tree *t = malloc(sizeof(radix_tree));
+    config->limits = t;
+    int res = radix_init(t);
+    if (res) goto ERR;
+
+    // Add all the prefixes
+    limit_config *current = config->limit_configs;
+    void **val;
+    config->num_limits = 0;
+    while (!res && current) {
+        current->index = config->num_limits++;
+        free(current->overflow_key);
+        if (asprintf(&current->overflow_key, "%s%s", current->prefix, LIMIT_OVERFLOW_SUFFIX) == -1) goto ERR;
         val = (void**)&current;
         res = radix_insert(t, current->prefix, val);
         current = current->next;
@@ -435,3 +2325,116 @@ ERR:
     return 1;
 }
 
+/**
+ * Adds a comma separated list of prefixes to the filter tree.
+ * A prefix that is already in the tree takes the new action.
+ */
+static void add_filter_rules(radix_tree *t, char *prefixes, filter_action action) {
+    if (!prefixes) return;
+    char *list = strdup(prefixes), *save = NULL, *prefix;
+    void *val;
+    for (prefix = strtok_r(list, ", ", &save); prefix; prefix = strtok_r(NULL, ", ", &save)) {
+        val = (void*)(uintptr_t)action;
+        radix_insert(t, prefix, &val);
+    }
+    free(list);
+}
+
+/**
+ * Builds the radix tree of the ingest filter. The allowed
+ * prefixes are added last, so they win over the same prefix
+ * when it is also dropped.
+ * @return 0 on success
+ */
+static int build_filter_tree(statsite_config *config) {
+    // Do nothing if there are no rules
+    if (!config->drop_prefixes && !config->allow_prefixes && !config->drop_unmatched)
+        return 0;
+
+    // Initialize the radix tree
+    radix_tree *t = malloc(sizeof(radix_tree));
+    config->filters = t;
+    if (radix_init(t)) {
+        free(t);
+        config->filters = NULL;
+        return 1;
+    }
+
+    add_filter_rules(t, config->drop_prefixes, FILTER_DROP);
+    add_filter_rules(t, config->allow_prefixes, FILTER_ALLOW);
+    return 0;
+}
+
+/**
+ * Builds the radix trees for prefix matching of histograms, timer
+ * engines, counter modes, key/value modes, set precisions, limits and the ingest filter
+ * @return 0 on success
+ */
+int build_prefix_tree(statsite_config *config) {
+    if (build_histogram_tree(config)) return 1;
+    if (build_timer_tree(config)) return 1;
+    if (build_counter_tree(config)) return 1;
+    if (build_kv_tree(config)) return 1;
+    if (build_set_tree(config)) return 1;
+    if (build_limit_tree(config)) return 1;
+    return build_filter_tree(config);
+}
+
+/**
+ * Makes the configuration that a reload switches to. It is a copy
+ * of the running configuration, with the settings that can change
+ * without a restart taken from the configuration that was read again:
+ * the log level, flush interval, stream command, input counter and
+ * memory budget, and the settings of the timers, sets, counters,
+ * key/value pairs, histograms and limits. The rest, such as the sockets, threads and
+ * outputs, keep their running values.
+ * @arg running The configuration in use
+ * @arg loaded The configuration read again, validated and
+ * with its prefix trees built. The new configuration shares
+ * the settings it takes, so only the struct may be freed.
+ * @return The new configuration, or NULL if the flush
+ * interval does not suit the running rollups.
+ */
+statsite_config* config_for_reload(statsite_config *running, statsite_config *loaded) {
+    if (sane_rollups(running->rollup_configs, loaded->flush_interval)) return NULL;
+    statsite_config *config = malloc(sizeof(statsite_config));
+    if (!config) return NULL;
+    *config = *running;
+
+    config->log_level = loaded->log_level;
+    config->syslog_log_level = loaded->syslog_log_level;
+    config->flush_interval = loaded->flush_interval;
+    config->stream_cmd = loaded->stream_cmd;
+    config->input_counter = loaded->input_counter;
+    config->parse_tags = loaded->parse_tags;
+    config->memory_budget = loaded->memory_budget;
+
+    config->timer_eps = loaded->timer_eps;
+    config->quantiles = loaded->quantiles;
+    config->num_quantiles = loaded->num_quantiles;
+    config->timer_engine = loaded->timer_engine;
+    config->tdigest_compression = loaded->tdigest_compression;
+    config->timer_admission_threshold = loaded->timer_admission_threshold;
+    config->timer_configs = loaded->timer_configs;
+    config->timer_engines = loaded->timer_engines;
+    config->hist_configs = loaded->hist_configs;
+    config->histograms = loaded->histograms;
+
+    config->set_eps = loaded->set_eps;
+    config->set_precision = loaded->set_precision;
+    config->set_max_exact = loaded->set_max_exact;
+    config->set_configs = loaded->set_configs;
+    config->set_precisions = loaded->set_precisions;
+
+    config->counter_sum_only = loaded->counter_sum_only;
+    config->counter_configs = loaded->counter_configs;
+    config->counter_modes = loaded->counter_modes;
+
+    config->kv_configs = loaded->kv_configs;
+    config->kv_modes = loaded->kv_modes;
+
+    config->limit_configs = loaded->limit_configs;
+    config->limits = loaded->limits;
+    config->num_limits = loaded->num_limits;
+    return config;
+}
@@ -4,7 +4,34 @@
 #include <syslog.h>
 #include <stdbool.h>
 #include "radix.h"
+#include "timer.h"
+#include "page_alloc.h"
+#include "cpu_features.h"
 
+// The layout of the bins of a histogram
+typedef enum {
+    HISTOGRAM_LINEAR,   // Bins are width apart, the default
+    HISTOGRAM_LOG,      // Each bin is width times wider than the last
+    HISTOGRAM_AUTO      // Log bins to a relative error, kept only where used
+} histogram_scale;
+
+// The defaults of the automatic histograms
+#define HISTOGRAM_AUTO_EPS 0.02
+#define HISTOGRAM_AUTO_MIN 0.001
+#define HISTOGRAM_AUTO_MAX_BINS 512
+
+// What to do with an interval when the flush queue is full
+typedef enum {
+    FLUSH_MERGE,        // Merge into the newest queued interval, the default
+    FLUSH_SPILL,        // Write out to a file, streamed once caught up
+    FLUSH_DROP          // Discard the interval
+} flush_policy;
+
+// How the output to the stream command is compressed
+typedef enum {
+    COMPRESS_NONE,      // Written as is, the default
+    COMPRESS_LZ4        // Written as LZ4 frames
+} output_compression;
 
 // Represents the configuration of a histogram
 typedef struct histogram_config {
@@ -15,8 +42,125 @@ typedef struct histogram_config {
     int num_bins;
     struct histogram_config *next;
     char parts;
+    histogram_scale scale;
+    double inv_bin_width;   // Reciprocal of the width, or of its log. Set by sane_histograms
+    double log_min;         // Log of the min value for log bins
+    struct histogram_names *names; // The bin names of the ASCII output, rendered on first use
+    double eps;             // The relative error of the automatic bins
+    int max_bins;           // Most automatic bins a timer keeps, the lowest are merged past it
+    bool skip_empty;        // Leave the bins without values out of the outputs
 } histogram_config;
 
+// The most quantiles that may be tracked for a timer
+#define MAX_QUANTILES 32
+
+// The most windows, and slots of a window, that the sets may keep
+#define MAX_SET_WINDOWS 8
+#define MAX_SET_WINDOW_SLOTS 64
+
+// Represents the quantile engine, quantiles and accuracy for a prefix of timers
+typedef struct timer_config {
+    char *prefix;
+    timer_engine engine;
+    struct timer_config *next;
+    char parts;
+    bool has_engine;        // Otherwise the global timer_engine is used
+    double *quantiles;      // Sorted, or NULL to use the global quantiles
+    int num_quantiles;
+    double eps;             // Or 0 to use the global timer_eps
+    double compression;     // Or 0 to use the global tdigest_compression
+} timer_config;
+
+// Represents the counter mode for a prefix of counters
+typedef struct counter_config {
+    char *prefix;
+    bool sum_only;          // Only keep the sum, defaults to true
+    struct counter_config *next;
+    char parts;
+} counter_config;
+
+// How the samples of a key/value pair are coalesced in an interval
+typedef enum {
+    KV_ALL,             // Every sample is streamed, as for the keys of no kv section
+    KV_LAST,            // The last sample of the interval
+    KV_SUM,             // The sum of the samples
+    KV_MIN,             // The least sample
+    KV_MAX,             // The greatest sample
+    KV_MEAN             // The mean of the samples
+} kv_mode;
+
+// Represents the coalescing of a prefix of key/value pairs
+typedef struct kv_config {
+    char *prefix;
+    kv_mode mode;           // Defaults to KV_LAST in a kv section
+    struct kv_config *next;
+    char parts;
+} kv_config;
+
+// Represents the precision for a prefix of sets
+typedef struct set_config {
+    char *prefix;
+    double eps;
+    unsigned char precision; // Set from the eps by sane_set_configs
+    struct set_config *next;
+    char parts;
+} set_config;
+
+// The actions of the ingest filter, the values of config->filters
+typedef enum {
+    FILTER_ALLOW = 1,
+    FILTER_DROP
+} filter_action;
+
+// The suffix of the key that a prefix over its limit folds into
+#define LIMIT_OVERFLOW_SUFFIX "__overflow__"
+
+// Represents the cardinality limit for a prefix of keys
+typedef struct limit_config {
+    char *prefix;
+    int max_keys;           // Keys kept in an interval, later keys are folded
+    struct limit_config *next;
+    char parts;
+    int index;              // The key count of each metrics object. Set by build_prefix_tree
+    char *overflow_key;     // The prefix and LIMIT_OVERFLOW_SUFFIX. Set by build_prefix_tree
+} limit_config;
+
+// Represents a coarser resolution, rolled up from the flushed intervals
+typedef struct rollup_config {
+    int interval;           // Seconds in a window, a multiple of the flush_interval
+    char *stream_cmd;       // Command each window is streamed to
+    struct rollup_config *next;
+    char parts;
+} rollup_config;
+
+// Represents another sink each flush is fanned out to
+typedef struct sink_config {
+    char *name;             // The name of the section
+    char *stream_cmd;       // Command each flush is streamed to
+    int timeout_ms;         // Milliseconds before the command is killed, or 0 to wait
+    struct sink_config *next;
+    char parts;
+} sink_config;
+
+// The protocols of the listener sections
+typedef enum {
+    LISTEN_TCP = 1,
+    LISTEN_UDP
+} listener_protocol;
+
+// Represents another socket to listen on
+typedef struct listener_config {
+    char *name;             // The name of the section
+    listener_protocol protocol;
+    char *bind_address;     // Address to bind on, or NULL for the bind_address
+    int port;
+    int udp_rcvbuf;         // Receive buffer of a UDP socket, or 0 for the udp_rcvbuf
+    int worker;             // The only worker to listen, or -1 for all of them
+    bool priority;          // Are its clients served first, with their own buffer budget
+    struct listener_config *next;
+    char parts;
+} listener_config;
+
 
 /**
  * Stores our configuration
@@ -39,6 +183,108 @@ typedef struct {
     radix_tree *histograms;
     double set_eps;
     unsigned char set_precision;
+    int worker_threads;
+    bool persistent_sink;
+    char *graphite_host;
+    int graphite_port;
+    char *graphite_prefix;
+    int graphite_max_buffer;
+    timer_engine timer_engine;
+    double tdigest_compression;
+    timer_config *timer_configs;
+    radix_tree *timer_engines;
+    int set_max_exact;
+    int conn_max_buffer;
+    uint64_t conn_buffer_budget;
+    int tcp_backlog;
+    int udp_rcvbuf;
+    char *udp_drop_counter;
+    bool internal_stats;
+    bool binary_stream_grouped;
+    int flush_threads;
+    int flush_workers;
+    int flush_queue;
+    flush_policy flush_queue_policy;
+    char *flush_spill_dir;
+    double *quantiles;
+    int num_quantiles;
+    bool counter_sum_only;
+    counter_config *counter_configs;
+    radix_tree *counter_modes;
+    bool flush_spool;
+    int flush_spool_segment;
+    char *snapshot_file;
+    bool io_uring;
+    char *unix_stream_path;
+    char *unix_dgram_path;
+    char *shm_ring_path;
+    int shm_ring_size;
+    bool sketch_stream;
+    char *proxy_upstreams;
+    int proxy_vnodes;
+    bool proxy_udp;
+    limit_config *limit_configs;
+    radix_tree *limits;
+    int num_limits;
+    char *drop_prefixes;
+    char *allow_prefixes;
+    bool drop_unmatched;
+    radix_tree *filters;
+    int top_keys;
+    int intern_idle_intervals;
+    int max_line_length;
+    bool udp_gro;
+    char *xdp_interface;
+    int xdp_queues;
+    bool udp_drop_filter;
+    char *worker_cpus;
+    char *flush_cpus;
+    char *stream_cpus;
+    huge_pages_mode huge_pages;
+    bool ingest_pipeline;
+    rollup_config *rollup_configs;
+    output_compression output_compression;
+    bool sorted_output;
+    bool binary_stream_front_coded;
+    bool columnar_stream;
+    sink_config *sink_configs;
+    int stream_timeout_ms;
+    bool gauge_changes_only;
+    int gauge_refresh_intervals;
+    char *admin_socket_path;
+    uint64_t memory_budget;
+    set_config *set_configs;
+    radix_tree *set_precisions;
+    listener_config *listener_configs;
+    bool parse_tags;
+    int client_rate_limit;
+    int client_rate_burst;
+    char *name_map_from;
+    char *name_map_to;
+    char *name_prefix;
+    char *name_suffix;
+    bool stream_splice;
+    char *output_ring_path;
+    int output_ring_size;
+    bool stream_gather;
+    char *influx_host;
+    int influx_port;
+    char *influx_db;
+    int influx_batch_size;
+    int influx_connections;
+    bool json_stream;
+    int stream_async_buffers;
+    int shared_counter_keys;
+    int busy_poll_us;
+    int sink_parallelism;
+    uint64_t priority_buffer_budget;
+    int timer_admission_threshold;
+    simd_level simd;
+    int *set_windows;
+    int num_set_windows;
+    int set_window_slots;
+    kv_config *kv_configs;
+    radix_tree *kv_modes;
 } statsite_config;
 
 /**
@@ -64,6 +310,45 @@ int sane_timer_eps(double eps);
 int sane_flush_interval(int intv);
 int sane_histograms(histogram_config *config);
 int sane_set_precision(double eps, unsigned char *precision);
+int sane_worker_threads(int threads);
+int sane_graphite(char *host, int port, int max_buffer);
+int sane_influx(char *host, int port, char *db, int batch_size, int connections,
+        char *graphite_host, bool spooled);
+int sane_tdigest_compression(double compression);
+int sane_set_max_exact(int max_exact);
+int sane_conn_buffers(int max_buffer, uint64_t budget);
+int sane_tcp_backlog(int backlog);
+int sane_udp_rcvbuf(int rcvbuf);
+int sane_client_rate(int rate, int burst);
+int sane_name_map(char *from, char *to, char *prefix, char *suffix);
+int sane_flush_threads(int threads);
+int sane_quantiles(double *quantiles, int num_quantiles);
+int sane_flush_queue(int workers, int queue, flush_policy policy,
+        char *spill_dir, char *graphite_host);
+int sane_flush_spool(bool spool, int segment_size, char *spill_dir, char *graphite_host);
+int sane_shm_ring_size(int size);
+int sane_output_ring(char *path, int size, char *graphite_host);
+int sane_json_stream(bool json, bool binary, bool columnar, bool sketch);
+int sane_proxy(char *upstreams, int vnodes);
+int sane_limits(limit_config *config);
+int sane_top_keys(int top_keys, bool internal_stats);
+int sane_intern_idle_intervals(int intervals);
+int sane_max_line_length(int length, int max_buffer);
+int sane_xdp_queues(int queues);
+int sane_cpu_list(char *name, char *list);
+int sane_rollups(rollup_config *config, int flush_interval);
+int sane_sinks(sink_config *config, bool persistent_sink, char *graphite_host);
+int sane_stream_timeout(int timeout_ms);
+int sane_stream_async_buffers(int buffers);
+int sane_shared_counter_keys(int keys);
+int sane_busy_poll_us(int busy_poll_us);
+int sane_sink_parallelism(int parallelism);
+int sane_timer_admission_threshold(int threshold);
+int sane_set_windows(int *windows, int num_windows, int num_slots, int flush_interval);
+int sane_gauge_refresh_intervals(bool changes_only, int intervals);
+int sane_timer_configs(timer_config *config);
+int sane_set_configs(set_config *config);
+int sane_listeners(listener_config *config, int worker_threads);
 
 /**
  * Joins two strings as part of a path,
@@ -75,9 +360,27 @@ int sane_set_precision(double eps, unsigned char *precision);
 char* join_path(char *path, char *part2);
 
 /**
- * Builds the radix tree for prefix matching
+ * Builds the radix trees for prefix matching of histograms, timer
+ * engines, counter modes, key/value modes, set precisions, limits and the ingest filter
  * @return 0 on success
  */
 int build_prefix_tree(statsite_config *config);
 
+/**
+ * Makes the configuration that a reload switches to. It is a copy
+ * of the running configuration, with the settings that can change
+ * without a restart taken from the configuration that was read again:
+ * the log level, flush interval, stream command, input counter,
+ * memory budget and parsing of tags, and the settings of the timers, sets, counters,
+ * key/value pairs, histograms and limits. The rest, such as the sockets, threads and
+ * outputs, keep their running values.
+ * @arg running The configuration in use
+ * @arg loaded The configuration read again, validated and
+ * with its prefix trees built. The new configuration shares
+ * the settings it takes, so only the struct may be freed.
+ * @return The new configuration, or NULL if the flush
+ * interval does not suit the running rollups.
+ */
+statsite_config* config_for_reload(statsite_config *running, statsite_config *loaded);
+
 #endif
@@ -7,8 +7,38 @@
 #include <sys/time.h>
 #include <netinet/in.h>
 #include <math.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "metrics.h"
+#include "hash.h"
 #include "streaming.h"
+#include "graphite.h"
+#include "influx.h"
+#include "json.h"
+#include "format.h"
+#include "ascii_scan.h"
+#include "stats.h"
+#include "spool.h"
+#include "snapshot.h"
+#include "sketch.h"
+#include "proxy.h"
+#include "probes.h"
+#include "affinity.h"
+#include "page_alloc.h"
+#include "spsc_queue.h"
+#include "gauge_history.h"
+#include "set_window.h"
+#include "name_map.h"
+#include "loop_monitor.h"
 #include "conn_handler.h"
 
 /*
@@ -20,6 +50,21 @@
 #define BIN_TYPE_SET            0x4
 #define BIN_TYPE_GAUGE          0x5
 #define BIN_TYPE_GAUGE_DELTA    0x6
+#define BIN_TYPE_BIND           0x7
+#define BIN_TYPE_SKETCH         0x8     // A serialized sketch from a downstream node
+#define BIN_TYPE_SET_HASH       0x9     // A set member hashed by the client
+#define BIN_TYPE_ID             0x40    // OR'd with the type for frames using a bound key
+#define BIN_TYPE_MULTI          0x80    // OR'd with the type for multi-value frames
+
+// The most values a multi-value frame may carry
+#define BIN_MULTI_MAX_VALUES    1024
+
+// The largest ID a binary client may bind a key to
+#define BIN_MAX_KEY_ID          4095
+
+// Sketch frames have a 32bit length, and are bounded by this
+#define BIN_SKETCH_HEADER_SIZE  8
+#define BIN_SKETCH_MAX_BYTES    (16 * 1024 * 1024)
 
 #define BIN_OUT_NO_TYPE 0x0
 #define BIN_OUT_SUM     0x1
@@ -34,18 +79,50 @@
 #define BIN_OUT_HIST_CEIL     0xa
 #define BIN_OUT_PCT     0x80
 
+// Frames rewritten by the proxy up to this size are built on the stack
+#define BIN_PROXY_STACK_FRAME   4096
+
+// Maximum number of ASCII lines tokenized at once
+#define ASCII_BATCH_LINES 64
+
+// Keys monitored for each of the top_keys that are reported
+#define TOP_KEYS_FACTOR 4
+
+// Warnings about bad input logged each second, the rest are counted
+#define INPUT_WARNINGS_PER_SEC 5
+
+// Connection events of a worker between checks of the memory budget
+#define MEMORY_CHECK_EVENTS 1024
+
+// The most the accuracy is lowered as the memory budget fills
+#define MEMORY_LEVELS 3
+#define MEMORY_MAX_EPS 0.25
+#define MEMORY_MIN_COMPRESSION 20
+
+// Size and number of the batches of samples each worker hands
+// to its aggregator with the ingest pipeline
+#define PIPELINE_BATCH_SIZE 65536
+#define PIPELINE_BATCHES 64
+
 // Macro to provide branch meta-data
 #define likely(x)       __builtin_expect((x),1)
 #define unlikely(x)     __builtin_expect((x),0)
 
 /* Static method declarations */
-static int handle_binary_client_connect(statsite_conn_handler *handle);
-static int handle_ascii_client_connect(statsite_conn_handler *handle);
-static int buffer_after_terminator(char *buf, int buf_len, char terminator, char **after_term, int *after_len);
+static int handle_binary_client_connect(statsite_conn_handler *handle, metrics *m);
+static int handle_ascii_client_connect(statsite_conn_handler *handle, metrics *m);
+static int proxy_binary_client_connect(statsite_conn_handler *handle);
+static void* flush_worker(void *arg);
+static void* spool_drainer(void *arg);
+static void* metrics_preparer(void *arg);
+static void start_pipelines();
+static void stop_pipelines();
+static void report_unlogged_warnings();
+static void report_loop_stalls(loop_report *r);
+static void input_warning(const char *format, ...) __attribute__((format(printf, 1, 2)));
 
-/* These are the quantiles we track */
-static const double QUANTILES[] = {0.5, 0.9, 0.95, 0.99};
-static const int NUM_QUANTILES = 4;
+// The percentile a quantile is sent as in the binary output
+#define QUANTILE_PCT(q) ((unsigned char)lround((q) * 100))
 
 // This is the magic byte that indicates we are handling
 // a binary command, instead of an ASCII command. We use
@@ -55,72 +132,864 @@ static const int MAX_BINARY_HEADER_SIZE = 12;
 static const int MIN_BINARY_HEADER_SIZE = 6;
 
 /**
- * This is the current metrics object we are using
+ * Each ingest worker updates its own shard of the
+ * metrics. The lock is only contended when a flush
+ * swaps out the current metrics object.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    metrics *m;
+    int memory_level;   // The level m's new timers and sets are made at
+} metrics_shard;
+
+/**
+ * These are the current metrics objects we are using
  */
-static metrics *GLOBAL_METRICS;
+static metrics_shard *GLOBAL_SHARDS;
+static int NUM_SHARDS;
 static statsite_config *GLOBAL_CONFIG;
 
 /**
- * Invoked to initialize the conn handler layer.
+ * The map of the output names, if any is configured
  */
-void init_conn_handler(statsite_config *config) {
-    // Make the initial metrics object
+static name_map GLOBAL_NAME_MAP;
+
+/**
+ * The long-lived sink, if persistent_sink is enabled
+ */
+static stream_sink *GLOBAL_SINK;
+
+/**
+ * The commands each flush is fanned out to, when there are
+ * sink sections. The first is the stream_cmd, without a timeout.
+ */
+static char **SINK_CMDS;
+static char **SINK_NAMES;
+static int *SINK_TIMEOUTS;
+static int NUM_SINKS;
+
+/**
+ * The native Graphite output, if graphite_host is set
+ */
+static graphite_output *GLOBAL_GRAPHITE;
+
+/**
+ * The native InfluxDB output, if influx_host is set
+ */
+static influx_output *GLOBAL_INFLUX;
+
+/**
+ * The spool of serialized intervals, if flush_spool is enabled.
+ * The flush workers append to it, and the drainer streams it.
+ */
+static spool *GLOBAL_SPOOL;
+static pthread_t SPOOL_DRAINER;
+
+/**
+ * The forwarding proxy, if proxy_upstreams is set. The
+ * inputs are sent to the upstreams instead of being aggregated.
+ */
+static proxy *GLOBAL_PROXY;
+
+/**
+ * A parsed ASCII sample, handed from a worker to its aggregator.
+ * It is followed by the key and, for sets, the value, each with
+ * a NULL terminator.
+ */
+typedef struct {
+    uint64_t hash;
+    double val;
+    uint32_t size;          // Size with the strings, a multiple of 8
+    uint32_t bytes;         // Bytes of the line, for the top keys
+    uint32_t key_len;
+    metric_type type;
+    uint64_t weight;        // Samples a timer sample stands for
+} sample_record;
+
+typedef struct {
+    uint32_t used;          // Bytes of records
+    uint32_t inputs;        // Inputs handled, including the dropped ones
+    char data[PIPELINE_BATCH_SIZE];
+} sample_batch;
+
+/**
+ * The ingest pipeline of a worker, if ingest_pipeline is enabled.
+ * The worker only parses its ASCII lines into samples, and pushes
+ * them in batches to an aggregator thread, which updates the shard.
+ * The batches come back on the free queue to be refilled.
+ */
+typedef struct {
+    spsc_queue *full;       // Batches for the aggregator
+    spsc_queue *free;       // Batches for the worker to fill
+    sample_batch *batch;    // Being filled by the worker, or NULL
+    int shard;
+    pthread_t thread;
+    pthread_mutex_t lock;   // Held by the aggregator to sleep
+    pthread_cond_t cond;
+    int sleeping;           // Set while the aggregator may sleep
+    int stop;
+} pipeline;
+
+static pipeline *PIPELINES;
+static void pipeline_push(pipeline *p);
+
+/**
+ * The rate limit of the warnings about bad input. Past the
+ * first few each second they are only counted, so a client
+ * sending garbage does not stall the workers on syslog.
+ */
+static time_t WARNINGS_SECOND;
+static int WARNINGS_LOGGED;
+static uint64_t WARNINGS_UNLOGGED;
+
+/**
+ * Pool of cleared metrics objects, one per shard. The flush
+ * thread returns the objects of the last interval, which keep
+ * their hashmap capacity, so the next interval starts already
+ * sized. Each shard gets its own object back, so its memory stays
+ * on the NUMA node of the worker that first touched it.
+ */
+static pthread_mutex_t POOL_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static metrics **METRICS_POOL;
+static statsite_config **POOL_CONFIGS;  // The configuration each pooled object was set up with
+
+/**
+ * The preparer fills the empty slots of the pool when the
+ * flushes fall behind the swaps, so the event loop does not
+ * have to make the next objects itself. The new objects are
+ * reserved for the keys of the last interval of their shard.
+ */
+static pthread_cond_t PREPARE_COND = PTHREAD_COND_INITIALIZER;
+static metrics_sizes *POOL_SIZES;   // The keys of the last interval of each shard
+static int PREPARE_PENDING;
+static int PREPARE_SHUTDOWN;
+static int OUT_INTERVALS;           // Intervals swapped out and not yet released
+static pthread_t METRICS_PREPARER;
+
+/**
+ * With shared_counter_keys, the shards of an interval keep their
+ * counters and gauges in one shared map. The map of a flushed
+ * interval is cleared and kept here for a later one.
+ */
+static shared_map *SPARE_SHARED;    // Guarded by POOL_LOCK
+
+/**
+ * The intervals waiting to be flushed, oldest first. At most
+ * flush_queue are queued, the rest are handled by the policy.
+ * Spilled intervals are kept as files until they are streamed.
+ */
+typedef struct flush_entry {
+    metrics **shards;       // One metrics object per shard
+    struct timeval tv;      // The end of the interval, the time of the metrics
+    struct timeval queued;  // When the oldest interval merged into this was queued
+    double swap_ms;         // The swaps of the shards of the intervals in this
+    struct flush_entry *next;
+} flush_entry;
+
+typedef struct spill_entry {
+    char *path;
+    struct spill_entry *next;
+} spill_entry;
+
+static pthread_mutex_t FLUSH_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t FLUSH_COND = PTHREAD_COND_INITIALIZER;
+static flush_entry *FLUSH_HEAD;
+static flush_entry *FLUSH_TAIL;
+static int FLUSH_DEPTH;
+static spill_entry *SPILL_HEAD;
+static spill_entry *SPILL_TAIL;
+static uint64_t SPILL_SEQ;
+static int REPLAY_BLOCKED;  // Set if a spill failed to stream, until a flush succeeds
+static int FLUSH_SHUTDOWN;
+static pthread_t *FLUSH_WORKERS;
+
+/**
+ * Timings of the previous flush for the internal stats, and
+ * the counter totals at that point, so each flush emits deltas.
+ * Flushes overlap with several flush workers, so these are locked.
+ */
+static pthread_mutex_t FLUSH_STATS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t LAST_STATS[NUM_STATS];
+static int HAVE_LAST_FLUSH;
+static double LAST_FLUSH_MS;
+static double LAST_STREAM_MS;
+static int LAST_SINK_STATUS;
+
+// The milliseconds spent in each phase of a flush
+typedef struct {
+    double swap;        // Swapping out the metrics of the shards
+    double merge;       // Merging the shards into one
+    double finalize;    // Finalizing the timers
+    double format;      // Formatting the output, all of the streaming for other sinks
+    double write;       // Blocked on the pipe to the command
+    double command;     // Starting the command, and waiting for its exit
+    double release;     // Returning the metrics to the pool, or destroying them
+} flush_phases;
+static flush_phases LAST_PHASES;
+
+/**
+ * The coarser resolutions, if there are rollup sections. Each
+ * flushed interval is merged into the window of every rollup,
+ * which is streamed to its own command once it is complete.
+ */
+typedef struct rollup {
+    rollup_config *config;
+    metrics *m;             // The intervals of the window so far
+    time_t window;          // The end of the window, 0 if it is empty
+    struct rollup *next;
+} rollup;
+
+static pthread_mutex_t ROLLUP_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static rollup *ROLLUPS;
+
+/**
+ * The last values streamed for the gauges, with gauge_changes_only.
+ * The lock orders the flush workers that filter their intervals.
+ */
+static pthread_mutex_t GAUGE_HISTORY_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static gauge_history *GAUGE_HISTORY;
+
+/**
+ * The long windows of the sets, with set_windows. The
+ * lock orders the flush workers that add their intervals.
+ */
+static pthread_mutex_t SET_WINDOW_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static set_window *SET_WINDOW;
+
+/**
+ * How far the memory_budget has lowered the accuracy of the new
+ * timers and sets, from 0 to MEMORY_LEVELS. Each worker counts its
+ * connection events, to check the budget every so often.
+ */
+static int MEMORY_LEVEL;
+static __thread uint32_t MEMORY_EVENTS;
+
+/**
+ * A reload of the configuration file, asked for with
+ * schedule_config_reload and done by the next flush.
+ */
+static volatile sig_atomic_t RELOAD_PENDING;
+static char *RELOAD_FILE;
+
+/**
+ * Returns the level of the memory budget for
+ * the bytes held by the metrics. The accuracy is lowered
+ * once half of the budget is used, and again at 75% and 90%.
+ */
+static int memory_level(int64_t used) {
+    double fill = (double)used / GLOBAL_CONFIG->memory_budget;
+    if (fill >= 0.9) return MEMORY_LEVELS;
+    if (fill >= 0.75) return 2;
+    if (fill >= 0.5) return 1;
+    return 0;
+}
+
+/**
+ * Updates the level of the memory budget from the
+ * bytes held by the timers, sets, maps and arenas.
+ */
+static void check_memory_budget() {
+    int64_t mem[NUM_MEMS];
+    stats_mem_collect(mem);
+    int64_t used = mem[MEM_TIMERS] + mem[MEM_SETS] + mem[MEM_MAPS] + mem[MEM_ARENAS];
+    int level = memory_level(used);
+    int old = __atomic_exchange_n(&MEMORY_LEVEL, level, __ATOMIC_RELAXED);
+    if (level != old) {
+        syslog((level > old) ? LOG_WARNING : LOG_INFO,
+                "Memory budget at level %d, the metrics hold %lld bytes.", level, (long long)used);
+    }
+}
+
+/**
+ * Sets the accuracy of the new timers and sets of a metrics
+ * object for a level of the memory budget. Each level about halves
+ * what they take: the timer error is doubled, the t-digest
+ * compression is halved, and the set precision is lowered by one.
+ * The sketches of different accuracies still merge.
+ */
+static void set_memory_level(metrics *m, int level) {
+    double eps = GLOBAL_CONFIG->timer_eps * (1 << level);
+    double compression = GLOBAL_CONFIG->tdigest_compression / (1 << level);
+    int precision = GLOBAL_CONFIG->set_precision - level;
+    eps = fmin(eps, fmax(GLOBAL_CONFIG->timer_eps, MEMORY_MAX_EPS));
+    compression = fmax(compression, fmin(GLOBAL_CONFIG->tdigest_compression, MEMORY_MIN_COMPRESSION));
+    if (precision < HLL_MIN_PRECISION) precision = HLL_MIN_PRECISION;
+    metrics_set_accuracy(m, eps, compression, precision);
+}
+
+/**
+ * Brings the accuracy of a shard up to date with the memory
+ * budget. Must be called with the shard lock held.
+ */
+static inline void update_memory_level(metrics_shard *shard) {
+    int level = __atomic_load_n(&MEMORY_LEVEL, __ATOMIC_RELAXED);
+    if (unlikely(shard->memory_level != level)) {
+        set_memory_level(shard->m, level);
+        shard->memory_level = level;
+    }
+}
+
+/**
+ * Applies the settings of the global configuration that
+ * a reload can change to an empty metrics object. The
+ * objects kept in the pool keep their maps and names.
+ */
+static void configure_metrics(metrics *m, statsite_config *config) {
+    int res = metrics_reconfigure(m, config->timer_eps, config->quantiles,
+            config->num_quantiles, config->histograms, config->set_precision);
+    assert(res == 0);
+    metrics_set_timer_engine(m, config->timer_engine,
+            config->tdigest_compression, config->timer_engines);
+    metrics_set_timer_admission(m, config->timer_admission_threshold);
+    metrics_set_max_exact(m, config->set_max_exact);
+    metrics_set_counter_mode(m, config->counter_sum_only, config->counter_modes);
+    metrics_set_kv_modes(m, config->kv_modes);
+    metrics_set_precisions(m, config->set_precisions);
+    if (m->num_limits != config->num_limits || (m->limits && m->limits != config->limits))
+        metrics_set_limits(m, config->limits, config->num_limits);
+}
+
+/**
+ * Allocates and initializes a metrics object
+ * using a configuration.
+ */
+static metrics* alloc_metrics(statsite_config *config) {
     metrics *m = malloc(sizeof(metrics));
-    int res = init_metrics(config->timer_eps, (double*)&QUANTILES, NUM_QUANTILES,
+    int res = init_metrics(config->timer_eps, config->quantiles, config->num_quantiles,
             config->histograms, config->set_precision, m);
     assert(res == 0);
-    GLOBAL_METRICS = m;
+    configure_metrics(m, config);
+    metrics_set_interning(m, config->intern_idle_intervals);
+    if (config->internal_stats && config->top_keys)
+        metrics_set_top_keys(m, config->top_keys * TOP_KEYS_FACTOR);
+    return m;
+}
+
+/**
+ * Returns the pooled metrics object of a shard, or
+ * allocates a new one. A pooled object is already set
+ * up, unless the configuration was reloaded since.
+ * @arg shard The shard the object is for
+ */
+static metrics* new_metrics(int shard) {
+    pthread_mutex_lock(&POOL_LOCK);
+    metrics *m = METRICS_POOL[shard];
+    statsite_config *config = POOL_CONFIGS[shard];
+    METRICS_POOL[shard] = NULL;
+    pthread_mutex_unlock(&POOL_LOCK);
+    if (!m) return alloc_metrics(GLOBAL_CONFIG);
+    if (config != GLOBAL_CONFIG) configure_metrics(m, GLOBAL_CONFIG);
+    return m;
+}
+
+/**
+ * Puts a set up metrics object in the pool. If the shard
+ * already has one pooled, the one displaced is returned.
+ */
+static metrics* pool_metrics(metrics *m, statsite_config *config, int shard) {
+    pthread_mutex_lock(&POOL_LOCK);
+    metrics *old = METRICS_POOL[shard];
+    METRICS_POOL[shard] = m;
+    POOL_CONFIGS[shard] = config;
+    pthread_mutex_unlock(&POOL_LOCK);
+    return old;
+}
+
+/**
+ * Clears a metrics object, sets it up for the next interval
+ * and returns it to the pool. It keeps the capacity of its
+ * maps for the keys of its interval, so it replaces an object
+ * the preparer pooled, but a map that is far larger than its
+ * keys is shrunk, so the pool follows the keys that still report.
+ * @arg shard The shard the object was used by
+ */
+static void release_metrics(metrics *m, int shard) {
+    statsite_config *config = __atomic_load_n(&GLOBAL_CONFIG, __ATOMIC_ACQUIRE);
+    metrics_sizes sizes;
+    metrics_get_sizes(m, &sizes);
+    metrics_clear(m);
+    metrics_fit(m, &sizes);
+    configure_metrics(m, config);
+    m = pool_metrics(m, config, shard);
+    if (m) {
+        destroy_metrics(m);
+        free(m);
+    }
+}
+
+/**
+ * Makes the objects for the empty slots of the pool,
+ * after a swap that the flushes did not keep up with.
+ */
+static void* metrics_preparer(void *arg) {
+    cpu_pin_thread(GLOBAL_CONFIG->flush_cpus, -1);
+    pthread_mutex_lock(&POOL_LOCK);
+    while (!PREPARE_SHUTDOWN) {
+        if (!PREPARE_PENDING) {
+            pthread_cond_wait(&PREPARE_COND, &POOL_LOCK);
+            continue;
+        }
+        PREPARE_PENDING = 0;
+        for (int i=0; i < NUM_SHARDS && !PREPARE_SHUTDOWN; i++) {
+            if (METRICS_POOL[i]) continue;
+            metrics_sizes sizes = POOL_SIZES[i];
+            pthread_mutex_unlock(&POOL_LOCK);
+
+            statsite_config *config = __atomic_load_n(&GLOBAL_CONFIG, __ATOMIC_ACQUIRE);
+            metrics *m = alloc_metrics(config);
+            metrics_reserve(m, &sizes);
+
+            // An object released meanwhile is kept instead
+            pthread_mutex_lock(&POOL_LOCK);
+            if (!METRICS_POOL[i]) {
+                METRICS_POOL[i] = m;
+                POOL_CONFIGS[i] = config;
+                m = NULL;
+            }
+            pthread_mutex_unlock(&POOL_LOCK);
+            if (m) {
+                destroy_metrics(m);
+                free(m);
+            }
+            pthread_mutex_lock(&POOL_LOCK);
+        }
+    }
+    pthread_mutex_unlock(&POOL_LOCK);
+    return NULL;
+}
+
+/**
+ * Restores a snapshot into the shards, and removes it
+ * so that the metrics are not restored again.
+ */
+static void restore_snapshot(char *path) {
+    metrics **shards = malloc(NUM_SHARDS * sizeof(metrics*));
+    for (int i=0; i < NUM_SHARDS; i++) {
+        shards[i] = GLOBAL_SHARDS[i].m;
+    }
+    int res = snapshot_load(path, shards, NUM_SHARDS);
+    free(shards);
+    if (res == 1) return;
+    if (res == 0) syslog(LOG_INFO, "Restored the snapshot %s", path);
+    if (unlink(path)) {
+        syslog(LOG_ERR, "Failed to remove the snapshot %s!", path);
+    }
+}
 
+/**
+ * Invoked to initialize the conn handler layer.
+ */
+void init_conn_handler(statsite_config *config) {
     // Store the config
     GLOBAL_CONFIG = config;
+
+    // Back the large tables and arenas with huge pages
+    page_alloc_set_mode(config->huge_pages);
+
+    // Pick the kernels for the instruction sets of the host
+    simd_level simd = simd_limit(config->simd);
+    if (config->simd != SIMD_AUTO && simd != config->simd) {
+        syslog(LOG_WARNING, "The host does not support the %s kernels, using %s.",
+                simd_name(config->simd), simd_name(simd));
+    } else {
+        syslog(LOG_INFO, "Using the %s kernels.", simd_name(simd));
+    }
+
+    // The output names are stored with the keys, so the map
+    // is set before any metrics are made
+    if (config->name_map_from || config->name_prefix || config->name_suffix) {
+        init_name_map(config->name_map_from, config->name_map_to,
+                config->name_prefix, config->name_suffix, &GLOBAL_NAME_MAP);
+        NAME_MAP = &GLOBAL_NAME_MAP;
+    }
+
+    // Setup the native Graphite output, which replaces the stream_cmd
+    if (config->graphite_host) {
+        GLOBAL_GRAPHITE = malloc(sizeof(graphite_output));
+        init_graphite_output(config->graphite_host, config->graphite_port,
+                config->graphite_prefix, config->graphite_max_buffer, GLOBAL_GRAPHITE);
+
+    // Setup the native InfluxDB output, which replaces the stream_cmd
+    } else if (config->influx_host) {
+        GLOBAL_INFLUX = malloc(sizeof(influx_output));
+        init_influx_output(config->influx_host, config->influx_port,
+                (config->influx_db) ? config->influx_db : "statsite", config->influx_batch_size,
+                config->influx_connections, config->parse_tags, GLOBAL_INFLUX);
+
+    // Setup the output ring, which replaces the stream_cmd. A full
+    // ring is waited on for the stream timeout, or an interval
+    } else if (config->output_ring_path) {
+        int timeout = (config->stream_timeout_ms) ? config->stream_timeout_ms : config->flush_interval * 1000;
+        GLOBAL_SINK = malloc(sizeof(stream_sink));
+        if (init_ring_sink(config->output_ring_path, config->output_ring_size, timeout, GLOBAL_SINK)) {
+            syslog(LOG_ERR, "Failed to create the output ring, streaming to the stream_cmd");
+            free(GLOBAL_SINK);
+            GLOBAL_SINK = NULL;
+        }
+
+    // Setup the persistent sink, the command is started on the first flush
+    } else if (config->persistent_sink) {
+        GLOBAL_SINK = malloc(sizeof(stream_sink));
+        init_stream_sink(config->stream_cmd, GLOBAL_SINK);
+
+    // Setup the fan out to the other sinks
+    } else if (config->sink_configs) {
+        NUM_SINKS = 1;
+        for (sink_config *conf = config->sink_configs; conf; conf = conf->next) NUM_SINKS++;
+        SINK_CMDS = calloc(NUM_SINKS, sizeof(char*));
+        SINK_NAMES = calloc(NUM_SINKS, sizeof(char*));
+        SINK_TIMEOUTS = calloc(NUM_SINKS, sizeof(int));
+        SINK_CMDS[0] = config->stream_cmd;
+        SINK_NAMES[0] = "stream_cmd";
+        SINK_TIMEOUTS[0] = config->stream_timeout_ms;
+        int i = 1;
+        for (sink_config *conf = config->sink_configs; conf; conf = conf->next, i++) {
+            SINK_CMDS[i] = conf->stream_cmd;
+            SINK_NAMES[i] = conf->name;
+            SINK_TIMEOUTS[i] = conf->timeout_ms;
+        }
+    }
+
+    // Setup the spool, or stream directly if it cannot be opened
+    if (config->flush_spool) {
+        if (spool_init(config->flush_spill_dir, config->flush_spool_segment, &GLOBAL_SPOOL)) {
+            syslog(LOG_ERR, "Failed to open the flush spool, streaming directly!");
+            GLOBAL_SPOOL = NULL;
+        } else {
+            pthread_create(&SPOOL_DRAINER, NULL, spool_drainer, NULL);
+        }
+    }
+
+    // Setup the proxy, or aggregate if the upstreams cannot be used
+    if (config->proxy_upstreams &&
+            proxy_init(config->proxy_upstreams, config->proxy_vnodes, config->proxy_udp,
+                config->worker_threads, &GLOBAL_PROXY)) {
+        syslog(LOG_ERR, "Failed to setup the proxy, aggregating instead!");
+        GLOBAL_PROXY = NULL;
+    }
+
+    // Set the number of threads that serialize a flush
+    stream_set_threads(config->flush_threads);
+    stream_set_cpus(config->stream_cpus);
+    stream_set_compression(config->output_compression);
+    stream_set_sorted(config->sorted_output || config->binary_stream_front_coded);
+    stream_set_block_output(config->columnar_stream && !config->sketch_stream);
+    stream_set_timeout(config->stream_timeout_ms);
+    stream_set_splice(config->stream_splice);
+    stream_set_gather(config->stream_gather);
+    stream_set_async(config->stream_async_buffers);
+
+    // Pool an object per shard, for the next interval
+    NUM_SHARDS = config->worker_threads;
+    METRICS_POOL = calloc(NUM_SHARDS, sizeof(metrics*));
+    POOL_CONFIGS = calloc(NUM_SHARDS, sizeof(statsite_config*));
+    POOL_SIZES = calloc(NUM_SHARDS, sizeof(metrics_sizes));
+
+    // Make the initial metrics object for each worker, and
+    // the one for its first swap
+    shared_map *shared = NULL;
+    if (config->shared_counter_keys && (shared_map_create(config->shared_counter_keys, &shared) ||
+                shared_map_create(config->shared_counter_keys, &SPARE_SHARED))) {
+        syslog(LOG_ERR, "Failed to create the shared counter map, sharding the counters!");
+        if (shared) shared_map_destroy(shared);
+        shared = NULL;
+    }
+    GLOBAL_SHARDS = calloc(NUM_SHARDS, sizeof(metrics_shard));
+    for (int i=0; i < NUM_SHARDS; i++) {
+        pthread_mutex_init(&GLOBAL_SHARDS[i].lock, NULL);
+        GLOBAL_SHARDS[i].m = new_metrics(i);
+        metrics_set_shared(GLOBAL_SHARDS[i].m, shared);
+        pool_metrics(alloc_metrics(config), config, i);
+    }
+    PREPARE_PENDING = PREPARE_SHUTDOWN = 0;
+    pthread_create(&METRICS_PREPARER, NULL, metrics_preparer, NULL);
+
+    // Restore the interval that was in progress at the last shutdown
+    if (config->snapshot_file) restore_snapshot(config->snapshot_file);
+
+    // Hand the parsing and the aggregation to separate threads
+    if (config->ingest_pipeline && !GLOBAL_PROXY) start_pipelines();
+
+    // Keep the last values of the gauges, to stream the changes
+    if (config->gauge_changes_only) {
+        GAUGE_HISTORY = malloc(sizeof(gauge_history));
+        if (gauge_history_init(config->gauge_refresh_intervals, GAUGE_HISTORY)) {
+            syslog(LOG_ERR, "Failed to setup the gauge history, streaming all gauges!");
+            free(GAUGE_HISTORY);
+            GAUGE_HISTORY = NULL;
+        }
+    }
+
+    if (config->num_set_windows) {
+        SET_WINDOW = malloc(sizeof(set_window));
+        if (set_window_init(config->set_windows, config->num_set_windows,
+                    config->set_window_slots, SET_WINDOW)) {
+            syslog(LOG_ERR, "Failed to setup the set windows!");
+            free(SET_WINDOW);
+            SET_WINDOW = NULL;
+        }
+    }
+
+    // Make a window for each rollup
+    for (rollup_config *conf = config->rollup_configs; conf; conf = conf->next) {
+        rollup *r = calloc(1, sizeof(rollup));
+        r->config = conf;
+        r->m = alloc_metrics(config);
+        r->next = ROLLUPS;
+        ROLLUPS = r;
+    }
+
+    // Start the flush workers
+    FLUSH_WORKERS = calloc(config->flush_workers, sizeof(pthread_t));
+    for (int i=0; i < config->flush_workers; i++) {
+        pthread_create(FLUSH_WORKERS + i, NULL, flush_worker, NULL);
+    }
 }
 
 /**
  * Streaming callback to format our output
  */
+#ifdef __GLIBC__
+#define STREAM_WRITE(buf, len, pipe) fwrite_unlocked(buf, 1, len, pipe)
+#else
+#define STREAM_WRITE(buf, len, pipe) fwrite(buf, 1, len, pipe)
+#endif
+
+/**
+ * Adds a single line to a gather writer. The prefix, name, tags and
+ * stable suffixes are referenced where they are, only the value and
+ * the timestamp are copied, and they end up in a single piece.
+ * @arg copy_suffix Set if the suffix does not last until the write
+ * @return 0 on success, 1 on a write error.
+ */
+static int gather_line(stream_gather *g, const char *prefix, int prefix_len,
+        const char *name, int name_len, int base_len, const char *suffix, int suffix_len,
+        int copy_suffix, const char *val, int val_len, const char *ts, int ts_len) {
+    int res = (prefix_len) ? stream_gather_ref(g, prefix, prefix_len) : 0;
+    res |= stream_gather_ref(g, name, base_len);
+    if (unlikely(base_len < name_len)) {
+        res |= (copy_suffix) ? stream_gather_copy(g, suffix, suffix_len - 1) :
+            stream_gather_ref(g, suffix, suffix_len - 1);
+        res |= stream_gather_ref(g, name + base_len, name_len - base_len);
+        res |= stream_gather_ref(g, "|", 1);
+    } else {
+        res |= (copy_suffix) ? stream_gather_copy(g, suffix, suffix_len) :
+            stream_gather_ref(g, suffix, suffix_len);
+    }
+    res |= stream_gather_copy(g, val, val_len);
+    res |= stream_gather_copy(g, ts, ts_len);
+    return (res) ? 1 : 0;
+}
+
+/**
+ * Writes a single line of the form <prefix><name><suffix><val><ts>
+ * to the pipe, or to its gather writer if there is one. The pieces
+ * are copied directly instead of going through fprintf, which
+ * dominates the flush time for large intervals. The tags of a name,
+ * after its base_len, go after the suffix.
+ * @arg g The gather writer of the pipe, or NULL
+ * @arg base_len The length of the name without its tags
+ * @arg suffix The suffix, ending in the '|' before the value
+ * @arg copy_suffix Set if the suffix does not last until it is gathered
+ * @arg ts The pre-formatted "|<timestamp>\n" tail
+ * @return 0 on success, 1 on a write error.
+ */
+static int stream_line(FILE *pipe, stream_gather *g, const char *prefix, int prefix_len,
+        const char *name, int name_len, int base_len, const char *suffix, int suffix_len,
+        int copy_suffix, const char *val, int val_len, const char *ts, int ts_len) {
+    if (g) return gather_line(g, prefix, prefix_len, name, name_len, base_len,
+            suffix, suffix_len, copy_suffix, val, val_len, ts, ts_len);
+    if (prefix_len && STREAM_WRITE(prefix, prefix_len, pipe) != prefix_len) return 1;
+    if (STREAM_WRITE(name, base_len, pipe) != base_len) return 1;
+    if (unlikely(base_len < name_len)) {
+        int tags_len = name_len - base_len;
+        if (STREAM_WRITE(suffix, suffix_len - 1, pipe) != suffix_len - 1) return 1;
+        if (STREAM_WRITE(name + base_len, tags_len, pipe) != tags_len) return 1;
+        if (STREAM_WRITE("|", 1, pipe) != 1) return 1;
+    } else if (STREAM_WRITE(suffix, suffix_len, pipe) != suffix_len) return 1;
+    if (STREAM_WRITE(val, val_len, pipe) != val_len) return 1;
+    if (STREAM_WRITE(ts, ts_len, pipe) != ts_len) return 1;
+    return 0;
+}
+
+/**
+ * The rendered names of the bins of a histogram, of the form
+ * ".histogram.bin_<start>|", which never change once configured.
+ */
+struct histogram_names {
+    int num_bins;
+    int *lens;
+    char **names;
+};
+
+/**
+ * Renders the name of a histogram bin, with a bound for the first and last
+ * @arg buf The output buffer, at least FORMAT_DOUBLE_MAX + 20 bytes
+ * @return The length of the name
+ */
+static int render_bin_name(char *buf, int i, int num_bins, double start, int places) {
+    // The first and last bins are below the min and above the max
+    const char *prefix = (i == 0) ? ".histogram.bin_<" : (i == num_bins - 1) ? ".histogram.bin_>" : ".histogram.bin_";
+    int len = strlen(prefix);
+    memcpy(buf, prefix, len);
+    len += format_double(buf + len, start, places);
+    buf[len++] = '|';
+    return len;
+}
+
+/**
+ * Returns the rendered bin names of a histogram, rendering them
+ * on first use. The flush threads may race to render them, and
+ * the first to publish its names wins.
+ * @return The names, or NULL on failure.
+ */
+static struct histogram_names* histogram_names(histogram_config *conf) {
+    struct histogram_names *names = __atomic_load_n(&conf->names, __ATOMIC_ACQUIRE);
+    if (likely(names != NULL)) return names;
+
+    int num = conf->num_bins;
+    names = malloc(sizeof(struct histogram_names));
+    names->num_bins = num;
+    names->lens = malloc(num * sizeof(int));
+    names->names = malloc(num * sizeof(char*));
+    char buf[FORMAT_DOUBLE_MAX + 20];
+    for (int i=0; i < num; i++) {
+        double start = (i == 0) ? conf->min_val : (i == num - 1) ? conf->max_val : histogram_bin_start(conf, i - 1);
+        int len = render_bin_name(buf, i, num, start, 2);
+        names->lens[i] = len;
+        names->names[i] = malloc(len);
+        memcpy(names->names[i], buf, len);
+    }
+
+    // Publish the names, unless another thread was first
+    struct histogram_names *expected = NULL;
+    if (__atomic_compare_exchange_n(&conf->names, &expected, names, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return names;
+    for (int i=0; i < num; i++) free(names->names[i]);
+    free(names->names);
+    free(names->lens);
+    free(names);
+    return expected;
+}
+
+/**
+ * The rendered ".<quantile>|" suffixes of the last quantiles a
+ * thread formatted. Most timers share the same quantiles, so
+ * the names are only rendered again when the quantiles change.
+ */
+typedef struct {
+    int num_quants;
+    double quantiles[MAX_QUANTILES];
+    int lens[MAX_QUANTILES];
+    char names[MAX_QUANTILES][FORMAT_QUANTILE_MAX + 2];
+} quantile_names;
+
+static __thread quantile_names QUANTILE_NAMES;
+
+// Returns the rendered suffixes of the quantiles of a timer. A gather
+// writer is flushed first if they change, since it refers to them.
+static quantile_names* timer_quantile_names(stream_gather *g, timer_hist *t) {
+    quantile_names *q = &QUANTILE_NAMES;
+    if (likely(q->num_quants == (int)t->num_quants &&
+                !memcmp(q->quantiles, t->quantiles, t->num_quants * sizeof(double))))
+        return q;
+    if (g) stream_gather_flush(g);
+
+    for (int i=0; i < (int)t->num_quants; i++) {
+        q->names[i][0] = '.';
+        q->lens[i] = 1 + format_quantile_name(q->names[i] + 1, t->quantiles[i]);
+        q->names[i][q->lens[i]++] = '|';
+        q->quantiles[i] = t->quantiles[i];
+    }
+    q->num_quants = t->num_quants;
+    return q;
+}
+
 static int stream_formatter(FILE *pipe, void *data, metric_type type, char *name, void *value) {
-    #define STREAM(...) if (fprintf(pipe, __VA_ARGS__, (long long)tv->tv_sec) < 0) return 1;
+    #define STREAM_LINE(prefix, suffix) if (stream_line(pipe, g, prefix, sizeof(prefix)-1, name, name_len, \
+                base_len, suffix, sizeof(suffix)-1, 0, val, val_len, ts, ts_len)) return 1;
+    #define STREAM_DBL(prefix, suffix, v) val_len = format_double(val, v, 6); STREAM_LINE(prefix, suffix)
+    #define STREAM_INT(prefix, suffix, v) val_len = format_int(val, v); STREAM_LINE(prefix, suffix)
     struct timeval *tv = data;
+    char ts[FORMAT_INT_MAX + 2];
+    char val[FORMAT_DOUBLE_MAX + FORMAT_INT_MAX + 1];
+    name = output_name(name);
+    int ts_len, val_len, name_len = strlen(name), base_len = name_len;
+    stream_gather *g = stream_gather_for(pipe);
+    double quants[MAX_QUANTILES];
+    quantile_names *qnames;
+    struct histogram_names *hnames;
     timer_hist *t;
     int i;
+
+    // Format the timestamp tail once for all the lines
+    ts[0] = '|';
+    ts_len = 1 + format_int(ts + 1, (long long)tv->tv_sec);
+    ts[ts_len++] = '\n';
+
+    // The suffixes go before the tags of a name
+    char *tags;
+    if (GLOBAL_CONFIG->parse_tags && (tags = memchr(name, ';', name_len))) base_len = tags - name;
+
     switch (type) {
         case KEY_VAL:
-            STREAM("%s|%f|%lld\n", name, *(double*)value);
+            STREAM_DBL("", "|", *(double*)value);
             break;
 
         case GAUGE:
-            STREAM("%s|%f|%lld\n", name, ((gauge_t*)value)->value);
+            STREAM_DBL("", "|", ((gauge_t*)value)->value);
             break;
 
         case COUNTER:
-            STREAM("%s|%f|%lld\n", name, counter_sum(value));
+            STREAM_DBL("", "|", counter_sum(value));
+            break;
+
+        case COUNTER_SUM:
+            STREAM_DBL("", "|", *(double*)value);
             break;
 
         case SET:
-            STREAM("%s|%lld|%lld\n", name, set_size(value));
+            STREAM_INT("", "|", set_size(value));
             break;
 
         case TIMER:
             t = (timer_hist*)value;
-            STREAM("timers.%s.sum|%f|%lld\n", name, timer_sum(&t->tm));
-            STREAM("timers.%s.sum_sq|%f|%lld\n", name, timer_squared_sum(&t->tm));
-            STREAM("timers.%s.mean|%f|%lld\n", name, timer_mean(&t->tm));
-            STREAM("timers.%s.lower|%f|%lld\n", name, timer_min(&t->tm));
-            STREAM("timers.%s.upper|%f|%lld\n", name, timer_max(&t->tm));
-            STREAM("timers.%s.count|%lld|%lld\n", name, timer_count(&t->tm));
-            STREAM("timers.%s.stdev|%f|%lld\n", name, timer_stddev(&t->tm));
-            STREAM("timers.%s.median|%f|%lld\n", name, timer_query(&t->tm, 0.5));
-            STREAM("timers.%s.upper_90|%f|%lld\n", name, timer_query(&t->tm, 0.9));
-            STREAM("timers.%s.upper_95|%f|%lld\n", name, timer_query(&t->tm, 0.95));
-            STREAM("timers.%s.upper_99|%f|%lld\n", name, timer_query(&t->tm, 0.99));
-
-            // Stream the histogram values
-            if (t->conf) {
-                STREAM("%s.histogram.bin_<%0.2f|%u|%lld\n", name, t->conf->min_val, t->counts[0]);
-                for (i=0; i < t->conf->num_bins-2; i++) {
-                    STREAM("%s.histogram.bin_%0.2f|%u|%lld\n", name, t->conf->min_val+(t->conf->bin_width*i), t->counts[i+1]);
+            STREAM_DBL("timers.", ".sum|", timer_sum(&t->tm));
+            STREAM_DBL("timers.", ".sum_sq|", timer_squared_sum(&t->tm));
+            STREAM_DBL("timers.", ".mean|", timer_mean(&t->tm));
+            STREAM_DBL("timers.", ".lower|", timer_min(&t->tm));
+            STREAM_DBL("timers.", ".upper|", timer_max(&t->tm));
+            STREAM_INT("timers.", ".count|", timer_count(&t->tm));
+            STREAM_DBL("timers.", ".stdev|", timer_stddev(&t->tm));
+            timer_query_many(&t->tm, t->quantiles, t->num_quants, quants);
+            qnames = timer_quantile_names(g, t);
+            for (i=0; i < t->num_quants; i++) {
+                val_len = format_double(val, quants[i], 6);
+                if (stream_line(pipe, g, "timers.", 7, name, name_len, base_len, qnames->names[i], qnames->lens[i],
+                            0, val, val_len, ts, ts_len)) return 1;
+            }
+
+            // The automatic bins change, so their names are rendered each time
+            if (t->conf && t->conf->scale == HISTOGRAM_AUTO) {
+                char bin[FORMAT_DOUBLE_MAX + 20];
+                int num_bins = timer_hist_num_bins(t);
+                for (i=0; i < num_bins; i++) {
+                    if (t->conf->skip_empty && !t->counts[i]) continue;
+                    int bin_len = render_bin_name(bin, i, num_bins, timer_hist_bin_start(t, i), 6);
+                    val_len = format_int(val, t->counts[i]);
+                    if (stream_line(pipe, g, "", 0, name, name_len, base_len, bin, bin_len,
+                                1, val, val_len, ts, ts_len)) return 1;
+                }
+
+            // Stream the histogram counts, after their pre-rendered bin names
+            } else if (t->conf && (hnames = histogram_names(t->conf))) {
+                for (i=0; i < hnames->num_bins; i++) {
+                    uint64_t count = timer_hist_count(t, i);
+                    if (t->conf->skip_empty && !count) continue;
+                    val_len = format_int(val, count);
+                    if (stream_line(pipe, g, "", 0, name, name_len, base_len, hnames->names[i], hnames->lens[i],
+                                0, val, val_len, ts, ts_len)) return 1;
                 }
-                STREAM("%s.histogram.bin_>%0.2f|%u|%lld\n", name, t->conf->max_val, t->counts[i+1]);
             }
             break;
 
@@ -131,48 +1000,166 @@ static int stream_formatter(FILE *pipe, void *data, metric_type type, char *name
     return 0;
 }
 
-/* Helps to write out a single binary result */
-#pragma pack(push,1)
-struct binary_out_prefix {
-    uint64_t timestamp;
-    uint8_t  type;
-    uint8_t  value_type;
-    uint16_t key_len;
-    double   val;
-};
-#pragma pack(pop)
-
-static int stream_bin_writer(FILE *pipe, uint64_t timestamp, unsigned char type,
-        unsigned char val_type, double val, char *name) {
-        uint16_t key_len = strlen(name) + 1;
-        struct binary_out_prefix out = {timestamp, type, val_type, key_len, val};
-        if (!fwrite(&out, sizeof(struct binary_out_prefix), 1, pipe)) return 1;
-        if (!fwrite(name, key_len, 1, pipe)) return 1;
-        return 0;
+/**
+ * Renders the key of a quantile in the JSON output, "P" and the
+ * percentile without trailing zeros, with two digits at least
+ * @arg buf The output buffer, at least FORMAT_DOUBLE_MAX + 2 bytes
+ * @return The length of the key
+ */
+static int json_quantile_key(char *buf, double quantile) {
+    buf[0] = 'P';
+    double pct = quantile * 100;
+    int len = 1;
+    if (pct < 10) buf[len++] = '0';
+    len += format_double(buf + len, pct, 6);
+    while (buf[len-1] == '0') len--;
+    if (buf[len-1] == '.') len--;
+    return len;
 }
 
-static int stream_formatter_bin(FILE *pipe, void *data, metric_type type, char *name, void *value) {
-    #define STREAM_BIN(...) if (stream_bin_writer(pipe, ((struct timeval *)data)->tv_sec, __VA_ARGS__, name)) return 1;
-    #define STREAM_UINT(val) if (!fwrite(&val, sizeof(unsigned int), 1, pipe)) return 1;
+/**
+ * Streaming callback to format the metrics as JSON, with a line
+ * for each metric of an object keyed by its name. The members are
+ * those the binary Ruby JSON sink made of the binary stream, and
+ * timers also have their histogram bins:
+ * {"<name>":{"type":"timer","ts":<ts>,"sum":...,"P99":...,"histogram":{"<0.00":...}}}
+ */
+static int stream_formatter_json(FILE *pipe, void *data, metric_type type, char *name, void *value) {
+    #define JSON_DBL(key, val) json_double(&w, key, sizeof(key) - 1, val)
+    #define JSON_INT(key, val) json_int(&w, key, sizeof(key) - 1, val)
+    #define JSON_TYPE(t) json_string(&w, "type", 4, t); JSON_INT("ts", tv->tv_sec)
+    struct timeval *tv = data;
+    json_writer w;
+    double quants[MAX_QUANTILES];
+    char key[FORMAT_DOUBLE_MAX + 2];
     timer_hist *t;
-    int i;
+    int i, len;
+
+    json_init(pipe, &w);
+    name = output_name(name);
+    json_open(&w, NULL, 0);
+    json_open(&w, name, strlen(name));
     switch (type) {
         case KEY_VAL:
-            STREAM_BIN(BIN_TYPE_KV, BIN_OUT_NO_TYPE, *(double*)value);
+            JSON_TYPE("kv");
+            JSON_DBL("kv", *(double*)value);
             break;
 
         case GAUGE:
-            STREAM_BIN(BIN_TYPE_GAUGE, BIN_OUT_NO_TYPE, ((gauge_t*)value)->value);
+            JSON_TYPE("gauge");
+            JSON_DBL("kv", ((gauge_t*)value)->value);
             break;
 
         case COUNTER:
-            STREAM_BIN(BIN_TYPE_COUNTER, BIN_OUT_SUM, counter_sum(value));
-            STREAM_BIN(BIN_TYPE_COUNTER, BIN_OUT_SUM_SQ, counter_squared_sum(value));
-            STREAM_BIN(BIN_TYPE_COUNTER, BIN_OUT_MEAN, counter_mean(value));
-            STREAM_BIN(BIN_TYPE_COUNTER, BIN_OUT_COUNT, counter_count(value));
-            STREAM_BIN(BIN_TYPE_COUNTER, BIN_OUT_STDDEV, counter_stddev(value));
-            STREAM_BIN(BIN_TYPE_COUNTER, BIN_OUT_MIN, counter_min(value));
-            STREAM_BIN(BIN_TYPE_COUNTER, BIN_OUT_MAX, counter_max(value));
+            JSON_TYPE("counter");
+            JSON_DBL("sum", counter_sum(value));
+            JSON_DBL("sumsqrt", counter_squared_sum(value));
+            JSON_DBL("mean", counter_mean(value));
+            JSON_INT("count", counter_count(value));
+            JSON_DBL("stddev", counter_stddev(value));
+            JSON_DBL("min", counter_min(value));
+            JSON_DBL("max", counter_max(value));
+            break;
+
+        case COUNTER_SUM:
+            JSON_TYPE("counter");
+            JSON_DBL("sum", *(double*)value);
+            break;
+
+        case SET:
+            JSON_TYPE("set");
+            JSON_INT("sum", set_size(value));
+            break;
+
+        case TIMER:
+            t = (timer_hist*)value;
+            JSON_TYPE("timer");
+            JSON_DBL("sum", timer_sum(&t->tm));
+            JSON_DBL("sumsqrt", timer_squared_sum(&t->tm));
+            JSON_DBL("mean", timer_mean(&t->tm));
+            JSON_INT("count", timer_count(&t->tm));
+            JSON_DBL("stddev", timer_stddev(&t->tm));
+            JSON_DBL("min", timer_min(&t->tm));
+            JSON_DBL("max", timer_max(&t->tm));
+            timer_query_many(&t->tm, t->quantiles, t->num_quants, quants);
+            for (i=0; i < t->num_quants; i++) {
+                len = json_quantile_key(key, t->quantiles[i]);
+                json_double(&w, key, len, quants[i]);
+            }
+
+            // The bins are keyed by their start, the automatic ones need more places
+            int num_bins = timer_hist_num_bins(t);
+            if (!num_bins) break;
+            int places = (t->conf && t->conf->scale == HISTOGRAM_AUTO) ? 6 : 2;
+            json_open(&w, "histogram", 9);
+            for (i=0; i < num_bins; i++) {
+                uint64_t count = timer_hist_count(t, i);
+                if (t->conf->skip_empty && !count) continue;
+                len = 0;
+                if (i == 0) key[len++] = '<';
+                else if (i == num_bins - 1) key[len++] = '>';
+                len += format_double(key + len, timer_hist_bin_start(t, i), places);
+                json_int(&w, key, len, count);
+            }
+            break;
+
+        default:
+            syslog(LOG_ERR, "Unknown metric type: %d", type);
+            return 0;
+    }
+    return (json_end_line(&w)) ? 1 : 0;
+}
+
+/* Helps to write out a single binary result */
+#pragma pack(push,1)
+struct binary_out_prefix {
+    uint64_t timestamp;
+    uint8_t  type;
+    uint8_t  value_type;
+    uint16_t key_len;
+    double   val;
+};
+#pragma pack(pop)
+
+static int stream_bin_writer(FILE *pipe, uint64_t timestamp, unsigned char type,
+        unsigned char val_type, double val, char *name) {
+        uint16_t key_len = strlen(name) + 1;
+        struct binary_out_prefix out = {timestamp, type, val_type, key_len, val};
+        if (!fwrite(&out, sizeof(struct binary_out_prefix), 1, pipe)) return 1;
+        if (!fwrite(name, key_len, 1, pipe)) return 1;
+        return 0;
+}
+
+static int stream_formatter_bin(FILE *pipe, void *data, metric_type type, char *name, void *value) {
+    #define STREAM_BIN(...) if (stream_bin_writer(pipe, ((struct timeval *)data)->tv_sec, __VA_ARGS__, name)) return 1;
+    // Histogram counts are sent as 32bit, and saturate
+    #define STREAM_UINT(val) { unsigned int v32 = (val > UINT_MAX) ? UINT_MAX : val; \
+            if (!fwrite(&v32, sizeof(unsigned int), 1, pipe)) return 1; }
+    name = output_name(name);
+    double quants[MAX_QUANTILES];
+    timer_hist *t;
+    int i, num_bins;
+    switch (type) {
+        case KEY_VAL:
+            STREAM_BIN(BIN_TYPE_KV, BIN_OUT_NO_TYPE, *(double*)value);
+            break;
+
+        case GAUGE:
+            STREAM_BIN(BIN_TYPE_GAUGE, BIN_OUT_NO_TYPE, ((gauge_t*)value)->value);
+            break;
+
+        case COUNTER:
+            STREAM_BIN(BIN_TYPE_COUNTER, BIN_OUT_SUM, counter_sum(value));
+            STREAM_BIN(BIN_TYPE_COUNTER, BIN_OUT_SUM_SQ, counter_squared_sum(value));
+            STREAM_BIN(BIN_TYPE_COUNTER, BIN_OUT_MEAN, counter_mean(value));
+            STREAM_BIN(BIN_TYPE_COUNTER, BIN_OUT_COUNT, counter_count(value));
+            STREAM_BIN(BIN_TYPE_COUNTER, BIN_OUT_STDDEV, counter_stddev(value));
+            STREAM_BIN(BIN_TYPE_COUNTER, BIN_OUT_MIN, counter_min(value));
+            STREAM_BIN(BIN_TYPE_COUNTER, BIN_OUT_MAX, counter_max(value));
+            break;
+
+        case COUNTER_SUM:
+            STREAM_BIN(BIN_TYPE_COUNTER, BIN_OUT_SUM, *(double*)value);
             break;
 
         case SET:
@@ -188,21 +1175,19 @@ static int stream_formatter_bin(FILE *pipe, void *data, metric_type type, char *
             STREAM_BIN(BIN_TYPE_TIMER, BIN_OUT_STDDEV, timer_stddev(&t->tm));
             STREAM_BIN(BIN_TYPE_TIMER, BIN_OUT_MIN, timer_min(&t->tm));
             STREAM_BIN(BIN_TYPE_TIMER, BIN_OUT_MAX, timer_max(&t->tm));
-            STREAM_BIN(BIN_TYPE_TIMER, BIN_OUT_PCT | 50, timer_query(&t->tm, 0.5));
-            STREAM_BIN(BIN_TYPE_TIMER, BIN_OUT_PCT | 90, timer_query(&t->tm, 0.90));
-            STREAM_BIN(BIN_TYPE_TIMER, BIN_OUT_PCT | 95, timer_query(&t->tm, 0.95));
-            STREAM_BIN(BIN_TYPE_TIMER, BIN_OUT_PCT | 99, timer_query(&t->tm, 0.99));
+            timer_query_many(&t->tm, t->quantiles, t->num_quants, quants);
+            for (i=0; i < t->num_quants; i++) {
+                STREAM_BIN(BIN_TYPE_TIMER, BIN_OUT_PCT | QUANTILE_PCT(t->quantiles[i]), quants[i]);
+            }
 
             // Binary streaming for histograms
-            if (t->conf) {
-                STREAM_BIN(BIN_TYPE_TIMER, BIN_OUT_HIST_FLOOR, t->conf->min_val);
-                STREAM_UINT(t->counts[0]);
-                for (i=0; i < t->conf->num_bins-2; i++) {
-                    STREAM_BIN(BIN_TYPE_TIMER, BIN_OUT_HIST_BIN, t->conf->min_val+(t->conf->bin_width*i));
-                    STREAM_UINT(t->counts[i+1]);
-                }
-                STREAM_BIN(BIN_TYPE_TIMER, BIN_OUT_HIST_CEIL, t->conf->max_val);
-                STREAM_UINT(t->counts[i+1]);
+            num_bins = timer_hist_num_bins(t);
+            for (i=0; i < num_bins; i++) {
+                uint64_t count = timer_hist_count(t, i);
+                if (t->conf->skip_empty && !count) continue;
+                STREAM_BIN(BIN_TYPE_TIMER, (i == 0) ? BIN_OUT_HIST_FLOOR : (i == num_bins - 1) ?
+                        BIN_OUT_HIST_CEIL : BIN_OUT_HIST_BIN, timer_hist_bin_start(t, i));
+                STREAM_UINT(count);
             }
             break;
 
@@ -213,250 +1198,2526 @@ static int stream_formatter_bin(FILE *pipe, void *data, metric_type type, char *
     return 0;
 }
 
+/*
+ * Helps to write out a grouped binary record, which has the key once,
+ * followed by the (value type, value) pairs of the metric, and then
+ * the counts of any histogram values, in order.
+ */
+#pragma pack(push,1)
+struct binary_group_prefix {
+    uint64_t timestamp;
+    uint8_t  type;
+    uint16_t num_values;
+    uint16_t num_counts;
+    uint16_t key_len;
+};
+
+/*
+ * A front coded record has the length of the prefix it shares with
+ * the key of the record before it in place of the key length,
+ * followed by the length of the rest of the key.
+ */
+struct binary_front_prefix {
+    uint64_t timestamp;
+    uint8_t  type;
+    uint16_t num_values;
+    uint16_t num_counts;
+    uint16_t shared_len;
+    uint16_t suffix_len;
+};
+
+struct binary_group_value {
+    uint8_t  value_type;
+    double   val;
+};
+#pragma pack(pop)
+
+// Enough for the records of most metrics, without allocating
+#define GROUP_STACK_SIZE 8192
+
+// Returns the length of the prefix two keys share
+static uint16_t shared_prefix_len(const char *prev, const char *name) {
+    uint16_t len = 0;
+    if (!prev) return 0;
+    while (prev[len] && prev[len] == name[len]) len++;
+    return len;
+}
+
 /**
- * This is the thread that is invoked to handle flushing metrics
+ * Writes a grouped binary record, with its key front coded
+ * against the key streamed before it if enabled.
  */
-static void* flush_thread(void *arg) {
-    // Cast the args
-    metrics *m = arg;
+static int stream_group_writer(FILE *pipe, void *data, metric_type type, char *name, void *value, int front_coded) {
+    // Size the record for the most values the type can have
+    name = output_name(name);
+    uint16_t key_len = strlen(name) + 1;
+    char *prev = (front_coded) ? stream_prev_name() : NULL;
+    uint16_t shared_len = (prev) ? shared_prefix_len(output_name(prev), name) : 0;
+    size_t prefix_size = (front_coded) ? sizeof(struct binary_front_prefix) : sizeof(struct binary_group_prefix);
+    timer_hist *t = (type == TIMER) ? value : NULL;
+    int max_values = 7, max_counts = 0;
+    if (t) max_values += t->num_quants;
+    if (t) {
+        max_counts = timer_hist_num_bins(t);
+        max_values += max_counts;
+    }
+    // Only the rest of a front coded key is written
+    key_len -= shared_len;
+    size_t size = prefix_size + key_len +
+        max_values * sizeof(struct binary_group_value) + max_counts * sizeof(uint64_t);
 
-    // Get the current time
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
+    char stack[GROUP_STACK_SIZE];
+    char *buf = (size <= sizeof(stack)) ? stack : malloc(size);
+    struct binary_group_value *vals = (struct binary_group_value*)(buf + prefix_size + key_len);
+    memcpy(buf + prefix_size, name + shared_len, key_len);
 
-    // Determine which callback to use
-    stream_callback cb = (GLOBAL_CONFIG->binary_stream)? stream_formatter_bin: stream_formatter;
+    #define GROUP_VAL(vt, v) vals[num_values].value_type = vt; vals[num_values++].val = v;
+    int num_values = 0, i;
+    double quants[MAX_QUANTILES];
+    unsigned char bin_type;
+    switch (type) {
+        case KEY_VAL:
+            bin_type = BIN_TYPE_KV;
+            GROUP_VAL(BIN_OUT_NO_TYPE, *(double*)value);
+            break;
 
-    // Stream the records
-    int res = stream_to_command(m, &tv, cb, GLOBAL_CONFIG->stream_cmd);
-    if (res != 0) {
-        syslog(LOG_WARNING, "Streaming command exited with status %d", res);
+        case GAUGE:
+            bin_type = BIN_TYPE_GAUGE;
+            GROUP_VAL(BIN_OUT_NO_TYPE, ((gauge_t*)value)->value);
+            break;
+
+        case COUNTER:
+            bin_type = BIN_TYPE_COUNTER;
+            GROUP_VAL(BIN_OUT_SUM, counter_sum(value));
+            GROUP_VAL(BIN_OUT_SUM_SQ, counter_squared_sum(value));
+            GROUP_VAL(BIN_OUT_MEAN, counter_mean(value));
+            GROUP_VAL(BIN_OUT_COUNT, counter_count(value));
+            GROUP_VAL(BIN_OUT_STDDEV, counter_stddev(value));
+            GROUP_VAL(BIN_OUT_MIN, counter_min(value));
+            GROUP_VAL(BIN_OUT_MAX, counter_max(value));
+            break;
+
+        case COUNTER_SUM:
+            bin_type = BIN_TYPE_COUNTER;
+            GROUP_VAL(BIN_OUT_SUM, *(double*)value);
+            break;
+
+        case SET:
+            bin_type = BIN_TYPE_SET;
+            GROUP_VAL(BIN_OUT_SUM, set_size(value));
+            break;
+
+        case TIMER:
+            bin_type = BIN_TYPE_TIMER;
+            GROUP_VAL(BIN_OUT_SUM, timer_sum(&t->tm));
+            GROUP_VAL(BIN_OUT_SUM_SQ, timer_squared_sum(&t->tm));
+            GROUP_VAL(BIN_OUT_MEAN, timer_mean(&t->tm));
+            GROUP_VAL(BIN_OUT_COUNT, timer_count(&t->tm));
+            GROUP_VAL(BIN_OUT_STDDEV, timer_stddev(&t->tm));
+            GROUP_VAL(BIN_OUT_MIN, timer_min(&t->tm));
+            GROUP_VAL(BIN_OUT_MAX, timer_max(&t->tm));
+            timer_query_many(&t->tm, t->quantiles, t->num_quants, quants);
+            for (i=0; i < t->num_quants; i++) {
+                GROUP_VAL(BIN_OUT_PCT | QUANTILE_PCT(t->quantiles[i]), quants[i]);
+            }
+
+            // The histogram values, the counts follow the values
+            for (i=0; i < max_counts; i++) {
+                GROUP_VAL((i == 0) ? BIN_OUT_HIST_FLOOR : (i == max_counts - 1) ?
+                        BIN_OUT_HIST_CEIL : BIN_OUT_HIST_BIN, timer_hist_bin_start(t, i));
+            }
+            for (i=0; i < max_counts; i++) {
+                uint64_t count = timer_hist_count(t, i);
+                memcpy((char*)(vals + num_values) + i * sizeof(uint64_t), &count, sizeof(count));
+            }
+            break;
+
+        default:
+            syslog(LOG_ERR, "Unknown metric type: %d", type);
+            if (buf != stack) free(buf);
+            return 0;
+    }
+
+    // Fill in the header, and write the record at once
+    uint64_t timestamp = ((struct timeval *)data)->tv_sec;
+    if (front_coded) {
+        *(struct binary_front_prefix*)buf = (struct binary_front_prefix){timestamp,
+            bin_type, num_values, max_counts, shared_len, key_len};
+    } else {
+        *(struct binary_group_prefix*)buf = (struct binary_group_prefix){timestamp,
+            bin_type, num_values, max_counts, key_len};
+    }
+    size = prefix_size + key_len + num_values * sizeof(struct binary_group_value) +
+        max_counts * sizeof(uint64_t);
+    int res = !fwrite(buf, size, 1, pipe);
+    if (buf != stack) free(buf);
+    return res;
+}
+
+static int stream_formatter_bin_grouped(FILE *pipe, void *data, metric_type type, char *name, void *value) {
+    return stream_group_writer(pipe, data, type, name, value, 0);
+}
+
+static int stream_formatter_bin_front_coded(FILE *pipe, void *data, metric_type type, char *name, void *value) {
+    return stream_group_writer(pipe, data, type, name, value, 1);
+}
+
+/*
+ * Columnar streams have blocks of metrics of one type. Each block
+ * has a header, the value type and parameter of each column, the
+ * NULL terminated names of its metrics, and then the values of each
+ * column, a contiguous array of a double for each metric. The
+ * parameter of a histogram column is the start of its bin, and the
+ * values are the counts of the bin.
+ */
+#pragma pack(push,1)
+struct columnar_header {
+    uint64_t timestamp;
+    uint8_t  type;
+    uint16_t num_columns;
+    uint32_t num_metrics;
+    uint32_t names_len;
+};
+
+struct columnar_column {
+    uint8_t  value_type;
+    double   param;
+};
+#pragma pack(pop)
+
+// The most metrics in a block, which bounds the buffered values
+#define COLUMNAR_BLOCK_METRICS 4096
+
+// The values of a column of a block
+#define COLUMNAR_VALUES(b, c) ((b)->values + (c) * COLUMNAR_BLOCK_METRICS)
+
+// The columns of the full counters
+static const uint8_t COUNTER_COLUMNS[] = {BIN_OUT_SUM, BIN_OUT_SUM_SQ, BIN_OUT_MEAN,
+    BIN_OUT_COUNT, BIN_OUT_STDDEV, BIN_OUT_MIN, BIN_OUT_MAX};
+
+// A block being buffered, until it is full or the run ends
+typedef struct {
+    metric_type type;
+    uint64_t timestamp;
+    double *quantiles;          // The quantiles of a block of timers
+    uint32_t num_quants;
+    histogram_config *conf;     // The histogram of a block of timers
+    struct columnar_column *columns;
+    int num_columns;
+    int num_metrics;
+    char *names;
+    size_t names_len;
+    size_t names_size;
+    double *values;             // The values of each column in turn
+} columnar_block;
+
+// Each run of metrics is serialized on one thread, see stream_set_block_output
+static __thread columnar_block COLUMNAR_BLOCK;
+
+/**
+ * Returns the histogram of a timer that has columns. The bins
+ * of automatic histograms differ by timer, so they are left out.
+ */
+static histogram_config* columnar_histogram(timer_hist *t) {
+    return (t && t->conf && t->conf->scale != HISTOGRAM_AUTO) ? t->conf : NULL;
+}
+
+// Sets up the columns of an empty block for a metric
+static int columnar_start(columnar_block *b, uint64_t timestamp, metric_type type, timer_hist *t) {
+    histogram_config *conf = columnar_histogram(t);
+    int num_columns = 1;
+    if (type == COUNTER || type == TIMER) num_columns = sizeof(COUNTER_COLUMNS);
+    if (t) num_columns += t->num_quants + (conf ? conf->num_bins : 0);
+
+    free(b->columns);
+    free(b->values);
+    b->columns = malloc(num_columns * sizeof(struct columnar_column));
+    b->values = malloc(COLUMNAR_BLOCK_METRICS * num_columns * sizeof(double));
+    if (!b->columns || !b->values) return 1;
+
+    // The same columns as the records of the binary stream
+    b->type = type;
+    b->timestamp = timestamp;
+    b->quantiles = (t) ? t->quantiles : NULL;
+    b->num_quants = (t) ? t->num_quants : 0;
+    b->conf = conf;
+    b->num_columns = num_columns;
+    int i = 0;
+    if (type == COUNTER || type == TIMER) {
+        for (; i < (int)sizeof(COUNTER_COLUMNS); i++) {
+            b->columns[i] = (struct columnar_column){COUNTER_COLUMNS[i], 0};
+        }
+    } else {
+        b->columns[i++] = (struct columnar_column){(type == KEY_VAL || type == GAUGE) ?
+            BIN_OUT_NO_TYPE : BIN_OUT_SUM, 0};
+    }
+    for (uint32_t q=0; t && q < t->num_quants; q++) {
+        b->columns[i++] = (struct columnar_column){BIN_OUT_PCT | QUANTILE_PCT(t->quantiles[q]), 0};
+    }
+    if (conf) {
+        b->columns[i++] = (struct columnar_column){BIN_OUT_HIST_FLOOR, conf->min_val};
+        for (int bin=0; bin < conf->num_bins-2; bin++) {
+            b->columns[i++] = (struct columnar_column){BIN_OUT_HIST_BIN, histogram_bin_start(conf, bin)};
+        }
+        b->columns[i++] = (struct columnar_column){BIN_OUT_HIST_CEIL, conf->max_val};
+    }
+    return 0;
+}
+
+/*
+ * Computes the mean and stddev columns of a block of counters or
+ * timers from their sums and counts, in one pass over the columns,
+ * which the compiler can vectorize. This matches counter_stddev
+ * and timer_stddev.
+ */
+static void columnar_moments(columnar_block *b) {
+    double *sum = COLUMNAR_VALUES(b, 0), *squared_sum = COLUMNAR_VALUES(b, 1);
+    double *mean = COLUMNAR_VALUES(b, 2), *count = COLUMNAR_VALUES(b, 3);
+    double *stddev = COLUMNAR_VALUES(b, 4);
+    for (int i=0; i < b->num_metrics; i++) {
+        double n = count[i];
+        double div = n * (n - 1);
+        mean[i] = (n) ? sum[i] / n : 0;
+        stddev[i] = (div) ? sqrt((n * squared_sum[i] - sum[i] * sum[i]) / div) : 0;
+    }
+}
+
+// Writes out a block, and empties it
+static int columnar_write(FILE *pipe, columnar_block *b) {
+    if (!b->num_metrics) return 0;
+    if (b->type == COUNTER || b->type == TIMER) columnar_moments(b);
+    static const unsigned char bin_types[] = {
+        [KEY_VAL] = BIN_TYPE_KV, [COUNTER] = BIN_TYPE_COUNTER, [COUNTER_SUM] = BIN_TYPE_COUNTER,
+        [TIMER] = BIN_TYPE_TIMER, [SET] = BIN_TYPE_SET, [GAUGE] = BIN_TYPE_GAUGE};
+    struct columnar_header header = {b->timestamp, bin_types[b->type], b->num_columns,
+        b->num_metrics, b->names_len};
+    int res = !fwrite(&header, sizeof(header), 1, pipe) ||
+        !fwrite(b->columns, b->num_columns * sizeof(struct columnar_column), 1, pipe) ||
+        !fwrite(b->names, b->names_len, 1, pipe);
+
+    // Write each column at once
+    for (int c=0; c < b->num_columns && !res; c++) {
+        res = !fwrite(COLUMNAR_VALUES(b, c), b->num_metrics * sizeof(double), 1, pipe);
+    }
+    b->num_metrics = 0;
+    b->names_len = 0;
+    return res;
+}
+
+// Writes out the last block of a run, and frees the block
+static int columnar_end(FILE *pipe, columnar_block *b) {
+    int res = columnar_write(pipe, b);
+    free(b->columns);
+    free(b->names);
+    free(b->values);
+    memset(b, 0, sizeof(columnar_block));
+    return res;
+}
+
+static int stream_formatter_columnar(FILE *pipe, void *data, metric_type type, char *name, void *value) {
+    columnar_block *b = &COLUMNAR_BLOCK;
+    if (!name) return columnar_end(pipe, b);
+    name = output_name(name);
+
+    // Start a new block if this metric has other columns
+    timer_hist *t = (type == TIMER) ? value : NULL;
+    if (b->num_metrics && (b->type != type || b->num_metrics == COLUMNAR_BLOCK_METRICS ||
+            (t && (t->quantiles != b->quantiles || t->num_quants != b->num_quants || columnar_histogram(t) != b->conf)))) {
+        if (columnar_write(pipe, b)) return 1;
+    }
+    if (!b->num_metrics) {
+        if (type != KEY_VAL && type != GAUGE && type != COUNTER && type != COUNTER_SUM &&
+                type != SET && type != TIMER) {
+            syslog(LOG_ERR, "Unknown metric type: %d", type);
+            return 0;
+        }
+        if (columnar_start(b, ((struct timeval *)data)->tv_sec, type, t)) return 1;
+    }
+
+    // Append the name
+    size_t name_len = strlen(name) + 1;
+    if (b->names_len + name_len > b->names_size) {
+        size_t size = (b->names_size) ? b->names_size * 2 : 65536;
+        while (size < b->names_len + name_len) size *= 2;
+        char *names = realloc(b->names, size);
+        if (!names) return 1;
+        b->names = names;
+        b->names_size = size;
+    }
+    memcpy(b->names + b->names_len, name, name_len);
+    b->names_len += name_len;
+
+    // Append the values of the columns. The mean and stddev of
+    // counters and timers are left to columnar_moments.
+    double *col = b->values + b->num_metrics++;
+    switch (type) {
+        case KEY_VAL:
+        case COUNTER_SUM:
+            col[0] = *(double*)value;
+            break;
+
+        case GAUGE:
+            col[0] = ((gauge_t*)value)->value;
+            break;
+
+        case SET:
+            col[0] = set_size(value);
+            break;
+
+        case COUNTER:
+            col[0] = counter_sum(value);
+            col[1 * COLUMNAR_BLOCK_METRICS] = counter_squared_sum(value);
+            col[3 * COLUMNAR_BLOCK_METRICS] = counter_count(value);
+            col[5 * COLUMNAR_BLOCK_METRICS] = counter_min(value);
+            col[6 * COLUMNAR_BLOCK_METRICS] = counter_max(value);
+            break;
+
+        default: {
+            col[0] = timer_sum(&t->tm);
+            col[1 * COLUMNAR_BLOCK_METRICS] = timer_squared_sum(&t->tm);
+            col[3 * COLUMNAR_BLOCK_METRICS] = timer_count(&t->tm);
+            col[5 * COLUMNAR_BLOCK_METRICS] = timer_min(&t->tm);
+            col[6 * COLUMNAR_BLOCK_METRICS] = timer_max(&t->tm);
+            double quants[t->num_quants + 1];
+            timer_query_many(&t->tm, t->quantiles, t->num_quants, quants);
+            int i = 7;
+            for (uint32_t q=0; q < t->num_quants; q++) {
+                col[i++ * COLUMNAR_BLOCK_METRICS] = quants[q];
+            }
+            histogram_config *conf = columnar_histogram(t);
+            for (int bin=0; conf && bin < conf->num_bins; bin++) {
+                col[i++ * COLUMNAR_BLOCK_METRICS] = timer_hist_count(t, bin);
+            }
+            break;
+        }
     }
+    return 0;
+}
+
+/*
+ * Sketch streams are written in the binary input protocol, so an
+ * upstream statsite merges them into its own metrics. Counters,
+ * sets and timers are sent as sketch frames, and the rest as plain
+ * binary commands.
+ */
+#pragma pack(push,1)
+struct binary_in_prefix {
+    uint8_t  magic;
+    uint8_t  type;
+    uint16_t key_len;
+    double   val;
+};
+
+struct binary_sketch_prefix {
+    uint8_t  magic;
+    uint8_t  type;
+    uint16_t key_len;
+    uint32_t sketch_len;
+};
+#pragma pack(pop)
+
+// Writes a binary command, with a single value
+static int stream_in_writer(FILE *pipe, unsigned char type, double val, char *name, uint16_t key_len) {
+    struct binary_in_prefix out = {BINARY_MAGIC_BYTE, type, key_len, val};
+    if (!fwrite(&out, sizeof(out), 1, pipe)) return 1;
+    if (!fwrite(name, key_len, 1, pipe)) return 1;
+    return 0;
+}
+
+static int stream_formatter_sketch(FILE *pipe, void *data, metric_type type, char *name, void *value) {
+    uint16_t key_len = strlen(name) + 1;
+    gauge_t *g;
+    switch (type) {
+        case KEY_VAL:
+            return stream_in_writer(pipe, BIN_TYPE_KV, *(double*)value, name, key_len);
+        case GAUGE:
+            g = value;
+            return stream_in_writer(pipe, (g->is_set) ? BIN_TYPE_GAUGE : BIN_TYPE_GAUGE_DELTA, g->value, name, key_len);
+        case COUNTER_SUM:
+            return stream_in_writer(pipe, BIN_TYPE_COUNTER, *(double*)value, name, key_len);
+        case COUNTER:
+        case SET:
+        case TIMER:
+            break;
+        default:
+            syslog(LOG_ERR, "Unknown metric type: %d", type);
+            return 0;
+    }
+
+    // Encode the sketch first, the frame carries its length
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&buf, &len);
+    if (!f) return 1;
+    int res;
+    if (type == COUNTER)
+        res = sketch_encode_counter(f, value);
+    else if (type == SET)
+        res = sketch_encode_set(f, value);
+    else
+        res = sketch_encode_timer(f, &((timer_hist*)value)->tm);
+    if (fclose(f)) res = 1;
 
-    // Cleanup
-    destroy_metrics(m);
-    free(m);
+    struct binary_sketch_prefix out = {BINARY_MAGIC_BYTE, BIN_TYPE_SKETCH, key_len, len};
+    if (!res && (!fwrite(&out, sizeof(out), 1, pipe) ||
+            !fwrite(name, key_len, 1, pipe) || !fwrite(buf, len, 1, pipe))) res = 1;
+    free(buf);
+    return (res) ? 1 : 0;
+}
+
+// Returns the monotonic time in milliseconds, for timing the phases of a flush
+static double monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Returns the milliseconds elapsed since start
+static double elapsed_ms(struct timeval *start) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+// Adds an internal stat to the metrics, under the statsite. prefix
+static void add_internal_stat(metrics *m, metric_type type, const char *name, double val) {
+    char key[64];
+    snprintf(key, sizeof(key), "statsite.%s", name);
+    metrics_add_sample(m, type, key, val);
 }
 
 /**
- * Invoked to when we've reached the flush interval timeout
+ * Adds the heaviest keys of a summary as gauges of their
+ * rate per second, under statsite.top_keys.<name>.
+ * @arg m The merged metrics of the interval
+ * @arg t The summary of the heaviest keys
+ * @arg name The name of the summary
  */
-void flush_interval_trigger() {
-    // Make a new metrics object
-    metrics *m = malloc(sizeof(metrics));
-    init_metrics(GLOBAL_CONFIG->timer_eps, (double*)&QUANTILES, NUM_QUANTILES,
-            GLOBAL_CONFIG->histograms, GLOBAL_CONFIG->set_precision, m);
+static void add_top_keys(metrics *m, topk *t, const char *name) {
+    topk_entry top[GLOBAL_CONFIG->top_keys];
+    int num = topk_top(t, top, GLOBAL_CONFIG->top_keys);
+    char *key;
+    for (int i=0; i < num; i++) {
+        if (asprintf(&key, "statsite.top_keys.%s.%s", name, top[i].key) < 0) return;
+        metrics_add_sample(m, GAUGE, key, (double)top[i].count / GLOBAL_CONFIG->flush_interval);
+        free(key);
+    }
+}
 
-    // Swap with the new one
-    metrics *old = GLOBAL_METRICS;
-    GLOBAL_METRICS = m;
+/**
+ * Adds the internal stats to the metrics being flushed.
+ * The counters are added as the change since the last flush.
+ * @arg m The merged metrics of the interval
+ */
+static void add_internal_stats(metrics *m) {
+    // Count the keys before adding our own
+    int counters = counter_map_size(&m->counters) + sum_map_size(&m->sums);
+    int timers = hashmap_size(m->timers);
+    int sets = hashmap_size(m->sets);
+    int gauges = gauge_map_size(&m->gauges);
+    add_internal_stat(m, GAUGE, "keys.counters", counters);
+    add_internal_stat(m, GAUGE, "keys.timers", timers);
+    add_internal_stat(m, GAUGE, "keys.sets", sets);
+    add_internal_stat(m, GAUGE, "keys.gauges", gauges);
+    if (m->top_samples) {
+        add_top_keys(m, m->top_samples, "samples");
+        add_top_keys(m, m->top_bytes, "bytes");
+    }
 
-    // Start a flush thread
-    pthread_t thread;
-    pthread_create(&thread, NULL, flush_thread, old);
-    pthread_detach(thread);
+    uint64_t totals[NUM_STATS];
+    stats_collect(totals);
+    pthread_mutex_lock(&FLUSH_STATS_LOCK);
+    for (int i=0; i < NUM_STATS; i++) {
+        add_internal_stat(m, COUNTER, STAT_NAMES[i], totals[i] - LAST_STATS[i]);
+        LAST_STATS[i] = totals[i];
+    }
+    int64_t mem[NUM_MEMS];
+    stats_mem_collect(mem);
+    for (int i=0; i < NUM_MEMS; i++) {
+        add_internal_stat(m, GAUGE, MEM_NAMES[i], mem[i]);
+    }
+    if (GLOBAL_CONFIG->memory_budget)
+        add_internal_stat(m, GAUGE, "memory.level", __atomic_load_n(&MEMORY_LEVEL, __ATOMIC_RELAXED));
+    if (HAVE_LAST_FLUSH) {
+        add_internal_stat(m, GAUGE, "flush_ms", LAST_FLUSH_MS);
+        add_internal_stat(m, GAUGE, "stream_ms", LAST_STREAM_MS);
+        add_internal_stat(m, GAUGE, "sink_status", LAST_SINK_STATUS);
+        add_internal_stat(m, GAUGE, "flush.swap_ms", LAST_PHASES.swap);
+        add_internal_stat(m, GAUGE, "flush.merge_ms", LAST_PHASES.merge);
+        add_internal_stat(m, GAUGE, "flush.finalize_ms", LAST_PHASES.finalize);
+        add_internal_stat(m, GAUGE, "flush.format_ms", LAST_PHASES.format);
+        add_internal_stat(m, GAUGE, "flush.write_ms", LAST_PHASES.write);
+        add_internal_stat(m, GAUGE, "flush.command_ms", LAST_PHASES.command);
+        add_internal_stat(m, GAUGE, "flush.release_ms", LAST_PHASES.release);
+    }
+    pthread_mutex_unlock(&FLUSH_STATS_LOCK);
 }
 
 /**
- * Called when statsite is terminating to flush the
- * final set of metrics
+ * Swaps out the metrics object of every shard. The new objects
+ * come from the pool, so this is only an exchange of pointers
+ * unless the flushes fell too far behind to return them.
+ * @arg replace Should a new metrics object be installed,
+ * otherwise the shards are left empty.
+ * @return An array of the old metrics objects, one per shard
  */
-void final_flush() {
-    // Get the last set of metrics
-    metrics *old = GLOBAL_METRICS;
-    GLOBAL_METRICS = NULL;
+static metrics** swap_shards(int replace) {
+    metrics **old = malloc(NUM_SHARDS * sizeof(metrics*));
+    metrics *m;
+    int level = __atomic_load_n(&MEMORY_LEVEL, __ATOMIC_RELAXED);
 
-    // Start a flush thread
-    pthread_t thread;
-    pthread_create(&thread, NULL, flush_thread, old);
+    // The shards of the new interval share a map, which the old one
+    // is done with once every shard has been swapped
+    shared_map *shared = NULL;
+    if (replace && GLOBAL_CONFIG->shared_counter_keys) {
+        pthread_mutex_lock(&POOL_LOCK);
+        shared = SPARE_SHARED;
+        SPARE_SHARED = NULL;
+        pthread_mutex_unlock(&POOL_LOCK);
+        if (!shared && shared_map_create(GLOBAL_CONFIG->shared_counter_keys, &shared))
+            shared = NULL;
+    }
+
+    for (int i=0; i < NUM_SHARDS; i++) {
+        // Take the new object before taking the lock
+        m = (replace) ? new_metrics(i) : NULL;
+        if (m) metrics_set_shared(m, shared);
+        if (m && GLOBAL_CONFIG->memory_budget) set_memory_level(m, level);
+        pthread_mutex_lock(&GLOBAL_SHARDS[i].lock);
+        old[i] = GLOBAL_SHARDS[i].m;
+        GLOBAL_SHARDS[i].m = m;
+        GLOBAL_SHARDS[i].memory_level = level;
+        pthread_mutex_unlock(&GLOBAL_SHARDS[i].lock);
+    }
+    int out = __atomic_add_fetch(&OUT_INTERVALS, 1, __ATOMIC_ACQ_REL);
+    if (!replace) return old;
+
+    // Have the preparer make the next objects if an earlier
+    // interval still holds the ones that would be pooled
+    pthread_mutex_lock(&POOL_LOCK);
+    for (int i=0; i < NUM_SHARDS; i++) {
+        metrics_get_sizes(old[i], POOL_SIZES + i);
+    }
+    if (out > 1) {
+        PREPARE_PENDING = 1;
+        pthread_cond_signal(&PREPARE_COND);
+    }
+    pthread_mutex_unlock(&POOL_LOCK);
+    return old;
+}
+
+/**
+ * Returns the stream callback that formats the flushes in
+ * the output format of a configuration. The callback is passed
+ * the time of the flush, as a struct timeval, for its data.
+ * @arg config The configuration
+ * @return The stream callback
+ */
+stream_callback output_formatter(statsite_config *config) {
+    if (config->sketch_stream) return stream_formatter_sketch;
+    if (config->columnar_stream) return stream_formatter_columnar;
+    if (config->json_stream) return stream_formatter_json;
+    if (!config->binary_stream) return stream_formatter;
+    if (config->binary_stream_front_coded) return stream_formatter_bin_front_coded;
+    return (config->binary_stream_grouped) ? stream_formatter_bin_grouped : stream_formatter_bin;
+}
+
+// Returns the stream callback for the configured output format
+static stream_callback output_callback() {
+    return output_formatter(GLOBAL_CONFIG);
+}
+
+// Formats the metrics of a query, as the ASCII stream does
+struct query_info {
+    FILE *out;
+    struct timeval tv;
+};
+
+static int query_cb(void *data, metric_type type, char *name, void *value) {
+    struct query_info *info = data;
+    return stream_formatter(info->out, &info->tv, type, name, value);
+}
+
+int query_metrics(const char *prefix, FILE *out) {
+    // The matches are merged with the settings of the intervals,
+    // but without the limits, which would hide keys that exist
+    metrics m;
+    if (init_metrics(GLOBAL_CONFIG->timer_eps, GLOBAL_CONFIG->quantiles, GLOBAL_CONFIG->num_quantiles,
+            GLOBAL_CONFIG->histograms, GLOBAL_CONFIG->set_precision, &m)) return -1;
+    metrics_set_timer_engine(&m, GLOBAL_CONFIG->timer_engine,
+            GLOBAL_CONFIG->tdigest_compression, GLOBAL_CONFIG->timer_engines);
+    metrics_set_max_exact(&m, GLOBAL_CONFIG->set_max_exact);
+    metrics_set_counter_mode(&m, GLOBAL_CONFIG->counter_sum_only, GLOBAL_CONFIG->counter_modes);
+    metrics_set_precisions(&m, GLOBAL_CONFIG->set_precisions);
+
+    int res = 0;
+    for (int i=0; i < NUM_SHARDS && !res; i++) {
+        metrics_shard *shard = GLOBAL_SHARDS + i;
+        pthread_mutex_lock(&shard->lock);
+        res = metrics_merge_prefix(&m, shard->m, prefix);
+
+        // The shard lock keeps the shared map of the interval in use
+        if (!res && !i && shard->m->shared)
+            res = metrics_merge_shared(&m, shard->m->shared, prefix);
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    struct query_info info = {out};
+    gettimeofday(&info.tv, NULL);
+    if (!res) res = metrics_iter(&m, &info, query_cb);
+    destroy_metrics(&m);
+    return res;
+}
+
+/**
+ * Persistent sinks get a delimiter after each flush. For ASCII
+ * this is an empty line, and for binary it is a header with a
+ * zero key length, since keys always include the NULL byte.
+ * Columnar streams get a block header with no metrics. Sketch
+ * streams have none, they are read as input upstream.
+ * @arg tv The time of the flush
+ * @arg delim Output. Filled in with the delimiter
+ * @return The length of the delimiter
+ */
+static int output_delimiter(struct timeval *tv, char *delim) {
+    if (GLOBAL_CONFIG->sketch_stream) {
+        return 0;
+    } else if (GLOBAL_CONFIG->columnar_stream) {
+        struct columnar_header frame = {tv->tv_sec, 0, 0, 0, 0};
+        memcpy(delim, &frame, sizeof(frame));
+        return sizeof(frame);
+    } else if (GLOBAL_CONFIG->binary_stream && GLOBAL_CONFIG->binary_stream_front_coded) {
+        struct binary_front_prefix frame = {tv->tv_sec, 0, 0, 0, 0, 0};
+        memcpy(delim, &frame, sizeof(frame));
+        return sizeof(frame);
+    } else if (GLOBAL_CONFIG->binary_stream && GLOBAL_CONFIG->binary_stream_grouped) {
+        struct binary_group_prefix frame = {tv->tv_sec, 0, 0, 0, 0};
+        memcpy(delim, &frame, sizeof(frame));
+        return sizeof(frame);
+    } else if (GLOBAL_CONFIG->binary_stream) {
+        struct binary_out_prefix frame = {tv->tv_sec, 0, 0, 0, 0};
+        memcpy(delim, &frame, sizeof(frame));
+        return sizeof(frame);
+    }
+    delim[0] = '\n';
+    return 1;
+}
+
+/**
+ * Detaches the shared map from the shards of an interval,
+ * and clears it for a later interval
+ */
+static void release_shared(metrics **shards) {
+    shared_map *s = shards[0]->shared;
+    if (!s) return;
+    for (int i=0; i < NUM_SHARDS; i++) {
+        metrics_set_shared(shards[i], NULL);
+    }
+    shared_map_clear(s);
+    pthread_mutex_lock(&POOL_LOCK);
+    if (!SPARE_SHARED) {
+        SPARE_SHARED = s;
+        s = NULL;
+    }
+    pthread_mutex_unlock(&POOL_LOCK);
+    if (s) shared_map_destroy(s);
+}
+
+/**
+ * Merges the shared counters and gauges of an interval into
+ * its first shard, and releases the shared map
+ */
+static void fold_shared(metrics **shards) {
+    if (!shards[0]->shared) return;
+    metrics_merge_shared(shards[0], shards[0]->shared, NULL);
+    release_shared(shards);
+}
+
+/**
+ * Merges the shards into the first, so that each key is
+ * only reported once, and folds in the input count.
+ * @return The merged metrics
+ */
+static metrics* merge_shards(metrics **shards) {
+    metrics *m = shards[0];
+    fold_shared(shards);
+    for (int i=1; i < NUM_SHARDS; i++) {
+        metrics_merge(m, shards[i]);
+    }
+
+    // Fold the input count into its counter once
+    if (GLOBAL_CONFIG->input_counter && m->inputs) {
+        metrics_add_counter_samples(m, GLOBAL_CONFIG->input_counter, 1, m->inputs);
+    }
+    return m;
+}
+
+// Returns the metrics of every shard to the pool
+static void release_shards(metrics **shards) {
+    release_shared(shards);
+    for (int i=0; i < NUM_SHARDS; i++) {
+        release_metrics(shards[i], i);
+    }
+    free(shards);
+    __atomic_sub_fetch(&OUT_INTERVALS, 1, __ATOMIC_ACQ_REL);
+}
+
+struct spool_info {
+    metrics *m;
+    struct timeval *tv;
+};
+
+// Serializes an interval into the spool, in the output format
+static int spool_writer_cb(FILE *f, void *data) {
+    struct spool_info *info = data;
+    return stream_to_handle(f, info->m, info->tv, output_callback());
+}
+
+/**
+ * Appends the merged metrics of an interval to the spool.
+ * @return 0 on success
+ */
+static int spool_metrics(metrics *m, struct timeval *tv) {
+    struct spool_info info = {m, tv};
+    int res = spool_append(GLOBAL_SPOOL, tv, spool_writer_cb, &info);
+    if (res) syslog(LOG_ERR, "Failed to spool an interval: %d", res);
+    return res;
+}
+
+// Logs the sinks that failed a fan out
+static int fan_out_result(int res, int *results) {
+    for (int i=0; i < NUM_SINKS; i++) {
+        if (results[i]) syslog(LOG_WARNING, "Sink %s failed with status %d", SINK_NAMES[i], results[i]);
+    }
+    return res;
+}
+
+// Streams a serialized interval to all the sinks
+static int fan_out_buffer(const char *buf, size_t len) {
+    int results[NUM_SINKS];
+    int res = stream_buffer_to_commands(buf, len, SINK_CMDS, SINK_TIMEOUTS, results, NUM_SINKS);
+    return fan_out_result(res, results);
+}
+
+/**
+ * Serializes an interval once, and streams it to all the sinks.
+ * @return 0 on success
+ */
+static int fan_out_metrics(metrics *m, struct timeval *tv) {
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *mem = open_memstream(&buf, &len);
+    if (!mem) return -1;
+    int res = stream_to_handle(mem, m, tv, output_callback());
+    if (fclose(mem)) res = -1;
+    if (!res) res = fan_out_buffer(buf, len);
+    free(buf);
+    return res;
+}
+
+/**
+ * Streams a spooled interval to the configured output.
+ * @return 0 on success
+ */
+static int drain_record(spool_record *rec) {
+    if (GLOBAL_SINK) {
+        char delim[sizeof(struct binary_out_prefix) + sizeof(struct binary_group_prefix)];
+        int delim_len = output_delimiter(&rec->tv, delim);
+        return stream_buffer_to_sink(GLOBAL_SINK, rec->buf, rec->len, delim, delim_len);
+    }
+    if (SINK_CMDS) return fan_out_buffer(rec->buf, rec->len);
+    return stream_buffer_to_command(rec->buf, rec->len, GLOBAL_CONFIG->stream_cmd);
+}
+
+/**
+ * The drainer streams the spooled intervals in order. While
+ * the output fails, the intervals stay spooled and are retried.
+ */
+static void* spool_drainer(void *arg) {
+    struct timeval start;
+    spool_record rec;
+    int res;
+    cpu_pin_thread(GLOBAL_CONFIG->flush_cpus, -1);
+    while ((res = spool_next(GLOBAL_SPOOL, &rec)) != 1) {
+        gettimeofday(&start, NULL);
+        if (!res) res = drain_record(&rec);
+        spool_release(GLOBAL_SPOOL, &rec, !res);
+
+        pthread_mutex_lock(&FLUSH_STATS_LOCK);
+        LAST_STREAM_MS = elapsed_ms(&start);
+        LAST_SINK_STATUS = res;
+        pthread_mutex_unlock(&FLUSH_STATS_LOCK);
+
+        // Back off, and give up once closed
+        if (res) {
+            syslog(LOG_WARNING, "Failed to stream a spooled interval: %d", res);
+            if (spool_wait(GLOBAL_SPOOL, 1000)) break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Streams the window of a rollup to its command, and empties it
+ */
+static void flush_rollup(rollup *r) {
+    struct timeval tv = {r->window, 0};
+    stream_finalize_timers(r->m);
+    int res = stream_to_command(r->m, &tv, output_callback(), r->config->stream_cmd);
+    if (res != 0) {
+        syslog(LOG_WARNING, "Streaming command of the %ds rollup exited with status %d",
+                r->config->interval, res);
+    }
+    metrics_clear(r->m);
+    configure_metrics(r->m, GLOBAL_CONFIG);
+    r->window = 0;
+}
+
+/**
+ * Merges an interval into the window of each rollup. An interval
+ * is in the window that ends at or after it, windows are aligned
+ * to multiples of their interval, and a window is streamed once
+ * an interval ends on its end or past it.
+ * @arg m The merged metrics of the interval
+ * @arg tv The end of the interval
+ */
+static void rollup_interval(metrics *m, struct timeval *tv) {
+    pthread_mutex_lock(&ROLLUP_LOCK);
+    for (rollup *r = ROLLUPS; r; r = r->next) {
+        int interval = r->config->interval;
+        time_t end = ((tv->tv_sec + interval - 1) / interval) * interval;
+        if (r->window && end > r->window) flush_rollup(r);
+
+        // A late interval of an overlapping flush stays in the window
+        if (end > r->window) r->window = end;
+        metrics_merge(r->m, m);
+        if (tv->tv_sec >= r->window) flush_rollup(r);
+    }
+    pthread_mutex_unlock(&ROLLUP_LOCK);
+}
+
+/**
+ * Streams the partial windows of the rollups,
+ * and frees them. Used on shutdown.
+ */
+static void flush_rollups() {
+    for (rollup *r = ROLLUPS; r; r = ROLLUPS) {
+        if (r->window) flush_rollup(r);
+        ROLLUPS = r->next;
+        destroy_metrics(r->m);
+        free(r->m);
+        free(r);
+    }
+}
+
+/**
+ * Flushes an interval to the configured output.
+ * @arg shards The metrics of the interval, one per shard. Released.
+ * @arg tv The end of the interval, used as the time of the metrics
+ * @arg depth The number of intervals still queued
+ * @arg behind_ms How long the interval waited to be flushed
+ * @arg swap_ms How long the shards of the interval took to swap out
+ * @return 0 on success
+ */
+static int flush_metrics(metrics **shards, struct timeval *tv, int depth, double behind_ms, double swap_ms) {
+    struct timeval start, stream_start;
+    gettimeofday(&start, NULL);
+    flush_phases phases = {.swap = swap_ms};
+
+    report_unlogged_warnings();
+    loop_report loops;
+    loop_monitor_collect(&loops);
+    report_loop_stalls(&loops);
+    double phase_start = monotonic_ms();
+    metrics *m = merge_shards(shards);
+    phases.merge = monotonic_ms() - phase_start;
+    if (ROLLUPS) rollup_interval(m, tv);
+
+    // The windows of the sets are not rolled up
+    int windowed = 0;
+    if (SET_WINDOW) {
+        pthread_mutex_lock(&SET_WINDOW_LOCK);
+        windowed = set_window_update(SET_WINDOW, m, tv->tv_sec);
+        pthread_mutex_unlock(&SET_WINDOW_LOCK);
+        if (windowed < 0) syslog(LOG_WARNING, "Failed to add the set windows of an interval!");
+    }
+
+    // The rollups take all the gauges, before the unchanged are removed
+    int unchanged = 0;
+    if (GAUGE_HISTORY) {
+        pthread_mutex_lock(&GAUGE_HISTORY_LOCK);
+        unchanged = gauge_history_filter(GAUGE_HISTORY, m);
+        pthread_mutex_unlock(&GAUGE_HISTORY_LOCK);
+    }
+    if (GLOBAL_CONFIG->internal_stats) {
+        add_internal_stats(m);
+        if (GAUGE_HISTORY) add_internal_stat(m, GAUGE, "gauges.unchanged", unchanged);
+        if (SET_WINDOW) add_internal_stat(m, GAUGE, "sets.windowed", windowed);
+        add_internal_stat(m, GAUGE, "flush.queue_depth", depth);
+        add_internal_stat(m, GAUGE, "flush.behind_ms", behind_ms);
+        add_internal_stat(m, GAUGE, "loop.max_iteration_ms", loops.max_iteration_ms);
+        add_internal_stat(m, GAUGE, "loop.max_lag_ms", loops.max_lag_ms);
+        if (GLOBAL_SPOOL)
+            add_internal_stat(m, GAUGE, "flush.spool_bytes", spool_pending_bytes(GLOBAL_SPOOL));
+    }
+
+    // Finalize the timers before the output starts, so it is not
+    // held up as each timer is finalized on its first query
+    phase_start = monotonic_ms();
+    stream_finalize_timers(m);
+    phases.finalize = monotonic_ms() - phase_start;
+
+    // Stream the records
+    int res;
+    char delim[sizeof(struct binary_out_prefix) + sizeof(struct binary_group_prefix)];
+    gettimeofday(&stream_start, NULL);
+    phase_start = monotonic_ms();
+    if (GLOBAL_SPOOL) {
+        res = spool_metrics(m, tv);
+    } else if (GLOBAL_GRAPHITE) {
+        res = graphite_flush(GLOBAL_GRAPHITE, m, tv);
+    } else if (GLOBAL_INFLUX) {
+        res = influx_flush(GLOBAL_INFLUX, m, tv);
+    } else if (GLOBAL_SINK) {
+        int delim_len = output_delimiter(tv, delim);
+        res = stream_to_sink(GLOBAL_SINK, m, tv, output_callback(), delim, delim_len);
+        if (res != 0) {
+            syslog(LOG_WARNING, "Failed to stream to persistent sink: %d", res);
+        }
+    } else if (SINK_CMDS) {
+        res = fan_out_metrics(m, tv);
+    } else {
+        res = stream_partitioned_to_command(m, tv, output_callback(), GLOBAL_CONFIG->stream_cmd,
+                GLOBAL_CONFIG->sink_parallelism);
+        if (res != 0) {
+            syslog(LOG_WARNING, "Streaming command exited with status %d", res);
+        }
+    }
+
+    // Only the pipe to a command is split into its parts
+    if (!GLOBAL_SPOOL && !GLOBAL_GRAPHITE && !GLOBAL_INFLUX && !GLOBAL_SINK && !SINK_CMDS) {
+        stream_timings st;
+        stream_get_timings(&st);
+        phases.format = st.format_ms;
+        phases.write = st.write_ms;
+        phases.command = st.command_ms;
+    } else {
+        phases.format = monotonic_ms() - phase_start;
+    }
+    phase_start = monotonic_ms();
+    release_shards(shards);
+    phases.release = monotonic_ms() - phase_start;
+
+    // Record the timings, reported with the next flush.
+    // The drainer records the sink timings of spooled intervals.
+    pthread_mutex_lock(&FLUSH_STATS_LOCK);
+    if (!GLOBAL_SPOOL) {
+        LAST_STREAM_MS = elapsed_ms(&stream_start);
+        LAST_SINK_STATUS = res;
+    }
+    LAST_FLUSH_MS = elapsed_ms(&start);
+    LAST_PHASES = phases;
+    HAVE_LAST_FLUSH = 1;
+    pthread_mutex_unlock(&FLUSH_STATS_LOCK);
+    syslog(LOG_DEBUG, "Flush phases in ms: swap %.3f, merge %.3f, finalize %.3f, "
+            "format %.3f, write %.3f, command %.3f, release %.3f",
+            phases.swap, phases.merge, phases.finalize, phases.format,
+            phases.write, phases.command, phases.release);
+    return res;
+}
+
+/**
+ * Streams a spilled interval to the configured output.
+ * @return 0 on success
+ */
+static int replay_spill(char *path) {
+    if (GLOBAL_SINK) {
+        // The delimiter only carries a timestamp, so use the current time
+        struct timeval tv;
+        char delim[sizeof(struct binary_out_prefix) + sizeof(struct binary_group_prefix)];
+        gettimeofday(&tv, NULL);
+        return stream_file_to_sink(GLOBAL_SINK, path, delim, output_delimiter(&tv, delim));
+    }
+    if (SINK_CMDS) {
+        int results[NUM_SINKS];
+        int res = stream_file_to_commands(path, SINK_CMDS, SINK_TIMEOUTS, results, NUM_SINKS);
+        return fan_out_result(res, results);
+    }
+    return stream_file_to_command(path, GLOBAL_CONFIG->stream_cmd);
+}
+
+/**
+ * Writes an interval that does not fit in the flush queue
+ * to a file in the spill directory.
+ * @return 0 on success
+ */
+static int spill_interval(metrics **shards, struct timeval *tv) {
+    // The spool already holds intervals on disk
+    if (GLOBAL_SPOOL) {
+        int res = spool_metrics(merge_shards(shards), tv);
+        release_shards(shards);
+        return res;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/statsite.%ld.%llu.spill", GLOBAL_CONFIG->flush_spill_dir,
+            (long)tv->tv_sec, (unsigned long long)__sync_fetch_and_add(&SPILL_SEQ, 1));
+
+    metrics *m = merge_shards(shards);
+    int res = stream_to_file(m, tv, output_callback(), path);
+    release_shards(shards);
+    if (res) {
+        syslog(LOG_ERR, "Failed to spill an interval to %s!", path);
+        unlink(path);
+        return res;
+    }
+
+    // Queue the file, it is streamed once the flushes catch up
+    spill_entry *spill = malloc(sizeof(spill_entry));
+    spill->path = strdup(path);
+    spill->next = NULL;
+    pthread_mutex_lock(&FLUSH_LOCK);
+    if (SPILL_TAIL) SPILL_TAIL->next = spill;
+    else SPILL_HEAD = spill;
+    SPILL_TAIL = spill;
+    pthread_cond_signal(&FLUSH_COND);
+    pthread_mutex_unlock(&FLUSH_LOCK);
+    return 0;
+}
+
+/**
+ * The flush workers flush the queued intervals in order.
+ * Spilled intervals are streamed once the queue is empty.
+ */
+static void* flush_worker(void *arg) {
+    cpu_pin_thread(GLOBAL_CONFIG->flush_cpus, -1);
+    pthread_mutex_lock(&FLUSH_LOCK);
+    while (1) {
+        if (FLUSH_HEAD) {
+            flush_entry *e = FLUSH_HEAD;
+            FLUSH_HEAD = e->next;
+            if (!FLUSH_HEAD) FLUSH_TAIL = NULL;
+            int depth = --FLUSH_DEPTH;
+            pthread_mutex_unlock(&FLUSH_LOCK);
+
+            int res = flush_metrics(e->shards, &e->tv, depth, elapsed_ms(&e->queued), e->swap_ms);
+            free(e);
+
+            // Retry the spilled intervals once the output works
+            pthread_mutex_lock(&FLUSH_LOCK);
+            if (!res) REPLAY_BLOCKED = 0;
+
+        } else if (SPILL_HEAD && !REPLAY_BLOCKED) {
+            spill_entry *spill = SPILL_HEAD;
+            SPILL_HEAD = spill->next;
+            if (!SPILL_HEAD) SPILL_TAIL = NULL;
+            pthread_mutex_unlock(&FLUSH_LOCK);
+
+            int res = replay_spill(spill->path);
+            if (!res) {
+                unlink(spill->path);
+                free(spill->path);
+                free(spill);
+            }
+
+            // Put the file back if it could not be streamed
+            pthread_mutex_lock(&FLUSH_LOCK);
+            if (res) {
+                syslog(LOG_WARNING, "Failed to stream spilled interval %s: %d", spill->path, res);
+                spill->next = SPILL_HEAD;
+                SPILL_HEAD = spill;
+                if (!SPILL_TAIL) SPILL_TAIL = spill;
+                REPLAY_BLOCKED = 1;
+            }
+
+        } else if (FLUSH_SHUTDOWN) {
+            break;
+        } else {
+            pthread_cond_wait(&FLUSH_COND, &FLUSH_LOCK);
+        }
+    }
+    pthread_mutex_unlock(&FLUSH_LOCK);
+    return NULL;
+}
+
+/**
+ * Queues an interval for the flush workers. If the queue is full,
+ * the interval is handled by the flush queue policy.
+ * @arg shards The metrics of the interval, one per shard
+ * @arg force Queue the interval even if the queue is full
+ * @arg swap_ms How long the shards took to swap out
+ */
+static void queue_interval(metrics **shards, int force, double swap_ms) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    pthread_mutex_lock(&FLUSH_LOCK);
+    if (!force && FLUSH_DEPTH >= GLOBAL_CONFIG->flush_queue) {
+        switch (GLOBAL_CONFIG->flush_queue_policy) {
+            case FLUSH_MERGE:
+                // The newest queued interval is not being flushed yet
+                fold_shared(shards);
+                for (int i=0; i < NUM_SHARDS; i++) {
+                    metrics_merge(FLUSH_TAIL->shards[i], shards[i]);
+                }
+                FLUSH_TAIL->tv = now;
+                FLUSH_TAIL->swap_ms += swap_ms;
+                release_shards(shards);
+                stats_add(STAT_FLUSH_MERGED, 1);
+                syslog(LOG_WARNING, "Flush queue is full, merged the interval into the next");
+                break;
+
+            case FLUSH_SPILL:
+                // Write the file without holding up the workers
+                pthread_mutex_unlock(&FLUSH_LOCK);
+                if (spill_interval(shards, &now)) {
+                    stats_add(STAT_FLUSH_DROPPED, 1);
+                } else {
+                    stats_add(STAT_FLUSH_SPILLED, 1);
+                    syslog(LOG_WARNING, "Flush queue is full, spilled the interval to disk");
+                }
+                return;
+
+            case FLUSH_DROP:
+                release_shards(shards);
+                stats_add(STAT_FLUSH_DROPPED, 1);
+                syslog(LOG_WARNING, "Flush queue is full, dropped the interval");
+                break;
+        }
+        pthread_mutex_unlock(&FLUSH_LOCK);
+        return;
+    }
+
+    flush_entry *e = malloc(sizeof(flush_entry));
+    e->shards = shards;
+    e->tv = now;
+    e->queued = now;
+    e->swap_ms = swap_ms;
+    e->next = NULL;
+    if (FLUSH_TAIL) FLUSH_TAIL->next = e;
+    else FLUSH_HEAD = e;
+    FLUSH_TAIL = e;
+    FLUSH_DEPTH++;
+    pthread_cond_signal(&FLUSH_COND);
+    pthread_mutex_unlock(&FLUSH_LOCK);
+}
+
+/**
+ * Reloads the configuration file, and switches to the settings
+ * it can change. The running configuration is kept on failure.
+ */
+static void reload_config() {
+    statsite_config *loaded = calloc(1, sizeof(statsite_config));
+    if (config_from_filename(RELOAD_FILE, loaded) || validate_config(loaded) || build_prefix_tree(loaded)) {
+        syslog(LOG_ERR, "Failed to reload the configuration, keeping the running one!");
+        free(loaded);
+        return;
+    }
+    statsite_config *config = config_for_reload(GLOBAL_CONFIG, loaded);
+    free(loaded);
+    if (!config) {
+        syslog(LOG_ERR, "Failed to reload the configuration, keeping the running one!");
+        return;
+    }
+
+    // The old configuration is not freed, the queued intervals
+    // and the workers may still refer to its prefix trees
+    setlogmask(config->syslog_log_level);
+    __atomic_store_n(&GLOBAL_CONFIG, config, __ATOMIC_RELEASE);
+    if (!config->memory_budget) __atomic_store_n(&MEMORY_LEVEL, 0, __ATOMIC_RELAXED);
+    syslog(LOG_INFO, "Reloaded the configuration.");
+}
+
+/**
+ * Reloads the configuration file at the next flush, which
+ * applies the settings of the metrics to the next interval,
+ * keeping the interval in progress and the open sockets.
+ * Only sets a flag, so it is safe to call from a signal handler.
+ * @arg filename The configuration file, NULL for the defaults
+ */
+void schedule_config_reload(char *filename) {
+    RELOAD_FILE = filename;
+    RELOAD_PENDING = 1;
+}
+
+/**
+ * Invoked to when we've reached the flush interval timeout
+ * @return The seconds until the next flush, which a
+ * reload of the configuration may change.
+ */
+int flush_interval_trigger() {
+    STATSITE_PROBE(flush_trigger);
+
+    // Switch to a reloaded configuration before the swap, so the new
+    // metrics objects are set up with it
+    if (RELOAD_PENDING) {
+        RELOAD_PENDING = 0;
+        reload_config();
+    }
+
+    // Swap in new metrics objects, and queue the old ones
+    if (GLOBAL_CONFIG->memory_budget) check_memory_budget();
+    double start = monotonic_ms();
+    metrics **shards = swap_shards(1);
+    queue_interval(shards, 0, monotonic_ms() - start);
+    return GLOBAL_CONFIG->flush_interval;
+}
+
+/**
+ * Called when statsite is terminating to flush the
+ * final set of metrics
+ */
+void final_flush() {
+    // Send what the proxy has left for the upstreams
+    if (GLOBAL_PROXY) {
+        proxy_destroy(GLOBAL_PROXY);
+        GLOBAL_PROXY = NULL;
+    }
+
+    // Aggregate the samples the workers left in the pipelines
+    if (PIPELINES) stop_pipelines();
+
+    // Snapshot the interval in progress for the next run,
+    // or queue the last set of metrics if that fails
+    double start = monotonic_ms();
+    metrics **shards = swap_shards(0);
+    double swap_ms = monotonic_ms() - start;
+    if (GLOBAL_CONFIG->snapshot_file) fold_shared(shards);
+    if (GLOBAL_CONFIG->snapshot_file &&
+            !snapshot_write(GLOBAL_CONFIG->snapshot_file, shards, NUM_SHARDS))
+        release_shards(shards);
+    else
+        queue_interval(shards, 1, swap_ms);
+
+    // Wait for the workers to drain the queue
+    pthread_mutex_lock(&FLUSH_LOCK);
+    FLUSH_SHUTDOWN = 1;
+    pthread_cond_broadcast(&FLUSH_COND);
+    pthread_mutex_unlock(&FLUSH_LOCK);
+    for (int i=0; i < GLOBAL_CONFIG->flush_workers; i++) {
+        pthread_join(FLUSH_WORKERS[i], NULL);
+    }
+    free(FLUSH_WORKERS);
+
+    // Stop the preparer, nothing is swapped in anymore
+    pthread_mutex_lock(&POOL_LOCK);
+    PREPARE_SHUTDOWN = 1;
+    pthread_cond_signal(&PREPARE_COND);
+    pthread_mutex_unlock(&POOL_LOCK);
+    pthread_join(METRICS_PREPARER, NULL);
+
+    // Stream what the rollups have of their windows
+    flush_rollups();
+
+    // Leave any spilled intervals that could not be streamed
+    for (spill_entry *spill = SPILL_HEAD; spill; spill = SPILL_HEAD) {
+        syslog(LOG_WARNING, "Spilled interval %s was not streamed", spill->path);
+        SPILL_HEAD = spill->next;
+        free(spill->path);
+        free(spill);
+    }
+    SPILL_TAIL = NULL;
+
+    // Drain the spool, and keep what the output does not take
+    if (GLOBAL_SPOOL) {
+        spool_close(GLOBAL_SPOOL);
+        pthread_join(SPOOL_DRAINER, NULL);
+        int left = spool_destroy(GLOBAL_SPOOL);
+        if (left) {
+            syslog(LOG_WARNING, "Kept %d spooled intervals in %s for the next run",
+                    left, GLOBAL_CONFIG->flush_spill_dir);
+        }
+        GLOBAL_SPOOL = NULL;
+    }
+
+    // Close the Graphite connection
+    if (GLOBAL_GRAPHITE) {
+        destroy_graphite_output(GLOBAL_GRAPHITE);
+        free(GLOBAL_GRAPHITE);
+        GLOBAL_GRAPHITE = NULL;
+    }
+
+    // Close the InfluxDB connections
+    if (GLOBAL_INFLUX) {
+        destroy_influx_output(GLOBAL_INFLUX);
+        free(GLOBAL_INFLUX);
+        GLOBAL_INFLUX = NULL;
+    }
+
+    // Close the persistent sink, allowing it to exit
+    if (GLOBAL_SINK) {
+        int res = destroy_stream_sink(GLOBAL_SINK);
+        if (res != 0) {
+            syslog(LOG_WARNING, "Persistent sink exited with status %d", res);
+        }
+        free(GLOBAL_SINK);
+        GLOBAL_SINK = NULL;
+    }
+    if (GAUGE_HISTORY) {
+        gauge_history_destroy(GAUGE_HISTORY);
+        free(GAUGE_HISTORY);
+        GAUGE_HISTORY = NULL;
+    }
+    if (SET_WINDOW) {
+        set_window_destroy(SET_WINDOW);
+        free(SET_WINDOW);
+        SET_WINDOW = NULL;
+    }
+    free(SINK_CMDS);
+    free(SINK_NAMES);
+    free(SINK_TIMEOUTS);
+    SINK_CMDS = SINK_NAMES = NULL;
+    SINK_TIMEOUTS = NULL;
+    NUM_SINKS = 0;
+
+    // Release the pooled objects
+    pthread_mutex_lock(&POOL_LOCK);
+    for (int i=0; i < NUM_SHARDS; i++) {
+        if (!METRICS_POOL[i]) continue;
+        destroy_metrics(METRICS_POOL[i]);
+        free(METRICS_POOL[i]);
+        METRICS_POOL[i] = NULL;
+    }
+    if (SPARE_SHARED) {
+        shared_map_destroy(SPARE_SHARED);
+        SPARE_SHARED = NULL;
+    }
+    pthread_mutex_unlock(&POOL_LOCK);
+}
+
+
+/**
+ * Logs how many warnings about bad input were over the
+ * rate limit since this was last called, if any.
+ */
+static void report_unlogged_warnings() {
+    uint64_t unlogged = __atomic_exchange_n(&WARNINGS_UNLOGGED, 0, __ATOMIC_RELAXED);
+    if (unlogged)
+        syslog(LOG_WARNING, "Did not log %llu more warnings about bad input",
+                (unsigned long long)unlogged);
+}
+
+/**
+ * Logs the longest stalls of the event loops since the
+ * last flush, if any iteration ran past LOOP_STALL_MS.
+ */
+static void report_loop_stalls(loop_report *r) {
+    if (!r->num_stalls) return;
+    char buf[256];
+    int len = 0;
+    for (int i=0; i < r->num_stalls && len < (int)sizeof(buf); i++) {
+        struct tm tm;
+        localtime_r(&r->stalls[i].when, &tm);
+        len += snprintf(buf + len, sizeof(buf) - len, "%s%.1fms on worker %d at %02d:%02d:%02d",
+                (i) ? ", " : "", r->stalls[i].ms, r->stalls[i].worker, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    }
+    syslog(LOG_WARNING, "Event loops stalled: %s, the most lag of their timers was %.1fms",
+            buf, r->max_lag_ms);
+}
+
+/**
+ * Logs a warning about bad input, unless INPUT_WARNINGS_PER_SEC
+ * were already logged this second, in which case it is only
+ * counted. The count is logged when the next second starts
+ * logging, and by the flush of each interval.
+ * @arg format The printf style format of the warning
+ */
+static void input_warning(const char *format, ...) {
+    time_t now = time(NULL), second = __atomic_load_n(&WARNINGS_SECOND, __ATOMIC_RELAXED);
+    if (now != second && __atomic_compare_exchange_n(&WARNINGS_SECOND, &second, now,
+                false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&WARNINGS_LOGGED, 0, __ATOMIC_RELAXED);
+        report_unlogged_warnings();
+    }
+    if (__atomic_add_fetch(&WARNINGS_LOGGED, 1, __ATOMIC_RELAXED) > INPUT_WARNINGS_PER_SEC) {
+        __atomic_add_fetch(&WARNINGS_UNLOGGED, 1, __ATOMIC_RELAXED);
+        stats_add(STAT_WARNINGS_UNLOGGED, 1);
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    vsyslog(LOG_WARNING, format, args);
+    va_end(args);
+}
+
+/**
+ * A key bound to an ID by a binary client. The resolved metric
+ * is cached with the generation of the metrics it belongs to,
+ * so the key is looked up again once the metrics are flushed.
+ */
+typedef struct {
+    char *key;              // The bound key, NULL if the ID is not bound
+    metric_type type;       // The type the metric was resolved for
+    metric_type kind;       // The type of the resolved metric, for metrics_add_to
+    void *metric;           // The resolved metric, NULL for K/V pairs
+    uint64_t generation;    // Generation of the metrics when resolved
+    bool dropped;           // Is the key dropped by the ingest filter
+} bound_key;
+
+// The protocols of a stream client, from its first byte
+#define PROTOCOL_ASCII 1
+#define PROTOCOL_BINARY 2
+
+/**
+ * The state of a stream client, kept in its client_state. The
+ * protocol is detected once from the first byte. A binary parser
+ * short of a frame keeps the length of the frame, and resumes
+ * once it is in, without peeking at the header in the meantime.
+ * A header that was checked before the wait is trusted then.
+ */
+typedef struct {
+    int protocol;           // The protocol of the client, 0 until known
+    uint64_t pending;       // The bytes the next frame needs, 0 if unknown
+    bool checked;           // Was the header of the pending frame checked
+    int num_keys;           // The keys bound by a binary client, indexed by ID
+    bound_key *keys;
+} client_conn;
+
+// Returns the state of a stream client, NULL for UDP
+static client_conn* conn_state(statsite_conn_handler *handle) {
+    void **slot = client_state(handle->conn);
+    if (!slot) return NULL;
+    if (!*slot) *slot = calloc(1, sizeof(client_conn));
+    return *slot;
+}
+
+// Keeps the length of a frame that is not yet in, and if its
+// header was checked. Returns -2, as the handlers do when missing data
+static int wait_for_frame(statsite_conn_handler *handle, uint64_t len, bool checked) {
+    void **slot = client_state(handle->conn);
+    if (slot && *slot) {
+        ((client_conn*)*slot)->pending = len;
+        ((client_conn*)*slot)->checked = checked;
+    }
+    return -2;
+}
+
+// Checks if the frame a stream client waits for is still short
+// Once it is in, sets checked if its header need not be checked again
+static bool frame_pending(statsite_conn_handler *handle, bool *checked) {
+    void **slot = client_state(handle->conn);
+    client_conn *c = (slot) ? *slot : NULL;
+    *checked = false;
+    if (likely(!c || !c->pending)) return false;
+    if (available_bytes(handle->conn) < c->pending) return true;
+    *checked = c->checked;
+    c->pending = 0;
+    c->checked = false;
+    return false;
+}
+
+// Counts an input that failed to parse, by its protocol
+static inline void count_parse_error(unsigned char magic) {
+    stats_add(STAT_PARSE_ERRORS, 1);
+    stats_add((magic == BINARY_MAGIC_BYTE) ? STAT_BINARY_ERRORS : STAT_ASCII_ERRORS, 1);
+}
+
+/**
+ * Invoked by the networking layer when there is new
+ * data to be handled. The connection handler should
+ * consume all the input possible, and generate responses
+ * to all requests.
+ * @arg handle The connection related information
+ * @return 0 on success.
+ */
+int handle_client_connect(statsite_conn_handler *handle) {
+    // Try to read the magic character, bail if no data. A stream
+    // client keeps the protocol of its first byte.
+    unsigned char magic;
+    client_conn *c = conn_state(handle);
+    if (c && c->protocol) {
+        magic = (c->protocol == PROTOCOL_BINARY) ? BINARY_MAGIC_BYTE : 0;
+    } else {
+        if (unlikely(peek_client_byte(handle->conn, &magic) == -1)) return 0;
+        if (c) c->protocol = (magic == BINARY_MAGIC_BYTE) ? PROTOCOL_BINARY : PROTOCOL_ASCII;
+    }
+    STATSITE_PROBE1(conn_start, handle->shard);
+
+    // Forward the commands when proxying, there are no metrics to update
+    int res;
+    if (GLOBAL_PROXY) {
+        if (magic == BINARY_MAGIC_BYTE)
+            res = proxy_binary_client_connect(handle);
+        else
+            res = handle_ascii_client_connect(handle, NULL);
+        if (unlikely(res)) count_parse_error(magic);
+        STATSITE_PROBE2(conn_done, handle->shard, res);
+        return res;
+    }
+
+    // The pipeline aggregates the ASCII lines, so it takes the lock
+    if (PIPELINES && magic != BINARY_MAGIC_BYTE) {
+        res = handle_ascii_client_connect(handle, NULL);
+        pipeline_push(PIPELINES + handle->shard);
+        if (unlikely(res)) count_parse_error(magic);
+        STATSITE_PROBE2(conn_done, handle->shard, res);
+        return res;
+    }
+
+    // Check the memory budget every so often
+    if (GLOBAL_CONFIG->memory_budget && !(++MEMORY_EVENTS % MEMORY_CHECK_EVENTS))
+        check_memory_budget();
+
+    // Hold the shard lock while we update the metrics
+    metrics_shard *shard = GLOBAL_SHARDS + handle->shard;
+    pthread_mutex_lock(&shard->lock);
+    update_memory_level(shard);
+
+    // Check the magic byte
+    if (magic == BINARY_MAGIC_BYTE)
+        res = handle_binary_client_connect(handle, shard->m);
+    else
+        res = handle_ascii_client_connect(handle, shard->m);
+
+    pthread_mutex_unlock(&shard->lock);
+    if (unlikely(res)) count_parse_error(magic);
+    STATSITE_PROBE2(conn_done, handle->shard, res);
+    return res;
+}
+
+/**
+ * Invoked by each worker on a short timer when proxying,
+ * to send the records it has batched for the upstreams.
+ * @arg worker The index of the worker
+ */
+void handle_proxy_flush(int worker) {
+    if (GLOBAL_PROXY) proxy_flush(GLOBAL_PROXY, worker);
+}
+
+// Counts received samples by their metric type
+static inline void count_samples(metric_type type, uint64_t num) {
+    switch (type) {
+        case KEY_VAL:
+            stats_add(STAT_KV_SAMPLES, num);
+            break;
+        case GAUGE:
+        case GAUGE_DELTA:
+            stats_add(STAT_GAUGE_SAMPLES, num);
+            break;
+        case COUNTER:
+            stats_add(STAT_COUNTER_SAMPLES, num);
+            break;
+        case TIMER:
+            stats_add(STAT_TIMER_SAMPLES, num);
+            break;
+        case SET:
+            stats_add(STAT_SET_SAMPLES, num);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Checks a key against the ingest filter. The rule of the
+ * longest matching prefix decides, and drop_unmatched decides
+ * for the keys without a rule.
+ * @arg key The key to check
+ * @return True if the key is dropped
+ */
+static bool key_filtered(char *key) {
+    void *action;
+    if (radix_longest_prefix(GLOBAL_CONFIG->filters, key, &action))
+        return GLOBAL_CONFIG->drop_unmatched;
+    return (uintptr_t)action == FILTER_DROP;
+}
+
+/**
+ * Checks if the samples of a key are dropped by the ingest
+ * filter, before anything is done with them, and counts them.
+ * @arg key The key of the samples
+ * @arg num The number of samples
+ * @return True if the samples are dropped
+ */
+static inline bool filter_drops(char *key, int num) {
+    if (likely(!GLOBAL_CONFIG->filters) || !key_filtered(key)) return false;
+    stats_add(STAT_FILTER_DROPPED, num);
+    return true;
+}
+
+/**
+ * Invoked by the networking layer when the kernel reports
+ * that UDP datagrams were dropped, so they can be counted.
+ * @arg handle The connection related information
+ * @arg drops The number of newly dropped datagrams
+ */
+void handle_udp_drops(statsite_conn_handler *handle, uint64_t drops) {
+    if (!GLOBAL_CONFIG->udp_drop_counter) return;
+    metrics_shard *shard = GLOBAL_SHARDS + handle->shard;
+    pthread_mutex_lock(&shard->lock);
+    metrics_add_sample(shard->m, COUNTER, GLOBAL_CONFIG->udp_drop_counter, drops);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Parses a single ASCII command, of the form key:value|type[|@sample]
+ * @arg line The tokenized line
+ * @arg type_out Output, the metric type
+ * @arg val_out Output, the value magnified by the sample rate.
+ * Sets are not converted, the value is the item.
+ * @arg weight_out Output, the number of samples a timer sample
+ * stands for, the inverse of the sample rate rounded. Otherwise 1.
+ * @return 0 on success.
+ */
+static int parse_ascii_line(ascii_line *line, metric_type *type_out, double *val_out, uint64_t *weight_out) {
+    char *val_str = line->value, *type_str = line->type, *endptr;
+    char *limit = line->key + line->len + 1;
+    metric_type type;
+    double val, sample_rate;
+
+    // Check for a valid metric
+    if (unlikely(!val_str || !type_str)) {
+        input_warning("Failed parse metric! Input: %s", line->key);
+        return -1;
+    }
+
+    // Convert the type
+    switch (*type_str) {
+        case 'c':
+            type = COUNTER;
+            break;
+        case 'm':
+            type = TIMER;
+            break;
+        case 'k':
+            type = KEY_VAL;
+            break;
+        case 'g':
+            type = GAUGE;
+
+            // Check if this is a delta update
+            switch (*val_str) {
+                case '+':
+                    // Advance past the + to avoid breaking parse_double
+                    val_str++;
+                case '-':
+                    type = GAUGE_DELTA;
+            }
+            break;
+        case 's':
+            type = SET;
+            break;
+        default:
+            type = UNKNOWN;
+            input_warning("Received unknown metric type! Input: %c", *type_str);
+            return -1;
+    }
+
+    // Count the input by its type
+    count_samples(type, 1);
+    *type_out = type;
+    *weight_out = 1;
+
+    // Fast track the set-updates
+    if (type == SET) return 0;
+
+    // Convert the value to a double
+    val = parse_double(val_str, limit, &endptr);
+    if (unlikely(endptr == val_str)) {
+        input_warning("Failed value conversion! Input: %s", val_str);
+        return -1;
+    }
+
+    // Handle counter and timer sampling if applicable
+    if ((type == COUNTER || type == TIMER) && line->sample) {
+        sample_rate = parse_double(line->sample, limit, &endptr);
+        if (unlikely(endptr == line->sample)) {
+            input_warning("Failed sample rate conversion! Input: %s", line->sample);
+            return -1;
+        }
+        if (sample_rate > 0 && sample_rate <= 1) {
+            // Magnify a counter, and weight a timer sample
+            if (type == COUNTER) {
+                val = val * (1.0 / sample_rate);
+            } else {
+                double weight = round(1.0 / sample_rate);
+                *weight_out = (weight < UINT32_MAX) ? (uint64_t)weight : UINT32_MAX;
+            }
+        }
+    }
+    *val_out = val;
+    return 0;
+}
+
+/**
+ * Counts and warns about a line over the max_line_length
+ */
+static void long_line_dropped() {
+    stats_add(STAT_LONG_LINES, 1);
+    input_warning("Dropped a line longer than the max of %d bytes!", GLOBAL_CONFIG->max_line_length);
+}
+
+/**
+ * Checks if a line is over the max_line_length, and counts it
+ * @return True if the line is dropped
+ */
+static inline bool line_too_long(ascii_line *line) {
+    int max_len = GLOBAL_CONFIG->max_line_length;
+    if (likely(!max_len || line->len <= max_len)) return false;
+    long_line_dropped();
+    return true;
+}
+
+/**
+ * Moves the tags of a line into its key, if tags are parsed,
+ * and warns about a line with too many tags to canonicalize
+ * @return True if the line is dropped
+ */
+static inline bool tags_dropped(ascii_line *line) {
+    if (likely(!line->tags || !GLOBAL_CONFIG->parse_tags)) return false;
+    if (likely(!ascii_canonical_tags(line))) return false;
+    input_warning("Dropped a line with more than %d tags, or longer than %d bytes! Input: %s",
+            MAX_LINE_TAGS, MAX_TAGGED_LINE, line->key);
+    return true;
+}
+
+// A parsed ASCII command, waiting in a batch to be stored
+typedef struct {
+    metric_type type;
+    bool dropped;       // Dropped by the ingest filter
+    double val;
+    uint64_t hash;      // Hash of the key
+    uint64_t weight;    // Samples a timer sample stands for
+} ascii_sample;
+
+/**
+ * Handles a batch of ASCII commands, of the form key:value|type[|@sample][|#tags].
+ * The first pass parses the lines and hashes their keys, starting
+ * to load the map entry of each key. The second pass stores the
+ * samples, so the entries of the keys load in parallel instead of
+ * each update waiting on memory in turn.
+ * @arg m The metrics object to update
+ * @arg lines The tokenized lines
+ * @arg num_lines The number of lines, at most ASCII_BATCH_LINES
+ * @arg handled Output, the number of lines before an invalid one
+ * @return 0 on success, -1 if a line is invalid.
+ */
+static int handle_ascii_lines(metrics *m, ascii_line *lines, int num_lines, int *handled) {
+    ascii_sample samples[ASCII_BATCH_LINES];
+    ascii_sample *s;
+    ascii_line *line;
+    int num, res = 0;
+    for (num=0; num < num_lines; num++) {
+        line = lines + num;
+        s = samples + num;
+        s->dropped = line_too_long(line) || tags_dropped(line) || filter_drops(line->key, 1);
+        if (s->dropped) continue;
+        if (unlikely(parse_ascii_line(line, &s->type, &s->val, &s->weight))) {
+            res = -1;
+            break;
+        }
+        s->hash = hash_key(line->key, strlen(line->key));
+        metrics_prefetch(m, s->type, s->hash);
+    }
+
+    // Store the samples of the valid lines
+    for (int i=0; i < num; i++) {
+        line = lines + i;
+        s = samples + i;
+        if (s->dropped) continue;
+        if (m->top_samples) metrics_track_key(m, line->key, 1, line->len + 1);
+        if (s->type == SET)
+            metrics_set_update_hash(m, line->key, s->hash, line->value);
+        else if (unlikely(s->weight > 1))
+            metrics_add_timer_weighted(m, line->key, s->hash, s->val, s->weight);
+        else
+            metrics_add_sample_hash(m, s->type, line->key, s->hash, s->val);
+    }
+    *handled = num;
+    return res;
+}
+
+/**
+ * Forwards a single ASCII command to the upstream of its key.
+ * The line is checked first, and then the delimiters are put
+ * back so it is sent as it was received.
+ * @arg worker The worker forwarding the line
+ * @arg line The tokenized line
+ * @return 0 on success.
+ */
+static int proxy_ascii_line(int worker, ascii_line *line) {
+    metric_type type;
+    double val;
+    uint64_t weight;
+    if (line_too_long(line) || filter_drops(line->key, 1)) return 0;
+    if (unlikely(parse_ascii_line(line, &type, &val, &weight))) return -1;
+
+    line->value[-1] = ':';
+    line->type[-1] = '|';
+    if (line->sample) line->sample[-1] = '@';
+    if (line->tags) line->tags[-2] = '|';
+    line->key[line->len] = '\n';
+
+    int key_len = line->value - 1 - line->key;
+    int upstream = proxy_route(GLOBAL_PROXY, line->key, key_len);
+    proxy_forward(GLOBAL_PROXY, worker, upstream, false, line->key, line->len + 1);
+    return 0;
+}
+
+/**
+ * Updates a metrics object with a batch of samples. The entries
+ * of a group of samples are prefetched before they are updated,
+ * as with handle_ascii_lines.
+ */
+static void aggregate_batch(metrics *m, sample_batch *b) {
+    sample_record *group[ASCII_BATCH_LINES], *r;
+    char *pos = b->data, *end = b->data + b->used, *key;
+    int num;
+    while (pos < end) {
+        for (num=0; num < ASCII_BATCH_LINES && pos < end; num++) {
+            r = group[num] = (sample_record*)pos;
+            metrics_prefetch(m, r->type, r->hash);
+            pos += r->size;
+        }
+        for (int i=0; i < num; i++) {
+            r = group[i];
+            key = (char*)(r + 1);
+            if (m->top_samples) metrics_track_key(m, key, 1, r->bytes);
+            if (r->type == SET)
+                metrics_set_update_hash(m, key, r->hash, key + r->key_len + 1);
+            else if (unlikely(r->weight > 1))
+                metrics_add_timer_weighted(m, key, r->hash, r->val, r->weight);
+            else
+                metrics_add_sample_hash(m, r->type, key, r->hash, r->val);
+        }
+    }
+    m->inputs += b->inputs;
+}
+
+/**
+ * Runs an aggregator, until it is stopped and
+ * has aggregated all the batches of its worker.
+ */
+static void* aggregator_main(void *arg) {
+    pipeline *p = arg;
+    metrics_shard *shard = GLOBAL_SHARDS + p->shard;
+    sample_batch *b;
+    while (1) {
+        // Sleep until the worker pushes a batch, see pipeline_push
+        if (!(b = spsc_queue_pop(p->full))) {
+            pthread_mutex_lock(&p->lock);
+            __atomic_store_n(&p->sleeping, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            while (!(b = spsc_queue_pop(p->full)) && !p->stop) {
+                pthread_cond_wait(&p->cond, &p->lock);
+            }
+            __atomic_store_n(&p->sleeping, 0, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&p->lock);
+            if (!b) break;
+        }
+
+        if (GLOBAL_CONFIG->memory_budget && !(++MEMORY_EVENTS % MEMORY_CHECK_EVENTS))
+            check_memory_budget();
+        pthread_mutex_lock(&shard->lock);
+        update_memory_level(shard);
+        aggregate_batch(shard->m, b);
+        pthread_mutex_unlock(&shard->lock);
+
+        // There is a slot for every batch, this cannot fail
+        b->used = 0;
+        b->inputs = 0;
+        spsc_queue_push(p->free, b);
+    }
+    return NULL;
+}
+
+/**
+ * Starts an aggregator for each shard, with its batches
+ */
+static void start_pipelines() {
+    PIPELINES = calloc(NUM_SHARDS, sizeof(pipeline));
+    for (int i=0; i < NUM_SHARDS; i++) {
+        pipeline *p = PIPELINES + i;
+        int res = spsc_queue_create(PIPELINE_BATCHES, &p->full);
+        res |= spsc_queue_create(PIPELINE_BATCHES, &p->free);
+        assert(res == 0);
+        for (int j=0; j < PIPELINE_BATCHES; j++) {
+            sample_batch *b = malloc(sizeof(sample_batch));
+            b->used = 0;
+            b->inputs = 0;
+            spsc_queue_push(p->free, b);
+        }
+        p->shard = i;
+        pthread_mutex_init(&p->lock, NULL);
+        pthread_cond_init(&p->cond, NULL);
+        pthread_create(&p->thread, NULL, aggregator_main, p);
+    }
+}
+
+/**
+ * Stops the aggregators once they have aggregated every batch.
+ * The workers must have stopped already.
+ */
+static void stop_pipelines() {
+    sample_batch *b;
+    for (int i=0; i < NUM_SHARDS; i++) {
+        pipeline *p = PIPELINES + i;
+        pthread_mutex_lock(&p->lock);
+        p->stop = 1;
+        pthread_cond_signal(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+        pthread_join(p->thread, NULL);
+
+        while ((b = spsc_queue_pop(p->free))) free(b);
+        spsc_queue_destroy(p->full);
+        spsc_queue_destroy(p->free);
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->cond);
+    }
+    free(PIPELINES);
+    PIPELINES = NULL;
+}
+
+/**
+ * Returns the batch a worker is filling, waiting for the
+ * aggregator to return one if they are all queued.
+ */
+static sample_batch* pipeline_batch(pipeline *p) {
+    if (likely(p->batch != NULL)) return p->batch;
+    if (unlikely(!(p->batch = spsc_queue_pop(p->free)))) {
+        stats_add(STAT_PIPELINE_STALLS, 1);
+        while (!(p->batch = spsc_queue_pop(p->free))) sched_yield();
+    }
+    return p->batch;
+}
+
+/**
+ * Pushes the batch a worker is filling to its aggregator,
+ * and wakes the aggregator if it is sleeping.
+ */
+static void pipeline_push(pipeline *p) {
+    sample_batch *b = p->batch;
+    if (!b || (!b->used && !b->inputs)) return;
+    spsc_queue_push(p->full, b);
+    p->batch = NULL;
+
+    // Pairs with the fence of the aggregator, so either it sees
+    // the batch, or this sees that it is going to sleep
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&p->sleeping, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_signal(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+/**
+ * Parses a batch of lines into samples for the aggregator
+ * of a worker. The keys and set values are copied, since the
+ * lines are consumed before they are aggregated.
+ * @arg p The pipeline of the worker
+ * @arg lines The tokenized lines
+ * @arg num_lines The number of lines
+ * @return 0 on success, -1 if a line is invalid.
+ */
+static int pipeline_ascii_lines(pipeline *p, ascii_line *lines, int num_lines) {
+    ascii_line *line;
+    sample_record *r;
+    sample_batch *b;
+    metric_type type;
+    double val = 0;
+    uint64_t weight = 1;
+    uint32_t key_len, val_len, size;
+    int num, res = 0;
+    for (num=0; num < num_lines; num++) {
+        line = lines + num;
+        if (line_too_long(line) || tags_dropped(line) || filter_drops(line->key, 1)) continue;
+
+        // A sample must fit in a batch
+        if (unlikely(line->len + sizeof(sample_record) + 8 > PIPELINE_BATCH_SIZE)) {
+            long_line_dropped();
+            continue;
+        }
+        if (unlikely(parse_ascii_line(line, &type, &val, &weight))) {
+            res = -1;
+            break;
+        }
+
+        key_len = strlen(line->key);
+        val_len = (type == SET) ? strlen(line->value) + 1 : 0;
+        size = (sizeof(sample_record) + key_len + 1 + val_len + 7) & ~7;
+        b = pipeline_batch(p);
+        if (b->used + size > PIPELINE_BATCH_SIZE) {
+            pipeline_push(p);
+            b = pipeline_batch(p);
+        }
+
+        r = (sample_record*)(b->data + b->used);
+        r->hash = hash_key(line->key, key_len);
+        r->val = val;
+        r->weight = weight;
+        r->size = size;
+        r->bytes = line->len + 1;
+        r->key_len = key_len;
+        r->type = type;
+        memcpy(r + 1, line->key, key_len + 1);
+        if (val_len) memcpy((char*)(r + 1) + key_len + 1, line->value, val_len);
+        b->used += size;
+    }
+    pipeline_batch(p)->inputs += num;
+    return res;
+}
+
+/**
+ * Handles a batch of lines, by updating a metrics object,
+ * pushing them to the pipeline or forwarding them.
+ * @arg handle The connection of the lines
+ * @arg m The metrics object, or NULL with the pipeline or proxy
+ * @arg lines The tokenized lines
+ * @arg num_lines The number of lines
+ * @return 0 on success, -1 if a line is invalid.
+ */
+static int ingest_ascii_lines(statsite_conn_handler *handle, metrics *m, ascii_line *lines, int num_lines) {
+    int handled = 0, res = 0;
+    if (m) {
+        res = handle_ascii_lines(m, lines, num_lines, &handled);
+        m->inputs += handled;
+    } else if (PIPELINES) {
+        res = pipeline_ascii_lines(PIPELINES + handle->shard, lines, num_lines);
+    } else {
+        while (handled < num_lines && !res) {
+            res = proxy_ascii_line(handle->shard, lines + handled++);
+        }
+    }
+    return res;
+}
+
+/**
+ * Invoked to handle ASCII commands. This is the default
+ * mode for statsite, to be backwards compatible with statsd.
+ * The contiguous input is tokenized in batches of lines, and
+ * only a line that wraps around the buffer is copied out.
+ * @arg handle The connection related information
+ * @arg m The metrics object to update, or NULL to push the
+ * lines to the pipeline, or forward them with the proxy
+ * @return 0 on success.
+ */
+static int handle_ascii_client_connect(statsite_conn_handler *handle, metrics *m) {
+    ascii_line lines[ASCII_BATCH_LINES];
+    char *buf;
+    int buf_len, should_free, num_lines, consumed, res;
+    while (1) {
+        // Return if no data is available
+        if (peek_client_contiguous(handle->conn, &buf, &buf_len)) return 0;
+
+        // Handle a batch of complete lines in place, unless the
+        // head is a partial line that was already scanned
+        if (likely(!client_scanned_bytes(handle->conn))) {
+            consumed = ascii_scan_lines(buf, buf_len, lines, ASCII_BATCH_LINES, &num_lines);
+            if (likely(num_lines)) {
+                res = ingest_ascii_lines(handle, m, lines, num_lines);
+                seek_client_bytes(handle->conn, consumed);
+                if (unlikely(res)) return -1;
+
+                // Short of a full batch, the rest was scanned and has no newline
+                if (num_lines < ASCII_BATCH_LINES)
+                    mark_client_scanned(handle->conn, buf_len - consumed);
+                continue;
+            }
+            mark_client_scanned(handle->conn, buf_len);
+        }
+
+        // The next line may wrap around the buffer, extract a copy.
+        // Return if no command is available, dropping the partial
+        // line if it is already too long.
+        if (extract_to_terminator(handle->conn, '\n', &buf, &buf_len, &should_free)) {
+            if (unlikely(GLOBAL_CONFIG->max_line_length &&
+                    available_bytes(handle->conn) > (uint64_t)GLOBAL_CONFIG->max_line_length)) {
+                long_line_dropped();
+                discard_to_terminator(handle->conn, '\n');
+            }
+            return 0;
+        }
+
+        // Restore the newline, which the tokenizer expects
+        buf[buf_len - 1] = '\n';
+        ascii_scan_lines(buf, buf_len, lines, 1, &num_lines);
+        res = ingest_ascii_lines(handle, m, lines, 1);
+        if (should_free) free(buf);
+        if (unlikely(res)) return -1;
+    }
+}
+
+/**
+ * A range of a mapped file, ingested by one bulk thread
+ */
+typedef struct {
+    char *start;
+    size_t len;
+    int shard;          // The shard the lines are added to
+    pthread_t thread;
+} bulk_range;
+
+// Largest slice of a range scanned at once, as the scanner takes an int
+#define BULK_SCAN_MAX (1 << 30)
+
+/**
+ * Adds a batch of lines to the metrics, skipping the invalid
+ * lines instead of stopping at them as a connection does.
+ */
+static void bulk_ascii_lines(metrics *m, ascii_line *lines, int num_lines) {
+    int handled, done = 0;
+    while (done < num_lines) {
+        int res = handle_ascii_lines(m, lines + done, num_lines - done, &handled);
+        m->inputs += handled;
+        done += handled;
+        if (res) {
+            count_parse_error(0);
+            done++;
+        }
+    }
+}
+
+/**
+ * Ingests the complete lines of a range into its shard,
+ * holding the shard lock for the whole range.
+ */
+static void* bulk_worker(void *arg) {
+    bulk_range *r = arg;
+    ascii_line lines[ASCII_BATCH_LINES];
+    metrics_shard *shard = GLOBAL_SHARDS + r->shard;
+    char *buf = r->start;
+    size_t left = r->len;
+    int num_lines, consumed;
+
+    pthread_mutex_lock(&shard->lock);
+    while (left) {
+        if (GLOBAL_CONFIG->memory_budget && !(++MEMORY_EVENTS % MEMORY_CHECK_EVENTS))
+            check_memory_budget();
+        update_memory_level(shard);
+
+        consumed = ascii_scan_lines(buf, (left > BULK_SCAN_MAX) ? BULK_SCAN_MAX : left,
+                lines, ASCII_BATCH_LINES, &num_lines);
+        if (!num_lines) break;
+        bulk_ascii_lines(shard->m, lines, num_lines);
+        buf += consumed;
+        left -= consumed;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return NULL;
+}
+
+/**
+ * Ingests one mapped file, split at newlines into a range
+ * for each shard. A final line without a newline is copied
+ * out and added on its own.
+ * @return 0 on success.
+ */
+static int bulk_ingest_buffer(char *buf, size_t len) {
+    bulk_range *ranges = calloc(NUM_SHARDS, sizeof(bulk_range));
+    if (!ranges) return -1;
+
+    size_t start = 0;
+    for (int i=0; i < NUM_SHARDS; i++) {
+        size_t end = (i == NUM_SHARDS - 1) ? len : len / NUM_SHARDS * (i + 1);
+        if (end < start) end = start;
+        if (end < len) {
+            char *nl = memchr(buf + end, '\n', len - end);
+            end = (nl) ? (size_t)(nl - buf) + 1 : len;
+        }
+        ranges[i].start = buf + start;
+        ranges[i].len = end - start;
+        ranges[i].shard = i;
+        start = end;
+    }
+
+    for (int i=1; i < NUM_SHARDS; i++) {
+        if (ranges[i].len) pthread_create(&ranges[i].thread, NULL, bulk_worker, ranges + i);
+    }
+    bulk_worker(ranges);
+    for (int i=1; i < NUM_SHARDS; i++) {
+        if (ranges[i].len) pthread_join(ranges[i].thread, NULL);
+    }
+    free(ranges);
+
+    // Add the last line, if it does not end in a newline
+    size_t tail = len;
+    while (tail && buf[tail - 1] != '\n') tail--;
+    if (tail < len && (len - tail) < BULK_SCAN_MAX) {
+        ascii_line line;
+        int num_lines, tail_len = len - tail;
+        char *copy = malloc(tail_len + 1);
+        if (!copy) return -1;
+        memcpy(copy, buf + tail, tail_len);
+        copy[tail_len] = '\n';
+        ascii_scan_lines(copy, tail_len + 1, &line, 1, &num_lines);
+        pthread_mutex_lock(&GLOBAL_SHARDS[0].lock);
+        if (num_lines) bulk_ascii_lines(GLOBAL_SHARDS[0].m, &line, 1);
+        pthread_mutex_unlock(&GLOBAL_SHARDS[0].lock);
+        free(copy);
+    }
+    return 0;
+}
+
+/**
+ * Aggregates the ASCII lines of files into the metrics, without
+ * the networking layer. Each file is mapped privately, as the lines
+ * are tokenized in place, and split at newlines into a range for
+ * each shard, which a thread of its own parses. final_flush then
+ * merges the shards and streams them once.
+ * @arg paths The files to read
+ * @arg num_paths The number of files
+ * @return 0 on success, -1 if a file could not be read.
+ */
+int bulk_ingest_files(char **paths, int num_paths) {
+    int res = 0;
+    for (int i=0; i < num_paths && !res; i++) {
+        int fd = open(paths[i], O_RDONLY);
+        if (fd < 0) {
+            syslog(LOG_ERR, "Failed to open %s: %s", paths[i], strerror(errno));
+            return -1;
+        }
+        struct stat st;
+        if (fstat(fd, &st)) {
+            syslog(LOG_ERR, "Failed to stat %s: %s", paths[i], strerror(errno));
+            close(fd);
+            return -1;
+        }
+        if (!st.st_size) {
+            close(fd);
+            continue;
+        }
+
+        char *buf = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (buf == MAP_FAILED) {
+            syslog(LOG_ERR, "Failed to map %s: %s", paths[i], strerror(errno));
+            return -1;
+        }
+        madvise(buf, st.st_size, MADV_SEQUENTIAL);
+
+        struct timeval start;
+        gettimeofday(&start, NULL);
+        res = bulk_ingest_buffer(buf, st.st_size);
+        syslog(LOG_INFO, "Ingested %s, %lld bytes in %.1f ms", paths[i],
+                (long long)st.st_size, elapsed_ms(&start));
+        munmap(buf, st.st_size);
+    }
+    return res;
+}
+
+// Handles the binary set command
+// Return 0 on success, -1 on error, -2 if missing data
+static int handle_binary_set(statsite_conn_handler *handle, metrics *m, uint16_t *header, int should_free) {
+    /*
+     * Abort if we haven't received the command
+     * header[1] is the key length
+     * header[2] is the set length
+     */
+    char *key;
+    int val_bytes = header[1] + header[2];
+
+    // Read the full command if available
+    if (unlikely(should_free)) free(header);
+    if (read_client_bytes(handle->conn, MIN_BINARY_HEADER_SIZE + val_bytes, (char**)&header, &should_free))
+        return wait_for_frame(handle, MIN_BINARY_HEADER_SIZE + val_bytes, true);
+    key = ((char*)header) + MIN_BINARY_HEADER_SIZE;
+
+    // Verify the null terminators
+    if (unlikely(*(key + header[1] - 1))) {
+        input_warning("Received command from binary stream with non-null terminated key: %.*s!", header[1], key);
+        goto ERR_RET;
+    }
+    if (unlikely(*(key + val_bytes - 1))) {
+        input_warning("Received command from binary stream with non-null terminated set key: %.*s!", header[2], key+header[1]);
+        goto ERR_RET;
+    }
 
-    // Wait for the thread to finish
-    pthread_join(thread, NULL);
-}
+    // Increment the input count, unless the key is dropped
+    if (filter_drops(key, 1)) goto DONE;
+    count_samples(SET, 1);
+    m->inputs++;
+    if (m->top_samples) metrics_track_key(m, key, 1, MIN_BINARY_HEADER_SIZE + val_bytes);
 
+    // Update the set
+    metrics_set_update(m, key, key+header[1]);
 
-/**
- * Invoked by the networking layer when there is new
- * data to be handled. The connection handler should
- * consume all the input possible, and generate responses
- * to all requests.
- * @arg handle The connection related information
- * @return 0 on success.
- */
-int handle_client_connect(statsite_conn_handler *handle) {
-    // Try to read the magic character, bail if no data
-    unsigned char magic;
-    if (unlikely(peek_client_byte(handle->conn, &magic) == -1)) return 0;
+DONE:
+    // Make sure to free the command buffer if we need to
+    if (unlikely(should_free)) free(header);
+    return 0;
 
-    // Check the magic byte
-    if (magic == BINARY_MAGIC_BYTE)
-        return handle_binary_client_connect(handle);
-    else
-        return handle_ascii_client_connect(handle);
+ERR_RET:
+    if (unlikely(should_free)) free(header);
+    return -1;
 }
 
-/**
- * Simple string to double conversion
- */
-static double str2double(const char *s, char **end) {
-    double val = 0.0;
-    char neg = 0;
-    if (*s == '-') {
-        neg = 1;
-        s++;
-    }
-    for (; *s >= '0' && *s <= '9'; s++) {
-        val = (val * 10.0) + (*s - '0');
+// Handles a sketch command, merging a sketch from a downstream node
+// Return 0 on success, -1 on error, -2 if missing data
+static int handle_binary_sketch(statsite_conn_handler *handle, metrics *m, uint16_t *header, int should_free, bool checked) {
+    /*
+     * Abort if we haven't received the command
+     * header[1] is the key length
+     * header[2] and header[3] are the sketch length
+     */
+    char *key;
+    if (unlikely(should_free)) free(header);
+    if (peek_client_bytes(handle->conn, BIN_SKETCH_HEADER_SIZE, (char**)&header, &should_free))
+        return wait_for_frame(handle, BIN_SKETCH_HEADER_SIZE, false);
+    uint16_t key_len = header[1];
+    uint32_t sketch_len = *(uint32_t*)(header+2);
+    if (unlikely(!checked && (!key_len || !sketch_len || sketch_len > BIN_SKETCH_MAX_BYTES))) {
+        input_warning("Received sketch from binary stream with length %u and key length %u!",
+                sketch_len, key_len);
+        goto ERR_RET;
     }
-    if (*s == '.') {
-        s++;
-        double frac = 0.0;
-        int digits = 0;
-        for (; *s >= '0' && *s <= '9'; s++) {
-            frac = (frac * 10.0) + (*s - '0');
-            digits++;
-        }
-        val += frac / pow(10.0, digits);
+
+    // Read the full command if available
+    if (unlikely(should_free)) free(header);
+    if (read_client_bytes(handle->conn, BIN_SKETCH_HEADER_SIZE + key_len + sketch_len, (char**)&header, &should_free))
+        return wait_for_frame(handle, BIN_SKETCH_HEADER_SIZE + key_len + sketch_len, true);
+    key = ((char*)header) + BIN_SKETCH_HEADER_SIZE;
+
+    // Verify the null terminator
+    if (unlikely(*(key + key_len - 1))) {
+        input_warning("Received command from binary stream with non-null terminated key: %.*s!", key_len, key);
+        goto ERR_RET;
     }
-    if (neg) val *= -1.0;
-    if (end) *end = (char*)s;
-    return val;
-}
 
-/**
- * Invoked to handle ASCII commands. This is the default
- * mode for statsite, to be backwards compatible with statsd
- * @arg handle The connection related information
- * @return 0 on success.
- */
-static int handle_ascii_client_connect(statsite_conn_handler *handle) {
-    // Look for the next command line
-    char *buf, *key, *val_str, *type_str, *sample_str, *endptr;
-    metric_type type;
-    int buf_len, should_free, status, i, after_len;
-    double val, sample_rate;
-    while (1) {
-        status = extract_to_terminator(handle->conn, '\n', &buf, &buf_len, &should_free);
-        if (status == -1) return 0; // Return if no command is available
-
-        // Check for a valid metric
-        // Scan for the colon
-        status = buffer_after_terminator(buf, buf_len, ':', &val_str, &after_len);
-        if (likely(!status)) status |= buffer_after_terminator(val_str, after_len, '|', &type_str, &after_len);
-        if (unlikely(status)) {
-            syslog(LOG_WARNING, "Failed parse metric! Input: %s", buf);
-            goto ERR_RET;
-        }
+    // Skip the sketches of dropped keys
+    if (filter_drops(key, 1)) goto DONE;
 
-        // Convert the type
-        switch (*type_str) {
-            case 'c':
-                type = COUNTER;
-                break;
-            case 'm':
-                type = TIMER;
-                break;
-            case 'k':
-                type = KEY_VAL;
-                break;
-            case 'g':
-                type = GAUGE;
+    // The sketch must fill the frame exactly
+    if (unlikely(metrics_merge_sketch(m, key, key + key_len, sketch_len) != (int)sketch_len)) {
+        input_warning("Received invalid sketch from binary stream for key: %s!", key);
+        goto ERR_RET;
+    }
+    stats_add(STAT_SKETCHES, 1);
+    m->inputs++;
 
-                // Check if this is a delta update
-                switch (*val_str) {
-                    case '+':
-                        // Advance past the + to avoid breaking str2double
-                        val_str++;
-                    case '-':
-                        type = GAUGE_DELTA;
-                }
-                break;
-            case 's':
-                type = SET;
-                break;
-            default:
-                type = UNKNOWN;
-                syslog(LOG_WARNING, "Received unknown metric type! Input: %c", *type_str);
-                goto ERR_RET;
-        }
+DONE:
+    // Make sure to free the command buffer if we need to
+    if (unlikely(should_free)) free(header);
+    return 0;
 
-        // Increment the number of inputs received
-        if (GLOBAL_CONFIG->input_counter)
-            metrics_add_sample(GLOBAL_METRICS, COUNTER, GLOBAL_CONFIG->input_counter, 1);
+ERR_RET:
+    if (unlikely(should_free)) free(header);
+    return -1;
+}
 
-        // Fast track the set-updates
-        if (type == SET) {
-            metrics_set_update(GLOBAL_METRICS, buf, val_str);
-            goto END_LOOP;
-        }
+// Handles a multi-value command, with many values for one key
+// Return 0 on success, -1 on error, -2 if missing data
+static int handle_binary_multi(statsite_conn_handler *handle, metrics *m, metric_type type, uint16_t *header, int should_free, bool checked) {
+    /*
+     * Abort if we haven't received the command
+     * header[1] is the key length
+     * header[2] is the number of values, which precede the key
+     */
+    char *key;
+    double *vals;
+    uint16_t key_len = header[1], num = header[2];
+    if (unlikely(!checked && (!key_len || !num || num > BIN_MULTI_MAX_VALUES))) {
+        input_warning("Received multi-value command from binary stream with %u values and key length %u!",
+                num, key_len);
+        goto ERR_RET;
+    }
+    int val_bytes = num * sizeof(double);
 
-        // Convert the value to a double
-        val = str2double(val_str, &endptr);
-        if (unlikely(endptr == val_str)) {
-            syslog(LOG_WARNING, "Failed value conversion! Input: %s", val_str);
-            goto ERR_RET;
-        }
+    // Read the full command if available
+    if (unlikely(should_free)) free(header);
+    if (read_client_bytes(handle->conn, MIN_BINARY_HEADER_SIZE + val_bytes + key_len, (char**)&header, &should_free))
+        return wait_for_frame(handle, MIN_BINARY_HEADER_SIZE + val_bytes + key_len, true);
+    vals = (double*)(((char*)header) + MIN_BINARY_HEADER_SIZE);
+    key = ((char*)vals) + val_bytes;
 
-        // Handle counter sampling if applicable
-        if (type == COUNTER && !buffer_after_terminator(type_str, after_len, '@', &sample_str, &after_len)) {
-            sample_rate = str2double(sample_str, &endptr);
-            if (unlikely(endptr == sample_str)) {
-                syslog(LOG_WARNING, "Failed sample rate conversion! Input: %s", sample_str);
-                goto ERR_RET;
-            }
-            if (sample_rate > 0 && sample_rate <= 1) {
-                // Magnify the value
-                val = val * (1.0 / sample_rate);
-            }
-        }
+    // Verify the null terminator
+    if (unlikely(*(key + key_len - 1))) {
+        input_warning("Received command from binary stream with non-null terminated key: %.*s!", key_len, key);
+        goto ERR_RET;
+    }
 
-        // Store the sample
-        metrics_add_sample(GLOBAL_METRICS, type, buf, val);
+    // Increment the input count, unless the key is dropped
+    if (filter_drops(key, num)) goto DONE;
+    count_samples(type, num);
+    m->inputs += num;
+    if (m->top_samples)
+        metrics_track_key(m, key, num, MIN_BINARY_HEADER_SIZE + val_bytes + key_len);
 
-END_LOOP:
-        // Make sure to free the command buffer if we need to
-        if (should_free) free(buf);
+    // Timers and hashed set members take the values as a batch, with a single lookup
+    if (type == TIMER)
+        metrics_add_timer_samples(m, key, vals, num);
+    else if (type == SET)
+        metrics_add_set_hashes(m, key, (uint64_t*)vals, num);
+    else {
+        for (int i=0; i < num; i++) {
+            metrics_add_sample(m, type, key, vals[i]);
+        }
     }
 
+DONE:
+    // Make sure to free the command buffer if we need to
+    if (unlikely(should_free)) free(header);
     return 0;
+
 ERR_RET:
-    if (should_free) free(buf);
+    if (unlikely(should_free)) free(header);
     return -1;
 }
 
-// Handles the binary set command
+/**
+ * Invoked by the networking layer when a connection is
+ * closed, to release the state kept in its client_state.
+ * @arg state The state to free
+ */
+void free_client_state(void *state) {
+    client_conn *keys = state;
+    for (int i=0; i < keys->num_keys; i++) {
+        free(keys->keys[i].key);
+    }
+    free(keys->keys);
+    free(keys);
+}
+
+// Handles the binary bind command, which binds an ID to a key
 // Return 0 on success, -1 on error, -2 if missing data
-static int handle_binary_set(statsite_conn_handler *handle, uint16_t *header, int should_free) {
+static int handle_binary_bind(statsite_conn_handler *handle, uint16_t *header, int should_free, bool checked) {
     /*
      * Abort if we haven't received the command
      * header[1] is the key length
-     * header[2] is the set length
+     * header[2] is the ID
      */
     char *key;
-    int val_bytes = header[1] + header[2];
+    uint16_t key_len = header[1], id = header[2];
+    void **slot = client_state(handle->conn);
+    if (unlikely(!slot)) {
+        input_warning("Received key binding from a UDP client!");
+        goto ERR_RET;
+    }
+    if (unlikely(!checked && (!key_len || id > BIN_MAX_KEY_ID))) {
+        input_warning("Received key binding from binary stream with ID %u and key length %u!", id, key_len);
+        goto ERR_RET;
+    }
 
     // Read the full command if available
     if (unlikely(should_free)) free(header);
-    if (read_client_bytes(handle->conn, MIN_BINARY_HEADER_SIZE + val_bytes, (char**)&header, &should_free))
-        return -2;
+    if (read_client_bytes(handle->conn, MIN_BINARY_HEADER_SIZE + key_len, (char**)&header, &should_free))
+        return wait_for_frame(handle, MIN_BINARY_HEADER_SIZE + key_len, true);
     key = ((char*)header) + MIN_BINARY_HEADER_SIZE;
 
-    // Verify the null terminators
-    if (unlikely(*(key + header[1] - 1))) {
-        syslog(LOG_WARNING, "Received command from binary stream with non-null terminated key: %.*s!", header[1], key);
-        goto ERR_RET;
-    }
-    if (unlikely(*(key + val_bytes - 1))) {
-        syslog(LOG_WARNING, "Received command from binary stream with non-null terminated set key: %.*s!", header[2], key+header[1]);
+    // Verify the null terminator
+    if (unlikely(*(key + key_len - 1))) {
+        input_warning("Received command from binary stream with non-null terminated key: %.*s!", key_len, key);
         goto ERR_RET;
     }
 
-    // Increment the input counter
-    if (GLOBAL_CONFIG->input_counter)
-        metrics_add_sample(GLOBAL_METRICS, COUNTER, GLOBAL_CONFIG->input_counter, 1);
+    // Grow the keys to fit the ID
+    client_conn *keys = *slot;
+    if (!keys) keys = *slot = calloc(1, sizeof(client_conn));
+    if (id >= keys->num_keys) {
+        int num = (keys->num_keys) ? keys->num_keys : 16;
+        while (num <= id) num *= 2;
+        keys->keys = realloc(keys->keys, num * sizeof(bound_key));
+        memset(keys->keys + keys->num_keys, 0, (num - keys->num_keys) * sizeof(bound_key));
+        keys->num_keys = num;
+    }
 
-    // Update the set
-    metrics_set_update(GLOBAL_METRICS, key, key+header[1]);
+    // Bind the key, which replaces any earlier binding
+    bound_key *b = keys->keys + id;
+    free(b->key);
+    b->key = strdup(key);
+    b->metric = NULL;
+    b->generation = 0;
+    b->dropped = GLOBAL_CONFIG->filters && key_filtered(key);
 
     // Make sure to free the command buffer if we need to
     if (unlikely(should_free)) free(header);
@@ -467,33 +3728,112 @@ ERR_RET:
     return -1;
 }
 
+// Handles a command that refers to a bound key by ID,
+// which may also carry many values
+// Return 0 on success, -1 on error, -2 if missing data
+static int handle_binary_id(statsite_conn_handler *handle, metrics *m, metric_type type, unsigned char *cmd, int should_free, bool checked) {
+    /*
+     * Abort if we haven't received the command
+     * The ID is at offset 2, followed by the value,
+     * or by the number of values and the values.
+     */
+    uint16_t id = *(uint16_t*)(cmd+2);
+    int num = 1, offset = 4;
+    if (cmd[1] & BIN_TYPE_MULTI) {
+        num = *(uint16_t*)(cmd+4);
+        offset = MIN_BINARY_HEADER_SIZE;
+        if (unlikely(!checked && (!num || num > BIN_MULTI_MAX_VALUES))) {
+            input_warning("Received multi-value command from binary stream with %u values!", num);
+            goto ERR_RET;
+        }
+    }
+
+    // Find the bound key
+    void **slot = client_state(handle->conn);
+    client_conn *keys = (slot) ? *slot : NULL;
+    if (unlikely(!checked && (!keys || id >= keys->num_keys || !keys->keys[id].key))) {
+        input_warning("Received command from binary stream with unbound key ID: %u!", id);
+        goto ERR_RET;
+    }
+    bound_key *b = keys->keys + id;
+
+    // Read the full command if available
+    if (unlikely(should_free)) free(cmd);
+    if (read_client_bytes(handle->conn, offset + num * sizeof(double), (char**)&cmd, &should_free))
+        return wait_for_frame(handle, offset + num * sizeof(double), true);
+    double *vals = (double*)(cmd + offset);
+
+    // Skip the samples of dropped keys, checked when bound
+    if (b->dropped) {
+        stats_add(STAT_FILTER_DROPPED, num);
+        if (unlikely(should_free)) free(cmd);
+        return 0;
+    }
+
+    // Increment the input count
+    count_samples(type, num);
+    m->inputs += num;
+    if (m->top_samples) metrics_track_key(m, b->key, num, offset + num * sizeof(double));
+
+    // Resolve the key once per interval, the flush swaps the metrics
+    if (b->generation != m->generation || b->type != type) {
+        b->kind = type;
+        b->metric = metrics_get_metric(m, &b->kind, b->key);
+        b->type = type;
+        b->generation = m->generation;
+    }
+
+    // Add the samples, K/V pairs can not be cached
+    if (b->metric)
+        metrics_add_to(m, b->kind, b->metric, vals, num);
+    else {
+        for (int i=0; i < num; i++) {
+            metrics_add_sample(m, type, b->key, vals[i]);
+        }
+    }
+
+    // Make sure to free the command buffer if we need to
+    if (unlikely(should_free)) free(cmd);
+    return 0;
+
+ERR_RET:
+    if (unlikely(should_free)) free(cmd);
+    return -1;
+}
+
 /**
  * Invoked to handle binary commands.
  * @arg handle The connection related information
+ * @arg m The metrics object to update
  * @return 0 on success.
  */
-static int handle_binary_client_connect(statsite_conn_handler *handle) {
+static int handle_binary_client_connect(statsite_conn_handler *handle, metrics *m) {
     metric_type type;
     uint16_t key_len;
     int should_free;
     unsigned char *cmd, *key;
-    while (1) {
+
+    // Wait for the rest of a frame that was short, the first
+    // frame is then trusted if its header was checked before
+    bool checked;
+    if (frame_pending(handle, &checked)) return 0;
+    for (;; checked = false) {
         // Peek and check for the header. This is up to 12 bytes.
         // Magic byte - 1 byte
         // Metric type - 1 byte
         // Key length - 2 bytes
-        // Metric value - 8 bytes OR Set Length 2 bytes
+        // Metric value - 8 bytes OR Set Length 2 bytes OR Value count 2 bytes
         if (peek_client_bytes(handle->conn, MIN_BINARY_HEADER_SIZE, (char**)&cmd, &should_free))
             return 0;  // Return if no command is available
 
         // Check for the magic byte
-        if (unlikely(cmd[0] != BINARY_MAGIC_BYTE)) {
-            syslog(LOG_WARNING, "Received command from binary stream without magic byte! Byte: %u", cmd[0]);
+        if (unlikely(!checked && cmd[0] != BINARY_MAGIC_BYTE)) {
+            input_warning("Received command from binary stream without magic byte! Byte: %u", cmd[0]);
             goto ERR_RET;
         }
 
-        // Get the metric type
-        switch (cmd[1]) {
+        // Get the metric type, which may be flagged as multi-value or using a bound key
+        switch (cmd[1] & ~(BIN_TYPE_MULTI | BIN_TYPE_ID)) {
             case BIN_TYPE_KV:
                 type = KEY_VAL;
                 break;
@@ -510,43 +3850,109 @@ static int handle_binary_client_connect(statsite_conn_handler *handle) {
                 type = GAUGE_DELTA;
                 break;
 
-            // Special case set handling
+            // Hashed set members carry the hash in place of
+            // the value, and can not use a bound key
+            case BIN_TYPE_SET_HASH:
+                if (!(cmd[1] & BIN_TYPE_ID)) {
+                    type = SET;
+                    break;
+                }
+                input_warning("Received command from binary stream with unknown type: %u!", cmd[1]);
+                goto ERR_RET;
+
+            // Special case set handling, key bindings
+            // and sketches, none of which can be flagged
             case BIN_TYPE_SET:
-                switch (handle_binary_set(handle, (uint16_t*)cmd, should_free)) {
-                    case -1:
-                        return -1;
-                    case -2:
-                        return 0;
-                    default:
-                        continue;
+                if (cmd[1] == BIN_TYPE_SET) {
+                    switch (handle_binary_set(handle, m, (uint16_t*)cmd, should_free)) {
+                        case -1:
+                            return -1;
+                        case -2:
+                            return 0;
+                        default:
+                            continue;
+                    }
+                }
+            case BIN_TYPE_BIND:
+                if (cmd[1] == BIN_TYPE_BIND) {
+                    switch (handle_binary_bind(handle, (uint16_t*)cmd, should_free, checked)) {
+                        case -1:
+                            return -1;
+                        case -2:
+                            return 0;
+                        default:
+                            continue;
+                    }
+                }
+            case BIN_TYPE_SKETCH:
+                if (cmd[1] == BIN_TYPE_SKETCH) {
+                    switch (handle_binary_sketch(handle, m, (uint16_t*)cmd, should_free, checked)) {
+                        case -1:
+                            return -1;
+                        case -2:
+                            return 0;
+                        default:
+                            continue;
+                    }
                 }
 
             default:
-                syslog(LOG_WARNING, "Received command from binary stream with unknown type: %u!", cmd[1]);
+                input_warning("Received command from binary stream with unknown type: %u!", cmd[1]);
                 goto ERR_RET;
         }
 
+        // Special case bound keys, which may also be multi-value
+        if (cmd[1] & BIN_TYPE_ID) {
+            switch (handle_binary_id(handle, m, type, cmd, should_free, checked)) {
+                case -1:
+                    return -1;
+                case -2:
+                    return 0;
+                default:
+                    continue;
+            }
+        }
+
+        // Special case multi-value handling
+        if (cmd[1] & BIN_TYPE_MULTI) {
+            switch (handle_binary_multi(handle, m, type, (uint16_t*)cmd, should_free, checked)) {
+                case -1:
+                    return -1;
+                case -2:
+                    return 0;
+                default:
+                    continue;
+            }
+        }
+
         // Abort if we haven't received the full key, wait for the data
         key_len = *(uint16_t*)(cmd+2);
 
         // Read the full command if available
         if (unlikely(should_free)) free(cmd);
-        if (read_client_bytes(handle->conn, MAX_BINARY_HEADER_SIZE + key_len, (char**)&cmd, &should_free))
+        if (read_client_bytes(handle->conn, MAX_BINARY_HEADER_SIZE + key_len, (char**)&cmd, &should_free)) {
+            wait_for_frame(handle, MAX_BINARY_HEADER_SIZE + key_len, true);
             return 0;
+        }
         key = cmd + MAX_BINARY_HEADER_SIZE;
 
         // Verify the key contains a null terminator
         if (unlikely(*(key + key_len - 1))) {
-            syslog(LOG_WARNING, "Received command from binary stream with non-null terminated key: %.*s!", key_len, key);
+            input_warning("Received command from binary stream with non-null terminated key: %.*s!", key_len, key);
             goto ERR_RET;
         }
 
-        // Increment the input counter
-        if (GLOBAL_CONFIG->input_counter)
-            metrics_add_sample(GLOBAL_METRICS, COUNTER, GLOBAL_CONFIG->input_counter, 1);
-
-        // Add the sample
-        metrics_add_sample(GLOBAL_METRICS, type, key, *(double*)(cmd+4));
+        // Increment the input count, and add the sample unless the key is dropped
+        if (!filter_drops((char*)key, 1)) {
+            count_samples(type, 1);
+            m->inputs++;
+            if (m->top_samples)
+                metrics_track_key(m, (char*)key, 1, MAX_BINARY_HEADER_SIZE + key_len);
+            if (type == SET)
+                metrics_add_set_hashes(m, (char*)key, (uint64_t*)(cmd+4), 1);
+            else
+                metrics_add_sample(m, type, key, *(double*)(cmd+4));
+        }
 
         // Make sure to free the command buffer if we need to
         if (unlikely(should_free)) free(cmd);
@@ -557,31 +3963,215 @@ ERR_RET:
     return -1;
 }
 
+// Forwards a binary frame with its key to the upstream of the key
+// Return 0 on success, -1 on error, -2 if missing data
+static int proxy_binary_frame(statsite_conn_handler *handle, unsigned char *cmd, int should_free, bool checked) {
+    uint16_t *header = (uint16_t*)cmd;
+    uint16_t key_len = header[1], set_len = 0, num;
+    int key_offset, frame_len;
+    switch (cmd[1]) {
+        case BIN_TYPE_SET:
+            set_len = header[2];
+            key_offset = MIN_BINARY_HEADER_SIZE;
+            frame_len = key_offset + key_len + set_len;
+            break;
 
-/**
- * Scans the input buffer of a given length up to a terminator.
- * Then sets the start of the buffer after the terminator including
- * the length of the after buffer.
- * @arg buf The input buffer
- * @arg buf_len The length of the input buffer
- * @arg terminator The terminator to scan to. Replaced with the null terminator.
- * @arg after_term Output. Set to the byte after the terminator.
- * @arg after_len Output. Set to the length of the output buffer.
- * @return 0 if terminator found. -1 otherwise.
- */
-static int buffer_after_terminator(char *buf, int buf_len, char terminator, char **after_term, int *after_len) {
-    // Scan for a space
-    char *term_addr = memchr(buf, terminator, buf_len);
-    if (!term_addr) {
-        *after_term = NULL;
-        return -1;
+        case BIN_TYPE_SKETCH: {
+            if (unlikely(should_free)) free(cmd);
+            if (peek_client_bytes(handle->conn, BIN_SKETCH_HEADER_SIZE, (char**)&cmd, &should_free))
+                return wait_for_frame(handle, BIN_SKETCH_HEADER_SIZE, false);
+            key_len = ((uint16_t*)cmd)[1];
+            uint32_t sketch_len = *(uint32_t*)(cmd+4);
+            if (unlikely(!checked && (!sketch_len || sketch_len > BIN_SKETCH_MAX_BYTES))) {
+                input_warning("Received sketch from binary stream with length %u!", sketch_len);
+                goto ERR_RET;
+            }
+            key_offset = BIN_SKETCH_HEADER_SIZE;
+            frame_len = key_offset + key_len + sketch_len;
+            break;
+        }
+
+        default:
+            // The values of a multi-value frame precede the key
+            key_offset = MAX_BINARY_HEADER_SIZE;
+            if (cmd[1] & BIN_TYPE_MULTI) {
+                num = header[2];
+                if (unlikely(!checked && (!num || num > BIN_MULTI_MAX_VALUES))) {
+                    input_warning("Received multi-value command from binary stream with %u values!", num);
+                    goto ERR_RET;
+                }
+                key_offset = MIN_BINARY_HEADER_SIZE + num * sizeof(double);
+            }
+            frame_len = key_offset + key_len;
+            break;
+    }
+    if (unlikely(!checked && !key_len)) {
+        input_warning("Received command from binary stream without a key!");
+        goto ERR_RET;
+    }
+
+    // Read the full command if available
+    if (unlikely(should_free)) free(cmd);
+    if (read_client_bytes(handle->conn, frame_len, (char**)&cmd, &should_free))
+        return wait_for_frame(handle, frame_len, true);
+    char *key = (char*)cmd + key_offset;
+
+    // Verify the null terminators
+    if (unlikely(key[key_len - 1] || (set_len && key[key_len + set_len - 1]))) {
+        input_warning("Received command from binary stream with non-null terminated key: %.*s!", key_len, key);
+        goto ERR_RET;
+    }
+
+    // Route on the key without its terminator, the same as ASCII lines
+    if (!filter_drops(key, 1)) {
+        int upstream = proxy_route(GLOBAL_PROXY, key, key_len - 1);
+        proxy_forward(GLOBAL_PROXY, handle->shard, upstream, true, (char*)cmd, frame_len);
     }
 
-    // Convert the space to a null-seperator
-    *term_addr = '\0';
+    // Make sure to free the command buffer if we need to
+    if (unlikely(should_free)) free(cmd);
+    return 0;
+
+ERR_RET:
+    if (unlikely(should_free)) free(cmd);
+    return -1;
+}
+
+// Forwards a command that refers to a bound key by ID. The
+// upstream never saw the binding, so it is sent with the key.
+// Return 0 on success, -1 on error, -2 if missing data
+static int proxy_binary_id(statsite_conn_handler *handle, unsigned char *cmd, int should_free, bool checked) {
+    /*
+     * The ID is at offset 2, followed by the value, or by the
+     * number of values and the values. The frame with the key
+     * only replaces the ID with the key length, and adds the key.
+     */
+    uint16_t id = *(uint16_t*)(cmd+2);
+    int num = 1, offset = 4;
+    if (cmd[1] & BIN_TYPE_MULTI) {
+        num = *(uint16_t*)(cmd+4);
+        offset = MIN_BINARY_HEADER_SIZE;
+        if (unlikely(!checked && (!num || num > BIN_MULTI_MAX_VALUES))) {
+            input_warning("Received multi-value command from binary stream with %u values!", num);
+            goto ERR_RET;
+        }
+    }
+
+    // Find the bound key
+    void **slot = client_state(handle->conn);
+    client_conn *keys = (slot) ? *slot : NULL;
+    if (unlikely(!checked && (!keys || id >= keys->num_keys || !keys->keys[id].key))) {
+        input_warning("Received command from binary stream with unbound key ID: %u!", id);
+        goto ERR_RET;
+    }
+    char *key = keys->keys[id].key;
+
+    // Read the full command if available
+    int cmd_len = offset + num * sizeof(double);
+    if (unlikely(should_free)) free(cmd);
+    if (read_client_bytes(handle->conn, cmd_len, (char**)&cmd, &should_free))
+        return wait_for_frame(handle, cmd_len, true);
+
+    // Skip the samples of dropped keys, checked when bound
+    if (keys->keys[id].dropped) {
+        stats_add(STAT_FILTER_DROPPED, num);
+        if (unlikely(should_free)) free(cmd);
+        return 0;
+    }
+
+    // Build the frame with the key
+    uint16_t key_len = strlen(key) + 1;
+    int frame_len = cmd_len + key_len;
+    char stack_frame[BIN_PROXY_STACK_FRAME];
+    char *frame = (frame_len <= BIN_PROXY_STACK_FRAME) ? stack_frame : malloc(frame_len);
+    memcpy(frame, cmd, cmd_len);
+    frame[1] &= ~BIN_TYPE_ID;
+    memcpy(frame + 2, &key_len, sizeof(key_len));
+    memcpy(frame + cmd_len, key, key_len);
 
-    // Provide the arg buffer, and arg_len
-    *after_term = term_addr+1;
-    *after_len = buf_len - (term_addr - buf + 1);
+    int upstream = proxy_route(GLOBAL_PROXY, key, key_len - 1);
+    proxy_forward(GLOBAL_PROXY, handle->shard, upstream, true, frame, frame_len);
+    if (frame != stack_frame) free(frame);
+
+    // Make sure to free the command buffer if we need to
+    if (unlikely(should_free)) free(cmd);
     return 0;
+
+ERR_RET:
+    if (unlikely(should_free)) free(cmd);
+    return -1;
+}
+
+/**
+ * Invoked to forward binary commands with the proxy. Each
+ * frame is checked and sent on to the upstream of its key,
+ * and the key bindings are kept here, as the upstreams do not
+ * see them.
+ * @arg handle The connection related information
+ * @return 0 on success.
+ */
+static int proxy_binary_client_connect(statsite_conn_handler *handle) {
+    int should_free, res;
+    unsigned char *cmd;
+
+    // Wait for the rest of a frame that was short, the first
+    // frame is then trusted if its header was checked before
+    bool checked;
+    if (frame_pending(handle, &checked)) return 0;
+    for (;; checked = false) {
+        if (peek_client_bytes(handle->conn, MIN_BINARY_HEADER_SIZE, (char**)&cmd, &should_free))
+            return 0;  // Return if no command is available
+
+        // Check for the magic byte
+        if (unlikely(!checked && cmd[0] != BINARY_MAGIC_BYTE)) {
+            input_warning("Received command from binary stream without magic byte! Byte: %u", cmd[0]);
+            if (unlikely(should_free)) free(cmd);
+            return -1;
+        }
+
+        // Check the metric type, sets, bindings and sketches can not be flagged
+        switch (cmd[1] & ~(BIN_TYPE_MULTI | BIN_TYPE_ID)) {
+            case BIN_TYPE_KV:
+            case BIN_TYPE_COUNTER:
+            case BIN_TYPE_TIMER:
+            case BIN_TYPE_GAUGE:
+            case BIN_TYPE_GAUGE_DELTA:
+                if (cmd[1] & BIN_TYPE_ID)
+                    res = proxy_binary_id(handle, cmd, should_free, checked);
+                else
+                    res = proxy_binary_frame(handle, cmd, should_free, checked);
+                break;
+
+            // Hashed set members are framed as samples, without bound keys
+            case BIN_TYPE_SET_HASH:
+                if (!(cmd[1] & BIN_TYPE_ID)) {
+                    res = proxy_binary_frame(handle, cmd, should_free, checked);
+                    break;
+                }
+
+            case BIN_TYPE_SET:
+            case BIN_TYPE_SKETCH:
+                if (cmd[1] == BIN_TYPE_SET || cmd[1] == BIN_TYPE_SKETCH) {
+                    res = proxy_binary_frame(handle, cmd, should_free, checked);
+                    break;
+                }
+            case BIN_TYPE_BIND:
+                if (cmd[1] == BIN_TYPE_BIND) {
+                    res = handle_binary_bind(handle, (uint16_t*)cmd, should_free, checked);
+                    break;
+                }
+
+            default:
+                input_warning("Received command from binary stream with unknown type: %u!", cmd[1]);
+                if (unlikely(should_free)) free(cmd);
+                return -1;
+        }
+
+        switch (res) {
+            case -1:
+                return -1;
+            case -2:
+                return 0;
+        }
+    }
 }
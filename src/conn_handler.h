@@ -2,6 +2,7 @@
 #define CONN_HANDLER_H
 #include "config.h"
 #include "networking.h"
+#include "streaming.h"
 
 /**
  * This structure is used to communicate
@@ -11,6 +12,7 @@
 typedef struct {
     statsite_config *config;     // Global configuration
     statsite_conn_info *conn;    // Opaque handle into the networking stack
+    int shard;                   // The metrics shard to update, one per worker
 } statsite_conn_handler;
 
 /**
@@ -20,8 +22,19 @@ void init_conn_handler(statsite_config *config);
 
 /**
  * Invoked to when we've reached the flush interval timeout
+ * @return The seconds until the next flush, which a
+ * reload of the configuration may change.
  */
-void flush_interval_trigger();
+int flush_interval_trigger();
+
+/**
+ * Reloads the configuration file at the next flush, which
+ * applies the settings of the metrics to the next interval,
+ * keeping the interval in progress and the open sockets.
+ * Only sets a flag, so it is safe to call from a signal handler.
+ * @arg filename The configuration file, NULL for the defaults
+ */
+void schedule_config_reload(char *filename);
 
 /**
  * Called when statsite is terminating to flush the
@@ -29,6 +42,17 @@ void flush_interval_trigger();
  */
 void final_flush();
 
+/**
+ * Aggregates the ASCII lines of files into the metrics, without
+ * the networking layer. Each file is mapped and split at newlines
+ * across a thread for each shard. Call final_flush afterwards to
+ * stream the result once.
+ * @arg paths The files to read
+ * @arg num_paths The number of files
+ * @return 0 on success, -1 if a file could not be read.
+ */
+int bulk_ingest_files(char **paths, int num_paths);
+
 /**
  * Invoked by the networking layer when there is new
  * data to be handled. The connection handler should
@@ -39,4 +63,47 @@ void final_flush();
  */
 int handle_client_connect(statsite_conn_handler *handle);
 
+/**
+ * Invoked by the networking layer when a connection is
+ * closed, to release the state kept in its client_state.
+ * @arg state The state to free
+ */
+void free_client_state(void *state);
+
+/**
+ * Invoked by the networking layer when the kernel reports
+ * that UDP datagrams were dropped, so they can be counted.
+ * @arg handle The connection related information
+ * @arg drops The number of newly dropped datagrams
+ */
+void handle_udp_drops(statsite_conn_handler *handle, uint64_t drops);
+
+/**
+ * Invoked by each worker on a short timer when proxying,
+ * to send the records it has batched for the upstreams.
+ * @arg worker The index of the worker
+ */
+void handle_proxy_flush(int worker);
+
+/**
+ * Writes the current values of the interval in progress, for
+ * the metrics whose names start with a prefix, in the ASCII
+ * output format. The matching metrics of each worker are merged
+ * into a separate object, with the lock of the worker held only
+ * while its metrics are scanned, so nothing is flushed or reset.
+ * @arg prefix The prefix of the names, "" for all
+ * @arg out The stream to write to
+ * @return 0 on success.
+ */
+int query_metrics(const char *prefix, FILE *out);
+
+/**
+ * Returns the stream callback that formats the flushes in
+ * the output format of a configuration. The callback is passed
+ * the time of the flush, as a struct timeval, for its data.
+ * @arg config The configuration
+ * @return The stream callback
+ */
+stream_callback output_formatter(statsite_config *config);
+
 #endif
@@ -36,6 +36,50 @@ int counter_add_sample(counter *counter, double sample) {
     return 0;
 }
 
+/**
+ * Adds the same sample value many times. This is
+ * equivalent to calling counter_add_sample count times.
+ * @arg counter The counter to add to
+ * @arg sample The sample value
+ * @arg count The number of samples
+ * @return 0 on success.
+ */
+int counter_add_samples(counter *counter, double sample, uint64_t count) {
+    if (!count) return 0;
+    if (counter->count == 0) {
+        counter->min = counter->max = sample;
+    } else {
+        if (counter->min > sample)
+            counter->min = sample;
+        else if (counter->max < sample)
+            counter->max = sample;
+    }
+    counter->count += count;
+    counter->sum += sample * count;
+    counter->squared_sum += pow(sample, 2) * count;
+    return 0;
+}
+
+/**
+ * Merges the samples of one counter into another
+ * @arg dst The counter to merge into
+ * @arg src The counter to merge from
+ * @return 0 on success.
+ */
+int counter_merge(counter *dst, counter *src) {
+    if (src->count == 0) return 0;
+    if (dst->count == 0) {
+        *dst = *src;
+        return 0;
+    }
+    if (dst->min > src->min) dst->min = src->min;
+    if (dst->max < src->max) dst->max = src->max;
+    dst->count += src->count;
+    dst->sum += src->sum;
+    dst->squared_sum += src->squared_sum;
+    return 0;
+}
+
 /**
  * Returns the number of samples in the counter
  * @arg counter The counter to query
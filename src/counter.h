@@ -25,6 +25,24 @@ int init_counter(counter *counter);
  */
 int counter_add_sample(counter *counter, double sample);
 
+/**
+ * Adds the same sample value many times. This is
+ * equivalent to calling counter_add_sample count times.
+ * @arg counter The counter to add to
+ * @arg sample The sample value
+ * @arg count The number of samples
+ * @return 0 on success.
+ */
+int counter_add_samples(counter *counter, double sample, uint64_t count);
+
+/**
+ * Merges the samples of one counter into another
+ * @arg dst The counter to merge into
+ * @arg src The counter to merge from
+ * @return 0 on success.
+ */
+int counter_merge(counter *dst, counter *src);
+
 /**
  * Returns the number of samples in the counter
  * @arg counter The counter to query
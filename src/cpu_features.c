@@ -0,0 +1,62 @@
+#include <strings.h>
+#include "cpu_features.h"
+
+// The instruction set the kernels use, -1 until detected
+static int SELECTED = -1;
+
+static const char *NAMES[] = {"none", "sse2", "avx2", "avx512", "neon"};
+
+simd_level simd_detect() {
+#if defined(HAVE_SIMD_X86)
+    // The checks include the support of the OS for the wider registers
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2")) return SIMD_SSE2;
+    return SIMD_NONE;
+#elif defined(__ARM_NEON)
+    // NEON is part of every 64 bit ARM core
+    return SIMD_NEON;
+#else
+    return SIMD_NONE;
+#endif
+}
+
+simd_level simd_current() {
+    int level = __atomic_load_n(&SELECTED, __ATOMIC_RELAXED);
+    if (__builtin_expect(level < 0, 0)) {
+        level = simd_detect();
+        __atomic_store_n(&SELECTED, level, __ATOMIC_RELAXED);
+    }
+    return level;
+}
+
+simd_level simd_limit(simd_level level) {
+    simd_level host = simd_detect();
+
+    // The levels are ordered on x86, NEON stands alone
+    if (level == SIMD_AUTO) level = host;
+    else if (host == SIMD_NEON) level = (level == SIMD_NEON) ? SIMD_NEON : SIMD_NONE;
+    else if (level > host) level = host;
+    __atomic_store_n(&SELECTED, level, __ATOMIC_RELAXED);
+    return level;
+}
+
+const char* simd_name(simd_level level) {
+    if (level == SIMD_AUTO) return "auto";
+    return NAMES[level];
+}
+
+int simd_parse(const char *name, simd_level *level) {
+    if (!strcasecmp(name, "auto")) {
+        *level = SIMD_AUTO;
+        return 0;
+    }
+    for (int i=0; i < (int)(sizeof(NAMES) / sizeof(NAMES[0])); i++) {
+        if (!strcasecmp(name, NAMES[i])) {
+            *level = i;
+            return 0;
+        }
+    }
+    return -1;
+}
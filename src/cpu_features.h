@@ -0,0 +1,58 @@
+/**
+ * Detects the SIMD instruction sets of the host at runtime, so
+ * a single binary built for the baseline runs the kernels of the
+ * widest set the host supports. The hot kernels, such as the line
+ * tokenizer and the histogram binning, are compiled once for each
+ * set with target attributes, and pick theirs by simd_level.
+ */
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+// The instruction sets that kernels are compiled for
+typedef enum {
+    SIMD_AUTO = -1,     // The widest set of the host, for simd_limit
+    SIMD_NONE,          // Scalar code only
+    SIMD_SSE2,
+    SIMD_AVX2,
+    SIMD_AVX512,        // AVX-512 with the byte and word instructions
+    SIMD_NEON
+} simd_level;
+
+// Are the x86 kernels compiled, for the targets of the compiler
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_SIMD_X86
+#endif
+
+/**
+ * Returns the widest instruction set of the host
+ */
+simd_level simd_detect();
+
+/**
+ * Returns the instruction set the kernels use. It is
+ * detected on the first call, unless set by simd_limit.
+ */
+simd_level simd_current();
+
+/**
+ * Limits the kernels to an instruction set, which is
+ * lowered to the widest the host supports.
+ * @arg level The instruction set, or SIMD_AUTO for the widest
+ * @return The instruction set now used.
+ */
+simd_level simd_limit(simd_level level);
+
+/**
+ * Returns the name of an instruction set
+ */
+const char* simd_name(simd_level level);
+
+/**
+ * Parses the name of an instruction set, or "auto"
+ * @arg name The name
+ * @arg level Output, the instruction set
+ * @return 0 on success, -1 if unknown.
+ */
+int simd_parse(const char *name, simd_level *level);
+
+#endif
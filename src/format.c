@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "format.h"
+
+static const uint64_t POW10[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL,
+    1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL
+};
+
+/**
+ * Writes an unsigned integer in reverse into the end of
+ * a scratch buffer, returning the start.
+ */
+static inline char* format_uint_rev(char *end, uint64_t val) {
+    do {
+        *--end = '0' + (val % 10);
+        val /= 10;
+    } while (val);
+    return end;
+}
+
+/**
+ * Formats a signed integer, identical to printf("%lld", val).
+ * @arg buf The output buffer, at least FORMAT_INT_MAX bytes
+ * @arg val The value to format
+ * @return The number of characters written, not including
+ * the NULL terminator.
+ */
+int format_int(char *buf, long long val) {
+    char scratch[FORMAT_INT_MAX];
+    char *end = scratch + sizeof(scratch);
+    uint64_t mag = (val < 0) ? -(uint64_t)val : (uint64_t)val;
+    char *start = format_uint_rev(end, mag);
+    if (val < 0) *--start = '-';
+
+    int len = end - start;
+    memcpy(buf, start, len);
+    buf[len] = '\0';
+    return len;
+}
+
+/**
+ * Formats a double, identical to printf("%.*f", precision, val).
+ * @arg buf The output buffer, at least FORMAT_DOUBLE_MAX bytes
+ * @arg val The value to format
+ * @arg precision The number of decimal places, between 0 and 9
+ * @return The number of characters written, not including
+ * the NULL terminator.
+ */
+int format_double(char *buf, double val, int precision) {
+#ifdef __SIZEOF_INT128__
+    /*
+     * The fast path handles values on [2^-12, 2^53). In this range
+     * the fractional part is exact as a 0.64 fixed point number, so
+     * we can scale and round it exactly, with ties to even like printf.
+     * Zero is also exact. Anything else uses snprintf.
+     */
+    double mag = fabs(val);
+    if (precision >= 0 && precision <= 9 &&
+            (mag == 0 || (mag >= 0x1p-12 && mag < 0x1p53))) {
+        uint64_t int_part = (uint64_t)mag;
+        uint64_t frac = (uint64_t)ldexp(mag - (double)int_part, 64);
+
+        // Scale the fraction by 10^precision
+        unsigned __int128 scaled = (unsigned __int128)frac * POW10[precision];
+        uint64_t digits = (uint64_t)(scaled >> 64);
+        uint64_t rem = (uint64_t)scaled;
+
+        // Round to nearest, ties to even
+        const uint64_t half = 1ULL << 63;
+        uint64_t last = (precision) ? digits : int_part;
+        if (rem > half || (rem == half && (last & 1))) {
+            digits++;
+            if (digits == POW10[precision]) {
+                digits = 0;
+                int_part++;
+            }
+        }
+
+        // Build the output backwards
+        char scratch[48];
+        char *end = scratch + sizeof(scratch);
+        char *start = end;
+        if (precision) {
+            for (int i=0; i < precision; i++) {
+                *--start = '0' + (digits % 10);
+                digits /= 10;
+            }
+            *--start = '.';
+        }
+        start = format_uint_rev(start, int_part);
+        if (signbit(val)) *--start = '-';
+
+        int len = end - start;
+        memcpy(buf, start, len);
+        buf[len] = '\0';
+        return len;
+    }
+#endif
+    return snprintf(buf, FORMAT_DOUBLE_MAX, "%.*f", precision, val);
+}
+
+/**
+ * Formats the name a timer quantile is reported under. The
+ * median is "median", and others are "upper_" and the percentile
+ * without trailing zeros, like "upper_99" or "upper_99.9".
+ * @arg buf The output buffer, at least FORMAT_QUANTILE_MAX bytes
+ * @arg quantile The quantile, on (0, 1)
+ * @return The number of characters written, not including
+ * the NULL terminator.
+ */
+int format_quantile_name(char *buf, double quantile) {
+    if (quantile == 0.5) {
+        memcpy(buf, "median", 7);
+        return 6;
+    }
+    memcpy(buf, "upper_", 6);
+    char pct[FORMAT_DOUBLE_MAX];
+    int len = format_double(pct, quantile * 100, 6);
+    while (pct[len-1] == '0') len--;
+    if (pct[len-1] == '.') len--;
+    if (len > FORMAT_QUANTILE_MAX - 7) len = FORMAT_QUANTILE_MAX - 7;
+    memcpy(buf + 6, pct, len);
+    buf[6 + len] = 0;
+    return 6 + len;
+}
+
+// Powers of ten that are exact as doubles
+static const double EXACT_POW10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Most significant digits that always fit in a uint64_t
+#define PARSE_MAX_DIGITS 19
+
+// Largest integer where every smaller one is an exact double
+#define PARSE_MAX_EXACT (1ULL << 53)
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/**
+ * Checks if 8 bytes, loaded little endian, are all digits
+ */
+static inline int is_eight_digits(uint64_t val) {
+    return (((val & 0xF0F0F0F0F0F0F0F0ULL) |
+             (((val + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4))
+            == 0x3333333333333333ULL);
+}
+
+/**
+ * Converts 8 digits, loaded little endian, to their value
+ * using a few multiplies instead of a loop.
+ */
+static inline uint32_t parse_eight_digits(uint64_t val) {
+    const uint64_t mask = 0x000000FF000000FFULL;
+    const uint64_t mul1 = 100 + (1000000ULL << 32);
+    const uint64_t mul2 = 1 + (10000ULL << 32);
+    val -= 0x3030303030303030ULL;
+    val = (val * 10) + (val >> 8);
+    val = (((val & mask) * mul1) + (((val >> 16) & mask) * mul2)) >> 32;
+    return val;
+}
+#define PARSE_SWAR 1
+#endif
+
+/**
+ * Accumulates a run of digits into the mantissa. Once it is full,
+ * the remaining digits are only counted and noted if non-zero.
+ * @return The position after the digits.
+ */
+static inline const char* parse_digits(const char *p, const char *limit,
+        uint64_t *mant, int *digits, int *dropped, int *truncated) {
+#ifdef PARSE_SWAR
+    uint64_t block;
+    while (limit && p + 8 <= limit && *digits + 8 <= PARSE_MAX_DIGITS) {
+        memcpy(&block, p, sizeof(block));
+        if (!is_eight_digits(block)) break;
+        *mant = *mant * 100000000 + parse_eight_digits(block);
+        if (*mant) *digits += 8;
+        p += 8;
+    }
+#endif
+    for (; *p >= '0' && *p <= '9'; p++) {
+        if (*digits < PARSE_MAX_DIGITS) {
+            *mant = *mant * 10 + (*p - '0');
+            if (*mant) *digits += 1;
+        } else {
+            *dropped += 1;
+            if (*p != '0') *truncated = 1;
+        }
+    }
+    return p;
+}
+
+/**
+ * Parses a decimal number, with an optional minus sign, fraction
+ * and exponent. The result is correctly rounded, identical to strtod
+ * for the same digits. Common values are computed exactly without
+ * calling into libc.
+ * @arg s The string to parse. Must be null terminated.
+ * @arg limit The end of the memory that can be read from s, which
+ * allows reading digits in blocks. NULL if unknown.
+ * @arg end Output. Set to the first character not parsed, which is
+ * s if there are no digits.
+ * @return The parsed value.
+ */
+double parse_double(const char *s, const char *limit, char **end) {
+    const char *p = s, *start;
+    int neg = 0, digits = 0, dropped = 0, truncated = 0, exp10, num_digits;
+    uint64_t mant = 0;
+    if (*p == '-') {
+        neg = 1;
+        p++;
+    }
+
+    // Integer digits, where dropped digits scale the value up
+    start = p;
+    p = parse_digits(p, limit, &mant, &digits, &dropped, &truncated);
+    num_digits = p - start;
+    exp10 = dropped;
+
+    // Fraction digits, where each kept digit scales the value down
+    if (*p == '.') {
+        start = ++p;
+        dropped = 0;
+        p = parse_digits(p, limit, &mant, &digits, &dropped, &truncated);
+        num_digits += p - start;
+        exp10 -= (p - start) - dropped;
+    }
+    if (!num_digits) {
+        if (end) *end = (char*)s;
+        return 0;
+    }
+
+    // Optional exponent, only consumed if it has digits
+    if (*p == 'e' || *p == 'E') {
+        const char *e = p + 1;
+        int exp_neg = 0, exp_val = 0;
+        if (*e == '-' || *e == '+') exp_neg = (*e++ == '-');
+        if (*e >= '0' && *e <= '9') {
+            for (; *e >= '0' && *e <= '9'; e++) {
+                if (exp_val < 100000) exp_val = exp_val * 10 + (*e - '0');
+            }
+            exp10 += exp_neg ? -exp_val : exp_val;
+            p = e;
+        }
+    }
+    if (end) *end = (char*)p;
+
+    /*
+     * If the mantissa and power of ten are both exact doubles,
+     * a single multiply or divide is correctly rounded. Otherwise
+     * use the slower path in libc, which already knows these are
+     * valid digits.
+     */
+    double val;
+    if (!mant) {
+        val = 0;
+    } else if (!truncated && mant <= PARSE_MAX_EXACT && exp10 >= -22 && exp10 <= 22) {
+        val = (double)mant;
+        val = (exp10 < 0) ? val / EXACT_POW10[-exp10] : val * EXACT_POW10[exp10];
+    } else {
+        return strtod(s, NULL);
+    }
+    return neg ? -val : val;
+}
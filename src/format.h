@@ -0,0 +1,65 @@
+/**
+ * Fast number formatting for the output paths. These produce
+ * exactly the same text as the equivalent printf conversions,
+ * but avoid parsing a format string and the general purpose
+ * double conversion on every call. The input path uses the
+ * matching decimal parser.
+ */
+#ifndef FORMAT_H
+#define FORMAT_H
+#include <stdint.h>
+
+// Large enough for any double formatted with "%f"
+#define FORMAT_DOUBLE_MAX 330
+
+// Large enough for any 64bit integer
+#define FORMAT_INT_MAX 21
+
+/**
+ * Formats a double, identical to printf("%.*f", precision, val).
+ * @arg buf The output buffer, at least FORMAT_DOUBLE_MAX bytes
+ * @arg val The value to format
+ * @arg precision The number of decimal places, between 0 and 9
+ * @return The number of characters written, not including
+ * the NULL terminator.
+ */
+int format_double(char *buf, double val, int precision);
+
+/**
+ * Formats a signed integer, identical to printf("%lld", val).
+ * @arg buf The output buffer, at least FORMAT_INT_MAX bytes
+ * @arg val The value to format
+ * @return The number of characters written, not including
+ * the NULL terminator.
+ */
+int format_int(char *buf, long long val);
+
+// Large enough for any quantile name
+#define FORMAT_QUANTILE_MAX 32
+
+/**
+ * Formats the name a timer quantile is reported under. The
+ * median is "median", and others are "upper_" and the percentile
+ * without trailing zeros, like "upper_99" or "upper_99.9".
+ * @arg buf The output buffer, at least FORMAT_QUANTILE_MAX bytes
+ * @arg quantile The quantile, on (0, 1)
+ * @return The number of characters written, not including
+ * the NULL terminator.
+ */
+int format_quantile_name(char *buf, double quantile);
+
+/**
+ * Parses a decimal number, with an optional minus sign, fraction
+ * and exponent. The result is correctly rounded, identical to strtod
+ * for the same digits. Common values are computed exactly without
+ * calling into libc.
+ * @arg s The string to parse. Must be null terminated.
+ * @arg limit The end of the memory that can be read from s, which
+ * allows reading digits in blocks. NULL if unknown.
+ * @arg end Output. Set to the first character not parsed, which is
+ * s if there are no digits.
+ * @return The parsed value.
+ */
+double parse_double(const char *s, const char *limit, char **end);
+
+#endif
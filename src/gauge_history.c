@@ -0,0 +1,125 @@
+/**
+ * This file implements the gauge history declared in gauge_history.h
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "gauge_history.h"
+
+// The state of filtering one interval
+struct filter_info {
+    gauge_history *h;
+    int full;       // Set if all of the gauges are kept
+    int error;      // Set if the history could not grow
+};
+
+/**
+ * Initializes a gauge history
+ * @arg refresh The number of intervals between the flushes
+ * that stream all of the gauges, at least 1
+ * @arg h The history to initialize
+ * @return 0 on success.
+ */
+int gauge_history_init(uint32_t refresh, gauge_history *h) {
+    if (!refresh) return -1;
+    h->epoch = 0;
+    h->refresh = refresh;
+    if (arena_init(0, &h->keys)) return -1;
+    if (gauge_history_map_init(&h->keys, &h->map)) {
+        arena_destroy(&h->keys);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Destroys a gauge history, releasing all the names
+ * @return 0 on success.
+ */
+int gauge_history_destroy(gauge_history *h) {
+    gauge_history_map_destroy(&h->map);
+    return arena_destroy(&h->keys);
+}
+
+/**
+ * Copies the gauges seen since the last refresh into new storage,
+ * releasing the names of the rest.
+ * @return 0 on success, the history is unchanged on error.
+ */
+static int sweep(gauge_history *h) {
+    arena keys;
+    gauge_history_map map;
+    if (arena_init(0, &keys)) return -1;
+    if (gauge_history_map_init(&keys, &map)) {
+        arena_destroy(&keys);
+        return -1;
+    }
+
+    uint32_t oldest = (h->epoch > h->refresh) ? h->epoch - h->refresh : 0;
+    int res = 0;
+    for (uint32_t i=0; i <= h->map.mask && !res; i++) {
+        gauge_history_map_entry *e = h->map.table + i;
+        if (!e->key || e->value.last_seen < oldest) continue;
+        gauge_history_value *v;
+        if (gauge_history_map_get_or_insert_hash(&map, e->key, e->hash, &v) < 0) {
+            res = -1;
+            break;
+        }
+        *v = e->value;
+    }
+    if (res) {
+        gauge_history_map_destroy(&map);
+        arena_destroy(&keys);
+        return res;
+    }
+
+    // The map refers to the arena, so move it in place
+    gauge_history_map_destroy(&h->map);
+    arena_destroy(&h->keys);
+    h->keys = keys;
+    h->map = map;
+    h->map.keys = &h->keys;
+    return 0;
+}
+
+// Records the value of a gauge, and keeps it if it changed
+static int keep_gauge(void *data, const char *key, uint64_t hash, gauge_t *g) {
+    struct filter_info *info = data;
+    gauge_history_value *v;
+    int res = gauge_history_map_get_or_insert_hash(&info->h->map, key, hash, &v);
+    if (res < 0) {
+        info->error = 1;
+        return 1;
+    }
+    v->last_seen = info->h->epoch;
+    if (!res && !info->full && v->value == g->value) return 0;
+    v->value = g->value;
+    return 1;
+}
+
+/**
+ * Removes the gauges of an interval that have the value they were
+ * last streamed with, unless the interval is a full refresh, and
+ * records the values of the rest. Starts the next interval.
+ * @arg m The merged metrics of the interval to be streamed
+ * @return The number of gauges removed, or -1 on error, in
+ * which case all of the gauges are kept.
+ */
+int gauge_history_filter(gauge_history *h, metrics *m) {
+    struct filter_info info = {h, (h->epoch % h->refresh) == 0, 0};
+    if (info.full) sweep(h);
+
+    // Grow the history once, to fit the gauges of the interval
+    int before = gauge_map_size(&m->gauges);
+    gauge_history_map_reserve(&h->map, before);
+    int res = gauge_map_retain(&m->gauges, keep_gauge, &info);
+    h->epoch++;
+    if (res) return -1;
+    return before - gauge_map_size(&m->gauges);
+}
+
+/**
+ * Returns the number of gauges in the history
+ */
+uint32_t gauge_history_size(gauge_history *h) {
+    return gauge_history_map_size(&h->map);
+}
@@ -0,0 +1,64 @@
+/**
+ * This module keeps the last value streamed for each gauge
+ * across flush intervals, so that only the gauges that changed
+ * are streamed. Most gauges hold their value for long stretches,
+ * and a sink only needs the changes to keep the latest values.
+ *
+ * Every refresh intervals all of the gauges are streamed, so a
+ * sink that restarts or missed a flush catches up. The refresh
+ * also releases the gauges that were not seen since the last one,
+ * by copying the rest into new storage.
+ * A gauge history is not thread safe.
+ */
+#ifndef GAUGE_HISTORY_H
+#define GAUGE_HISTORY_H
+#include <stdint.h>
+#include "arena.h"
+#include "inline_map.h"
+#include "metrics.h"
+
+typedef struct {
+    double value;       // The last value streamed
+    uint32_t last_seen; // The last interval the gauge was flushed in
+} gauge_history_value;
+
+INLINE_MAP_DEFINE(gauge_history_map, gauge_history_value)
+
+typedef struct {
+    gauge_history_map map;
+    arena keys;         // Owns the names
+    uint32_t epoch;     // The current interval
+    uint32_t refresh;   // Intervals between full refreshes
+} gauge_history;
+
+/**
+ * Initializes a gauge history
+ * @arg refresh The number of intervals between the flushes
+ * that stream all of the gauges, at least 1
+ * @arg h The history to initialize
+ * @return 0 on success.
+ */
+int gauge_history_init(uint32_t refresh, gauge_history *h);
+
+/**
+ * Destroys a gauge history, releasing all the names
+ * @return 0 on success.
+ */
+int gauge_history_destroy(gauge_history *h);
+
+/**
+ * Removes the gauges of an interval that have the value they were
+ * last streamed with, unless the interval is a full refresh, and
+ * records the values of the rest. Starts the next interval.
+ * @arg m The merged metrics of the interval to be streamed
+ * @return The number of gauges removed, or -1 on error, in
+ * which case all of the gauges are kept.
+ */
+int gauge_history_filter(gauge_history *h, metrics *m);
+
+/**
+ * Returns the number of gauges in the history
+ */
+uint32_t gauge_history_size(gauge_history *h);
+
+#endif
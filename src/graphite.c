@@ -0,0 +1,287 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "format.h"
+#include "graphite.h"
+#include "name_map.h"
+
+// Default timeout for connecting and sending
+#define GRAPHITE_TIMEOUT_MS 1000
+
+// Initial size of the output buffer
+#define GRAPHITE_INIT_BUFFER 65536
+
+// Struct to hold the callback info
+struct graphite_info {
+    graphite_output *g;
+    long long ts;
+};
+
+/**
+ * Initializes a Graphite output. The connection
+ * is made lazily on the first flush.
+ * @arg host The Carbon host, this is copied
+ * @arg port The Carbon plaintext port
+ * @arg prefix A prefix added to every key, this is copied
+ * @arg max_buffer The maximum number of unsent bytes to retain
+ * when Carbon is unavailable. Older data is dropped first.
+ * @arg g The output to initialize
+ * @return 0 on success.
+ */
+int init_graphite_output(char *host, int port, char *prefix, size_t max_buffer, graphite_output *g) {
+    g->host = strdup(host);
+    g->port = port;
+    g->prefix = strdup((prefix) ? prefix : "");
+    g->fd = -1;
+    g->buf_len = 0;
+    g->buf_size = GRAPHITE_INIT_BUFFER;
+    g->buf = malloc(g->buf_size);
+    g->max_buffer = max_buffer;
+    g->timeout_ms = GRAPHITE_TIMEOUT_MS;
+    return pthread_mutex_init(&g->lock, NULL);
+}
+
+/**
+ * Closes the connection and frees the output.
+ * Unsent data is discarded.
+ * @return 0 on success.
+ */
+int destroy_graphite_output(graphite_output *g) {
+    if (g->fd >= 0) close(g->fd);
+    g->fd = -1;
+    free(g->host);
+    free(g->prefix);
+    free(g->buf);
+    pthread_mutex_destroy(&g->lock);
+    return 0;
+}
+
+/**
+ * Appends a formatted line to the output buffer
+ * @return 0 on success.
+ */
+static int graphite_append(graphite_output *g, const char *fmt, ...) {
+    va_list args;
+    int len;
+    while (1) {
+        va_start(args, fmt);
+        len = vsnprintf(g->buf + g->buf_len, g->buf_size - g->buf_len, fmt, args);
+        va_end(args);
+        if (len < 0) return 1;
+
+        // Check if it fit, otherwise grow and retry
+        if (g->buf_len + len < g->buf_size) break;
+        g->buf_size = (g->buf_size * 2 > g->buf_len + len + 1) ? g->buf_size * 2 : g->buf_len + len + 1;
+        g->buf = realloc(g->buf, g->buf_size);
+    }
+    g->buf_len += len;
+    return 0;
+}
+
+/**
+ * Callback to format each metric in the plaintext protocol
+ */
+static int graphite_cb(void *data, metric_type type, char *name, void *value) {
+    #define GRAPHITE(fmt, ...) if (graphite_append(g, "%s" fmt " %lld\n", g->prefix, __VA_ARGS__, info->ts)) return 1;
+    struct graphite_info *info = data;
+    graphite_output *g = info->g;
+    double quants[MAX_QUANTILES];
+    char qname[FORMAT_QUANTILE_MAX];
+    timer_hist *t;
+    int i;
+    name = output_name(name);
+    switch (type) {
+        case KEY_VAL:
+            GRAPHITE("%s %f", name, *(double*)value);
+            break;
+
+        case GAUGE:
+            GRAPHITE("%s %f", name, ((gauge_t*)value)->value);
+            break;
+
+        case COUNTER:
+            GRAPHITE("%s %f", name, counter_sum(value));
+            break;
+
+        case COUNTER_SUM:
+            GRAPHITE("%s %f", name, *(double*)value);
+            break;
+
+        case SET:
+            GRAPHITE("%s %lld", name, (long long)set_size(value));
+            break;
+
+        case TIMER:
+            t = (timer_hist*)value;
+            GRAPHITE("timers.%s.sum %f", name, timer_sum(&t->tm));
+            GRAPHITE("timers.%s.sum_sq %f", name, timer_squared_sum(&t->tm));
+            GRAPHITE("timers.%s.mean %f", name, timer_mean(&t->tm));
+            GRAPHITE("timers.%s.lower %f", name, timer_min(&t->tm));
+            GRAPHITE("timers.%s.upper %f", name, timer_max(&t->tm));
+            GRAPHITE("timers.%s.count %lld", name, (long long)timer_count(&t->tm));
+            GRAPHITE("timers.%s.stdev %f", name, timer_stddev(&t->tm));
+            timer_query_many(&t->tm, t->quantiles, t->num_quants, quants);
+            for (i=0; i < t->num_quants; i++) {
+                format_quantile_name(qname, t->quantiles[i]);
+                GRAPHITE("timers.%s.%s %f", name, qname, quants[i]);
+            }
+
+            // Send the histogram values, the automatic bins need more places
+            int num_bins = timer_hist_num_bins(t);
+            int places = (t->conf && t->conf->scale == HISTOGRAM_AUTO) ? 6 : 2;
+            for (i=0; i < num_bins; i++) {
+                uint64_t count = timer_hist_count(t, i);
+                if (t->conf->skip_empty && !count) continue;
+                const char *bound = (i == 0) ? "<" : (i == num_bins - 1) ? ">" : "";
+                GRAPHITE("%s.histogram.bin_%s%0.*f %llu", name, bound, places, timer_hist_bin_start(t, i),
+                        (unsigned long long)count);
+            }
+            break;
+
+        default:
+            syslog(LOG_ERR, "Unknown metric type: %d", type);
+            break;
+    }
+    return 0;
+}
+
+/**
+ * Waits for the connection to become writable
+ * @return 1 if writable, 0 on timeout or error.
+ */
+static int graphite_wait(graphite_output *g) {
+    struct pollfd pfd = {g->fd, POLLOUT, 0};
+    int res;
+    do {
+        res = poll(&pfd, 1, g->timeout_ms);
+    } while (res < 0 && errno == EINTR);
+    return res > 0 && !(pfd.revents & (POLLERR | POLLHUP | POLLNVAL));
+}
+
+/**
+ * Closes the connection, it is re-opened on the next flush
+ */
+static void graphite_disconnect(graphite_output *g) {
+    if (g->fd >= 0) close(g->fd);
+    g->fd = -1;
+}
+
+/**
+ * Makes a non-blocking connection to Carbon
+ * @return 0 on success.
+ */
+static int graphite_connect(graphite_output *g) {
+    struct addrinfo hints, *addrs, *addr;
+    char port[8];
+    snprintf(port, sizeof(port), "%d", g->port);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int res = getaddrinfo(g->host, port, &hints, &addrs);
+    if (res) {
+        syslog(LOG_ERR, "Failed to resolve Graphite host %s: %s", g->host, gai_strerror(res));
+        return -1;
+    }
+
+    // Try each address in turn
+    for (addr = addrs; addr; addr = addr->ai_next) {
+        g->fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (g->fd < 0) continue;
+        fcntl(g->fd, F_SETFL, fcntl(g->fd, F_GETFL, 0) | O_NONBLOCK);
+
+        // Wait for the connect to finish
+        if (connect(g->fd, addr->ai_addr, addr->ai_addrlen) == 0 ||
+                (errno == EINPROGRESS && graphite_wait(g))) {
+            int err = 0;
+            socklen_t err_len = sizeof(err);
+            getsockopt(g->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+            if (!err) break;
+        }
+        graphite_disconnect(g);
+    }
+    freeaddrinfo(addrs);
+
+    if (g->fd < 0) {
+        syslog(LOG_ERR, "Failed to connect to Graphite at %s:%d", g->host, g->port);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Drops the oldest data if the buffer is over the limit,
+ * keeping whole lines.
+ */
+static void graphite_trim(graphite_output *g) {
+    if (g->buf_len <= g->max_buffer) return;
+    char *start = g->buf + (g->buf_len - g->max_buffer);
+    char *line = memchr(start, '\n', g->buf + g->buf_len - start);
+    size_t drop = (line) ? (size_t)(line + 1 - g->buf) : g->buf_len;
+    syslog(LOG_WARNING, "Graphite retry buffer full, dropped %zu bytes", drop);
+    memmove(g->buf, g->buf + drop, g->buf_len - drop);
+    g->buf_len -= drop;
+}
+
+/**
+ * Formats and sends the metrics to Graphite, along
+ * with any data retained from previous flushes.
+ * @arg g The output to use
+ * @arg m The metrics to send
+ * @arg tv The timestamp for the metrics
+ * @return 0 on success, -1 if some data could not be sent.
+ */
+int graphite_flush(graphite_output *g, metrics *m, struct timeval *tv) {
+    pthread_mutex_lock(&g->lock);
+
+    // Format after any retained data
+    struct graphite_info info = {g, (long long)tv->tv_sec};
+    metrics_iter(m, &info, graphite_cb);
+
+    // Send as much as we can
+    size_t sent = 0;
+    ssize_t res;
+    if (g->fd >= 0 || !graphite_connect(g)) {
+        while (sent < g->buf_len) {
+            res = send(g->fd, g->buf + sent, g->buf_len - sent, MSG_NOSIGNAL);
+            if (res > 0) {
+                sent += res;
+            } else if (res < 0 && errno == EINTR) {
+                continue;
+            } else if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && graphite_wait(g)) {
+                continue;
+            } else {
+                syslog(LOG_ERR, "Failed to send to Graphite: %s", strerror(errno));
+                graphite_disconnect(g);
+                break;
+            }
+        }
+    }
+
+    // Retain anything that was not sent, but
+    // avoid splitting a partially sent line
+    int ret = 0;
+    if (sent < g->buf_len) {
+        if (g->fd < 0) {
+            while (sent > 0 && g->buf[sent-1] != '\n') sent--;
+        }
+        memmove(g->buf, g->buf + sent, g->buf_len - sent);
+        g->buf_len -= sent;
+        graphite_trim(g);
+        ret = -1;
+    } else {
+        g->buf_len = 0;
+    }
+
+    pthread_mutex_unlock(&g->lock);
+    return ret;
+}
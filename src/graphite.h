@@ -0,0 +1,56 @@
+/**
+ * This module implements a native Graphite output, writing the
+ * Carbon plaintext protocol directly to a TCP connection. Data
+ * that could not be sent is kept in a bounded retry buffer and
+ * sent ahead of the next flush.
+ */
+#ifndef GRAPHITE_H
+#define GRAPHITE_H
+#include <pthread.h>
+#include <sys/time.h>
+#include "metrics.h"
+
+typedef struct {
+    char *host;         // Carbon host
+    int port;           // Carbon plaintext port
+    char *prefix;       // Prefix for all keys
+    int fd;             // Connection, -1 if not connected
+    char *buf;          // Unsent data, followed by the current flush
+    size_t buf_len;     // Bytes of data in the buffer
+    size_t buf_size;    // Allocated size of the buffer
+    size_t max_buffer;  // Maximum bytes kept between flushes
+    int timeout_ms;     // Timeout for connecting and sending
+    pthread_mutex_t lock; // Serializes overlapping flushes
+} graphite_output;
+
+/**
+ * Initializes a Graphite output. The connection
+ * is made lazily on the first flush.
+ * @arg host The Carbon host, this is copied
+ * @arg port The Carbon plaintext port
+ * @arg prefix A prefix added to every key, this is copied
+ * @arg max_buffer The maximum number of unsent bytes to retain
+ * when Carbon is unavailable. Older data is dropped first.
+ * @arg g The output to initialize
+ * @return 0 on success.
+ */
+int init_graphite_output(char *host, int port, char *prefix, size_t max_buffer, graphite_output *g);
+
+/**
+ * Formats and sends the metrics to Graphite, along
+ * with any data retained from previous flushes.
+ * @arg g The output to use
+ * @arg m The metrics to send
+ * @arg tv The timestamp for the metrics
+ * @return 0 on success, -1 if some data could not be sent.
+ */
+int graphite_flush(graphite_output *g, metrics *m, struct timeval *tv);
+
+/**
+ * Closes the connection and frees the output.
+ * Unsent data is discarded.
+ * @return 0 on success.
+ */
+int destroy_graphite_output(graphite_output *g);
+
+#endif
@@ -0,0 +1,93 @@
+/**
+ * Implements the shared 64bit hash function. Previously every
+ * caller used the 128bit x64 MurmurHash3 and discarded half of it.
+ * MurmurHash64A produces 64 bits directly in roughly half the work
+ * for short keys such as metric names.
+ */
+#include <string.h>
+#include "hash.h"
+
+#if defined(HASH_MURMUR3)
+
+// Link the external murmur hash in
+extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
+
+uint64_t hash_key(const void *key, size_t len) {
+    uint64_t out[2];
+    MurmurHash3_x64_128(key, len, 0, &out);
+    return out[1];
+}
+
+#elif defined(HASH_FNV)
+
+uint64_t hash_key(const void *key, size_t len) {
+    const unsigned char *data = key;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i=0; i < len; i++) {
+        h ^= data[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    // FNV-1a mixes poorly into the high bits, which the HLLs use,
+    // so finish with the MurmurHash3 finalizer
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9a64f2f1e1bULL;
+    h ^= h >> 33;
+    return h;
+}
+
+#else
+
+/**
+ * MurmurHash64A by Austin Appleby, placed in the public domain.
+ */
+uint64_t hash_key(const void *key, size_t len) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = len * m;
+
+    const unsigned char *data = key;
+    const unsigned char *end = data + (len & ~(size_t)7);
+    uint64_t k;
+    while (data != end) {
+        memcpy(&k, data, sizeof(k));
+        data += sizeof(k);
+
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+    }
+
+    // Mix in the remaining bytes
+    switch (len & 7) {
+        case 7: h ^= (uint64_t)data[6] << 48; /* fall through */
+        case 6: h ^= (uint64_t)data[5] << 40; /* fall through */
+        case 5: h ^= (uint64_t)data[4] << 32; /* fall through */
+        case 4: h ^= (uint64_t)data[3] << 24; /* fall through */
+        case 3: h ^= (uint64_t)data[2] << 16; /* fall through */
+        case 2: h ^= (uint64_t)data[1] << 8;  /* fall through */
+        case 1: h ^= (uint64_t)data[0];
+                h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+
+    // Keys that differ in their last bytes only go through a single
+    // multiply above, which leaves the HLL index and rank correlated,
+    // so finish with the MurmurHash3 finalizer
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9a64f2f1e1bULL;
+    h ^= h >> 33;
+    return h;
+}
+
+#endif
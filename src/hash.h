@@ -0,0 +1,24 @@
+/**
+ * This module provides the 64bit hash function shared by the
+ * hashmaps, sets and HyperLogLogs. The function is chosen at
+ * build time, so that alternatives can be benchmarked:
+ *
+ *  - `scons hash=murmur64` MurmurHash64A with the MurmurHash3
+ *    finalizer, the default
+ *  - `scons hash=murmur3` MurmurHash3 x64 128bit, using the upper half
+ *  - `scons hash=fnv` FNV-1a, with a final avalanche step
+ */
+#ifndef HASH_H
+#define HASH_H
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Computes the 64bit hash of a key
+ * @arg key The key to hash
+ * @arg len The length of the key in bytes
+ * @return The hash value
+ */
+uint64_t hash_key(const void *key, size_t len);
+
+#endif
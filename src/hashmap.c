@@ -1,27 +1,79 @@
+/**
+ * Chained implementation of the hashmap API, and the default.
+ * The entries are kept without gaps in blocks that double in size,
+ * in the order they were added, and the buckets of the table only
+ * hold the position of the first entry of their chain. Iterating
+ * is then a linear scan of the entries, however sparse the table,
+ * and growing the table only re-links the chains.
+ */
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include "hashmap.h"
+#include "page_alloc.h"
+#include "hash.h"
+#include "stats.h"
+#include "probes.h"
+#include "name_map.h"
 
 #define MAX_CAPACITY 0.75
 #define DEFAULT_CAPACITY 128
 
+// Buckets of the old table moved with each insert while resizing.
+// At least 4/3 per insert are needed to finish before the next resize.
+#define MIGRATE_BUCKETS 4
+
+// The first block holds 2^BLOCK_BITS entries, and each one after
+// it twice as many as the last, so up to 2^32 entries fit
+#define BLOCK_BITS 6
+#define MAX_BLOCKS (32 - BLOCK_BITS)
+#define BLOCK_SIZE(block) ((uint32_t)1 << (BLOCK_BITS + (block)))
+#define BLOCK_START(block) ((((uint32_t)1 << (block)) - 1) << BLOCK_BITS)
+
 // Basic hash entry.
-typedef struct hashmap_entry {
+typedef struct {
     char *key;
     void *value;
-    struct hashmap_entry *next; // Support linking.
+    uint64_t hash;              // Hash of the key, avoids re-hashing on resize
+    uint32_t next;              // Position + 1 of the next entry of the chain, 0 at the end
 } hashmap_entry;
 
 struct hashmap {
     int count;      // Number of entries
-    int table_size; // Size of table in nodes
+    int table_size; // Size of table in buckets
     int max_size;   // Max size before we resize
-    hashmap_entry *table; // Pointer to an arry of hashmap_entry objects
+    uint32_t *table; // Position + 1 of the first entry of each bucket, 0 if empty
+    hashmap_entry *blocks[MAX_BLOCKS]; // The entries, in the order they were added
+    arena *keys;    // Optional arena owning the keys
+    intern_table *names; // Optional table of the stable keys
+    uint32_t *old_table; // The table being moved from while resizing, or NULL
+    int old_size;   // Size of the old table in buckets
+    int migrated;   // Buckets of the old table already moved
 };
 
-// Link the external murmur hash in
-extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
+/**
+ * Returns the entry at a position
+ */
+static inline hashmap_entry* entry_at(hashmap *map, uint32_t pos) {
+    int block = 31 - __builtin_clz((pos >> BLOCK_BITS) + 1);
+    return map->blocks[block] + (pos - BLOCK_START(block));
+}
+
+/**
+ * Copies a key, taking the interned copy or using
+ * the arena if we have one
+ */
+static inline char* hashmap_dup_key(hashmap *map, char *key, uint64_t hash) {
+    if (map->names) {
+        char *name = intern_key(map->names, key, hash);
+        if (name) return name;
+    }
+    if (map->keys) return name_arena_copy(map->keys, key);
+    size_t len = strlen(key);
+    char *copy = malloc(name_copy_size(len));
+    if (copy) name_copy(copy, key, len);
+    return copy;
+}
 
 /**
  * Creates a new hashmap and allocates space for it.
@@ -30,6 +82,19 @@ extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t
  * @return 0 on success.
  */
 int hashmap_init(int initial_size, hashmap **map) {
+    return hashmap_init_arena(initial_size, NULL, map);
+}
+
+/**
+ * Creates a new hashmap whose keys are copied into an arena.
+ * Keys are then never freed by the hashmap, and are released
+ * when the arena is reset or destroyed.
+ * @arg initial_size The minimim initial size. 0 for default (64).
+ * @arg keys The arena to copy keys into. Must outlive the map.
+ * @arg map Output. Set to the address of the map
+ * @return 0 on success.
+ */
+int hashmap_init_arena(int initial_size, arena *keys, hashmap **map) {
     // Default to 64 if no size
     if (initial_size <= 0) {
        initial_size = DEFAULT_CAPACITY;
@@ -53,45 +118,44 @@ int hashmap_init(int initial_size, hashmap **map) {
     hashmap *m = calloc(1, sizeof(hashmap));
     m->table_size = initial_size;
     m->max_size = MAX_CAPACITY * initial_size;
+    m->keys = keys;
 
-    // Allocate the table
-    m->table = (hashmap_entry*)calloc(initial_size, sizeof(hashmap_entry));
+    // Allocate the table, the entries are allocated as they are added
+    m->table = (uint32_t*)page_calloc(initial_size * sizeof(uint32_t));
+    stats_mem_add(MEM_MAPS, sizeof(hashmap) + initial_size * sizeof(uint32_t));
 
     // Return the table
     *map = m;
     return 0;
 }
 
+/**
+ * Makes a hashmap take the new keys from an intern table, so
+ * the names that are stable across intervals are not copied again
+ * for each one. Only for maps that were created with an arena.
+ * @arg map The hashmap, which must be empty
+ * @arg names The intern table, which must outlive the map. The
+ * map must be cleared before the table is advanced.
+ */
+void hashmap_set_interned(hashmap *map, intern_table *names) {
+    map->names = (map->keys) ? names : NULL;
+}
+
 /**
  * Destroys a map and cleans up all associated memory
  * @arg map The hashmap to destroy. Frees memory.
  */
 int hashmap_destroy(hashmap *map) {
-    // Free each entry
-    hashmap_entry *entry, *old;
-    int in_table;
-    for (int i=0; i < map->table_size; i++) {
-        entry = map->table+i;
-        in_table = 1;
-        while (entry && entry->key) {
-            // Walk the next links
-            old = entry;
-            entry = entry->next;
-
-            // Clear the objects
-            free(old->key);
-
-            // The initial entry is in the table
-            // and we should not free that one.
-            if (!in_table) {
-                free(old);
-            }
-            in_table = 0;
-        }
-    }
+    // Free each key, and the old table if resizing
+    hashmap_clear(map);
 
-    // Free the table and hash map
-    free(map->table);
+    // Free the blocks of entries, the table and hash map
+    for (int i=0; i < MAX_BLOCKS && map->blocks[i]; i++) {
+        page_free(map->blocks[i], BLOCK_SIZE(i) * sizeof(hashmap_entry));
+        stats_mem_add(MEM_MAPS, -(int64_t)(BLOCK_SIZE(i) * sizeof(hashmap_entry)));
+    }
+    page_free(map->table, map->table_size * sizeof(uint32_t));
+    stats_mem_add(MEM_MAPS, -(int64_t)(sizeof(hashmap) + map->table_size * sizeof(uint32_t)));
     free(map);
     return 0;
 }
@@ -111,248 +175,336 @@ int hashmap_size(hashmap *map) {
  * 0 on success. -1 if not found.
  */
 int hashmap_get(hashmap *map, char *key, void **value) {
-    // Compute the hash value of the key
-    uint64_t out[2];
-    MurmurHash3_x64_128(key, strlen(key), 0, &out);
-
-    // Mod the lower 64bits of the hash function with the table
-    // size to get the index
-    unsigned int index = out[1] % map->table_size;
-
-    // Look for an entry
-    hashmap_entry *entry = map->table+index;
-
-    // Scan the keys
-    while (entry && entry->key) {
-        // Found it
-        if (strcmp(entry->key, key) == 0) {
-            *value = entry->value;
-            return 0;
-        }
-
-        // Walk the chain
-        entry = entry->next;
-    }
+    return hashmap_get_hash(map, key, hash_key(key, strlen(key)), value);
+}
 
-    // Not found
-    return -1;
+/**
+ * Starts loading the bucket a hash belongs in, so a
+ * later lookup of the key does not wait on memory.
+ * @arg hash The hash of the key, from hash_key
+ */
+void hashmap_prefetch(hashmap *map, uint64_t hash) {
+    __builtin_prefetch(map->table + (hash % map->table_size));
+    if (map->old_table && (int)(hash % map->old_size) >= map->migrated)
+        __builtin_prefetch(map->old_table + (hash % map->old_size));
 }
 
 /**
- * Internal method to insert into a hash table
- * @arg table The table to insert into
- * @arg table_size The size of the table
- * @arg key The key to insert
- * @arg key_len The length of the key
- * @arg value The value to associate
- * @arg should_cmp Should keys be compared to existing ones.
- * @arg should_dup Should duplicate keys
- * @return 1 if the key is new, 0 if updated.
+ * Internal method to find the link to the entry of a key in a
+ * table, which is either its bucket or the entry before it
+ * @return The link, or NULL if not found.
  */
-static int hashmap_insert_table(hashmap_entry *table, int table_size, char *key, int key_len,
-                                void *value, int should_cmp, int should_dup) {
-    // Compute the hash value of the key
-    uint64_t out[2];
-    MurmurHash3_x64_128(key, key_len, 0, &out);
-
-    // Mod the lower 64bits of the hash function with the table
-    // size to get the index
-    unsigned int index = out[1] % table_size;
-
-    // Look for an entry
-    hashmap_entry *entry = table+index;
-    hashmap_entry *last_entry = NULL;
-
-    // Scan the keys
-    while (entry && entry->key) {
-        // Found it, update the value
-        if (should_cmp && (strcmp(entry->key, key) == 0)) {
-            entry->value = value;
-            return 0;
-        }
+static inline uint32_t* hashmap_find_link(hashmap *map, uint32_t *table, int table_size, char *key, uint64_t hash) {
+    uint32_t *link = table + (hash % table_size);
+    hashmap_entry *entry;
 
-        // Walk the chain
-        last_entry = entry;
-        entry = entry->next;
+    // Walk the chain
+    while (*link) {
+        entry = entry_at(map, *link - 1);
+        if (entry->hash == hash && strcmp(entry->key, key) == 0) return link;
+        link = &entry->next;
     }
+    return NULL;
+}
 
-    // If last entry is NULL, we can just
-    // insert directly into the table slot
-    // since it is empty
-    if (last_entry == NULL) {
-        entry->key = (should_dup) ? strdup(key) : key;
-        entry->value = value;
+/**
+ * Internal method to find the entry of a key, which is
+ * in the old table if its bucket was not moved yet.
+ * @return The entry, or NULL if not found.
+ */
+static inline hashmap_entry* hashmap_find_entry(hashmap *map, char *key, uint64_t hash) {
+    uint32_t *link = hashmap_find_link(map, map->table, map->table_size, key, hash);
+    if (!link && map->old_table && (int)(hash % map->old_size) >= map->migrated)
+        link = hashmap_find_link(map, map->old_table, map->old_size, key, hash);
+    return (link) ? entry_at(map, *link - 1) : NULL;
+}
 
-    // We have a last value, need to link against it
-    } else {
-        entry = calloc(1, sizeof(hashmap_entry));
-        entry->key = (should_dup) ? strdup(key) : key;
-        entry->value = value;
-        last_entry->next = entry;
+/**
+ * Gets a value, using a hash computed with hash_key.
+ * @arg key The key to look for. Must be null terminated.
+ * @arg hash The hash of the key
+ * @arg value Output. Set to the value of th key.
+ * 0 on success. -1 if not found.
+ */
+int hashmap_get_hash(hashmap *map, char *key, uint64_t hash, void **value) {
+    hashmap_entry *entry = hashmap_find_entry(map, key, hash);
+    if (!entry) return -1;
+    *value = entry->value;
+    return 0;
+}
+
+/**
+ * Puts a key/value pair. Replaces existing values.
+ * @arg key The key to set. This is copied, and a seperate
+ * version is owned by the hashmap. The caller the key at will.
+ * @notes This method is not thread safe.
+ * @arg key_len The key length
+ * @arg value The value to set.
+ * 0 if updated, 1 if added.
+ */
+int hashmap_put(hashmap *map, char *key, void *value) {
+    void **slot;
+    int new = hashmap_get_or_insert(map, key, &slot);
+    *slot = value;
+    return new;
+}
+
+/**
+ * Internal method to move the entries of a bucket of the
+ * old table to the new one, leaving the bucket empty.
+ * Only the links change, the entries stay in place.
+ */
+static void hashmap_migrate_bucket(hashmap *map, int index) {
+    uint32_t pos = map->old_table[index], *bucket;
+    hashmap_entry *entry;
+    while (pos) {
+        entry = entry_at(map, pos - 1);
+        bucket = map->table + (entry->hash % map->table_size);
+
+        // Link the entry at the front of its new bucket
+        uint32_t next = entry->next;
+        entry->next = *bucket;
+        *bucket = pos;
+        pos = next;
     }
-    return 1;
+    map->old_table[index] = 0;
 }
 
+/**
+ * Internal method to move some buckets of the old table,
+ * freeing it once all of them are moved.
+ * @arg buckets The most buckets to move
+ */
+static void hashmap_migrate(hashmap *map, int buckets) {
+    int end = (buckets < map->old_size - map->migrated) ? map->migrated + buckets : map->old_size;
+    for (; map->migrated < end; map->migrated++) {
+        hashmap_migrate_bucket(map, map->migrated);
+    }
+    if (map->migrated == map->old_size) {
+        page_free(map->old_table, map->old_size * sizeof(uint32_t));
+        stats_mem_add(MEM_MAPS, -(int64_t)(map->old_size * sizeof(uint32_t)));
+        map->old_table = NULL;
+    }
+}
 
 /**
- * Internal method to double the size of a hashmap
+ * Internal method to double the size of a hashmap. The entries
+ * are linked into the new buckets a few buckets at a time by the
+ * later inserts, so no single insert pays for re-hashing the whole
+ * table. The entries themselves are never moved or copied.
  */
 static void hashmap_double_size(hashmap *map) {
+    stats_add(STAT_HASHMAP_RESIZES, 1);
+
+    // Finish moving the entries of the last resize
+    if (map->old_table) hashmap_migrate(map, map->old_size);
+
     // Calculate the new sizes
     int new_size = map->table_size * 2;
     int new_max_size = map->max_size * 2;
+    STATSITE_PROBE2(hashmap_resize, map->table_size, new_size);
 
-    // Allocate the table
-    hashmap_entry *new_table = (hashmap_entry*)calloc(new_size, sizeof(hashmap_entry));
-
-    // Move each entry
-    hashmap_entry *entry, *old;
-    int in_table;
-    for (int i=0; i < map->table_size; i++) {
-        entry = map->table+i;
-        in_table = 1;
-        while (entry && entry->key) {
-            // Walk the next links
-            old = entry;
-            entry = entry->next;
-
-            // Insert the value in the new map
-            // Do not compare keys or duplicate since we are just doubling our
-            // size, and we have unique keys and duplicates already.
-            hashmap_insert_table(new_table, new_size, old->key, strlen(old->key),
-                    old->value, 0, 0);
-
-            // The initial entry is in the table
-            // and we should not free that one.
-            if (!in_table) {
-                free(old);
-            }
-            in_table = 0;
-        }
-    }
-
-    // Free the old table
-    free(map->table);
+    // Keep the old table until it is moved
+    map->old_table = map->table;
+    map->old_size = map->table_size;
+    map->migrated = 0;
 
     // Update the pointers
-    map->table = new_table;
+    map->table = (uint32_t*)page_calloc(new_size * sizeof(uint32_t));
+    stats_mem_add(MEM_MAPS, new_size * sizeof(uint32_t));
     map->table_size = new_size;
     map->max_size = new_max_size;
 }
 
 /**
- * Puts a key/value pair. Replaces existing values.
- * @arg key The key to set. This is copied, and a seperate
- * version is owned by the hashmap. The caller the key at will.
- * @notes This method is not thread safe.
- * @arg key_len The key length
- * @arg value The value to set.
- * 0 if updated, 1 if added.
+ * Internal method to add an entry after the last one,
+ * allocating the next block once the last one is full.
+ * The key is not copied.
+ * @return The new entry
  */
-int hashmap_put(hashmap *map, char *key, void *value) {
-    // Check if we need to double the size
+static hashmap_entry* hashmap_append_entry(hashmap *map, char *key, uint64_t hash) {
+    uint32_t pos = map->count;
+    int block = 31 - __builtin_clz((pos >> BLOCK_BITS) + 1);
+    if (!map->blocks[block]) {
+        map->blocks[block] = (hashmap_entry*)page_alloc(BLOCK_SIZE(block) * sizeof(hashmap_entry));
+        stats_mem_add(MEM_MAPS, BLOCK_SIZE(block) * sizeof(hashmap_entry));
+    }
+
+    hashmap_entry *entry = map->blocks[block] + (pos - BLOCK_START(block));
+    entry->key = key;
+    entry->value = NULL;
+    entry->hash = hash;
+
+    // Link it at the front of its bucket
+    uint32_t *bucket = map->table + (hash % map->table_size);
+    entry->next = *bucket;
+    *bucket = pos + 1;
+    map->count += 1;
+    return entry;
+}
+
+/**
+ * Gets the address of the value for a key, inserting the
+ * key with a NULL value if it does not exist. This only hashes
+ * and probes the key once, unlike a get followed by a put.
+ * @notes This method is not thread safe. The returned address is
+ * only valid until the map is next modified.
+ * @arg key The key to look for. This is copied if it is added.
+ * @arg slot Output. Set to the address of the value of the key.
+ * @return 0 if found, 1 if added.
+ */
+int hashmap_get_or_insert(hashmap *map, char *key, void ***slot) {
+    return hashmap_get_or_insert_hash(map, key, hash_key(key, strlen(key)), slot);
+}
+
+/**
+ * Gets the address of the value for a key, inserting it if
+ * needed, using a hash computed with hash_key.
+ * @notes This method is not thread safe. The returned address is
+ * only valid until the map is next modified.
+ * @arg key The key to look for. This is copied if it is added.
+ * @arg hash The hash of the key
+ * @arg slot Output. Set to the address of the value of the key.
+ * @return 0 if found, 1 if added.
+ */
+int hashmap_get_or_insert_hash(hashmap *map, char *key, uint64_t hash, void ***slot) {
+    hashmap_entry *entry = hashmap_find_entry(map, key, hash);
+    if (entry) {
+        *slot = &entry->value;
+        return 0;
+    }
+
+    // Check if we need to double the size, and move
+    // some of the entries of the old table if resizing
     if (map->count + 1 > map->max_size) {
-        // Doubles the size of the hashmap, re-try the insert
         hashmap_double_size(map);
-        return hashmap_put(map, key, value);
     }
+    if (map->old_table) hashmap_migrate(map, MIGRATE_BUCKETS);
 
-    // Insert into the map, comparing keys and duplicating keys
-    int new = hashmap_insert_table(map->table, map->table_size, key, strlen(key), value, 1, 1);
-    if (new) map->count += 1;
+    // Add the new key
+    entry = hashmap_append_entry(map, hashmap_dup_key(map, key, hash), hash);
+    *slot = &entry->value;
+    return 1;
+}
 
-    return new;
+/**
+ * Internal method to find the link to the entry at a position.
+ * New entries are always in the new table, so it is in the old
+ * one only if its bucket was not moved yet.
+ */
+static uint32_t* hashmap_link_of(hashmap *map, uint32_t pos) {
+    uint64_t hash = entry_at(map, pos)->hash;
+    uint32_t *link = map->table + (hash % map->table_size);
+    while (*link && *link != pos + 1) link = &entry_at(map, *link - 1)->next;
+    if (*link) return link;
+
+    link = map->old_table + (hash % map->old_size);
+    while (*link != pos + 1) link = &entry_at(map, *link - 1)->next;
+    return link;
 }
 
 /**
- * Deletes a key/value pair.
+ * Deletes a key/value pair. The last entry is moved into
+ * its place, so the entries stay without gaps.
  * @notes This method is not thread safe.
  * @arg key The key to delete
  * 0 on success. -1 if not found.
  */
 int hashmap_delete(hashmap *map, char *key) {
-    // Compute the hash value of the key
-    uint64_t out[2];
-    MurmurHash3_x64_128(key, strlen(key), 0, &out);
-
-    // Mod the lower 64bits of the hash function with the table
-    // size to get the index
-    unsigned int index = out[1] % map->table_size;
-
-    // Look for an entry
-    hashmap_entry *entry = map->table+index;
-    hashmap_entry *last_entry = NULL;
-
-    // Scan the keys
-    while (entry && entry->key) {
-        // Found it
-        if (strcmp(entry->key, key) == 0) {
-            // Free the key
-            free(entry->key);
-            map->count -= 1;
-
-            // Check if we are in the table
-            if (last_entry == NULL) {
-                // Copy the keys from the node, and free it
-                if (entry->next) {
-                    hashmap_entry *n = entry->next;
-                    entry->key = n->key;
-                    entry->value = n->value;
-                    entry->next = n->next;
-                    free(n);
-
-                // Zero everything out
-                } else {
-                    entry->key = NULL;
-                    entry->value = NULL;
-                }
-
-            } else {
-                // Skip us in the list
-                last_entry->next = entry->next;
-
-                // Free ourself
-                free(entry);
-            }
-            return 0;
+    // Compute the hash value of the key, it is in
+    // the old table if its bucket was not moved yet
+    uint64_t hash = hash_key(key, strlen(key));
+    uint32_t *link = hashmap_find_link(map, map->table, map->table_size, key, hash);
+    if (!link && map->old_table && (int)(hash % map->old_size) >= map->migrated)
+        link = hashmap_find_link(map, map->old_table, map->old_size, key, hash);
+    if (!link) return -1;
+
+    // Unlink the entry, and free the key
+    uint32_t pos = *link - 1;
+    hashmap_entry *entry = entry_at(map, pos);
+    *link = entry->next;
+    if (!map->keys) free(entry->key);
+    map->count -= 1;
+
+    // Move the last entry into the gap
+    uint32_t last = map->count;
+    if (pos != last) {
+        *hashmap_link_of(map, last) = pos + 1;
+        *entry = *entry_at(map, last);
+    }
+    return 0;
+}
+
+/**
+ * Grows the table so that a number of keys fit
+ * without resizing. The table never shrinks.
+ * @notes This method is not thread safe.
+ * @arg count The number of keys to make room for
+ * @return 0 on success.
+ */
+int hashmap_reserve(hashmap *map, int count) {
+    while (count > map->max_size) {
+        hashmap_double_size(map);
+    }
+
+    // Move the entries now, the inserts will not
+    if (map->old_table) hashmap_migrate(map, map->old_size);
+    return 0;
+}
+
+/**
+ * Shrinks the storage of an empty map that is at least four
+ * times what a number of keys needs, to fit them. Used so that
+ * a map that is cleared and re-used follows its keys down.
+ * @notes This method is not thread safe.
+ * @arg count The number of keys to make room for
+ * @return 0 on success, -1 if the map is not empty.
+ */
+int hashmap_fit(hashmap *map, int count) {
+    if (map->count) return -1;
+    int size = DEFAULT_CAPACITY;
+    while (count > MAX_CAPACITY * size) size *= 2;
+    if (map->table_size >= 4 * size) {
+        uint32_t *table = (uint32_t*)page_calloc(size * sizeof(uint32_t));
+        if (table) {
+            page_free(map->table, map->table_size * sizeof(uint32_t));
+            stats_mem_add(MEM_MAPS, ((int64_t)size - map->table_size) * (int64_t)sizeof(uint32_t));
+            map->table = table;
+            map->table_size = size;
+            map->max_size = MAX_CAPACITY * size;
         }
-        // Walk the chain
-        entry = entry->next;
     }
 
-    // Not found
-    return -1;
+    // Free the blocks past twice the keys, the first is always kept
+    for (int i=MAX_BLOCKS - 1; i > 0; i--) {
+        if (!map->blocks[i] || BLOCK_START(i) < 2 * (uint32_t)count) continue;
+        page_free(map->blocks[i], BLOCK_SIZE(i) * sizeof(hashmap_entry));
+        stats_mem_add(MEM_MAPS, -(int64_t)(BLOCK_SIZE(i) * sizeof(hashmap_entry)));
+        map->blocks[i] = NULL;
+    }
+    return 0;
 }
 
 /**
- * Clears all the key/value pairs.
+ * Clears all the key/value pairs. The blocks
+ * of entries are kept to be re-used.
  * @notes This method is not thread safe.
  * 0 on success. -1 if not found.
  */
 int hashmap_clear(hashmap *map) {
-    hashmap_entry *entry, *old;
-    int in_table;
-    for (int i=0; i < map->table_size; i++) {
-        entry = map->table+i;
-        in_table = 1;
-        while (entry && entry->key) {
-            // Walk the next links
-            old = entry;
-            entry = entry->next;
-
-            // Clear the objects
-            free(old->key);
-
-            // The initial entry is in the table
-            // and we should not free that one.
-            if (!in_table) {
-                free(old);
-            } else {
-                old->key = NULL;
-            }
-            in_table = 0;
+    if (!map->keys) {
+        for (uint32_t i=0; i < (uint32_t)map->count; i++) {
+            free(entry_at(map, i)->key);
         }
     }
+    memset(map->table, 0, map->table_size * sizeof(uint32_t));
+
+    // Drop the old table, the new one keeps the capacity
+    if (map->old_table) {
+        page_free(map->old_table, map->old_size * sizeof(uint32_t));
+        stats_mem_add(MEM_MAPS, -(int64_t)(map->old_size * sizeof(uint32_t)));
+        map->old_table = NULL;
+    }
 
     // Reset the sizes
     map->count = 0;
@@ -364,22 +516,46 @@ int hashmap_clear(hashmap *map) {
  * invoking a callback for each. The call back gets a
  * key, value for each and returns an integer stop value.
  * If the callback returns 1, then the iteration stops.
+ * The entries are visited in the order they were added,
+ * by a scan of the blocks that skips the buckets.
  * @arg map The hashmap to iterate over
  * @arg cb The callback function to invoke
  * @arg data Opaque handle passed to the callback
  * @return 0 on success
  */
 int hashmap_iter(hashmap *map, hashmap_callback cb, void *data) {
-    hashmap_entry *entry;
+    hashmap_entry *entry, *end;
     int should_break = 0;
-    for (int i=0; i < map->table_size && !should_break; i++) {
-        entry = map->table+i;
-        while (entry && entry->key && !should_break) {
+    uint32_t count = map->count;
+    for (int i=0; i < MAX_BLOCKS && BLOCK_START(i) < count && !should_break; i++) {
+        entry = map->blocks[i];
+        end = entry + ((count - BLOCK_START(i) < BLOCK_SIZE(i)) ? count - BLOCK_START(i) : BLOCK_SIZE(i));
+        for (; entry < end && !should_break; entry++) {
             // Invoke the callback
             should_break = cb(data, entry->key, entry->value);
-            entry = entry->next;
         }
     }
     return should_break;
 }
 
+/**
+ * Iterates through the key/value pairs in the map as
+ * hashmap_iter, also giving the callback the hash of each key.
+ * @arg map The hashmap to iterate over
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success
+ */
+int hashmap_iter_hash(hashmap *map, hashmap_hash_callback cb, void *data) {
+    hashmap_entry *entry, *end;
+    int should_break = 0;
+    uint32_t count = map->count;
+    for (int i=0; i < MAX_BLOCKS && BLOCK_START(i) < count && !should_break; i++) {
+        entry = map->blocks[i];
+        end = entry + ((count - BLOCK_START(i) < BLOCK_SIZE(i)) ? count - BLOCK_START(i) : BLOCK_SIZE(i));
+        for (; entry < end && !should_break; entry++) {
+            should_break = cb(data, entry->key, entry->hash, entry->value);
+        }
+    }
+    return should_break;
+}
@@ -1,11 +1,15 @@
 #ifndef HASHMAP_H
 #define HASHMAP_H
+#include <stdint.h>
+#include "arena.h"
+#include "intern.h"
 
 /**
  * Opaque hashmap reference
  */
 typedef struct hashmap hashmap;
 typedef int(*hashmap_callback)(void *data, const char *key, void *value);
+typedef int(*hashmap_hash_callback)(void *data, const char *key, uint64_t hash, void *value);
 
 /**
  * Creates a new hashmap and allocates space for it.
@@ -15,6 +19,27 @@ typedef int(*hashmap_callback)(void *data, const char *key, void *value);
  */
 int hashmap_init(int initial_size, hashmap **map);
 
+/**
+ * Creates a new hashmap whose keys are copied into an arena.
+ * Keys are then never freed by the hashmap, and are released
+ * when the arena is reset or destroyed.
+ * @arg initial_size The minimim initial size. 0 for default (64).
+ * @arg keys The arena to copy keys into. Must outlive the map.
+ * @arg map Output. Set to the address of the map
+ * @return 0 on success.
+ */
+int hashmap_init_arena(int initial_size, arena *keys, hashmap **map);
+
+/**
+ * Makes a hashmap take the new keys from an intern table, so
+ * the names that are stable across intervals are not copied again
+ * for each one. Only for maps that were created with an arena.
+ * @arg map The hashmap, which must be empty
+ * @arg names The intern table, which must outlive the map. The
+ * map must be cleared before the table is advanced.
+ */
+void hashmap_set_interned(hashmap *map, intern_table *names);
+
 /**
  * Destroys a map and cleans up all associated memory
  * @arg map The hashmap to destroy. Frees memory.
@@ -34,6 +59,16 @@ int hashmap_size(hashmap *map);
  */
 int hashmap_get(hashmap *map, char *key, void **value);
 
+/**
+ * Gets a value, using a hash computed with hash_key.
+ * This lets callers that already hashed the key skip doing it again.
+ * @arg key The key to look for. Must be null terminated.
+ * @arg hash The hash of the key
+ * @arg value Output. Set to the value of th key.
+ * 0 on success. -1 if not found.
+ */
+int hashmap_get_hash(hashmap *map, char *key, uint64_t hash, void **value);
+
 /**
  * Puts a key/value pair.
  * @arg key The key to set. This is copied, and a seperate
@@ -45,6 +80,37 @@ int hashmap_get(hashmap *map, char *key, void **value);
  */
 int hashmap_put(hashmap *map, char *key, void *value);
 
+/**
+ * Gets the address of the value for a key, inserting the
+ * key with a NULL value if it does not exist. This only hashes
+ * and probes the key once, unlike a get followed by a put.
+ * @notes This method is not thread safe. The returned address is
+ * only valid until the map is next modified.
+ * @arg key The key to look for. This is copied if it is added.
+ * @arg slot Output. Set to the address of the value of the key.
+ * @return 0 if found, 1 if added.
+ */
+int hashmap_get_or_insert(hashmap *map, char *key, void ***slot);
+
+/**
+ * Gets the address of the value for a key, inserting it if
+ * needed, using a hash computed with hash_key.
+ * @notes This method is not thread safe. The returned address is
+ * only valid until the map is next modified.
+ * @arg key The key to look for. This is copied if it is added.
+ * @arg hash The hash of the key
+ * @arg slot Output. Set to the address of the value of the key.
+ * @return 0 if found, 1 if added.
+ */
+int hashmap_get_or_insert_hash(hashmap *map, char *key, uint64_t hash, void ***slot);
+
+/**
+ * Starts loading the table entry a hash belongs in, so a
+ * later lookup of the key does not wait on memory.
+ * @arg hash The hash of the key, from hash_key
+ */
+void hashmap_prefetch(hashmap *map, uint64_t hash);
+
 /**
  * Deletes a key/value pair.
  * @notes This method is not thread safe.
@@ -61,6 +127,25 @@ int hashmap_delete(hashmap *map, char *key);
  */
 int hashmap_clear(hashmap *map);
 
+/**
+ * Grows the table so that a number of keys fit
+ * without resizing. The table never shrinks.
+ * @notes This method is not thread safe.
+ * @arg count The number of keys to make room for
+ * @return 0 on success.
+ */
+int hashmap_reserve(hashmap *map, int count);
+
+/**
+ * Shrinks the storage of an empty map that is at least four
+ * times what a number of keys needs, to fit them. Used so that
+ * a map that is cleared and re-used follows its keys down.
+ * @notes This method is not thread safe.
+ * @arg count The number of keys to make room for
+ * @return 0 on success, -1 if the map is not empty.
+ */
+int hashmap_fit(hashmap *map, int count);
+
 /**
  * Iterates through the key/value pairs in the map,
  * invoking a callback for each. The call back gets a
@@ -73,4 +158,16 @@ int hashmap_clear(hashmap *map);
  */
 int hashmap_iter(hashmap *map, hashmap_callback cb, void *data);
 
+/**
+ * Iterates through the key/value pairs in the map as hashmap_iter,
+ * also giving the callback the hash of each key, which is kept with
+ * the entry. Callers that look the keys up in another map can then
+ * skip hashing them again.
+ * @arg map The hashmap to iterate over
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int hashmap_iter_hash(hashmap *map, hashmap_hash_callback cb, void *data);
+
 #endif
@@ -0,0 +1,534 @@
+/**
+ * Open addressing implementation of the hashmap API.
+ * The table is split into groups of 16 entries, with a control
+ * byte for each entry holding 7 bits of the hash, or marking it as
+ * empty or deleted. A lookup compares all the control bytes of a
+ * group at once (using SSE2 when available), and only visits the
+ * entries with a matching tag. The full hash is stored with each entry
+ * so that resizing never re-hashes keys, and short keys are stored
+ * inline to avoid an extra pointer chase.
+ *
+ * Select it at build time with `scons hashmap=open`.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "hashmap.h"
+#include "page_alloc.h"
+#include "hash.h"
+#include "stats.h"
+#include "probes.h"
+#include "name_map.h"
+
+#define MAX_CAPACITY 0.75
+#define DEFAULT_CAPACITY 128
+#define GROUP_WIDTH 16
+#define INLINE_KEY_LEN 24
+
+// Control byte values. Full entries store 7 bits of the hash.
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xFE
+#define CTRL_TAG(hash) ((hash) & 0x7F)
+
+// Basic hash entry.
+typedef struct {
+    uint64_t hash;
+    void *value;
+    uint32_t key_len;
+    union {
+        char inline_key[INLINE_KEY_LEN]; // Used if the key and its output name fit
+        char *ptr;
+    } key;
+} hashmap_entry;
+
+struct hashmap {
+    int count;      // Number of entries
+    int used;       // Number of entries and deleted entries
+    int table_size; // Size of table in entries, a multiple of GROUP_WIDTH
+    int max_size;   // Max used entries before we resize
+    uint8_t *ctrl;  // Control byte for each entry
+    hashmap_entry *table; // Pointer to an array of hashmap_entry objects
+    arena *keys;    // Optional arena owning the long keys
+    intern_table *names; // Optional table of the stable long keys
+};
+
+/**
+ * Returns if a key of a length is stored in the entry
+ */
+static inline int key_inline(uint32_t key_len) {
+    return name_copy_size(key_len) <= INLINE_KEY_LEN;
+}
+
+/**
+ * Returns the key of an entry
+ */
+static inline char* entry_key(hashmap_entry *entry) {
+    return key_inline(entry->key_len) ? entry->key.inline_key : entry->key.ptr;
+}
+
+/**
+ * Returns a bitmask of the entries in a group
+ * whose control byte matches a value.
+ */
+static inline uint32_t group_match(uint8_t *group, uint8_t val) {
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128((__m128i*)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(val)));
+#else
+    uint32_t mask = 0;
+    for (int i=0; i < GROUP_WIDTH; i++) {
+        if (group[i] == val) mask |= (1 << i);
+    }
+    return mask;
+#endif
+}
+
+/**
+ * Returns a bitmask of the empty or deleted
+ * entries in a group.
+ */
+static inline uint32_t group_match_free(uint8_t *group) {
+#ifdef __SSE2__
+    // Free control bytes are the only ones with the high bit set
+    return _mm_movemask_epi8(_mm_loadu_si128((__m128i*)group));
+#else
+    uint32_t mask = 0;
+    for (int i=0; i < GROUP_WIDTH; i++) {
+        if (group[i] & 0x80) mask |= (1 << i);
+    }
+    return mask;
+#endif
+}
+
+/**
+ * Creates a new hashmap and allocates space for it.
+ * @arg initial_size The minimim initial size. 0 for default (64).
+ * @arg map Output. Set to the address of the map
+ * @return 0 on success.
+ */
+int hashmap_init(int initial_size, hashmap **map) {
+    return hashmap_init_arena(initial_size, NULL, map);
+}
+
+/**
+ * Creates a new hashmap whose keys are copied into an arena.
+ * Keys are then never freed by the hashmap, and are released
+ * when the arena is reset or destroyed.
+ * @arg initial_size The minimim initial size. 0 for default (64).
+ * @arg keys The arena to copy keys into. Must outlive the map.
+ * @arg map Output. Set to the address of the map
+ * @return 0 on success.
+ */
+int hashmap_init_arena(int initial_size, arena *keys, hashmap **map) {
+    // Default to 64 if no size
+    if (initial_size <= 0) {
+       initial_size = DEFAULT_CAPACITY;
+
+    // Round up to power of 2
+    } else {
+        int most_sig_bit = 0;
+        for (int idx= 0; idx < sizeof(initial_size)*8; idx++) {
+            if ((initial_size >> idx) & 0x1)
+                most_sig_bit = idx;
+        }
+
+        // Round up if not a power of 2
+        if ((1 << most_sig_bit) != initial_size) {
+            most_sig_bit += 1;
+        }
+        initial_size = 1 << most_sig_bit;
+    }
+
+    // We need at least a single group
+    if (initial_size < GROUP_WIDTH) initial_size = GROUP_WIDTH;
+
+    // Allocate the map
+    hashmap *m = calloc(1, sizeof(hashmap));
+    m->table_size = initial_size;
+    m->max_size = MAX_CAPACITY * initial_size;
+    m->keys = keys;
+
+    // Allocate the table
+    m->ctrl = page_alloc(initial_size);
+    memset(m->ctrl, CTRL_EMPTY, initial_size);
+    m->table = (hashmap_entry*)page_alloc(initial_size * sizeof(hashmap_entry));
+    stats_mem_add(MEM_MAPS, sizeof(hashmap) + initial_size * (1 + sizeof(hashmap_entry)));
+
+    // Return the table
+    *map = m;
+    return 0;
+}
+
+/**
+ * Makes a hashmap take the new keys from an intern table, so
+ * the names that are stable across intervals are not copied again
+ * for each one. Only for maps that were created with an arena.
+ * Short keys are still copied inline.
+ * @arg map The hashmap, which must be empty
+ * @arg names The intern table, which must outlive the map. The
+ * map must be cleared before the table is advanced.
+ */
+void hashmap_set_interned(hashmap *map, intern_table *names) {
+    map->names = (map->keys) ? names : NULL;
+}
+
+/**
+ * Destroys a map and cleans up all associated memory
+ * @arg map The hashmap to destroy. Frees memory.
+ */
+int hashmap_destroy(hashmap *map) {
+    hashmap_clear(map);
+    page_free(map->ctrl, map->table_size);
+    page_free(map->table, map->table_size * sizeof(hashmap_entry));
+    stats_mem_add(MEM_MAPS, -(int64_t)(sizeof(hashmap) + map->table_size * (1 + sizeof(hashmap_entry))));
+    free(map);
+    return 0;
+}
+
+/**
+ * Returns the size of the hashmap in items
+ */
+int hashmap_size(hashmap *map) {
+    return map->count;
+}
+
+/**
+ * Starts loading the control bytes and the first entry of the
+ * group a hash starts probing at, so a later lookup of the key
+ * does not wait on memory.
+ * @arg hash The hash of the key, from hash_key
+ */
+void hashmap_prefetch(hashmap *map, uint64_t hash) {
+    uint32_t group = (hash >> 7) & ((map->table_size / GROUP_WIDTH) - 1);
+    __builtin_prefetch(map->ctrl + group * GROUP_WIDTH);
+    __builtin_prefetch(map->table + group * GROUP_WIDTH);
+}
+
+/**
+ * Internal method to find the entry of a key
+ * @return The entry, or NULL if not found.
+ */
+static hashmap_entry* hashmap_find(hashmap *map, char *key, uint32_t key_len, uint64_t hash) {
+    uint8_t tag = CTRL_TAG(hash);
+    uint32_t group_mask = (map->table_size / GROUP_WIDTH) - 1;
+    uint32_t group = (hash >> 7) & group_mask;
+    uint32_t matches, idx;
+    hashmap_entry *entry;
+
+    // Triangular probing visits every group once
+    for (uint32_t probe=1; probe <= group_mask + 1; probe++) {
+        uint8_t *ctrl = map->ctrl + group * GROUP_WIDTH;
+
+        // Check each entry with a matching tag
+        matches = group_match(ctrl, tag);
+        while (matches) {
+            idx = group * GROUP_WIDTH + __builtin_ctz(matches);
+            entry = map->table + idx;
+            if (entry->hash == hash && entry->key_len == key_len &&
+                    memcmp(entry_key(entry), key, key_len) == 0) {
+                return entry;
+            }
+            matches &= matches - 1;
+        }
+
+        // An empty entry terminates the probe
+        if (group_match(ctrl, CTRL_EMPTY)) break;
+        group = (group + probe) & group_mask;
+    }
+    return NULL;
+}
+
+/**
+ * Internal method to find the first free index for a hash
+ */
+static uint32_t hashmap_find_free(uint8_t *ctrl, int table_size, uint64_t hash) {
+    uint32_t group_mask = (table_size / GROUP_WIDTH) - 1;
+    uint32_t group = (hash >> 7) & group_mask;
+    uint32_t free_mask;
+    for (uint32_t probe=1; ; probe++) {
+        free_mask = group_match_free(ctrl + group * GROUP_WIDTH);
+        if (free_mask) return group * GROUP_WIDTH + __builtin_ctz(free_mask);
+        group = (group + probe) & group_mask;
+    }
+}
+
+/**
+ * Internal method to re-build the table at a new size.
+ * This also drops any deleted entries.
+ */
+static void hashmap_resize(hashmap *map, int new_size) {
+    stats_add(STAT_HASHMAP_RESIZES, 1);
+    STATSITE_PROBE2(hashmap_resize, map->table_size, new_size);
+
+    // Allocate the table
+    uint8_t *new_ctrl = page_alloc(new_size);
+    memset(new_ctrl, CTRL_EMPTY, new_size);
+    hashmap_entry *new_table = (hashmap_entry*)page_alloc(new_size * sizeof(hashmap_entry));
+
+    // Move each entry, we have the hash already
+    uint32_t idx;
+    for (int i=0; i < map->table_size; i++) {
+        if (map->ctrl[i] & 0x80) continue;
+        idx = hashmap_find_free(new_ctrl, new_size, map->table[i].hash);
+        new_ctrl[idx] = map->ctrl[i];
+        new_table[idx] = map->table[i];
+    }
+
+    // Free the old table
+    page_free(map->ctrl, map->table_size);
+    page_free(map->table, map->table_size * sizeof(hashmap_entry));
+    stats_mem_add(MEM_MAPS, ((int64_t)new_size - map->table_size) * (int64_t)(1 + sizeof(hashmap_entry)));
+
+    // Update the pointers
+    map->ctrl = new_ctrl;
+    map->table = new_table;
+    map->table_size = new_size;
+    map->max_size = MAX_CAPACITY * new_size;
+    map->used = map->count;
+}
+
+/**
+ * Internal method to add a new key, which must not
+ * already be present. The value is set to NULL.
+ * @return The new entry
+ */
+static hashmap_entry* hashmap_insert_new(hashmap *map, char *key, uint32_t key_len, uint64_t hash) {
+    // Check if we need to resize. If the table is mostly
+    // deleted entries, re-build it at the same size.
+    if (map->used + 1 > map->max_size) {
+        if (map->count + 1 > map->max_size / 2)
+            hashmap_resize(map, map->table_size * 2);
+        else
+            hashmap_resize(map, map->table_size);
+    }
+
+    // Claim a free entry
+    uint32_t idx = hashmap_find_free(map->ctrl, map->table_size, hash);
+    if (map->ctrl[idx] == CTRL_EMPTY) map->used += 1;
+    map->ctrl[idx] = CTRL_TAG(hash);
+    map->count += 1;
+
+    // Copy the key
+    hashmap_entry *entry = map->table + idx;
+    entry->hash = hash;
+    entry->value = NULL;
+    entry->key_len = key_len;
+    if (key_inline(key_len)) {
+        name_copy(entry->key.inline_key, key, key_len);
+    } else {
+        // Take the interned copy if there is one
+        entry->key.ptr = (map->names) ? intern_key(map->names, key, hash) : NULL;
+        if (!entry->key.ptr) {
+            size_t size = name_copy_size(key_len);
+            entry->key.ptr = (map->keys) ? arena_alloc(map->keys, size) : malloc(size);
+            name_copy(entry->key.ptr, key, key_len);
+        }
+    }
+    return entry;
+}
+
+/**
+ * Gets a value.
+ * @arg key The key to look for
+ * @arg value Output. Set to the value of th key.
+ * 0 on success. -1 if not found.
+ */
+int hashmap_get(hashmap *map, char *key, void **value) {
+    uint32_t key_len = strlen(key);
+    return hashmap_get_hash(map, key, hash_key(key, key_len), value);
+}
+
+/**
+ * Gets a value, using a hash computed with hash_key.
+ * @arg key The key to look for. Must be null terminated.
+ * @arg hash The hash of the key
+ * @arg value Output. Set to the value of th key.
+ * 0 on success. -1 if not found.
+ */
+int hashmap_get_hash(hashmap *map, char *key, uint64_t hash, void **value) {
+    hashmap_entry *entry = hashmap_find(map, key, strlen(key), hash);
+    if (!entry) return -1;
+    *value = entry->value;
+    return 0;
+}
+
+/**
+ * Puts a key/value pair. Replaces existing values.
+ * @arg key The key to set. This is copied, and a seperate
+ * version is owned by the hashmap. The caller the key at will.
+ * @notes This method is not thread safe.
+ * @arg value The value to set.
+ * 0 if updated, 1 if added.
+ */
+int hashmap_put(hashmap *map, char *key, void *value) {
+    uint32_t key_len = strlen(key);
+    uint64_t hash = hash_key(key, key_len);
+    int new = 0;
+
+    hashmap_entry *entry = hashmap_find(map, key, key_len, hash);
+    if (!entry) {
+        entry = hashmap_insert_new(map, key, key_len, hash);
+        new = 1;
+    }
+    entry->value = value;
+    return new;
+}
+
+/**
+ * Gets the address of the value for a key, inserting the
+ * key with a NULL value if it does not exist. This only hashes
+ * and probes the key once, unlike a get followed by a put.
+ * @notes This method is not thread safe. The returned address is
+ * only valid until the map is next modified.
+ * @arg key The key to look for. This is copied if it is added.
+ * @arg slot Output. Set to the address of the value of the key.
+ * @return 0 if found, 1 if added.
+ */
+int hashmap_get_or_insert(hashmap *map, char *key, void ***slot) {
+    return hashmap_get_or_insert_hash(map, key, hash_key(key, strlen(key)), slot);
+}
+
+/**
+ * Gets the address of the value for a key, inserting it if
+ * needed, using a hash computed with hash_key.
+ * @notes This method is not thread safe. The returned address is
+ * only valid until the map is next modified.
+ * @arg key The key to look for. This is copied if it is added.
+ * @arg hash The hash of the key
+ * @arg slot Output. Set to the address of the value of the key.
+ * @return 0 if found, 1 if added.
+ */
+int hashmap_get_or_insert_hash(hashmap *map, char *key, uint64_t hash, void ***slot) {
+    uint32_t key_len = strlen(key);
+    int new = 0;
+
+    hashmap_entry *entry = hashmap_find(map, key, key_len, hash);
+    if (!entry) {
+        entry = hashmap_insert_new(map, key, key_len, hash);
+        new = 1;
+    }
+    *slot = &entry->value;
+    return new;
+}
+
+/**
+ * Deletes a key/value pair.
+ * @notes This method is not thread safe.
+ * @arg key The key to delete
+ * 0 on success. -1 if not found.
+ */
+int hashmap_delete(hashmap *map, char *key) {
+    uint32_t key_len = strlen(key);
+    hashmap_entry *entry = hashmap_find(map, key, key_len, hash_key(key, key_len));
+    if (!entry) return -1;
+
+    // Free the key
+    if (!key_inline(entry->key_len) && !map->keys) free(entry->key.ptr);
+    map->count -= 1;
+
+    /*
+     * If the group still has an empty entry then no probe
+     * has ever continued past it, so we can mark the entry as
+     * empty. Otherwise we must leave a deleted marker.
+     */
+    uint32_t idx = entry - map->table;
+    uint8_t *group = map->ctrl + (idx - idx % GROUP_WIDTH);
+    if (group_match(group, CTRL_EMPTY)) {
+        map->ctrl[idx] = CTRL_EMPTY;
+        map->used -= 1;
+    } else {
+        map->ctrl[idx] = CTRL_DELETED;
+    }
+    return 0;
+}
+
+/**
+ * Grows the table so that a number of keys fit
+ * without resizing. The table never shrinks.
+ * @notes This method is not thread safe.
+ * @arg count The number of keys to make room for
+ * @return 0 on success.
+ */
+int hashmap_reserve(hashmap *map, int count) {
+    int new_size = map->table_size;
+    while (count > MAX_CAPACITY * new_size) new_size *= 2;
+    if (new_size != map->table_size) hashmap_resize(map, new_size);
+    return 0;
+}
+
+/**
+ * Shrinks the storage of an empty map that is at least four
+ * times what a number of keys needs, to fit them. Used so that
+ * a map that is cleared and re-used follows its keys down.
+ * @notes This method is not thread safe.
+ * @arg count The number of keys to make room for
+ * @return 0 on success, -1 if the map is not empty.
+ */
+int hashmap_fit(hashmap *map, int count) {
+    if (map->count) return -1;
+    int size = DEFAULT_CAPACITY;
+    while (count > MAX_CAPACITY * size) size *= 2;
+    if (map->table_size >= 4 * size) hashmap_resize(map, size);
+    return 0;
+}
+
+/**
+ * Clears all the key/value pairs.
+ * @notes This method is not thread safe.
+ * 0 on success. -1 if not found.
+ */
+int hashmap_clear(hashmap *map) {
+    for (int i=0; i < map->table_size && !map->keys; i++) {
+        if (map->ctrl[i] & 0x80) continue;
+        if (!key_inline(map->table[i].key_len)) free(map->table[i].key.ptr);
+    }
+    memset(map->ctrl, CTRL_EMPTY, map->table_size);
+
+    // Reset the sizes
+    map->count = 0;
+    map->used = 0;
+    return 0;
+}
+
+/**
+ * Iterates through the key/value pairs in the map,
+ * invoking a callback for each. The call back gets a
+ * key, value for each and returns an integer stop value.
+ * If the callback returns 1, then the iteration stops.
+ * @arg map The hashmap to iterate over
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success
+ */
+int hashmap_iter(hashmap *map, hashmap_callback cb, void *data) {
+    hashmap_entry *entry;
+    int should_break = 0;
+    for (int i=0; i < map->table_size && !should_break; i++) {
+        if (map->ctrl[i] & 0x80) continue;
+        entry = map->table+i;
+        should_break = cb(data, entry_key(entry), entry->value);
+    }
+    return should_break;
+}
+
+/**
+ * Iterates through the key/value pairs in the map as
+ * hashmap_iter, also giving the callback the hash of each key.
+ * @arg map The hashmap to iterate over
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success
+ */
+int hashmap_iter_hash(hashmap *map, hashmap_hash_callback cb, void *data) {
+    hashmap_entry *entry;
+    int should_break = 0;
+    for (int i=0; i < map->table_size && !should_break; i++) {
+        if (map->ctrl[i] & 0x80) continue;
+        entry = map->table+i;
+        should_break = cb(data, entry_key(entry), entry->hash, entry->value);
+    }
+    return should_break;
+}
@@ -0,0 +1,197 @@
+/**
+ * This file implements the histogram declared in hdr.h
+ *
+ * Values are scaled to integer units of HDR_LOWEST / 2^sub_bits. The
+ * units below 2^sub_bits each have a bucket, and above that every power
+ * of two is split into 2^(sub_bits-1) buckets, so a bucket is never
+ * wider than 2^-(sub_bits-1) of its values, and its midpoint is within
+ * 2^-sub_bits of them. HDR_LOWEST is the first of those powers of two,
+ * so the error holds over the whole range.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "hdr.h"
+#include "stats.h"
+
+
+// Bounds the buckets, 2^12 linear ones is a 2.4e-4 error in 450KB of counts
+#define MIN_SUB_BITS 2
+#define MAX_SUB_BITS 12
+
+/**
+ * Returns the bucket of a value. Values below the lowest,
+ * including NaN, go in the first bucket.
+ */
+static inline uint32_t bucket_of(hdr_histogram *h, double val) {
+    double scaled = ldexp(val * (1 / HDR_LOWEST), h->sub_bits);
+    double max_units = ldexp(HDR_HIGHEST / HDR_LOWEST, h->sub_bits);
+    uint64_t units = (scaled >= 1) ? (uint64_t)fmin(scaled, max_units) : 0;
+    uint64_t linear = ((uint64_t)1 << h->sub_bits) - 1;
+    uint32_t shift = 63 - __builtin_clzll(units | linear) - (h->sub_bits - 1);
+    return (shift << (h->sub_bits - 1)) + (uint32_t)(units >> shift);
+}
+
+/**
+ * Initializes the histogram
+ * @arg eps The relative error of the values, on (0, 0.5)
+ * @arg h The histogram to initialize
+ * @return 0 on success.
+ */
+int init_hdr(double eps, hdr_histogram *h) {
+    if (!(eps > 0 && eps < 0.5)) return -1;
+    int bits = ceil(log2(1 / eps));
+    if (bits < MIN_SUB_BITS) bits = MIN_SUB_BITS;
+    if (bits > MAX_SUB_BITS) bits = MAX_SUB_BITS;
+
+    h->eps = eps;
+    h->sub_bits = bits;
+    h->counts = NULL;
+    h->total = 0;
+    h->min = INFINITY;
+    h->max = -INFINITY;
+    h->num_buckets = bucket_of(h, HDR_HIGHEST) + 1;
+    return 0;
+}
+
+/**
+ * Destroys the histogram
+ * @arg h The histogram to destroy
+ * @return 0 on success.
+ */
+int destroy_hdr(hdr_histogram *h) {
+    if (h->counts) stats_mem_add(MEM_TIMERS, -(int64_t)(h->num_buckets * sizeof(uint64_t)));
+    free(h->counts);
+    h->counts = NULL;
+    return 0;
+}
+
+/**
+ * Adds a new value to the histogram
+ * @arg h The histogram to add to
+ * @arg val The new value
+ * @return 0 on success.
+ */
+int hdr_add(hdr_histogram *h, double val) {
+    return hdr_add_weighted(h, val, 1);
+}
+
+/**
+ * Adds a new value that stands for a number of values
+ * @arg h The histogram to add to
+ * @arg val The new value
+ * @arg weight The number of values it stands for
+ * @return 0 on success.
+ */
+int hdr_add_weighted(hdr_histogram *h, double val, uint64_t weight) {
+    if (!h->counts) {
+        h->counts = calloc(h->num_buckets, sizeof(uint64_t));
+        if (!h->counts) return -1;
+        stats_mem_add(MEM_TIMERS, h->num_buckets * sizeof(uint64_t));
+    }
+    h->counts[bucket_of(h, val)] += weight;
+    h->total += weight;
+    h->min = (val < h->min) ? val : h->min;
+    h->max = (val > h->max) ? val : h->max;
+    return 0;
+}
+
+/**
+ * Merges the counts of one histogram into another. Those of
+ * a different accuracy are re-added at the accuracy of dst.
+ * @arg dst The histogram to merge into
+ * @arg src The histogram to merge from, unmodified
+ * @return 0 on success.
+ */
+int hdr_merge(hdr_histogram *dst, hdr_histogram *src) {
+    if (!src->total) return 0;
+
+    // The midpoints are only within the error, the extremes are exact
+    double min = (src->min < dst->min) ? src->min : dst->min;
+    double max = (src->max > dst->max) ? src->max : dst->max;
+    if (dst->sub_bits != src->sub_bits) {
+        for (uint32_t i=0; i < src->num_buckets; i++) {
+            if (!src->counts[i]) continue;
+            if (hdr_add_weighted(dst, hdr_bucket_value(src, i), src->counts[i])) return -1;
+        }
+    } else {
+        if (!dst->counts) {
+            dst->counts = calloc(dst->num_buckets, sizeof(uint64_t));
+            if (!dst->counts) return -1;
+            stats_mem_add(MEM_TIMERS, dst->num_buckets * sizeof(uint64_t));
+        }
+        for (uint32_t i=0; i < dst->num_buckets; i++) {
+            dst->counts[i] += src->counts[i];
+        }
+        dst->total += src->total;
+    }
+    dst->min = min;
+    dst->max = max;
+    return 0;
+}
+
+/**
+ * Returns the value a bucket stands for, its midpoint
+ * @arg h The histogram
+ * @arg idx The index of the bucket
+ * @return The value
+ */
+double hdr_bucket_value(hdr_histogram *h, uint32_t idx) {
+    uint32_t half = 1 << (h->sub_bits - 1);
+    uint32_t shift = (idx < 2 * half) ? 0 : idx / half - 1;
+    uint64_t low = (uint64_t)(idx - (shift << (h->sub_bits - 1))) << shift;
+    return ldexp((low + ldexp(1, shift) / 2) * HDR_LOWEST, -(int)h->sub_bits);
+}
+
+// Returns the value of a bucket, kept within the min and max
+static double clamped_value(hdr_histogram *h, uint32_t idx) {
+    double val = hdr_bucket_value(h, idx);
+    if (val < h->min) return h->min;
+    if (val > h->max) return h->max;
+    return val;
+}
+
+/**
+ * Queries for a quantile value, the nearest rank of the
+ * values to the relative error, kept within the min and max.
+ * @arg h The histogram to query
+ * @arg quantile The quantile to query, on [0, 1]
+ * @return The value on success or 0.
+ */
+double hdr_query(hdr_histogram *h, double quantile) {
+    double val = 0;
+    hdr_query_many(h, &quantile, 1, &val);
+    return val;
+}
+
+/**
+ * Queries for several quantile values with a single walk of the counts
+ * @arg h The histogram to query
+ * @arg quantiles A sorted array of the quantiles to query
+ * @arg num_quants The number of quantiles
+ * @arg values Output. The value of each quantile.
+ */
+void hdr_query_many(hdr_histogram *h, const double *quantiles, int num_quants, double *values) {
+    if (!h->total) {
+        for (int i=0; i < num_quants; i++) values[i] = 0;
+        return;
+    }
+
+    uint64_t seen = 0;
+    uint32_t idx = 0;
+    for (int q=0; q < num_quants; q++) {
+        // The rank of the quantile, from 1 to the total
+        double rank = ceil(quantiles[q] * h->total);
+        if (rank < 1) rank = 1;
+        if (rank > h->total) rank = h->total;
+
+        // Walk on to the bucket that holds the rank, the ends are exact
+        while (seen + h->counts[idx] < rank) seen += h->counts[idx++];
+        if (rank == 1)
+            values[q] = h->min;
+        else if (rank == h->total)
+            values[q] = h->max;
+        else
+            values[q] = clamped_value(h, idx);
+    }
+}
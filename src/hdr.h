@@ -0,0 +1,98 @@
+/**
+ * This module implements a log-linear histogram, in the style of
+ * HdrHistogram. The values are counted in a flat array of buckets,
+ * a linear run of them for each power of two, so every value is
+ * kept to a fixed relative error. Inserts are a few shifts and an
+ * increment, and histograms of the same accuracy merge by adding
+ * their counts. The count, min and max are exact.
+ *
+ * Values are tracked from HDR_LOWEST to HDR_HIGHEST, 1us to 60s for
+ * timers in milliseconds. Those outside are counted in the first and
+ * last buckets, and only the min and max keep them exactly.
+ */
+#ifndef HDR_H
+#define HDR_H
+#include <stdint.h>
+
+// The range of the values kept to the relative error
+#define HDR_LOWEST 0.001
+#define HDR_HIGHEST 60000.0
+
+typedef struct {
+    double eps;             // The relative error of the values
+    uint32_t sub_bits;      // 2^sub_bits linear buckets for the lowest values
+    uint32_t num_buckets;   // Number of counts
+    uint64_t *counts;       // The count of each bucket, allocated on the first add
+    uint64_t total;         // Number of values added
+    double min;             // Minimum value added
+    double max;             // Maximum value added
+} hdr_histogram;
+
+/**
+ * Initializes the histogram
+ * @arg eps The relative error of the values, on (0, 0.5)
+ * @arg h The histogram to initialize
+ * @return 0 on success.
+ */
+int init_hdr(double eps, hdr_histogram *h);
+
+/**
+ * Destroys the histogram
+ * @arg h The histogram to destroy
+ * @return 0 on success.
+ */
+int destroy_hdr(hdr_histogram *h);
+
+/**
+ * Adds a new value to the histogram
+ * @arg h The histogram to add to
+ * @arg val The new value
+ * @return 0 on success.
+ */
+int hdr_add(hdr_histogram *h, double val);
+
+/**
+ * Adds a new value that stands for a number of values
+ * @arg h The histogram to add to
+ * @arg val The new value
+ * @arg weight The number of values it stands for
+ * @return 0 on success.
+ */
+int hdr_add_weighted(hdr_histogram *h, double val, uint64_t weight);
+
+/**
+ * Merges the counts of one histogram into another. Those of
+ * a different accuracy are re-added at the accuracy of dst.
+ * @arg dst The histogram to merge into
+ * @arg src The histogram to merge from, unmodified
+ * @return 0 on success.
+ */
+int hdr_merge(hdr_histogram *dst, hdr_histogram *src);
+
+/**
+ * Returns the value a bucket stands for, its midpoint
+ * @arg h The histogram
+ * @arg idx The index of the bucket
+ * @return The value
+ */
+double hdr_bucket_value(hdr_histogram *h, uint32_t idx);
+
+/**
+ * Queries for a quantile value, the nearest rank of the
+ * values to the relative error, kept within the min and max.
+ * @arg h The histogram to query
+ * @arg quantile The quantile to query, on [0, 1]
+ * @return The value on success or 0.
+ */
+double hdr_query(hdr_histogram *h, double quantile);
+
+/**
+ * Queries for several quantile values with a single walk of the counts
+ * @arg h The histogram to query
+ * @arg quantiles A sorted array of the quantiles to query
+ * @arg num_quants The number of quantiles
+ * @arg values Output. The value of each quantile.
+ */
+void hdr_query_many(hdr_histogram *h, const double *quantiles, int num_quants, double *values);
+
+#endif
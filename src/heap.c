@@ -4,8 +4,6 @@
  * data structure.
  */
 
-#include <unistd.h>
-#include <sys/mman.h>
 #include <assert.h>
 #include <strings.h>
 #include <string.h>
@@ -31,51 +29,28 @@
 
 
 
-/**
- * Stores the number of heap_entry structures
- * we can fit into a single page of memory.
- *
- * This is determined by the page size, so we
- * need to determine this at run time.
- */
-static int ENTRIES_PER_PAGE = 0;
-
-/**
- * Stores the number of bytes in a single
- * page of memory.
- */
-static int PAGE_SIZE = 0;
-
-// Helper function to map a number of pages into memory
-// Returns NULL on error, otherwise returns a pointer to the
-// first page.
-static void* map_in_pages(int page_count) {
-    // Check everything
-    assert(page_count > 0);
-
-    // Call malloc to get the pages
-    void* addr = malloc(page_count*PAGE_SIZE);
-
-    if (!addr)
-        return NULL;
-    else {
-        // Clear the memory
-        bzero(addr,page_count*PAGE_SIZE);
-
-        // Return the address
-        return addr;
+// Helper function to move the table to one with a new size.
+// Small tables use the inline storage, others are malloc'd.
+static void resize_table(heap* h, int new_size) {
+    heap_entry* new_table;
+    if (new_size <= HEAP_INLINE_ENTRIES) {
+        new_size = HEAP_INLINE_ENTRIES;
+        new_table = h->inline_table;
+    } else {
+        new_table = malloc(new_size * sizeof(heap_entry));
+        assert(new_table != NULL);
     }
-}
+    if (new_table == h->table) return;
 
+    // Copy the active entries
+    memcpy(new_table, h->table, h->active_entries * sizeof(heap_entry));
 
-// Helper function to map a number of pages out of memory
-static void map_out_pages(void* addr, int page_count) {
-    // Check everything
-    assert(addr != NULL);
-    assert(page_count > 0);
+    // Cleanup the old table
+    if (h->table != h->inline_table) free(h->table);
 
-    // Call munmap to get rid of the pages
-    free(addr);
+    // Switch to the new table
+    h->table = new_table;
+    h->allocated_entries = new_size;
 }
 
 
@@ -97,18 +72,9 @@ int compare_int_keys(register void* key1, register void* key2) {
 
 // Creates a new heap
 void heap_create(heap* h, int initial_size, int (*comp_func)(void*,void*)) {
-    // Check if we need to setup our globals
-    if (PAGE_SIZE == 0) {
-        // Get the page size
-        PAGE_SIZE = getpagesize();
-
-        // Calculate the max entries
-        ENTRIES_PER_PAGE = PAGE_SIZE / sizeof(heap_entry);
-    }
-
-    // Check that initial size is greater than 0, else set it to ENTRIES_PER_PAGE
+    // Check that initial size is greater than 0, else use the inline size
     if (initial_size <= 0)
-        initial_size = ENTRIES_PER_PAGE;
+        initial_size = HEAP_INLINE_ENTRIES;
 
     // If the comp_func is null, treat the keys as signed ints
     if (comp_func == NULL)
@@ -121,12 +87,11 @@ void heap_create(heap* h, int initial_size, int (*comp_func)(void*,void*)) {
     // Set active entries to 0
     h->active_entries = 0;
 
-    // Determine how many pages of entries we need
-    h->allocated_pages = initial_size / ENTRIES_PER_PAGE + ((initial_size % ENTRIES_PER_PAGE > 0) ? 1 : 0);
-    h->minimum_pages = h->allocated_pages;
-
-    // Allocate the table
-    h->table = (void*)map_in_pages(h->allocated_pages);
+    // Start with the inline table, and grow if needed
+    h->table = h->inline_table;
+    h->allocated_entries = HEAP_INLINE_ENTRIES;
+    resize_table(h, initial_size);
+    h->minimum_entries = h->allocated_entries;
 }
 
 
@@ -135,12 +100,12 @@ void heap_destroy(heap* h) {
     // Check that h is not null
     assert(h != NULL);
 
-    // Map out the table
-    map_out_pages(h->table, h->allocated_pages);
+    // Free the table
+    if (h->table != h->inline_table) free(h->table);
 
     // Clear everything
     h->active_entries = 0;
-    h->allocated_pages = 0;
+    h->allocated_entries = 0;
     h->table = NULL;
 }
 
@@ -175,24 +140,9 @@ void heap_insert(heap *h, void* key, void* value) {
     // Check if this heap is not destoyed
     assert(h->table != NULL);
 
-    // Check if we have room
-    int max_entries = h->allocated_pages * ENTRIES_PER_PAGE;
-    if (h->active_entries + 1 > max_entries) {
-        // Get the new number of entries we need
-        int new_size = h->allocated_pages * 2;
-
-        // Map in a new table
-        heap_entry* new_table = map_in_pages(new_size);
-
-        // Copy the old entries, copy the entire pages
-        memcpy(new_table, h->table, h->allocated_pages*PAGE_SIZE);
-
-        // Cleanup the old table
-        map_out_pages(h->table, h->allocated_pages);
-
-        // Switch to the new table
-        h->table = new_table;
-        h->allocated_pages = new_size;
+    // Check if we have room, double the size if not
+    if (h->active_entries + 1 > h->allocated_entries) {
+        resize_table(h, h->allocated_entries * 2);
     }
 
     // Store the comparison function
@@ -332,26 +282,9 @@ int heap_delmin(heap* h, void** key, void** value) {
         }
     }
 
-    // Check if we should release a page of memory
-    int used_pages = entries / ENTRIES_PER_PAGE + ((entries % ENTRIES_PER_PAGE > 0) ? 1 : 0);
-
-    // Allow one empty page, but not two
-    if (h->allocated_pages / 2 > used_pages + 1 && h->allocated_pages / 2 >= h->minimum_pages) {
-        // Get the new number of entries we need
-        int new_size = h->allocated_pages / 2;
-
-        // Map in a new table
-        heap_entry* new_table = map_in_pages(new_size);
-
-        // Copy the old entries, copy the entire pages
-        memcpy(new_table, h->table, used_pages*PAGE_SIZE);
-
-        // Cleanup the old table
-        map_out_pages(h->table, h->allocated_pages);
-
-        // Switch to the new table
-        h->table = new_table;
-        h->allocated_pages = new_size;
+    // Shrink the table once it is a quarter full, but not below the initial size
+    if (h->allocated_entries / 4 >= entries && h->allocated_entries / 2 >= h->minimum_entries) {
+        resize_table(h, h->allocated_entries / 2);
     }
 
     // Success
@@ -14,13 +14,18 @@ typedef struct heap_entry {
 } heap_entry;
 
 
-// Main struct for representing the heap
+// Number of entries stored inside the heap struct itself
+#define HEAP_INLINE_ENTRIES 8
+
+// Main struct for representing the heap. The table may point
+// into the struct, so it must not be copied once created.
 typedef struct heap {
     int (*compare_func)(void*, void*); // The key comparison function to use
-    int active_entries;  // The number of entries in the heap
-    int minimum_pages;   // The minimum number of pages to maintain, based on the initial cap.
-    int allocated_pages; // The number of pages in memory that are allocated
-    heap_entry* table; // Pointer to the table, which maps to the pages
+    int active_entries;    // The number of entries in the heap
+    int minimum_entries;   // The minimum number of entries to maintain, based on the initial cap.
+    int allocated_entries; // The number of entries the table can hold
+    heap_entry* table;     // Pointer to the table, either inline_table or malloc'd
+    heap_entry inline_table[HEAP_INLINE_ENTRIES]; // Storage for small heaps
 } heap;
 
 // Functions
@@ -29,7 +34,7 @@ typedef struct heap {
  * Creates a new heap
  * @param h Pointer to a heap structure that is initialized
  * @param initial_size What should the initial size of the heap be. If <= 0, then it will be set to the minimum
- * permissable size, of 1 page (512 entries on 32bit system with 4K pages).
+ * permissable size, of HEAP_INLINE_ENTRIES. Heaps of up to that size are stored inline, and need no allocation.
  * @param comp_func A pointer to a function that can be used to compare the keys. If NULL, it will be set
  * to a function which treats keys as signed ints. This function must take two keys, given as pointers and return an int.
  * It should return -1 if key 1 is smaller, 0 if they are equal, and 1 if key 2 is smaller.
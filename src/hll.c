@@ -4,8 +4,11 @@
 State of The Art Cardinality Estimation Algorithm"
  *
  * We implement a HyperLogLog using 6 bits for register,
- * and a 64bit hash function. For our needs, we always use
- * a dense representation and avoid the sparse/dense conversions.
+ * and a 64bit hash function. New HLLs use the sparse representation,
+ * a sorted list of the non-zero registers. It is converted to the dense
+ * representation once the list would be larger than the registers.
+ * Unlike the paper, the sparse list uses the same precision as the
+ * dense registers, so estimates do not change with the conversion.
  *
  */
 #include <stdlib.h>
@@ -15,16 +18,40 @@ State of The Art Cardinality Estimation Algorithm"
 #include <stdint.h>
 #include <stdio.h>
 #include "hll.h"
+#include "hash.h"
 #include "hll_constants.h"
+#include "stats.h"
+#include "cpu_features.h"
 
 #define REG_WIDTH 6     // Bits per register
 #define INT_WIDTH 32    // Bits in an int
 #define REG_PER_WORD 5  // floor(INT_WIDTH / REG_WIDTH)
 
 #define NUM_REG(precision) ((1 << precision))
+#ifdef HLL_BYTE_REGISTERS
+#define NUM_WORDS(precision) (NUM_REG(precision))
+#else
+#define NUM_WORDS(precision) ((NUM_REG(precision) + REG_PER_WORD - 1) / REG_PER_WORD)
+#endif
+
+// The sparse list is never larger than the dense registers
+#define SPARSE_MAX(precision) (NUM_WORDS(precision) * sizeof(hll_register) / sizeof(uint32_t))
+
+// Sparse entries store the register index above the value
+#define SPARSE_VAL_BITS 8
+#define SPARSE_ENTRY(idx, val) (((uint32_t)(idx) << SPARSE_VAL_BITS) | (val))
+#define SPARSE_IDX(entry) ((entry) >> SPARSE_VAL_BITS)
+#define SPARSE_VAL(entry) ((entry) & ((1 << SPARSE_VAL_BITS) - 1))
+#define SPARSE_INIT_SIZE 16
 
-// Link the external murmur hash in
-extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
+/*
+ * The sum of 2^-val over the registers is kept in fixed point, as
+ * two words split at a value of 32, so it is exact and the same
+ * however the registers were updated. Values past 64 are too small
+ * to change the estimate, and are only counted as non-zero.
+ */
+#define INV_SPLIT 32
+#define INV_MAX 64
 
 
 /**
@@ -41,15 +68,16 @@ int hll_init(unsigned char precision, hll_t *h) {
     // Store precision
     h->precision = precision;
 
-    // Determine how many registers are needed
-    int reg = NUM_REG(precision);
-
-    // Get the full words required
-    int words = ceil(reg / (double)REG_PER_WORD);
+    // Start with an empty sparse list
+    h->registers = NULL;
+    h->sparse = NULL;
+    h->sparse_len = 0;
+    h->sparse_size = 0;
 
-    // Allocate and zero out the registers
-    h->registers = calloc(words, sizeof(uint32_t));
-    if (!h->registers) return -1;
+    // All the registers start at zero
+    h->num_zero = NUM_REG(precision);
+    h->inv_hi = (uint64_t)NUM_REG(precision) << INV_SPLIT;
+    h->inv_lo = 0;
     return 0;
 }
 
@@ -59,10 +87,24 @@ int hll_init(unsigned char precision, hll_t *h) {
  * @return 0 on success
  */
 int hll_destroy(hll_t *h) {
+    stats_mem_add(MEM_SETS, -(int64_t)(h->sparse_size * sizeof(uint32_t) +
+                ((h->registers) ? NUM_WORDS(h->precision) * sizeof(hll_register) : 0)));
     free(h->registers);
+    free(h->sparse);
+    h->registers = NULL;
+    h->sparse = NULL;
     return 0;
 }
 
+#ifdef HLL_BYTE_REGISTERS
+static inline int get_register(hll_t *h, int idx) {
+    return h->registers[idx];
+}
+
+static inline void set_register(hll_t *h, int idx, int val) {
+    h->registers[idx] = val;
+}
+#else
 static int get_register(hll_t *h, int idx) {
     uint32_t word = *(h->registers + (idx / REG_PER_WORD));
     word = word >> REG_WIDTH * (idx % REG_PER_WORD);
@@ -80,6 +122,131 @@ static void set_register(hll_t *h, int idx, int val) {
     // Store the word
     *word = (*word & ~val_mask) | val;
 }
+#endif
+
+// Adds the term of a register value to the sums
+static inline void add_inverse(hll_t *h, int val) {
+    if (val <= INV_SPLIT)
+        h->inv_hi += 1ULL << (INV_SPLIT - val);
+    else if (val <= INV_MAX)
+        h->inv_lo += 1ULL << (INV_MAX - val);
+}
+
+// Removes the term of a register value from the sums
+static inline void sub_inverse(hll_t *h, int val) {
+    if (val <= INV_SPLIT)
+        h->inv_hi -= 1ULL << (INV_SPLIT - val);
+    else if (val <= INV_MAX)
+        h->inv_lo -= 1ULL << (INV_MAX - val);
+}
+
+// Updates the sums for a register raised from old to val
+static inline void count_register(hll_t *h, int old, int val) {
+    if (!old) h->num_zero--;
+    sub_inverse(h, old);
+    add_inverse(h, val);
+}
+
+/**
+ * Recomputes the sums of the registers kept for the estimate,
+ * after the dense registers were set directly.
+ * @arg h The hll to recount
+ */
+void hll_recount(hll_t *h) {
+    int num_reg = NUM_REG(h->precision), val;
+    h->num_zero = num_reg;
+    h->inv_hi = (uint64_t)num_reg << INV_SPLIT;
+    h->inv_lo = 0;
+    if (h->registers) {
+        for (int i=0; i < num_reg; i++) {
+            if ((val = get_register(h, i))) count_register(h, 0, val);
+        }
+    } else {
+        for (uint32_t i=0; i < h->sparse_len; i++) {
+            if ((val = SPARSE_VAL(h->sparse[i]))) count_register(h, 0, val);
+        }
+    }
+}
+
+/**
+ * Converts the sparse list to dense registers
+ * @return 0 on success
+ */
+static int convert_sparse_to_dense(hll_t *h) {
+    h->registers = calloc(NUM_WORDS(h->precision), sizeof(hll_register));
+    if (!h->registers) return -1;
+    stats_mem_add(MEM_SETS, NUM_WORDS(h->precision) * sizeof(hll_register) -
+            (int64_t)(h->sparse_size * sizeof(uint32_t)));
+    for (uint32_t i=0; i < h->sparse_len; i++) {
+        set_register(h, SPARSE_IDX(h->sparse[i]), SPARSE_VAL(h->sparse[i]));
+    }
+    free(h->sparse);
+    h->sparse = NULL;
+    h->sparse_len = 0;
+    h->sparse_size = 0;
+    return 0;
+}
+
+/**
+ * Sets a register to the maximum of its value and a new
+ * value, in either representation. The sparse list is kept
+ * sorted by index, and converted when it gets too large.
+ */
+static void update_register(hll_t *h, int idx, int val) {
+    int old;
+    if (h->registers) {
+        if (val > (old = get_register(h, idx))) {
+            set_register(h, idx, val);
+            count_register(h, old, val);
+        }
+        return;
+    }
+
+    // Binary search for the index
+    uint32_t low = 0, high = h->sparse_len, mid;
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (SPARSE_IDX(h->sparse[mid]) < idx)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    // Update an existing entry
+    if (low < h->sparse_len && SPARSE_IDX(h->sparse[low]) == idx) {
+        if (val > (old = SPARSE_VAL(h->sparse[low]))) {
+            h->sparse[low] = SPARSE_ENTRY(idx, val);
+            count_register(h, old, val);
+        }
+        return;
+    }
+
+    // Switch to dense once the list would outgrow the registers
+    if (h->sparse_len + 1 > SPARSE_MAX(h->precision)) {
+        if (!convert_sparse_to_dense(h)) {
+            set_register(h, idx, val);
+            count_register(h, 0, val);
+        }
+        return;
+    }
+
+    // Grow the list if needed
+    if (h->sparse_len == h->sparse_size) {
+        uint32_t size = (h->sparse_size) ? h->sparse_size * 2 : SPARSE_INIT_SIZE;
+        if (size > SPARSE_MAX(h->precision)) size = SPARSE_MAX(h->precision);
+        uint32_t *sparse = realloc(h->sparse, size * sizeof(uint32_t));
+        if (!sparse) return;
+        stats_mem_add(MEM_SETS, (size - h->sparse_size) * sizeof(uint32_t));
+        h->sparse = sparse;
+        h->sparse_size = size;
+    }
+
+    // Insert the new entry in order
+    memmove(h->sparse + low + 1, h->sparse + low, (h->sparse_len - low) * sizeof(uint32_t));
+    h->sparse[low] = SPARSE_ENTRY(idx, val);
+    h->sparse_len++;
+    count_register(h, 0, val);
+}
 
 /**
  * Adds a new key to the HLL
@@ -87,12 +254,8 @@ static void set_register(hll_t *h, int idx, int val) {
  * @arg key The key to add
  */
 void hll_add(hll_t *h, char *key) {
-    // Compute the hash value of the key
-    uint64_t out[2];
-    MurmurHash3_x64_128(key, strlen(key), 0, &out);
-
     // Add the hashed value
-    hll_add_hash(h, out[1]);
+    hll_add_hash(h, hash_key(key, strlen(key)));
 }
 
 /**
@@ -111,11 +274,128 @@ void hll_add_hash(hll_t *h, uint64_t hash) {
     int leading = __builtin_clzll(hash) + 1;
 
     // Update the register if the new value is larger
-    if (leading > get_register(h, idx)) {
-        set_register(h, idx, leading);
+    update_register(h, idx, leading);
+}
+
+/**
+ * Sets a register to the maximum of its value and a new value
+ * @arg h The hll to update
+ * @arg idx The index of the register
+ * @arg val The new value
+ */
+void hll_set_max(hll_t *h, uint32_t idx, int val) {
+    update_register(h, idx, val);
+}
+
+/**
+ * Sets a register of a lower precision HLL from a register of a
+ * higher one. The index bits that are dropped are the leading bits
+ * of the rest of the hash at the lower precision, so the value is
+ * counted from the first of them that is set, or past all of them.
+ */
+static void fold_register(hll_t *dst, unsigned char precision, uint32_t idx, int val) {
+    int shift = precision - dst->precision;
+    uint32_t low = idx & ((1 << shift) - 1);
+    val = (low) ? shift - (31 - __builtin_clz(low)) : val + shift;
+    update_register(dst, idx >> shift, val);
+}
+
+// Merges an HLL of a higher precision, folding each register
+static void merge_folded(hll_t *dst, hll_t *src) {
+    if (src->sparse) {
+        for (uint32_t i=0; i < src->sparse_len; i++) {
+            fold_register(dst, src->precision, SPARSE_IDX(src->sparse[i]), SPARSE_VAL(src->sparse[i]));
+        }
+    } else if (src->registers) {
+        int num_reg = NUM_REG(src->precision), val;
+        for (int i=0; i < num_reg; i++) {
+            if ((val = get_register(src, i))) fold_register(dst, src->precision, i, val);
+        }
     }
 }
 
+/**
+ * Lowers the precision of an HLL, keeping the estimate
+ * it would have had if the hashes were added at that precision.
+ * @arg h The hll to fold
+ * @arg precision The new precision, lower than the current one
+ * @return 0 on success.
+ */
+int hll_fold(hll_t *h, unsigned char precision) {
+    if (precision >= h->precision) return -1;
+    hll_t folded;
+    if (hll_init(precision, &folded)) return -1;
+    merge_folded(&folded, h);
+    hll_destroy(h);
+    *h = folded;
+    return 0;
+}
+
+/**
+ * Merges one HLL into another, by taking the
+ * maximum of each register. HLLs of different precisions
+ * are merged at the lower one, and the destination is
+ * folded down if it is the higher.
+ * @arg dst The hll to merge into
+ * @arg src The hll to merge from
+ * @return 0 on success.
+ */
+#ifdef HLL_BYTE_REGISTERS
+// A plain byte max, which the compiler vectorizes
+static inline __attribute__((always_inline)) void max_registers(hll_register *d, hll_register *s, int num) {
+    for (int i=0; i < num; i++) {
+        d[i] = (s[i] > d[i]) ? s[i] : d[i];
+    }
+}
+
+#ifdef HAVE_SIMD_X86
+// The same max, vectorized with the AVX2 registers
+__attribute__((target("avx2")))
+static void max_registers_avx2(hll_register *d, hll_register *s, int num) {
+    max_registers(d, s, num);
+}
+#endif
+#endif
+
+int hll_merge(hll_t *dst, hll_t *src) {
+    if (dst->precision > src->precision && hll_fold(dst, src->precision)) return -1;
+    if (dst->precision < src->precision) {
+        merge_folded(dst, src);
+        return 0;
+    }
+
+    // Only the non-zero registers are stored when sparse
+    if (src->sparse) {
+        for (uint32_t i=0; i < src->sparse_len; i++) {
+            update_register(dst, SPARSE_IDX(src->sparse[i]), SPARSE_VAL(src->sparse[i]));
+        }
+        return 0;
+    }
+    if (!src->registers) return 0;
+    if (!dst->registers && convert_sparse_to_dense(dst)) return -1;
+
+    int num_reg = NUM_REG(dst->precision);
+#ifdef HLL_BYTE_REGISTERS
+#ifdef HAVE_SIMD_X86
+    if (simd_current() >= SIMD_AVX2)
+        max_registers_avx2(dst->registers, src->registers, num_reg);
+    else
+#endif
+        max_registers(dst->registers, src->registers, num_reg);
+    hll_recount(dst);
+#else
+    int reg_val, old;
+    for (int i=0; i < num_reg; i++) {
+        reg_val = get_register(src, i);
+        if (reg_val > (old = get_register(dst, i))) {
+            set_register(dst, i, reg_val);
+            count_register(dst, old, reg_val);
+        }
+    }
+#endif
+    return 0;
+}
+
 /*
  * Returns the bias correctors from the
  * hyperloglog paper
@@ -135,19 +415,12 @@ static double alpha(unsigned char precision) {
 
 /*
  * Computes the raw cardinality estimate
+ * from the sums of the registers
  */
-static double raw_estimate(hll_t *h, int *num_zero) {
-    unsigned char precision = h->precision;
-    int num_reg = NUM_REG(precision);
-    double multi = alpha(precision) * num_reg * num_reg;
-
-    int reg_val;
-    double inv_sum = 0;
-    for (int i=0; i < num_reg; i++) {
-        reg_val = get_register(h, i);
-        inv_sum += pow(2.0, -1 * reg_val);
-        if (!reg_val) *num_zero += 1;
-    }
+static double raw_estimate(hll_t *h) {
+    int num_reg = NUM_REG(h->precision);
+    double multi = alpha(h->precision) * num_reg * num_reg;
+    double inv_sum = ldexp(h->inv_hi, -INV_SPLIT) + ldexp(h->inv_lo, -INV_MAX);
     return multi * (1.0 / inv_sum);
 }
 
@@ -221,8 +494,8 @@ static double bias_estimate(hll_t *h, double raw_est) {
  * @return An estimate of the cardinality
  */
 double hll_size(hll_t *h) {
-    int num_zero = 0;
-    double raw_est = raw_estimate(h, &num_zero);
+    int num_zero = h->num_zero;
+    double raw_est = raw_estimate(h);
 
     // Check if we need to apply bias correction
     int num_reg = NUM_REG(h->precision);
@@ -247,6 +520,15 @@ double hll_size(hll_t *h) {
 }
 
 
+/**
+ * Returns the size in bytes of the dense registers
+ * @arg precision The digits of precision
+ * @return The number of bytes
+ */
+uint32_t hll_dense_bytes(unsigned char precision) {
+    return NUM_WORDS(precision) * sizeof(hll_register);
+}
+
 /**
  * Computes the minimum number of registers
  * needed to hit a target error.
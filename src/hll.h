@@ -7,13 +7,31 @@
 #define HLL_MIN_PRECISION 4      // 16 registers
 #define HLL_MAX_PRECISION 18     // 262,144 registers
 
+/*
+ * Dense registers are packed five to a 32bit word by default.
+ * Building with HLL_BYTE_REGISTERS uses a byte per register
+ * instead, which uses 60% more memory but is faster to update.
+ */
+#ifdef HLL_BYTE_REGISTERS
+typedef uint8_t hll_register;
+#else
+typedef uint32_t hll_register;
+#endif
+
 typedef struct {
     unsigned char precision;
-    uint32_t *registers;
+    hll_register *registers; // Dense registers, NULL while sparse
+    uint32_t *sparse;       // Sorted (index, value) pairs, NULL once dense
+    uint32_t sparse_len;    // Number of sparse entries
+    uint32_t sparse_size;   // Allocated size of the sparse entries
+    uint32_t num_zero;      // Number of registers that are zero
+    uint64_t inv_hi;        // Sum of 2^-val of the registers up to 32, in units of 2^-32
+    uint64_t inv_lo;        // Sum of 2^-val of the larger registers, in units of 2^-64
 } hll_t;
 
 /**
- * Initializes a new HLL
+ * Initializes a new HLL. It starts with a sparse representation,
+ * and converts to dense registers once that would use less memory.
  * @arg precision The digits of precision to use
  * @arg h The HLL to initialize
  * @return 0 on success
@@ -41,12 +59,57 @@ void hll_add(hll_t *h, char *key);
 void hll_add_hash(hll_t *h, uint64_t hash);
 
 /**
- * Estimates the cardinality of the HLL
+ * Sets a register to the maximum of its value and a new
+ * value, used to rebuild an HLL from its registers.
+ * @arg h The hll to update
+ * @arg idx The index of the register
+ * @arg val The new value
+ */
+void hll_set_max(hll_t *h, uint32_t idx, int val);
+
+/**
+ * Recomputes the sums of the registers kept for the estimate,
+ * after the dense registers were set directly, as when they
+ * are copied or viewed in place.
+ * @arg h The hll to recount
+ */
+void hll_recount(hll_t *h);
+
+/**
+ * Merges one HLL into another, by taking the
+ * maximum of each register. HLLs of different precisions
+ * are merged at the lower one, and the destination is
+ * folded down if it is the higher.
+ * @arg dst The hll to merge into
+ * @arg src The hll to merge from
+ * @return 0 on success.
+ */
+int hll_merge(hll_t *dst, hll_t *src);
+
+/**
+ * Lowers the precision of an HLL, keeping the estimate
+ * it would have had if the hashes were added at that precision.
+ * @arg h The hll to fold
+ * @arg precision The new precision, lower than the current one
+ * @return 0 on success.
+ */
+int hll_fold(hll_t *h, unsigned char precision);
+
+/**
+ * Estimates the cardinality of the HLL. The sums of the registers
+ * are kept as they are updated, so this does not scan them.
  * @arg h The hll to query
  * @return An estimate of the cardinality
  */
 double hll_size(hll_t *h);
 
+/**
+ * Returns the size in bytes of the dense registers
+ * @arg precision The digits of precision
+ * @return The number of bytes
+ */
+uint32_t hll_dense_bytes(unsigned char precision);
+
 /**
  * Computes the minimum digits of precision
  * needed to hit a target error.
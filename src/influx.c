@@ -0,0 +1,584 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <netdb.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "format.h"
+#include "influx.h"
+#include "name_map.h"
+
+// Default timeout for connecting and each response
+#define INFLUX_TIMEOUT_MS 5000
+
+// Initial size of the output buffer
+#define INFLUX_INIT_BUFFER 65536
+
+// Initial number of batches of the buffer
+#define INFLUX_INIT_BATCHES 64
+
+// Times a batch is posted before it is dropped
+#define INFLUX_TRIES 2
+
+// Most requests in flight at once
+#define INFLUX_MAX_CONNS 64
+
+// Struct to hold the callback info
+struct influx_info {
+    influx_output *o;
+    char ts[FORMAT_INT_MAX + 2];    // The " <timestamp>\n" tail of each point
+    int ts_len;
+};
+
+/**
+ * Initializes an InfluxDB output. The connections are
+ * made lazily, and kept open between the flushes.
+ * @arg host The InfluxDB host, this is copied
+ * @arg port The InfluxDB HTTP port
+ * @arg db The database to write to, this is copied
+ * @arg batch_size The points posted in each request
+ * @arg num_conns The requests in flight at once
+ * @arg parse_tags Set if the ;tag=value of the names are sent as tags
+ * @arg o The output to initialize
+ * @return 0 on success.
+ */
+int init_influx_output(char *host, int port, char *db, int batch_size,
+        int num_conns, int parse_tags, influx_output *o) {
+    memset(o, 0, sizeof(influx_output));
+    if (num_conns < 1 || num_conns > INFLUX_MAX_CONNS || batch_size < 1) return -1;
+    o->host = strdup(host);
+    o->port = port;
+    o->path = malloc(strlen(db) + 32);
+    sprintf(o->path, "/write?db=%s&precision=s", db);
+    o->parse_tags = parse_tags;
+    o->batch_size = batch_size;
+    o->num_conns = num_conns;
+    o->conns = calloc(num_conns, sizeof(influx_conn));
+    for (int i=0; i < num_conns; i++) {
+        o->conns[i].fd = -1;
+        o->conns[i].batch = -1;
+    }
+    o->buf_size = INFLUX_INIT_BUFFER;
+    o->buf = malloc(o->buf_size);
+    o->max_batches = INFLUX_INIT_BATCHES;
+    o->batches = malloc(o->max_batches * sizeof(size_t));
+    o->tries = malloc(o->max_batches * sizeof(int));
+    o->retries = malloc(o->max_batches * sizeof(int));
+    o->timeout_ms = INFLUX_TIMEOUT_MS;
+    return pthread_mutex_init(&o->lock, NULL);
+}
+
+/**
+ * Closes the connections and frees the output.
+ * @return 0 on success.
+ */
+int destroy_influx_output(influx_output *o) {
+    for (int i=0; i < o->num_conns; i++) {
+        if (o->conns[i].fd >= 0) close(o->conns[i].fd);
+    }
+    free(o->conns);
+    free(o->host);
+    free(o->path);
+    free(o->buf);
+    free(o->batches);
+    free(o->tries);
+    free(o->retries);
+    pthread_mutex_destroy(&o->lock);
+    return 0;
+}
+
+/**
+ * Makes room in the output buffer
+ * @return Where to write the next len bytes
+ */
+static char* influx_room(influx_output *o, size_t len) {
+    if (o->buf_len + len > o->buf_size) {
+        while (o->buf_len + len > o->buf_size) o->buf_size *= 2;
+        o->buf = realloc(o->buf, o->buf_size);
+    }
+    return o->buf + o->buf_len;
+}
+
+/**
+ * Appends a part of a point, with a backslash before
+ * each of the special characters
+ */
+static void influx_escaped(influx_output *o, const char *s, size_t len, const char *special) {
+    char *out = influx_room(o, 2 * len);
+    for (size_t i=0; i < len; i++) {
+        if (strchr(special, s[i])) *out++ = '\\';
+        *out++ = s[i];
+    }
+    o->buf_len = out - o->buf;
+}
+
+/**
+ * Appends the measurement of a name, and the tags of
+ * its ;tag=value suffix if they are parsed
+ */
+static void influx_series(influx_output *o, char *name) {
+    char *tags = (o->parse_tags) ? strchr(name, ';') : NULL;
+    size_t len = (tags) ? (size_t)(tags - name) : strlen(name);
+    influx_escaped(o, name, len, ", ");
+    while (tags) {
+        char *tag = tags + 1;
+        tags = strchr(tag, ';');
+        len = (tags) ? (size_t)(tags - tag) : strlen(tag);
+
+        // A tag needs a key and a value
+        char *eq = memchr(tag, '=', len);
+        if (!eq || eq == tag || eq == tag + len - 1) continue;
+        *influx_room(o, 1) = ',';
+        o->buf_len++;
+        influx_escaped(o, tag, eq - tag, ",= ");
+        *influx_room(o, 1) = '=';
+        o->buf_len++;
+        influx_escaped(o, eq + 1, tag + len - eq - 1, ",= ");
+    }
+}
+
+/**
+ * Appends the key of a field, after the separator before it
+ * @arg fields The fields of the point so far, which is counted
+ */
+static char* influx_key(influx_output *o, int *fields, const char *key, size_t key_len) {
+    char *out = influx_room(o, key_len + FORMAT_DOUBLE_MAX + 3);
+    *out++ = (*fields)++ ? ',' : ' ';
+    memcpy(out, key, key_len);
+    out += key_len;
+    *out++ = '=';
+    return out;
+}
+
+// Appends a float field, those that are not finite are left out
+static void influx_double(influx_output *o, int *fields, const char *key, size_t key_len, double val) {
+    if (!isfinite(val)) return;
+    char *out = influx_key(o, fields, key, key_len);
+    out += format_double(out, val, 6);
+    o->buf_len = out - o->buf;
+}
+
+// Appends an integer field
+static void influx_int(influx_output *o, int *fields, const char *key, size_t key_len, long long val) {
+    char *out = influx_key(o, fields, key, key_len);
+    out += format_int(out, val);
+    *out++ = 'i';
+    o->buf_len = out - o->buf;
+}
+
+/**
+ * Starts a new batch at the end of the buffer
+ */
+static void influx_new_batch(influx_output *o) {
+    if (o->num_batches == o->max_batches) {
+        o->max_batches *= 2;
+        o->batches = realloc(o->batches, o->max_batches * sizeof(size_t));
+        o->tries = realloc(o->tries, o->max_batches * sizeof(int));
+        o->retries = realloc(o->retries, o->max_batches * sizeof(int));
+    }
+    o->batches[o->num_batches] = o->buf_len;
+    o->tries[o->num_batches] = 0;
+    o->num_batches++;
+    o->batch_points = 0;
+}
+
+// Returns the end of a batch in the buffer
+static size_t influx_batch_end(influx_output *o, int batch) {
+    return (batch + 1 < o->num_batches) ? o->batches[batch + 1] : o->buf_len;
+}
+
+/**
+ * Closes a connection, it is re-opened for the next batch
+ */
+static void influx_disconnect(influx_conn *c) {
+    if (c->fd >= 0) close(c->fd);
+    c->fd = -1;
+}
+
+/**
+ * Ends the batch of a connection that failed. It is posted
+ * again if it may have failed with the connection.
+ * @arg retry Set to post the batch again, if it has tries left
+ */
+static void influx_fail(influx_output *o, influx_conn *c, int retry) {
+    influx_disconnect(c);
+    if (retry && o->tries[c->batch] < INFLUX_TRIES) {
+        o->retries[o->num_retries++] = c->batch;
+    } else {
+        o->failed++;
+        o->done++;
+    }
+    c->batch = -1;
+}
+
+/**
+ * Makes a non-blocking connection to InfluxDB
+ * @return 0 on success.
+ */
+static int influx_connect(influx_output *o, influx_conn *c) {
+    struct addrinfo hints, *addrs, *addr;
+    char port[8];
+    snprintf(port, sizeof(port), "%d", o->port);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int res = getaddrinfo(o->host, port, &hints, &addrs);
+    if (res) {
+        syslog(LOG_ERR, "Failed to resolve InfluxDB host %s: %s", o->host, gai_strerror(res));
+        return -1;
+    }
+
+    // Try each address in turn
+    for (addr = addrs; addr; addr = addr->ai_next) {
+        c->fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (c->fd < 0) continue;
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+
+        // Wait for the connect to finish
+        struct pollfd pfd = {c->fd, POLLOUT, 0};
+        if (connect(c->fd, addr->ai_addr, addr->ai_addrlen) == 0 ||
+                (errno == EINPROGRESS && poll(&pfd, 1, o->timeout_ms) > 0)) {
+            int err = 0;
+            socklen_t err_len = sizeof(err);
+            getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+            if (!err) break;
+        }
+        influx_disconnect(c);
+    }
+    freeaddrinfo(addrs);
+
+    if (c->fd < 0) {
+        syslog(LOG_ERR, "Failed to connect to InfluxDB at %s:%d", o->host, o->port);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Sends as much of the request of a connection as it takes
+ */
+static void influx_send(influx_output *o, influx_conn *c) {
+    size_t start = o->batches[c->batch];
+    size_t len = influx_batch_end(o, c->batch) - start;
+    while (c->sent < c->head_len + len) {
+        // The head, then the points straight from the buffer
+        struct iovec iov[2];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        size_t body_sent = (c->sent > c->head_len) ? c->sent - c->head_len : 0;
+        if (c->sent < c->head_len) {
+            iov[msg.msg_iovlen++] = (struct iovec){c->head + c->sent, c->head_len - c->sent};
+        }
+        iov[msg.msg_iovlen++] = (struct iovec){o->buf + start + body_sent, len - body_sent};
+        msg.msg_iov = iov;
+
+        ssize_t res = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        if (res > 0) {
+            c->sent += res;
+        } else if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        } else if (res < 0 && errno != EINTR) {
+            syslog(LOG_ERR, "Failed to send to InfluxDB: %s", strerror(errno));
+            influx_fail(o, c, 1);
+            return;
+        }
+    }
+}
+
+/**
+ * Parses the head of a response, once it is all read
+ * @return 0 on success, -1 if it is not a response.
+ */
+static int influx_parse_head(influx_conn *c, char *end) {
+    if (strncmp(c->resp, "HTTP/1.", 7) || c->resp_len < 12) return -1;
+    c->status = atoi(c->resp + 9);
+    if (c->status < 100) return -1;
+
+    // The body is skipped, the server says how long it is
+    size_t body_len = 0;
+    for (char *line = strstr(c->resp, "\r\n") + 2; line < end; line = strstr(line, "\r\n") + 2) {
+        if (!strncasecmp(line, "Content-Length:", 15)) {
+            body_len = strtoul(line + 15, NULL, 10);
+        } else if (!strncasecmp(line, "Connection:", 11)) {
+            if (!strncasecmp(line + 11 + strspn(line + 11, " "), "close", 5)) c->close_after = 1;
+        } else if (!strncasecmp(line, "Transfer-Encoding:", 18)) {
+            // The end of a chunked body is not looked for, the connection is dropped
+            c->close_after = 1;
+        }
+    }
+    size_t read = c->resp_len - (end + 4 - c->resp);
+    c->body_left = (body_len > read) ? body_len - read : 0;
+    return 0;
+}
+
+/**
+ * Reads the response to the request of a connection,
+ * and ends its batch once it is all read
+ */
+static void influx_recv(influx_output *o, influx_conn *c) {
+    char discard[4096];
+    while (!c->status || c->body_left) {
+        ssize_t res;
+        if (c->status) {
+            size_t len = (c->body_left < sizeof(discard)) ? c->body_left : sizeof(discard);
+            res = recv(c->fd, discard, len, 0);
+        } else {
+            res = recv(c->fd, c->resp + c->resp_len, sizeof(c->resp) - 1 - c->resp_len, 0);
+        }
+        if (res < 0 && errno == EINTR) continue;
+        if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+        // A reused connection may have been closed by the server
+        if (res <= 0) {
+            if (res < 0) syslog(LOG_ERR, "Failed to read from InfluxDB: %s", strerror(errno));
+            influx_fail(o, c, 1);
+            return;
+        }
+        if (c->status) {
+            c->body_left -= res;
+            continue;
+        }
+
+        c->resp_len += res;
+        c->resp[c->resp_len] = 0;
+        char *end = strstr(c->resp, "\r\n\r\n");
+        if ((!end && c->resp_len == sizeof(c->resp) - 1) || (end && influx_parse_head(c, end))) {
+            syslog(LOG_ERR, "Bad response from InfluxDB at %s:%d", o->host, o->port);
+            influx_fail(o, c, 0);
+            return;
+        }
+    }
+
+    // Servers errors are retried, a rejected batch would be rejected again
+    if (c->status / 100 != 2) {
+        char *body = strstr(c->resp, "\r\n\r\n") + 4;
+        syslog(LOG_ERR, "InfluxDB failed a batch with status %d: %.*s", c->status,
+                (int)(c->resp_len - (body - c->resp)), body);
+        influx_fail(o, c, c->status / 100 == 5);
+        return;
+    }
+    o->done++;
+    c->batch = -1;
+    if (c->close_after) influx_disconnect(c);
+}
+
+/**
+ * Returns the next batch to post
+ * @return The batch, or -1 if there is none ready.
+ */
+static int influx_next(influx_output *o) {
+    if (o->num_retries) return o->retries[--o->num_retries];
+    if (o->next_batch < o->ready) return o->next_batch++;
+    return -1;
+}
+
+/**
+ * Starts a request for a batch on an idle connection
+ */
+static void influx_start(influx_output *o, influx_conn *c, int batch) {
+    size_t len = influx_batch_end(o, batch) - o->batches[batch];
+    c->batch = batch;
+    c->head_len = snprintf(c->head, sizeof(c->head), "POST %s HTTP/1.1\r\nHost: %s:%d\r\n"
+            "Content-Type: text/plain; charset=utf-8\r\nContent-Length: %zu\r\n\r\n",
+            o->path, o->host, o->port, len);
+    c->sent = 0;
+    c->resp_len = 0;
+    c->status = 0;
+    c->body_left = 0;
+    c->close_after = 0;
+    o->tries[batch]++;
+    influx_send(o, c);
+}
+
+/**
+ * Starts the batches that are ready on the idle connections,
+ * and moves the requests in flight along
+ * @arg timeout The milliseconds to wait for the requests, after
+ * which they fail, or 0 to only take what is there
+ */
+static void influx_pump(influx_output *o, int timeout) {
+    int batch;
+    for (int i=0; i < o->num_conns; i++) {
+        influx_conn *c = o->conns + i;
+        while (c->batch < 0 && !o->down && (batch = influx_next(o)) >= 0) {
+            if (c->fd < 0 && influx_connect(o, c)) {
+                o->retries[o->num_retries++] = batch;
+                o->down = 1;
+                break;
+            }
+            influx_start(o, c, batch);
+        }
+    }
+
+    // Drop the batches that are left if the server is down
+    while (o->down && (batch = influx_next(o)) >= 0) {
+        o->failed++;
+        o->done++;
+    }
+
+    // Wait on the requests in flight
+    struct pollfd pfds[INFLUX_MAX_CONNS];
+    int conns[INFLUX_MAX_CONNS];
+    int num = 0;
+    for (int i=0; i < o->num_conns; i++) {
+        influx_conn *c = o->conns + i;
+        if (c->batch < 0) continue;
+        size_t len = influx_batch_end(o, c->batch) - o->batches[c->batch];
+        pfds[num] = (struct pollfd){c->fd, (c->sent < c->head_len + len) ? POLLOUT : POLLIN, 0};
+        conns[num++] = i;
+    }
+    if (!num) return;
+
+    int res = poll(pfds, num, timeout);
+    if (res < 0) return;
+    if (!res && timeout) {
+        // The rest are dropped, rather than each waiting out the timeout
+        syslog(LOG_ERR, "Timed out posting to InfluxDB at %s:%d", o->host, o->port);
+        for (int i=0; i < num; i++) influx_fail(o, o->conns + conns[i], 0);
+        o->down = 1;
+        return;
+    }
+    for (int i=0; i < num; i++) {
+        if (!pfds[i].revents) continue;
+        influx_conn *c = o->conns + conns[i];
+        if (pfds[i].events == POLLOUT) influx_send(o, c);
+        else influx_recv(o, c);
+    }
+}
+
+/**
+ * Callback to format each metric as a point
+ */
+static int influx_cb(void *data, metric_type type, char *name, void *value) {
+    #define FIELD_DBL(key, val) influx_double(o, &fields, key, sizeof(key) - 1, val)
+    #define FIELD_INT(key, val) influx_int(o, &fields, key, sizeof(key) - 1, val)
+    struct influx_info *info = data;
+    influx_output *o = info->o;
+    size_t start = o->buf_len;
+    int fields = 0;
+    double quants[MAX_QUANTILES];
+    char key[FORMAT_DOUBLE_MAX + 20];
+    timer_hist *t;
+    int i, len;
+
+    influx_series(o, output_name(name));
+    switch (type) {
+        case KEY_VAL:
+        case COUNTER_SUM:
+            FIELD_DBL("value", *(double*)value);
+            break;
+
+        case GAUGE:
+            FIELD_DBL("value", ((gauge_t*)value)->value);
+            break;
+
+        case COUNTER:
+            FIELD_DBL("value", counter_sum(value));
+            break;
+
+        case SET:
+            FIELD_INT("value", set_size(value));
+            break;
+
+        case TIMER:
+            t = (timer_hist*)value;
+            FIELD_DBL("sum", timer_sum(&t->tm));
+            FIELD_DBL("sum_sq", timer_squared_sum(&t->tm));
+            FIELD_DBL("mean", timer_mean(&t->tm));
+            FIELD_DBL("lower", timer_min(&t->tm));
+            FIELD_DBL("upper", timer_max(&t->tm));
+            FIELD_INT("count", timer_count(&t->tm));
+            FIELD_DBL("stdev", timer_stddev(&t->tm));
+            timer_query_many(&t->tm, t->quantiles, t->num_quants, quants);
+            for (i=0; i < t->num_quants; i++) {
+                len = format_quantile_name(key, t->quantiles[i]);
+                influx_double(o, &fields, key, len, quants[i]);
+            }
+
+            // The histogram bins, the automatic ones need more places
+            int num_bins = timer_hist_num_bins(t);
+            int places = (t->conf && t->conf->scale == HISTOGRAM_AUTO) ? 6 : 2;
+            for (i=0; i < num_bins; i++) {
+                uint64_t count = timer_hist_count(t, i);
+                if (t->conf->skip_empty && !count) continue;
+                const char *bound = (i == 0) ? "bin_<" : (i == num_bins - 1) ? "bin_>" : "bin_";
+                len = strlen(bound);
+                memcpy(key, bound, len);
+                len += format_double(key + len, timer_hist_bin_start(t, i), places);
+                influx_int(o, &fields, key, len, count);
+            }
+            break;
+
+        default:
+            syslog(LOG_ERR, "Unknown metric type: %d", type);
+            break;
+    }
+
+    // A point needs a field
+    if (!fields) {
+        o->buf_len = start;
+        return 0;
+    }
+    memcpy(influx_room(o, info->ts_len), info->ts, info->ts_len);
+    o->buf_len += info->ts_len;
+
+    // Post each batch as it fills, while the rest are formatted
+    if (++o->batch_points == o->batch_size) {
+        o->ready = o->num_batches;
+        influx_new_batch(o);
+        influx_pump(o, 0);
+    }
+    return 0;
+}
+
+/**
+ * Formats and posts the metrics to InfluxDB. A batch that
+ * fails on a reused connection, or with a server error, is
+ * posted again once, and is otherwise dropped.
+ * @arg o The output to use
+ * @arg m The metrics to send
+ * @arg tv The timestamp for the metrics
+ * @return 0 on success, -1 if some batches could not be sent.
+ */
+int influx_flush(influx_output *o, metrics *m, struct timeval *tv) {
+    pthread_mutex_lock(&o->lock);
+    o->buf_len = 0;
+    o->num_batches = 0;
+    o->ready = 0;
+    o->next_batch = 0;
+    o->num_retries = 0;
+    o->done = 0;
+    o->failed = 0;
+    o->down = 0;
+    influx_new_batch(o);
+
+    // Format the points, posting the batches as they fill
+    struct influx_info info;
+    info.o = o;
+    info.ts[0] = ' ';
+    info.ts_len = 1 + format_int(info.ts + 1, (long long)tv->tv_sec);
+    info.ts[info.ts_len++] = '\n';
+    metrics_iter(m, &info, influx_cb);
+
+    // Post the rest, the last batch is complete unless it is empty
+    if (!o->batch_points) o->num_batches--;
+    o->ready = o->num_batches;
+    while (o->done < o->num_batches) influx_pump(o, o->timeout_ms);
+
+    int ret = 0;
+    if (o->failed) {
+        syslog(LOG_WARNING, "Dropped %d of %d batches for InfluxDB", o->failed, o->num_batches);
+        ret = -1;
+    }
+    pthread_mutex_unlock(&o->lock);
+    return ret;
+}
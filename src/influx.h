@@ -0,0 +1,88 @@
+/**
+ * This module implements a native InfluxDB output, writing the
+ * line protocol directly to the HTTP write endpoint. Each metric is
+ * a single point, and a timer has its summaries, quantiles and bins
+ * as the fields of one point. The points of a flush are split into
+ * batches, which are posted over several keep-alive connections at
+ * once, and the first batches are sent while the rest are formatted.
+ */
+#ifndef INFLUX_H
+#define INFLUX_H
+#include <pthread.h>
+#include <sys/time.h>
+#include "metrics.h"
+
+// A keep-alive connection, with the request it has in flight
+typedef struct {
+    int fd;             // Connection, -1 if not connected
+    int batch;          // The batch in flight, -1 if idle
+    char head[512];     // The request line and headers of the batch
+    size_t head_len;
+    size_t sent;        // Bytes of the request sent, head included
+    char resp[1024];    // The response head, as it is read
+    size_t resp_len;
+    int status;         // The status of the response, 0 until read
+    size_t body_left;   // Bytes of the response body left to skip
+    int close_after;    // Set if the server ends the connection
+} influx_conn;
+
+typedef struct {
+    char *host;         // InfluxDB host
+    int port;           // InfluxDB HTTP port
+    char *path;         // Path of the write endpoint, with its query
+    int parse_tags;     // Set if the ;tag=value of the names are tags
+    int batch_size;     // Points posted in each request
+    int num_conns;      // Requests in flight at once
+    influx_conn *conns;
+    char *buf;          // The points of the flush
+    size_t buf_len;
+    size_t buf_size;
+    size_t *batches;    // The start of each batch in the buffer
+    int *tries;         // The times each batch was posted
+    int num_batches;
+    int max_batches;
+    int batch_points;   // Points in the last batch
+    int ready;          // Batches that are complete, the last may not be
+    int next_batch;     // The next batch to post
+    int *retries;       // Batches to post again
+    int num_retries;
+    int done;           // Batches posted, or given up on
+    int failed;         // Batches given up on
+    int down;           // Set if a connection could not be made
+    int timeout_ms;     // Timeout for connecting and each response
+    pthread_mutex_t lock; // Serializes overlapping flushes
+} influx_output;
+
+/**
+ * Initializes an InfluxDB output. The connections are
+ * made lazily, and kept open between the flushes.
+ * @arg host The InfluxDB host, this is copied
+ * @arg port The InfluxDB HTTP port
+ * @arg db The database to write to, this is copied
+ * @arg batch_size The points posted in each request
+ * @arg num_conns The requests in flight at once
+ * @arg parse_tags Set if the ;tag=value of the names are sent as tags
+ * @arg o The output to initialize
+ * @return 0 on success.
+ */
+int init_influx_output(char *host, int port, char *db, int batch_size,
+        int num_conns, int parse_tags, influx_output *o);
+
+/**
+ * Formats and posts the metrics to InfluxDB. A batch that
+ * fails on a reused connection, or with a server error, is
+ * posted again once, and is otherwise dropped.
+ * @arg o The output to use
+ * @arg m The metrics to send
+ * @arg tv The timestamp for the metrics
+ * @return 0 on success, -1 if some batches could not be sent.
+ */
+int influx_flush(influx_output *o, metrics *m, struct timeval *tv);
+
+/**
+ * Closes the connections and frees the output.
+ * @return 0 on success.
+ */
+int destroy_influx_output(influx_output *o);
+
+#endif
@@ -0,0 +1,272 @@
+/**
+ * This module generates typed hashmaps that store their values
+ * inline in the table entries, instead of behind a void pointer.
+ * They are used for the small metrics, so that updating a counter
+ * or gauge touches a single cache line without an allocation.
+ *
+ * INLINE_MAP_DEFINE(name, type) declares the map struct `name`
+ * and the static inline functions name_init, name_destroy,
+ * name_clear, name_size, name_reserve, name_fit, name_get, name_get_hash,
+ * name_get_or_insert_hash, name_prefetch, name_iter, name_iter_hash and
+ * name_retain. The table
+ * uses open addressing with linear probing, and the keys are copied
+ * into an arena, or taken from the intern table set as map->names.
+ *
+ * Values move when the table grows, so pointers returned by the
+ * map are only valid until the next insert that reports growth.
+ */
+#ifndef INLINE_MAP_H
+#define INLINE_MAP_H
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "intern.h"
+#include "hash.h"
+#include "hashmap.h"
+#include "stats.h"
+#include "name_map.h"
+
+// Initial number of entries in the table, must be a power of 2
+#define INLINE_MAP_INIT_SIZE 64
+
+#define INLINE_MAP_DEFINE(name, type)                                           \
+typedef struct {                                                                \
+    char *key;          /* Key in the arena, NULL if the entry is empty */      \
+    uint64_t hash;                                                              \
+    type value;                                                                 \
+} name##_entry;                                                                 \
+                                                                                \
+typedef struct {                                                                \
+    uint32_t count;     /* Number of used entries */                            \
+    uint32_t mask;      /* Size of the table minus one */                       \
+    name##_entry *table;                                                        \
+    arena *keys;        /* The keys are copied here */                          \
+    intern_table *names; /* Or taken from here, if set */                       \
+} name;                                                                         \
+                                                                                \
+/**                                                                             \
+ * Initializes an empty map.                                                    \
+ * @arg keys The arena the keys are copied into                                 \
+ * @return 0 on success.                                                        \
+ */                                                                             \
+static inline int name##_init(arena *keys, name *map) {                         \
+    map->count = 0;                                                             \
+    map->mask = INLINE_MAP_INIT_SIZE - 1;                                       \
+    map->keys = keys;                                                           \
+    map->names = NULL;                                                          \
+    map->table = calloc(INLINE_MAP_INIT_SIZE, sizeof(name##_entry));            \
+    if (!map->table) return -1;                                                 \
+    stats_mem_add(MEM_MAPS, INLINE_MAP_INIT_SIZE * sizeof(name##_entry));       \
+    return 0;                                                                   \
+}                                                                               \
+                                                                                \
+/**                                                                             \
+ * Frees the table. The keys belong to the arena.                               \
+ */                                                                             \
+static inline void name##_destroy(name *map) {                                  \
+    if (map->table)                                                             \
+        stats_mem_add(MEM_MAPS, -(int64_t)((map->mask + 1) * sizeof(name##_entry))); \
+    free(map->table);                                                           \
+    map->table = NULL;                                                          \
+    map->count = 0;                                                             \
+}                                                                               \
+                                                                                \
+/**                                                                             \
+ * Removes all the entries, keeping the capacity.                               \
+ * The caller is expected to reset the key arena.                               \
+ */                                                                             \
+static inline void name##_clear(name *map) {                                    \
+    if (map->count)                                                             \
+        memset(map->table, 0, (map->mask + 1) * sizeof(name##_entry));          \
+    map->count = 0;                                                             \
+}                                                                               \
+                                                                                \
+/**                                                                             \
+ * Returns the number of entries in the map                                     \
+ */                                                                             \
+static inline int name##_size(name *map) {                                      \
+    return map->count;                                                          \
+}                                                                               \
+                                                                                \
+/* Returns the entry of the key, or the empty entry it belongs in */           \
+static inline name##_entry* name##_find(name *map, const char *key, uint64_t hash) { \
+    uint32_t i = hash & map->mask;                                              \
+    name##_entry *e;                                                            \
+    while ((e = map->table + i)->key) {                                         \
+        if (e->hash == hash && !strcmp(e->key, key)) break;                     \
+        i = (i + 1) & map->mask;                                                \
+    }                                                                           \
+    return e;                                                                   \
+}                                                                               \
+                                                                                \
+/* Doubles the size of the table, moving all the values */                     \
+static inline int name##_grow(name *map) {                                      \
+    uint32_t old_size = map->mask + 1;                                          \
+    name##_entry *new_table = calloc(old_size * 2, sizeof(name##_entry));       \
+    if (!new_table) return -1;                                                  \
+                                                                                \
+    name##_entry *old_table = map->table;                                       \
+    map->table = new_table;                                                     \
+    map->mask = old_size * 2 - 1;                                               \
+    for (uint32_t i=0; i < old_size; i++) {                                     \
+        if (!old_table[i].key) continue;                                        \
+        uint32_t j = old_table[i].hash & map->mask;                             \
+        while (new_table[j].key) j = (j + 1) & map->mask;                       \
+        new_table[j] = old_table[i];                                            \
+    }                                                                           \
+    free(old_table);                                                            \
+    stats_add(STAT_HASHMAP_RESIZES, 1);                                         \
+    stats_mem_add(MEM_MAPS, old_size * sizeof(name##_entry));                   \
+    return 0;                                                                   \
+}                                                                               \
+                                                                                \
+/**                                                                             \
+ * Grows the table so that a number of keys fit without growing                 \
+ * again. This moves the values, like an insert that grows.                     \
+ * @return 0 on success.                                                        \
+ */                                                                             \
+static inline int name##_reserve(name *map, uint32_t count) {                   \
+    while ((uint64_t)count * 4 > (uint64_t)(map->mask + 1) * 3) {               \
+        if (name##_grow(map)) return -1;                                        \
+    }                                                                           \
+    return 0;                                                                   \
+}                                                                               \
+                                                                                \
+/**                                                                             \
+ * Shrinks the table of an empty map that is at least four times                \
+ * what a number of keys needs, to fit them.                                    \
+ * @return 0 on success, -1 if the map is not empty.                            \
+ */                                                                             \
+static inline int name##_fit(name *map, uint32_t count) {                       \
+    if (map->count) return -1;                                                  \
+    uint32_t size = INLINE_MAP_INIT_SIZE;                                       \
+    while ((uint64_t)count * 4 > (uint64_t)size * 3) size *= 2;                 \
+    if (map->mask + 1 < 4 * size) return 0;                                     \
+    name##_entry *table = calloc(size, sizeof(name##_entry));                   \
+    if (!table) return 0;                                                       \
+    stats_mem_add(MEM_MAPS, ((int64_t)size - (map->mask + 1)) * (int64_t)sizeof(name##_entry)); \
+    free(map->table);                                                           \
+    map->table = table;                                                         \
+    map->mask = size - 1;                                                       \
+    return 0;                                                                   \
+}                                                                               \
+                                                                                \
+/**                                                                             \
+ * Returns the value of a key, or NULL if it does not exist,                    \
+ * using a hash computed with hash_key.                                         \
+ */                                                                             \
+static inline type* name##_get_hash(name *map, const char *key, uint64_t hash) { \
+    name##_entry *e = name##_find(map, key, hash);                              \
+    return (e->key) ? &e->value : NULL;                                         \
+}                                                                               \
+                                                                                \
+/**                                                                             \
+ * Starts loading the entry a hash belongs in, so a later                       \
+ * lookup of the key does not wait on memory.                                   \
+ */                                                                             \
+static inline void name##_prefetch(name *map, uint64_t hash) {                  \
+    __builtin_prefetch(map->table + (hash & map->mask));                        \
+}                                                                               \
+                                                                                \
+/**                                                                             \
+ * Returns the value of a key, or NULL if it does not exist.                    \
+ */                                                                             \
+static inline type* name##_get(name *map, const char *key) {                    \
+    return name##_get_hash(map, key, hash_key(key, strlen(key)));               \
+}                                                                               \
+                                                                                \
+/**                                                                             \
+ * Returns the value of a key, inserting a zeroed value if it                   \
+ * does not exist, using a hash computed with hash_key.                         \
+ * @arg hash The hash of the key                                                \
+ * @arg value Output, set to the value in the table                             \
+ * @return 0 if the key existed, 1 if it was inserted, 2 if it                  \
+ * was inserted and the table grew, moving all the values, and                  \
+ * -1 if the table could not grow.                                              \
+ */                                                                             \
+static inline int name##_get_or_insert_hash(name *map, const char *key,         \
+        uint64_t hash, type **value) {                                          \
+    name##_entry *e = name##_find(map, key, hash);                              \
+    if (e->key) {                                                               \
+        *value = &e->value;                                                     \
+        return 0;                                                               \
+    }                                                                           \
+                                                                                \
+    /* Keep the load under 75%, so the probes stay short */                     \
+    int res = 1;                                                                \
+    if ((uint64_t)(map->count + 1) * 4 > (uint64_t)(map->mask + 1) * 3) {       \
+        if (name##_grow(map) == 0) {                                            \
+            e = name##_find(map, key, hash);                                    \
+            res = 2;                                                            \
+        } else if (map->count + 1 > map->mask) {                                \
+            *value = NULL;                                                      \
+            return -1;                                                          \
+        }                                                                       \
+    }                                                                           \
+    e->key = (map->names) ? intern_key(map->names, key, hash) : NULL;           \
+    if (!e->key) e->key = name_arena_copy(map->keys, key);                      \
+    e->hash = hash;                                                             \
+    memset(&e->value, 0, sizeof(type));                                         \
+    map->count++;                                                               \
+    *value = &e->value;                                                         \
+    return res;                                                                 \
+}                                                                               \
+                                                                                \
+/**                                                                             \
+ * Iterates through the entries, the callback is given                          \
+ * a pointer to the value. Return non-zero to stop iteration.                   \
+ * @return 0 on success, or the return of the callback                          \
+ */                                                                             \
+static inline int name##_iter(name *map, hashmap_callback cb, void *data) {     \
+    for (uint32_t i=0; i <= map->mask; i++) {                                   \
+        name##_entry *e = map->table + i;                                       \
+        if (!e->key) continue;                                                  \
+        int res = cb(data, e->key, &e->value);                                  \
+        if (res) return res;                                                    \
+    }                                                                           \
+    return 0;                                                                   \
+}                                                                               \
+                                                                                \
+/**                                                                             \
+ * Iterates through the entries as name_iter, also giving                       \
+ * the callback the hash of each key.                                           \
+ * @return 0 on success, or the return of the callback                          \
+ */                                                                             \
+static inline int name##_iter_hash(name *map, hashmap_hash_callback cb, void *data) { \
+    for (uint32_t i=0; i <= map->mask; i++) {                                   \
+        name##_entry *e = map->table + i;                                       \
+        if (!e->key) continue;                                                  \
+        int res = cb(data, e->key, e->hash, &e->value);                         \
+        if (res) return res;                                                    \
+    }                                                                           \
+    return 0;                                                                   \
+}                                                                               \
+                                                                                \
+/**                                                                             \
+ * Keeps only the entries the callback returns non-zero for, by                 \
+ * moving them into a new table of the same size. The keys of the              \
+ * removed entries stay in the arena, and all the values move.                  \
+ * @return 0 on success, -1 if the new table could not be allocated.            \
+ */                                                                             \
+static inline int name##_retain(name *map,                                      \
+        int (*keep)(void *data, const char *key, uint64_t hash, type *value),   \
+        void *data) {                                                           \
+    name##_entry *new_table = calloc(map->mask + 1, sizeof(name##_entry));      \
+    if (!new_table) return -1;                                                  \
+    uint32_t count = 0;                                                         \
+    for (uint32_t i=0; i <= map->mask; i++) {                                   \
+        name##_entry *e = map->table + i;                                       \
+        if (!e->key || !keep(data, e->key, e->hash, &e->value)) continue;       \
+        uint32_t j = e->hash & map->mask;                                       \
+        while (new_table[j].key) j = (j + 1) & map->mask;                       \
+        new_table[j] = *e;                                                      \
+        count++;                                                                \
+    }                                                                           \
+    free(map->table);                                                           \
+    map->table = new_table;                                                     \
+    map->count = count;                                                         \
+    return 0;                                                                   \
+}
+
+#endif
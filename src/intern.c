@@ -0,0 +1,215 @@
+/**
+ * This file implements the intern table declared in intern.h
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "intern.h"
+#include "stats.h"
+#include "name_map.h"
+
+// Initial number of entries in the table, must be a power of 2
+#define INTERN_INIT_SIZE 64
+
+/**
+ * Initializes an intern table
+ * @arg max_idle The number of intervals an unused name is kept,
+ * at least 1
+ * @arg t The table to initialize
+ * @return 0 on success.
+ */
+int intern_init(uint32_t max_idle, intern_table *t) {
+    if (!max_idle || max_idle == UINT32_MAX) return -1;
+    t->count = 0;
+    t->mask = INTERN_INIT_SIZE - 1;
+    t->epoch = 0;
+    t->max_idle = max_idle;
+    t->bytes = 0;
+    t->expired = 0;
+    t->expired_bytes = 0;
+    t->table = calloc(INTERN_INIT_SIZE, sizeof(intern_entry));
+    if (!t->table) return -1;
+    t->wheel = calloc(max_idle + 1, sizeof(uint32_t));
+    if (!t->wheel) {
+        free(t->table);
+        return -1;
+    }
+    stats_mem_add(MEM_MAPS, INTERN_INIT_SIZE * sizeof(intern_entry) + (max_idle + 1) * sizeof(uint32_t));
+    return arena_init(0, &t->names);
+}
+
+/**
+ * Destroys an intern table, releasing all the names
+ * @return 0 on success.
+ */
+int intern_destroy(intern_table *t) {
+    stats_mem_add(MEM_MAPS, -(int64_t)((t->mask + 1) * sizeof(intern_entry) +
+                (t->max_idle + 1) * sizeof(uint32_t)));
+    free(t->table);
+    free(t->wheel);
+    return arena_destroy(&t->names);
+}
+
+// Has a name gone unused for max_idle intervals
+static inline int expired(intern_table *t, intern_entry *e) {
+    return t->epoch - e->last_used > t->max_idle;
+}
+
+// Files the name at a position in the wheel slot of its last use
+static inline void file_entry(intern_table *t, uint32_t pos) {
+    intern_entry *e = t->table + pos;
+    uint32_t *slot = t->wheel + e->last_used % (t->max_idle + 1);
+    e->next = *slot;
+    *slot = pos + 1;
+}
+
+// Files all the unexpired names of the table again, once they moved
+static void refile_entries(intern_table *t) {
+    memset(t->wheel, 0, (t->max_idle + 1) * sizeof(uint32_t));
+    for (uint32_t i=0; i <= t->mask; i++) {
+        intern_entry *e = t->table + i;
+        if (e->key && !expired(t, e)) file_entry(t, i);
+    }
+}
+
+// Returns the entry of a name, or the empty entry it would take
+static inline intern_entry* intern_find(intern_entry *table, uint32_t mask, const char *key, uint64_t hash) {
+    uint32_t idx = hash & mask;
+    intern_entry *e;
+    while ((e = table + idx)->key) {
+        if (e->hash == hash && !strcmp(e->key, key)) break;
+        idx = (idx + 1) & mask;
+    }
+    return e;
+}
+
+// Moves the entries into a new table of a size, keeping their names
+static int intern_resize(intern_table *t, uint32_t size) {
+    intern_entry *table = calloc(size, sizeof(intern_entry));
+    if (!table) return -1;
+    for (uint32_t i=0; i <= t->mask; i++) {
+        intern_entry *e = t->table + i;
+        if (e->key) *intern_find(table, size - 1, e->key, e->hash) = *e;
+    }
+    stats_mem_add(MEM_MAPS, ((int64_t)size - (t->mask + 1)) * (int64_t)sizeof(intern_entry));
+    free(t->table);
+    t->table = table;
+    t->mask = size - 1;
+    refile_entries(t);
+    return 0;
+}
+
+/**
+ * Returns the stable copy of a name, copying it on first use.
+ * @arg key The name
+ * @arg hash The hash of the name, from hash_key
+ * @return The copy, valid until intern_advance, or NULL on failure.
+ */
+char* intern_key(intern_table *t, const char *key, uint64_t hash) {
+    intern_entry *e = intern_find(t->table, t->mask, key, hash);
+    if (e->key) {
+        // A name used again after it expired is filed again,
+        // the others are filed again once their slot comes up
+        if (expired(t, e)) {
+            t->expired--;
+            t->expired_bytes -= name_copy_size(strlen(e->key));
+            e->last_used = t->epoch;
+            file_entry(t, e - t->table);
+        }
+        e->last_used = t->epoch;
+        return e->key;
+    }
+
+    // Keep the load under 75%, so the probes stay short
+    if ((uint64_t)(t->count + 1) * 4 > (uint64_t)(t->mask + 1) * 3) {
+        if (intern_resize(t, (t->mask + 1) * 2)) return NULL;
+        e = intern_find(t->table, t->mask, key, hash);
+    }
+    size_t len = strlen(key), size = name_copy_size(len);
+    e->key = arena_alloc(&t->names, size);
+    if (!e->key) return NULL;
+    name_copy(e->key, key, len);
+    e->hash = hash;
+    e->last_used = t->epoch;
+    file_entry(t, e - t->table);
+    t->count++;
+    t->bytes += size;
+    return e->key;
+}
+
+// Copies the names used in the last max_idle intervals into new storage
+static int intern_sweep(intern_table *t) {
+    // Size the new table for the live names at under half full
+    uint32_t live = t->count - t->expired, size = INTERN_INIT_SIZE;
+    while (size < live * 2) size <<= 1;
+    intern_entry *table = calloc(size, sizeof(intern_entry));
+    if (!table) return -1;
+
+    arena names;
+    arena_init(0, &names);
+    size_t bytes = 0;
+    for (uint32_t i=0; i <= t->mask; i++) {
+        intern_entry *e = t->table + i;
+        if (!e->key || expired(t, e)) continue;
+        intern_entry *n = intern_find(table, size - 1, e->key, e->hash);
+        *n = *e;
+        n->key = name_arena_copy(&names, e->key);
+        bytes += name_copy_size(strlen(e->key));
+    }
+
+    // Release the old names at once
+    stats_mem_add(MEM_MAPS, ((int64_t)size - (t->mask + 1)) * (int64_t)sizeof(intern_entry));
+    free(t->table);
+    arena_destroy(&t->names);
+    t->table = table;
+    t->mask = size - 1;
+    t->names = names;
+    t->count = live;
+    t->bytes = bytes;
+    t->expired = 0;
+    t->expired_bytes = 0;
+    refile_entries(t);
+    return 0;
+}
+
+/**
+ * Starts a new interval, expiring the names that were unused for
+ * max_idle intervals. Once a quarter of the names or their bytes
+ * expired they are swept, which moves the remaining names, so
+ * nothing may refer to them when this is called.
+ */
+void intern_advance(intern_table *t) {
+    // The slot of this interval has the names filed by their use
+    // max_idle + 1 intervals ago, or since they were last checked
+    uint32_t *slot = t->wheel + ++t->epoch % (t->max_idle + 1);
+    uint32_t pos = *slot;
+    *slot = 0;
+    while (pos) {
+        intern_entry *e = t->table + pos - 1;
+        uint32_t next = e->next;
+        if (expired(t, e)) {
+            t->expired++;
+            t->expired_bytes += name_copy_size(strlen(e->key));
+        } else {
+            file_entry(t, pos - 1);
+        }
+        pos = next;
+    }
+
+    // Leave the names if at most a quarter are unused
+    if (!t->expired || (t->expired * 4 < t->count && t->expired_bytes * 4 < t->bytes)) return;
+    intern_sweep(t);
+}
+
+/**
+ * Returns the number of interned names
+ */
+uint32_t intern_size(intern_table *t) {
+    return t->count;
+}
+
+/**
+ * Returns the number of names used in the last max_idle intervals
+ */
+uint32_t intern_live(intern_table *t) {
+    return t->count - t->expired;
+}
@@ -0,0 +1,84 @@
+/**
+ * This module keeps stable copies of key names across flush
+ * intervals. Every interval starts from empty maps, so without
+ * it the same names are copied again each interval. A map that
+ * uses an intern table takes the existing copy of a name, found
+ * by the hash the map computed anyway.
+ *
+ * Each name remembers the last interval it was used in. The names
+ * are also filed in a timer wheel by that interval, and each new
+ * interval only checks the names filed max_idle intervals ago. The
+ * names used since are filed again by their new interval, so a use
+ * is only a stamp, and the rest have expired. Once enough of the
+ * names expired, a sweep copies the live names into new storage.
+ * The sweep runs between intervals, when no map refers to the names.
+ * An intern table is not thread safe.
+ */
+#ifndef INTERN_H
+#define INTERN_H
+#include <stdint.h>
+#include <stddef.h>
+#include "arena.h"
+
+typedef struct {
+    char *key;          // The name, NULL if the entry is empty
+    uint64_t hash;
+    uint32_t last_used; // The last interval the name was used in
+    uint32_t next;      // Position + 1 of the next name in its wheel slot, 0 at the end
+} intern_entry;
+
+typedef struct {
+    uint32_t count;     // Number of names
+    uint32_t mask;      // Size of the table minus one
+    intern_entry *table;
+    uint32_t epoch;     // The current interval
+    uint32_t max_idle;  // Intervals an unused name is kept
+    size_t bytes;       // Bytes of all the names
+    uint32_t *wheel;    // Position + 1 of the first name filed at each interval, max_idle + 1 slots
+    uint32_t expired;   // Names unused for max_idle intervals, still in the table
+    size_t expired_bytes;
+    arena names;        // Owns the names
+} intern_table;
+
+/**
+ * Initializes an intern table
+ * @arg max_idle The number of intervals an unused name is kept,
+ * at least 1
+ * @arg t The table to initialize
+ * @return 0 on success.
+ */
+int intern_init(uint32_t max_idle, intern_table *t);
+
+/**
+ * Destroys an intern table, releasing all the names
+ * @return 0 on success.
+ */
+int intern_destroy(intern_table *t);
+
+/**
+ * Returns the stable copy of a name, copying it on first use.
+ * @arg key The name
+ * @arg hash The hash of the name, from hash_key
+ * @return The copy, valid until intern_advance, or NULL on failure.
+ */
+char* intern_key(intern_table *t, const char *key, uint64_t hash);
+
+/**
+ * Starts a new interval, expiring the names that were unused for
+ * max_idle intervals. Once a quarter of the names or their bytes
+ * expired they are swept, which moves the remaining names, so
+ * nothing may refer to them when this is called.
+ */
+void intern_advance(intern_table *t);
+
+/**
+ * Returns the number of interned names
+ */
+uint32_t intern_size(intern_table *t);
+
+/**
+ * Returns the number of names used in the last max_idle intervals
+ */
+uint32_t intern_live(intern_table *t);
+
+#endif
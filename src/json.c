@@ -0,0 +1,149 @@
+/**
+ * This file implements the JSON writer declared in json.h
+ */
+#include <string.h>
+#include <math.h>
+#include "json.h"
+#include "format.h"
+
+static const char HEX[] = "0123456789abcdef";
+
+/**
+ * Initializes a writer
+ * @arg out The stream written to
+ * @arg w The writer to initialize
+ */
+void json_init(FILE *out, json_writer *w) {
+    w->out = out;
+    w->depth = 0;
+    w->members = 0;
+    w->failed = 0;
+    w->len = 0;
+}
+
+// Writes out the buffer
+static void json_flush(json_writer *w) {
+    if (w->len && !w->failed && fwrite(w->buf, w->len, 1, w->out) != 1) w->failed = 1;
+    w->len = 0;
+}
+
+/**
+ * Makes room in the buffer, writing it out if needed
+ * @arg len The bytes needed, at most JSON_BUF_SIZE
+ * @return Where to write them
+ */
+static inline char* json_room(json_writer *w, size_t len) {
+    if (w->len + len > JSON_BUF_SIZE) json_flush(w);
+    return w->buf + w->len;
+}
+
+// Appends a quoted string, escaping the quotes, backslashes and controls
+static void json_quoted(json_writer *w, const char *s, size_t len) {
+    char *out = json_room(w, 1);
+    *out = '"';
+    w->len++;
+    for (size_t i=0; i < len; i++) {
+        unsigned char c = s[i];
+        out = json_room(w, 6);
+        if (c == '"' || c == '\\') {
+            out[0] = '\\';
+            out[1] = c;
+            w->len += 2;
+        } else if (c < 0x20) {
+            memcpy(out, "\\u00", 4);
+            out[4] = HEX[c >> 4];
+            out[5] = HEX[c & 15];
+            w->len += 6;
+        } else {
+            out[0] = c;
+            w->len++;
+        }
+    }
+    out = json_room(w, 1);
+    *out = '"';
+    w->len++;
+}
+
+/**
+ * Starts a member of the open object, with the
+ * comma before it if it is not the first
+ */
+static void json_member(json_writer *w, const char *key, size_t key_len) {
+    unsigned int bit = 1u << (w->depth - 1);
+    if (w->members & bit) {
+        *json_room(w, 1) = ',';
+        w->len++;
+    }
+    w->members |= bit;
+    json_quoted(w, key, key_len);
+    *json_room(w, 1) = ':';
+    w->len++;
+}
+
+/**
+ * Opens an object, as a member of the open object if there is one
+ * @arg key The key of the member, NULL for the outermost object
+ */
+void json_open(json_writer *w, const char *key, size_t key_len) {
+    if (w->depth == JSON_MAX_DEPTH) {
+        w->failed = 1;
+        return;
+    }
+    if (w->depth) json_member(w, key, key_len);
+    *json_room(w, 1) = '{';
+    w->len++;
+    w->members &= ~(1u << w->depth);
+    w->depth++;
+}
+
+/**
+ * Closes the innermost open object
+ */
+void json_close(json_writer *w) {
+    if (!w->depth) return;
+    w->depth--;
+    *json_room(w, 1) = '}';
+    w->len++;
+}
+
+/**
+ * Adds a string member to the open object
+ */
+void json_string(json_writer *w, const char *key, size_t key_len, const char *val) {
+    json_member(w, key, key_len);
+    json_quoted(w, val, strlen(val));
+}
+
+/**
+ * Adds a number member to the open object, NaN and
+ * infinities are null as JSON has no value for them
+ */
+void json_double(json_writer *w, const char *key, size_t key_len, double val) {
+    json_member(w, key, key_len);
+    if (!isfinite(val)) {
+        memcpy(json_room(w, 4), "null", 4);
+        w->len += 4;
+        return;
+    }
+    w->len += format_double(json_room(w, FORMAT_DOUBLE_MAX), val, 6);
+}
+
+/**
+ * Adds an integer member to the open object
+ */
+void json_int(json_writer *w, const char *key, size_t key_len, long long val) {
+    json_member(w, key, key_len);
+    w->len += format_int(json_room(w, FORMAT_INT_MAX), val);
+}
+
+/**
+ * Ends a line of output, and writes out the buffer
+ * @return 0 on success, -1 if a write failed.
+ */
+int json_end_line(json_writer *w) {
+    while (w->depth) json_close(w);
+    *json_room(w, 1) = '\n';
+    w->len++;
+    json_flush(w);
+    return (w->failed) ? -1 : 0;
+}
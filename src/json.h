@@ -0,0 +1,67 @@
+/**
+ * A small JSON writer for the output paths. The text is built in
+ * a fixed buffer on the stack of the writer, and written to the
+ * stream whenever it fills, so nothing is allocated however large
+ * an object is. The numbers go through the formatters of format.h.
+ */
+#ifndef JSON_H
+#define JSON_H
+#include <stdio.h>
+#include <stddef.h>
+
+// Size of the buffer of a writer
+#define JSON_BUF_SIZE 4096
+
+// Deepest nesting of the objects
+#define JSON_MAX_DEPTH 16
+
+typedef struct {
+    FILE *out;
+    int depth;          // The objects that are open
+    unsigned int members; // Bit d is set once object d has a member
+    int failed;         // Set once a write fails
+    size_t len;
+    char buf[JSON_BUF_SIZE];
+} json_writer;
+
+/**
+ * Initializes a writer
+ * @arg out The stream written to
+ * @arg w The writer to initialize
+ */
+void json_init(FILE *out, json_writer *w);
+
+/**
+ * Opens an object, as a member of the open object if there is one
+ * @arg key The key of the member, NULL for the outermost object
+ */
+void json_open(json_writer *w, const char *key, size_t key_len);
+
+/**
+ * Closes the innermost open object
+ */
+void json_close(json_writer *w);
+
+/**
+ * Adds a string member to the open object
+ */
+void json_string(json_writer *w, const char *key, size_t key_len, const char *val);
+
+/**
+ * Adds a number member to the open object, NaN and
+ * infinities are null as JSON has no value for them
+ */
+void json_double(json_writer *w, const char *key, size_t key_len, double val);
+
+/**
+ * Adds an integer member to the open object
+ */
+void json_int(json_writer *w, const char *key, size_t key_len, long long val);
+
+/**
+ * Ends a line of output, and writes out the buffer
+ * @return 0 on success, -1 if a write failed.
+ */
+int json_end_line(json_writer *w);
+
+#endif
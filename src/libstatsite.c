@@ -0,0 +1,152 @@
+/**
+ * This file defines the methods declared in libstatsite.h
+ * An aggregator wraps a metrics object, and the serialized
+ * form is a snapshot of it, as written by snapshot.c.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "libstatsite.h"
+#include "metrics.h"
+#include "snapshot.h"
+
+struct statsite_agg {
+    metrics m;
+};
+
+// The quantiles summarized by statsite, the sketch answers any
+static double DEFAULT_QUANTILES[] = {0.5, 0.9, 0.95, 0.99};
+
+int statsite_api_version(void) {
+    return STATSITE_API_VERSION;
+}
+
+int statsite_agg_create(double timer_eps, unsigned char set_precision, statsite_agg **agg) {
+    if (timer_eps < 0 || timer_eps >= 0.5) return -1;
+    statsite_agg *a = calloc(1, sizeof(statsite_agg));
+    if (!a) return -1;
+    int res = init_metrics((timer_eps) ? timer_eps : 0.01, DEFAULT_QUANTILES,
+            sizeof(DEFAULT_QUANTILES) / sizeof(double), NULL,
+            (set_precision) ? set_precision : 12, &a->m);
+    if (res) {
+        free(a);
+        return -1;
+    }
+    *agg = a;
+    return 0;
+}
+
+void statsite_agg_destroy(statsite_agg *agg) {
+    destroy_metrics(&agg->m);
+    free(agg);
+}
+
+int statsite_agg_add(statsite_agg *agg, statsite_type type, const char *name, double value) {
+    switch (type) {
+        case STATSITE_KEY_VAL:
+        case STATSITE_GAUGE:
+        case STATSITE_COUNTER:
+        case STATSITE_TIMER:
+        case STATSITE_GAUGE_DELTA:
+            // The values of the public types match the metric types
+            agg->m.inputs++;
+            return metrics_add_sample(&agg->m, (metric_type)type, (char*)name, value);
+        default:
+            return -1;
+    }
+}
+
+int statsite_agg_set_add(statsite_agg *agg, const char *name, const char *value) {
+    agg->m.inputs++;
+    return metrics_set_update(&agg->m, (char*)name, (char*)value);
+}
+
+struct iter_info {
+    void *data;
+    statsite_agg_callback cb;
+};
+
+// Summarizes each metric for the public callback
+static int summarize_cb(void *data, metric_type type, char *name, void *val) {
+    struct iter_info *info = data;
+    statsite_value v;
+    memset(&v, 0, sizeof(v));
+    statsite_type public_type;
+    switch (type) {
+        case KEY_VAL:
+            public_type = STATSITE_KEY_VAL;
+            v.value = *(double*)val;
+            break;
+        case GAUGE:
+            public_type = STATSITE_GAUGE;
+            v.value = ((gauge_t*)val)->value;
+            break;
+        case COUNTER: {
+            counter *c = val;
+            public_type = STATSITE_COUNTER;
+            v.count = counter_count(c);
+            v.value = counter_sum(c);
+            v.min = counter_min(c);
+            v.max = counter_max(c);
+            v.mean = counter_mean(c);
+            v.stddev = counter_stddev(c);
+            break;
+        }
+        case COUNTER_SUM:
+            public_type = STATSITE_COUNTER;
+            v.value = *(double*)val;
+            break;
+        case TIMER: {
+            timer *t = &((timer_hist*)val)->tm;
+            public_type = STATSITE_TIMER;
+            v.count = timer_count(t);
+            v.value = timer_sum(t);
+            v.min = timer_min(t);
+            v.max = timer_max(t);
+            v.mean = timer_mean(t);
+            v.stddev = timer_stddev(t);
+            v.sketch = t;
+            break;
+        }
+        case SET:
+            public_type = STATSITE_SET;
+            v.count = set_size(val);
+            break;
+        default:
+            return 0;
+    }
+    return info->cb(info->data, public_type, name, &v);
+}
+
+int statsite_agg_iter(statsite_agg *agg, void *data, statsite_agg_callback cb) {
+    struct iter_info info = {data, cb};
+    return metrics_iter(&agg->m, &info, summarize_cb);
+}
+
+double statsite_quantile(const statsite_value *value, double quantile) {
+    if (!value->sketch) return 0;
+    return timer_query((timer*)value->sketch, quantile);
+}
+
+int statsite_agg_serialize(statsite_agg *agg, char **buf, size_t *len) {
+    FILE *f = open_memstream(buf, len);
+    if (!f) return -1;
+    metrics *shards[] = {&agg->m};
+    int res = snapshot_serialize(f, shards, 1);
+    if (fclose(f)) res = -1;
+    if (res) {
+        free(*buf);
+        *buf = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int statsite_agg_merge(statsite_agg *agg, const char *buf, size_t len) {
+    metrics *shards[] = {&agg->m};
+    return snapshot_restore(buf, len, shards, 1);
+}
+
+int statsite_agg_reset(statsite_agg *agg) {
+    return metrics_clear(&agg->m);
+}
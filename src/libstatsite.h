@@ -0,0 +1,143 @@
+/**
+ * The embeddable statsite API, built as libstatsite.a. A service
+ * aggregates its metrics in-process with the same counters, timers
+ * and sets as statsite, and ships one serialized aggregate per
+ * interval, which statsite or another aggregator merges.
+ *
+ * Only this header is stable. The types, enum values and functions
+ * keep their meaning within an STATSITE_API_VERSION. An aggregator
+ * is not thread safe, callers must lock or keep one per thread.
+ */
+#ifndef LIBSTATSITE_H
+#define LIBSTATSITE_H
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define STATSITE_API_VERSION 1
+
+/**
+ * The kinds of metrics. Gauge deltas are only used
+ * when adding samples, and are iterated as gauges.
+ */
+typedef enum {
+    STATSITE_KEY_VAL = 1,
+    STATSITE_GAUGE = 2,
+    STATSITE_COUNTER = 3,
+    STATSITE_TIMER = 4,
+    STATSITE_SET = 5,
+    STATSITE_GAUGE_DELTA = 6
+} statsite_type;
+
+/**
+ * A summary of a metric, passed to statsite_agg_iter.
+ * Fields that do not apply to the type are zero.
+ */
+typedef struct {
+    uint64_t count;     // Samples, or the estimated cardinality of a set
+    double value;       // The K/V or gauge value, or the sum of the samples
+    double min;
+    double max;
+    double mean;
+    double stddev;
+    const void *sketch; // The timer, passed to statsite_quantile
+} statsite_value;
+
+/**
+ * Opaque aggregator reference
+ */
+typedef struct statsite_agg statsite_agg;
+
+/**
+ * Invoked for each metric by statsite_agg_iter
+ * @arg data Opaque handle passed to statsite_agg_iter
+ * @arg type The type of the metric
+ * @arg name The name of the metric
+ * @arg value A summary of the metric, valid during the call
+ * @return Non-zero to stop iterating
+ */
+typedef int(*statsite_agg_callback)(void *data, statsite_type type,
+        const char *name, const statsite_value *value);
+
+/**
+ * Returns the STATSITE_API_VERSION the library was built with
+ */
+int statsite_api_version(void);
+
+/**
+ * Creates an aggregator.
+ * @arg timer_eps The maximum error of the timer quantiles, or 0 for 1%
+ * @arg set_precision The HyperLogLog precision of sets, or 0 for 12
+ * @arg agg Output, the aggregator
+ * @return 0 on success.
+ */
+int statsite_agg_create(double timer_eps, unsigned char set_precision, statsite_agg **agg);
+
+/**
+ * Destroys an aggregator
+ */
+void statsite_agg_destroy(statsite_agg *agg);
+
+/**
+ * Adds a sample to a metric
+ * @arg type The type of the metric, any but STATSITE_SET
+ * @arg name The name of the metric
+ * @arg value The sample
+ * @return 0 on success.
+ */
+int statsite_agg_add(statsite_agg *agg, statsite_type type, const char *name, double value);
+
+/**
+ * Adds a value to a set
+ * @arg name The name of the set
+ * @arg value The value to count
+ * @return 0 on success.
+ */
+int statsite_agg_set_add(statsite_agg *agg, const char *name, const char *value);
+
+/**
+ * Invokes a callback for each metric
+ * @arg data Opaque handle passed to the callback
+ * @arg cb The callback to invoke
+ * @return 0 on success, or the return of the callback
+ */
+int statsite_agg_iter(statsite_agg *agg, void *data, statsite_agg_callback cb);
+
+/**
+ * Returns a quantile of a timer summarized by statsite_agg_iter
+ * @arg value The summary of the timer
+ * @arg quantile The quantile, on (0, 1)
+ * @return The value of the quantile, or 0 if not a timer.
+ */
+double statsite_quantile(const statsite_value *value, double quantile);
+
+/**
+ * Serializes all the metrics, with the sketches of the timers
+ * and sets, so they can be merged elsewhere.
+ * @arg buf Output, the serialized metrics. Must be freed by the caller.
+ * @arg len Output, the length of the buffer
+ * @return 0 on success.
+ */
+int statsite_agg_serialize(statsite_agg *agg, char **buf, size_t *len);
+
+/**
+ * Merges serialized metrics into an aggregator
+ * @arg buf The serialized metrics
+ * @arg len The length of the buffer
+ * @return 0 on success, or -1 if they are not valid.
+ */
+int statsite_agg_merge(statsite_agg *agg, const char *buf, size_t len);
+
+/**
+ * Clears all the metrics, starting a new interval
+ * @return 0 on success.
+ */
+int statsite_agg_reset(statsite_agg *agg);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,63 @@
+#include <string.h>
+#include <pthread.h>
+#include "loop_monitor.h"
+#include "stats.h"
+
+// The most of the interval, raised with a compare and swap
+static double MAX_ITERATION_MS;
+static double MAX_LAG_MS;
+
+// Stalls are rare, so the longest are kept under a lock
+static pthread_mutex_t STALL_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static loop_stall STALLS[LOOP_WORST_STALLS];
+static int NUM_STALLS;
+
+// Raises a double to a value, if it is above
+static inline void atomic_max_double(double *d, double val) {
+    double cur;
+    __atomic_load(d, &cur, __ATOMIC_RELAXED);
+    while (val > cur && !__atomic_compare_exchange(d, &cur, &val, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Keeps a stall if it is among the longest of the interval
+static void add_stall(int worker, double ms) {
+    pthread_mutex_lock(&STALL_LOCK);
+    int i = (NUM_STALLS < LOOP_WORST_STALLS) ? NUM_STALLS++ : LOOP_WORST_STALLS;
+    if (i == LOOP_WORST_STALLS && ms <= STALLS[i - 1].ms) {
+        pthread_mutex_unlock(&STALL_LOCK);
+        return;
+    }
+    if (i == LOOP_WORST_STALLS) i--;
+
+    // Shift the shorter ones down, the list stays longest first
+    for (; i > 0 && STALLS[i - 1].ms < ms; i--) STALLS[i] = STALLS[i - 1];
+    STALLS[i] = (loop_stall){ms, worker, time(NULL)};
+    pthread_mutex_unlock(&STALL_LOCK);
+}
+
+void loop_monitor_iteration(int worker, double ms) {
+    stat_id bin;
+    if (ms < 0.1) bin = STAT_LOOP_100US;
+    else if (ms < 1) bin = STAT_LOOP_1MS;
+    else if (ms < 10) bin = STAT_LOOP_10MS;
+    else if (ms < 100) bin = STAT_LOOP_100MS;
+    else bin = STAT_LOOP_SLOWER;
+    stats_add(bin, 1);
+    atomic_max_double(&MAX_ITERATION_MS, ms);
+    if (ms >= LOOP_STALL_MS) add_stall(worker, ms);
+}
+
+void loop_monitor_lag(double ms) {
+    atomic_max_double(&MAX_LAG_MS, ms);
+}
+
+void loop_monitor_collect(loop_report *r) {
+    double zero = 0;
+    __atomic_exchange(&MAX_ITERATION_MS, &zero, &r->max_iteration_ms, __ATOMIC_RELAXED);
+    __atomic_exchange(&MAX_LAG_MS, &zero, &r->max_lag_ms, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&STALL_LOCK);
+    r->num_stalls = NUM_STALLS;
+    memcpy(r->stalls, STALLS, NUM_STALLS * sizeof(loop_stall));
+    NUM_STALLS = 0;
+    pthread_mutex_unlock(&STALL_LOCK);
+}
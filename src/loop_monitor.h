@@ -0,0 +1,55 @@
+/**
+ * Watches the latency of the event loops of the workers. Each
+ * iteration of a loop is timed from the end of its poll to the
+ * start of the next one, which is the time its callbacks held
+ * up the sockets, and binned into the loop.iterations counters
+ * of stats.h. A short repeating timer on each loop measures how
+ * late it fires. The longest iterations and the most lag of an
+ * interval are kept here until the flush collects them.
+ */
+#ifndef LOOP_MONITOR_H
+#define LOOP_MONITOR_H
+#include <time.h>
+
+// Iterations of at least this many milliseconds are stalls
+#define LOOP_STALL_MS 10
+
+// The longest stalls reported for each interval
+#define LOOP_WORST_STALLS 4
+
+// An iteration of a worker that held up its loop
+typedef struct {
+    double ms;
+    int worker;
+    time_t when;
+} loop_stall;
+
+// The latency of the loops over an interval
+typedef struct {
+    double max_iteration_ms;    // The longest iteration of any loop
+    double max_lag_ms;          // The latest the timer of any loop fired
+    int num_stalls;
+    loop_stall stalls[LOOP_WORST_STALLS];   // The longest first
+} loop_report;
+
+/**
+ * Records an iteration of the loop of a worker
+ * @arg worker The worker that ran the iteration
+ * @arg ms How long its callbacks ran
+ */
+void loop_monitor_iteration(int worker, double ms);
+
+/**
+ * Records how late the lag timer of a worker fired
+ * @arg ms The milliseconds past when it was due
+ */
+void loop_monitor_lag(double ms);
+
+/**
+ * Returns the latency since the last collection, and starts
+ * a new interval. Safe to call along with the records.
+ * @arg r Output, the latency of the interval
+ */
+void loop_monitor_collect(loop_report *r);
+
+#endif
@@ -0,0 +1,333 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "lz4.h"
+
+// The frame magic number, and the descriptor of our frames:
+// version 1 with independent blocks, and 64KB blocks
+#define FRAME_MAGIC 0x184D2204
+#define FRAME_FLG 0x60
+#define FRAME_BD 0x40
+
+// The flags of the descriptor
+#define FLG_BLOCK_CHECKSUM 0x10
+#define FLG_CONTENT_SIZE 0x08
+#define FLG_CONTENT_CHECKSUM 0x04
+#define FLG_DICT_ID 0x01
+
+// Set on the size of a block that is stored as is
+#define BLOCK_UNCOMPRESSED 0x80000000U
+
+// The matches are found with a table of the last
+// position of each hash of 4 bytes
+#define HASH_LOG 12
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+
+// The end of a block is always literals, and no
+// match starts in the last MF_LIMIT bytes
+#define LAST_LITERALS 5
+#define MF_LIMIT 12
+
+// Misses before the search starts skipping ahead,
+// so incompressible input is passed over quickly
+#define SKIP_TRIGGER 6
+
+// The primes of xxHash32
+#define PRIME1 2654435761U
+#define PRIME2 2246822519U
+#define PRIME3 3266489917U
+#define PRIME5 374761393U
+
+// A frame being written
+typedef struct {
+    FILE *out;
+    int len;        // The bytes in block
+    int error;
+    char block[LZ4_BLOCK_SIZE];
+    char compressed[LZ4_BLOCK_SIZE];
+} frame_writer;
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash_sequence(uint32_t seq) {
+    return (seq * PRIME1) >> (32 - HASH_LOG);
+}
+
+static void write_le32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t read_le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * Computes the checksum byte of a frame descriptor,
+ * the second byte of its xxHash32. Descriptors are
+ * shorter than the 16 byte stripes of xxHash32.
+ */
+static uint8_t descriptor_checksum(const uint8_t *desc, int len) {
+    uint32_t h = PRIME5 + len;
+    for (int i=0; i < len; i++) {
+        h += desc[i] * PRIME5;
+        h = ((h << 11) | (h >> 21)) * PRIME1;
+    }
+    h ^= h >> 15;
+    h *= PRIME2;
+    h ^= h >> 13;
+    h *= PRIME3;
+    h ^= h >> 16;
+    return (h >> 8) & 0xff;
+}
+
+// Writes a length of 15 or more as extension bytes
+static uint8_t* write_length(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+int lz4_compress_block(const char *src, int len, char *dst, int cap) {
+    const uint8_t *in = (const uint8_t*)src, *end = in + len;
+    const uint8_t *ip = in, *anchor = in;
+    uint8_t *op = (uint8_t*)dst, *op_end = op + cap;
+    uint16_t table[1 << HASH_LOG];
+    memset(table, 0, sizeof(table));
+
+    if (len > MF_LIMIT) {
+        const uint8_t *mf_limit = end - MF_LIMIT, *match_limit = end - LAST_LITERALS;
+        int misses = 0;
+        while (ip < mf_limit) {
+            // Look up the last position of these bytes
+            uint32_t h = hash_sequence(read32(ip));
+            const uint8_t *ref = in + table[h];
+            table[h] = ip - in;
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != read32(ip)) {
+                ip += 1 + (misses++ >> SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+
+            // Extend the match both ways
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *match_end = ip + MIN_MATCH, *ref_end = ref + MIN_MATCH;
+            while (match_end < match_limit && *match_end == *ref_end) {
+                match_end++;
+                ref_end++;
+            }
+
+            // Check the sequence fits, at its longest
+            size_t lits = ip - anchor, match_len = match_end - ip - MIN_MATCH;
+            if (op + 1 + lits / 255 + 1 + lits + 2 + match_len / 255 + 1 > op_end) return 0;
+
+            // Write the token, the literals, the offset and the match length
+            uint8_t *token = op++;
+            *token = ((lits < 15) ? lits : 15) << 4;
+            if (lits >= 15) op = write_length(op, lits - 15);
+            memcpy(op, anchor, lits);
+            op += lits;
+            *op++ = (ip - ref) & 0xff;
+            *op++ = (ip - ref) >> 8;
+            *token |= (match_len < 15) ? match_len : 15;
+            if (match_len >= 15) op = write_length(op, match_len - 15);
+
+            // Continue after the match, indexing the bytes before it
+            ip = anchor = match_end;
+            if (ip < mf_limit) table[hash_sequence(read32(ip - 2))] = ip - 2 - in;
+        }
+    }
+
+    // The last literals
+    size_t lits = end - anchor;
+    if (op + 1 + lits / 255 + 1 + lits > op_end) return 0;
+    *op++ = ((lits < 15) ? lits : 15) << 4;
+    if (lits >= 15) op = write_length(op, lits - 15);
+    memcpy(op, anchor, lits);
+    op += lits;
+    return op - (uint8_t*)dst;
+}
+
+// Reads the extension bytes of a length of 15
+static int read_length(const uint8_t **ip, const uint8_t *end, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= end) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz4_decompress_block(const char *src, int len, char *dst, int cap) {
+    const uint8_t *ip = (const uint8_t*)src, *end = ip + len;
+    uint8_t *op = (uint8_t*)dst, *op_end = op + cap;
+    while (ip < end) {
+        // Copy the literals
+        uint8_t token = *ip++;
+        size_t lits = token >> 4;
+        if (lits == 15 && read_length(&ip, end, &lits)) return -1;
+        if (lits > (size_t)(end - ip) || lits > (size_t)(op_end - op)) return -1;
+        memcpy(op, ip, lits);
+        op += lits;
+        ip += lits;
+
+        // The last sequence has no match
+        if (ip == end) break;
+
+        // Copy the match, which may overlap its output
+        if (end - ip < 2) return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (!offset || offset > (size_t)(op - (uint8_t*)dst)) return -1;
+        size_t match_len = token & 15;
+        if (match_len == 15 && read_length(&ip, end, &match_len)) return -1;
+        match_len += MIN_MATCH;
+        if (match_len > (size_t)(op_end - op)) return -1;
+        const uint8_t *ref = op - offset;
+        for (size_t i=0; i < match_len; i++) *op++ = *ref++;
+    }
+    return op - (uint8_t*)dst;
+}
+
+// Compresses and writes out the buffered block
+static int write_block(frame_writer *w) {
+    if (!w->len) return 0;
+    uint8_t size[4];
+    int len = lz4_compress_block(w->block, w->len, w->compressed, w->len);
+    char *block = w->compressed;
+    if (!len) {
+        len = w->len;
+        block = w->block;
+        write_le32(size, len | BLOCK_UNCOMPRESSED);
+    } else {
+        write_le32(size, len);
+    }
+    w->len = 0;
+    if (!fwrite(size, sizeof(size), 1, w->out) || !fwrite(block, len, 1, w->out)) {
+        w->error = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static ssize_t frame_write(void *cookie, const char *buf, size_t size) {
+    frame_writer *w = cookie;
+    size_t written = 0;
+    while (written < size) {
+        size_t n = LZ4_BLOCK_SIZE - w->len;
+        if (n > size - written) n = size - written;
+        memcpy(w->block + w->len, buf + written, n);
+        w->len += n;
+        written += n;
+        if (w->len == LZ4_BLOCK_SIZE && write_block(w)) return 0;
+    }
+    return written;
+}
+
+static int frame_close(void *cookie) {
+    frame_writer *w = cookie;
+    uint8_t end_mark[4] = {0, 0, 0, 0};
+    write_block(w);
+    if (!w->error && !fwrite(end_mark, sizeof(end_mark), 1, w->out)) w->error = 1;
+    int res = (w->error) ? -1 : 0;
+    free(w);
+    return res;
+}
+
+FILE* lz4_frame_open(FILE *out) {
+    frame_writer *w = malloc(sizeof(frame_writer));
+    if (!w) return NULL;
+    w->out = out;
+    w->len = 0;
+    w->error = 0;
+
+    // Write the header
+    uint8_t header[7];
+    write_le32(header, FRAME_MAGIC);
+    header[4] = FRAME_FLG;
+    header[5] = FRAME_BD;
+    header[6] = descriptor_checksum(header + 4, 2);
+    if (!fwrite(header, sizeof(header), 1, out)) {
+        free(w);
+        return NULL;
+    }
+
+    cookie_io_functions_t funcs = {NULL, frame_write, NULL, frame_close};
+    FILE *f = fopencookie(w, "w", funcs);
+    if (!f) free(w);
+
+    // Buffer whole blocks, so the writes are copied once
+    if (f) setvbuf(f, NULL, _IOFBF, LZ4_BLOCK_SIZE);
+    return f;
+}
+
+int lz4_frame_decode(FILE *in, FILE *out) {
+    uint8_t header[4];
+    char *block = NULL, *decompressed = NULL;
+    int res = 0;
+    size_t n;
+    while (!res && (n = fread(header, 1, 4, in)) > 0) {
+        // Check the magic and the descriptor
+        uint8_t desc[15];
+        if (n != 4 || read_le32(header) != FRAME_MAGIC || fread(desc, 2, 1, in) != 1) {
+            res = -1;
+            break;
+        }
+        uint8_t flg = desc[0];
+        int desc_len = 2 + ((flg & FLG_CONTENT_SIZE) ? 8 : 0) + ((flg & FLG_DICT_ID) ? 4 : 0);
+        int block_size_id = (desc[1] >> 4) & 7;
+        if ((flg >> 6) != 1 || block_size_id < 4 ||
+                fread(desc + 2, desc_len - 2 + 1, 1, in) != 1 ||
+                desc[desc_len] != descriptor_checksum(desc, desc_len)) {
+            res = -1;
+            break;
+        }
+        int max_block = 1 << (8 + 2 * block_size_id);
+        char *b = realloc(block, max_block), *d = realloc(decompressed, max_block);
+        if (b) block = b;
+        if (d) decompressed = d;
+        if (!b || !d) {
+            res = -1;
+            break;
+        }
+
+        // Copy out the blocks until the end mark
+        uint8_t word[4];
+        while (!res) {
+            if (fread(word, 4, 1, in) != 1) {
+                res = -1;
+                break;
+            }
+            uint32_t size = read_le32(word), len = size & ~BLOCK_UNCOMPRESSED;
+            if (!size) break;
+            if (len > (uint32_t)max_block || fread(block, len, 1, in) != 1 ||
+                    (flg & FLG_BLOCK_CHECKSUM && fread(word, 4, 1, in) != 1)) {
+                res = -1;
+                break;
+            }
+            int out_len = len;
+            char *out_buf = block;
+            if (!(size & BLOCK_UNCOMPRESSED)) {
+                out_len = lz4_decompress_block(block, len, decompressed, max_block);
+                out_buf = decompressed;
+            }
+            if (out_len < 0 || (out_len && !fwrite(out_buf, out_len, 1, out))) res = -1;
+        }
+        if (!res && flg & FLG_CONTENT_CHECKSUM && fread(word, 4, 1, in) != 1) res = -1;
+    }
+    if (ferror(in)) res = -1;
+    free(block);
+    free(decompressed);
+    return res;
+}
@@ -0,0 +1,58 @@
+/**
+ * This module compresses the output to the stream command with
+ * the LZ4 frame format, so it can be decoded by the lz4 tool, or
+ * by the lz4_decode.py helper of the sinks. The repetitive keys
+ * of the ASCII output compress well, which cuts the bytes that a
+ * forwarding sink ships on and reads.
+ *
+ * Frames have independent blocks of up to LZ4_BLOCK_SIZE bytes,
+ * without checksums. A block that does not compress is stored
+ * as is. Concatenated frames decode to their concatenation.
+ */
+#ifndef LZ4_H
+#define LZ4_H
+#include <stdio.h>
+
+/**
+ * The most input bytes in a block, the 64KB size of the frame format
+ */
+#define LZ4_BLOCK_SIZE 65536
+
+/**
+ * Compresses a block.
+ * @arg src The input
+ * @arg len The length of the input, at most LZ4_BLOCK_SIZE
+ * @arg dst Output, the compressed block
+ * @arg cap The size of dst
+ * @return The length of the compressed block, or 0 if it does not fit.
+ */
+int lz4_compress_block(const char *src, int len, char *dst, int cap);
+
+/**
+ * Decompresses a block.
+ * @arg src The compressed block
+ * @arg len The length of the compressed block
+ * @arg dst Output, the decompressed block
+ * @arg cap The size of dst
+ * @return The length of the decompressed block, or -1 if it is invalid.
+ */
+int lz4_decompress_block(const char *src, int len, char *dst, int cap);
+
+/**
+ * Opens a stream that writes a frame to another stream. The header
+ * is written first, and the end mark when the stream is closed.
+ * Closing it does not close the other stream.
+ * @arg out The stream to write the frame to
+ * @return The stream, or NULL on error.
+ */
+FILE* lz4_frame_open(FILE *out);
+
+/**
+ * Decompresses the frames of a stream until its end.
+ * @arg in The frames
+ * @arg out The stream to write the decompressed contents to
+ * @return 0 on success, -1 if the frames are invalid or on error.
+ */
+int lz4_frame_decode(FILE *in, FILE *out);
+
+#endif
@@ -1,13 +1,41 @@
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <syslog.h>
+#include "cpu_features.h"
+#ifdef HAVE_SIMD_X86
+#include <immintrin.h>
+#endif
 #include "metrics.h"
 #include "set.h"
+#include "sketch.h"
+#include "hash.h"
+#include "stats.h"
+#include "probes.h"
+#include "name_map.h"
 
-static int counter_delete_cb(void *data, const char *key, void *value);
 static int timer_delete_cb(void *data, const char *key, void *value);
 static int set_delete_cb(void *data, const char *key, void *value);
-static int gauge_delete_cb(void *data, const char *key, void *value);
 static int iter_cb(void *data, const char *key, void *value);
+static int counter_merge_cb(void *data, const char *key, uint64_t hash, void *value);
+static int timer_merge_cb(void *data, const char *key, uint64_t hash, void *value);
+static int set_merge_cb(void *data, const char *key, uint64_t hash, void *value);
+static int gauge_merge_cb(void *data, const char *key, uint64_t hash, void *value);
+static int sum_merge_cb(void *data, const char *key, uint64_t hash, void *value);
+static int kv_merge_cb(void *data, const char *key, uint64_t hash, void *value);
+
+/**
+ * Hands out the generations of the metrics. These are unique
+ * across all the metrics objects, so a cached metric pointer
+ * can be checked with a single compare.
+ */
+static uint64_t GENERATIONS;
+
+// Drops the cached prefix lookups, once the prefix trees change
+static void drop_prefix_cache(metrics *m) {
+    free(m->prefix_cache);
+    m->prefix_cache = NULL;
+}
 
 struct cb_info {
     metric_type type;
@@ -33,22 +61,290 @@ int init_metrics(double timer_eps, double *quantiles, uint32_t num_quants, radix
     memcpy(m->quantiles, quantiles, num_quants * sizeof(double));
     m->histograms = histograms;
     m->set_precision = set_precision;
+    m->timer_engine = TIMER_ENGINE_CM;
+    m->tdigest_compression = 100;
+    m->timer_engines = NULL;
+    m->timer_admission = 0;
+    m->set_max_exact = SET_MAX_EXACT;
+    m->counter_sum_only = false;
+    m->counter_modes = NULL;
+    m->kv_modes = NULL;
+    m->set_precisions = NULL;
+    m->limits = NULL;
+    m->limit_keys = NULL;
+    m->num_limits = 0;
+    m->top_samples = NULL;
+    m->top_bytes = NULL;
+    m->names = NULL;
+    m->inputs = 0;
+    m->prefix_cache = NULL;
+    m->shared = NULL;
+    m->generation = __sync_add_and_fetch(&GENERATIONS, 1);
 
-    // Allocate the hashmaps
-    int res = hashmap_init(0, &m->counters);
+    // Allocate the arena and hashmaps. The arena fills
+    // whole huge pages when they are enabled.
+    size_t chunk = (page_alloc_mode() != HUGE_PAGES_OFF) ? ARENA_HUGE_CHUNK : 0;
+    int res = arena_init(chunk, &m->arena);
+    if (res) return res;
+    res = counter_map_init(&m->arena, &m->counters);
+    if (res) return res;
+    res = hashmap_init_arena(0, &m->arena, &m->timers);
+    if (res) return res;
+    res = hashmap_init_arena(0, &m->arena, &m->sets);
     if (res) return res;
-    res = hashmap_init(0, &m->timers);
+    res = gauge_map_init(&m->arena, &m->gauges);
     if (res) return res;
-    res = hashmap_init(0, &m->sets);
+    res = sum_map_init(&m->arena, &m->sums);
     if (res) return res;
-    res = hashmap_init(0, &m->gauges);
+    res = kv_map_init(&m->arena, &m->kvs);
     if (res) return res;
 
-    // Set the head of our linked list to null
-    m->kv_vals = NULL;
+    // No key/value pairs yet
+    m->kv_head = m->kv_tail = NULL;
+    return 0;
+}
+
+/**
+ * Changes the timer error, quantiles, histograms and set
+ * precision given to init_metrics, for a new configuration.
+ * The metrics must be empty, as their timers refer to the
+ * quantiles. Nothing is changed if the settings are the same.
+ * @arg timer_eps The maximum error for the quantiles
+ * @arg quantiles A sorted array of double quantile values, must be on (0, 1)
+ * @arg num_quants The number of entries in the quantiles array
+ * @arg histograms A radix tree with histogram settings, not owned by the metrics
+ * @arg set_precision The precision to use for sets
+ * @return 0 on success.
+ */
+int metrics_reconfigure(metrics *m, double timer_eps, double *quantiles, uint32_t num_quants, radix_tree *histograms, unsigned char set_precision) {
+    m->timer_eps = timer_eps;
+    m->set_precision = set_precision;
+    if (histograms != m->histograms) {
+        m->histograms = histograms;
+        drop_prefix_cache(m);
+    }
+    if (num_quants == m->num_quants && !memcmp(quantiles, m->quantiles, num_quants * sizeof(double)))
+        return 0;
+
+    double *copy = malloc(num_quants * sizeof(double));
+    if (!copy) return -1;
+    memcpy(copy, quantiles, num_quants * sizeof(double));
+    free(m->quantiles);
+    m->quantiles = copy;
+    m->num_quants = num_quants;
     return 0;
 }
 
+/**
+ * Sets the quantile engine used for new timers.
+ * @arg engine The default engine
+ * @arg compression The compression used for t-digest timers
+ * @arg prefixes A radix tree of timer_config structs to override the
+ * engine and quantiles by prefix, or NULL. This is not owned by the metrics object.
+ */
+void metrics_set_timer_engine(metrics *m, timer_engine engine, double compression, radix_tree *prefixes) {
+    m->timer_engine = engine;
+    m->tdigest_compression = compression;
+    if (prefixes != m->timer_engines) {
+        m->timer_engines = prefixes;
+        drop_prefix_cache(m);
+    }
+}
+
+/**
+ * Sets the accuracy of the new timers and sets, which can
+ * be lowered to make them smaller. Those already made are
+ * unchanged, and still merge with the new ones.
+ * @arg m The metrics to configure
+ * @arg timer_eps The error for CM quantile timers
+ * @arg compression The compression for t-digest timers
+ * @arg set_precision The precision for sets
+ */
+void metrics_set_accuracy(metrics *m, double timer_eps, double compression, unsigned char set_precision) {
+    m->timer_eps = timer_eps;
+    m->tdigest_compression = compression;
+    m->set_precision = set_precision;
+}
+
+/**
+ * Sets the number of items a set counts exactly before
+ * switching to a HyperLogLog. Defaults to SET_MAX_EXACT.
+ * @arg m The metrics to configure
+ * @arg max_exact The maximum number of exact items
+ */
+void metrics_set_max_exact(metrics *m, uint32_t max_exact) {
+    m->set_max_exact = max_exact;
+}
+
+/**
+ * Sets the samples new timers insert into their quantile
+ * engine before the rest are sampled, see timer_set_admission.
+ * Defaults to 0, which inserts every sample.
+ * @arg m The metrics to configure
+ * @arg threshold The samples inserted before sampling
+ */
+void metrics_set_timer_admission(metrics *m, uint32_t threshold) {
+    m->timer_admission = threshold;
+}
+
+/**
+ * Sets the precision of new sets by prefix, which
+ * otherwise use the precision of the metrics.
+ * @arg m The metrics to configure
+ * @arg prefixes A radix tree of set_config structs, or NULL.
+ * This is not owned by the metrics object.
+ */
+void metrics_set_precisions(metrics *m, radix_tree *prefixes) {
+    m->set_precisions = prefixes;
+}
+
+/**
+ * Sets which counters only keep their sum, instead of the
+ * count, mean, stddev, min and max. Defaults to none.
+ * @arg m The metrics to configure
+ * @arg sum_only Do counters only keep their sum by default
+ * @arg prefixes A radix tree of counter_config structs to override
+ * the mode by prefix, or NULL. This is not owned by the metrics object.
+ */
+void metrics_set_counter_mode(metrics *m, bool sum_only, radix_tree *prefixes) {
+    m->counter_sum_only = sum_only;
+    m->counter_modes = prefixes;
+}
+
+/**
+ * Sets which K/V pairs coalesce their samples in an interval,
+ * into a single value per key. The rest keep every sample.
+ * Defaults to none.
+ * @arg m The metrics to configure
+ * @arg prefixes A radix tree of kv_config structs, or NULL.
+ * This is not owned by the metrics object.
+ */
+void metrics_set_kv_modes(metrics *m, radix_tree *prefixes) {
+    m->kv_modes = prefixes;
+}
+
+/**
+ * Sets the cardinality limits of prefixes. Once a prefix has
+ * its maximum of keys in an interval, the samples of new keys
+ * under it are folded into its overflow key. Defaults to none.
+ * @arg m The metrics to configure
+ * @arg limits A radix tree of limit_config structs, or NULL.
+ * This is not owned by the metrics object.
+ * @arg num_limits The number of limits in the tree
+ */
+void metrics_set_limits(metrics *m, radix_tree *limits, int num_limits) {
+    free(m->limit_keys);
+    m->limits = (num_limits) ? limits : NULL;
+    m->limit_keys = (m->limits) ? calloc(num_limits, sizeof(uint32_t)) : NULL;
+    m->num_limits = (m->limits) ? num_limits : 0;
+}
+
+// Points the maps at an intern table, or back at the arena with NULL
+static void metrics_use_names(metrics *m, intern_table *names) {
+    m->counters.names = names;
+    m->gauges.names = names;
+    m->sums.names = names;
+    m->kvs.names = names;
+    hashmap_set_interned(m->timers, names);
+    hashmap_set_interned(m->sets, names);
+    m->names = names;
+}
+
+/**
+ * Keeps the names of the keys across clears, so that the keys
+ * that are stable across intervals are not copied again for each
+ * one. Defaults to copying the names into the arena.
+ * @arg m The metrics to configure, which must be empty
+ * @arg max_idle The number of intervals a name is kept after
+ * it was last used, or 0 to stop keeping them.
+ * @return 0 on success.
+ */
+int metrics_set_interning(metrics *m, uint32_t max_idle) {
+    intern_table *old = m->names;
+    metrics_use_names(m, NULL);
+    if (old) {
+        intern_destroy(old);
+        free(old);
+    }
+    if (!max_idle) return 0;
+
+    intern_table *names = malloc(sizeof(intern_table));
+    if (!names || intern_init(max_idle, names)) {
+        free(names);
+        return -1;
+    }
+    metrics_use_names(m, names);
+    return 0;
+}
+
+// Frees a summary of the heaviest keys
+static void free_topk(topk *t) {
+    if (!t) return;
+    topk_destroy(t);
+    free(t);
+}
+
+/**
+ * Keeps the new counters and gauges in a map shared with other
+ * metrics objects, which may be updated by other threads at the
+ * same time. They fall back to the maps of the object once the
+ * shared map is full, or while there are limits. The shared map
+ * is not merged or cleared along with the object, that is left
+ * to metrics_merge_shared.
+ * @arg s The shared map, NULL to keep them in the object
+ */
+void metrics_set_shared(metrics *m, shared_map *s) {
+    m->shared = s;
+}
+
+/**
+ * Tracks the heaviest keys of each interval, by their samples
+ * and by their bytes. Defaults to not tracking them.
+ * @arg m The metrics to configure
+ * @arg capacity The number of keys monitored by each summary,
+ * or 0 to stop tracking them.
+ * @return 0 on success.
+ */
+int metrics_set_top_keys(metrics *m, uint32_t capacity) {
+    free_topk(m->top_samples);
+    free_topk(m->top_bytes);
+    m->top_samples = m->top_bytes = NULL;
+    if (!capacity) return 0;
+
+    topk *samples = malloc(sizeof(topk)), *bytes = malloc(sizeof(topk));
+    if (topk_init(capacity, samples)) {
+        free(samples);
+        samples = NULL;
+    }
+    if (topk_init(capacity, bytes)) {
+        free(bytes);
+        bytes = NULL;
+    }
+    if (!samples || !bytes) {
+        free_topk(samples);
+        free_topk(bytes);
+        return -1;
+    }
+    m->top_samples = samples;
+    m->top_bytes = bytes;
+    return 0;
+}
+
+/**
+ * Counts the samples and bytes received for a key, in the
+ * summaries of the heaviest keys. Only call this when the
+ * heaviest keys are tracked, with m->top_samples set.
+ * @arg m The metrics
+ * @arg key The key of the samples
+ * @arg samples The number of samples
+ * @arg bytes The bytes of input they took
+ */
+void metrics_track_key(metrics *m, char *key, uint64_t samples, uint64_t bytes) {
+    uint64_t hash = hash_key(key, strlen(key));
+    topk_add(m->top_samples, key, hash, samples);
+    topk_add(m->top_bytes, key, hash, bytes);
+}
+
 /**
  * Initializes the metrics struct, with preset configurations.
  * This defaults to a timer epsilon of 0.01 (1% error), and quantiles at
@@ -69,35 +365,206 @@ int destroy_metrics(metrics *m) {
     // Clear the copied quantiles array
     free(m->quantiles);
 
-    // Nuke all the k/v pairs
-    key_val *current = m->kv_vals;
-    key_val *prev = NULL;
-    while (current) {
-        free(current->name);
-        prev = current;
-        current = current->next;
-        free(prev);
+    // Release all the metrics
+    metrics_clear(m);
+
+    // Nuke the maps
+    counter_map_destroy(&m->counters);
+    hashmap_destroy(m->timers);
+    hashmap_destroy(m->sets);
+    gauge_map_destroy(&m->gauges);
+    sum_map_destroy(&m->sums);
+    kv_map_destroy(&m->kvs);
+    arena_destroy(&m->arena);
+    free(m->prefix_cache);
+    free(m->limit_keys);
+    free_topk(m->top_samples);
+    free_topk(m->top_bytes);
+    if (m->names) {
+        intern_destroy(m->names);
+        free(m->names);
     }
+    return 0;
+}
+
+/**
+ * Clears all the metrics so the struct can be re-used. The
+ * hashmaps keep their capacity, so the next interval does
+ * not need to grow them again.
+ * @return 0 on success.
+ */
+int metrics_clear(metrics *m) {
+    // Nuke all the k/v pairs, their chunks are in the arena
+    m->kv_head = m->kv_tail = NULL;
+    kv_map_clear(&m->kvs);
 
     // Nuke the counters
-    hashmap_iter(m->counters, counter_delete_cb, NULL);
-    hashmap_destroy(m->counters);
+    counter_map_clear(&m->counters);
+    sum_map_clear(&m->sums);
 
-    // Nuke the timers
+    // Nuke the timers, these have internal allocations
     hashmap_iter(m->timers, timer_delete_cb, NULL);
-    hashmap_destroy(m->timers);
+    hashmap_clear(m->timers);
 
-    // Nuke the timers
+    // Nuke the sets, these have internal allocations
     hashmap_iter(m->sets, set_delete_cb, NULL);
-    hashmap_destroy(m->sets);
+    hashmap_clear(m->sets);
 
     // Nuke the gauges
-    hashmap_iter(m->gauges, gauge_delete_cb, NULL);
-    hashmap_destroy(m->gauges);
+    gauge_map_clear(&m->gauges);
+
+    // Release the keys and metric structs at once. The
+    // interned names are only swept once nothing refers to them
+    arena_reset(&m->arena);
+    if (m->names) intern_advance(m->names);
+    m->inputs = 0;
 
+    // Each interval gets the full limits
+    if (m->limit_keys) memset(m->limit_keys, 0, m->num_limits * sizeof(uint32_t));
+    if (m->top_samples) {
+        topk_clear(m->top_samples);
+        topk_clear(m->top_bytes);
+    }
+
+    // Invalidate the pointers from metrics_get_metric
+    m->generation = __sync_add_and_fetch(&GENERATIONS, 1);
     return 0;
 }
 
+/**
+ * Called when a counter or gauge map grew, which moves the
+ * values. The new generation invalidates the pointers that
+ * were returned by metrics_get_metric.
+ */
+static void metrics_moved(metrics *m) {
+    m->generation = __sync_add_and_fetch(&GENERATIONS, 1);
+}
+
+/**
+ * Returns the number of keys in each of the maps
+ * @arg sizes Output, the sizes of the maps
+ */
+void metrics_get_sizes(metrics *m, metrics_sizes *sizes) {
+    sizes->counters = counter_map_size(&m->counters);
+    sizes->timers = hashmap_size(m->timers);
+    sizes->sets = hashmap_size(m->sets);
+    sizes->gauges = gauge_map_size(&m->gauges);
+    sizes->sums = sum_map_size(&m->sums);
+}
+
+/**
+ * Grows the maps so the given number of keys fit without
+ * resizing. This changes m->generation if a map moved.
+ * @arg sizes The number of keys to make room for
+ * @return 0 on success.
+ */
+int metrics_reserve(metrics *m, metrics_sizes *sizes) {
+    int res = 0;
+    res |= counter_map_reserve(&m->counters, sizes->counters);
+    res |= gauge_map_reserve(&m->gauges, sizes->gauges);
+    res |= sum_map_reserve(&m->sums, sizes->sums);
+    res |= hashmap_reserve(m->timers, sizes->timers);
+    res |= hashmap_reserve(m->sets, sizes->sets);
+    metrics_moved(m);
+    return res;
+}
+
+/**
+ * Shrinks the maps of a cleared metrics object that are at least
+ * four times what a number of keys needs, so an object that is
+ * re-used follows the keys of its intervals down instead of
+ * keeping the most it ever held. This changes m->generation.
+ * @arg sizes The number of keys to fit, such as of the last interval
+ * @return 0 on success, -1 if the metrics are not cleared.
+ */
+int metrics_fit(metrics *m, metrics_sizes *sizes) {
+    int res = 0;
+    res |= counter_map_fit(&m->counters, sizes->counters);
+    res |= gauge_map_fit(&m->gauges, sizes->gauges);
+    res |= sum_map_fit(&m->sums, sizes->sums);
+    res |= hashmap_fit(m->timers, sizes->timers);
+    res |= hashmap_fit(m->sets, sizes->sets);
+    metrics_moved(m);
+    return res;
+}
+
+/**
+ * Checks if a new counter only keeps its sum. The
+ * longest matching prefix overrides the default.
+ * @arg name The name of the counter
+ * @return True if only the sum is kept
+ */
+static bool counter_is_sum_only(metrics *m, char *name) {
+    counter_config *conf;
+    if (m->counter_modes && !radix_longest_prefix(m->counter_modes, name, (void**)&conf))
+        return conf->sum_only;
+    return m->counter_sum_only;
+}
+
+/**
+ * Checks a new key against the limit of its prefix. The key is
+ * counted while the prefix is under its limit, and after that
+ * the overflow key of the prefix is used in its place.
+ * @arg name The name of the new key
+ * @arg hash The hash of the name, updated if the overflow key is used
+ * @return The name to use for the key
+ */
+static char* metrics_limit_key(metrics *m, char *name, uint64_t *hash) {
+    limit_config *conf;
+    if (radix_longest_prefix(m->limits, name, (void**)&conf)) return name;
+    if (!strcmp(name, conf->overflow_key)) return name;
+    if (m->limit_keys[conf->index] < (uint32_t)conf->max_keys) {
+        m->limit_keys[conf->index]++;
+        return name;
+    }
+    stats_add(STAT_LIMIT_OVERFLOWS, 1);
+    *hash = hash_key(conf->overflow_key, strlen(conf->overflow_key));
+    return conf->overflow_key;
+}
+
+/**
+ * Returns the counter with the given name,
+ * creating it if it does not exist.
+ * @arg name The name of the counter
+ * @arg kind Output, set to COUNTER for a counter struct,
+ * or COUNTER_SUM if only the double sum is kept
+ * @return The counter, or NULL if the map could not grow
+ */
+static void* metrics_get_counter(metrics *m, char *name, uint64_t hash, metric_type *kind) {
+    counter *c;
+    double *sum;
+    int res;
+
+    // With modes by prefix, an existing counter may be in either map,
+    // and with limits a new counter may be over the limit of its prefix
+    if (m->counter_modes || m->limits) {
+        if ((sum = sum_map_get_hash(&m->sums, name, hash))) {
+            *kind = COUNTER_SUM;
+            return sum;
+        }
+        if ((c = counter_map_get_hash(&m->counters, name, hash))) {
+            *kind = COUNTER;
+            return c;
+        }
+        if (m->limits) name = metrics_limit_key(m, name, &hash);
+    }
+
+    // New sums are zeroed by the map
+    if (counter_is_sum_only(m, name)) {
+        *kind = COUNTER_SUM;
+        res = sum_map_get_or_insert_hash(&m->sums, name, hash, &sum);
+        if (res == 2) metrics_moved(m);
+        return sum;
+    }
+
+    // New counter
+    *kind = COUNTER;
+    res = counter_map_get_or_insert_hash(&m->counters, name, hash, &c);
+    if (res > 0) init_counter(c);
+    if (res == 2) metrics_moved(m);
+    return c;
+}
+
 /**
  * Increments the counter with the given name
  * by a value.
@@ -105,60 +572,369 @@ int destroy_metrics(metrics *m) {
  * @arg val The value to add
  * @return 0 on success
  */
-static int metrics_increment_counter(metrics *m, char *name, double val) {
-    counter *c;
-    int res = hashmap_get(m->counters, name, (void**)&c);
-
-    // New counter
-    if (res == -1) {
-        c = malloc(sizeof(counter));
-        init_counter(c);
-        hashmap_put(m->counters, name, c);
-    }
+static int metrics_increment_counter(metrics *m, char *name, uint64_t hash, double val) {
+    metric_type kind;
+    void *c = metrics_get_counter(m, name, hash, &kind);
+    if (!c) return -1;
 
     // Add the sample value
+    if (kind == COUNTER_SUM) {
+        *(double*)c += val;
+        return 0;
+    }
     return counter_add_sample(c, val);
 }
 
 /**
- * Adds a new timer sample for the timer with a
- * given name.
+ * Returns the timer with the given name,
+ * creating it if it does not exist.
  * @arg name The name of the timer
- * @arg val The sample to add
- * @return 0 on success.
+ * @return The timer
  */
-static int metrics_add_timer_sample(metrics *m, char *name, double val) {
-    timer_hist *t;
-    histogram_config *conf;
-    int res = hashmap_get(m->timers, name, (void**)&t);
+static timer_hist* metrics_get_timer(metrics *m, char *name, uint64_t hash) {
+    timer_hist *t, **slot;
+    histogram_config *conf = NULL;
+    timer_config *tconf = NULL;
+
+    // A new timer may be over the limit of its prefix
+    if (m->limits) {
+        if (!hashmap_get_hash(m->timers, name, hash, (void**)&t)) return t;
+        name = metrics_limit_key(m, name, &hash);
+    }
 
     // New timer
-    if (res == -1) {
-        t = malloc(sizeof(timer_hist));
-        init_timer(m->timer_eps, m->quantiles, m->num_quants, &t->tm);
-        hashmap_put(m->timers, name, t);
-
-        // Check if we have any histograms configured
-        if (m->histograms && !radix_longest_prefix(m->histograms, name, (void**)&conf)) {
-            t->conf = conf;
-            t->counts = calloc(conf->num_bins, sizeof(unsigned int));
+    if (hashmap_get_or_insert_hash(m->timers, name, hash, (void***)&slot)) {
+        t = *slot = arena_alloc(&m->arena, sizeof(timer_hist));
+
+        // Resolve the prefixes, unless the name is cached. The cache
+        // outlives metrics_clear, and is dropped if the trees change.
+        if (m->histograms || m->timer_engines) {
+            if (!m->prefix_cache)
+                m->prefix_cache = calloc(PREFIX_CACHE_SIZE, sizeof(prefix_cache_entry));
+            prefix_cache_entry *entry = m->prefix_cache + (hash % PREFIX_CACHE_SIZE);
+            if (hash && entry->hash == hash) {
+                tconf = entry->tconf;
+                conf = entry->hconf;
+            } else {
+                if (m->timer_engines && radix_longest_prefix(m->timer_engines, name, (void**)&tconf))
+                    tconf = NULL;
+                if (m->histograms && radix_longest_prefix(m->histograms, name, (void**)&conf))
+                    conf = NULL;
+                entry->hash = hash;
+                entry->tconf = tconf;
+                entry->hconf = conf;
+            }
+        }
+
+        // Pick the quantile engine and quantiles, which may be set by prefix
+        timer_engine engine = (tconf && tconf->has_engine) ? tconf->engine : m->timer_engine;
+        if (engine == TIMER_ENGINE_STATS) {
+            t->quantiles = NULL;
+            t->num_quants = 0;
+        } else if (tconf && tconf->quantiles) {
+            t->quantiles = tconf->quantiles;
+            t->num_quants = tconf->num_quantiles;
         } else {
-            t->conf = NULL;
-            t->counts = NULL;
+            t->quantiles = m->quantiles;
+            t->num_quants = m->num_quants;
+        }
+        if (engine == TIMER_ENGINE_TDIGEST)
+            init_timer_tdigest((tconf && tconf->compression) ? tconf->compression : m->tdigest_compression, &t->tm);
+        else if (engine == TIMER_ENGINE_HDR)
+            init_timer_hdr((tconf && tconf->eps) ? tconf->eps : m->timer_eps, &t->tm);
+        else if (engine == TIMER_ENGINE_STATS)
+            init_timer_stats(&t->tm);
+        else
+            init_timer((tconf && tconf->eps) ? tconf->eps : m->timer_eps, t->quantiles, t->num_quants, &t->tm);
+
+        // The raw samples share the lifetime of the timer in the arena
+        timer_use_arena(&t->tm, &m->arena);
+        timer_set_admission(&t->tm, m->timer_admission);
+
+        // Check if we have any histograms configured. The
+        // bins are allocated as they are used.
+        t->conf = conf;
+        t->counts = NULL;
+        t->bin_offset = 0;
+        t->num_counts = 0;
+        t->counts_size = 0;
+        t->sparse = NULL;
+        t->num_sparse = 0;
+    }
+    return *slot;
+}
+
+/**
+ * Returns the histogram bin of a value. Bin 0 has the values
+ * below the min, including NaN, and the last bin those at or
+ * above the max.
+ */
+static inline int histogram_bin(histogram_config *conf, double val) {
+    if (!(val >= conf->min_val)) return 0;
+    if (val >= conf->max_val) return conf->num_bins - 1;
+    int idx;
+    if (conf->scale == HISTOGRAM_LOG) {
+        // A little slack keeps values on a bin boundary, like 100
+        // with a width of 10, from rounding into the bin below
+        idx = (log(val) - conf->log_min) * conf->inv_bin_width + (1 + 1e-9);
+    } else
+        idx = (val - conf->min_val) * conf->inv_bin_width + 1;
+
+    // Guard against the rounding of the reciprocal at the edges
+    if (idx < 1) return 1;
+    return (idx < conf->num_bins - 1) ? idx : conf->num_bins - 1;
+}
+
+/**
+ * Returns the automatic bin of a value, on the powers of the
+ * width. Values at or below the min, including NaN, share its bin.
+ */
+static inline int32_t auto_histogram_bin(histogram_config *conf, double val) {
+    if (!(val > conf->min_val)) return floor(conf->log_min * conf->inv_bin_width);
+    double bin = floor(log(val) * conf->inv_bin_width);
+    return (bin < INT32_MAX / 2) ? (int32_t)bin : INT32_MAX / 2;
+}
+
+/**
+ * Adds to a bin of an automatic histogram. The counts only cover
+ * the run of bins from the lowest to the highest used, and grow in
+ * the arena to take in a new one. Past the max bins, the lowest are
+ * merged into the below bin, so the high ones are kept to the error.
+ */
+static void auto_histogram_add_bin(metrics *m, timer_hist *t, int32_t bin, uint64_t weight) {
+    int64_t pos = (int64_t)bin - t->bin_offset;
+    if (pos >= 0 && pos < t->num_counts) {
+        t->counts[1 + pos] += weight;
+        return;
+    }
+
+    // The new run of bins, keeping the highest
+    int64_t lo = bin, hi = bin;
+    if (t->num_counts) {
+        int64_t top = (int64_t)t->bin_offset + t->num_counts - 1;
+        lo = (bin < t->bin_offset) ? bin : t->bin_offset;
+        hi = (bin > top) ? bin : top;
+    }
+    if (hi - lo + 1 > t->conf->max_bins) lo = hi - t->conf->max_bins + 1;
+    uint32_t num = hi - lo + 1;
+
+    if (num + 1 > t->counts_size) {
+        uint32_t size = (t->counts_size) ? t->counts_size * 2 : 16;
+        while (size < num + 1) size *= 2;
+        if (size > (uint32_t)t->conf->max_bins + 1) size = t->conf->max_bins + 1;
+        uint64_t *counts = arena_calloc(&m->arena, size, sizeof(uint64_t));
+        if (t->counts) memcpy(counts, t->counts, (t->num_counts + 1) * sizeof(uint64_t));
+        t->counts = counts;
+        t->counts_size = size;
+    }
+
+    // Move the bins to their place in the new run
+    uint64_t *counts = t->counts;
+    uint32_t end;
+    if (lo <= t->bin_offset || !t->num_counts) {
+        uint32_t shift = (t->num_counts) ? t->bin_offset - lo : 0;
+        memmove(counts + 1 + shift, counts + 1, t->num_counts * sizeof(uint64_t));
+        memset(counts + 1, 0, shift * sizeof(uint64_t));
+        end = shift + t->num_counts;
+    } else {
+        uint32_t gone = lo - t->bin_offset;
+        if (gone > t->num_counts) gone = t->num_counts;
+        for (uint32_t i=0; i < gone; i++) counts[0] += counts[1 + i];
+        memmove(counts + 1, counts + 1 + gone, (t->num_counts - gone) * sizeof(uint64_t));
+        end = t->num_counts - gone;
+    }
+    memset(counts + 1 + end, 0, (num - end) * sizeof(uint64_t));
+    t->bin_offset = lo;
+    t->num_counts = num;
+
+    if (bin < lo)
+        counts[0] += weight;
+    else
+        counts[1 + bin - lo] += weight;
+}
+
+/**
+ * Returns the sparse bin of a fixed histogram at or after a bin
+ */
+static inline uint32_t sparse_bin_pos(timer_hist *t, uint32_t bin) {
+    uint32_t lo = 0, hi = t->num_sparse;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (t->sparse[mid].bin < bin) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * Adds to a bin of a fixed histogram. A wide histogram keeps its
+ * used bins sorted in a small vector, and only allocates the counts
+ * of every bin in the arena once the vector is full. A narrow one
+ * allocates them on its first value, as they take less room.
+ */
+static void fixed_histogram_add_bin(metrics *m, timer_hist *t, uint32_t bin, uint64_t weight) {
+    if (t->counts) {
+        t->counts[bin] += weight;
+        return;
+    }
+
+    uint32_t pos = 0;
+    if (t->conf->num_bins > 2 * HISTOGRAM_SPARSE_BINS) {
+        pos = sparse_bin_pos(t, bin);
+        if (pos < t->num_sparse && t->sparse[pos].bin == bin) {
+            t->sparse[pos].count += weight;
+            return;
+        }
+        if (!t->sparse) t->sparse = arena_alloc(&m->arena, HISTOGRAM_SPARSE_BINS * sizeof(hist_bin));
+    }
+
+    // Move the sparse bins to the counts once they are full
+    if (!t->sparse || t->num_sparse == HISTOGRAM_SPARSE_BINS) {
+        t->counts = arena_calloc(&m->arena, t->conf->num_bins, sizeof(uint64_t));
+        for (uint32_t i=0; i < t->num_sparse; i++) {
+            t->counts[t->sparse[i].bin] = t->sparse[i].count;
+        }
+        t->sparse = NULL;
+        t->num_sparse = 0;
+        t->counts[bin] += weight;
+        return;
+    }
+
+    memmove(t->sparse + pos + 1, t->sparse + pos, (t->num_sparse - pos) * sizeof(hist_bin));
+    t->sparse[pos] = (hist_bin){bin, weight};
+    t->num_sparse++;
+}
+
+/**
+ * Adds a value to the histogram of a timer
+ */
+static inline void histogram_add(metrics *m, timer_hist *t, double val, uint64_t weight) {
+    if (t->conf->scale == HISTOGRAM_AUTO)
+        auto_histogram_add_bin(m, t, auto_histogram_bin(t->conf, val), weight);
+    else
+        fixed_histogram_add_bin(m, t, histogram_bin(t->conf, val), weight);
+}
+
+#ifdef HAVE_SIMD_X86
+/**
+ * Indexes the linear bins of four values at a time with AVX2,
+ * the same way as the SSE2 loop of histogram_add_samples.
+ * @return The number of values added
+ */
+__attribute__((target("avx2")))
+static int linear_bins_avx2(histogram_config *conf, uint64_t *counts, double *vals, int num) {
+    __m256d vmin = _mm256_set1_pd(conf->min_val);
+    __m256d vmax = _mm256_set1_pd(conf->max_val);
+    __m256d vinv = _mm256_set1_pd(conf->inv_bin_width);
+    __m256d vone = _mm256_set1_pd(1);
+    __m256d vtop = _mm256_set1_pd(conf->num_bins - 1);
+    int32_t bins[4];
+    int i = 0;
+    for (; i + 4 <= num; i += 4) {
+        __m256d v = _mm256_loadu_pd(vals + i);
+        __m256d pos = _mm256_add_pd(_mm256_mul_pd(_mm256_sub_pd(v, vmin), vinv), vone);
+        pos = _mm256_min_pd(_mm256_max_pd(pos, vone), vtop);
+        __m256d below = _mm256_cmp_pd(v, vmin, _CMP_NGE_UQ);
+        __m256d above = _mm256_cmp_pd(v, vmax, _CMP_GE_OQ);
+        pos = _mm256_blendv_pd(pos, vtop, above);
+        pos = _mm256_andnot_pd(below, pos);
+
+        _mm_storeu_si128((__m128i*)bins, _mm256_cvttpd_epi32(pos));
+        counts[bins[0]]++;
+        counts[bins[1]]++;
+        counts[bins[2]]++;
+        counts[bins[3]]++;
+    }
+    return i;
+}
+#endif
+
+/**
+ * Adds many values to the histogram of a timer. Linear
+ * bins are indexed four values at a time with AVX2 if the
+ * host has it, else two at a time with SSE2.
+ */
+static void histogram_add_samples(metrics *m, timer_hist *t, double *vals, int num) {
+    histogram_config *conf = t->conf;
+    int i = 0;
+    if (conf->scale == HISTOGRAM_AUTO) {
+        for (; i < num; i++) {
+            auto_histogram_add_bin(m, t, auto_histogram_bin(conf, vals[i]), 1);
+        }
+        return;
+    }
+
+    // The values are batched once the counts of every bin are allocated
+    for (; i < num && !t->counts; i++) {
+        fixed_histogram_add_bin(m, t, histogram_bin(conf, vals[i]), 1);
+    }
+    uint64_t *counts = t->counts;
+#ifdef HAVE_SIMD_X86
+    if (conf->scale == HISTOGRAM_LINEAR && simd_current() >= SIMD_AVX2)
+        i += linear_bins_avx2(conf, counts, vals + i, num - i);
+#endif
+#ifdef __SSE2__
+    if (conf->scale == HISTOGRAM_LINEAR) {
+        __m128d vmin = _mm_set1_pd(conf->min_val);
+        __m128d vmax = _mm_set1_pd(conf->max_val);
+        __m128d vinv = _mm_set1_pd(conf->inv_bin_width);
+        __m128d vone = _mm_set1_pd(1);
+        __m128d vtop = _mm_set1_pd(conf->num_bins - 1);
+        for (; i + 2 <= num; i += 2) {
+            __m128d v = _mm_loadu_pd(vals + i);
+            __m128d pos = _mm_add_pd(_mm_mul_pd(_mm_sub_pd(v, vmin), vinv), vone);
+
+            // Clamp to the inner bins, since the reciprocal may round
+            // past the edges, then move the out of range values, and
+            // NaN, to the outer bins. This matches histogram_bin.
+            pos = _mm_min_pd(_mm_max_pd(pos, vone), vtop);
+            __m128d below = _mm_cmpnge_pd(v, vmin);
+            __m128d above = _mm_cmpge_pd(v, vmax);
+            pos = _mm_or_pd(_mm_andnot_pd(above, pos), _mm_and_pd(above, vtop));
+            pos = _mm_andnot_pd(below, pos);
+
+            __m128i idx = _mm_cvttpd_epi32(pos);
+            counts[_mm_cvtsi128_si32(idx)]++;
+            counts[_mm_cvtsi128_si32(_mm_shuffle_epi32(idx, 1))]++;
         }
     }
+#endif
+    for (; i < num; i++) {
+        counts[histogram_bin(conf, vals[i])]++;
+    }
+}
+
+/**
+ * Adds many samples to a timer and its histogram
+ * @return 0 on success.
+ */
+static int timer_hist_add_samples(metrics *m, timer_hist *t, double *vals, int num) {
+    // Add the histogram values in a batch
+    if (t->conf) {
+        histogram_add_samples(m, t, vals, num);
+    }
+
+    // Add the sample values
+    int res = 0;
+    for (int i=0; i < num; i++) {
+        res |= timer_add_sample(&t->tm, vals[i]);
+    }
+    return res;
+}
+
+/**
+ * Adds a new timer sample for the timer with a
+ * given name.
+ * @arg name The name of the timer
+ * @arg val The sample to add
+ * @return 0 on success.
+ */
+static int metrics_add_timer_sample(metrics *m, char *name, uint64_t hash, double val) {
+    timer_hist *t = metrics_get_timer(m, name, hash);
 
     // Add the histogram value
     if (t->conf) {
-        conf = t->conf;
-        if (val < conf->min_val)
-            t->counts[0]++;
-        else if (val >= conf->max_val)
-            t->counts[conf->num_bins - 1]++;
-        else {
-            int idx = ((val - conf->min_val) / conf->bin_width) + 1;
-            t->counts[idx]++;
-        }
+        histogram_add(m, t, val, 1);
     }
 
     // Add the sample value
@@ -166,46 +942,217 @@ static int metrics_add_timer_sample(metrics *m, char *name, double val) {
 }
 
 /**
- * Adds a new K/V pair
+ * Adds many samples to the timer with a given name,
+ * with a single lookup of the timer.
+ * @arg name The name of the timer
+ * @arg vals The samples to add
+ * @arg num The number of samples
+ * @return 0 on success.
+ */
+int metrics_add_timer_samples(metrics *m, char *name, double *vals, int num) {
+    return timer_hist_add_samples(m, metrics_get_timer(m, name, hash_key(name, strlen(name))), vals, num);
+}
+
+/**
+ * Adds a timer sample that stands for a number of samples, using
+ * a hash of the name computed with hash_key. The sample counts that
+ * many times in the timer and its histogram, but is only inserted
+ * once, so a sampled timer costs as much as one sample.
+ * @arg name The name of the timer
+ * @arg hash The hash of the name
+ * @arg val The sample to add
+ * @arg weight The number of samples it stands for, at least 1
+ * @return 0 on success.
+ */
+int metrics_add_timer_weighted(metrics *m, char *name, uint64_t hash, double val, uint64_t weight) {
+    STATSITE_PROBE3(add_sample, TIMER, name, val);
+    timer_hist *t = metrics_get_timer(m, name, hash);
+    if (t->conf) {
+        histogram_add(m, t, val, weight);
+    }
+    return timer_add_weighted(&t->tm, val, weight);
+}
+
+/**
+ * Returns the lower bound of a histogram bin, between the min and max.
+ * @arg conf The histogram config
+ * @arg i The index of the bin, starting at 0 for the one at the min value
+ * @return The lower bound of the bin
+ */
+double histogram_bin_start(histogram_config *conf, int i) {
+    if (conf->scale == HISTOGRAM_LOG)
+        return conf->min_val * pow(conf->bin_width, i);
+    return conf->min_val + conf->bin_width * i;
+}
+
+/**
+ * Returns the number of histogram bins of a timer. The first
+ * counts the values below the start of the second, and the last
+ * those at or above its start. Automatic histograms only have
+ * the bins from the lowest to the highest used.
+ * @arg t The timer
+ * @return The number of bins, 0 without a histogram
+ */
+int timer_hist_num_bins(timer_hist *t) {
+    if (!t->conf) return 0;
+    if (t->conf->scale == HISTOGRAM_AUTO) return (t->num_counts) ? t->num_counts + 1 : 0;
+    return t->conf->num_bins;
+}
+
+/**
+ * Returns the start of a histogram bin of a timer, the
+ * bound of the values of the first and last bins.
+ * @arg t The timer
+ * @arg i The index of the bin, from 0 to timer_hist_num_bins
+ * @return The start of the bin
+ */
+double timer_hist_bin_start(timer_hist *t, int i) {
+    histogram_config *conf = t->conf;
+    if (conf->scale == HISTOGRAM_AUTO)
+        return pow(conf->bin_width, t->bin_offset + ((i) ? i - 1 : 0));
+    if (i == 0) return conf->min_val;
+    if (i == conf->num_bins - 1) return conf->max_val;
+    return histogram_bin_start(conf, i - 1);
+}
+
+/**
+ * Returns the count of a histogram bin of a timer
+ * @arg t The timer
+ * @arg i The index of the bin, from 0 to timer_hist_num_bins
+ * @return The values counted in the bin
+ */
+uint64_t timer_hist_count(timer_hist *t, int i) {
+    if (t->counts) return t->counts[i];
+    uint32_t pos = sparse_bin_pos(t, i);
+    return (pos < t->num_sparse && t->sparse[pos].bin == (uint32_t)i) ? t->sparse[pos].count : 0;
+}
+
+/**
+ * Adds to the count of a bin of a fixed histogram
+ * @arg t The timer, with a linear or log histogram
+ * @arg i The index of the bin, from 0 to timer_hist_num_bins
+ * @arg count The values to add to the bin
+ */
+void timer_hist_add_count(metrics *m, timer_hist *t, int i, uint64_t count) {
+    if (count) fixed_histogram_add_bin(m, t, i, count);
+}
+
+/**
+ * Appends a K/V pair to the chunks, to be streamed as received
  * @arg name The key name
  * @arg val The value associated
  * @return 0 on success.
  */
-static int metrics_add_kv(metrics *m, char *name, double val) {
-    key_val *kv = malloc(sizeof(key_val));
-    kv->name = strdup(name);
+static int append_kv(metrics *m, char *name, double val) {
+    // Start a new chunk if the last is full
+    kv_chunk *chunk = m->kv_tail;
+    if (!chunk || chunk->num_vals == KV_CHUNK_SIZE) {
+        chunk = arena_alloc(&m->arena, sizeof(kv_chunk));
+        chunk->next = NULL;
+        chunk->num_vals = 0;
+        if (m->kv_tail) m->kv_tail->next = chunk;
+        else m->kv_head = chunk;
+        m->kv_tail = chunk;
+    }
+
+    key_val *kv = chunk->vals + chunk->num_vals++;
+    kv->name = name_arena_copy(&m->arena, name);
     kv->val = val;
-    kv->next = m->kv_vals;
-    m->kv_vals = kv;
+    return 0;
+}
+
+// Coalesces samples into a K/V pair, by the mode it was created with
+static void kv_update(kv_value *v, kv_value *src) {
+    if (!v->count) {
+        *v = *src;
+        return;
+    }
+    v->sum += src->sum;
+    v->count += src->count;
+    switch (v->mode) {
+        case KV_SUM:
+            v->val = v->sum;
+            break;
+        case KV_MIN:
+            if (src->val < v->val) v->val = src->val;
+            break;
+        case KV_MAX:
+            if (src->val > v->val) v->val = src->val;
+            break;
+        case KV_MEAN:
+            v->val = v->sum / v->count;
+            break;
+        default:
+            v->val = src->val;
+    }
+}
+
+/**
+ * Adds a new K/V pair. The pairs under a prefix that coalesces
+ * are kept once per key, the rest are appended as received.
+ * @arg name The key name
+ * @arg hash The hash of the name
+ * @arg val The value associated
+ * @return 0 on success.
+ */
+static int metrics_add_kv(metrics *m, char *name, uint64_t hash, double val) {
+    kv_config *conf;
+    if (!m->kv_modes || radix_longest_prefix(m->kv_modes, name, (void**)&conf) ||
+            conf->mode == KV_ALL)
+        return append_kv(m, name, val);
+
+    kv_value *v;
+    if (kv_map_get_or_insert_hash(&m->kvs, name, hash, &v) < 0) return -1;
+    kv_value sample = {val, val, 1, conf->mode};
+    kv_update(v, &sample);
     return 0;
 }
 
 /**
- * Sets a guage value
+ * Returns the gauge with the given name,
+ * creating it if it does not exist.
  * @arg name The name of the gauge
- * @arg val The value to set
- * @arg delta Is this a delta update
- * @return 0 on success
+ * @return The gauge, or NULL if the map could not grow
  */
-static int metrics_set_gauge(metrics *m, char *name, double val, bool delta) {
+static gauge_t* metrics_get_gauge(metrics *m, char *name, uint64_t hash) {
     gauge_t *g;
-    int res = hashmap_get(m->gauges, name, (void**)&g);
 
-    // New gauge
-    if (res == -1) {
-        g = malloc(sizeof(gauge_t));
-        g->value = 0;
-        hashmap_put(m->gauges, name, g);
+    // A new gauge may be over the limit of its prefix
+    if (m->limits) {
+        if ((g = gauge_map_get_hash(&m->gauges, name, hash))) return g;
+        name = metrics_limit_key(m, name, &hash);
     }
+    int res = gauge_map_get_or_insert_hash(&m->gauges, name, hash, &g);
+
+    // New gauges are zeroed by the map, so are unset
+    if (res == 2) metrics_moved(m);
+    return g;
+}
 
+// Updates a gauge with a value or a delta
+static int gauge_update(gauge_t *g, double val, bool delta) {
     if (delta) {
         g->value += val;
     } else {
         g->value = val;
+        g->is_set = true;
     }
     return 0;
 }
 
+/**
+ * Sets a guage value
+ * @arg name The name of the gauge
+ * @arg val The value to set
+ * @arg delta Is this a delta update
+ * @return 0 on success
+ */
+static int metrics_set_gauge(metrics *m, char *name, uint64_t hash, double val, bool delta) {
+    gauge_t *g = metrics_get_gauge(m, name, hash);
+    if (!g) return -1;
+    return gauge_update(g, val, delta);
+}
+
 /**
  * Adds a new sampled value
  * arg type The type of the metrics
@@ -214,27 +1161,196 @@ static int metrics_set_gauge(metrics *m, char *name, double val, bool delta) {
  * @return 0 on success.
  */
 int metrics_add_sample(metrics *m, metric_type type, char *name, double val) {
+    return metrics_add_sample_hash(m, type, name, hash_key(name, strlen(name)), val);
+}
+
+/**
+ * Adds a new sampled value, using a hash of the name
+ * computed with hash_key. This lets callers that hashed
+ * the name to prefetch it skip doing it again.
+ * arg type The type of the metrics
+ * @arg name The name of the metric
+ * @arg hash The hash of the name
+ * @arg val The sample to add
+ * @return 0 on success.
+ */
+int metrics_add_sample_hash(metrics *m, metric_type type, char *name, uint64_t hash, double val) {
+    STATSITE_PROBE3(add_sample, type, name, val);
     switch (type) {
         case KEY_VAL:
-            return metrics_add_kv(m, name, val);
+            return metrics_add_kv(m, name, hash, val);
 
         case GAUGE:
-            return metrics_set_gauge(m, name, val, false);
-
         case GAUGE_DELTA:
-            return metrics_set_gauge(m, name, val, true);
+            if (m->shared && !m->limits &&
+                    !shared_map_update_gauge(m->shared, name, hash, val, type == GAUGE_DELTA))
+                return 0;
+            return metrics_set_gauge(m, name, hash, val, type == GAUGE_DELTA);
 
         case COUNTER:
-            return metrics_increment_counter(m, name, val);
+            if (m->shared && !m->limits && !shared_map_add_counter(m->shared, name, hash, val, 1))
+                return 0;
+            return metrics_increment_counter(m, name, hash, val);
+
+        case TIMER:
+            return metrics_add_timer_sample(m, name, hash, val);
+
+        default:
+            return -1;
+    }
+}
+
+/**
+ * Prefetches the table entry a name of a type hashes to, so
+ * that a batch of samples can start loading the entries of
+ * all its names before updating any of them.
+ * @arg type The type of the metric
+ * @arg hash The hash of the name, from hash_key
+ */
+void metrics_prefetch(metrics *m, metric_type type, uint64_t hash) {
+    switch (type) {
+        case GAUGE:
+        case GAUGE_DELTA:
+            gauge_map_prefetch(&m->gauges, hash);
+            break;
+        case COUNTER:
+            // With modes by prefix, the counter may be in either map
+            if (m->counter_modes || m->counter_sum_only)
+                sum_map_prefetch(&m->sums, hash);
+            if (m->counter_modes || !m->counter_sum_only)
+                counter_map_prefetch(&m->counters, hash);
+            break;
+        case TIMER:
+            hashmap_prefetch(m->timers, hash);
+            break;
+        case SET:
+            hashmap_prefetch(m->sets, hash);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Adds the same sample value to a counter many times,
+ * with a single lookup of the counter.
+ * @arg name The name of the counter
+ * @arg val The sample value
+ * @arg count The number of samples
+ * @return 0 on success.
+ */
+int metrics_add_counter_samples(metrics *m, char *name, double val, uint64_t count) {
+    metric_type kind;
+    uint64_t hash = hash_key(name, strlen(name));
+    if (m->shared && !m->limits && !shared_map_add_counter(m->shared, name, hash, val, count))
+        return 0;
+    void *c = metrics_get_counter(m, name, hash, &kind);
+    if (!c) return -1;
+    if (kind == COUNTER_SUM) {
+        *(double*)c += val * count;
+        return 0;
+    }
+    return counter_add_samples(c, val, count);
+}
 
+/**
+ * Returns the metric struct for a name, creating it if it does
+ * not exist, so samples can be added with metrics_add_to without
+ * looking up the name again. The pointer stays valid until the
+ * metrics are cleared, or the counter or gauge map grows, both of
+ * which change m->generation.
+ * @arg type The type of the metric
+ * @arg name The name of the metric
+ * @return The metric, or NULL for K/V pairs and sets.
+ */
+void* metrics_get_metric(metrics *m, metric_type *type, char *name) {
+    uint64_t hash = hash_key(name, strlen(name));
+    switch (*type) {
+        case GAUGE:
+        case GAUGE_DELTA:
+            return metrics_get_gauge(m, name, hash);
+        case COUNTER:
+            return metrics_get_counter(m, name, hash, type);
         case TIMER:
-            return metrics_add_timer_sample(m, name, val);
+            return metrics_get_timer(m, name, hash);
+        default:
+            return NULL;
+    }
+}
 
+/**
+ * Adds samples to a metric returned by metrics_get_metric
+ * @arg type The type the metric was returned for
+ * @arg metric The metric to update
+ * @arg vals The samples to add
+ * @arg num The number of samples
+ * @return 0 on success.
+ */
+int metrics_add_to(metrics *m, metric_type type, void *metric, double *vals, int num) {
+    int res = 0;
+    switch (type) {
+        case GAUGE:
+        case GAUGE_DELTA:
+            for (int i=0; i < num; i++) {
+                res |= gauge_update(metric, vals[i], type == GAUGE_DELTA);
+            }
+            return res;
+        case COUNTER:
+            for (int i=0; i < num; i++) {
+                res |= counter_add_sample(metric, vals[i]);
+            }
+            return res;
+        case COUNTER_SUM:
+            for (int i=0; i < num; i++) {
+                *(double*)metric += vals[i];
+            }
+            return 0;
+        case TIMER:
+            return timer_hist_add_samples(m, metric, vals, num);
         default:
             return -1;
     }
 }
 
+/**
+ * Returns the set with the given name,
+ * creating it if it does not exist.
+ * @arg name The name of the set
+ * @return The set
+ */
+set_t* metrics_get_set(metrics *m, char *name) {
+    return metrics_get_set_hash(m, name, hash_key(name, strlen(name)));
+}
+
+/**
+ * Returns the set with the given name, creating it if
+ * it does not exist, using a hash of the name.
+ * @arg name The name of the set
+ * @arg hash The hash of the name, from hash_key
+ * @return The set
+ */
+set_t* metrics_get_set_hash(metrics *m, char *name, uint64_t hash) {
+    set_t **s, *found;
+
+    // A new set may be over the limit of its prefix
+    if (m->limits) {
+        if (!hashmap_get_hash(m->sets, name, hash, (void**)&found)) return found;
+        name = metrics_limit_key(m, name, &hash);
+    }
+
+    // New set
+    if (hashmap_get_or_insert_hash(m->sets, name, hash, (void***)&s)) {
+        // The precision may be set by prefix
+        set_config *conf;
+        unsigned char precision = m->set_precision;
+        if (m->set_precisions && !radix_longest_prefix(m->set_precisions, name, (void**)&conf))
+            precision = conf->precision;
+        *s = arena_alloc(&m->arena, sizeof(set_t));
+        set_init_exact(precision, m->set_max_exact, *s);
+    }
+    return *s;
+}
+
 /**
  * Adds a value to a named set.
  * @arg name The name of the set
@@ -242,46 +1358,300 @@ int metrics_add_sample(metrics *m, metric_type type, char *name, double val) {
  * @return 0 on success
  */
 int metrics_set_update(metrics *m, char *name, char *value) {
-    set_t *s;
-    int res = hashmap_get(m->sets, name, (void**)&s);
+    return metrics_set_update_hash(m, name, hash_key(name, strlen(name)), value);
+}
 
-    // New set
-    if (res == -1) {
-        s = malloc(sizeof(set_t));
-        set_init(m->set_precision, s);
-        hashmap_put(m->sets, name, s);
-    }
+/**
+ * Adds a value to a named set, using a hash of the name.
+ * @arg name The name of the set
+ * @arg hash The hash of the name, from hash_key
+ * @arg value The value to add
+ * @return 0 on success
+ */
+int metrics_set_update_hash(metrics *m, char *name, uint64_t hash, char *value) {
+    STATSITE_PROBE2(set_update, name, value);
+    set_t *s = metrics_get_set_hash(m, name, hash);
 
     // Add the sample value
     set_add(s, value);
     return 0;
 }
 
+/**
+ * Adds members that were already hashed by the client to a
+ * named set, with a single lookup of the set.
+ * @arg name The name of the set
+ * @arg hashes The 64 bit hashes of the members
+ * @arg num The number of hashes
+ * @return 0 on success
+ */
+int metrics_add_set_hashes(metrics *m, char *name, uint64_t *hashes, int num) {
+    set_t *s = metrics_get_set_hash(m, name, hash_key(name, strlen(name)));
+    for (int i=0; i < num; i++) {
+        set_add_hash(s, hashes[i]);
+    }
+    return 0;
+}
+
+/**
+ * Merges all the metrics of one struct into another.
+ * Counters, timers, sets and histograms are combined. Gauges
+ * that were set take the value from src, while gauges that only
+ * received deltas are added. K/V pairs are copied, the
+ * coalesced ones are coalesced, and the input counts are added.
+ * @arg dst The metrics to merge into
+ * @arg src The metrics to merge from. The timers may be
+ * flushed, but is otherwise unmodified.
+ * @return 0 on success.
+ */
+int metrics_merge(metrics *dst, metrics *src) {
+    // Copy the K/V pairs
+    for (kv_chunk *chunk = src->kv_head; chunk; chunk = chunk->next) {
+        for (uint32_t i=0; i < chunk->num_vals; i++) {
+            append_kv(dst, chunk->vals[i].name, chunk->vals[i].val);
+        }
+    }
+
+    // Merge each of the maps
+    dst->inputs += src->inputs;
+    if (dst->top_samples && src->top_samples) {
+        topk_merge(dst->top_samples, src->top_samples);
+        topk_merge(dst->top_bytes, src->top_bytes);
+    }
+    int res = counter_map_iter_hash(&src->counters, counter_merge_cb, dst);
+    if (res) return res;
+    res = hashmap_iter_hash(src->timers, timer_merge_cb, dst);
+    if (res) return res;
+    res = gauge_map_iter_hash(&src->gauges, gauge_merge_cb, dst);
+    if (res) return res;
+    res = sum_map_iter_hash(&src->sums, sum_merge_cb, dst);
+    if (res) return res;
+    res = kv_map_iter_hash(&src->kvs, kv_merge_cb, dst);
+    if (res) return res;
+    return hashmap_iter_hash(src->sets, set_merge_cb, dst);
+}
+
+/**
+ * Adds a value of a sketch to a timer of another engine,
+ * once for each of the samples it stands for. The caller
+ * restores the exact sums afterwards.
+ * @return 0 on success.
+ */
+static int add_weighted(timer *t, double value, uint64_t weight) {
+    int res = 0;
+    for (uint64_t i=0; i < weight; i++) {
+        res |= timer_add_sample(t, value);
+    }
+    return res;
+}
+
+// Merges a decoded timer, adding the raw samples or merging the sketch
+static int merge_timer_sketch(metrics *m, char *name, timer *src) {
+    metric_type type = TIMER;
+    timer_hist *t = metrics_get_metric(m, &type, name);
+    if (!t) return -1;
+
+    // Without quantiles there are only the sums and extremes to add
+    int res = 0;
+    if (src->engine == TIMER_ENGINE_STATS && t->tm.engine != TIMER_ENGINE_STATS) {
+        if (src->count && (!t->tm.count || src->min < t->tm.min)) t->tm.min = src->min;
+        if (src->count && (!t->tm.count || src->max > t->tm.max)) t->tm.max = src->max;
+        t->tm.count += src->count;
+        t->tm.sum += src->sum;
+        t->tm.squared_sum += src->squared_sum;
+        return 0;
+    }
+
+    // Raw samples are re-added, so they suit any engine
+    if (src->engine != TIMER_ENGINE_STATS && src->count <= TIMER_EXACT_MAX) {
+        for (uint32_t i=0; i < src->num_exact; i++) {
+            res |= timer_add_sample(&t->tm, src->exact[i]);
+        }
+        return res;
+    }
+
+    // Merge the sketch if the engines match
+    if (t->tm.engine == src->engine) return timer_merge(&t->tm, src);
+
+    double prev_sum = t->tm.sum, prev_squared = t->tm.squared_sum;
+    double prev_min = t->tm.min, prev_max = t->tm.max;
+    uint64_t prev_count = t->tm.count;
+    if (src->engine == TIMER_ENGINE_TDIGEST) {
+        for (uint32_t i=0; i < src->q.td.num_centroids; i++) {
+            res |= add_weighted(&t->tm, src->q.td.nodes[i].mean, src->q.td.nodes[i].weight);
+        }
+    } else if (src->engine == TIMER_ENGINE_HDR) {
+        for (uint32_t i=0; i < src->q.hdr.num_buckets; i++) {
+            if (src->q.hdr.counts[i])
+                res |= add_weighted(&t->tm, hdr_bucket_value(&src->q.hdr, i), src->q.hdr.counts[i]);
+        }
+    } else {
+        for (uint64_t i=0; i < src->q.cm.num_samples; i++) {
+            res |= add_weighted(&t->tm, src->q.cm.samples[i].value, src->q.cm.samples[i].width);
+        }
+    }
+    t->tm.sum = prev_sum + src->sum;
+    t->tm.squared_sum = prev_squared + src->squared_sum;
+
+    // The values re-added stand in for the samples, the extremes are exact
+    t->tm.min = (prev_count && prev_min < src->min) ? prev_min : src->min;
+    t->tm.max = (prev_count && prev_max > src->max) ? prev_max : src->max;
+    return res;
+}
+
+// Merges the entries of a map that start with a prefix
+struct prefix_merge_info {
+    metrics *dst;
+    const char *prefix;
+    size_t prefix_len;
+    hashmap_hash_callback cb;
+};
+
+static int prefix_merge_cb(void *data, const char *key, uint64_t hash, void *value) {
+    struct prefix_merge_info *info = data;
+    if (strncmp(key, info->prefix, info->prefix_len)) return 0;
+    return info->cb(info->dst, key, hash, value);
+}
+
+/**
+ * Merges the metrics of one struct whose names start with a
+ * prefix into another, as metrics_merge. The input counts are
+ * not added.
+ * @arg dst The metrics to merge into
+ * @arg src The metrics to merge from. The timers may be
+ * flushed, but is otherwise unmodified.
+ * @arg prefix The prefix of the names to merge, "" for all
+ * @return 0 on success.
+ */
+int metrics_merge_prefix(metrics *dst, metrics *src, const char *prefix) {
+    size_t prefix_len = strlen(prefix);
+    for (kv_chunk *chunk = src->kv_head; chunk; chunk = chunk->next) {
+        for (uint32_t i=0; i < chunk->num_vals; i++) {
+            if (strncmp(chunk->vals[i].name, prefix, prefix_len)) continue;
+            append_kv(dst, chunk->vals[i].name, chunk->vals[i].val);
+        }
+    }
+
+    struct prefix_merge_info info = {dst, prefix, prefix_len, counter_merge_cb};
+    int res = counter_map_iter_hash(&src->counters, prefix_merge_cb, &info);
+    if (res) return res;
+    info.cb = timer_merge_cb;
+    res = hashmap_iter_hash(src->timers, prefix_merge_cb, &info);
+    if (res) return res;
+    info.cb = gauge_merge_cb;
+    res = gauge_map_iter_hash(&src->gauges, prefix_merge_cb, &info);
+    if (res) return res;
+    info.cb = sum_merge_cb;
+    res = sum_map_iter_hash(&src->sums, prefix_merge_cb, &info);
+    if (res) return res;
+    info.cb = kv_merge_cb;
+    res = kv_map_iter_hash(&src->kvs, prefix_merge_cb, &info);
+    if (res) return res;
+    info.cb = set_merge_cb;
+    return hashmap_iter_hash(src->sets, prefix_merge_cb, &info);
+}
+
+/**
+ * Merges an encoded counter, set or timer sketch into the
+ * metric of the same name. Sets merge dense registers in place
+ * from the buffer when they can, and timers of another engine
+ * are added as weighted values.
+ * @arg name The name of the metric
+ * @arg buf The encoded sketch
+ * @arg len The bytes available
+ * @return The bytes decoded, or -1 if it is not valid.
+ */
+int metrics_merge_sketch(metrics *m, char *name, const char *buf, size_t len) {
+    int used, res = 0;
+    switch (sketch_kind_of(buf, len)) {
+        case SKETCH_COUNTER: {
+            counter src;
+            used = sketch_decode_counter(buf, len, &src);
+            if (used < 0) return -1;
+            metric_type type = COUNTER;
+            void *dst = metrics_get_metric(m, &type, name);
+            if (type == COUNTER_SUM)
+                *(double*)dst += src.sum;
+            else
+                res = counter_merge(dst, &src);
+            break;
+        }
+
+        case SKETCH_SET: {
+            set_t src;
+            int viewed = 1;
+            used = sketch_view_set(buf, len, &src);
+            if (used < 0) {
+                viewed = 0;
+                used = sketch_decode_set(buf, len, &src);
+                if (used < 0) return -1;
+            }
+            if (set_merge(metrics_get_set(m, name), &src)) {
+                syslog(LOG_WARNING, "Set %s has a different precision, not merging its sketch", name);
+            }
+            if (!viewed) set_destroy(&src);
+            break;
+        }
+
+        case SKETCH_TIMER: {
+            timer src;
+            used = sketch_decode_timer(buf, len, &src);
+            if (used < 0) return -1;
+            res = merge_timer_sketch(m, name, &src);
+            destroy_timer(&src);
+            break;
+        }
+
+        default:
+            return -1;
+    }
+    return (res) ? -1 : used;
+}
+
+/**
+ * Merges a coalesced K/V pair, such as one restored from a
+ * snapshot, into the pair of the same name. The pair keeps
+ * the mode it was created with, as with metrics_merge.
+ * @arg name The key name
+ * @arg v The coalesced value, with its sum and count
+ * @return 0 on success.
+ */
+int metrics_merge_kv(metrics *m, char *name, kv_value *v) {
+    return kv_merge_cb(m, name, hash_key(name, strlen(name)), v);
+}
+
 /**
  * Iterates through all the metrics
  * @arg m The metrics to iterate through
  * @arg data Opaque handle passed to the callback
  * @arg cb A callback function to invoke. Called with a type, name
  * and value. If the type is KEY_VAL, it is a pointer to a double,
- * for a counter, it is a pointer to a counter, and for a timer it is
- * a pointer to a timer. Return non-zero to stop iteration.
+ * for a counter, it is a pointer to a counter, for a COUNTER_SUM it
+ * is a pointer to the double sum, and for a timer it is a pointer to
+ * a timer. Return non-zero to stop iteration.
  * @return 0 on success, or the return of the callback
  */
 int metrics_iter(metrics *m, void *data, metric_callback cb) {
-    // Handle the K/V pairs first
-    key_val *current = m->kv_vals;
+    // Handle the K/V pairs first, in the order received
     int should_break = 0;
-    while (current && !should_break) {
-        should_break = cb(data, KEY_VAL, current->name, &current->val);
-        current = current->next;
+    for (kv_chunk *chunk = m->kv_head; chunk && !should_break; chunk = chunk->next) {
+        for (uint32_t i=0; i < chunk->num_vals && !should_break; i++) {
+            should_break = cb(data, KEY_VAL, chunk->vals[i].name, &chunk->vals[i].val);
+        }
     }
     if (should_break) return should_break;
 
-    // Store our data in a small struct
-    struct cb_info info = {COUNTER, data, cb};
+    // Then the coalesced pairs, whose values are first in their structs
+    struct cb_info info = {KEY_VAL, data, cb};
+    should_break = kv_map_iter(&m->kvs, iter_cb, &info);
+    if (should_break) return should_break;
 
     // Send the counters
-    should_break = hashmap_iter(m->counters, iter_cb, &info);
+    info.type = COUNTER;
+    should_break = counter_map_iter(&m->counters, iter_cb, &info);
+    if (should_break) return should_break;
+    info.type = COUNTER_SUM;
+    should_break = sum_map_iter(&m->sums, iter_cb, &info);
     if (should_break) return should_break;
 
     // Send the timers
@@ -291,7 +1661,7 @@ int metrics_iter(metrics *m, void *data, metric_callback cb) {
 
     // Send the gauges
     info.type = GAUGE;
-    should_break = hashmap_iter(m->gauges, iter_cb, &info);
+    should_break = gauge_map_iter(&m->gauges, iter_cb, &info);
     if (should_break) return should_break;
 
     // Send the sets
@@ -301,18 +1671,10 @@ int metrics_iter(metrics *m, void *data, metric_callback cb) {
     return should_break;
 }
 
-// Counter map cleanup
-static int counter_delete_cb(void *data, const char *key, void *value) {
-    free(value);
-    return 0;
-}
-
 // Timer map cleanup
 static int timer_delete_cb(void *data, const char *key, void *value) {
     timer_hist *t = value;
     destroy_timer(&t->tm);
-    if (t->counts) free(t->counts);
-    free(t);
     return 0;
 }
 
@@ -320,17 +1682,107 @@ static int timer_delete_cb(void *data, const char *key, void *value) {
 static int set_delete_cb(void *data, const char *key, void *value) {
     set_t *s = value;
     set_destroy(s);
-    free(s);
     return 0;
 }
 
-// Gauge map cleanup
-static int gauge_delete_cb(void *data, const char *key, void *value) {
-    gauge_t *g = value;
-    free(g);
+// Counter map merging
+static int counter_merge_cb(void *data, const char *key, uint64_t hash, void *value) {
+    metric_type kind;
+    void *c = metrics_get_counter(data, (char*)key, hash, &kind);
+    if (!c) return -1;
+    if (kind == COUNTER_SUM) {
+        *(double*)c += counter_sum(value);
+        return 0;
+    }
+    return counter_merge(c, value);
+}
+
+// Sum only counter merging
+static int sum_merge_cb(void *data, const char *key, uint64_t hash, void *value) {
+    metric_type kind;
+    void *c = metrics_get_counter(data, (char*)key, hash, &kind);
+    if (!c) return -1;
+    if (kind == COUNTER_SUM) {
+        *(double*)c += *(double*)value;
+        return 0;
+    }
+
+    // The modes differ, so only the sum is known
+    return counter_add_sample(c, *(double*)value);
+}
+
+// Timer map merging
+static int timer_merge_cb(void *data, const char *key, uint64_t hash, void *value) {
+    timer_hist *src = value;
+    timer_hist *t = metrics_get_timer(data, (char*)key, hash);
+
+    // Add the histogram counts if the bins match. The automatic
+    // bins are added one at a time, as their runs may differ.
+    if (t->conf && t->conf == src->conf && t->conf->scale == HISTOGRAM_AUTO) {
+        for (uint32_t i=0; i < src->num_counts; i++) {
+            if (src->counts[1 + i]) auto_histogram_add_bin(data, t, src->bin_offset + i, src->counts[1 + i]);
+        }
+        if (t->num_counts) t->counts[0] += src->counts[0];
+    } else if (t->conf && t->conf == src->conf && src->counts) {
+        for (int i=0; i < t->conf->num_bins; i++) {
+            if (src->counts[i]) fixed_histogram_add_bin(data, t, i, src->counts[i]);
+        }
+    } else if (t->conf && t->conf == src->conf) {
+        for (uint32_t i=0; i < src->num_sparse; i++) {
+            fixed_histogram_add_bin(data, t, src->sparse[i].bin, src->sparse[i].count);
+        }
+    }
+    return timer_merge(&t->tm, &src->tm);
+}
+
+// Set map merging
+static int set_merge_cb(void *data, const char *key, uint64_t hash, void *value) {
+    set_t *s = metrics_get_set_hash(data, (char*)key, hash);
+    return set_merge(s, value);
+}
+
+// Coalesced K/V merging, in the mode of the source
+static int kv_merge_cb(void *data, const char *key, uint64_t hash, void *value) {
+    metrics *m = data;
+    kv_value *v;
+    if (kv_map_get_or_insert_hash(&m->kvs, key, hash, &v) < 0) return -1;
+    kv_update(v, value);
+    return 0;
+}
+
+// Gauge map merging
+static int gauge_merge_cb(void *data, const char *key, uint64_t hash, void *value) {
+    gauge_t *src = value;
+    gauge_t *g = metrics_get_gauge(data, (char*)key, hash);
+    if (!g) return -1;
+    if (src->is_set) {
+        g->value = src->value;
+        g->is_set = true;
+    } else {
+        g->value += src->value;
+    }
     return 0;
 }
 
+// Shared counter and gauge merging
+static int shared_merge_cb(void *data, const char *key, uint64_t hash, counter *c, shared_gauge *g) {
+    if (c) return counter_merge_cb(data, key, hash, c);
+    gauge_t gauge = {g->value, g->is_set};
+    return gauge_merge_cb(data, key, hash, &gauge);
+}
+
+/**
+ * Merges the counters and gauges of a shared map into the maps
+ * of a metrics object. The updates may still run, for a query.
+ * @arg dst The metrics to merge into
+ * @arg s The shared map
+ * @arg prefix Only the names that start with this, or NULL for all
+ * @return 0 on success.
+ */
+int metrics_merge_shared(metrics *dst, shared_map *s, const char *prefix) {
+    return shared_map_iter(s, prefix, dst, shared_merge_cb);
+}
+
 // Callback to invoke the user code
 static int iter_cb(void *data, const char *key, void *value) {
     struct cb_info *info = data;
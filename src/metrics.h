@@ -2,11 +2,15 @@
 #define METRICS_H
 #include <stdint.h>
 #include "config.h"
+#include "arena.h"
 #include "radix.h"
 #include "counter.h"
 #include "timer.h"
 #include "hashmap.h"
+#include "inline_map.h"
 #include "set.h"
+#include "topk.h"
+#include "shared_map.h"
 
 typedef enum {
     UNKNOWN,
@@ -15,42 +19,146 @@ typedef enum {
     COUNTER,
     TIMER,
     SET,
-    GAUGE_DELTA
+    GAUGE_DELTA,
+    COUNTER_SUM     // A counter that only keeps its sum
 } metric_type;
 
-typedef struct key_val {
+typedef struct {
     char *name;
     double val;
-    struct key_val *next;
 } key_val;
 
+// Number of key/value pairs stored in each chunk
+#define KV_CHUNK_SIZE 256
+
+/**
+ * Key/value pairs are appended to chunks allocated from
+ * the arena, so they are iterated in the order received.
+ */
+typedef struct kv_chunk {
+    struct kv_chunk *next;
+    uint32_t num_vals;
+    key_val vals[KV_CHUNK_SIZE];
+} kv_chunk;
+
+// The bins a wide fixed histogram keeps sparsely, before its counts
+#define HISTOGRAM_SPARSE_BINS 8
+
+// A used bin of a sparse histogram
+typedef struct {
+    uint32_t bin;
+    uint64_t count;
+} hist_bin;
+
 typedef struct {
     timer tm;
 
+    // The sorted quantiles reported for the timer
+    double *quantiles;
+    uint32_t num_quants;
+
     // Support for histograms
     histogram_config *conf;
-    unsigned int *counts;
+    uint64_t *counts;
+
+    // The used run of automatic bins, after the below bin in counts
+    int32_t bin_offset;     // The bin of counts[1]
+    uint32_t num_counts;    // The bins used after counts[0]
+    uint32_t counts_size;   // The counts allocated
+
+    // The used bins of a fixed histogram by bin, until they fill
+    // and the counts of every bin are allocated
+    hist_bin *sparse;
+    uint32_t num_sparse;
 } timer_hist;
 
+/**
+ * A cached result of the prefix lookups for a timer name.
+ * Entries are matched by the 64bit hash of the name, and
+ * also cache the names without a histogram or engine.
+ */
+typedef struct {
+    uint64_t hash;      // Hash of the name, 0 if the entry is empty
+    timer_config *tconf;
+    histogram_config *hconf;
+} prefix_cache_entry;
+
+// Number of entries in the direct mapped prefix cache
+#define PREFIX_CACHE_SIZE 1024
+
 typedef struct {
     double value;
+    bool is_set;    // Was an absolute value set, or only deltas
 } gauge_t;
 
+/**
+ * A key/value pair whose samples are coalesced, by the mode
+ * of its prefix when it was created. The value is first, so a
+ * pointer to the struct is a pointer to the double streamed.
+ */
 typedef struct {
-    hashmap *counters;  // Hashmap of name -> counter structs
+    double val;         // The coalesced value
+    double sum;         // The sum of the samples, for the mean
+    uint64_t count;     // The samples coalesced
+    kv_mode mode;
+} kv_value;
+
+// Maps that store the counters and gauges inline in their entries
+INLINE_MAP_DEFINE(counter_map, counter)
+INLINE_MAP_DEFINE(gauge_map, gauge_t)
+INLINE_MAP_DEFINE(sum_map, double)
+INLINE_MAP_DEFINE(kv_map, kv_value)
+
+typedef struct {
+    counter_map counters; // Map of name -> counter, stored inline
     hashmap *timers;    // Map of name -> timer_hist structs
     hashmap *sets;      // Map of name -> set_t structs
-    hashmap *gauges;    // Map of name -> guage struct
-    key_val *kv_vals;   // Linked list of key_val structs
+    gauge_map gauges;   // Map of name -> gauge, stored inline
+    sum_map sums;       // Map of name -> sum, for sum only counters
+    kv_chunk *kv_head;  // Chunks of key_val structs, oldest first
+    kv_chunk *kv_tail;  // The chunk being appended to
+    kv_map kvs;         // Map of name -> coalesced K/V pair, stored inline
     double timer_eps;   // The error for timers
     double *quantiles;  // Array of quantiles
     uint32_t num_quants; // Size of quantiles array
     radix_tree *histograms; // Radix tree with histogram configs
     unsigned char set_precision; // The precision for sets
+    timer_engine timer_engine; // The default quantile engine for timers
+    double tdigest_compression; // The compression for t-digest timers
+    radix_tree *timer_engines; // Radix tree with per-prefix timer engines and quantiles
+    uint32_t timer_admission; // Samples a timer inserts before sampling, 0 for all
+    uint32_t set_max_exact; // The number of set items counted exactly
+    radix_tree *set_precisions; // Radix tree with per-prefix set precisions
+    bool counter_sum_only; // Do new counters only keep their sum
+    radix_tree *counter_modes; // Radix tree with per-prefix counter modes
+    radix_tree *kv_modes; // Radix tree with per-prefix K/V coalescing
+    radix_tree *limits; // Radix tree with per-prefix cardinality limits
+    uint32_t *limit_keys; // The keys under each limit in this interval
+    int num_limits;     // Size of the limit_keys array
+    topk *top_samples;  // The heaviest keys by samples, or NULL
+    topk *top_bytes;    // The heaviest keys by bytes, or NULL
+    intern_table *names; // Stable copies of the keys, kept across clears, or NULL
+    uint64_t inputs;    // Number of inputs received, for the input counter
+    prefix_cache_entry *prefix_cache; // Cached prefix lookups, kept across clears
+    shared_map *shared; // Counters and gauges shared with other objects, or NULL
+    uint64_t generation; // Unique to each interval, changes when cleared
+    arena arena;        // Owns the keys and metric structs
 } metrics;
 
 typedef int(*metric_callback)(void *data, metric_type type, char *name, void *val);
 
+/**
+ * The number of keys in each of the maps, used
+ * to size the maps of a metrics object up front.
+ */
+typedef struct {
+    uint32_t counters;
+    uint32_t timers;
+    uint32_t sets;
+    uint32_t gauges;
+    uint32_t sums;
+} metrics_sizes;
+
 /**
  * Initializes the metrics struct.
  * @arg eps The maximum error for the quantiles
@@ -63,6 +171,140 @@ typedef int(*metric_callback)(void *data, metric_type type, char *name, void *va
  */
 int init_metrics(double timer_eps, double *quantiles, uint32_t num_quants, radix_tree *histograms, unsigned char set_precision, metrics *m);
 
+/**
+ * Changes the timer error, quantiles, histograms and set
+ * precision given to init_metrics, for a new configuration.
+ * The metrics must be empty, as their timers refer to the
+ * quantiles. Nothing is changed if the settings are the same.
+ * @arg timer_eps The maximum error for the quantiles
+ * @arg quantiles A sorted array of double quantile values, must be on (0, 1)
+ * @arg num_quants The number of entries in the quantiles array
+ * @arg histograms A radix tree with histogram settings, not owned by the metrics
+ * @arg set_precision The precision to use for sets
+ * @return 0 on success.
+ */
+int metrics_reconfigure(metrics *m, double timer_eps, double *quantiles, uint32_t num_quants, radix_tree *histograms, unsigned char set_precision);
+
+/**
+ * Sets the quantile engine used for new timers.
+ * @arg engine The default engine
+ * @arg compression The compression used for t-digest timers
+ * @arg prefixes A radix tree of timer_config structs to override the
+ * engine and quantiles by prefix, or NULL. This is not owned by the metrics object.
+ */
+void metrics_set_timer_engine(metrics *m, timer_engine engine, double compression, radix_tree *prefixes);
+
+/**
+ * Sets the samples new timers insert into their quantile
+ * engine before the rest are sampled, see timer_set_admission.
+ * Defaults to 0, which inserts every sample.
+ * @arg m The metrics to configure
+ * @arg threshold The samples inserted before sampling
+ */
+void metrics_set_timer_admission(metrics *m, uint32_t threshold);
+
+/**
+ * Sets the accuracy of the new timers and sets, which can
+ * be lowered to make them smaller. Those already made are
+ * unchanged, and still merge with the new ones.
+ * @arg m The metrics to configure
+ * @arg timer_eps The error for CM quantile timers
+ * @arg compression The compression for t-digest timers
+ * @arg set_precision The precision for sets
+ */
+void metrics_set_accuracy(metrics *m, double timer_eps, double compression, unsigned char set_precision);
+
+/**
+ * Sets the number of items a set counts exactly before
+ * switching to a HyperLogLog. Defaults to SET_MAX_EXACT.
+ * @arg m The metrics to configure
+ * @arg max_exact The maximum number of exact items
+ */
+void metrics_set_max_exact(metrics *m, uint32_t max_exact);
+
+/**
+ * Sets the precision of new sets by prefix, which
+ * otherwise use the precision of the metrics.
+ * @arg m The metrics to configure
+ * @arg prefixes A radix tree of set_config structs, or NULL.
+ * This is not owned by the metrics object.
+ */
+void metrics_set_precisions(metrics *m, radix_tree *prefixes);
+
+/**
+ * Sets which counters only keep their sum, instead of the
+ * count, mean, stddev, min and max. Defaults to none.
+ * @arg m The metrics to configure
+ * @arg sum_only Do counters only keep their sum by default
+ * @arg prefixes A radix tree of counter_config structs to override
+ * the mode by prefix, or NULL. This is not owned by the metrics object.
+ */
+void metrics_set_counter_mode(metrics *m, bool sum_only, radix_tree *prefixes);
+
+/**
+ * Sets which K/V pairs coalesce their samples in an interval,
+ * into a single value per key. The rest keep every sample.
+ * Defaults to none.
+ * @arg m The metrics to configure
+ * @arg prefixes A radix tree of kv_config structs, or NULL.
+ * This is not owned by the metrics object.
+ */
+void metrics_set_kv_modes(metrics *m, radix_tree *prefixes);
+
+/**
+ * Sets the cardinality limits of prefixes. Once a prefix has
+ * its maximum of keys in an interval, the samples of new keys
+ * under it are folded into its overflow key. Defaults to none.
+ * @arg m The metrics to configure
+ * @arg limits A radix tree of limit_config structs, or NULL.
+ * This is not owned by the metrics object.
+ * @arg num_limits The number of limits in the tree
+ */
+void metrics_set_limits(metrics *m, radix_tree *limits, int num_limits);
+
+/**
+ * Keeps the names of the keys across clears, so that the keys
+ * that are stable across intervals are not copied again for each
+ * one. Defaults to copying the names into the arena.
+ * @arg m The metrics to configure, which must be empty
+ * @arg max_idle The number of intervals a name is kept after
+ * it was last used, or 0 to stop keeping them.
+ * @return 0 on success.
+ */
+int metrics_set_interning(metrics *m, uint32_t max_idle);
+
+/**
+ * Tracks the heaviest keys of each interval, by their samples
+ * and by their bytes. Defaults to not tracking them.
+ * @arg m The metrics to configure
+ * @arg capacity The number of keys monitored by each summary,
+ * or 0 to stop tracking them.
+ * @return 0 on success.
+ */
+int metrics_set_top_keys(metrics *m, uint32_t capacity);
+
+/**
+ * Keeps the new counters and gauges in a map shared with other
+ * metrics objects, which may be updated by other threads at the
+ * same time. They fall back to the maps of the object once the
+ * shared map is full, or while there are limits. The shared map
+ * is not merged or cleared along with the object, that is left
+ * to metrics_merge_shared.
+ * @arg s The shared map, NULL to keep them in the object
+ */
+void metrics_set_shared(metrics *m, shared_map *s);
+
+/**
+ * Counts the samples and bytes received for a key, in the
+ * summaries of the heaviest keys. Only call this when the
+ * heaviest keys are tracked, with m->top_samples set.
+ * @arg m The metrics
+ * @arg key The key of the samples
+ * @arg samples The number of samples
+ * @arg bytes The bytes of input they took
+ */
+void metrics_track_key(metrics *m, char *key, uint64_t samples, uint64_t bytes);
+
 /**
  * Initializes the metrics struct, with preset configurations.
  * This defaults to a epsilon of 0.01 (1% error), and quantiles at
@@ -77,6 +319,38 @@ int init_metrics_defaults(metrics *m);
  */
 int destroy_metrics(metrics *m);
 
+/**
+ * Clears all the metrics so the struct can be re-used. The
+ * hashmaps keep their capacity, so the next interval does
+ * not need to grow them again.
+ * @return 0 on success.
+ */
+int metrics_clear(metrics *m);
+
+/**
+ * Returns the number of keys in each of the maps
+ * @arg sizes Output, the sizes of the maps
+ */
+void metrics_get_sizes(metrics *m, metrics_sizes *sizes);
+
+/**
+ * Grows the maps so the given number of keys fit without
+ * resizing. This changes m->generation if a map moved.
+ * @arg sizes The number of keys to make room for
+ * @return 0 on success.
+ */
+int metrics_reserve(metrics *m, metrics_sizes *sizes);
+
+/**
+ * Shrinks the maps of a cleared metrics object that are at least
+ * four times what a number of keys needs, so an object that is
+ * re-used follows the keys of its intervals down instead of
+ * keeping the most it ever held. This changes m->generation.
+ * @arg sizes The number of keys to fit, such as of the last interval
+ * @return 0 on success, -1 if the metrics are not cleared.
+ */
+int metrics_fit(metrics *m, metrics_sizes *sizes);
+
 /**
  * Adds a new sampled value
  * arg type The type of the metrics
@@ -86,6 +360,143 @@ int destroy_metrics(metrics *m);
  */
 int metrics_add_sample(metrics *m, metric_type type, char *name, double val);
 
+/**
+ * Adds a new sampled value, using a hash of the name
+ * computed with hash_key. This lets callers that hashed
+ * the name to prefetch it skip doing it again.
+ * arg type The type of the metrics
+ * @arg name The name of the metric
+ * @arg hash The hash of the name
+ * @arg val The sample to add
+ * @return 0 on success.
+ */
+int metrics_add_sample_hash(metrics *m, metric_type type, char *name, uint64_t hash, double val);
+
+/**
+ * Prefetches the table entry a name of a type hashes to, so
+ * that a batch of samples can start loading the entries of
+ * all its names before updating any of them.
+ * @arg type The type of the metric
+ * @arg hash The hash of the name, from hash_key
+ */
+void metrics_prefetch(metrics *m, metric_type type, uint64_t hash);
+
+/**
+ * Adds the same sample value to a counter many times,
+ * with a single lookup of the counter.
+ * @arg name The name of the counter
+ * @arg val The sample value
+ * @arg count The number of samples
+ * @return 0 on success.
+ */
+int metrics_add_counter_samples(metrics *m, char *name, double val, uint64_t count);
+
+/**
+ * Adds many samples to the timer with a given name,
+ * with a single lookup of the timer.
+ * @arg name The name of the timer
+ * @arg vals The samples to add
+ * @arg num The number of samples
+ * @return 0 on success.
+ */
+int metrics_add_timer_samples(metrics *m, char *name, double *vals, int num);
+
+/**
+ * Adds a timer sample that stands for a number of samples, using
+ * a hash of the name computed with hash_key. The sample counts that
+ * many times in the timer and its histogram, but is only inserted
+ * once, so a sampled timer costs as much as one sample.
+ * @arg name The name of the timer
+ * @arg hash The hash of the name
+ * @arg val The sample to add
+ * @arg weight The number of samples it stands for, at least 1
+ * @return 0 on success.
+ */
+int metrics_add_timer_weighted(metrics *m, char *name, uint64_t hash, double val, uint64_t weight);
+
+/**
+ * Returns the metric struct for a name, creating it if it does
+ * not exist, so samples can be added with metrics_add_to without
+ * looking up the name again. The pointer stays valid until the
+ * metrics are cleared, or the counter or gauge map grows, both of
+ * which change m->generation.
+ * @arg type The type of the metric. Updated to COUNTER_SUM for
+ * counters that only keep their sum, to pass to metrics_add_to.
+ * @arg name The name of the metric
+ * @return The metric, or NULL for K/V pairs and sets.
+ */
+void* metrics_get_metric(metrics *m, metric_type *type, char *name);
+
+/**
+ * Adds samples to a metric returned by metrics_get_metric
+ * @arg type The type the metric was returned for
+ * @arg metric The metric to update
+ * @arg vals The samples to add
+ * @arg num The number of samples
+ * @return 0 on success.
+ */
+int metrics_add_to(metrics *m, metric_type type, void *metric, double *vals, int num);
+
+/**
+ * Returns the lower bound of a histogram bin, between the min and max.
+ * @arg conf The histogram config
+ * @arg i The index of the bin, starting at 0 for the one at the min value
+ * @return The lower bound of the bin
+ */
+double histogram_bin_start(histogram_config *conf, int i);
+
+/**
+ * Returns the number of histogram bins of a timer. The first
+ * counts the values below the start of the second, and the last
+ * those at or above its start. Automatic histograms only have
+ * the bins from the lowest to the highest used.
+ * @arg t The timer
+ * @return The number of bins, 0 without a histogram
+ */
+int timer_hist_num_bins(timer_hist *t);
+
+/**
+ * Returns the start of a histogram bin of a timer, the
+ * bound of the values of the first and last bins.
+ * @arg t The timer
+ * @arg i The index of the bin, from 0 to timer_hist_num_bins
+ * @return The start of the bin
+ */
+double timer_hist_bin_start(timer_hist *t, int i);
+
+/**
+ * Returns the count of a histogram bin of a timer
+ * @arg t The timer
+ * @arg i The index of the bin, from 0 to timer_hist_num_bins
+ * @return The values counted in the bin
+ */
+uint64_t timer_hist_count(timer_hist *t, int i);
+
+/**
+ * Adds to the count of a bin of a fixed histogram
+ * @arg t The timer, with a linear or log histogram
+ * @arg i The index of the bin, from 0 to timer_hist_num_bins
+ * @arg count The values to add to the bin
+ */
+void timer_hist_add_count(metrics *m, timer_hist *t, int i, uint64_t count);
+
+/**
+ * Returns the set with the given name,
+ * creating it if it does not exist.
+ * @arg name The name of the set
+ * @return The set
+ */
+set_t* metrics_get_set(metrics *m, char *name);
+
+/**
+ * Returns the set with the given name, creating it if
+ * it does not exist, using a hash of the name.
+ * @arg name The name of the set
+ * @arg hash The hash of the name, from hash_key
+ * @return The set
+ */
+set_t* metrics_get_set_hash(metrics *m, char *name, uint64_t hash);
+
 /**
  * Adds a value to a named set.
  * @arg name The name of the set
@@ -94,14 +505,91 @@ int metrics_add_sample(metrics *m, metric_type type, char *name, double val);
  */
 int metrics_set_update(metrics *m, char *name, char *value);
 
+/**
+ * Adds a value to a named set, using a hash of the name.
+ * @arg name The name of the set
+ * @arg hash The hash of the name, from hash_key
+ * @arg value The value to add
+ * @return 0 on success
+ */
+int metrics_set_update_hash(metrics *m, char *name, uint64_t hash, char *value);
+
+/**
+ * Adds members that were already hashed by the client to a
+ * named set, with a single lookup of the set.
+ * @arg name The name of the set
+ * @arg hashes The 64 bit hashes of the members
+ * @arg num The number of hashes
+ * @return 0 on success
+ */
+int metrics_add_set_hashes(metrics *m, char *name, uint64_t *hashes, int num);
+
+/**
+ * Merges all the metrics of one struct into another.
+ * Counters, timers, sets and histograms are combined. Gauges
+ * that were set take the value from src, while gauges that only
+ * received deltas are added. K/V pairs are copied, the
+ * coalesced ones are coalesced, and the input counts are added.
+ * @arg dst The metrics to merge into
+ * @arg src The metrics to merge from. The timers may be
+ * flushed, but is otherwise unmodified.
+ * @return 0 on success.
+ */
+int metrics_merge(metrics *dst, metrics *src);
+
+/**
+ * Merges the metrics of one struct whose names start with a
+ * prefix into another, as metrics_merge. The input counts are
+ * not added.
+ * @arg dst The metrics to merge into
+ * @arg src The metrics to merge from. The timers may be
+ * flushed, but is otherwise unmodified.
+ * @arg prefix The prefix of the names to merge, "" for all
+ * @return 0 on success.
+ */
+int metrics_merge_prefix(metrics *dst, metrics *src, const char *prefix);
+
+/**
+ * Merges the counters and gauges of a shared map into the maps
+ * of a metrics object. The updates may still run, for a query.
+ * @arg dst The metrics to merge into
+ * @arg s The shared map
+ * @arg prefix Only the names that start with this, or NULL for all
+ * @return 0 on success.
+ */
+int metrics_merge_shared(metrics *dst, shared_map *s, const char *prefix);
+
+/**
+ * Merges an encoded counter, set or timer sketch into the
+ * metric of the same name. Sets merge dense registers in place
+ * from the buffer when they can, and timers of another engine
+ * are added as weighted values.
+ * @arg name The name of the metric
+ * @arg buf The encoded sketch, see sketch.h
+ * @arg len The bytes available
+ * @return The bytes decoded, or -1 if it is not valid.
+ */
+int metrics_merge_sketch(metrics *m, char *name, const char *buf, size_t len);
+
+/**
+ * Merges a coalesced K/V pair, such as one restored from a
+ * snapshot, into the pair of the same name. The pair keeps
+ * the mode it was created with, as with metrics_merge.
+ * @arg name The key name
+ * @arg v The coalesced value, with its sum and count
+ * @return 0 on success.
+ */
+int metrics_merge_kv(metrics *m, char *name, kv_value *v);
+
 /**
  * Iterates through all the metrics
  * @arg m The metrics to iterate through
  * @arg data Opaque handle passed to the callback
  * @arg cb A callback function to invoke. Called with a type, name
  * and value. If the type is KEY_VAL, it is a pointer to a double,
- * for a counter, it is a pointer to a counter, and for a timer it is
- * a pointer to a timer. Return non-zero to stop iteration.
+ * for a counter, it is a pointer to a counter, for a COUNTER_SUM it
+ * is a pointer to the double sum, and for a timer it is a pointer to
+ * a timer. Return non-zero to stop iteration.
  * @return 0 on success.
  */
 int metrics_iter(metrics *m, void *data, metric_callback cb);
@@ -0,0 +1,110 @@
+/**
+ * This file implements the map of the names declared in name_map.h
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "name_map.h"
+
+name_map *NAME_MAP = NULL;
+
+/**
+ * Takes the escapes out of a list of characters
+ * @arg chars The characters, with \s, \t or \\ escapes
+ * @arg out Output. The characters, at most strlen(chars)
+ * @return The number of characters, or -1 on a bad escape.
+ */
+static int unescape_chars(const char *chars, unsigned char *out) {
+    int len = 0;
+    for (const char *c = chars; *c; c++) {
+        if (*c != '\\') {
+            out[len++] = *c;
+            continue;
+        }
+        switch (*++c) {
+            case 's': out[len++] = ' '; break;
+            case 't': out[len++] = '\t'; break;
+            case '\\': out[len++] = '\\'; break;
+            default: return -1;
+        }
+    }
+    return len;
+}
+
+/**
+ * Initializes a map of the names. The characters of from are
+ * replaced with those at the same place in to, and the last of to
+ * repeats if it is shorter, as tr does. Both take \s for a space,
+ * \t for a tab and \\ for a backslash.
+ * @arg from The characters to replace, NULL for none
+ * @arg to The replacements, needed if from is set
+ * @arg prefix Added before the names, NULL for none
+ * @arg suffix Added after the names, NULL for none
+ * @arg m The map to initialize
+ * @return 0 on success, -1 if the characters do not pair up.
+ */
+int init_name_map(const char *from, const char *to, const char *prefix,
+        const char *suffix, name_map *m) {
+    for (int i=0; i < 256; i++) m->chars[i] = i;
+    if (from && *from) {
+        if (!to || !*to) return -1;
+        unsigned char *f = malloc(strlen(from)), *t = malloc(strlen(to));
+        int from_len = unescape_chars(from, f), to_len = unescape_chars(to, t);
+        int res = (from_len < 0 || to_len < 1 || to_len > from_len) ? -1 : 0;
+        for (int i=0; !res && i < from_len; i++) {
+            m->chars[f[i]] = t[(i < to_len) ? i : to_len - 1];
+        }
+        free(f);
+        free(t);
+        if (res) return res;
+    }
+
+    m->prefix = strdup((prefix) ? prefix : "");
+    m->prefix_len = strlen(m->prefix);
+    m->suffix = strdup((suffix) ? suffix : "");
+    m->suffix_len = strlen(m->suffix);
+    return 0;
+}
+
+/**
+ * Destroys a map of the names
+ * @arg m The map to destroy
+ */
+void destroy_name_map(name_map *m) {
+    free(m->prefix);
+    free(m->suffix);
+    m->prefix = m->suffix = NULL;
+}
+
+/**
+ * Stores a key and its output name
+ * @arg dst Where to store them, name_copy_size(len) bytes
+ * @arg key The key
+ * @arg len The length of the key, without the null
+ */
+void name_copy(char *dst, const char *key, size_t len) {
+    memcpy(dst, key, len + 1);
+    if (!NAME_MAP) return;
+
+    // The output name is made in one pass over the key
+    char *out = dst + len + 1;
+    memcpy(out, NAME_MAP->prefix, NAME_MAP->prefix_len);
+    out += NAME_MAP->prefix_len;
+    for (size_t i=0; i < len; i++) {
+        out[i] = NAME_MAP->chars[(unsigned char)key[i]];
+    }
+    out += len;
+    memcpy(out, NAME_MAP->suffix, NAME_MAP->suffix_len + 1);
+}
+
+/**
+ * Copies a key and its output name into an arena
+ * @arg a The arena to copy into
+ * @arg key The null terminated key
+ * @return The copy, or NULL on failure.
+ */
+char* name_arena_copy(arena *a, const char *key) {
+    size_t len = strlen(key);
+    char *copy = arena_alloc(a, name_copy_size(len));
+    if (copy) name_copy(copy, key, len);
+    return copy;
+}
@@ -0,0 +1,86 @@
+/**
+ * This module rewrites the names of the metrics for the sinks, with
+ * a map of the characters and a prefix and suffix around the result,
+ * so that the sinks get names they can ship as they are.
+ *
+ * The output name is made once, when a key is first copied into a
+ * map, and is stored right after the key: "key\0output\0". Sinks take
+ * it with output_name, and everything else keeps using the key, so
+ * the prefix trees, filters and the sketches sent to other instances
+ * see the names as they were sent. Interned keys keep their output
+ * name across intervals, so a key is only rewritten when it is new.
+ *
+ * The map in use is global, and must be set before any maps are
+ * made, since the size of the stored keys depends on it.
+ */
+#ifndef NAME_MAP_H
+#define NAME_MAP_H
+#include <stddef.h>
+#include <string.h>
+#include "arena.h"
+
+typedef struct {
+    unsigned char chars[256];  // The output character for each character
+    char *prefix;              // Added before the names
+    size_t prefix_len;
+    char *suffix;              // Added after the names
+    size_t suffix_len;
+} name_map;
+
+// The map in use, NULL if the names are output as they are
+extern name_map *NAME_MAP;
+
+/**
+ * Initializes a map of the names. The characters of from are
+ * replaced with those at the same place in to, and the last of to
+ * repeats if it is shorter, as tr does. Both take \s for a space,
+ * \t for a tab and \\ for a backslash.
+ * @arg from The characters to replace, NULL for none
+ * @arg to The replacements, needed if from is set
+ * @arg prefix Added before the names, NULL for none
+ * @arg suffix Added after the names, NULL for none
+ * @arg m The map to initialize
+ * @return 0 on success, -1 if the characters do not pair up.
+ */
+int init_name_map(const char *from, const char *to, const char *prefix,
+        const char *suffix, name_map *m);
+
+/**
+ * Destroys a map of the names
+ * @arg m The map to destroy
+ */
+void destroy_name_map(name_map *m);
+
+/**
+ * Returns the bytes needed to store a key with its output name
+ * @arg len The length of the key, without the null
+ */
+static inline size_t name_copy_size(size_t len) {
+    if (!NAME_MAP) return len + 1;
+    return len + 1 + NAME_MAP->prefix_len + len + NAME_MAP->suffix_len + 1;
+}
+
+/**
+ * Stores a key and its output name
+ * @arg dst Where to store them, name_copy_size(len) bytes
+ * @arg key The key
+ * @arg len The length of the key, without the null
+ */
+void name_copy(char *dst, const char *key, size_t len);
+
+/**
+ * Copies a key and its output name into an arena
+ * @arg a The arena to copy into
+ * @arg key The null terminated key
+ * @return The copy, or NULL on failure.
+ */
+char* name_arena_copy(arena *a, const char *key);
+
+/**
+ * Returns the output name of a key stored with name_copy
+ */
+static inline char* output_name(char *key) {
+    return (NAME_MAP) ? key + strlen(key) + 1 : key;
+}
+
+#endif
@@ -1,20 +1,32 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <syslog.h>
 #include <unistd.h>
 
 #include "networking.h"
 #include "conn_handler.h"
+#include "stats.h"
+#include "shm_ring.h"
+#include "xdp.h"
+#include "affinity.h"
+#include "rate_limit.h"
+#include "loop_monitor.h"
 
 #define EV_STANDALONE 1
 #define EV_API_STATIC 1
 #define EV_COMPAT3 0
-#define EV_MULTIPLICITY 0
+#define EV_MULTIPLICITY 1
 #define EV_USE_MONOTONIC 1
 #ifdef __linux__
 #define EV_USE_CLOCK_SYSCALL 0
@@ -26,10 +38,11 @@
 #include "ev.c"
 
 /**
- * Default listen backlog size for
- * our TCP listener.
+ * The most connections we accept per wakeup
+ * of a TCP listener, so a reconnect storm cannot
+ * starve the clients that are already connected.
  */
-#define BACKLOG_SIZE 64
+#define ACCEPT_BATCH_SIZE 1024
 
 /**
  * How big should the default connection
@@ -48,37 +61,316 @@
  */
 #define CONN_BUF_MULTIPLIER 2
 
+/**
+ * How many closed connections each worker keeps
+ * around for reuse, along with their buffers. This
+ * avoids going through malloc and mmap when short lived
+ * clients connect and disconnect at a high rate.
+ */
+#define CONN_POOL_SIZE 64
+
+/**
+ * How long reads are paused for when a client
+ * needs a larger buffer, but the buffer memory
+ * budget is used up.
+ */
+#define CONN_PAUSE_INTERVAL 0.1
+
+/**
+ * How often the shared memory ring is checked for
+ * frames. Producers never make a syscall, so there is
+ * nothing to wake the loop, and the ring is polled.
+ */
+#define SHM_RING_POLL_INTERVAL 0.001
+
+/**
+ * How often each worker sends the records batched
+ * by the proxy, unless a batch fills up first.
+ */
+#define PROXY_FLUSH_INTERVAL 0.005
+
+/**
+ * How often each worker checks how late its
+ * loop runs a timer, see loop_monitor.h
+ */
+#define LOOP_LAG_INTERVAL 0.1
+
+/**
+ * The priority of the watchers of the priority listeners
+ * and their clients. Their callbacks run before those of
+ * the other sockets, only the loop timing and the flush
+ * timer come first.
+ */
+#define PRIORITY_LISTENER_PRI (EV_MAXPRI - 1)
+
+/**
+ * This is the largest UDP datagram we expect
+ * to receive. Each datagram slot reserves one extra
+ * byte so that a newline can always be appended.
+ */
+#define MAX_UDP_PACKET_SIZE 65536
+
+/**
+ * The most datagrams and bytes a UDP socket handles per
+ * wakeup. The rest are left queued in the kernel, and the
+ * socket is reported again on the next loop iteration, after
+ * the other clients and the timers of the loop had their turn,
+ * so a flood of datagrams cannot starve them or delay a flush.
+ */
+#define UDP_WAKEUP_DATAGRAMS 256
+#define UDP_WAKEUP_BYTES (4 * 1024 * 1024)
+
+/**
+ * The most bytes read from a stream client per wakeup. A
+ * fast sender is read and handled in a loop until its socket
+ * is drained or this is used, instead of once per wakeup, so
+ * it does not cost a loop iteration per buffer of input.
+ */
+#define STREAM_WAKEUP_BYTES (1024 * 1024)
+
+/**
+ * On Linux we can use recvmmsg() to read many
+ * datagrams with a single syscall. This is
+ * the number of datagrams we read per batch.
+ */
+#ifdef __linux__
+#define HAVE_RECVMMSG 1
+#define UDP_BATCH_SIZE 32
+#endif
+
+/**
+ * The buffer size of a datagram socket. Each datagram of a
+ * batch gets its own slot, and the buffer is allocated at this
+ * size instead of being grown from the size of a stream buffer.
+ */
+#ifdef HAVE_RECVMMSG
+#define UDP_CONN_BUF_SIZE (UDP_BATCH_SIZE * MAX_UDP_PACKET_SIZE)
+#else
+#define UDP_CONN_BUF_SIZE (2 * MAX_UDP_PACKET_SIZE)
+#endif
+
+// The longest request line of an admin client
+#define ADMIN_MAX_REQUEST 1024
+
+/**
+ * On Linux, accept4() can make the accepted
+ * socket non-blocking without an extra fcntl().
+ */
+#ifdef __linux__
+#define HAVE_ACCEPT4 1
+#endif
+
+/**
+ * With SO_RXQ_OVFL, the kernel attaches the number
+ * of datagrams dropped on a socket to each message.
+ * This is the control buffer space used per message.
+ */
+#if defined(HAVE_RECVMMSG) && defined(SO_RXQ_OVFL)
+#define HAVE_RXQ_OVFL 1
+#endif
+
+/**
+ * With UDP_GRO, the kernel may coalesce the datagrams of a
+ * flow into one message, with the size of the datagrams
+ * attached to it. All but the last have that size.
+ */
+#if defined(HAVE_RECVMMSG) && defined(UDP_GRO)
+#define HAVE_UDP_GRO 1
+#endif
+
+// The control buffer space used per message
+#if defined(HAVE_RXQ_OVFL) || defined(HAVE_UDP_GRO)
+#define HAVE_UDP_CONTROL 1
+#define UDP_CONTROL_SIZE (CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(int)))
+#endif
+
+/**
+ * On Linux, SO_BUSY_POLL has the kernel poll the device queue of a
+ * socket instead of waiting for an interrupt, see busy_poll_us.
+ * SO_PREFER_BUSY_POLL, from Linux 5.11, keeps the interrupts of the
+ * queue deferred while it is being polled.
+ */
+#if defined(__linux__) && defined(SO_BUSY_POLL)
+#define HAVE_BUSY_POLL 1
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#endif
+
+/**
+ * On Linux, a classic BPF filter on the UDP sockets can drop
+ * the datagrams of filtered keys before they are queued. The
+ * filter sees the UDP header, followed by the payload.
+ */
+#if defined(__linux__) && defined(SO_ATTACH_FILTER)
+#include <linux/filter.h>
+#define HAVE_DROP_FILTER 1
+#define DROP_FILTER_PAYLOAD 8
+#define DROP_FILTER_MAX_PREFIX 256
+#endif
+
+/**
+ * With AF_XDP, the UDP datagrams on an interface can be
+ * received on rings shared with the kernel, see xdp.h.
+ * This is the number of packets taken from a ring at once.
+ */
+#ifdef HAVE_RECVMMSG
+#define HAVE_XDP 1
+#define XDP_BATCH_SIZE 64
+#endif
+
+/**
+ * With io_uring, each worker can receive UDP with a multishot
+ * recvmsg into a ring of provided buffers. The kernel then keeps
+ * receiving without a syscall per batch, and the completions are
+ * reaped when libev reports the ring as readable.
+ */
+#if defined(HAVE_RECVMMSG) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define UDP_RING_ENTRIES UDP_BATCH_SIZE
+#endif
+#endif
+
 // Macro to provide branch meta-data
 #define likely(x)       __builtin_expect((x),1)
 #define unlikely(x)     __builtin_expect((x),0)
 
+#ifdef HAVE_IO_URING
+/**
+ * An io_uring receiving from a UDP socket. The provided
+ * buffers are the datagram slots of the connection buffer.
+ */
+typedef struct {
+    int fd;
+    void *sq_ring;          // The submission and completion rings, mapped at once
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *bufs; // The ring of provided buffers
+    size_t bufs_size;
+    uint16_t buf_tail;      // Tail of the provided buffers, published in batches
+    struct msghdr msg;      // Describes the layout of each received buffer
+    ev_io watcher;          // Readable when there are completions
+} udp_ring;
+#endif
+
 /**
- * Stores the thread specific user data.
+ * Stores the thread specific user data. Each ingest
+ * worker owns an event loop along with its own TCP and
+ * UDP listeners. Worker 0 runs on the main thread using
+ * the default loop, the rest run in their own threads.
  */
 typedef struct {
     statsite_networking *netconf;
+    int worker_id;          // Index of the worker, selects the metrics shard
+    struct ev_loop *loop;   // The event loop of this worker
+    pthread_t thread;       // Thread running the loop, unused for worker 0
+    ev_io tcp_client;
+    ev_io udp_client;
+    ev_io *listeners;       // Watches the sockets of the listener sections
+    int num_listeners;
+    ev_io unix_stream;      // Watches the Unix stream listener, shared by the workers
+    ev_io unix_dgram;       // Watches the Unix datagram socket, shared by the workers
+    ev_io admin;            // Watches the admin socket, on the first worker only
+    ev_async wakeup;        // Used to wake the loop on shutdown
+    ev_timer proxy_timer;   // Sends the batches of the proxy, if enabled
+    ev_prepare loop_prepare; // Ends the timing of an iteration, before the poll
+    ev_check loop_check;    // Starts the timing of an iteration, after the poll
+    ev_timer lag_timer;     // Measures how late the loop runs its timers
+    double busy_since;      // When the callbacks of the iteration started, 0 if idle
+    double lag_due;         // When the lag timer is next due
+    int had_events;         // Did the last iteration run any callbacks
+    struct conn_info *free_conns;   // Closed connections kept for reuse
+    int num_free_conns;     // Length of the free_conns list
+    rate_table *client_rates; // The buckets of the clients, if rate limited
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr udp_msgs[UDP_BATCH_SIZE];
+    struct iovec udp_vectors[UDP_BATCH_SIZE];
+    struct sockaddr_storage udp_addrs[UDP_BATCH_SIZE]; // The sources, if rate limited
+#endif
+#ifdef HAVE_UDP_CONTROL
+    char udp_control[UDP_BATCH_SIZE][UDP_CONTROL_SIZE];
+#endif
+#ifdef HAVE_IO_URING
+    udp_ring *udp_ring;     // Receives the UDP datagrams instead of udp_client, if set
+#endif
 } worker_ev_userdata;
 
 /**
- * Represents a simple circular buffer
+ * Represents a simple circular buffer. When possible the
+ * buffer is mirrored, with the same pages mapped twice back
+ * to back, so the used bytes are always contiguous starting
+ * at the read cursor, even if they wrap around.
  */
 typedef struct {
     int write_cursor;
     int read_cursor;
     uint32_t buf_size;
+    int mirrored;   // Is the buffer mapped twice
+    int scanned;    // Bytes after the read cursor known to have no terminator
     char *buffer;
 } circular_buffer;
 
+// Checks if the used bytes of a buffer are split in two
+#define CIRCBUF_SPLIT(buf) ((buf)->write_cursor < (buf)->read_cursor && !(buf)->mirrored)
+
 /**
  * Stores the connection specific data.
  * We initialize one of these per connection
  */
 struct conn_info {
     ev_io client;
+    ev_timer resume;        // Resumes reads if paused for buffer memory
+    struct ev_loop *loop;   // The loop the client is registered with
+    int limited;            // Is the buffer bounded and counted in the budget
+    int paused;             // Are reads paused until buffer memory frees up
+    int datagram;           // Is this the shared connection of a UDP socket
+    int discarding;         // Is the input dropped up to the next terminator
+    char discard_to;        // The terminator that ends the dropped input
+    int rate_limited;       // Are reads bounded by the rate bucket
+    int priority;           // Is this a client of a priority listener
+    rate_bucket rate;       // The input the client may send, if rate limited
     circular_buffer input;
+    void *state;            // State of the connection handler, see client_state
+    struct conn_info *next; // Next connection in the free list
+#ifdef HAVE_RXQ_OVFL
+    uint32_t udp_drops;     // Last drop count the kernel reported, on a datagram socket
+#endif
 };
 typedef struct conn_info conn_info;
 
+/**
+ * A client of the admin socket. Each request is a line, and
+ * its response is written out before the next line is read.
+ */
+typedef struct {
+    ev_io watcher;
+    char request[ADMIN_MAX_REQUEST];
+    int request_len;
+    char *response;         // The response being written, or NULL
+    size_t response_len;
+    size_t written;
+} admin_conn;
+
+#ifdef HAVE_XDP
+/**
+ * An AF_XDP socket on a receive queue, handled by one of
+ * the workers. Its packets are parsed in place in the UMEM.
+ */
+typedef struct {
+    xdp_socket *sock;
+    conn_info *conn;        // Presents the UMEM as the input buffer
+    ev_io watcher;          // Readable when there are packets
+    uint64_t drops;         // Last drop count of the socket
+} xdp_queue;
+#endif
+
 /**
  * Defines a structure that is
  * used to store the state of the networking
@@ -86,22 +378,93 @@ typedef struct conn_info conn_info;
  */
 struct statsite_networking {
     statsite_config *config;
-    ev_io tcp_client;
-    ev_io udp_client;
+    int num_workers;
+    worker_ev_userdata *workers;
     conn_info *stdin_client;
+    int unix_stream_fd;     // The Unix domain sockets, or -1 if disabled
+    int unix_dgram_fd;
+    int admin_fd;           // The admin socket, or -1 if disabled
+    shm_ring *shm_ring;     // The shared memory ring, or NULL if disabled
+    conn_info *shm_client;  // Presents the ring as the input buffer
+    uint64_t shm_head;      // Head of the ring when last polled
+    ev_timer shm_timer;     // Polls the ring on the first worker
+#ifdef HAVE_XDP
+    xdp_prog *xdp;          // The XDP program, or NULL if disabled
+    xdp_queue *xdp_queues;
+    int num_xdp_queues;
+#endif
     ev_timer flush_timer;
+    int *should_run;
 };
 
 
+/**
+ * Limits on connection buffer memory. The total is
+ * shared by all the workers, so it is updated atomically.
+ */
+static uint32_t MAX_CONN_BUFFER;
+static uint64_t CONN_BUFFER_BUDGET;
+static uint64_t CONN_BUFFER_BYTES;
+
+/**
+ * The clients of the priority listeners have a budget of
+ * their own, so they keep reading once the others are paused.
+ */
+static uint64_t PRIORITY_BUFFER_BUDGET;
+static uint64_t PRIORITY_BUFFER_BYTES;
+
+// The buffer memory a connection is counted in, by its listener
+#define CONN_BYTES(conn) ((conn)->priority ? &PRIORITY_BUFFER_BYTES : &CONN_BUFFER_BYTES)
+
+/**
+ * How long the workers spin on their sockets before
+ * sleeping, see busy_poll_us. 0 if they do not.
+ */
+static int BUSY_POLL_US;
+static int BUSY_POLL_WARNED;
+
 // Static typedefs
-static void handle_flush_event(ev_timer *watcher, int revents);
-static void handle_new_client(ev_io *watcher, int ready_events);
-static void handle_udp_message(ev_io *watch, int ready_events);
-static void invoke_event_handler(ev_io *watch, int ready_events);
+static void handle_flush_event(struct ev_loop *loop, ev_timer *watcher, int revents);
+
+// Returns the monotonic time in seconds, for timing the loops
+static double monotonic_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+static void handle_new_client(struct ev_loop *loop, ev_io *watcher, int ready_events);
+static void handle_admin_client(struct ev_loop *loop, ev_io *watcher, int ready_events);
+static void handle_udp_message(struct ev_loop *loop, ev_io *watch, int ready_events);
+static void invoke_event_handler(struct ev_loop *loop, ev_io *watch, int ready_events);
+static void handle_wakeup(struct ev_loop *loop, ev_async *watcher, int revents);
+static void handle_resume(struct ev_loop *loop, ev_timer *watcher, int revents);
+static void handle_shm_ring(struct ev_loop *loop, ev_timer *watcher, int revents);
+static void handle_proxy_timer(struct ev_loop *loop, ev_timer *watcher, int revents);
+static void handle_loop_prepare(struct ev_loop *loop, ev_prepare *watcher, int revents);
+static void handle_loop_check(struct ev_loop *loop, ev_check *watcher, int revents);
+static void handle_lag_timer(struct ev_loop *loop, ev_timer *watcher, int revents);
+#ifdef HAVE_XDP
+static void handle_xdp_queue(struct ev_loop *loop, ev_io *watch, int ready_events);
+#endif
+#ifdef HAVE_IO_URING
+static void handle_udp_ring(struct ev_loop *loop, ev_io *watch, int ready_events);
+static int setup_udp_ring(worker_ev_userdata *worker, conn_info *conn, int udp_fd);
+static void destroy_udp_ring(udp_ring *ring);
+#endif
 
 // Utility methods
-static int set_client_sockopts(int client_fd);
-static conn_info* get_conn();
+static int set_client_sockopts(int client_fd, int tcp);
+static int set_reuse_port(worker_ev_userdata *worker, int listen_fd);
+static void set_udp_sockopts(worker_ev_userdata *worker, int udp_fd, int size, int report);
+static void set_busy_poll(int fd);
+static conn_info* get_conn(struct ev_loop *loop);
+static conn_info* get_datagram_conn(worker_ev_userdata *worker);
+static void put_conn(conn_info *conn);
+static void free_conn_pool(worker_ev_userdata *worker);
+static void limit_conn(conn_info *conn);
+static int conn_grow_buf(conn_info *conn);
+static void conn_shrink_buf(conn_info *conn);
+static void discard_input(conn_info *conn);
 
 // Circular buffer method
 static void circbuf_init(circular_buffer *buf);
@@ -110,32 +473,67 @@ static void circbuf_free(circular_buffer *buf);
 static uint64_t circbuf_avail_buf(circular_buffer *buf);
 static uint64_t circbuf_used_buf(circular_buffer *buf);
 static void circbuf_grow_buf(circular_buffer *buf);
+static void circbuf_resize_buf(circular_buffer *buf, uint32_t new_size);
 static void circbuf_setup_readv_iovec(circular_buffer *buf, struct iovec *vectors, int *num_vectors);
 static void circbuf_advance_write(circular_buffer *buf, uint64_t bytes);
 static void circbuf_advance_read(circular_buffer *buf, uint64_t bytes);
+#ifndef HAVE_RECVMMSG
 static int circbuf_write(circular_buffer *buf, char *in, uint64_t bytes);
+#endif
 
 /**
- * Initializes the TCP listener
- * @arg netconf The network configuration
- * @return 0 on success.
+ * Allocates the connection object of a datagram socket. The
+ * buffer is sized for a full batch of datagrams, and the receive
+ * messages of the worker, which are shared by its datagram
+ * sockets, are setup to point at the slots of a buffer.
+ * @arg worker The worker that owns the socket
+ * @return The connection, with a min-buffer size of 64K.
  */
-static int setup_tcp_listener(statsite_networking *netconf) {
-    if (netconf->config->tcp_port == 0) {
-        syslog(LOG_INFO, "TCP port is disabled");
-        return 0;
+static conn_info* get_datagram_conn(worker_ev_userdata *worker) {
+    conn_info *conn = get_conn(worker->loop);
+    conn->datagram = 1;
+#ifdef HAVE_RXQ_OVFL
+    conn->udp_drops = 0;
+#endif
+#ifdef HAVE_RECVMMSG
+    // Make room for a full batch of datagrams, each
+    // message is pointed at its own slot when reading
+    circbuf_resize_buf(&conn->input, UDP_CONN_BUF_SIZE);
+    bzero(worker->udp_msgs, sizeof(worker->udp_msgs));
+    for (int i=0; i < UDP_BATCH_SIZE; i++) {
+        worker->udp_vectors[i].iov_len = MAX_UDP_PACKET_SIZE - 1;
+        worker->udp_msgs[i].msg_hdr.msg_iov = worker->udp_vectors + i;
+        worker->udp_msgs[i].msg_hdr.msg_iovlen = 1;
+#ifdef HAVE_UDP_CONTROL
+        worker->udp_msgs[i].msg_hdr.msg_control = worker->udp_control[i];
+#endif
     }
+#else
+    circbuf_resize_buf(&conn->input, UDP_CONN_BUF_SIZE);
+#endif
+    return conn;
+}
+
+/**
+ * Opens a TCP listener socket
+ * @arg worker The worker that owns the listener
+ * @arg address The IPv4 address to bind on
+ * @arg port The port to bind on
+ * @arg shared Is the port also bound by the other workers
+ * @return The non-blocking socket, or -1 on error.
+ */
+static int open_tcp_listener(worker_ev_userdata *worker, char *address, int port, int shared) {
     struct sockaddr_in addr;
     struct in_addr bind_addr;
     bzero(&addr, sizeof(addr));
     bzero(&bind_addr, sizeof(bind_addr));
     addr.sin_family = PF_INET;
-    addr.sin_port = htons(netconf->config->tcp_port);
+    addr.sin_port = htons(port);
 
-    int ret = inet_pton(AF_INET, netconf->config->bind_address, &bind_addr);
+    int ret = inet_pton(AF_INET, address, &bind_addr);
     if (ret != 1) {
-        syslog(LOG_ERR, "Invalid IPv4 address '%s'!", netconf->config->bind_address);
-        return 1;
+        syslog(LOG_ERR, "Invalid IPv4 address '%s'!", address);
+        return -1;
     }
     addr.sin_addr = bind_addr;
 
@@ -146,50 +544,54 @@ static int setup_tcp_listener(statsite_networking *netconf) {
                 SO_REUSEADDR, &optval, sizeof(optval))) {
         syslog(LOG_ERR, "Failed to set SO_REUSEADDR! Err: %s", strerror(errno));
         close(tcp_listener_fd);
-        return 1;
+        return -1;
+    }
+    if (shared && set_reuse_port(worker, tcp_listener_fd)) {
+        close(tcp_listener_fd);
+        return -1;
     }
     if (bind(tcp_listener_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
         syslog(LOG_ERR, "Failed to bind on TCP socket! Err: %s", strerror(errno));
         close(tcp_listener_fd);
-        return 1;
+        return -1;
     }
-    if (listen(tcp_listener_fd, BACKLOG_SIZE) != 0) {
+    if (listen(tcp_listener_fd, worker->netconf->config->tcp_backlog) != 0) {
         syslog(LOG_ERR, "Failed to listen on TCP socket! Err: %s", strerror(errno));
         close(tcp_listener_fd);
-        return 1;
+        return -1;
     }
 
-    syslog(LOG_INFO, "Listening on tcp '%s:%d'",
-           netconf->config->bind_address, netconf->config->tcp_port);
+    // Put the socket in non-blocking mode, we accept until EAGAIN
+    int flags = fcntl(tcp_listener_fd, F_GETFL, 0);
+    fcntl(tcp_listener_fd, F_SETFL, flags | O_NONBLOCK);
 
-    // Create the libev objects
-    ev_io_init(&netconf->tcp_client, handle_new_client,
-                tcp_listener_fd, EV_READ);
-    ev_io_start(&netconf->tcp_client);
-    return 0;
+    if (!shared || worker->worker_id == 0) {
+        syslog(LOG_INFO, "Listening on tcp '%s:%d'", address, port);
+    }
+    return tcp_listener_fd;
 }
 
 /**
- * Initializes the UDP Listener.
- * @arg netconf The network configuration
- * @return 0 on success.
+ * Opens a UDP listener socket
+ * @arg worker The worker that owns the listener
+ * @arg address The IPv4 address to bind on
+ * @arg port The port to bind on
+ * @arg rcvbuf The size of the receive buffer, or 0 for the default
+ * @arg shared Is the port also bound by the other workers
+ * @return The non-blocking socket, or -1 on error.
  */
-static int setup_udp_listener(statsite_networking *netconf) {
-    if (netconf->config->udp_port == 0) {
-        syslog(LOG_INFO, "UDP port is disabled");
-        return 0;
-    }
+static int open_udp_listener(worker_ev_userdata *worker, char *address, int port, int rcvbuf, int shared) {
     struct sockaddr_in addr;
     struct in_addr bind_addr;
     bzero(&addr, sizeof(addr));
     bzero(&bind_addr, sizeof(bind_addr));
     addr.sin_family = PF_INET;
-    addr.sin_port = htons(netconf->config->udp_port);
+    addr.sin_port = htons(port);
 
-    int ret = inet_pton(AF_INET, netconf->config->bind_address, &bind_addr);
+    int ret = inet_pton(AF_INET, address, &bind_addr);
     if (ret != 1) {
-        syslog(LOG_ERR, "Invalid IPv4 address '%s'!", netconf->config->bind_address);
-        return 1;
+        syslog(LOG_ERR, "Invalid IPv4 address '%s'!", address);
+        return -1;
     }
     addr.sin_addr = bind_addr;
 
@@ -200,195 +602,1005 @@ static int setup_udp_listener(statsite_networking *netconf) {
                 SO_REUSEADDR, &optval, sizeof(optval))) {
         syslog(LOG_ERR, "Failed to set SO_REUSEADDR! Err: %s", strerror(errno));
         close(udp_listener_fd);
-        return 1;
+        return -1;
+    }
+    if (shared && set_reuse_port(worker, udp_listener_fd)) {
+        close(udp_listener_fd);
+        return -1;
     }
+    set_udp_sockopts(worker, udp_listener_fd, rcvbuf, !shared || worker->worker_id == 0);
     if (bind(udp_listener_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
         syslog(LOG_ERR, "Failed to bind on UDP socket! Err: %s", strerror(errno));
         close(udp_listener_fd);
-        return 1;
+        return -1;
     }
 
     // Put the socket in non-blocking mode
     int flags = fcntl(udp_listener_fd, F_GETFL, 0);
     fcntl(udp_listener_fd, F_SETFL, flags | O_NONBLOCK);
 
-    // Allocate a connection object for the UDP socket,
-    // ensure a min-buffer size of 64K
-    conn_info *conn = get_conn();
-    while (circbuf_avail_buf(&conn->input) < 65536) {
-        circbuf_grow_buf(&conn->input);
+    if (!shared || worker->worker_id == 0) {
+        syslog(LOG_INFO, "Listening on udp '%s:%d'.", address, port);
     }
-    netconf->udp_client.data = conn;
+    return udp_listener_fd;
+}
 
-    syslog(LOG_INFO, "Listening on udp '%s:%d'.",
-           netconf->config->bind_address, netconf->config->udp_port);
+/**
+ * Initializes the TCP listener
+ * @arg worker The worker that owns the listener
+ * @return 0 on success.
+ */
+static int setup_tcp_listener(worker_ev_userdata *worker) {
+    statsite_config *config = worker->netconf->config;
+    if (config->tcp_port == 0) {
+        if (worker->worker_id == 0) syslog(LOG_INFO, "TCP port is disabled");
+        return 0;
+    }
+    int tcp_listener_fd = open_tcp_listener(worker, config->bind_address, config->tcp_port, 1);
+    if (tcp_listener_fd < 0) return 1;
 
     // Create the libev objects
-    ev_io_init(&netconf->udp_client, handle_udp_message,
-                udp_listener_fd, EV_READ);
-    ev_io_start(&netconf->udp_client);
+    ev_io_init(&worker->tcp_client, handle_new_client,
+                tcp_listener_fd, EV_READ);
+    ev_io_start(worker->loop, &worker->tcp_client);
     return 0;
 }
 
 /**
- * Initializes the stdin listener.
- * @arg netconf The network configuration
+ * Initializes the UDP Listener.
+ * @arg worker The worker that owns the listener
  * @return 0 on success.
  */
-static int setup_stdin_listener(statsite_networking *netconf) {
-    if (!netconf->config->parse_stdin) {
-        syslog(LOG_INFO, "stdin is disabled");
+static int setup_udp_listener(worker_ev_userdata *worker) {
+    statsite_networking *netconf = worker->netconf;
+    statsite_config *config = netconf->config;
+    if (config->udp_port == 0) {
+        if (worker->worker_id == 0) syslog(LOG_INFO, "UDP port is disabled");
         return 0;
     }
+    int udp_listener_fd = open_udp_listener(worker, config->bind_address,
+            config->udp_port, config->udp_rcvbuf, 1);
+    if (udp_listener_fd < 0) return 1;
 
-    // Log we are listening
-    syslog(LOG_INFO, "Listening on stdin.");
+    // Allocate a connection object for the UDP socket
+    conn_info *conn = get_datagram_conn(worker);
+    worker->udp_client.data = conn;
 
-    // Create an associated conn object
-    conn_info *conn = get_conn();
-    netconf->stdin_client = conn;
+    // Create the libev objects
+    ev_io_init(&worker->udp_client, handle_udp_message,
+                udp_listener_fd, EV_READ);
 
-    // Initialize the libev stuff
-    ev_io_init(&conn->client, invoke_event_handler, STDIN_FILENO, EV_READ);
-    ev_io_start(&conn->client);
+    // Receive with io_uring if enabled, recvmmsg is the fallback. The
+    // multishot receive does not take the sources, to rate limit them.
+#ifdef HAVE_IO_URING
+    if (config->io_uring && config->client_rate_limit && worker->worker_id == 0) {
+        syslog(LOG_WARNING, "io_uring is not used with a client_rate_limit, using recvmmsg.");
+    }
+    if (config->io_uring && !config->client_rate_limit && !setup_udp_ring(worker, conn, udp_listener_fd)) {
+        if (worker->worker_id == 0) syslog(LOG_INFO, "Receiving UDP with io_uring.");
+        return 0;
+    }
+#else
+    if (config->io_uring && worker->worker_id == 0) {
+        syslog(LOG_WARNING, "io_uring is not supported on this platform.");
+    }
+#endif
+    ev_io_start(worker->loop, &worker->udp_client);
     return 0;
 }
 
 /**
- * Initializes the networking interfaces
- * @arg config Takes the bloom server configuration
- * @arg mgr The filter manager to pass up to the connection handlers
- * @arg netconf Output. The configuration for the networking stack.
+ * Initializes the sockets of the listener sections that a worker
+ * listens on. A listener pinned to a worker is only bound by it,
+ * the rest are bound by every worker, as with the main listeners.
+ * Each UDP socket has its own receive buffer and connection.
+ * @arg worker The worker that owns the listeners
+ * @return 0 on success.
  */
-int init_networking(statsite_config *config, statsite_networking **netconf_out) {
-    // Initialize the netconf structure
-    statsite_networking *netconf = calloc(1, sizeof(struct statsite_networking));
-    netconf->config = config;
-
-    /**
-     * Check if we can use kqueue instead of select.
-     * By default, libev will not use kqueue since it only
-     * works for sockets, which is all we need.
-     */
-    int ev_mode = EVFLAG_AUTO;
-    if (ev_supported_backends () & ~ev_recommended_backends () & EVBACKEND_KQUEUE) {
-        ev_mode = EVBACKEND_KQUEUE;
+static int setup_extra_listeners(worker_ev_userdata *worker) {
+    statsite_config *config = worker->netconf->config;
+    int num = 0;
+    for (listener_config *l = config->listener_configs; l; l = l->next) {
+        if (l->worker == -1 || l->worker == worker->worker_id) num++;
     }
+    if (!num) return 0;
+    worker->listeners = calloc(num, sizeof(ev_io));
+
+    for (listener_config *l = config->listener_configs; l; l = l->next) {
+        if (l->worker != -1 && l->worker != worker->worker_id) continue;
+        char *address = l->bind_address ? l->bind_address : config->bind_address;
+        int shared = (l->worker == -1);
+        ev_io *watcher = worker->listeners + worker->num_listeners;
+        if (l->protocol == LISTEN_TCP) {
+            int fd = open_tcp_listener(worker, address, l->port, shared);
+            if (fd < 0) return 1;
+            ev_io_init(watcher, handle_new_client, fd, EV_READ);
+        } else {
+            int rcvbuf = l->udp_rcvbuf ? l->udp_rcvbuf : config->udp_rcvbuf;
+            int fd = open_udp_listener(worker, address, l->port, rcvbuf, shared);
+            if (fd < 0) return 1;
+            ev_io_init(watcher, handle_udp_message, fd, EV_READ);
+            watcher->data = get_datagram_conn(worker);
+            ((conn_info*)watcher->data)->priority = l->priority;
+        }
 
-    if (!ev_default_loop (ev_mode)) {
-        syslog(LOG_CRIT, "Failed to initialize libev!");
-        free(netconf);
-        return 1;
+        // The clients accepted by a priority listener take its priority
+        if (l->priority) ev_set_priority(watcher, PRIORITY_LISTENER_PRI);
+        ev_io_start(worker->loop, watcher);
+        worker->num_listeners++;
     }
+    return 0;
+}
 
-    // Setup the stdin listener
-    int res = setup_stdin_listener(netconf);
-    if (res != 0) {
-        free(netconf);
-        return 1;
+/**
+ * Binds a Unix domain socket, replacing a stale
+ * socket file left at the path by an earlier run.
+ * @arg path The path of the socket
+ * @arg type SOCK_STREAM or SOCK_DGRAM
+ * @return The non-blocking socket, or -1 on error.
+ */
+static int bind_unix_socket(char *path, int type) {
+    struct sockaddr_un addr;
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "Unix socket path '%s' is too long!", path);
+        return -1;
     }
+    strcpy(addr.sun_path, path);
 
-    // Setup the TCP listener
-    res = setup_tcp_listener(netconf);
-    if (res != 0) {
-        free(netconf);
-        return 1;
-    }
+    // Only remove the path if it is a socket
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
 
-    // Setup the UDP listener
-    res = setup_udp_listener(netconf);
-    if (res != 0) {
-        if (ev_is_active(&netconf->tcp_client)) {
-            ev_io_stop(&netconf->tcp_client);
-            close(netconf->tcp_client.fd);
-        }
-        free(netconf);
-        return 1;
+    int fd = socket(AF_UNIX, type, 0);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Failed to create Unix socket! Err: %s", strerror(errno));
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        syslog(LOG_ERR, "Failed to bind on Unix socket '%s'! Err: %s", path, strerror(errno));
+        close(fd);
+        return -1;
     }
 
-    // Setup the timer
-    ev_timer_init(&netconf->flush_timer, handle_flush_event, config->flush_interval, config->flush_interval);
-    ev_timer_start(&netconf->flush_timer);
-
-    // Prepare the conn handlers
-    init_conn_handler(config);
-
-    // Success!
-    *netconf_out = netconf;
-    return 0;
+    // Put the socket in non-blocking mode
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    return fd;
 }
 
-
 /**
- * Invoked when our flush timer is reached.
- * We need to instruct the connection handler about this.
+ * Closes the Unix domain sockets, and removes their paths.
+ * @arg netconf The network configuration
  */
-static void handle_flush_event(ev_timer *watcher, int revents) {
-    // Inform the connection handler of the timeout
-    flush_interval_trigger();
+static void close_unix_listeners(statsite_networking *netconf) {
+    if (netconf->unix_stream_fd >= 0) {
+        close(netconf->unix_stream_fd);
+        unlink(netconf->config->unix_stream_path);
+        netconf->unix_stream_fd = -1;
+    }
+    if (netconf->unix_dgram_fd >= 0) {
+        close(netconf->unix_dgram_fd);
+        unlink(netconf->config->unix_dgram_path);
+        netconf->unix_dgram_fd = -1;
+    }
+    if (netconf->admin_fd >= 0) {
+        close(netconf->admin_fd);
+        unlink(netconf->config->admin_socket_path);
+        netconf->admin_fd = -1;
+    }
 }
 
-
 /**
- * Invoked when a TCP listening socket fd is ready
- * to accept a new client. Accepts the client, initializes
- * the connection buffers, and stars to listening for data
+ * Initializes the Unix domain sockets. There is no SO_REUSEPORT
+ * for them, so each is bound once, and watched by every worker.
+ * @arg netconf The network configuration
+ * @return 0 on success.
  */
-static void handle_new_client(ev_io *watcher, int ready_events) {
-    // Accept the client connection
-    int listen_fd = watcher->fd;
-    struct sockaddr_in client_addr;
-    int client_addr_len = sizeof(client_addr);
-    int client_fd = accept(listen_fd,
-                        (struct sockaddr*)&client_addr,
-                        &client_addr_len);
-
-    // Check for an error
-    if (client_fd == -1) {
-        syslog(LOG_ERR, "Failed to accept() connection! %s.", strerror(errno));
-        return;
+static int setup_unix_listeners(statsite_networking *netconf) {
+    statsite_config *config = netconf->config;
+    netconf->unix_stream_fd = -1;
+    netconf->unix_dgram_fd = -1;
+    netconf->admin_fd = -1;
+    if (config->unix_stream_path) {
+        netconf->unix_stream_fd = bind_unix_socket(config->unix_stream_path, SOCK_STREAM);
+        if (netconf->unix_stream_fd < 0) return 1;
+        if (listen(netconf->unix_stream_fd, config->tcp_backlog) != 0) {
+            syslog(LOG_ERR, "Failed to listen on Unix socket! Err: %s", strerror(errno));
+            close_unix_listeners(netconf);
+            return 1;
+        }
+        syslog(LOG_INFO, "Listening on unix stream '%s'.", config->unix_stream_path);
     }
-
-    // Setup the socket
-    if (set_client_sockopts(client_fd)) {
-        return;
+    if (config->unix_dgram_path) {
+        netconf->unix_dgram_fd = bind_unix_socket(config->unix_dgram_path, SOCK_DGRAM);
+        if (netconf->unix_dgram_fd < 0) {
+            close_unix_listeners(netconf);
+            return 1;
+        }
+        syslog(LOG_INFO, "Listening on unix dgram '%s'.", config->unix_dgram_path);
     }
-
-    // Debug info
-    syslog(LOG_DEBUG, "Accepted client connection: %s %d [%d]",
-            inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), client_fd);
-
-    // Get the associated conn object
-    conn_info *conn = get_conn();
-
-    // Initialize the libev stuff
-    ev_io_init(&conn->client, invoke_event_handler, client_fd, EV_READ);
-    ev_io_start(&conn->client);
+    if (config->admin_socket_path) {
+        netconf->admin_fd = bind_unix_socket(config->admin_socket_path, SOCK_STREAM);
+        if (netconf->admin_fd < 0 || listen(netconf->admin_fd, config->tcp_backlog) != 0) {
+            syslog(LOG_ERR, "Failed to listen on the admin socket! Err: %s", strerror(errno));
+            close_unix_listeners(netconf);
+            return 1;
+        }
+        syslog(LOG_INFO, "Listening for admin requests on '%s'.", config->admin_socket_path);
+    }
+    return 0;
 }
 
-
 /**
- * Invoked when a client connection has data ready to be read.
- * We need to take care to add the data to our buffers, and then
- * invoke the connection handlers who have the business logic
- * of what to do.
+ * Starts watching the Unix domain sockets from a worker.
+ * Stream clients are accepted like TCP clients, and datagrams
+ * are read like UDP, into a connection of the worker.
+ * @arg worker The worker to watch from
  */
-static int read_client_data(conn_info *conn) {
-    /**
-     * Figure out how much space we have to write.
-     * If we have < 50% free, we resize the buffer using
-     * a multiplier.
-     */
-    int avail_buf = circbuf_avail_buf(&conn->input);
-    if (avail_buf < conn->input.buf_size / 2) {
-        circbuf_grow_buf(&conn->input);
+static void setup_unix_watchers(worker_ev_userdata *worker) {
+    statsite_networking *netconf = worker->netconf;
+    if (netconf->unix_stream_fd >= 0) {
+        ev_io_init(&worker->unix_stream, handle_new_client,
+                    netconf->unix_stream_fd, EV_READ);
+        ev_io_start(worker->loop, &worker->unix_stream);
+    }
+    if (netconf->unix_dgram_fd >= 0) {
+        ev_io_init(&worker->unix_dgram, handle_udp_message,
+                    netconf->unix_dgram_fd, EV_READ);
+        worker->unix_dgram.data = get_datagram_conn(worker);
+        ev_io_start(worker->loop, &worker->unix_dgram);
     }
 
-    // Build the IO vectors to perform the read
+    // The admin requests are rare, so one worker answers them
+    if (netconf->admin_fd >= 0 && worker->worker_id == 0) {
+        ev_io_init(&worker->admin, handle_admin_client, netconf->admin_fd, EV_READ);
+        ev_io_start(worker->loop, &worker->admin);
+    }
+}
+
+/**
+ * Initializes the shared memory ring. It is drained by the
+ * first worker, through a connection whose input buffer is
+ * the mirrored data of the ring, so frames are parsed in place.
+ * @arg netconf The network configuration
+ * @return 0 on success.
+ */
+static int setup_shm_listener(statsite_networking *netconf) {
+    statsite_config *config = netconf->config;
+    if (!config->shm_ring_path) return 0;
+    if (shm_ring_create(config->shm_ring_path, config->shm_ring_size, &netconf->shm_ring)) {
+        return 1;
+    }
+    syslog(LOG_INFO, "Listening on shm ring '%s'.", config->shm_ring_path);
+
+    // The buffer belongs to the ring, so the connection is not pooled
+    conn_info *conn = calloc(1, sizeof(conn_info));
+    conn->loop = netconf->workers[0].loop;
+    conn->client.fd = -1;
+    conn->input.buffer = shm_ring_data(netconf->shm_ring);
+    conn->input.buf_size = shm_ring_size(netconf->shm_ring);
+    conn->input.mirrored = 1;
+    netconf->shm_client = conn;
+    netconf->shm_head = shm_ring_tail(netconf->shm_ring);
+
+    ev_timer_init(&netconf->shm_timer, handle_shm_ring,
+                    SHM_RING_POLL_INTERVAL, SHM_RING_POLL_INTERVAL);
+    netconf->shm_timer.data = netconf;
+    ev_timer_start(conn->loop, &netconf->shm_timer);
+    return 0;
+}
+
+/**
+ * Stops draining the shared memory ring. Frames that
+ * were not consumed are left for the next run.
+ * @arg netconf The network configuration
+ */
+static void close_shm_listener(statsite_networking *netconf) {
+    if (!netconf->shm_ring) return;
+    ev_timer_stop(netconf->workers[0].loop, &netconf->shm_timer);
+    if (netconf->shm_client->state) free_client_state(netconf->shm_client->state);
+    free(netconf->shm_client);
+    shm_ring_close(netconf->shm_ring);
+    netconf->shm_ring = NULL;
+}
+
+/**
+ * Attaches the XDP program and opens a socket on each of
+ * the receive queues, handled by the workers in turn.
+ * @arg netconf The network configuration
+ * @return 0 on success.
+ */
+static int setup_xdp_listener(statsite_networking *netconf) {
+    statsite_config *config = netconf->config;
+    if (!config->xdp_interface) return 0;
+#ifdef HAVE_XDP
+    if (xdp_prog_attach(config->xdp_interface, config->udp_port,
+                config->xdp_queues, &netconf->xdp)) {
+        return 1;
+    }
+    netconf->xdp_queues = calloc(config->xdp_queues, sizeof(xdp_queue));
+    for (int i=0; i < config->xdp_queues; i++) {
+        xdp_queue *q = netconf->xdp_queues + i;
+        if (xdp_socket_open(netconf->xdp, i, &q->sock)) return 1;
+        netconf->num_xdp_queues++;
+
+        // The buffer belongs to the socket, so the connection is not pooled
+        conn_info *conn = calloc(1, sizeof(conn_info));
+        conn->loop = netconf->workers[i % netconf->num_workers].loop;
+        conn->client.fd = -1;
+        conn->datagram = 1;
+        conn->input.buffer = xdp_socket_umem(q->sock);
+        conn->input.buf_size = xdp_socket_umem_size(q->sock);
+        q->conn = conn;
+
+        ev_io_init(&q->watcher, handle_xdp_queue, xdp_socket_fd(q->sock), EV_READ);
+        q->watcher.data = q;
+        ev_io_start(conn->loop, &q->watcher);
+    }
+    syslog(LOG_INFO, "Listening with AF_XDP on '%s', %d queues.",
+            config->xdp_interface, config->xdp_queues);
+    return 0;
+#else
+    syslog(LOG_ERR, "AF_XDP is not supported on this platform!");
+    return 1;
+#endif
+}
+
+/**
+ * Closes the AF_XDP sockets and detaches the XDP program.
+ * The workers must have stopped.
+ * @arg netconf The network configuration
+ */
+static void close_xdp_listener(statsite_networking *netconf) {
+#ifdef HAVE_XDP
+    if (!netconf->xdp) return;
+    for (int i=0; i < netconf->num_xdp_queues; i++) {
+        xdp_queue *q = netconf->xdp_queues + i;
+        if (q->conn) {
+            ev_io_stop(q->conn->loop, &q->watcher);
+            if (q->conn->state) free_client_state(q->conn->state);
+            free(q->conn);
+        }
+        xdp_socket_close(q->sock);
+    }
+    free(netconf->xdp_queues);
+    netconf->xdp_queues = NULL;
+    netconf->num_xdp_queues = 0;
+    xdp_prog_detach(netconf->xdp);
+    netconf->xdp = NULL;
+#endif
+}
+
+/**
+ * Initializes the stdin listener.
+ * @arg netconf The network configuration
+ * @return 0 on success.
+ */
+static int setup_stdin_listener(statsite_networking *netconf) {
+    if (!netconf->config->parse_stdin) {
+        syslog(LOG_INFO, "stdin is disabled");
+        return 0;
+    }
+
+    // Log we are listening
+    syslog(LOG_INFO, "Listening on stdin.");
+
+    // Create an associated conn object, stdin
+    // is always handled by the first worker
+    conn_info *conn = get_conn(netconf->workers[0].loop);
+    limit_conn(conn);
+    netconf->stdin_client = conn;
+
+    // Initialize the libev stuff
+    ev_io_init(&conn->client, invoke_event_handler, STDIN_FILENO, EV_READ);
+    ev_io_start(conn->loop, &conn->client);
+    return 0;
+}
+
+/**
+ * Stops and closes the listeners of a worker
+ * @arg worker The worker to stop
+ */
+static void stop_worker_listeners(worker_ev_userdata *worker) {
+    if (ev_is_active(&worker->tcp_client)) {
+        ev_io_stop(worker->loop, &worker->tcp_client);
+        close(worker->tcp_client.fd);
+    }
+    if (ev_is_active(&worker->udp_client)) {
+        ev_io_stop(worker->loop, &worker->udp_client);
+        close(worker->udp_client.fd);
+    }
+    for (int i=0; i < worker->num_listeners; i++) {
+        ev_io_stop(worker->loop, worker->listeners + i);
+        close(worker->listeners[i].fd);
+    }
+    free(worker->listeners);
+    worker->listeners = NULL;
+    worker->num_listeners = 0;
+
+    // The Unix sockets are shared, and closed once all workers stop
+    ev_io_stop(worker->loop, &worker->unix_stream);
+    ev_io_stop(worker->loop, &worker->unix_dgram);
+    ev_io_stop(worker->loop, &worker->admin);
+    ev_timer_stop(worker->loop, &worker->proxy_timer);
+    ev_prepare_stop(worker->loop, &worker->loop_prepare);
+    ev_check_stop(worker->loop, &worker->loop_check);
+    ev_timer_stop(worker->loop, &worker->lag_timer);
+#ifdef HAVE_IO_URING
+    if (worker->udp_ring) {
+        ev_io_stop(worker->loop, &worker->udp_ring->watcher);
+        destroy_udp_ring(worker->udp_ring);
+        worker->udp_ring = NULL;
+        close(worker->udp_client.fd);
+    }
+#endif
+}
+
+/**
+ * Initializes the event loop and listeners of a worker
+ * @arg netconf The network configuration
+ * @arg worker The worker to initialize
+ * @arg ev_mode The libev backend flags
+ * @return 0 on success.
+ */
+static int setup_worker(statsite_networking *netconf, worker_ev_userdata *worker, int ev_mode) {
+    // The first worker uses the default loop
+    worker->netconf = netconf;
+    if (worker->worker_id == 0)
+        worker->loop = ev_default_loop(ev_mode);
+    else
+        worker->loop = ev_loop_new(ev_mode);
+    if (!worker->loop) {
+        syslog(LOG_CRIT, "Failed to initialize libev!");
+        return 1;
+    }
+    ev_set_userdata(worker->loop, worker);
+
+    // Setup the async watcher used to wake the loop
+    ev_async_init(&worker->wakeup, handle_wakeup);
+    ev_async_start(worker->loop, &worker->wakeup);
+
+    // The buckets of the clients, a burst must fit a datagram
+    statsite_config *config = netconf->config;
+    if (config->client_rate_limit) {
+        double burst = (config->client_rate_burst) ? config->client_rate_burst : config->client_rate_limit;
+        if (burst < MAX_UDP_PACKET_SIZE) burst = MAX_UDP_PACKET_SIZE;
+        worker->client_rates = malloc(sizeof(rate_table));
+        if (init_rate_table(config->client_rate_limit, burst, worker->client_rates)) {
+            syslog(LOG_CRIT, "Failed to allocate the client rate buckets!");
+            free(worker->client_rates);
+            worker->client_rates = NULL;
+            return 1;
+        }
+    }
+
+    // Setup the TCP listener
+    int res = setup_tcp_listener(worker);
+    if (res != 0) return 1;
+
+    // Setup the UDP listener
+    res = setup_udp_listener(worker);
+    if (res != 0) {
+        stop_worker_listeners(worker);
+        return 1;
+    }
+
+    // Setup the sockets of the listener sections
+    res = setup_extra_listeners(worker);
+    if (res != 0) {
+        stop_worker_listeners(worker);
+        return 1;
+    }
+
+    // Watch the Unix sockets
+    setup_unix_watchers(worker);
+
+    // Send the batches of the proxy on a short timer
+    if (netconf->config->proxy_upstreams) {
+        ev_timer_init(&worker->proxy_timer, handle_proxy_timer,
+                PROXY_FLUSH_INTERVAL, PROXY_FLUSH_INTERVAL);
+        ev_timer_start(worker->loop, &worker->proxy_timer);
+    }
+
+    // Time each iteration of the loop. The check runs ahead of
+    // the other callbacks that are ready after the poll.
+    ev_prepare_init(&worker->loop_prepare, handle_loop_prepare);
+    ev_prepare_start(worker->loop, &worker->loop_prepare);
+    ev_check_init(&worker->loop_check, handle_loop_check);
+    ev_set_priority(&worker->loop_check, EV_MAXPRI);
+    ev_check_start(worker->loop, &worker->loop_check);
+    ev_timer_init(&worker->lag_timer, handle_lag_timer, LOOP_LAG_INTERVAL, LOOP_LAG_INTERVAL);
+    ev_timer_start(worker->loop, &worker->lag_timer);
+    worker->lag_due = monotonic_now() + LOOP_LAG_INTERVAL;
+    return 0;
+}
+
+/**
+ * Initializes the networking interfaces
+ * @arg config Takes the bloom server configuration
+ * @arg mgr The filter manager to pass up to the connection handlers
+ * @arg netconf Output. The configuration for the networking stack.
+ */
+int init_networking(statsite_config *config, statsite_networking **netconf_out) {
+    // Initialize the netconf structure
+    statsite_networking *netconf = calloc(1, sizeof(struct statsite_networking));
+    netconf->config = config;
+    netconf->num_workers = config->worker_threads;
+    netconf->workers = calloc(netconf->num_workers, sizeof(worker_ev_userdata));
+
+    // Store the connection buffer limits
+    MAX_CONN_BUFFER = config->conn_max_buffer;
+    BUSY_POLL_US = config->busy_poll_us;
+#ifndef HAVE_BUSY_POLL
+    if (BUSY_POLL_US) syslog(LOG_WARNING, "Busy polling the sockets is not supported on this platform.");
+#endif
+    CONN_BUFFER_BUDGET = config->conn_buffer_budget;
+    PRIORITY_BUFFER_BUDGET = config->priority_buffer_budget;
+
+    /**
+     * Check if we can use kqueue instead of select.
+     * By default, libev will not use kqueue since it only
+     * works for sockets, which is all we need.
+     */
+    int ev_mode = EVFLAG_AUTO;
+    if (ev_supported_backends () & ~ev_recommended_backends () & EVBACKEND_KQUEUE) {
+        ev_mode = EVBACKEND_KQUEUE;
+    }
+
+    // Bind the Unix sockets, shared by the workers
+    int res = setup_unix_listeners(netconf);
+    if (res != 0) {
+        free(netconf->workers);
+        free(netconf);
+        return 1;
+    }
+
+    // Setup each of the workers
+    int i;
+    for (i=0; i < netconf->num_workers && !res; i++) {
+        netconf->workers[i].worker_id = i;
+        res = setup_worker(netconf, netconf->workers+i, ev_mode);
+    }
+    if (res != 0) {
+        // Close the listeners of the workers already setup
+        for (int j=0; j < i - 1; j++) {
+            stop_worker_listeners(netconf->workers+j);
+        }
+        close_unix_listeners(netconf);
+        free(netconf->workers);
+        free(netconf);
+        return 1;
+    }
+
+    // Setup the shm ring, AF_XDP and the stdin listener
+    res = setup_shm_listener(netconf);
+    if (!res) res = setup_xdp_listener(netconf);
+    if (!res) res = setup_stdin_listener(netconf);
+    if (res != 0) {
+        close_xdp_listener(netconf);
+        close_shm_listener(netconf);
+        close_unix_listeners(netconf);
+        free(netconf->workers);
+        free(netconf);
+        return 1;
+    }
+
+    // Setup the timer on the default loop. It runs ahead of
+    // the clients that are ready in the same loop iteration.
+    ev_timer_init(&netconf->flush_timer, handle_flush_event, config->flush_interval, config->flush_interval);
+    ev_set_priority(&netconf->flush_timer, EV_MAXPRI);
+    ev_timer_start(netconf->workers[0].loop, &netconf->flush_timer);
+
+    // Prepare the conn handlers
+    init_conn_handler(config);
+
+    // Success!
+    *netconf_out = netconf;
+    return 0;
+}
+
+
+/**
+ * Invoked when our flush timer is reached.
+ * We need to instruct the connection handler about this.
+ */
+static void handle_flush_event(struct ev_loop *loop, ev_timer *watcher, int revents) {
+    // Inform the connection handler of the timeout, and
+    // restart the timer if a reload changed the interval
+    int interval = flush_interval_trigger();
+    if (interval != watcher->repeat) {
+        watcher->repeat = interval;
+        ev_timer_again(loop, watcher);
+    }
+}
+
+
+/**
+ * Invoked when a worker loop is woken up by another
+ * thread. This is only used to get the loop to
+ * check if it should still be running.
+ */
+static void handle_wakeup(struct ev_loop *loop, ev_async *watcher, int revents) {
+}
+
+
+/**
+ * Invoked when a client that was paused for buffer
+ * memory can be read from again.
+ */
+static void handle_resume(struct ev_loop *loop, ev_timer *watcher, int revents) {
+    conn_info *conn = watcher->data;
+    ev_io_start(loop, &conn->client);
+}
+
+
+/**
+ * Invoked on each worker to send the records that
+ * the proxy has batched for the upstreams.
+ */
+static void handle_proxy_timer(struct ev_loop *loop, ev_timer *watcher, int revents) {
+    worker_ev_userdata *worker = ev_userdata(loop);
+    handle_proxy_flush(worker->worker_id);
+}
+
+
+/**
+ * Invoked once the poll of a loop returns, before the
+ * callbacks of the iteration run.
+ */
+static void handle_loop_check(struct ev_loop *loop, ev_check *watcher, int revents) {
+    // Iterations that run nothing, as a spinning loop mostly does, are not timed
+    worker_ev_userdata *worker = ev_userdata(loop);
+    worker->had_events = ev_pending_count(loop) > 0;
+    worker->busy_since = (worker->had_events) ? monotonic_now() : 0;
+}
+
+
+/**
+ * Invoked before a loop polls, once the callbacks of the
+ * iteration are done. Records how long they held up the loop.
+ */
+static void handle_loop_prepare(struct ev_loop *loop, ev_prepare *watcher, int revents) {
+    worker_ev_userdata *worker = ev_userdata(loop);
+    if (!worker->busy_since) return;
+    loop_monitor_iteration(worker->worker_id, (monotonic_now() - worker->busy_since) * 1000);
+    worker->busy_since = 0;
+}
+
+
+/**
+ * Invoked by the lag timer of a loop. Records how late it
+ * fired, and restarts it from now, so a late firing only
+ * counts once.
+ */
+static void handle_lag_timer(struct ev_loop *loop, ev_timer *watcher, int revents) {
+    worker_ev_userdata *worker = ev_userdata(loop);
+    double now = monotonic_now();
+    if (now > worker->lag_due) loop_monitor_lag((now - worker->lag_due) * 1000);
+    worker->lag_due = now + LOOP_LAG_INTERVAL;
+    ev_now_update(loop);
+    ev_timer_again(loop, watcher);
+}
+
+
+/**
+ * Invoked to poll the shared memory ring. The frames between
+ * the tail and head are parsed in place, and the bytes of the
+ * complete frames are given back to the producer.
+ */
+static void handle_shm_ring(struct ev_loop *loop, ev_timer *watcher, int revents) {
+    statsite_networking *netconf = watcher->data;
+    shm_ring *ring = netconf->shm_ring;
+    conn_info *conn = netconf->shm_client;
+    uint64_t head = shm_ring_head(ring);
+    if (head == netconf->shm_head) return;
+
+    // A producer that moved the head too far has corrupted the ring
+    uint32_t mask = shm_ring_size(ring) - 1;
+    uint64_t tail = shm_ring_tail(ring);
+    uint64_t used = head - tail;
+    if (unlikely(used > mask)) {
+        syslog(LOG_WARNING, "The shm ring head is out of bounds, discarding its frames!");
+        shm_ring_consume(ring, used);
+        netconf->shm_head = head;
+        return;
+    }
+    stats_add(STAT_BYTES, head - netconf->shm_head);
+    netconf->shm_head = head;
+
+    // Point the cursors at the pending frames
+    conn->input.read_cursor = tail & mask;
+    conn->input.write_cursor = head & mask;
+    statsite_conn_handler handle = {netconf->config, conn, 0};
+    if (handle_client_connect(&handle)) {
+        // There is no connection to close, so skip past the bad frame
+        syslog(LOG_WARNING, "Discarding the shm ring after an invalid frame!");
+        shm_ring_consume(ring, used);
+        return;
+    }
+
+    // The cursors are reset once all the bytes are consumed
+    if (conn->input.read_cursor == conn->input.write_cursor)
+        shm_ring_consume(ring, used);
+    else
+        shm_ring_consume(ring, (conn->input.read_cursor - (tail & mask)) & mask);
+}
+
+
+/**
+ * Invoked when a TCP or Unix stream listening socket fd is ready
+ * to accept new clients. Accepts clients until there are no
+ * more pending, initializes the connection buffers, and stars
+ * to listening for data
+ */
+static void handle_new_client(struct ev_loop *loop, ev_io *watcher, int ready_events) {
+    int listen_fd = watcher->fd;
+    worker_ev_userdata *worker = ev_userdata(loop);
+    int tcp = (watcher != &worker->unix_stream);
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_len;
+    int client_fd;
+
+    // Accept all the pending connections, up to a batch
+    for (int i=0; i < ACCEPT_BATCH_SIZE; i++) {
+        client_addr_len = sizeof(client_addr);
+#ifdef HAVE_ACCEPT4
+        client_fd = accept4(listen_fd, (struct sockaddr*)&client_addr,
+                            &client_addr_len, SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+        client_fd = accept(listen_fd, (struct sockaddr*)&client_addr,
+                            &client_addr_len);
+#endif
+
+        // Check for an error
+        if (client_fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            syslog(LOG_ERR, "Failed to accept() connection! %s.", strerror(errno));
+            return;
+        }
+
+        // Setup the socket
+        if (set_client_sockopts(client_fd, tcp)) {
+            continue;
+        }
+
+        // Debug info
+        if (tcp) {
+            syslog(LOG_DEBUG, "Accepted client connection: %s %d [%d]",
+                    inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), client_fd);
+        } else {
+            syslog(LOG_DEBUG, "Accepted unix client connection. [%d]", client_fd);
+        }
+
+        // Get the associated conn object. The clients of a
+        // priority listener are not rate limited.
+        conn_info *conn = get_conn(loop);
+        conn->priority = (ev_priority(watcher) == PRIORITY_LISTENER_PRI);
+        limit_conn(conn);
+        if (worker->client_rates && !conn->priority) {
+            conn->rate_limited = 1;
+            rate_bucket_init(worker->client_rates, &conn->rate, ev_now(loop));
+        }
+
+        // Initialize the libev stuff
+        ev_io_init(&conn->client, invoke_event_handler, client_fd, EV_READ);
+        if (conn->priority) ev_set_priority(&conn->client, PRIORITY_LISTENER_PRI);
+        ev_io_start(loop, &conn->client);
+    }
+}
+
+
+// Stops watching an admin client, and releases it
+static void close_admin_conn(struct ev_loop *loop, admin_conn *c) {
+    ev_io_stop(loop, &c->watcher);
+    close(c->watcher.fd);
+    free(c->response);
+    free(c);
+}
+
+/**
+ * Answers a request of an admin client, into its response.
+ * The response ends with an empty line.
+ * @arg line The request, without the newline
+ */
+static void admin_request(admin_conn *c, char *line) {
+    FILE *out = open_memstream(&c->response, &c->response_len);
+    if (!out) return;
+    if (!strncmp(line, "GET", 3) && (line[3] == ' ' || !line[3])) {
+        char *prefix = line + 3;
+        while (*prefix == ' ') prefix++;
+        if (query_metrics(prefix, out)) fputs("ERR query failed\n", out);
+    } else if (!strcmp(line, "MEM")) {
+        int64_t mem[NUM_MEMS];
+        stats_mem_collect(mem);
+        for (int i=0; i < NUM_MEMS; i++) {
+            fprintf(out, "%s|%lld\n", MEM_NAMES[i], (long long)mem[i]);
+        }
+    } else {
+        fputs("ERR unknown command\n", out);
+    }
+    fputc('\n', out);
+    if (fclose(out)) {
+        free(c->response);
+        c->response = NULL;
+    }
+    c->written = 0;
+}
+
+/**
+ * Invoked when an admin client is readable, or writable while
+ * a response is written out. Both are non-blocking, so a slow
+ * client does not hold up the loop.
+ */
+static void handle_admin_io(struct ev_loop *loop, ev_io *watcher, int ready_events) {
+    admin_conn *c = (admin_conn*)watcher;
+    int fd = watcher->fd;
+    if (c->response) {
+        ssize_t n = write(fd, c->response + c->written, c->response_len - c->written);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            close_admin_conn(loop, c);
+            return;
+        }
+        if (n > 0) c->written += n;
+        if (c->written < c->response_len) return;
+        free(c->response);
+        c->response = NULL;
+    } else {
+        ssize_t n = read(fd, c->request + c->request_len, ADMIN_MAX_REQUEST - c->request_len);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            close_admin_conn(loop, c);
+            return;
+        }
+        if (n > 0) c->request_len += n;
+    }
+
+    // Answer the next complete request, writing until it is out
+    char *end = memchr(c->request, '\n', c->request_len);
+    if (!end && c->request_len == ADMIN_MAX_REQUEST) {
+        syslog(LOG_WARNING, "Admin request exceeds %d bytes!", ADMIN_MAX_REQUEST);
+        close_admin_conn(loop, c);
+        return;
+    }
+    int events = EV_READ;
+    if (end) {
+        *end = 0;
+        if (end > c->request && end[-1] == '\r') end[-1] = 0;
+        admin_request(c, c->request);
+        int used = end - c->request + 1;
+        c->request_len -= used;
+        memmove(c->request, end + 1, c->request_len);
+        if (c->response) events = EV_WRITE;
+    }
+    if (events != (watcher->events & (EV_READ | EV_WRITE))) {
+        ev_io_stop(loop, watcher);
+        ev_io_set(watcher, fd, events);
+        ev_io_start(loop, watcher);
+    }
+}
+
+/**
+ * Invoked when the admin socket has clients to accept.
+ */
+static void handle_admin_client(struct ev_loop *loop, ev_io *watcher, int ready_events) {
+    for (int i=0; i < ACCEPT_BATCH_SIZE; i++) {
+        int fd = accept(watcher->fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                syslog(LOG_ERR, "Failed to accept() admin connection! %s.", strerror(errno));
+            return;
+        }
+        if (fcntl(fd, F_SETFL, O_NONBLOCK) || fcntl(fd, F_SETFD, FD_CLOEXEC)) {
+            close(fd);
+            continue;
+        }
+        admin_conn *c = calloc(1, sizeof(admin_conn));
+        if (!c) {
+            close(fd);
+            return;
+        }
+        ev_io_init(&c->watcher, handle_admin_io, fd, EV_READ);
+        ev_io_start(loop, &c->watcher);
+    }
+}
+
+/**
+ * Drops the input of a connection that is discarding, up to
+ * and including the terminator. Once the terminator is found,
+ * the input after it is kept.
+ */
+static void discard_input(conn_info *conn) {
+    char *buf;
+    int buf_len, should_free;
+    if (extract_to_terminator(conn, conn->discard_to, &buf, &buf_len, &should_free)) {
+        circbuf_clear(&conn->input);
+        return;
+    }
+    if (should_free) free(buf);
+    conn->discarding = 0;
+}
+
+/**
+ * Invoked when a client connection has data ready to be read.
+ * We need to take care to add the data to our buffers, and then
+ * invoke the connection handlers who have the business logic
+ * of what to do.
+ * @arg budget The most bytes to read, reduced by the bytes read
+ * @arg more Output, set if the read filled the space it was given,
+ * so there may be more data waiting
+ * @return 0 on success, 1 if the connection should be closed.
+ */
+static int read_client_data(conn_info *conn, size_t *budget, int *more) {
+    *more = 0;
+
+    /**
+     * Figure out how much space we have to write.
+     * If we have < 50% free, we resize the buffer using
+     * a multiplier.
+     */
+    int avail_buf = circbuf_avail_buf(&conn->input);
+    if (avail_buf < conn->input.buf_size / 2) {
+        conn_grow_buf(conn);
+        avail_buf = circbuf_avail_buf(&conn->input);
+    }
+
+    /*
+     * If the buffer is full with a partial command, it must grow.
+     * Give up if the command is larger than the maximum buffer,
+     * otherwise we are over the memory budget, so pause reading
+     * and leave the data with the kernel until memory frees up.
+     */
+    if (unlikely(!avail_buf)) {
+        if (conn->input.buf_size * CONN_BUF_MULTIPLIER > MAX_CONN_BUFFER) {
+            syslog(LOG_WARNING, "Command exceeds the maximum buffer size of %u bytes! [%d]",
+                    MAX_CONN_BUFFER, conn->client.fd);
+            return 1;
+        }
+        if (!conn->paused) {
+            syslog(LOG_DEBUG, "Pausing reads, buffer budget exhausted. [%d]", conn->client.fd);
+            conn->paused = 1;
+        }
+        ev_io_stop(conn->loop, &conn->client);
+        ev_timer_set(&conn->resume, CONN_PAUSE_INTERVAL, 0);
+        ev_timer_start(conn->loop, &conn->resume);
+        return 0;
+    }
+
+    /*
+     * A client over its rate is not read until its bucket refills,
+     * so the input waits with the kernel, and TCP slows the client.
+     */
+    size_t left = *budget;
+    rate_table *rates = NULL;
+    if (conn->rate_limited) {
+        rates = ((worker_ev_userdata*)ev_userdata(conn->loop))->client_rates;
+        double tokens = rate_bucket_refill(rates, &conn->rate, ev_now(conn->loop));
+        if (tokens < 1) {
+            stats_add(STAT_RATE_PAUSED, 1);
+            ev_io_stop(conn->loop, &conn->client);
+            ev_timer_set(&conn->resume, rate_bucket_wait(rates, &conn->rate), 0);
+            ev_timer_start(conn->loop, &conn->resume);
+            return 0;
+        }
+        if (tokens < left) left = tokens;
+    }
+
+    // Build the IO vectors to perform the read
     struct iovec vectors[2];
     int num_vectors;
     circbuf_setup_readv_iovec(&conn->input, (struct iovec*)&vectors, &num_vectors);
 
+    // Read at most the budget, the rest is left for the next wakeup
+    size_t space = 0;
+    for (int i=0; i < num_vectors; i++) {
+        if (vectors[i].iov_len > left) vectors[i].iov_len = left;
+        left -= vectors[i].iov_len;
+        space += vectors[i].iov_len;
+    }
+
     // Issue the read
     ssize_t read_bytes = readv(conn->client.fd, (struct iovec*)&vectors, num_vectors);
 
@@ -401,75 +1613,536 @@ static int read_client_data(conn_info *conn) {
         if (errno == EAGAIN || errno == EINTR)
             return 0;
 
-        syslog(LOG_ERR, "Failed to read() from connection [%d]! %s.",
-                conn->client.fd, strerror(errno));
+        syslog(LOG_ERR, "Failed to read() from connection [%d]! %s.",
+                conn->client.fd, strerror(errno));
+        return 1;
+    }
+
+    // Update the write cursor
+    conn->paused = 0;
+    if (rates) conn->rate.tokens -= read_bytes;
+    stats_add(STAT_BYTES, read_bytes);
+    circbuf_advance_write(&conn->input, read_bytes);
+    *budget -= read_bytes;
+    *more = ((size_t)read_bytes == space);
+    if (unlikely(conn->discarding)) discard_input(conn);
+    return 0;
+}
+
+
+#ifdef HAVE_RECVMMSG
+#ifdef HAVE_RXQ_OVFL
+/**
+ * Reports the datagrams the kernel dropped since the last
+ * message. The SO_RXQ_OVFL count attached to it is cumulative,
+ * and kept by each socket.
+ * @arg conn The connection of the socket
+ * @arg hdr A received message, with its control messages
+ */
+static void check_udp_drops(conn_info *conn, statsite_conn_handler *handle, struct msghdr *hdr) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SO_RXQ_OVFL) continue;
+        uint32_t drops;
+        memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+        if (drops != conn->udp_drops) {
+            handle_udp_drops(handle, drops - conn->udp_drops);
+            conn->udp_drops = drops;
+        }
+    }
+}
+#endif
+
+/**
+ * Returns the size of the datagrams that UDP_GRO
+ * coalesced into a message.
+ * @arg hdr A received message, with its control messages
+ * @return The size, or 0 if the message is a single datagram.
+ */
+static unsigned int udp_segment_size(struct msghdr *hdr) {
+#ifdef HAVE_UDP_GRO
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (cmsg->cmsg_level != IPPROTO_UDP || cmsg->cmsg_type != UDP_GRO) continue;
+        int size;
+        memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+        return size > 0 ? size : 0;
+    }
+#endif
+    return 0;
+}
+
+/**
+ * Invokes the connection handler on a datagram that was
+ * received into a slot of the connection buffer.
+ * @arg start The start of the datagram
+ * @arg read_bytes The length of the datagram. There must be
+ * room for one more byte in the slot.
+ */
+static void handle_udp_datagram(statsite_conn_handler *handle, conn_info *conn, char *start, unsigned int read_bytes) {
+    stats_add(STAT_PACKETS, 1);
+    stats_add(STAT_BYTES, read_bytes);
+
+    // Point the input buffer at this datagram
+    conn->input.read_cursor = start - conn->input.buffer;
+    conn->input.write_cursor = conn->input.read_cursor + read_bytes;
+    conn->input.scanned = 0;
+
+    // UDP clients don't need to append newlines to the messages like
+    // TCP clients do, but our parser requires them. Append one if
+    // it's not present, there is always room left in the slot.
+    if (start[read_bytes - 1] != '\n') {
+        start[read_bytes] = '\n';
+        conn->input.write_cursor++;
+    }
+
+    // Invoke the connection handler
+    handle_client_connect(handle);
+}
+
+/**
+ * Invokes the connection handler on each datagram of a message.
+ * The datagrams are handled in place, so the byte after each one,
+ * which may get a newline appended, is restored after it.
+ * @arg start The start of the message
+ * @arg read_bytes The length of the message. There must be
+ * room for one more byte in the slot.
+ * @arg seg_size The size of the coalesced datagrams, or 0
+ */
+static void handle_udp_segments(statsite_conn_handler *handle, conn_info *conn,
+        char *start, unsigned int read_bytes, unsigned int seg_size) {
+    if (seg_size) {
+        for (; read_bytes > seg_size; start += seg_size, read_bytes -= seg_size) {
+            char next = start[seg_size];
+            handle_udp_datagram(handle, conn, start, seg_size);
+            start[seg_size] = next;
+        }
+    }
+    handle_udp_datagram(handle, conn, start, read_bytes);
+}
+
+/**
+ * Invoked when an AF_XDP socket has packets on its receive
+ * ring. The UDP payload of each packet is handled in place in
+ * its frame, and the frames are given back to the kernel after
+ * each batch. Batches are taken until the ring is drained, or
+ * the wakeup budget is used.
+ */
+static void handle_xdp_queue(struct ev_loop *loop, ev_io *watch, int ready_events) {
+    xdp_queue *q = watch->data;
+    worker_ev_userdata *worker = ev_userdata(loop);
+    statsite_conn_handler handle = {worker->netconf->config, q->conn, worker->worker_id};
+    char *umem = xdp_socket_umem(q->sock);
+
+    xdp_packet pkts[XDP_BATCH_SIZE];
+    uint32_t num;
+    int datagrams = 0;
+    do {
+        num = xdp_socket_recv(q->sock, pkts, XDP_BATCH_SIZE);
+        for (uint32_t i=0; i < num; i++) {
+            uint32_t offset, len;
+            char *frame = umem + pkts[i].addr;
+            if (xdp_udp_payload(frame, pkts[i].len, &offset, &len) || !len) continue;
+
+            // There must be a byte left in the frame for the newline
+            if ((pkts[i].addr & (XDP_FRAME_SIZE - 1)) + offset + len >= XDP_FRAME_SIZE) {
+                syslog(LOG_WARNING, "Dropped a UDP packet of %u bytes that fills its XDP frame.", len);
+                continue;
+            }
+            handle_udp_datagram(&handle, q->conn, frame + offset, len);
+        }
+        xdp_socket_release(q->sock, pkts, num);
+        circbuf_clear(&q->conn->input);
+        datagrams += num;
+    } while (num == XDP_BATCH_SIZE && datagrams < UDP_WAKEUP_DATAGRAMS);
+
+    // The drop count is cumulative, like SO_RXQ_OVFL
+    uint64_t drops;
+    if (handle.config->udp_drop_counter && !xdp_socket_drops(q->sock, &drops) && drops != q->drops) {
+        handle_udp_drops(&handle, drops - q->drops);
+        q->drops = drops;
+    }
+}
+
+/**
+ * Invoked when a UDP connection has a message ready to be read.
+ * We read up to UDP_BATCH_SIZE datagrams with a single recvmmsg()
+ * call directly into slots of the connection buffer, and then invoke
+ * the connection handler on each datagram in turn. Batches are read
+ * until the socket is drained, or the wakeup budget is used.
+ */
+static void handle_udp_message(struct ev_loop *loop, ev_io *watch, int ready_events) {
+    // Get the associated connection struct and user data
+    conn_info *conn = watch->data;
+    worker_ev_userdata *worker = ev_userdata(loop);
+    statsite_conn_handler handle = {worker->netconf->config, watch->data, worker->worker_id};
+
+    int num_msgs, datagrams = 0;
+    size_t bytes = 0;
+    do {
+        // Issue the batched read, into the slots of this socket
+        for (int i=0; i < UDP_BATCH_SIZE; i++) {
+            worker->udp_vectors[i].iov_base = conn->input.buffer + (i * MAX_UDP_PACKET_SIZE);
+#ifdef HAVE_UDP_CONTROL
+            worker->udp_msgs[i].msg_hdr.msg_controllen = UDP_CONTROL_SIZE;
+#endif
+            if (worker->client_rates) {
+                worker->udp_msgs[i].msg_hdr.msg_name = worker->udp_addrs + i;
+                worker->udp_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+            }
+        }
+        num_msgs = recvmmsg(watch->fd, worker->udp_msgs, UDP_BATCH_SIZE, 0, NULL);
+        if (num_msgs == -1) {
+            if (errno != EAGAIN && errno != EINTR) {
+                syslog(LOG_ERR, "Failed to recvmmsg() from connection [%d]! %s.",
+                        watch->fd, strerror(errno));
+            }
+            return;
+        }
+
+#ifdef HAVE_RXQ_OVFL
+        // The drop count is cumulative, so only the latest one matters
+        if (num_msgs > 0) {
+            check_udp_drops(conn, &handle, &worker->udp_msgs[num_msgs - 1].msg_hdr);
+        }
+#endif
+
+        datagrams += num_msgs;
+        for (int i=0; i < num_msgs; i++) {
+            unsigned int read_bytes = worker->udp_msgs[i].msg_len;
+            bytes += read_bytes;
+            if (read_bytes == 0) {
+                syslog(LOG_DEBUG, "Got empty UDP packet. [%d]\n", watch->fd);
+                continue;
+            }
+
+            // Drop what a source sends over its rate, before parsing it
+            if (worker->client_rates && !conn->priority && worker->udp_msgs[i].msg_hdr.msg_namelen &&
+                    !rate_table_take(worker->client_rates, worker->udp_msgs[i].msg_hdr.msg_name,
+                        ev_now(loop), read_bytes)) {
+                stats_add(STAT_RATE_DROPPED, 1);
+                continue;
+            }
+            handle_udp_segments(&handle, conn, worker->udp_vectors[i].iov_base, read_bytes,
+                    udp_segment_size(&worker->udp_msgs[i].msg_hdr));
+        }
+
+        // Reset the cursors, discarding any partial commands
+        circbuf_clear(&conn->input);
+
+    // A full batch means there may be more datagrams waiting
+    } while (num_msgs == UDP_BATCH_SIZE && datagrams < UDP_WAKEUP_DATAGRAMS &&
+             bytes < UDP_WAKEUP_BYTES);
+}
+
+#else
+/**
+ * Invoked when a UDP connection has a message ready to be read.
+ * We need to take care to add the data to our buffers, and then
+ * invoke the connection handlers who have the business logic
+ * of what to do. Datagrams are read until the socket is drained,
+ * or the wakeup budget is used.
+ */
+static void handle_udp_message(struct ev_loop *loop, ev_io *watch, int ready_events) {
+    worker_ev_userdata *worker = ev_userdata(loop);
+    size_t bytes = 0;
+    for (int n=0; n < UDP_WAKEUP_DATAGRAMS && bytes < UDP_WAKEUP_BYTES; n++) {
+        // Get the associated connection struct
+        conn_info *conn = watch->data;
+
+        // Clear the input buffer
+        circbuf_clear(&conn->input);
+
+        // Build the IO vectors to perform the read
+        struct iovec vectors[2];
+        int num_vectors;
+        circbuf_setup_readv_iovec(&conn->input, (struct iovec*)&vectors, &num_vectors);
+
+        /*
+         * Issue the read, always use the first vector.
+         * since we just cleared the buffer, and it should
+         * be a contiguous buffer.
+         */
+        assert(num_vectors == 1);
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        ssize_t read_bytes = recvfrom(watch->fd, vectors[0].iov_base, vectors[0].iov_len, 0,
+                                    (struct sockaddr*)&addr, &addr_len);
+
+        // Make sure we actually read something
+        if (read_bytes == 0) {
+            syslog(LOG_DEBUG, "Got empty UDP packet. [%d]\n", watch->fd);
+            return;
+
+        } else if (read_bytes == -1) {
+            if (errno != EAGAIN && errno != EINTR) {
+                syslog(LOG_ERR, "Failed to recv() from connection [%d]! %s.",
+                        watch->fd, strerror(errno));
+            }
+            return;
+        }
+
+        // Drop what a source sends over its rate, before parsing it
+        bytes += read_bytes;
+        if (worker->client_rates && !conn->priority && addr_len &&
+                !rate_table_take(worker->client_rates, (struct sockaddr*)&addr, ev_now(loop), read_bytes)) {
+            stats_add(STAT_RATE_DROPPED, 1);
+            continue;
+        }
+
+        // Update the write cursor
+        stats_add(STAT_PACKETS, 1);
+        stats_add(STAT_BYTES, read_bytes);
+        circbuf_advance_write(&conn->input, read_bytes);
+
+        // UDP clients don't need to append newlines to the messages like
+        // TCP clients do, but our parser requires them.  Append one if
+        // it's not present.
+        if (conn->input.buffer[conn->input.write_cursor - 1] != '\n')
+            circbuf_write(&conn->input, "\n", 1);
+
+        // Invoke the connection handler
+        statsite_conn_handler handle = {worker->netconf->config, watch->data, worker->worker_id};
+        handle_client_connect(&handle);
+    }
+}
+#endif
+
+
+#ifdef HAVE_IO_URING
+/*
+ * There is no libc wrapper for the io_uring syscalls,
+ * and liburing is not needed for the one request we use.
+ */
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Releases an io_uring. Closing it cancels the receive.
+ */
+static void destroy_udp_ring(udp_ring *ring) {
+    if (ring->fd >= 0) close(ring->fd);
+    if (ring->sq_ring) munmap(ring->sq_ring, ring->ring_size);
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->bufs) munmap(ring->bufs, ring->bufs_size);
+    free(ring);
+}
+
+/**
+ * Gives a datagram slot back to the kernel. The
+ * buffers are published at once by udp_ring_publish.
+ * @arg base The start of the connection buffer
+ * @arg bid The index of the slot
+ */
+static void udp_ring_recycle(udp_ring *ring, char *base, uint16_t bid) {
+    struct io_uring_buf *buf = ring->bufs->bufs + (ring->buf_tail & (UDP_RING_ENTRIES - 1));
+    buf->addr = (uint64_t)(uintptr_t)(base + bid * MAX_UDP_PACKET_SIZE);
+    buf->len = MAX_UDP_PACKET_SIZE - 1;
+    buf->bid = bid;
+    ring->buf_tail++;
+}
+
+// Makes the recycled buffers visible to the kernel
+static void udp_ring_publish(udp_ring *ring) {
+    __atomic_store_n(&ring->bufs->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Submits a multishot recvmsg on the UDP socket. It keeps
+ * completing until it fails, or runs out of buffers.
+ * @return 0 on success.
+ */
+static int udp_ring_arm(udp_ring *ring, int udp_fd) {
+    unsigned tail = *ring->sq_tail;
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = ring->sqes + idx;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = udp_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&ring->msg;
+    sqe->len = 1;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return (sys_io_uring_enter(ring->fd, 1) == 1) ? 0 : -1;
+}
+
+/**
+ * Switches a worker back to receiving UDP with recvmmsg,
+ * used if the kernel cannot do multishot receives.
+ */
+static void udp_ring_fallback(worker_ev_userdata *worker) {
+    if (worker->worker_id == 0) {
+        syslog(LOG_WARNING, "Failed to receive UDP with io_uring, using recvmmsg instead.");
+    }
+    ev_io_stop(worker->loop, &worker->udp_ring->watcher);
+    destroy_udp_ring(worker->udp_ring);
+    worker->udp_ring = NULL;
+    ev_io_start(worker->loop, &worker->udp_client);
+}
+
+/**
+ * Sets up an io_uring to receive from the UDP socket of a
+ * worker, using the datagram slots of the connection buffer
+ * as the provided buffers.
+ * @arg conn The connection of the UDP socket
+ * @arg udp_fd The UDP socket
+ * @return 0 on success.
+ */
+static int setup_udp_ring(worker_ev_userdata *worker, conn_info *conn, int udp_fd) {
+    struct io_uring_params params;
+    bzero(&params, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = UDP_RING_ENTRIES * 4;
+    int fd = sys_io_uring_setup(4, &params);
+    if (fd < 0) {
+        syslog(LOG_WARNING, "Failed to setup io_uring! Err: %s", strerror(errno));
+        return 1;
+    }
+
+    udp_ring *ring = calloc(1, sizeof(udp_ring));
+    ring->fd = fd;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        syslog(LOG_WARNING, "The kernel io_uring is too old, using recvmmsg.");
+        destroy_udp_ring(ring);
+        return 1;
+    }
+
+    // Map the rings, and the ring of provided buffers
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->bufs_size = UDP_RING_ENTRIES * sizeof(struct io_uring_buf);
+    void *sq_ring = mmap(NULL, ring->ring_size, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void *sqes = mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    void *bufs = mmap(NULL, ring->bufs_size, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    ring->sq_ring = (sq_ring == MAP_FAILED) ? NULL : sq_ring;
+    ring->sqes = (sqes == MAP_FAILED) ? NULL : sqes;
+    ring->bufs = (bufs == MAP_FAILED) ? NULL : bufs;
+    if (!ring->sq_ring || !ring->sqes || !ring->bufs) {
+        syslog(LOG_WARNING, "Failed to map io_uring! Err: %s", strerror(errno));
+        destroy_udp_ring(ring);
+        return 1;
+    }
+
+    char *base = ring->sq_ring;
+    ring->sq_head = (unsigned*)(base + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(base + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(base + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(base + params.sq_off.array);
+    ring->cq_head = (unsigned*)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(base + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+
+    // Register the datagram slots as provided buffers
+    struct io_uring_buf_reg reg;
+    bzero(&reg, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->bufs;
+    reg.ring_entries = UDP_RING_ENTRIES;
+    reg.bgid = 0;
+    if (sys_io_uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+        syslog(LOG_WARNING, "Failed to register io_uring buffers! Err: %s", strerror(errno));
+        destroy_udp_ring(ring);
         return 1;
     }
+    for (int i=0; i < UDP_RING_ENTRIES; i++) {
+        udp_ring_recycle(ring, conn->input.buffer, i);
+    }
+    udp_ring_publish(ring);
 
-    // Update the write cursor
-    circbuf_advance_write(&conn->input, read_bytes);
+    // Each buffer starts with a header, then the control messages
+#ifdef HAVE_UDP_CONTROL
+    ring->msg.msg_controllen = UDP_CONTROL_SIZE;
+#endif
+    if (udp_ring_arm(ring, udp_fd)) {
+        syslog(LOG_WARNING, "Failed to submit to io_uring! Err: %s", strerror(errno));
+        destroy_udp_ring(ring);
+        return 1;
+    }
+
+    // Reap the completions when the ring is readable
+    ev_io_init(&ring->watcher, handle_udp_ring, fd, EV_READ);
+    ring->watcher.data = conn;
+    ev_io_start(worker->loop, &ring->watcher);
+    worker->udp_ring = ring;
     return 0;
 }
 
-
 /**
- * Invoked when a UDP connection has a message ready to be read.
- * We need to take care to add the data to our buffers, and then
- * invoke the connection handlers who have the business logic
- * of what to do.
+ * Invoked when the io_uring of a worker has completions. Each
+ * completion is a datagram in one of the provided buffers, which
+ * is handled in place and then given back to the kernel.
  */
-static void handle_udp_message(ev_io *watch, int ready_events) {
-    while (1) {
-        // Get the associated connection struct
-        conn_info *conn = watch->data;
-
-        // Clear the input buffer
-        circbuf_clear(&conn->input);
-
-        // Build the IO vectors to perform the read
-        struct iovec vectors[2];
-        int num_vectors;
-        circbuf_setup_readv_iovec(&conn->input, (struct iovec*)&vectors, &num_vectors);
-
-        /*
-         * Issue the read, always use the first vector.
-         * since we just cleared the buffer, and it should
-         * be a contiguous buffer.
-         */
-        assert(num_vectors == 1);
-        ssize_t read_bytes = recv(watch->fd, vectors[0].iov_base,
-                                    vectors[0].iov_len, 0);
-
-        // Make sure we actually read something
-        if (read_bytes == 0) {
-            syslog(LOG_DEBUG, "Got empty UDP packet. [%d]\n", watch->fd);
-            return;
-
-        } else if (read_bytes == -1) {
-            if (errno != EAGAIN && errno != EINTR) {
-                syslog(LOG_ERR, "Failed to recv() from connection [%d]! %s.",
-                        watch->fd, strerror(errno));
-            }
-            return;
+static void handle_udp_ring(struct ev_loop *loop, ev_io *watch, int ready_events) {
+    conn_info *conn = watch->data;
+    worker_ev_userdata *worker = ev_userdata(loop);
+    udp_ring *ring = worker->udp_ring;
+    statsite_conn_handler handle = {worker->netconf->config, conn, worker->worker_id};
+
+    int rearm = 0, unsupported = 0;
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = ring->cqes + (head & *ring->cq_mask);
+
+        // The receive stops on errors, or once the buffers run out
+        if (!(cqe->flags & IORING_CQE_F_MORE)) rearm = 1;
+        if (cqe->res < 0) {
+            if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)
+                unsupported = 1;
+            else if (cqe->res != -ENOBUFS)
+                syslog(LOG_ERR, "Failed to receive from io_uring [%d]! %s.",
+                        worker->udp_client.fd, strerror(-cqe->res));
+            continue;
         }
+        if (!(cqe->flags & IORING_CQE_F_BUFFER)) continue;
+
+        // The buffer holds a header, the control messages and the datagram
+        uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        char *buf = conn->input.buffer + bid * MAX_UDP_PACKET_SIZE;
+        struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out*)buf;
+        char *control = buf + sizeof(*out) + ring->msg.msg_namelen;
+        char *start = control + ring->msg.msg_controllen;
+        struct msghdr hdr = {.msg_control = control, .msg_controllen = out->controllen};
+#ifdef HAVE_RXQ_OVFL
+        if (out->controllen) check_udp_drops(conn, &handle, &hdr);
+#endif
+        if (out->flags & MSG_TRUNC) {
+            syslog(LOG_WARNING, "Dropped a truncated UDP packet of %u bytes. [%d]",
+                    out->payloadlen, worker->udp_client.fd);
+        } else if (out->payloadlen == 0) {
+            syslog(LOG_DEBUG, "Got empty UDP packet. [%d]\n", worker->udp_client.fd);
+        } else {
+            handle_udp_segments(&handle, conn, start, out->payloadlen, udp_segment_size(&hdr));
+        }
+        udp_ring_recycle(ring, conn->input.buffer, bid);
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    udp_ring_publish(ring);
 
-        // Update the write cursor
-        circbuf_advance_write(&conn->input, read_bytes);
-
-        // UDP clients don't need to append newlines to the messages like
-        // TCP clients do, but our parser requires them.  Append one if
-        // it's not present.
-        if (conn->input.buffer[conn->input.write_cursor - 1] != '\n')
-            circbuf_write(&conn->input, "\n", 1);
-
-        // Get the user data
-        worker_ev_userdata *data = ev_userdata();
+    // Reset the cursors, discarding any partial commands
+    circbuf_clear(&conn->input);
 
-        // Invoke the connection handler
-        statsite_conn_handler handle = {data->netconf->config, watch->data};
-        handle_client_connect(&handle);
+    // Start receiving again, or go back to recvmmsg
+    if (unsupported || (rearm && udp_ring_arm(ring, worker->udp_client.fd))) {
+        udp_ring_fallback(worker);
     }
 }
+#endif
 
 
 /**
@@ -478,24 +2151,68 @@ static void handle_udp_message(ev_io *watch, int ready_events) {
  * stack should be handled here, but otherwise we should defer
  * to the connection handlers.
  */
-static void invoke_event_handler(ev_io *watcher, int ready_events) {
+static void invoke_event_handler(struct ev_loop *loop, ev_io *watcher, int ready_events) {
     // Get the user data
-    worker_ev_userdata *data = ev_userdata();
+    worker_ev_userdata *worker = ev_userdata(loop);
 
-    // Read in the data, and close on issues
+    // Read in the data and handle it, until the socket is drained
+    // or the budget is used, and close on issues
     conn_info *conn = watcher->data;
-    if (read_client_data(conn)) {
-        close_client_connection(conn);
-        return;
-    }
+    statsite_conn_handler handle = {worker->netconf->config, watcher->data, worker->worker_id};
+    size_t budget = STREAM_WAKEUP_BYTES;
+    int more;
+    do {
+        if (read_client_data(conn, &budget, &more)) {
+            close_client_connection(conn);
+            return;
+        }
 
-    // Invoke the connection handler, and close connection on error
-    statsite_conn_handler handle = {data->netconf->config, watcher->data};
-    if (handle_client_connect(&handle))
-        close_client_connection(conn);
+        // Invoke the connection handler, and close connection on error
+        if (handle_client_connect(&handle)) {
+            close_client_connection(conn);
+            return;
+        }
+    } while (more && budget);
+
+    // Give back memory left over from a burst
+    conn_shrink_buf(conn);
+}
+
+
+/**
+ * Runs the loop of a worker without sleeping while it has input,
+ * and for up to BUSY_POLL_US after the last of it.
+ */
+static void spin_loop(worker_ev_userdata *worker, int *should_run) {
+    double idle_since = 0;
+    while (likely(*should_run)) {
+        ev_run(worker->loop, EVRUN_NOWAIT);
+        if (worker->had_events) {
+            idle_since = 0;
+            continue;
+        }
+        double now = monotonic_now();
+        if (!idle_since) idle_since = now;
+        else if ((now - idle_since) * 1e6 >= BUSY_POLL_US) break;
+    }
 }
 
 
+/**
+ * Runs the event loop of a worker until we
+ * are told to halt.
+ */
+static void* worker_main(void *arg) {
+    worker_ev_userdata *worker = arg;
+    int *should_run = worker->netconf->should_run;
+    cpu_pin_thread(worker->netconf->config->worker_cpus, worker->worker_id);
+    while (likely(*should_run)) {
+        if (BUSY_POLL_US) spin_loop(worker, should_run);
+        ev_run(worker->loop, EVRUN_ONCE);
+    }
+    return NULL;
+}
+
 /**
  * Entry point for main thread to enter the networking
  * stack. This method blocks indefinitely until the
@@ -505,17 +2222,21 @@ static void invoke_event_handler(ev_io *watcher, int ready_events) {
  * shutdown should be started
  */
 void enter_networking_loop(statsite_networking *netconf, int *should_run) {
-    // Allocate our user data
-    worker_ev_userdata data;
-    data.netconf = netconf;
-
-    // Set the user data to be for this thread
-    ev_set_userdata(&data);
-
-    // Run forever until we are told to halt
-    while (likely(*should_run)) {
-        ev_run(EVRUN_ONCE);
+    netconf->should_run = should_run;
+
+    // Start the extra workers with all signals blocked,
+    // so that signals are handled by the main thread
+    sigset_t all_signals, old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+    for (int i=1; i < netconf->num_workers; i++) {
+        worker_ev_userdata *worker = netconf->workers+i;
+        pthread_create(&worker->thread, NULL, worker_main, worker);
     }
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+    // Run the first worker on this thread
+    worker_main(netconf->workers);
     return;
 }
 
@@ -525,31 +2246,45 @@ void enter_networking_loop(statsite_networking *netconf, int *should_run) {
  * @arg netconf The config for the networking stack.
  */
 int shutdown_networking(statsite_networking *netconf) {
-    // Stop listening for new connections
-    if (ev_is_active(&netconf->tcp_client)) {
-        ev_io_stop(&netconf->tcp_client);
-        close(netconf->tcp_client.fd);
+    // Wake and wait for the extra workers
+    worker_ev_userdata *worker;
+    for (int i=1; i < netconf->num_workers; i++) {
+        worker = netconf->workers+i;
+        ev_async_send(worker->loop, &worker->wakeup);
+        pthread_join(worker->thread, NULL);
     }
-    if (ev_is_active(&netconf->udp_client)) {
-        ev_io_stop(&netconf->udp_client);
-        close(netconf->udp_client.fd);
+
+    // Stop listening for new connections
+    for (int i=0; i < netconf->num_workers; i++) {
+        stop_worker_listeners(netconf->workers+i);
     }
+    close_unix_listeners(netconf);
+    close_shm_listener(netconf);
+    close_xdp_listener(netconf);
     if (netconf->stdin_client != NULL) {
         close_client_connection(netconf->stdin_client);
         netconf->stdin_client = NULL;
     }
 
     // Stop the other timers
-    ev_timer_stop(&netconf->flush_timer);
+    ev_timer_stop(netconf->workers[0].loop, &netconf->flush_timer);
 
     // TODO: Close all the client connections
     // ??? For now, we just leak the memory
     // since we are shutdown down anyways...
 
-    // Free the event loop
-    ev_loop_destroy(EV_DEFAULT);
+    // Free the pooled connections and the event loops
+    for (int i=0; i < netconf->num_workers; i++) {
+        free_conn_pool(netconf->workers+i);
+        ev_loop_destroy(netconf->workers[i].loop);
+        if (netconf->workers[i].client_rates) {
+            destroy_rate_table(netconf->workers[i].client_rates);
+            free(netconf->workers[i].client_rates);
+        }
+    }
 
     // Free the netconf
+    free(netconf->workers);
     free(netconf);
     return 0;
 }
@@ -569,15 +2304,37 @@ int shutdown_networking(statsite_networking *netconf) {
  */
 void close_client_connection(conn_info *conn) {
     // Stop the libev clients
-    ev_io_stop(&conn->client);
+    ev_io_stop(conn->loop, &conn->client);
+    ev_timer_stop(conn->loop, &conn->resume);
 
-    // Clear everything out
-    circbuf_free(&conn->input);
+    // Stop counting the buffer
+    if (conn->limited) __sync_sub_and_fetch(CONN_BYTES(conn), conn->input.buf_size);
 
     // Close the fd
     syslog(LOG_DEBUG, "Closed connection. [%d]", conn->client.fd);
     close(conn->client.fd);
-    free(conn);
+
+    // Release the state of the connection handler
+    if (conn->state) {
+        free_client_state(conn->state);
+        conn->state = NULL;
+    }
+
+    // Return the connection to the pool
+    put_conn(conn);
+}
+
+
+/**
+ * Returns the slot where the connection handler can keep state
+ * of its own for a client. It starts as NULL, and is released
+ * with free_client_state when the connection is closed.
+ * @arg conn The client connection
+ * @return The slot, or NULL for UDP sockets, which are shared
+ * by all the clients that send to them.
+ */
+void** client_state(conn_info *conn) {
+    return (conn->datagram) ? NULL : &conn->state;
 }
 
 
@@ -597,17 +2354,22 @@ void close_client_connection(conn_info *conn) {
  * @return 0 on success, -1 if the terminator is not found.
  */
 int extract_to_terminator(statsite_conn_info *conn, char terminator, char **buf, int *buf_len, int *should_free) {
-    // First we need to find the terminator...
+    // First we need to find the terminator, past the bytes
+    // that an earlier call already scanned
     char *term_addr = NULL;
-    if (unlikely(conn->input.write_cursor < conn->input.read_cursor)) {
+    int scanned = conn->input.scanned;
+    if (unlikely(CIRCBUF_SPLIT(&conn->input))) {
         /*
          * We need to scan from the read cursor to the end of
          * the buffer, and then from the start of the buffer to
          * the write cursor.
         */
-        term_addr = memchr(conn->input.buffer+conn->input.read_cursor,
-                           terminator,
-                           conn->input.buf_size - conn->input.read_cursor);
+        int end_size = conn->input.buf_size - conn->input.read_cursor;
+        if (scanned < end_size) {
+            term_addr = memchr(conn->input.buffer+conn->input.read_cursor+scanned,
+                               terminator,
+                               end_size - scanned);
+        }
 
         // If we've found the terminator, we can just move up
         // the read cursor
@@ -623,9 +2385,10 @@ int extract_to_terminator(statsite_conn_info *conn, char terminator, char **buf,
         }
 
         // Wrap around
-        term_addr = memchr(conn->input.buffer,
+        int wrapped = (scanned > end_size) ? scanned - end_size : 0;
+        term_addr = memchr(conn->input.buffer + wrapped,
                            terminator,
-                           conn->input.write_cursor);
+                           conn->input.write_cursor - wrapped);
 
         // If we've found the terminator, we need to allocate
         // a contiguous buffer large enough to store everything
@@ -650,10 +2413,11 @@ int extract_to_terminator(statsite_conn_info *conn, char terminator, char **buf,
     } else {
         /*
          * We need to scan from the read cursor to write buffer.
+         * If the buffer is mirrored, this may continue into the mirror.
          */
-        term_addr = memchr(conn->input.buffer+conn->input.read_cursor,
+        term_addr = memchr(conn->input.buffer+conn->input.read_cursor+scanned,
                            terminator,
-                           conn->input.write_cursor - conn->input.read_cursor);
+                           circbuf_used_buf(&conn->input) - scanned);
 
         // If we've found the terminator, we can just move up
         // the read cursor
@@ -662,7 +2426,9 @@ int extract_to_terminator(statsite_conn_info *conn, char terminator, char **buf,
             *buf_len = term_addr - *buf + 1; // Difference between the terminator and location
             *term_addr = '\0';               // Add a null terminator
             *should_free = 0;                // No need to free, in the buffer
-            conn->input.read_cursor = term_addr - conn->input.buffer + 1; // Push the read cursor forward
+
+            // Push the read cursor forward
+            conn->input.read_cursor = (term_addr - conn->input.buffer + 1) % conn->input.buf_size;
         }
     }
 
@@ -674,10 +2440,50 @@ int extract_to_terminator(statsite_conn_info *conn, char terminator, char **buf,
         conn->input.write_cursor = 0;
     }
 
+    // The next scan starts after the bytes scanned so far
+    conn->input.scanned = (term_addr) ? 0 : circbuf_used_buf(&conn->input);
+
     // Return success if we have a term address
     return ((term_addr) ? 0 : -1);
 }
 
+/**
+ * Records that the bytes at the head of the input buffer
+ * have no terminator, so extract_to_terminator can start
+ * scanning after them. The mark is dropped once input is
+ * consumed.
+ * @arg conn The client connection
+ * @arg bytes The number of bytes without a terminator
+ */
+void mark_client_scanned(statsite_conn_info *conn, int bytes) {
+    if (bytes > conn->input.scanned && bytes <= circbuf_used_buf(&conn->input))
+        conn->input.scanned = bytes;
+}
+
+/**
+ * Returns the number of bytes at the head of the input buffer
+ * known to have no terminator, from mark_client_scanned or a
+ * failed extract_to_terminator.
+ * @arg conn The client connection
+ */
+int client_scanned_bytes(statsite_conn_info *conn) {
+    return conn->input.scanned;
+}
+
+/**
+ * Drops the buffered input, and the input that follows up to
+ * and including the next terminator. This is used to skip a
+ * command that is too long to be handled, without growing the
+ * buffer to hold it.
+ * @arg conn The client connection
+ * @arg terminator The terminator that ends the command
+ */
+void discard_to_terminator(statsite_conn_info *conn, char terminator) {
+    circbuf_clear(&conn->input);
+    conn->discarding = 1;
+    conn->discard_to = terminator;
+}
+
 
 /**
  * This method is used to query how much data is available
@@ -716,7 +2522,7 @@ int peek_client_bytes(statsite_conn_info *conn, int bytes, char** buf, int* shou
     if (unlikely(bytes > circbuf_used_buf(&conn->input))) return -1;
 
     // Handle the wrap around case
-    if (unlikely(conn->input.write_cursor < conn->input.read_cursor)) {
+    if (unlikely(CIRCBUF_SPLIT(&conn->input))) {
         // Check if we can use a contiguous chunk
         int end_size = conn->input.buf_size - conn->input.read_cursor;
         if (end_size >= bytes) {
@@ -740,6 +2546,27 @@ int peek_client_bytes(statsite_conn_info *conn, int bytes, char** buf, int* shou
     return 0;
 }
 
+/**
+ * Provides the bytes at the head of the input buffer that are
+ * contiguous in memory, without consuming them. If the buffer
+ * wraps around, only the bytes up to the end are provided. It
+ * can be used in conjunction with seek_client_bytes to consume
+ * what was handled.
+ * @arg conn The client connection
+ * @arg buf Output parameter, sets the start of the buffer.
+ * @arg buf_len Output parameter, the number of contiguous bytes.
+ * @return 0 on success, -1 if there is no data.
+ */
+int peek_client_contiguous(statsite_conn_info *conn, char **buf, int *buf_len) {
+    if (unlikely(!circbuf_used_buf(&conn->input))) return -1;
+    *buf = conn->input.buffer + conn->input.read_cursor;
+    if (unlikely(CIRCBUF_SPLIT(&conn->input)))
+        *buf_len = conn->input.buf_size - conn->input.read_cursor;
+    else
+        *buf_len = circbuf_used_buf(&conn->input);
+    return 0;
+}
+
 /**
  * This method is used to seek the input buffer without
  * consuming input. It can be used in conjunction with
@@ -767,7 +2594,7 @@ int read_client_bytes(statsite_conn_info *conn, int bytes, char** buf, int* shou
     if (unlikely(bytes > circbuf_used_buf(&conn->input))) return -1;
 
     // Handle the wrap around case
-    if (unlikely(conn->input.write_cursor < conn->input.read_cursor)) {
+    if (unlikely(CIRCBUF_SPLIT(&conn->input))) {
         // Check if we can use a contiguous chunk
         int end_size = conn->input.buf_size - conn->input.read_cursor;
         if (end_size >= bytes) {
@@ -798,7 +2625,8 @@ int read_client_bytes(statsite_conn_info *conn, int bytes, char** buf, int* shou
  * Sets the client socket options.
  * @return 0 on success, 1 on error.
  */
-static int set_client_sockopts(int client_fd) {
+static int set_client_sockopts(int client_fd, int tcp) {
+#ifndef HAVE_ACCEPT4
     // Setup the socket to be non-blocking
     int sock_flags = fcntl(client_fd, F_GETFL, 0);
     if (sock_flags < 0) {
@@ -811,11 +2639,13 @@ static int set_client_sockopts(int client_fd) {
         close(client_fd);
         return 1;
     }
+#endif
 
     /**
      * Set TCP_NODELAY. This will allow us to send small response packets more
      * quickly, since our responses are rarely large enough to consume a packet.
      */
+    if (!tcp) return 0;
     int flag = 1;
     if (setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int))) {
         syslog(LOG_WARNING, "Failed to set TCP_NODELAY on connection! %s.", strerror(errno));
@@ -825,48 +2655,428 @@ static int set_client_sockopts(int client_fd) {
     if(setsockopt(client_fd, SOL_SOCKET, SO_KEEPALIVE, &flag, sizeof(int))) {
         syslog(LOG_WARNING, "Failed to set SO_KEEPALIVE on connection! %s.", strerror(errno));
     }
+    set_busy_poll(client_fd);
+    return 0;
+}
+
+
+/**
+ * Sets a socket to busy poll its device queue for BUSY_POLL_US,
+ * if enabled. A failure is only logged the first time, and the
+ * socket works without it.
+ */
+static void set_busy_poll(int fd) {
+#ifdef HAVE_BUSY_POLL
+    if (!BUSY_POLL_US) return;
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &BUSY_POLL_US, sizeof(int)) &&
+            !__atomic_exchange_n(&BUSY_POLL_WARNED, 1, __ATOMIC_RELAXED)) {
+        syslog(LOG_WARNING, "Failed to set SO_BUSY_POLL! Err: %s", strerror(errno));
+    }
+
+    // Kernels before 5.11 lack it, and busy poll without
+    int optval = 1;
+    setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &optval, sizeof(optval));
+#else
+    (void)fd;
+#endif
+}
+
+
+/**
+ * Sets SO_REUSEPORT on a listener socket when there
+ * are multiple workers, so that each worker can bind
+ * its own socket and the kernel spreads the load.
+ * @return 0 on success, 1 on error.
+ */
+static int set_reuse_port(worker_ev_userdata *worker, int listen_fd) {
+    if (worker->netconf->num_workers == 1) return 0;
+#ifdef SO_REUSEPORT
+    int optval = 1;
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval))) {
+        syslog(LOG_ERR, "Failed to set SO_REUSEPORT! Err: %s", strerror(errno));
+        return 1;
+    }
+    return 0;
+#else
+    syslog(LOG_ERR, "Multiple worker threads require SO_REUSEPORT support!");
+    return 1;
+#endif
+}
+
+#ifdef HAVE_DROP_FILTER
+// A rule of the ingest filter, see config->filters
+typedef struct {
+    char *prefix;
+    int len;
+    uintptr_t action;
+} drop_rule;
+
+typedef struct {
+    drop_rule *rules;
+    int num;
+    int size;
+} drop_rules;
+
+static int collect_drop_rule(void *data, char *key, void *value) {
+    drop_rules *r = data;
+    if (r->num == r->size) {
+        r->size = r->size ? r->size * 2 : 16;
+        r->rules = realloc(r->rules, r->size * sizeof(drop_rule));
+    }
+    r->rules[r->num++] = (drop_rule){key, strlen(key), (uintptr_t)value};
+    return 0;
+}
+
+// Orders the rules longest first
+static int cmp_drop_rules(const void *a, const void *b) {
+    return ((drop_rule*)b)->len - ((drop_rule*)a)->len;
+}
 
+// Checks if a rule changes the outcome, an allowed prefix only does under a dropped one
+static int drop_rule_needed(drop_rules *r, drop_rule *rule) {
+    if (rule->action == FILTER_DROP) return 1;
+    for (int i=0; i < r->num; i++) {
+        drop_rule *d = r->rules + i;
+        if (d->action == FILTER_DROP && d->len < rule->len &&
+                !memcmp(d->prefix, rule->prefix, d->len)) return 1;
+    }
     return 0;
 }
 
+/**
+ * Compiles the ingest filter into a socket filter, which decides
+ * on the first key of each datagram. The rules are tried longest
+ * first, so the first that matches is the longest prefix, as in
+ * key_filtered, and drops or passes the datagram. The datagrams
+ * that match no rule are passed.
+ * @arg filters The radix tree of the ingest filter
+ * @arg prog Output, the program. The caller frees its instructions.
+ * @return 0 on success, -1 if the rules do not fit in a program.
+ */
+static int build_drop_filter(radix_tree *filters, struct sock_fprog *prog) {
+    drop_rules r = {NULL, 0, 0};
+    radix_foreach(filters, &r, collect_drop_rule);
+    qsort(r.rules, r.num, sizeof(drop_rule), cmp_drop_rules);
+
+    struct sock_filter *insns = malloc(BPF_MAXINSNS * sizeof(struct sock_filter));
+    int n = 0, res = 0;
+    for (int i=0; i < r.num; i++) {
+        drop_rule *rule = r.rules + i;
+        if (!drop_rule_needed(&r, rule)) continue;
+
+        // Each rule takes a length check, a load and compare per 4 bytes, and a return
+        if (rule->len > DROP_FILTER_MAX_PREFIX ||
+                n + 2 * (rule->len / 4 + 2) + 4 > BPF_MAXINSNS) {
+            res = -1;
+            break;
+        }
+        int start = n;
+        insns[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0);
+        insns[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K,
+                DROP_FILTER_PAYLOAD + rule->len, 0, 0);
+        for (int off=0; off < rule->len;) {
+            int left = rule->len - off;
+            int size = left >= 4 ? 4 : (left >= 2 ? 2 : 1);
+            uint32_t val = 0;
+            for (int b=0; b < size; b++) val = (val << 8) | (uint8_t)rule->prefix[off + b];
+            int mode = size == 4 ? BPF_W : (size == 2 ? BPF_H : BPF_B);
+            insns[n++] = (struct sock_filter)BPF_STMT(BPF_LD | mode | BPF_ABS, DROP_FILTER_PAYLOAD + off);
+            insns[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, val, 0, 0);
+            off += size;
+        }
+        insns[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+                rule->action == FILTER_DROP ? 0 : 0xffffffff);
+
+        // A mismatch skips to the next rule
+        for (int j=start; j < n; j++) {
+            if (BPF_CLASS(insns[j].code) == BPF_JMP) insns[j].jf = n - j - 1;
+        }
+    }
+    insns[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+    free(r.rules);
+    prog->len = n;
+    prog->filter = insns;
+    return res;
+}
+
+/**
+ * Attaches the ingest filter to a UDP listener
+ * @arg worker The worker that owns the listener
+ * @arg udp_fd The UDP socket
+ */
+static void set_udp_drop_filter(worker_ev_userdata *worker, int udp_fd) {
+    struct sock_fprog prog;
+    if (build_drop_filter(worker->netconf->config->filters, &prog)) {
+        if (worker->worker_id == 0)
+            syslog(LOG_WARNING, "The drop prefixes are too long or too many to filter in the kernel.");
+    } else if (prog.len > 1 &&
+            setsockopt(udp_fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog))) {
+        syslog(LOG_WARNING, "Failed to set SO_ATTACH_FILTER! Err: %s", strerror(errno));
+    }
+    free(prog.filter);
+}
+#endif
+
+/**
+ * Sets the receive buffer size of a UDP listener, and
+ * enables reporting of the datagrams dropped when it is full.
+ * Failures are only logged, the listener works without these.
+ * @arg worker The worker that owns the listener
+ * @arg udp_fd The UDP socket
+ * @arg size The size of the receive buffer, or 0 for the default
+ * @arg report Should the size of the buffer be logged
+ */
+static void set_udp_sockopts(worker_ev_userdata *worker, int udp_fd, int size, int report) {
+    statsite_config *config = worker->netconf->config;
+    if (size) {
+        // Forcing the size bypasses rmem_max, but needs CAP_NET_ADMIN
+        int res = -1;
+#ifdef SO_RCVBUFFORCE
+        res = setsockopt(udp_fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size));
+#endif
+        if (res && setsockopt(udp_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size))) {
+            syslog(LOG_WARNING, "Failed to set SO_RCVBUF! Err: %s", strerror(errno));
+        }
+
+        // Linux reports double the size, to account for its overhead
+        int actual = 0;
+        socklen_t len = sizeof(actual);
+        getsockopt(udp_fd, SOL_SOCKET, SO_RCVBUF, &actual, &len);
+        if (report) {
+            if (actual < size)
+                syslog(LOG_WARNING, "UDP receive buffer is %d bytes, less than \
+the %d requested. Check net.core.rmem_max.", actual, size);
+            else
+                syslog(LOG_INFO, "UDP receive buffer is %d bytes.", actual);
+        }
+    }
+
+#ifdef HAVE_RXQ_OVFL
+    int optval = 1;
+    if (config->udp_drop_counter &&
+            setsockopt(udp_fd, SOL_SOCKET, SO_RXQ_OVFL, &optval, sizeof(optval))) {
+        syslog(LOG_WARNING, "Failed to set SO_RXQ_OVFL! Err: %s", strerror(errno));
+    }
+#else
+    if (config->udp_drop_counter && worker->worker_id == 0) {
+        syslog(LOG_WARNING, "Counting dropped datagrams is not supported on this platform.");
+    }
+#endif
+
+#ifdef HAVE_DROP_FILTER
+    if (config->udp_drop_filter && config->filters) set_udp_drop_filter(worker, udp_fd);
+#else
+    if (config->udp_drop_filter && worker->worker_id == 0) {
+        syslog(LOG_WARNING, "Filtering datagrams in the kernel is not supported on this platform.");
+    }
+#endif
+
+    set_busy_poll(udp_fd);
+
+    // The socket filter would only see the first datagram of a coalesced message
+#ifdef HAVE_UDP_GRO
+    int gro = 1;
+    if (config->udp_gro && !config->udp_drop_filter &&
+            setsockopt(udp_fd, IPPROTO_UDP, UDP_GRO, &gro, sizeof(gro))) {
+        syslog(LOG_WARNING, "Failed to set UDP_GRO! Err: %s", strerror(errno));
+    }
+#endif
+}
+
 
 /**
  * Returns the conn_info* object associated with the FD
  * or allocates a new one as necessary.
+ * @arg loop The event loop the connection belongs to
  */
-static conn_info* get_conn() {
-    // Allocate space
-    conn_info *conn = malloc(sizeof(conn_info));
-
-    // Prepare the buffers
-    circbuf_init(&conn->input);
+static conn_info* get_conn(struct ev_loop *loop) {
+    // Re-use a pooled connection and its buffer if possible
+    worker_ev_userdata *worker = ev_userdata(loop);
+    conn_info *conn = worker->free_conns;
+    if (conn) {
+        worker->free_conns = conn->next;
+        worker->num_free_conns--;
+        circbuf_clear(&conn->input);
+    } else {
+        conn = malloc(sizeof(conn_info));
+        circbuf_init(&conn->input);
+    }
+    conn->loop = loop;
+    conn->limited = 0;
+    conn->paused = 0;
+    conn->datagram = 0;
+    conn->discarding = 0;
+    conn->rate_limited = 0;
+    conn->priority = 0;
+    conn->state = NULL;
+    conn->next = NULL;
+
+    // Prepare the timer used to resume paused reads
+    ev_timer_init(&conn->resume, handle_resume, CONN_PAUSE_INTERVAL, 0);
+    conn->resume.data = conn;
 
     // Store a reference to the conn object
     conn->client.data = conn;
     return conn;
 }
 
+/**
+ * Returns a closed connection to the pool of its worker,
+ * or frees it if the pool is full. Only connections with
+ * a buffer of the initial size are kept, so the pool holds
+ * a bounded amount of memory.
+ * @arg conn The connection to release
+ */
+static void put_conn(conn_info *conn) {
+    worker_ev_userdata *worker = ev_userdata(conn->loop);
+    if (worker->num_free_conns < CONN_POOL_SIZE &&
+            conn->input.buffer && conn->input.buf_size == INIT_CONN_BUF_SIZE) {
+        conn->next = worker->free_conns;
+        worker->free_conns = conn;
+        worker->num_free_conns++;
+        return;
+    }
+    circbuf_free(&conn->input);
+    free(conn);
+}
+
+/**
+ * Frees all the pooled connections of a worker
+ * @arg worker The worker to free the pool of
+ */
+static void free_conn_pool(worker_ev_userdata *worker) {
+    conn_info *conn;
+    while ((conn = worker->free_conns)) {
+        worker->free_conns = conn->next;
+        circbuf_free(&conn->input);
+        free(conn);
+    }
+    worker->num_free_conns = 0;
+}
+
+/**
+ * Bounds the buffer of a client connection by the maximum
+ * size, and counts it against the buffer memory budget.
+ * @arg conn The connection to limit
+ */
+static void limit_conn(conn_info *conn) {
+    conn->limited = 1;
+    __sync_add_and_fetch(CONN_BYTES(conn), conn->input.buf_size);
+}
+
+/**
+ * Grows the buffer of a connection, if it is within
+ * the maximum size and the buffer memory budget.
+ * @return 0 if grown, -1 if over a limit.
+ */
+static int conn_grow_buf(conn_info *conn) {
+    if (conn->limited) {
+        uint32_t old_size = conn->input.buf_size;
+        uint32_t new_size = old_size * CONN_BUF_MULTIPLIER;
+        if (new_size > MAX_CONN_BUFFER) return -1;
+
+        // Reserve the extra memory, undo if it goes over the budget
+        uint64_t budget = (conn->priority) ? PRIORITY_BUFFER_BUDGET : CONN_BUFFER_BUDGET;
+        uint64_t total = __sync_add_and_fetch(CONN_BYTES(conn), new_size - old_size);
+        if (budget && total > budget) {
+            __sync_sub_and_fetch(CONN_BYTES(conn), new_size - old_size);
+            return -1;
+        }
+    }
+    circbuf_grow_buf(&conn->input);
+    stats_add(STAT_BUFFER_GROWS, 1);
+    return 0;
+}
+
+/**
+ * Shrinks the buffer of a connection after a burst,
+ * halving it while it would stay less than a quarter used.
+ * @arg conn The connection to shrink
+ */
+static void conn_shrink_buf(conn_info *conn) {
+    uint32_t old_size = conn->input.buf_size;
+    uint32_t new_size = old_size;
+    uint64_t used = circbuf_used_buf(&conn->input);
+    while (new_size > INIT_CONN_BUF_SIZE && used < new_size / CONN_BUF_MULTIPLIER / 4) {
+        new_size /= CONN_BUF_MULTIPLIER;
+    }
+    if (new_size == old_size || !conn->limited) return;
+
+    circbuf_resize_buf(&conn->input, new_size);
+    __sync_sub_and_fetch(CONN_BYTES(conn), old_size - new_size);
+}
+
 /*
  * Methods for manipulating our circular buffers
  */
 
+/**
+ * Allocates the memory for a buffer. On Linux this tries to map
+ * a memfd twice back to back, so the buffer is mirrored. If that
+ * fails, for example once the process hits its limit of mappings,
+ * a plain buffer is allocated instead.
+ * @arg size The size, which must be a multiple of the page size
+ * @arg mirrored Output. Set if the buffer is mirrored
+ * @return The buffer.
+ */
+static char* circbuf_alloc(uint32_t size, int *mirrored) {
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+    int fd = memfd_create("statsite_conn", MFD_CLOEXEC);
+    if (fd >= 0) {
+        char *addr = MAP_FAILED;
+        if (!ftruncate(fd, size)) {
+            // Reserve the address space, then map the pages twice over it
+            addr = mmap(NULL, 2 * (size_t)size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        }
+        if (addr != MAP_FAILED) {
+            if (mmap(addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+                mmap(addr + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+                munmap(addr, 2 * (size_t)size);
+                addr = MAP_FAILED;
+            }
+        }
+        close(fd);
+        if (addr != MAP_FAILED) {
+            stats_mem_add(MEM_BUFFERS, size);
+            *mirrored = 1;
+            return addr;
+        }
+    }
+#endif
+    *mirrored = 0;
+    char *buffer = malloc(size);
+    if (buffer) stats_mem_add(MEM_BUFFERS, size);
+    return buffer;
+}
+
+// Releases the memory of a buffer
+static void circbuf_release(char *buffer, uint32_t size, int mirrored) {
+    stats_mem_add(MEM_BUFFERS, -(int64_t)size);
+    if (mirrored)
+        munmap(buffer, 2 * (size_t)size);
+    else
+        free(buffer);
+}
+
 // Conditionally allocates if there is no buffer
 static void circbuf_init(circular_buffer *buf) {
     buf->read_cursor = 0;
     buf->write_cursor = 0;
+    buf->scanned = 0;
     buf->buf_size = INIT_CONN_BUF_SIZE * sizeof(char);
-    buf->buffer = malloc(buf->buf_size);
+    buf->buffer = circbuf_alloc(buf->buf_size, &buf->mirrored);
 }
 
 // Clears the circular buffer, reseting it.
 static void circbuf_clear(circular_buffer *buf) {
     buf->read_cursor = 0;
     buf->write_cursor = 0;
+    buf->scanned = 0;
 }
 
 // Frees a buffer
 static void circbuf_free(circular_buffer *buf) {
-    if (buf->buffer) free(buf->buffer);
+    if (buf->buffer) circbuf_release(buf->buffer, buf->buf_size, buf->mirrored);
     buf->buffer = NULL;
 }
 
@@ -894,12 +3104,17 @@ static uint64_t circbuf_used_buf(circular_buffer *buf) {
 
 // Grows the circular buffer to make room for more data
 static void circbuf_grow_buf(circular_buffer *buf) {
-    int new_size = buf->buf_size * CONN_BUF_MULTIPLIER * sizeof(char);
-    char *new_buf = malloc(new_size);
+    circbuf_resize_buf(buf, buf->buf_size * CONN_BUF_MULTIPLIER * sizeof(char));
+}
+
+// Moves the used data of a circular buffer into a new buffer of a given size
+static void circbuf_resize_buf(circular_buffer *buf, uint32_t new_size) {
+    int new_mirrored;
+    char *new_buf = circbuf_alloc(new_size, &new_mirrored);
     int bytes_written = 0;
 
     // Check if the write has wrapped around
-    if (buf->write_cursor < buf->read_cursor) {
+    if (CIRCBUF_SPLIT(buf)) {
         // Copy from the read cursor to the end of the buffer
         bytes_written = buf->buf_size - buf->read_cursor;
         memcpy(new_buf,
@@ -915,16 +3130,17 @@ static void circbuf_grow_buf(circular_buffer *buf) {
     // We haven't wrapped yet...
     } else {
         // Copy from the read cursor up to the write cursor
-        bytes_written = buf->write_cursor - buf->read_cursor;
+        bytes_written = circbuf_used_buf(buf);
         memcpy(new_buf,
                buf->buffer + buf->read_cursor,
                bytes_written);
     }
 
     // Update the buffer locations and everything
-    free(buf->buffer);
+    circbuf_release(buf->buffer, buf->buf_size, buf->mirrored);
     buf->buffer = new_buf;
     buf->buf_size = new_size;
+    buf->mirrored = new_mirrored;
     buf->read_cursor = 0;
     buf->write_cursor = bytes_written;
 }
@@ -932,9 +3148,14 @@ static void circbuf_grow_buf(circular_buffer *buf) {
 
 // Initializes a pair of iovectors to be used for readv
 static void circbuf_setup_readv_iovec(circular_buffer *buf, struct iovec *vectors, int *num_vectors) {
-    // Check if we've wrapped around
+    // A mirrored buffer has all the free space after the write cursor
     *num_vectors = 1;
-    if (buf->write_cursor < buf->read_cursor) {
+    if (buf->mirrored) {
+        vectors[0].iov_base = buf->buffer + buf->write_cursor;
+        vectors[0].iov_len = circbuf_avail_buf(buf);
+
+    // Check if we've wrapped around
+    } else if (buf->write_cursor < buf->read_cursor) {
         vectors[0].iov_base = buf->buffer + buf->write_cursor;
         vectors[0].iov_len = buf->read_cursor - buf->write_cursor - 1;
     } else {
@@ -956,6 +3177,7 @@ static void circbuf_advance_write(circular_buffer *buf, uint64_t bytes) {
 
 static void circbuf_advance_read(circular_buffer *buf, uint64_t bytes) {
     buf->read_cursor = (buf->read_cursor + bytes) % buf->buf_size;
+    buf->scanned = 0;
 
     // Optimization, reset the cursors if they catchup with each other
     if (buf->read_cursor == buf->write_cursor) {
@@ -964,6 +3186,7 @@ static void circbuf_advance_read(circular_buffer *buf, uint64_t bytes) {
     }
 }
 
+#ifndef HAVE_RECVMMSG
 /**
  * Writes the data from a given input buffer
  * into the circular buffer.
@@ -999,4 +3222,5 @@ static int circbuf_write(circular_buffer *buf, char *in, uint64_t bytes) {
 
     return 0;
 }
+#endif
 
@@ -40,6 +40,16 @@ int shutdown_networking(statsite_networking *netconf);
  */
 void close_client_connection(statsite_conn_info *conn);
 
+/**
+ * Returns the slot where the connection handler can keep state
+ * of its own for a client. It starts as NULL, and is released
+ * with free_client_state when the connection is closed.
+ * @arg conn The client connection
+ * @return The slot, or NULL for UDP sockets, which are shared
+ * by all the clients that send to them.
+ */
+void** client_state(statsite_conn_info *conn);
+
 /**
  * This method is used to conveniently extract commands from the
  * command buffer. It scans up to a terminator, and then sets the
@@ -57,6 +67,34 @@ void close_client_connection(statsite_conn_info *conn);
  */
 int extract_to_terminator(statsite_conn_info *conn, char terminator, char **buf, int *buf_len, int *should_free);
 
+/**
+ * Records that the bytes at the head of the input buffer
+ * have no terminator, so extract_to_terminator can start
+ * scanning after them. The mark is dropped once input is
+ * consumed.
+ * @arg conn The client connection
+ * @arg bytes The number of bytes without a terminator
+ */
+void mark_client_scanned(statsite_conn_info *conn, int bytes);
+
+/**
+ * Returns the number of bytes at the head of the input buffer
+ * known to have no terminator, from mark_client_scanned or a
+ * failed extract_to_terminator.
+ * @arg conn The client connection
+ */
+int client_scanned_bytes(statsite_conn_info *conn);
+
+/**
+ * Drops the buffered input, and the input that follows up to
+ * and including the next terminator. This is used to skip a
+ * command that is too long to be handled, without growing the
+ * buffer to hold it.
+ * @arg conn The client connection
+ * @arg terminator The terminator that ends the command
+ */
+void discard_to_terminator(statsite_conn_info *conn, char terminator);
+
 /**
  * This method is used to query how much data is available
  * to be read from the command buffer.
@@ -85,6 +123,19 @@ int peek_client_byte(statsite_conn_info *conn, unsigned char* byte);
  */
 int peek_client_bytes(statsite_conn_info *conn, int bytes, char** buf, int* should_free);
 
+/**
+ * Provides the bytes at the head of the input buffer that are
+ * contiguous in memory, without consuming them. If the buffer
+ * wraps around, only the bytes up to the end are provided. It
+ * can be used in conjunction with seek_client_bytes to consume
+ * what was handled.
+ * @arg conn The client connection
+ * @arg buf Output parameter, sets the start of the buffer.
+ * @arg buf_len Output parameter, the number of contiguous bytes.
+ * @return 0 on success, -1 if there is no data.
+ */
+int peek_client_contiguous(statsite_conn_info *conn, char **buf, int *buf_len);
+
 /**
  * This method is used to seek the input buffer without
  * consuming input. It can be used in conjunction with
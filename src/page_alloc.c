@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include "page_alloc.h"
+#include "stats.h"
+
+#define ROUND_UP(x) (((x) + (HUGE_PAGE_SIZE - 1)) & ~((size_t)HUGE_PAGE_SIZE - 1))
+
+static huge_pages_mode MODE = HUGE_PAGES_OFF;
+
+// Set once the explicit pool has run out, so it is only logged once
+static int POOL_EXHAUSTED = 0;
+
+void page_alloc_set_mode(huge_pages_mode mode) {
+    MODE = mode;
+}
+
+huge_pages_mode page_alloc_mode(void) {
+    return MODE;
+}
+
+/**
+ * Maps a buffer aligned to a huge page, so all
+ * of it can be backed by them.
+ */
+static void* map_aligned(size_t len) {
+    char *base = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return NULL;
+
+    // Trim the unaligned head and the tail
+    char *start = (char*)ROUND_UP((uintptr_t)base);
+    if (start > base) munmap(base, start - base);
+    size_t tail = (base + len + HUGE_PAGE_SIZE) - (start + len);
+    if (tail) munmap(start + len, tail);
+    return start;
+}
+
+static void* map_buffer(size_t size) {
+    size_t len = ROUND_UP(size);
+    void *ptr;
+#ifdef MAP_HUGETLB
+    if (MODE == HUGE_PAGES_EXPLICIT && !POOL_EXHAUSTED) {
+        ptr = mmap(NULL, len, PROT_READ|PROT_WRITE,
+                MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED) return ptr;
+        POOL_EXHAUSTED = 1;
+        syslog(LOG_WARNING, "No explicit huge pages left, using transparent ones");
+    }
+#endif
+
+    ptr = map_aligned(len);
+#ifdef MADV_HUGEPAGE
+    if (ptr && MODE != HUGE_PAGES_OFF) madvise(ptr, len, MADV_HUGEPAGE);
+#endif
+    return ptr;
+}
+
+// Maps a buffer, counting the mapped bytes
+static void* map_counted(size_t size) {
+    void *ptr = map_buffer(size);
+    if (ptr) stats_mem_add(MEM_MAPPED, ROUND_UP(size));
+    return ptr;
+}
+
+void* page_alloc(size_t size) {
+    if (size < HUGE_PAGE_SIZE) return malloc(size);
+    return map_counted(size);
+}
+
+void* page_calloc(size_t size) {
+    // Mappings are zeroed already
+    if (size < HUGE_PAGE_SIZE) return calloc(1, size);
+    return map_counted(size);
+}
+
+void page_free(void *ptr, size_t size) {
+    if (!ptr) return;
+    if (size < HUGE_PAGE_SIZE) {
+        free(ptr);
+    } else {
+        munmap(ptr, ROUND_UP(size));
+        stats_mem_add(MEM_MAPPED, -(int64_t)ROUND_UP(size));
+    }
+}
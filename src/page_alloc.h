@@ -0,0 +1,61 @@
+/**
+ * This module allocates the large buffers, such as the hashmap
+ * tables and the chunks of the metrics arena. Those of at least
+ * a huge page are mapped on their own, and can be backed by huge
+ * pages, which cuts the TLB misses of the random lookups into
+ * tables of millions of keys. Smaller buffers come from the heap.
+ *
+ * Transparent huge pages are requested with madvise, and the
+ * kernel falls back to small pages if it has no huge ones, unless
+ * they are disabled in /sys/kernel/mm/transparent_hugepage.
+ * Explicit huge pages come from the pool reserved in
+ * /proc/sys/vm/nr_hugepages, and transparent ones are used from
+ * then on once it runs out. Huge pages are only supported on Linux.
+ */
+#ifndef PAGE_ALLOC_H
+#define PAGE_ALLOC_H
+#include <stddef.h>
+
+// The size of a huge page. Buffers at least this large
+// are mapped, in multiples of it.
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+typedef enum {
+    HUGE_PAGES_OFF,
+    HUGE_PAGES_TRANSPARENT,
+    HUGE_PAGES_EXPLICIT
+} huge_pages_mode;
+
+/**
+ * Sets the huge pages of the buffers mapped
+ * from now on. Off by default.
+ */
+void page_alloc_set_mode(huge_pages_mode mode);
+
+/**
+ * Returns the huge pages of the buffers
+ */
+huge_pages_mode page_alloc_mode(void);
+
+/**
+ * Allocates a buffer. The memory is not zeroed.
+ * @arg size The size of the buffer
+ * @return The buffer, or NULL on failure.
+ */
+void* page_alloc(size_t size);
+
+/**
+ * Allocates a zeroed buffer
+ * @arg size The size of the buffer
+ * @return The buffer, or NULL on failure.
+ */
+void* page_calloc(size_t size);
+
+/**
+ * Frees a buffer
+ * @arg ptr The buffer, may be NULL
+ * @arg size The size it was allocated with
+ */
+void page_free(void *ptr, size_t size);
+
+#endif
@@ -0,0 +1,38 @@
+/**
+ * Static tracepoints on the ingest and flush paths, for profiling
+ * with bpftrace, perf or DTrace. They are compiled out unless built
+ * with `scons usdt=1`, which needs <sys/sdt.h> from SystemTap. An
+ * unattached probe is a single nop. The probes of the statsite
+ * provider are:
+ *
+ *  - conn_start(shard), conn_done(shard, res) around handle_client_connect
+ *  - add_sample(type, name, val) in metrics_add_sample
+ *  - set_update(name, member) in metrics_set_update
+ *  - hashmap_resize(old_size, new_size) when a hashmap grows
+ *  - cm_compress_start(samples), cm_compress_done(samples) around cm_compress
+ *  - flush_trigger() at each flush interval
+ *  - stream_start(cmd), stream_done(res) around stream_to_command
+ *
+ * For example, the time spent in each compression:
+ *
+ *    bpftrace -e 'usdt:./statsite:statsite:cm_compress_start { @s[tid] = nsecs; }
+ *        usdt:./statsite:statsite:cm_compress_done /@s[tid]/ {
+ *        @ns = hist(nsecs - @s[tid]); delete(@s[tid]); }'
+ */
+#ifndef PROBES_H
+#define PROBES_H
+
+#ifdef STATSITE_USDT
+#include <sys/sdt.h>
+#define STATSITE_PROBE(name) DTRACE_PROBE(statsite, name)
+#define STATSITE_PROBE1(name, a) DTRACE_PROBE1(statsite, name, a)
+#define STATSITE_PROBE2(name, a, b) DTRACE_PROBE2(statsite, name, a, b)
+#define STATSITE_PROBE3(name, a, b, c) DTRACE_PROBE3(statsite, name, a, b, c)
+#else
+#define STATSITE_PROBE(name) do {} while (0)
+#define STATSITE_PROBE1(name, a) do {} while (0)
+#define STATSITE_PROBE2(name, a, b) do {} while (0)
+#define STATSITE_PROBE3(name, a, b, c) do {} while (0)
+#endif
+
+#endif
@@ -0,0 +1,404 @@
+/**
+ * This file defines the methods declared in proxy.h
+ * The ring holds vnodes points for each upstream, the hashes of
+ * "host:port-i", and a key belongs to the first point at or past
+ * its own hash. The keys are hashed with MurmurHash3 directly,
+ * rather than the hash_key of the build, so that every proxy of
+ * a fleet routes a key the same however it was built.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "stats.h"
+#include "proxy.h"
+
+// Streams are sent once this much is queued, or on the timer
+#define PROXY_BATCH_BYTES 65536
+
+// Most bytes queued for an upstream while it is unavailable
+#define PROXY_MAX_BUFFER (4 * 1024 * 1024)
+
+// Datagrams are filled up to a typical MTU, larger records go alone
+#define PROXY_UDP_PAYLOAD 1432
+#define PROXY_UDP_MAX 65507
+
+// Initial size of an output buffer
+#define PROXY_INIT_BUFFER 16384
+
+// Delay before reconnecting to an upstream that failed
+#define PROXY_RETRY_SECS 1.0
+
+// How long to wait for each upstream when closing
+#define PROXY_CLOSE_TIMEOUT_MS 1000
+
+// Longest "host:port-i" hashed for a point of the ring
+#define PROXY_POINT_NAME 320
+
+extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
+
+// Finds the output of a worker to an upstream
+#define PROXY_OUT(p, worker, upstream, binary) \
+    ((p)->outs + ((worker) * (p)->num_upstreams + (upstream)) * 2 + (binary))
+
+// Hashes a key onto the ring
+static uint64_t ring_hash(const char *key, size_t len) {
+    uint64_t out[2];
+    MurmurHash3_x64_128(key, len, 0, out);
+    return out[0];
+}
+
+// Returns the time from a monotonic clock, in seconds
+static double now_secs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Orders the points by hash, and ties by upstream
+static int compare_points(const void *a, const void *b) {
+    const proxy_point *pa = a, *pb = b;
+    if (pa->hash != pb->hash) return (pa->hash < pb->hash) ? -1 : 1;
+    return pa->upstream - pb->upstream;
+}
+
+/**
+ * Splits an upstream of the form host:port, or [host]:port
+ * @return 0 on success, -1 if it is not valid.
+ */
+static int parse_upstream(char *spec, proxy_upstream *u) {
+    char *sep = strrchr(spec, ':');
+    if (!sep || sep == spec) return -1;
+    *sep = '\0';
+    char *host = spec, *port = sep + 1, *end;
+    long num = strtol(port, &end, 10);
+    if (*end || end == port || num < 1 || num > 65535) return -1;
+
+    // Strip the brackets of an IPv6 address
+    size_t len = strlen(host);
+    if (host[0] == '[' && host[len-1] == ']') {
+        host[len-1] = '\0';
+        host++;
+    }
+    if (!*host) return -1;
+    u->host = strdup(host);
+    u->port = strdup(port);
+    return 0;
+}
+
+/**
+ * Initializes a proxy. The connections are made lazily,
+ * when the first records are sent.
+ * @arg upstreams The upstream nodes, as "host:port,host:port"
+ * @arg vnodes The points of each upstream on the ring
+ * @arg udp Forward over UDP instead of TCP
+ * @arg num_workers The number of ingest workers
+ * @arg p Output, the new proxy
+ * @return 0 on success, -1 if the upstreams are not valid.
+ */
+int proxy_init(char *upstreams, int vnodes, bool udp, int num_workers, proxy **p) {
+    proxy *px = calloc(1, sizeof(proxy));
+    px->udp = udp;
+    px->num_workers = num_workers;
+
+    // Split the list, ignoring the spaces around each upstream
+    char *list = strdup(upstreams), *save = NULL, *spec;
+    for (spec = strtok_r(list, ",", &save); spec; spec = strtok_r(NULL, ",", &save)) {
+        while (*spec == ' ') spec++;
+        char *end = spec + strlen(spec);
+        while (end > spec && end[-1] == ' ') *--end = '\0';
+
+        px->upstreams = realloc(px->upstreams, (px->num_upstreams + 1) * sizeof(proxy_upstream));
+        if (parse_upstream(spec, px->upstreams + px->num_upstreams)) {
+            syslog(LOG_ERR, "Invalid proxy upstream: %s", spec);
+            free(list);
+            proxy_destroy(px);
+            return -1;
+        }
+        px->num_upstreams++;
+    }
+    free(list);
+    if (!px->num_upstreams) {
+        syslog(LOG_ERR, "No proxy upstreams!");
+        proxy_destroy(px);
+        return -1;
+    }
+
+    // Place the points of every upstream on the ring
+    char name[PROXY_POINT_NAME];
+    px->num_points = px->num_upstreams * vnodes;
+    px->points = malloc(px->num_points * sizeof(proxy_point));
+    for (int u=0; u < px->num_upstreams; u++) {
+        for (int i=0; i < vnodes; i++) {
+            int len = snprintf(name, sizeof(name), "%s:%s-%d",
+                    px->upstreams[u].host, px->upstreams[u].port, i);
+            if (len >= (int)sizeof(name)) len = sizeof(name) - 1;
+            proxy_point *pt = px->points + u * vnodes + i;
+            pt->hash = ring_hash(name, len);
+            pt->upstream = u;
+        }
+    }
+    qsort(px->points, px->num_points, sizeof(proxy_point), compare_points);
+
+    // Every output starts disconnected
+    int num_outs = num_workers * px->num_upstreams * 2;
+    px->outs = calloc(num_outs, sizeof(proxy_out));
+    for (int i=0; i < num_outs; i++) {
+        px->outs[i].fd = -1;
+    }
+    *p = px;
+    return 0;
+}
+
+/**
+ * Finds the upstream of a key on the ring
+ * @arg p The proxy
+ * @arg key The key, which need not be terminated
+ * @arg len The length of the key
+ * @return The index of the upstream.
+ */
+int proxy_route(proxy *p, const char *key, size_t len) {
+    // Find the first point at or past the hash, wrapping around
+    uint64_t hash = ring_hash(key, len);
+    int low = 0, high = p->num_points;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (p->points[mid].hash < hash)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low == p->num_points) low = 0;
+    return p->points[low].upstream;
+}
+
+// Closes the connection of an output
+static void proxy_disconnect(proxy_out *o) {
+    if (o->fd >= 0) close(o->fd);
+    o->fd = -1;
+}
+
+/**
+ * Starts a non-blocking connection to an upstream. The name
+ * is resolved on every connect, so an upstream may move.
+ * @return 0 on success, -1 if it failed or is backing off.
+ */
+static int proxy_connect(proxy *p, proxy_out *o, proxy_upstream *u) {
+    double now = now_secs();
+    if (now < o->retry_at) return -1;
+
+    struct addrinfo hints, *addrs, *addr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = (p->udp) ? SOCK_DGRAM : SOCK_STREAM;
+    int res = getaddrinfo(u->host, u->port, &hints, &addrs);
+    if (res) {
+        syslog(LOG_ERR, "Failed to resolve proxy upstream %s: %s", u->host, gai_strerror(res));
+        o->retry_at = now + PROXY_RETRY_SECS;
+        return -1;
+    }
+
+    // Try each address in turn, the connect finishes in the background
+    for (addr = addrs; addr; addr = addr->ai_next) {
+        o->fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (o->fd < 0) continue;
+        fcntl(o->fd, F_SETFL, fcntl(o->fd, F_GETFL, 0) | O_NONBLOCK);
+        if (connect(o->fd, addr->ai_addr, addr->ai_addrlen) == 0 || errno == EINPROGRESS) break;
+        proxy_disconnect(o);
+    }
+    freeaddrinfo(addrs);
+
+    if (o->fd < 0) {
+        syslog(LOG_ERR, "Failed to connect to proxy upstream %s:%s", u->host, u->port);
+        o->retry_at = now + PROXY_RETRY_SECS;
+        return -1;
+    }
+    return 0;
+}
+
+// Discards the queued records of an output
+static void proxy_drop(proxy_out *o) {
+    stats_add(STAT_PROXY_DROPPED, o->records);
+    o->len = 0;
+    o->records = 0;
+    o->partial = 0;
+}
+
+/**
+ * Sends the queued datagram of an output. A datagram
+ * that cannot be sent is dropped.
+ */
+static void proxy_send_dgram(proxy *p, proxy_out *o, proxy_upstream *u) {
+    ssize_t res;
+    if (o->fd >= 0 || !proxy_connect(p, o, u)) {
+        do {
+            res = send(o->fd, o->buf, o->len, MSG_NOSIGNAL);
+        } while (res < 0 && errno == EINTR);
+        if (res == (ssize_t)o->len) {
+            o->len = 0;
+            o->records = 0;
+            return;
+        }
+    }
+    proxy_drop(o);
+}
+
+/**
+ * Sends as much of the queued stream of an output as the
+ * socket takes. The rest is kept for the next send, unless
+ * the connection failed part way through a record, which
+ * cannot be resumed on a new connection.
+ */
+static void proxy_send_stream(proxy *p, proxy_out *o, proxy_upstream *u) {
+    if (o->fd < 0 && proxy_connect(p, o, u)) return;
+
+    size_t sent = 0;
+    ssize_t res;
+    while (sent < o->len) {
+        res = send(o->fd, o->buf + sent, o->len - sent, MSG_NOSIGNAL);
+        if (res > 0) {
+            sent += res;
+        } else if (res < 0 && errno == EINTR) {
+            continue;
+        } else if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            syslog(LOG_ERR, "Failed to send to proxy upstream %s:%s: %s", u->host, u->port, strerror(errno));
+            proxy_disconnect(o);
+            o->retry_at = now_secs() + PROXY_RETRY_SECS;
+            break;
+        }
+    }
+
+    if (sent == o->len) {
+        o->len = 0;
+        o->records = 0;
+        o->partial = 0;
+    } else if (o->fd < 0 && (sent || o->partial)) {
+        proxy_drop(o);
+    } else if (sent) {
+        memmove(o->buf, o->buf + sent, o->len - sent);
+        o->len -= sent;
+        o->partial = 1;
+    }
+}
+
+// Sends the queued records of an output
+static void proxy_send(proxy *p, proxy_out *o, proxy_upstream *u) {
+    if (!o->len) return;
+    if (p->udp)
+        proxy_send_dgram(p, o, u);
+    else
+        proxy_send_stream(p, o, u);
+}
+
+/**
+ * Queues a complete record for an upstream, sending
+ * the output once it fills a batch. Records that do not
+ * fit while the upstream is unavailable are dropped.
+ * @arg p The proxy
+ * @arg worker The worker forwarding the record
+ * @arg upstream The upstream, see proxy_route
+ * @arg binary Is this a binary frame, instead of an ASCII line
+ * @arg buf The record
+ * @arg len The length of the record
+ * @return 0 on success, -1 if the record was dropped.
+ */
+int proxy_forward(proxy *p, int worker, int upstream, bool binary, const char *buf, size_t len) {
+    proxy_out *o = PROXY_OUT(p, worker, upstream, binary);
+    proxy_upstream *u = p->upstreams + upstream;
+
+    // Datagrams hold whole records, streams are bounded while unavailable
+    size_t limit = (p->udp) ? PROXY_UDP_PAYLOAD : PROXY_MAX_BUFFER;
+    if (o->len + len > limit) proxy_send(p, o, u);
+    if (o->len + len > limit && (!p->udp || len > PROXY_UDP_MAX)) {
+        stats_add(STAT_PROXY_DROPPED, 1);
+        return -1;
+    }
+
+    // Grow the buffer to fit the record
+    if (o->len + len > o->size) {
+        size_t size = (o->size) ? o->size : PROXY_INIT_BUFFER;
+        while (size < o->len + len) size *= 2;
+        o->buf = realloc(o->buf, size);
+        o->size = size;
+    }
+    memcpy(o->buf + o->len, buf, len);
+    o->len += len;
+    o->records++;
+    stats_add(STAT_PROXY_FORWARDED, 1);
+
+    // Streams are sent in batches, a datagram once it is full
+    if (!p->udp && o->len >= PROXY_BATCH_BYTES) proxy_send(p, o, u);
+    return 0;
+}
+
+/**
+ * Sends the queued records of a worker to every upstream.
+ * @arg p The proxy
+ * @arg worker The worker to flush
+ */
+void proxy_flush(proxy *p, int worker) {
+    for (int u=0; u < p->num_upstreams; u++) {
+        proxy_send(p, PROXY_OUT(p, worker, u, 0), p->upstreams + u);
+        proxy_send(p, PROXY_OUT(p, worker, u, 1), p->upstreams + u);
+    }
+}
+
+/**
+ * Sends the rest of an output, waiting for the
+ * upstream to take it, up to a timeout each time.
+ */
+static void proxy_drain(proxy *p, proxy_out *o, proxy_upstream *u) {
+    struct pollfd pfd;
+    o->retry_at = 0;
+    proxy_send(p, o, u);
+    while (o->len && o->fd >= 0) {
+        pfd.fd = o->fd;
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, PROXY_CLOSE_TIMEOUT_MS) <= 0) break;
+        proxy_send(p, o, u);
+    }
+    if (o->len) {
+        syslog(LOG_WARNING, "Dropped %llu records for proxy upstream %s:%s",
+                (unsigned long long)o->records, u->host, u->port);
+        proxy_drop(o);
+    }
+}
+
+/**
+ * Sends what remains of every worker, waiting briefly for
+ * each upstream, and then closes the connections and frees
+ * the proxy. Unsent records are discarded.
+ * @arg p The proxy
+ */
+void proxy_destroy(proxy *p) {
+    if (p->outs) {
+        for (int w=0; w < p->num_workers; w++) {
+            for (int u=0; u < p->num_upstreams; u++) {
+                for (int binary=0; binary < 2; binary++) {
+                    proxy_out *o = PROXY_OUT(p, w, u, binary);
+                    proxy_drain(p, o, p->upstreams + u);
+                    proxy_disconnect(o);
+                    free(o->buf);
+                }
+            }
+        }
+    }
+    for (int u=0; u < p->num_upstreams; u++) {
+        free(p->upstreams[u].host);
+        free(p->upstreams[u].port);
+    }
+    free(p->upstreams);
+    free(p->points);
+    free(p->outs);
+    free(p);
+}
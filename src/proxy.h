@@ -0,0 +1,102 @@
+/**
+ * The forwarding proxy. Each key is hashed onto a consistent-hash
+ * ring of upstream statsite nodes, and its lines or frames are
+ * forwarded to that node, so a key always lands on the same
+ * aggregator and the fleet scales by adding nodes. Adding or
+ * removing a node only moves the keys of its share of the ring.
+ *
+ * Each ingest worker has its own output buffer and connection to
+ * every upstream, so forwarding takes no locks. ASCII lines and
+ * binary frames use separate connections, since an upstream reads
+ * a connection in one mode at a time. The buffers are sent once
+ * they fill a batch, and on a short timer by the worker.
+ */
+#ifndef PROXY_H
+#define PROXY_H
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// A point of an upstream on the ring
+typedef struct {
+    uint64_t hash;
+    int upstream;
+} proxy_point;
+
+// The output of a worker to an upstream, in one mode
+typedef struct {
+    int fd;             // Connection, -1 if not connected
+    int partial;        // Was a record only partly sent
+    char *buf;          // Records waiting to be sent
+    size_t len;
+    size_t size;
+    uint64_t records;   // Number of records in the buffer
+    double retry_at;    // When to reconnect after a failure
+} proxy_out;
+
+typedef struct {
+    char *host;
+    char *port;
+} proxy_upstream;
+
+typedef struct {
+    int num_upstreams;
+    proxy_upstream *upstreams;
+    int num_points;
+    proxy_point *points;    // The ring, sorted by hash
+    bool udp;               // Forward datagrams instead of streams
+    int num_workers;
+    proxy_out *outs;        // Per worker, per upstream, ASCII then binary
+} proxy;
+
+/**
+ * Initializes a proxy. The connections are made lazily,
+ * when the first records are sent.
+ * @arg upstreams The upstream nodes, as "host:port,host:port"
+ * @arg vnodes The points of each upstream on the ring
+ * @arg udp Forward over UDP instead of TCP
+ * @arg num_workers The number of ingest workers
+ * @arg p Output, the new proxy
+ * @return 0 on success, -1 if the upstreams are not valid.
+ */
+int proxy_init(char *upstreams, int vnodes, bool udp, int num_workers, proxy **p);
+
+/**
+ * Finds the upstream of a key on the ring
+ * @arg p The proxy
+ * @arg key The key, which need not be terminated
+ * @arg len The length of the key
+ * @return The index of the upstream.
+ */
+int proxy_route(proxy *p, const char *key, size_t len);
+
+/**
+ * Queues a complete record for an upstream, sending
+ * the output once it fills a batch. Records that do not
+ * fit while the upstream is unavailable are dropped.
+ * @arg p The proxy
+ * @arg worker The worker forwarding the record
+ * @arg upstream The upstream, see proxy_route
+ * @arg binary Is this a binary frame, instead of an ASCII line
+ * @arg buf The record
+ * @arg len The length of the record
+ * @return 0 on success, -1 if the record was dropped.
+ */
+int proxy_forward(proxy *p, int worker, int upstream, bool binary, const char *buf, size_t len);
+
+/**
+ * Sends the queued records of a worker to every upstream.
+ * @arg p The proxy
+ * @arg worker The worker to flush
+ */
+void proxy_flush(proxy *p, int worker);
+
+/**
+ * Sends what remains of every worker, waiting briefly for
+ * each upstream, and then closes the connections and frees
+ * the proxy. Unsent records are discarded.
+ * @arg p The proxy
+ */
+void proxy_destroy(proxy *p);
+
+#endif
@@ -2,6 +2,224 @@
 #include <strings.h>
 #include <string.h>
 #include "radix.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The node types, named by their capacity
+#define NODE4   0
+#define NODE16  1
+#define NODE48  2
+#define NODE256 3
+
+/*
+ * Small nodes keep sorted key bytes next to the children.
+ * A node48 maps each byte to a slot, stored off by one so
+ * that zero means no child. A node256 is indexed directly.
+ */
+typedef struct {
+    radix_node n;
+    unsigned char keys[4];
+    radix_node *children[4];
+} radix_node4;
+
+typedef struct {
+    radix_node n;
+    unsigned char keys[16];
+    radix_node *children[16];
+} radix_node16;
+
+typedef struct {
+    radix_node n;
+    unsigned char index[256];
+    radix_node *children[48];
+} radix_node48;
+
+typedef struct {
+    radix_node n;
+    radix_node *children[256];
+} radix_node256;
+
+// Allocates an empty node of the smallest type
+static radix_node* alloc_node() {
+    radix_node *n = calloc(1, sizeof(radix_node4));
+    n->type = NODE4;
+    return n;
+}
+
+// Allocates a leaf with a copy of the key
+static radix_leaf* alloc_leaf(char *key, void *value) {
+    radix_leaf *leaf = malloc(sizeof(radix_leaf));
+    leaf->key = key ? strdup(key) : NULL;
+    leaf->value = value;
+    return leaf;
+}
+
+/**
+ * Returns the slot of the child for a key byte,
+ * or NULL if there is no such child.
+ */
+static radix_node** find_child(radix_node *n, unsigned char c) {
+    int i;
+    switch (n->type) {
+        case NODE4: {
+            radix_node4 *n4 = (radix_node4*)n;
+            for (i=0; i < n->num_children; i++) {
+                if (n4->keys[i] == c) return n4->children + i;
+            }
+            return NULL;
+        }
+        case NODE16: {
+            radix_node16 *n16 = (radix_node16*)n;
+#ifdef __SSE2__
+            __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8(c),
+                    _mm_loadu_si128((__m128i*)n16->keys));
+            int mask = _mm_movemask_epi8(cmp) & ((1 << n->num_children) - 1);
+            return (mask) ? n16->children + __builtin_ctz(mask) : NULL;
+#else
+            for (i=0; i < n->num_children; i++) {
+                if (n16->keys[i] == c) return n16->children + i;
+            }
+            return NULL;
+#endif
+        }
+        case NODE48: {
+            radix_node48 *n48 = (radix_node48*)n;
+            i = n48->index[c];
+            return (i) ? n48->children + i - 1 : NULL;
+        }
+        default: {
+            radix_node256 *n256 = (radix_node256*)n;
+            return (n256->children[c]) ? n256->children + c : NULL;
+        }
+    }
+}
+
+// Inserts into the sorted keys of a node4 or node16 with room
+static void insert_sorted(unsigned char *keys, radix_node **children, int num,
+        unsigned char c, radix_node *child) {
+    int i = num;
+    while (i > 0 && keys[i-1] > c) {
+        keys[i] = keys[i-1];
+        children[i] = children[i-1];
+        i--;
+    }
+    keys[i] = c;
+    children[i] = child;
+}
+
+/**
+ * Grows a full node to the next type, replacing it in its slot
+ * @return The new node
+ */
+static radix_node* grow_node(radix_node **ref) {
+    radix_node *n = *ref, *bigger;
+    int i;
+    switch (n->type) {
+        case NODE4: {
+            radix_node4 *n4 = (radix_node4*)n;
+            radix_node16 *n16 = calloc(1, sizeof(radix_node16));
+            memcpy(n16->keys, n4->keys, sizeof(n4->keys));
+            memcpy(n16->children, n4->children, sizeof(n4->children));
+            bigger = (radix_node*)n16;
+            bigger->type = NODE16;
+            break;
+        }
+        case NODE16: {
+            radix_node16 *n16 = (radix_node16*)n;
+            radix_node48 *n48 = calloc(1, sizeof(radix_node48));
+            for (i=0; i < n->num_children; i++) {
+                n48->children[i] = n16->children[i];
+                n48->index[n16->keys[i]] = i + 1;
+            }
+            bigger = (radix_node*)n48;
+            bigger->type = NODE48;
+            break;
+        }
+        default: {
+            radix_node48 *n48 = (radix_node48*)n;
+            radix_node256 *n256 = calloc(1, sizeof(radix_node256));
+            for (i=0; i < 256; i++) {
+                if (n48->index[i]) n256->children[i] = n48->children[n48->index[i] - 1];
+            }
+            bigger = (radix_node*)n256;
+            bigger->type = NODE256;
+            break;
+        }
+    }
+
+    // Copy the header, but keep the new type
+    unsigned char type = bigger->type;
+    *bigger = *n;
+    bigger->type = type;
+    free(n);
+    *ref = bigger;
+    return bigger;
+}
+
+/**
+ * Adds a child to the node in a slot, growing the node if it is full.
+ * The key byte must not already have a child.
+ */
+static void add_child(radix_node **ref, unsigned char c, radix_node *child) {
+    radix_node *n = *ref;
+    if ((n->type == NODE4 && n->num_children == 4) ||
+        (n->type == NODE16 && n->num_children == 16) ||
+        (n->type == NODE48 && n->num_children == 48)) {
+        n = grow_node(ref);
+    }
+
+    switch (n->type) {
+        case NODE4: {
+            radix_node4 *n4 = (radix_node4*)n;
+            insert_sorted(n4->keys, n4->children, n->num_children, c, child);
+            break;
+        }
+        case NODE16: {
+            radix_node16 *n16 = (radix_node16*)n;
+            insert_sorted(n16->keys, n16->children, n->num_children, c, child);
+            break;
+        }
+        case NODE48: {
+            // Children are never removed, so the slots are used in order
+            radix_node48 *n48 = (radix_node48*)n;
+            n48->children[n->num_children] = child;
+            n48->index[c] = n->num_children + 1;
+            break;
+        }
+        default:
+            ((radix_node256*)n)->children[c] = child;
+            break;
+    }
+    n->num_children++;
+}
+
+/**
+ * Returns the i'th child of a node in key byte order,
+ * and advances i past it. Returns NULL when there are no more.
+ */
+static radix_node* next_child(radix_node *n, int *i) {
+    switch (n->type) {
+        case NODE4:
+            return (*i < n->num_children) ? ((radix_node4*)n)->children[(*i)++] : NULL;
+        case NODE16:
+            return (*i < n->num_children) ? ((radix_node16*)n)->children[(*i)++] : NULL;
+        case NODE48: {
+            radix_node48 *n48 = (radix_node48*)n;
+            for (; *i < 256; (*i)++) {
+                if (n48->index[*i]) return n48->children[n48->index[(*i)++] - 1];
+            }
+            return NULL;
+        }
+        default: {
+            radix_node256 *n256 = (radix_node256*)n;
+            for (; *i < 256; (*i)++) {
+                if (n256->children[*i]) return n256->children[(*i)++];
+            }
+            return NULL;
+        }
+    }
+}
 
 /**
  * Initializes the radix tree
@@ -9,24 +227,22 @@
  * @return 0 on success
  */
 int radix_init(radix_tree *tree) {
-    bzero(tree, sizeof(radix_tree));
+    tree->root = alloc_node();
     return 0;
 }
 
 // Recursively destroys the radix tree
 static void recursive_destroy(radix_node *n) {
     radix_node *child;
-    if (n->edges[0]) {
-        radix_leaf *leaf = n->edges[0];
-        free(leaf->key);
-        free(leaf);
+    if (n->leaf) {
+        free(n->leaf->key);
+        free(n->leaf);
     }
-    for (int i=1; i < 256; i++) {
-        child = (radix_node*)n->edges[i];
-        if (!child) continue;
+    int i = 0;
+    while ((child = next_child(n, &i))) {
         recursive_destroy(child);
-        free(child);
     }
+    free(n);
 }
 
 /**
@@ -35,7 +251,8 @@ static void recursive_destroy(radix_node *n) {
  * @return 0 on success
  */
 int radix_destroy(radix_tree *tree) {
-    recursive_destroy(&tree->root);
+    recursive_destroy(tree->root);
+    tree->root = NULL;
     return 0;
 }
 
@@ -58,85 +275,74 @@ static int longest_prefix(char *k1, char *k2, int max) {
  * @return 0 if the value was inserted, 1 if the value was updated.
  */
 int radix_insert(radix_tree *t, char *key, void **value) {
-    radix_node *child, *parent=NULL, *n = &t->root;
+    radix_node **ref = &t->root, **child_ref, *n = t->root, *child, *split;
     radix_leaf *leaf;
     char *search = key;
     int common_prefix;
     do {
         // Check if we've exhausted the key
         if (!search || *search == 0) {
-            leaf = n->edges[0];
-            if (leaf) {
+            if (n->leaf) {
                 // Return the old value
-                void *old = leaf->value;
-                leaf->value = *value;
+                void *old = n->leaf->value;
+                n->leaf->value = *value;
                 *value = old;
                 return 1;
-            } else {
-                // Add a new node
-                leaf = malloc(sizeof(radix_leaf));
-                n->edges[0] = leaf;
-                leaf->key = key ? strdup(key) : NULL;
-                leaf->value = *value;
-                return 0;
             }
+            n->leaf = alloc_leaf(key, *value);
+            return 0;
         }
 
-        // Get the edge
-        parent = n;
-        n = n->edges[(int)*search];
-        if (!n) {
-            child = parent->edges[(int)*search] = calloc(1, sizeof(radix_node));
-            leaf = child->edges[0] = malloc(sizeof(radix_leaf));
-            leaf->key = strdup(key);
-            leaf->value = *value;
-
-            // The key of the node is some
-            child->key = leaf->key + (search - key);
+        // Get the edge, add a new node if there is none
+        child_ref = find_child(n, *search);
+        if (!child_ref) {
+            child = alloc_node();
+            child->leaf = alloc_leaf(key, *value);
+
+            // The key of the node is the rest of the search key
+            child->key = child->leaf->key + (search - key);
             child->key_len = strlen(search);
+            add_child(ref, *search, child);
             return 0;
         }
 
         // Determine longest prefix of the search key on match
-        common_prefix = longest_prefix(search, n->key, n->key_len);
-        if (common_prefix == n->key_len) {
-            search += n->key_len;
+        child = *child_ref;
+        common_prefix = longest_prefix(search, child->key, child->key_len);
+        if (common_prefix == child->key_len) {
+            search += child->key_len;
+            ref = child_ref;
+            n = child;
+            continue;
+        }
 
-        // If we share a sub-set, we need to split the nodes
-        } else {
-            // Split the node with the shared prefix
-            child = calloc(1, sizeof(radix_node));
-            parent->edges[(int)*search] = child;
-            child->key = n->key;
-            child->key_len = common_prefix;
-
-            // Restore pointer to the existing node
-            n->key += common_prefix;
-            n->key_len -= common_prefix;
-            child->edges[(int)*(n->key)] = n;
-
-            // Create a new leaf
-            leaf = malloc(sizeof(radix_leaf));
-            leaf->key = strdup(key);
-            leaf->value = *value;
-
-            // If the new key is a subset, add to to this node
-            search += common_prefix;
-            if (*search == 0) {
-                child->edges[0] = leaf;
-                return 0;
-            }
+        // If we share a sub-set, we need to split the node
+        // with the shared prefix, which replaces it in its slot
+        split = alloc_node();
+        split->key = child->key;
+        split->key_len = common_prefix;
+        *child_ref = split;
 
-            // Create a new node for the new key
-            n = calloc(1, sizeof(radix_node));
-            child->edges[(int)*search] = n;
-            n->edges[0] = leaf;
+        // Move the existing node under the split
+        child->key += common_prefix;
+        child->key_len -= common_prefix;
+        add_child(child_ref, *child->key, child);
 
-            // The key of the node is some
-            n->key = leaf->key + (search - key);
-            n->key_len = strlen(search);
+        // If the new key is a subset, add it to the split node
+        leaf = alloc_leaf(key, *value);
+        search += common_prefix;
+        if (*search == 0) {
+            split->leaf = leaf;
             return 0;
         }
+
+        // Create a new node for the new key
+        child = alloc_node();
+        child->leaf = leaf;
+        child->key = leaf->key + (search - key);
+        child->key_len = strlen(search);
+        add_child(child_ref, *search, child);
+        return 0;
     } while (1);
     return 0;
 }
@@ -149,22 +355,22 @@ int radix_insert(radix_tree *t, char *key, void **value) {
  * @return 0 if found
  */
 int radix_search(radix_tree *t, char *key, void **value) {
-    radix_node *n = &t->root;
+    radix_node *n = t->root, **child_ref;
     char *search = key;
     do {
         // Check if we've exhausted the key
         if (!search || *search == 0) {
-            radix_leaf *l = n->edges[0];
-            if (l) {
-                *value = l->value;
+            if (n->leaf) {
+                *value = n->leaf->value;
                 return 0;
             }
             break;
         }
 
         // Get the edge
-        n = n->edges[(int)*search];
-        if (!n) break;
+        child_ref = find_child(n, *search);
+        if (!child_ref) break;
+        n = *child_ref;
 
         // Consume the search key on match
         if (!strncmp(search, n->key, n->key_len))
@@ -183,21 +389,22 @@ int radix_search(radix_tree *t, char *key, void **value) {
  * @return 0 if found
  */
 int radix_longest_prefix(radix_tree *t, char *key, void **value) {
-    radix_node *n = &t->root;
+    radix_node *n = t->root, **child_ref;
     radix_leaf *last_match = NULL;
     char *search = key;
     do {
         // Store the last match
-        if (n->edges[0])
-            last_match = n->edges[0];
+        if (n->leaf)
+            last_match = n->leaf;
 
         // Check if we've exhausted the key
         if (!search || *search == 0)
             break;
 
         // Get the edge
-        n = n->edges[(int)*search];
-        if (!n) break;
+        child_ref = find_child(n, *search);
+        if (!child_ref) break;
+        n = *child_ref;
 
         // Consume the search key on match
         if (!strncmp(search, n->key, n->key_len))
@@ -217,14 +424,12 @@ int radix_longest_prefix(radix_tree *t, char *key, void **value) {
 // Recursively iterates
 static int recursive_iter(radix_node *n, void *data, int(*iter_func)(void *data, char *key, void *value)) {
     int ret = 0;
-    if (n->edges[0]) {
-        radix_leaf *leaf = n->edges[0];
-        ret = iter_func(data, leaf->key, leaf->value);
+    if (n->leaf) {
+        ret = iter_func(data, n->leaf->key, n->leaf->value);
     }
     radix_node *child;
-    for (int i=1; !ret && i < 256; i++) {
-        child = (radix_node*)n->edges[i];
-        if (!child) continue;
+    int i = 0;
+    while (!ret && (child = next_child(n, &i))) {
         ret = recursive_iter(child, data, iter_func);
     }
     return ret;
@@ -238,6 +443,5 @@ static int recursive_iter(radix_node *n, void *data, int(*iter_func)(void *data,
  * @return 0 on sucess. 1 if the iteration was stopped.
  */
 int radix_foreach(radix_tree *t, void *data, int(*iter_func)(void* data, char *key, void *value)) {
-    return recursive_iter(&t->root, data, iter_func);
+    return recursive_iter(t->root, data, iter_func);
 }
-
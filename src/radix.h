@@ -2,10 +2,11 @@
  * This modules implements a radix tree.
  * We use this for fast longest-prefix matching.
  *
- * It is not particularly space efficient as each of
- * the nodes are quite large, but it is suitable for the
- * small number of patterns that are needed for
- * histograms.
+ * Nodes adapt their size to the number of children, as
+ * in an adaptive radix tree (ART). A node starts with room
+ * for 4 children and grows to 16, 48 and then 256, so the
+ * tree stays compact and cache friendly even as the number
+ * of patterns grows.
  *
  */
 
@@ -17,14 +18,20 @@ typedef struct {
     void *value;
 } radix_leaf;
 
+/**
+ * The common header of every node. It is followed by
+ * the children, laid out according to the node type.
+ */
 typedef struct radix_node {
-    char *key;
+    char *key;              // The prefix of the node, points into a leaf key
     int key_len;
-    void *edges[256];
+    radix_leaf *leaf;       // The value of the key ending at this node
+    unsigned char type;     // Node type, the capacity of children
+    unsigned short num_children;
 } radix_node;
 
 typedef struct {
-    radix_node root;
+    radix_node *root;
 } radix_tree;
 
 /**
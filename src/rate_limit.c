@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include <netinet/in.h>
+#include "rate_limit.h"
+#include "hash.h"
+
+/**
+ * Initializes a table of buckets
+ * @arg rate The bytes per second of each client
+ * @arg burst The most bytes each client may send at once
+ * @arg t The table to initialize
+ * @return 0 on success.
+ */
+int init_rate_table(double rate, double burst, rate_table *t) {
+    if (!(rate > 0) || burst < 1) return -1;
+    t->rate = rate;
+    t->burst = burst;
+    t->buckets = calloc(RATE_TABLE_SIZE, sizeof(rate_bucket));
+    return (t->buckets) ? 0 : -1;
+}
+
+/**
+ * Destroys a table of buckets
+ */
+void destroy_rate_table(rate_table *t) {
+    free(t->buckets);
+    t->buckets = NULL;
+}
+
+/**
+ * Starts a bucket full
+ * @arg t The table the bucket takes its rate from
+ * @arg b The bucket
+ * @arg now The current time, in seconds
+ */
+void rate_bucket_init(rate_table *t, rate_bucket *b, double now) {
+    b->tokens = t->burst;
+    b->last = now;
+}
+
+/**
+ * Adds the tokens gained since the bucket was last refilled
+ * @arg t The table the bucket takes its rate from
+ * @arg b The bucket
+ * @arg now The current time, in seconds
+ * @return The tokens in the bucket
+ */
+double rate_bucket_refill(rate_table *t, rate_bucket *b, double now) {
+    if (now > b->last) {
+        b->tokens += (now - b->last) * t->rate;
+        if (b->tokens > t->burst) b->tokens = t->burst;
+        b->last = now;
+    }
+    return b->tokens;
+}
+
+/**
+ * Returns how long until a bucket has a token
+ * @arg t The table the bucket takes its rate from
+ * @arg b The bucket, after a refill
+ * @return The seconds to wait
+ */
+double rate_bucket_wait(rate_table *t, rate_bucket *b) {
+    return (b->tokens >= 1) ? 0 : (1 - b->tokens) / t->rate;
+}
+
+/**
+ * Takes the tokens for the input of a datagram source, if
+ * its bucket has them. Sources other than IPv4 and IPv6
+ * are not limited.
+ * @arg t The table of buckets
+ * @arg addr The address of the source
+ * @arg now The current time, in seconds
+ * @arg cost The bytes of the input
+ * @return 1 if the input is allowed, 0 if it is over the rate.
+ */
+int rate_table_take(rate_table *t, const struct sockaddr *addr, double now, double cost) {
+    // Only the host is the source, clients send from many ports
+    uint64_t key;
+    if (addr->sa_family == AF_INET)
+        key = hash_key(&((struct sockaddr_in*)addr)->sin_addr, sizeof(struct in_addr));
+    else if (addr->sa_family == AF_INET6)
+        key = hash_key(&((struct sockaddr_in6*)addr)->sin6_addr, sizeof(struct in6_addr));
+    else
+        return 1;
+    if (!key) key = 1;
+
+    // A new source takes over the slot with a full bucket
+    rate_bucket *b = t->buckets + (key % RATE_TABLE_SIZE);
+    if (b->key != key) {
+        b->key = key;
+        rate_bucket_init(t, b, now);
+    }
+
+    // The datagram is dropped whole, if there are not the tokens for it
+    if (rate_bucket_refill(t, b, now) < cost) return 0;
+    b->tokens -= cost;
+    return 1;
+}
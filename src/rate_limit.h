@@ -0,0 +1,83 @@
+/**
+ * Token buckets that limit the input of each client. A bucket
+ * holds up to the burst of tokens, and gains the rate of them
+ * per second, each byte read from a client costs a token.
+ *
+ * Stream clients have a bucket of their own, and the sources of
+ * datagrams share a direct mapped table of buckets, keyed by the
+ * hash of their address. A source that maps to a slot held by
+ * another takes it over with a full bucket, so the table bounds
+ * the memory at the cost of some slack when it is crowded.
+ */
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+#include <stdint.h>
+#include <sys/socket.h>
+
+// The buckets of the datagram sources, per worker
+#define RATE_TABLE_SIZE 4096
+
+typedef struct {
+    uint64_t key;       // Hash of the source address, 0 if unused
+    double tokens;      // Bytes that may be read
+    double last;        // When the tokens were last added
+} rate_bucket;
+
+typedef struct {
+    double rate;        // Tokens added per second
+    double burst;       // Most tokens a bucket holds
+    rate_bucket *buckets; // The buckets of the sources, RATE_TABLE_SIZE of them
+} rate_table;
+
+/**
+ * Initializes a table of buckets
+ * @arg rate The bytes per second of each client
+ * @arg burst The most bytes each client may send at once
+ * @arg t The table to initialize
+ * @return 0 on success.
+ */
+int init_rate_table(double rate, double burst, rate_table *t);
+
+/**
+ * Destroys a table of buckets
+ */
+void destroy_rate_table(rate_table *t);
+
+/**
+ * Starts a bucket full
+ * @arg t The table the bucket takes its rate from
+ * @arg b The bucket
+ * @arg now The current time, in seconds
+ */
+void rate_bucket_init(rate_table *t, rate_bucket *b, double now);
+
+/**
+ * Adds the tokens gained since the bucket was last refilled
+ * @arg t The table the bucket takes its rate from
+ * @arg b The bucket
+ * @arg now The current time, in seconds
+ * @return The tokens in the bucket
+ */
+double rate_bucket_refill(rate_table *t, rate_bucket *b, double now);
+
+/**
+ * Returns how long until a bucket has a token
+ * @arg t The table the bucket takes its rate from
+ * @arg b The bucket, after a refill
+ * @return The seconds to wait
+ */
+double rate_bucket_wait(rate_table *t, rate_bucket *b);
+
+/**
+ * Takes the tokens for the input of a datagram source, if
+ * its bucket has them. Sources other than IPv4 and IPv6
+ * are not limited.
+ * @arg t The table of buckets
+ * @arg addr The address of the source
+ * @arg now The current time, in seconds
+ * @arg cost The bytes of the input
+ * @return 1 if the input is allowed, 0 if it is over the rate.
+ */
+int rate_table_take(rate_table *t, const struct sockaddr *addr, double now, double cost);
+
+#endif
@@ -3,9 +3,11 @@
 #include <string.h>
 #include <strings.h>
 #include "set.h"
+#include "hash.h"
+#include "stats.h"
 
-// Link the external murmur hash in
-extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
+// Initial size of the exact hash table
+#define EXACT_INIT_SIZE 16
 
 /**
  * Initializes a new set
@@ -14,12 +16,29 @@ extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t
  * @return 0 on success.
  */
 int set_init(unsigned char precision, set_t *s) {
+    return set_init_exact(precision, SET_MAX_EXACT, s);
+}
+
+/**
+ * Initializes a new set, with a maximum for the
+ * number of items that are counted exactly.
+ * @arg precision The precision to use when converting to an HLL
+ * @arg max_exact The maximum number of items before converting
+ * @arg s The set to initialize
+ * @return 0 on success.
+ */
+int set_init_exact(unsigned char precision, uint32_t max_exact, set_t *s) {
     // Initialize as an exact set
     s->type = EXACT;
     s->store.s.precision = precision;
+    s->store.s.has_zero = 0;
     s->store.s.count = 0;
-    s->store.s.hashes = (uint64_t*)malloc(sizeof(uint64_t)*SET_MAX_EXACT);
-    if (!s->store.s.hashes) return 1;
+    s->store.s.max_exact = max_exact;
+
+    // The first hashes are kept inline, most sets stay that small
+    s->store.s.size = SET_INLINE_HASHES;
+    s->store.s.hashes = NULL;
+    memset(s->store.s.inline_hashes, 0, sizeof(s->store.s.inline_hashes));
     return 0;
 }
 
@@ -30,6 +49,8 @@ int set_init(unsigned char precision, set_t *s) {
 int set_destroy(set_t *s) {
     switch (s->type) {
         case EXACT:
+            if (!s->store.s.hashes) break;
+            stats_mem_add(MEM_SETS, -(int64_t)(s->store.s.size * sizeof(uint64_t)));
             free(s->store.s.hashes);
             break;
 
@@ -41,46 +62,156 @@ int set_destroy(set_t *s) {
 }
 
 /**
- * Converts a full exact set to an approximate HLL set.
+ * Checks if a hash is in the exact hash table.
+ * @return 1 if present, 0 otherwise.
+ */
+static int exact_contains(exact_set *e, uint64_t hash) {
+    if (!hash) return e->has_zero;
+    if (!e->hashes) {
+        for (int i=0; i < SET_INLINE_HASHES && e->inline_hashes[i]; i++) {
+            if (e->inline_hashes[i] == hash) return 1;
+        }
+        return 0;
+    }
+    uint32_t mask = e->size - 1;
+    uint32_t i = hash & mask;
+    while (e->hashes[i]) {
+        if (e->hashes[i] == hash) return 1;
+        i = (i + 1) & mask;
+    }
+    return 0;
+}
+
+/**
+ * Inserts a hash into the exact hash table, using linear probing.
+ * @return 1 if added, 0 if it was already present.
+ */
+static int exact_insert(exact_set *e, uint64_t hash) {
+    // Zero marks an empty slot, so it is tracked separately
+    if (!hash) {
+        if (e->has_zero) return 0;
+        e->has_zero = 1;
+        return 1;
+    }
+
+    // The inline hashes fill from the front
+    if (!e->hashes) {
+        for (int i=0; i < SET_INLINE_HASHES; i++) {
+            if (e->inline_hashes[i] == hash) return 0;
+            if (!e->inline_hashes[i]) {
+                e->inline_hashes[i] = hash;
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    uint32_t mask = e->size - 1;
+    uint32_t i = hash & mask;
+    while (e->hashes[i]) {
+        if (e->hashes[i] == hash) return 0;
+        i = (i + 1) & mask;
+    }
+    e->hashes[i] = hash;
+    return 1;
+}
+
+/**
+ * Moves the inline hashes into a table
+ * @return 0 on success
+ */
+static int exact_spill(exact_set *e) {
+    uint64_t *hashes = calloc(EXACT_INIT_SIZE, sizeof(uint64_t));
+    if (!hashes) return 1;
+    stats_mem_add(MEM_SETS, EXACT_INIT_SIZE * sizeof(uint64_t));
+
+    uint64_t old[SET_INLINE_HASHES];
+    memcpy(old, e->inline_hashes, sizeof(old));
+    e->hashes = hashes;
+    e->size = EXACT_INIT_SIZE;
+    for (int i=0; i < SET_INLINE_HASHES && old[i]; i++) {
+        exact_insert(e, old[i]);
+    }
+    return 0;
+}
+
+/**
+ * Doubles the size of the exact hash table
+ * @return 0 on success
+ */
+static int exact_grow(exact_set *e) {
+    uint64_t *old = e->hashes;
+    uint32_t old_size = e->size;
+    uint64_t *hashes = calloc(old_size * 2, sizeof(uint64_t));
+    if (!hashes) return 1;
+    stats_mem_add(MEM_SETS, old_size * sizeof(uint64_t));
+
+    e->hashes = hashes;
+    e->size = old_size * 2;
+    for (uint32_t i=0; i < old_size; i++) {
+        if (old[i]) exact_insert(e, old[i]);
+    }
+    free(old);
+    return 0;
+}
+
+/**
+ * Checks if another hash fits, keeping the table at
+ * most half full, and grows or spills it if needed
+ * @return 1 if it fits
+ */
+static int exact_fits(exact_set *e) {
+    if (!e->hashes) return e->count < SET_INLINE_HASHES || !exact_spill(e);
+    return (e->count + 1) * 2 <= e->size || !exact_grow(e);
+}
+
+/**
+ * Converts an exact set to an approximate HLL set.
  */
 static void convert_exact_to_approx(set_t *s) {
     // Store the hashes, as HLL initialization
-    // will step on the pointer
-    uint64_t *hashes = s->store.s.hashes;
+    // will step on the pointer and the inline hashes
+    uint64_t inline_hashes[SET_INLINE_HASHES];
+    memcpy(inline_hashes, s->store.s.inline_hashes, sizeof(inline_hashes));
+    uint64_t *table = s->store.s.hashes;
+    uint64_t *hashes = (table) ? table : inline_hashes;
+    uint32_t size = s->store.s.size;
+    unsigned char has_zero = s->store.s.has_zero;
 
     // Initialize the HLL
     s->type = APPROX;
     hll_init(s->store.s.precision, &s->store.h);
 
     // Add each hash to the HLL
-    for (int i=0; i < SET_MAX_EXACT; i++) {
-        hll_add_hash(&s->store.h, hashes[i]);
+    if (has_zero) hll_add_hash(&s->store.h, 0);
+    for (uint32_t i=0; i < size; i++) {
+        if (hashes[i]) hll_add_hash(&s->store.h, hashes[i]);
     }
 
-    // Free the array of hashes
-    free(hashes);
+    // Free the table of hashes
+    if (!table) return;
+    stats_mem_add(MEM_SETS, -(int64_t)(size * sizeof(uint64_t)));
+    free(table);
 }
 
 /**
- * Adds a new key to the set
+ * Adds a new hash to the set
  * @arg s The set to add to
- * @arg key The key to add
+ * @arg hash The hash to add, computed with hash_key
  */
-void set_add(set_t *s, char *key) {
-    uint32_t i;
-    uint64_t out[2];
-    MurmurHash3_x64_128(key, strlen(key), 0, &out);
+void set_add_hash(set_t *s, uint64_t hash) {
+    exact_set *e;
     switch (s->type) {
         case EXACT:
+            e = &s->store.s;
+
             // Check if this element is already added
-            for (i=0; i < s->store.s.count; i++) {
-                if (out[1] == s->store.s.hashes[i]) return;
-            }
+            if (exact_contains(e, hash)) return;
 
-            // Check if we can fit this in the array
-            if (i < SET_MAX_EXACT) {
-                s->store.s.hashes[i] = out[1];
-                s->store.s.count++;
+            // Check if we can fit this in the table
+            if (e->count < e->max_exact && exact_fits(e)) {
+                exact_insert(e, hash);
+                e->count++;
                 return;
             }
 
@@ -90,11 +221,47 @@ void set_add(set_t *s, char *key) {
             convert_exact_to_approx(s);
 
         case APPROX:
-            hll_add_hash(&s->store.h, out[1]);
+            hll_add_hash(&s->store.h, hash);
             break;
     }
 }
 
+/**
+ * Adds a new key to the set
+ * @arg s The set to add to
+ * @arg key The key to add
+ */
+void set_add(set_t *s, char *key) {
+    set_add_hash(s, hash_key(key, strlen(key)));
+}
+
+/**
+ * Merges one set into another
+ * @arg dst The set to merge into
+ * @arg src The set to merge from
+ * @return 0 on success.
+ */
+int set_merge(set_t *dst, set_t *src) {
+    switch (src->type) {
+        case EXACT: {
+            // Add each of the exact hashes
+            uint64_t *hashes = exact_table(&src->store.s);
+            if (src->store.s.has_zero) set_add_hash(dst, 0);
+            for (uint32_t i=0; i < src->store.s.size; i++) {
+                if (hashes[i]) set_add_hash(dst, hashes[i]);
+            }
+            return 0;
+        }
+
+        case APPROX:
+            if (dst->type == EXACT) convert_exact_to_approx(dst);
+            return hll_merge(&dst->store.h, &src->store.h);
+
+        default:
+            abort();
+    }
+}
+
 /**
  * Returns the size of the set. May be approximate.
  * @arg s The set to query
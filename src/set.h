@@ -5,12 +5,19 @@
 #define SET_H
 
 /**
- * This is the maximum number of items
+ * This is the default maximum number of items
  * we represent exactly before switching
  * to a HyperLogLog
  */
 #define SET_MAX_EXACT 64
 
+/**
+ * The number of hashes kept inside the set itself,
+ * before a table is allocated. This fills the space
+ * the union has for an HLL.
+ */
+#define SET_INLINE_HASHES 4
+
 typedef enum {
     EXACT,      // Exact representation, used for small cardinalities
     APPROX      // Approximate representation, used for large cardinalities
@@ -18,8 +25,12 @@ typedef enum {
 
 typedef struct {
     unsigned char precision;
-    uint32_t count;
-    uint64_t *hashes;
+    unsigned char has_zero; // Is the zero hash in the set
+    uint32_t count;         // Number of items
+    uint32_t max_exact;     // Switch to an HLL past this many items
+    uint32_t size;          // Size of the hash table, a power of 2, or SET_INLINE_HASHES
+    uint64_t *hashes;       // Open addressed table of hashes, 0 is empty, NULL while inline
+    uint64_t inline_hashes[SET_INLINE_HASHES]; // The first hashes, 0 is empty
 } exact_set;
 
 typedef struct {
@@ -30,6 +41,14 @@ typedef struct {
     } store;
 } set_t;
 
+/**
+ * Returns the hashes of an exact set, the table or the
+ * inline hashes. There are size slots, the empty ones are 0.
+ */
+static inline uint64_t* exact_table(exact_set *e) {
+    return (e->hashes) ? e->hashes : e->inline_hashes;
+}
+
 /**
  * Initializes a new set
  * @arg precision The precision to use when converting to an HLL
@@ -38,6 +57,16 @@ typedef struct {
  */
 int set_init(unsigned char precision, set_t *s);
 
+/**
+ * Initializes a new set, with a maximum for the
+ * number of items that are counted exactly.
+ * @arg precision The precision to use when converting to an HLL
+ * @arg max_exact The maximum number of items before converting
+ * @arg s The set to initialize
+ * @return 0 on success.
+ */
+int set_init_exact(unsigned char precision, uint32_t max_exact, set_t *s);
+
 /**
  * Destroys the set
  * @return 0 on sucess
@@ -51,6 +80,21 @@ int set_destroy(set_t *s);
  */
 void set_add(set_t *s, char *key);
 
+/**
+ * Adds a new hash to the set
+ * @arg s The set to add to
+ * @arg hash The hash to add, computed with hash_key
+ */
+void set_add_hash(set_t *s, uint64_t hash);
+
+/**
+ * Merges one set into another
+ * @arg dst The set to merge into
+ * @arg src The set to merge from
+ * @return 0 on success.
+ */
+int set_merge(set_t *dst, set_t *src);
+
 /**
  * Returns the size of the set. May be approximate.
  * @arg s The set to query
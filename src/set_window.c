@@ -0,0 +1,186 @@
+/**
+ * This file implements the set windows declared in set_window.h
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "set_window.h"
+#include "hash.h"
+
+// A part of a window, with the sets of the intervals in it
+typedef struct {
+    int64_t epoch;      // The slot of time held, -1 while empty
+    set_t set;
+} window_slot;
+
+// The state of merging one interval
+struct update_info {
+    set_window *w;
+    metrics *m;
+    time_t now;
+    int added;          // The window sets added to the interval
+    int error;
+    char *name;         // The name of a window set, grown as needed
+    size_t name_size;
+    char **idle;        // The sets no longer in any window
+    int num_idle;
+    int max_idle;
+};
+
+int set_window_init(int *windows, int num_windows, int num_slots, set_window *w) {
+    if (num_windows < 1 || num_slots < 1) return -1;
+    for (int i=0; i < num_windows; i++) {
+        if (windows[i] < num_slots || windows[i] % num_slots) return -1;
+    }
+    w->windows = malloc(num_windows * sizeof(int));
+    if (!w->windows) return -1;
+    if (hashmap_init(0, &w->keys)) {
+        free(w->windows);
+        return -1;
+    }
+    memcpy(w->windows, windows, num_windows * sizeof(int));
+    w->num_windows = num_windows;
+    w->num_slots = num_slots;
+    return 0;
+}
+
+// Releases the slots of a set
+static void free_slots(set_window *w, window_slot *slots) {
+    for (int i=0; i < w->num_windows * w->num_slots; i++) {
+        if (slots[i].epoch >= 0) set_destroy(&slots[i].set);
+    }
+    free(slots);
+}
+
+static int free_slots_cb(void *data, const char *key, void *value) {
+    free_slots(data, value);
+    return 0;
+}
+
+int set_window_destroy(set_window *w) {
+    hashmap_iter(w->keys, free_slots_cb, w);
+    hashmap_destroy(w->keys);
+    free(w->windows);
+    return 0;
+}
+
+// Returns the slot of time an interval ending at a time is in.
+// The slots are aligned to their length, and end on their end.
+static inline int64_t slot_epoch(set_window *w, int window, time_t now) {
+    return (int64_t)(now - 1) / (window / w->num_slots);
+}
+
+// The precision of a set, kept when it is merged
+static inline unsigned char set_precision(set_t *s) {
+    return (s->type == EXACT) ? s->store.s.precision : s->store.h.precision;
+}
+
+// Merges the set of an interval into the current slot of each window
+static int merge_set(void *data, const char *key, uint64_t hash, void *value) {
+    struct update_info *info = data;
+    set_window *w = info->w;
+    window_slot **slots;
+    if (hashmap_get_or_insert_hash(w->keys, (char*)key, hash, (void***)&slots)) {
+        *slots = malloc(w->num_windows * w->num_slots * sizeof(window_slot));
+        if (!*slots) {
+            hashmap_delete(w->keys, (char*)key);
+            info->error = 1;
+            return 1;
+        }
+        for (int i=0; i < w->num_windows * w->num_slots; i++) (*slots)[i].epoch = -1;
+    }
+
+    set_t *src = value;
+    for (int i=0; i < w->num_windows; i++) {
+        int64_t epoch = slot_epoch(w, w->windows[i], info->now);
+        window_slot *slot = *slots + i * w->num_slots + epoch % w->num_slots;
+
+        // A late interval may be older than its slot
+        if (slot->epoch > epoch) continue;
+        if (slot->epoch != epoch) {
+            if (slot->epoch >= 0) set_destroy(&slot->set);
+            set_init_exact(set_precision(src), info->m->set_max_exact, &slot->set);
+            slot->epoch = epoch;
+        }
+        set_merge(&slot->set, src);
+    }
+    return 0;
+}
+
+// Adds the union of the slots in each window of a set to the interval
+static int add_windows(void *data, const char *key, void *value) {
+    struct update_info *info = data;
+    set_window *w = info->w;
+    window_slot *slots = value;
+
+    size_t len = strlen(key) + 16;
+    if (len > info->name_size) {
+        char *name = realloc(info->name, len);
+        if (!name) {
+            info->error = 1;
+            return 1;
+        }
+        info->name = name;
+        info->name_size = len;
+    }
+
+    int live = 0;
+    for (int i=0; i < w->num_windows; i++) {
+        int64_t oldest = slot_epoch(w, w->windows[i], info->now) - w->num_slots;
+        set_t *out = NULL;
+        for (int j=0; j < w->num_slots; j++) {
+            window_slot *slot = slots + i * w->num_slots + j;
+            if (slot->epoch < 0 || slot->epoch <= oldest) continue;
+            if (!out) {
+                snprintf(info->name, info->name_size, "%s.%ds", key, w->windows[i]);
+                out = metrics_get_set_hash(info->m, info->name,
+                        hash_key(info->name, strlen(info->name)));
+                info->added++;
+            }
+            set_merge(out, &slot->set);
+        }
+        if (out) live = 1;
+    }
+    if (live) return 0;
+
+    // Not in any window, the set is released after the iteration
+    if (info->num_idle == info->max_idle) {
+        int max = (info->max_idle) ? 2 * info->max_idle : 64;
+        char **idle = realloc(info->idle, max * sizeof(char*));
+        if (!idle) return 0;
+        info->idle = idle;
+        info->max_idle = max;
+    }
+    char *name = strdup(key);
+    if (name) info->idle[info->num_idle++] = name;
+    return 0;
+}
+
+int set_window_update(set_window *w, metrics *m, time_t now) {
+    struct update_info info;
+    memset(&info, 0, sizeof(info));
+    info.w = w;
+    info.m = m;
+    info.now = now;
+
+    // Merge the interval before its window sets are added to it
+    int res = hashmap_iter_hash(m->sets, merge_set, &info);
+    if (!res) res = hashmap_iter(w->keys, add_windows, &info);
+
+    void *slots;
+    for (int i=0; i < info.num_idle; i++) {
+        if (!hashmap_get(w->keys, info.idle[i], &slots)) {
+            free_slots(w, slots);
+            hashmap_delete(w->keys, info.idle[i]);
+        }
+        free(info.idle[i]);
+    }
+    free(info.idle);
+    free(info.name);
+    if (res || info.error) return -1;
+    return info.added;
+}
+
+uint32_t set_window_size(set_window *w) {
+    return hashmap_size(w->keys);
+}
@@ -0,0 +1,64 @@
+/**
+ * This module keeps the unique counts of the sets over windows
+ * longer than the flush interval, such as an hour or a day, from
+ * the sets of the intervals instead of the raw values.
+ *
+ * Each window is a ring of slots, each covering an equal part of
+ * the window. The set of every interval is merged into the slot
+ * of its time, and a slot is emptied once the ring comes around
+ * to it again. The count of a window is the union of the slots
+ * that are still in it, so the window slides a slot at a time,
+ * and covers between one slot less than its length and its length.
+ *
+ * The windows are added to each flush as sets of their own, named
+ * after the set with the seconds of the window, as "users.3600s".
+ * A set window is not thread safe.
+ */
+#ifndef SET_WINDOW_H
+#define SET_WINDOW_H
+#include <stdint.h>
+#include <time.h>
+#include "hashmap.h"
+#include "metrics.h"
+
+typedef struct {
+    hashmap *keys;      // The name of a set -> its slots
+    int num_windows;
+    int *windows;       // The seconds of each window
+    int num_slots;      // The slots of each window
+} set_window;
+
+/**
+ * Initializes the set windows
+ * @arg windows The seconds of each window, copied
+ * @arg num_windows The number of windows, at least 1
+ * @arg num_slots The slots of each window, which must
+ * divide each of the windows
+ * @arg w The set windows to initialize
+ * @return 0 on success.
+ */
+int set_window_init(int *windows, int num_windows, int num_slots, set_window *w);
+
+/**
+ * Destroys the set windows, and the sets they hold
+ * @return 0 on success.
+ */
+int set_window_destroy(set_window *w);
+
+/**
+ * Merges the sets of an interval into the slots of their windows,
+ * and adds the windows of every set that is in one to the interval.
+ * The sets that are no longer in any window are released.
+ * @arg m The merged metrics of the interval to be streamed
+ * @arg now The end of the interval. An interval older than
+ * the slots of its window is left out of it.
+ * @return The number of window sets added, or -1 on error.
+ */
+int set_window_update(set_window *w, metrics *m, time_t now);
+
+/**
+ * Returns the number of sets with windows
+ */
+uint32_t set_window_size(set_window *w);
+
+#endif
@@ -0,0 +1,196 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "shared_map.h"
+#include "stats.h"
+
+// The kinds of the keys, a counter and a gauge may share a name
+#define KIND_COUNTER 1
+#define KIND_GAUGE 2
+
+typedef struct {
+    uint64_t tag;       // The hash with the low bit set, 0 while empty
+    uint64_t hash;
+    char *key;          // Stored once the slot is set up, NULL until then
+    int kind;
+    union {
+        counter c;
+        shared_gauge g;
+    } v;
+} shared_slot;
+
+struct shared_map {
+    shared_slot *slots;
+    uint32_t mask;
+    uint32_t max_keys;
+    uint32_t num_keys;      // Keys claimed, including those being set up
+};
+
+// The key of a slot whose name could not be copied
+static char LOST_KEY[] = "";
+
+int shared_map_create(uint32_t max_keys, shared_map **s) {
+    if (!max_keys || max_keys > (1u << 30)) return -1;
+
+    // At most half the slots are used, so a probe always ends
+    uint32_t size = 2;
+    while (size < 2 * max_keys) size *= 2;
+    shared_map *map = malloc(sizeof(shared_map));
+    if (!map) return -1;
+    map->slots = calloc(size, sizeof(shared_slot));
+    if (!map->slots) {
+        free(map);
+        return -1;
+    }
+    stats_mem_add(MEM_MAPS, (int64_t)size * sizeof(shared_slot));
+    map->mask = size - 1;
+    map->max_keys = max_keys;
+    map->num_keys = 0;
+    *s = map;
+    return 0;
+}
+
+void shared_map_destroy(shared_map *s) {
+    shared_map_clear(s);
+    stats_mem_add(MEM_MAPS, -(int64_t)(s->mask + 1) * (int64_t)sizeof(shared_slot));
+    free(s->slots);
+    free(s);
+}
+
+void shared_map_clear(shared_map *s) {
+    if (!s->num_keys) return;
+    for (uint32_t i=0; i <= s->mask; i++) {
+        char *key = s->slots[i].key;
+        if (!key || key == LOST_KEY) continue;
+        stats_mem_add(MEM_MAPS, -(int64_t)(strlen(key) + 1));
+        free(key);
+    }
+    memset(s->slots, 0, (size_t)(s->mask + 1) * sizeof(shared_slot));
+    s->num_keys = 0;
+}
+
+/**
+ * Finds the slot of a key, claiming and setting up a new one
+ * if it is not in the map. A thread that finds a slot being
+ * set up waits for its key.
+ * @return The slot, or NULL if the map is full.
+ */
+static shared_slot* shared_slot_for(shared_map *s, char *name, uint64_t hash, int kind) {
+    uint64_t tag = hash | 1;
+    for (uint32_t i = hash & s->mask;; i = (i + 1) & s->mask) {
+        shared_slot *slot = s->slots + i;
+        uint64_t cur = __atomic_load_n(&slot->tag, __ATOMIC_ACQUIRE);
+        if (!cur) {
+            // Reserve room for a key before claiming the slot
+            if (__atomic_add_fetch(&s->num_keys, 1, __ATOMIC_RELAXED) > s->max_keys) {
+                __atomic_sub_fetch(&s->num_keys, 1, __ATOMIC_RELAXED);
+                return NULL;
+            }
+            if (__atomic_compare_exchange_n(&slot->tag, &cur, tag, 0,
+                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                slot->hash = hash;
+                slot->kind = kind;
+                if (kind == KIND_COUNTER) {
+                    init_counter(&slot->v.c);
+                    slot->v.c.min = INFINITY;
+                    slot->v.c.max = -INFINITY;
+                }
+                char *key = strdup(name);
+                if (key) stats_mem_add(MEM_MAPS, strlen(key) + 1);
+                __atomic_store_n(&slot->key, (key) ? key : LOST_KEY, __ATOMIC_RELEASE);
+                return (key) ? slot : NULL;
+            }
+
+            // Another thread claimed it, cur is now its tag
+            __atomic_sub_fetch(&s->num_keys, 1, __ATOMIC_RELAXED);
+        }
+        if (cur != tag) continue;
+
+        // The slot is only used once its key is stored
+        char *key;
+        while (!(key = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE)));
+        if (slot->kind == kind && !strcmp(key, name)) return slot;
+    }
+}
+
+// Adds to a double with a compare and swap
+static inline void atomic_add_double(double *d, double val) {
+    double cur, next;
+    __atomic_load(d, &cur, __ATOMIC_RELAXED);
+    do {
+        next = cur + val;
+    } while (!__atomic_compare_exchange(d, &cur, &next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Lowers a double to a value, if it is below
+static inline void atomic_min_double(double *d, double val) {
+    double cur;
+    __atomic_load(d, &cur, __ATOMIC_RELAXED);
+    while (val < cur && !__atomic_compare_exchange(d, &cur, &val, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Raises a double to a value, if it is above
+static inline void atomic_max_double(double *d, double val) {
+    double cur;
+    __atomic_load(d, &cur, __ATOMIC_RELAXED);
+    while (val > cur && !__atomic_compare_exchange(d, &cur, &val, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+int shared_map_add_counter(shared_map *s, char *name, uint64_t hash, double val, uint64_t count) {
+    shared_slot *slot = shared_slot_for(s, name, hash, KIND_COUNTER);
+    if (!slot) return -1;
+    counter *c = &slot->v.c;
+    atomic_min_double(&c->min, val);
+    atomic_max_double(&c->max, val);
+    atomic_add_double(&c->sum, val * count);
+    atomic_add_double(&c->squared_sum, pow(val, 2) * count);
+    __atomic_add_fetch(&c->count, count, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int shared_map_update_gauge(shared_map *s, char *name, uint64_t hash, double val, bool delta) {
+    shared_slot *slot = shared_slot_for(s, name, hash, KIND_GAUGE);
+    if (!slot) return -1;
+    shared_gauge *g = &slot->v.g;
+    if (delta) {
+        atomic_add_double(&g->value, val);
+    } else {
+        __atomic_store(&g->value, &val, __ATOMIC_RELAXED);
+        __atomic_store_n(&g->is_set, true, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+int shared_map_iter(shared_map *s, const char *prefix, void *data, shared_map_callback cb) {
+    size_t prefix_len = (prefix) ? strlen(prefix) : 0;
+    counter c;
+    shared_gauge g;
+    int res;
+    for (uint32_t i=0; i <= s->mask; i++) {
+        shared_slot *slot = s->slots + i;
+        char *key = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+        if (!key || key == LOST_KEY) continue;
+        if (prefix && strncmp(key, prefix, prefix_len)) continue;
+
+        // Read each field atomically, the updates may still run
+        if (slot->kind == KIND_COUNTER) {
+            c.count = __atomic_load_n(&slot->v.c.count, __ATOMIC_RELAXED);
+            if (!c.count) continue;
+            __atomic_load(&slot->v.c.sum, &c.sum, __ATOMIC_RELAXED);
+            __atomic_load(&slot->v.c.squared_sum, &c.squared_sum, __ATOMIC_RELAXED);
+            __atomic_load(&slot->v.c.min, &c.min, __ATOMIC_RELAXED);
+            __atomic_load(&slot->v.c.max, &c.max, __ATOMIC_RELAXED);
+            res = cb(data, key, slot->hash, &c, NULL);
+        } else {
+            __atomic_load(&slot->v.g.value, &g.value, __ATOMIC_RELAXED);
+            g.is_set = __atomic_load_n(&slot->v.g.is_set, __ATOMIC_RELAXED);
+            res = cb(data, key, slot->hash, NULL, &g);
+        }
+        if (res) return res;
+    }
+    return 0;
+}
+
+uint32_t shared_map_size(shared_map *s) {
+    return __atomic_load_n(&s->num_keys, __ATOMIC_RELAXED);
+}
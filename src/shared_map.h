@@ -0,0 +1,87 @@
+/**
+ * A map of counters and gauges shared by all the ingest workers,
+ * so each key is kept once instead of once per shard. The table
+ * is open addressed with a fixed number of slots, which are
+ * claimed with a compare and swap, and the values are updated
+ * with atomic adds and compare and swaps in place. An update
+ * of a new key fails once the map holds its most keys, and the
+ * caller keeps the key in its own shard instead.
+ */
+#ifndef SHARED_MAP_H
+#define SHARED_MAP_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "counter.h"
+
+/**
+ * Opaque map reference
+ */
+typedef struct shared_map shared_map;
+
+// The value of a gauge, as the gauges of the metrics
+typedef struct {
+    double value;
+    bool is_set;    // Was an absolute value set, or only deltas
+} shared_gauge;
+
+/**
+ * Callback for the keys of a map. Exactly one of the
+ * counter and the gauge is set.
+ * @return 0 to continue.
+ */
+typedef int(*shared_map_callback)(void *data, const char *key, uint64_t hash,
+        counter *c, shared_gauge *g);
+
+/**
+ * Creates a map
+ * @arg max_keys The most keys held, counters and gauges
+ * @arg s Output, the map
+ * @return 0 on success.
+ */
+int shared_map_create(uint32_t max_keys, shared_map **s);
+
+/**
+ * Destroys a map, and the keys it holds
+ */
+void shared_map_destroy(shared_map *s);
+
+/**
+ * Removes every key. No updates may be in progress.
+ */
+void shared_map_clear(shared_map *s);
+
+/**
+ * Adds the same sample many times to a counter, from any thread
+ * @arg name The name of the counter, copied when it is new
+ * @arg hash The hash of the name, from hash_key
+ * @arg val The sample value
+ * @arg count The number of samples
+ * @return 0 on success, -1 if the map is full
+ */
+int shared_map_add_counter(shared_map *s, char *name, uint64_t hash, double val, uint64_t count);
+
+/**
+ * Sets a gauge, or adds a delta to it, from any thread
+ * @arg name The name of the gauge, copied when it is new
+ * @arg hash The hash of the name, from hash_key
+ * @arg val The value or the delta
+ * @arg delta Is this a delta update
+ * @return 0 on success, -1 if the map is full
+ */
+int shared_map_update_gauge(shared_map *s, char *name, uint64_t hash, double val, bool delta);
+
+/**
+ * Calls back for the keys of the map, optionally only those
+ * with a prefix. It may run along with updates, which are
+ * then seen in part.
+ * @arg prefix Only the names that start with this, or NULL for all
+ * @return 0 on success, or the first non-zero result of the callback.
+ */
+int shared_map_iter(shared_map *s, const char *prefix, void *data, shared_map_callback cb);
+
+/**
+ * Returns the number of keys in the map
+ */
+uint32_t shared_map_size(shared_map *s);
+
+#endif
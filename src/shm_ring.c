@@ -0,0 +1,161 @@
+/**
+ * This file defines the methods declared in shm_ring.h
+ * The producer and consumer each own one cursor, and only
+ * read the other with acquire semantics, so the ring needs
+ * no locks. A frame is visible once the head is stored.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shm_ring.h"
+
+struct shm_ring {
+    shm_ring_header *hdr;   // The mapped header
+    size_t hdr_size;
+    char *data;             // The data, mapped twice
+    uint32_t size;
+};
+
+/**
+ * Maps the header and the mirrored data of a ring file.
+ * @return 0 on success.
+ */
+static int map_ring(int fd, uint32_t size, uint32_t data_offset, shm_ring *r) {
+    r->hdr_size = data_offset;
+    r->size = size;
+    r->hdr = mmap(NULL, data_offset, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (r->hdr == MAP_FAILED) {
+        r->hdr = NULL;
+        return -1;
+    }
+
+    // Reserve the address space, then map the data twice over it
+    char *addr = mmap(NULL, 2 * (size_t)size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) return -1;
+    if (mmap(addr, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, data_offset) == MAP_FAILED ||
+        mmap(addr + size, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, data_offset) == MAP_FAILED) {
+        munmap(addr, 2 * (size_t)size);
+        return -1;
+    }
+    r->data = addr;
+    return 0;
+}
+
+// Checks that a header describes a ring of this version
+static int valid_header(shm_ring_header *hdr, off_t file_size) {
+    return hdr->magic == SHM_RING_MAGIC && hdr->version == SHM_RING_VERSION &&
+        hdr->size && !(hdr->size & (hdr->size - 1)) &&
+        (off_t)hdr->data_offset + hdr->size <= file_size &&
+        hdr->head - hdr->tail < hdr->size;
+}
+
+int shm_ring_create(char *path, uint32_t size, shm_ring **r) {
+    long page = sysconf(_SC_PAGESIZE);
+    if (!size || (size & (size - 1)) || size % page) {
+        syslog(LOG_ERR, "The shm ring size must be a power of two multiple of the page size!");
+        return -1;
+    }
+    int fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0666);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Failed to open shm ring '%s'! Err: %s", path, strerror(errno));
+        return -1;
+    }
+
+    // Reuse a ring of the same size, its unconsumed frames are kept
+    struct stat st;
+    shm_ring_header old;
+    int reuse = !fstat(fd, &st) && pread(fd, &old, sizeof(old), 0) == sizeof(old) &&
+        valid_header(&old, st.st_size) && old.size == size && old.data_offset == page;
+    // Otherwise truncate first, so the new ring starts zeroed
+    if (!reuse && (ftruncate(fd, 0) || ftruncate(fd, page + (off_t)size))) {
+        syslog(LOG_ERR, "Failed to size shm ring '%s'! Err: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    shm_ring *ring = calloc(1, sizeof(shm_ring));
+    int res = map_ring(fd, size, page, ring);
+    close(fd);
+    if (res) {
+        syslog(LOG_ERR, "Failed to map shm ring '%s'! Err: %s", path, strerror(errno));
+        shm_ring_close(ring);
+        return -1;
+    }
+
+    // Publish the header last, producers check the magic
+    if (!reuse) {
+        ring->hdr->version = SHM_RING_VERSION;
+        ring->hdr->size = size;
+        ring->hdr->data_offset = page;
+        __atomic_store_n(&ring->hdr->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+    }
+    *r = ring;
+    return 0;
+}
+
+int shm_ring_open(char *path, shm_ring **r) {
+    int fd = open(path, O_RDWR|O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    shm_ring_header hdr;
+    if (fstat(fd, &st) || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+            !valid_header(&hdr, st.st_size)) {
+        close(fd);
+        return -1;
+    }
+    shm_ring *ring = calloc(1, sizeof(shm_ring));
+    int res = map_ring(fd, hdr.size, hdr.data_offset, ring);
+    close(fd);
+    if (res) {
+        shm_ring_close(ring);
+        return -1;
+    }
+    *r = ring;
+    return 0;
+}
+
+int shm_ring_write(shm_ring *r, const char *buf, uint32_t len) {
+    uint64_t head = r->hdr->head;
+    uint64_t tail = __atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE);
+
+    // Keep a byte free, a full ring would look empty to the parser
+    if (head - tail + len >= r->size) return -1;
+    memcpy(r->data + (head & (r->size - 1)), buf, len);
+    __atomic_store_n(&r->hdr->head, head + len, __ATOMIC_RELEASE);
+    return 0;
+}
+
+char* shm_ring_data(shm_ring *r) {
+    return r->data;
+}
+
+uint32_t shm_ring_size(shm_ring *r) {
+    return r->size;
+}
+
+uint64_t shm_ring_head(shm_ring *r) {
+    return __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+}
+
+uint64_t shm_ring_tail(shm_ring *r) {
+    return __atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE);
+}
+
+void shm_ring_publish(shm_ring *r, uint64_t head) {
+    __atomic_store_n(&r->hdr->head, head, __ATOMIC_RELEASE);
+}
+
+void shm_ring_consume(shm_ring *r, uint64_t bytes) {
+    __atomic_store_n(&r->hdr->tail, r->hdr->tail + bytes, __ATOMIC_RELEASE);
+}
+
+void shm_ring_close(shm_ring *r) {
+    if (r->hdr) munmap(r->hdr, r->hdr_size);
+    if (r->data) munmap(r->data, 2 * (size_t)r->size);
+    free(r);
+}
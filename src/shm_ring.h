@@ -0,0 +1,116 @@
+/**
+ * A single-producer, single-consumer ring in shared memory,
+ * for clients on the same host. The producer copies frames of
+ * the binary protocol into the ring and advances the head, and
+ * statsite parses them in place and advances the tail, so
+ * neither side makes a syscall per frame.
+ *
+ * The ring is a file, normally under /dev/shm. Its first page is
+ * the header, followed by the data, which is mapped twice back to
+ * back so frames that wrap around are still contiguous. Clients
+ * may include this header and use shm_ring_open and shm_ring_write,
+ * or follow the layout of shm_ring_header themselves.
+ *
+ * The output ring of the flushes has the same layout, with statsite
+ * as the producer. Sinks open it with shm_ring_open, read the data
+ * up to shm_ring_head in place and give it back with shm_ring_consume.
+ */
+#ifndef SHM_RING_H
+#define SHM_RING_H
+#include <stdint.h>
+
+#define SHM_RING_MAGIC 0x474e4952
+#define SHM_RING_VERSION 1
+
+/**
+ * The header at the start of the file. The head and
+ * tail are byte counts that only increase, the offset
+ * in the data is the count modulo the size.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;          // Bytes of data, a power of two
+    uint32_t data_offset;   // Offset of the data in the file, one page
+    char pad0[48];
+    uint64_t head;          // Bytes written, only stored by the producer
+    char pad1[56];
+    uint64_t tail;          // Bytes consumed, only stored by statsite
+    char pad2[56];
+} shm_ring_header;
+
+/**
+ * Opaque ring reference
+ */
+typedef struct shm_ring shm_ring;
+
+/**
+ * Creates a ring, or reuses the one at the path if it has the
+ * same size, so frames left by an earlier run are still consumed.
+ * @arg path The path of the ring file
+ * @arg size The data size, a power of two multiple of the page size
+ * @arg r Output, the ring
+ * @return 0 on success
+ */
+int shm_ring_create(char *path, uint32_t size, shm_ring **r);
+
+/**
+ * Opens an existing ring, used by the producer.
+ * @arg path The path of the ring file
+ * @arg r Output, the ring
+ * @return 0 on success
+ */
+int shm_ring_open(char *path, shm_ring **r);
+
+/**
+ * Writes a frame to the ring. The frame is written whole or not
+ * at all, and there can only be one producer at a time.
+ * @arg buf The frame to write
+ * @arg len The length of the frame
+ * @return 0 on success, -1 if there is not enough room.
+ */
+int shm_ring_write(shm_ring *r, const char *buf, uint32_t len);
+
+/**
+ * Returns the data of the ring. The data is mapped
+ * twice, so reads may continue past the size.
+ */
+char* shm_ring_data(shm_ring *r);
+
+/**
+ * Returns the size of the data
+ */
+uint32_t shm_ring_size(shm_ring *r);
+
+/**
+ * Returns the bytes written to the ring, the
+ * frames before it are visible to the consumer.
+ */
+uint64_t shm_ring_head(shm_ring *r);
+
+/**
+ * Returns the bytes consumed from the ring
+ */
+uint64_t shm_ring_tail(shm_ring *r);
+
+/**
+ * Makes the bytes written to the data up to a
+ * head visible to the consumer, for producers that
+ * copy into shm_ring_data themselves.
+ * @arg head The bytes written, at most a size past the tail
+ */
+void shm_ring_publish(shm_ring *r, uint64_t head);
+
+/**
+ * Gives bytes back to the producer.
+ * @arg bytes The number of bytes consumed
+ */
+void shm_ring_consume(shm_ring *r, uint64_t bytes);
+
+/**
+ * Unmaps a ring. The file is left in place, for
+ * the producers and the next run.
+ */
+void shm_ring_close(shm_ring *r);
+
+#endif
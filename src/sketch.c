@@ -0,0 +1,605 @@
+/**
+ * This file defines the methods declared in sketch.h
+ * Every field is 1, 4 or 8 bytes wide, and the arrays are of
+ * 4 or 8 byte words, so a little-endian host writes and reads
+ * the arrays directly. Only a big-endian host swaps them.
+ *
+ * counter: kind, version, count u64, sum, squared_sum, min, max
+ * set:     kind, version, precision, type, then either has_zero,
+ *          max_exact u32, num u32 and the hashes, or an HLL sketch
+ * hll:     kind, version, precision, layout, num u32, pad u8, the
+ *          padding, and then num sparse entries or register bytes
+ * timer:   kind, version, engine, mode, count u64, sum, squared_sum,
+ *          the engine parameters, and the raw samples or the sketch.
+ *          An HDR sketch is its total u64, min, max, first u32 and
+ *          num u32, and the num counts from the first bucket used.
+ *          A timer without quantiles has its min and max as its
+ *          parameters, and nothing after them.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "sketch.h"
+#include "stats.h"
+
+// The layouts of an HLL
+#define HLL_LAYOUT_SPARSE 0     // Sorted u32 (index, value) entries
+#define HLL_LAYOUT_PACKED 1     // Five 6 bit registers to a u32 word
+#define HLL_LAYOUT_BYTES 2      // A byte per register
+
+#ifdef HLL_BYTE_REGISTERS
+#define HLL_LAYOUT_NATIVE HLL_LAYOUT_BYTES
+#else
+#define HLL_LAYOUT_NATIVE HLL_LAYOUT_PACKED
+#endif
+
+// The registers of an HLL are aligned to this
+#define HLL_ALIGN 8
+
+// Timers hold either the raw samples or the sketch
+#define TIMER_MODE_EXACT 0
+#define TIMER_MODE_SKETCH 1
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SKETCH_LITTLE_ENDIAN 1
+#else
+#define SKETCH_LITTLE_ENDIAN 0
+#endif
+
+// Reads through an encoded sketch
+typedef struct {
+    const char *start;
+    const char *pos;
+    const char *end;
+} cursor;
+
+/**
+ * Swaps the bytes of each word, on a big-endian host
+ * @arg words The words to swap
+ * @arg num The number of words
+ * @arg size The size of a word, 4 or 8
+ */
+static void swap_words(void *words, size_t num, size_t size) {
+    if (SKETCH_LITTLE_ENDIAN) return;
+    unsigned char *b = words, tmp;
+    for (size_t i=0; i < num; i++, b += size) {
+        for (size_t j=0; j < size / 2; j++) {
+            tmp = b[j];
+            b[j] = b[size - 1 - j];
+            b[size - 1 - j] = tmp;
+        }
+    }
+}
+
+/**
+ * Writes an array of words, little-endian
+ * @arg f The stream to write to
+ * @arg words The words to write
+ * @arg num The number of words
+ * @arg size The size of a word, 1, 4 or 8
+ */
+static void put_words(FILE *f, const void *words, size_t num, size_t size) {
+    if (SKETCH_LITTLE_ENDIAN || size == 1) {
+        fwrite(words, size, num, f);
+        return;
+    }
+    unsigned char word[8];
+    for (size_t i=0; i < num; i++) {
+        memcpy(word, (const char*)words + i * size, size);
+        swap_words(word, 1, size);
+        fwrite(word, size, 1, f);
+    }
+}
+
+static void put_u8(FILE *f, uint8_t v) {
+    fwrite(&v, 1, 1, f);
+}
+
+static void put_u32(FILE *f, uint32_t v) {
+    put_words(f, &v, 1, sizeof(v));
+}
+
+static void put_u64(FILE *f, uint64_t v) {
+    put_words(f, &v, 1, sizeof(v));
+}
+
+static void put_f64(FILE *f, double v) {
+    put_words(f, &v, 1, sizeof(v));
+}
+
+/**
+ * Copies the next words of the sketch
+ * @return 0 on success, -1 if the sketch is too short.
+ */
+static int get_words(cursor *c, void *out, size_t num, size_t size) {
+    if (num > (size_t)(c->end - c->pos) / size) return -1;
+    memcpy(out, c->pos, num * size);
+    c->pos += num * size;
+    if (size > 1) swap_words(out, num, size);
+    return 0;
+}
+
+/**
+ * Copies an array of the next words into a new buffer
+ * @return The buffer, or NULL if the sketch is too short.
+ */
+static void* get_array(cursor *c, size_t num, size_t size) {
+    if (num > (size_t)(c->end - c->pos) / size) return NULL;
+    void *out = malloc((num) ? num * size : 1);
+    if (out && get_words(c, out, num, size)) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+static int get_u8(cursor *c, uint8_t *v) {
+    return get_words(c, v, 1, sizeof(*v));
+}
+
+static int get_u32(cursor *c, uint32_t *v) {
+    return get_words(c, v, 1, sizeof(*v));
+}
+
+static int get_u64(cursor *c, uint64_t *v) {
+    return get_words(c, v, 1, sizeof(*v));
+}
+
+static int get_f64(cursor *c, double *v) {
+    return get_words(c, v, 1, sizeof(*v));
+}
+
+/**
+ * Checks the kind and version that start each sketch
+ * @return 0 if they match, -1 otherwise.
+ */
+static int get_kind(cursor *c, sketch_kind kind) {
+    uint8_t k, version;
+    if (get_u8(c, &k) || get_u8(c, &version)) return -1;
+    return (k == kind && version == SKETCH_VERSION) ? 0 : -1;
+}
+
+static void put_kind(FILE *f, sketch_kind kind) {
+    put_u8(f, kind);
+    put_u8(f, SKETCH_VERSION);
+}
+
+// Number of registers at a precision
+static uint32_t num_registers(unsigned char precision) {
+    return (uint32_t)1 << precision;
+}
+
+// Size in bytes of the registers of a layout
+static uint32_t layout_bytes(int layout, unsigned char precision) {
+    if (layout == HLL_LAYOUT_BYTES) return num_registers(precision);
+    return (num_registers(precision) + 4) / 5 * sizeof(uint32_t);
+}
+
+int sketch_kind_of(const char *buf, size_t len) {
+    if (len < 2 || (uint8_t)buf[1] != SKETCH_VERSION) return -1;
+    return (uint8_t)buf[0];
+}
+
+int sketch_encode_counter(FILE *f, counter *c) {
+    put_kind(f, SKETCH_COUNTER);
+    put_u64(f, c->count);
+    put_f64(f, c->sum);
+    put_f64(f, c->squared_sum);
+    put_f64(f, c->min);
+    put_f64(f, c->max);
+    return ferror(f) ? -1 : 0;
+}
+
+int sketch_decode_counter(const char *buf, size_t len, counter *c) {
+    cursor cur = {buf, buf, buf + len};
+    if (get_kind(&cur, SKETCH_COUNTER) ||
+        get_u64(&cur, &c->count) ||
+        get_f64(&cur, &c->sum) ||
+        get_f64(&cur, &c->squared_sum) ||
+        get_f64(&cur, &c->min) ||
+        get_f64(&cur, &c->max)) return -1;
+    return cur.pos - cur.start;
+}
+
+int sketch_encode_hll(FILE *f, hll_t *h) {
+    int dense = (h->registers != NULL);
+    put_kind(f, SKETCH_HLL);
+    put_u8(f, h->precision);
+    put_u8(f, (dense) ? HLL_LAYOUT_NATIVE : HLL_LAYOUT_SPARSE);
+    put_u32(f, (dense) ? hll_dense_bytes(h->precision) : h->sparse_len);
+
+    // Pad the registers to an aligned offset of the stream
+    long pos = ftell(f);
+    uint8_t pad = (pos < 0) ? 0 : (HLL_ALIGN - (pos + 1) % HLL_ALIGN) % HLL_ALIGN;
+    put_u8(f, pad);
+    const char zeros[HLL_ALIGN] = {0};
+    fwrite(zeros, 1, pad, f);
+
+    if (dense)
+        put_words(f, h->registers, hll_dense_bytes(h->precision) / sizeof(hll_register), sizeof(hll_register));
+    else
+        put_words(f, h->sparse, h->sparse_len, sizeof(uint32_t));
+    return ferror(f) ? -1 : 0;
+}
+
+// The fixed fields of an encoded HLL
+typedef struct {
+    uint8_t precision;
+    uint8_t layout;
+    uint32_t num;
+} hll_fields;
+
+/**
+ * Reads the fields of an encoded HLL, leaving the
+ * cursor at the start of its entries or registers
+ * @return 0 on success, -1 if it is not valid.
+ */
+static int get_hll_fields(cursor *c, hll_fields *fields) {
+    uint8_t pad;
+    if (get_kind(c, SKETCH_HLL) ||
+        get_u8(c, &fields->precision) ||
+        get_u8(c, &fields->layout) ||
+        get_u32(c, &fields->num) ||
+        get_u8(c, &pad)) return -1;
+    if (pad >= HLL_ALIGN || (size_t)(c->end - c->pos) < pad) return -1;
+    c->pos += pad;
+
+    if (fields->precision < HLL_MIN_PRECISION || fields->precision > HLL_MAX_PRECISION) return -1;
+    if (fields->layout == HLL_LAYOUT_SPARSE) {
+        if (fields->num > (size_t)(c->end - c->pos) / sizeof(uint32_t)) return -1;
+    } else if (fields->layout == HLL_LAYOUT_PACKED || fields->layout == HLL_LAYOUT_BYTES) {
+        if (fields->num != layout_bytes(fields->layout, fields->precision)) return -1;
+        if ((size_t)(c->end - c->pos) < fields->num) return -1;
+    } else
+        return -1;
+    return 0;
+}
+
+/**
+ * Decodes the HLL after its fields into a new HLL
+ * @return 0 on success, -1 if it is not valid.
+ */
+static int decode_hll(cursor *c, hll_fields *fields, hll_t *h) {
+    if (hll_init(fields->precision, h)) return -1;
+    uint32_t num_reg = num_registers(fields->precision);
+
+    // The same layout is copied as is
+    if (fields->layout == HLL_LAYOUT_NATIVE) {
+        h->registers = get_array(c, fields->num / sizeof(hll_register), sizeof(hll_register));
+        if (!h->registers) return -1;
+        stats_mem_add(MEM_SETS, fields->num);
+        hll_recount(h);
+        return 0;
+    }
+
+    // Rebuild the sparse list, or the registers of the other layout
+    uint32_t word = 0;
+    uint8_t val = 0;
+    if (fields->layout == HLL_LAYOUT_SPARSE) {
+        for (uint32_t i=0; i < fields->num; i++) {
+            get_u32(c, &word);
+            if ((word >> 8) >= num_reg) goto INVALID;
+            if (word & 0xff) hll_set_max(h, word >> 8, word & 0xff);
+        }
+    } else if (fields->layout == HLL_LAYOUT_PACKED) {
+        for (uint32_t i=0; i < num_reg; i++) {
+            if (i % 5 == 0) get_u32(c, &word);
+            val = (word >> 6 * (i % 5)) & 0x3f;
+            if (val) hll_set_max(h, i, val);
+        }
+    } else {
+        for (uint32_t i=0; i < num_reg; i++) {
+            get_u8(c, &val);
+            if (val > 0x3f) goto INVALID;
+            if (val) hll_set_max(h, i, val);
+        }
+    }
+    return 0;
+
+INVALID:
+    hll_destroy(h);
+    return -1;
+}
+
+/**
+ * Views the dense registers after the fields of an HLL
+ * @return 0 on success, -1 if they cannot be viewed.
+ */
+static int view_hll(cursor *c, hll_fields *fields, hll_t *h) {
+    if (!SKETCH_LITTLE_ENDIAN && sizeof(hll_register) > 1) return -1;
+    if (fields->layout != HLL_LAYOUT_NATIVE) return -1;
+    if ((uintptr_t)c->pos % sizeof(hll_register)) return -1;
+    if (hll_init(fields->precision, h)) return -1;
+    h->registers = (hll_register*)c->pos;
+    c->pos += fields->num;
+    hll_recount(h);
+    return 0;
+}
+
+int sketch_decode_hll(const char *buf, size_t len, hll_t *h) {
+    cursor cur = {buf, buf, buf + len};
+    hll_fields fields;
+    if (get_hll_fields(&cur, &fields) || decode_hll(&cur, &fields, h)) return -1;
+    return cur.pos - cur.start;
+}
+
+int sketch_view_hll(const char *buf, size_t len, hll_t *h) {
+    cursor cur = {buf, buf, buf + len};
+    hll_fields fields;
+    if (get_hll_fields(&cur, &fields) || view_hll(&cur, &fields, h)) return -1;
+    return cur.pos - cur.start;
+}
+
+int sketch_encode_set(FILE *f, set_t *s) {
+    put_kind(f, SKETCH_SET);
+    if (s->type == APPROX) {
+        put_u8(f, s->store.h.precision);
+        put_u8(f, APPROX);
+        return sketch_encode_hll(f, &s->store.h);
+    }
+
+    exact_set *e = &s->store.s;
+    uint64_t *hashes = exact_table(e);
+    put_u8(f, e->precision);
+    put_u8(f, EXACT);
+    put_u8(f, e->has_zero);
+    put_u32(f, e->max_exact);
+    put_u32(f, e->count - e->has_zero);
+    for (uint32_t i=0; i < e->size; i++) {
+        if (hashes[i]) put_u64(f, hashes[i]);
+    }
+    return ferror(f) ? -1 : 0;
+}
+
+/**
+ * Reads the fields of an encoded set
+ * @return 0 on success, -1 if it is not valid.
+ */
+static int get_set_fields(cursor *c, uint8_t *precision, uint8_t *type) {
+    if (get_kind(c, SKETCH_SET) || get_u8(c, precision) || get_u8(c, type)) return -1;
+    return (*type == EXACT || *type == APPROX) ? 0 : -1;
+}
+
+int sketch_decode_set(const char *buf, size_t len, set_t *s) {
+    cursor cur = {buf, buf, buf + len};
+    uint8_t precision, type;
+    if (get_set_fields(&cur, &precision, &type)) return -1;
+
+    if (type == APPROX) {
+        hll_fields fields;
+        if (get_hll_fields(&cur, &fields) || fields.precision != precision) return -1;
+        if (decode_hll(&cur, &fields, &s->store.h)) return -1;
+        s->type = APPROX;
+        return cur.pos - cur.start;
+    }
+
+    uint8_t has_zero;
+    uint32_t max_exact, num;
+    uint64_t hash = 0;
+    if (get_u8(&cur, &has_zero) ||
+        get_u32(&cur, &max_exact) ||
+        get_u32(&cur, &num)) return -1;
+    if (num > (size_t)(cur.end - cur.pos) / sizeof(uint64_t)) return -1;
+    if (set_init_exact(precision, max_exact, s)) return -1;
+    if (has_zero) set_add_hash(s, 0);
+    for (uint32_t i=0; i < num; i++) {
+        get_u64(&cur, &hash);
+        set_add_hash(s, hash);
+    }
+    return cur.pos - cur.start;
+}
+
+int sketch_view_set(const char *buf, size_t len, set_t *s) {
+    cursor cur = {buf, buf, buf + len};
+    uint8_t precision, type;
+    hll_fields fields;
+    if (get_set_fields(&cur, &precision, &type) || type != APPROX) return -1;
+    if (get_hll_fields(&cur, &fields) || fields.precision != precision) return -1;
+    if (view_hll(&cur, &fields, &s->store.h)) return -1;
+    s->type = APPROX;
+    return cur.pos - cur.start;
+}
+
+int sketch_encode_timer(FILE *f, timer *t) {
+    int exact = (t->count <= TIMER_EXACT_MAX);
+    put_kind(f, SKETCH_TIMER);
+    put_u8(f, t->engine);
+    put_u8(f, (exact) ? TIMER_MODE_EXACT : TIMER_MODE_SKETCH);
+    put_u64(f, t->count);
+    put_f64(f, t->sum);
+    put_f64(f, t->squared_sum);
+
+    // The engine parameters, a timer is decoded into the same engine
+    if (t->engine == TIMER_ENGINE_TDIGEST) {
+        put_f64(f, t->q.td.compression);
+    } else if (t->engine == TIMER_ENGINE_HDR) {
+        put_f64(f, t->q.hdr.eps);
+    } else if (t->engine == TIMER_ENGINE_STATS) {
+        put_f64(f, t->min);
+        put_f64(f, t->max);
+        return ferror(f) ? -1 : 0;
+    } else {
+        put_f64(f, t->q.cm.eps);
+        put_u32(f, t->q.cm.num_quantiles);
+        put_words(f, t->q.cm.quantiles, t->q.cm.num_quantiles, sizeof(double));
+    }
+
+    if (exact) {
+        put_u32(f, t->num_exact);
+        put_words(f, t->exact, t->num_exact, sizeof(double));
+
+    } else if (t->engine == TIMER_ENGINE_TDIGEST) {
+        tdigest *td = &t->q.td;
+        tdigest_flush(td);
+        put_f64(f, td->total_weight);
+        put_f64(f, td->min);
+        put_f64(f, td->max);
+        put_u32(f, td->num_centroids);
+        put_words(f, td->nodes, td->num_centroids * 2, sizeof(double));
+
+    } else if (t->engine == TIMER_ENGINE_HDR) {
+        // Only the run of buckets from the first to the last used
+        hdr_histogram *h = &t->q.hdr;
+        uint32_t first = 0, last = 0;
+        for (uint32_t i=0; h->counts && i < h->num_buckets; i++) {
+            if (!h->counts[i]) continue;
+            if (!last) first = i;
+            last = i + 1;
+        }
+        put_u64(f, h->total);
+        put_f64(f, h->min);
+        put_f64(f, h->max);
+        put_u32(f, first);
+        put_u32(f, last - first);
+        if (last) put_words(f, h->counts + first, last - first, sizeof(uint64_t));
+
+    } else {
+        cm_quantile *cm = &t->q.cm;
+        cm_flush(cm);
+        put_u64(f, cm->num_values);
+        put_u64(f, cm->num_samples);
+        put_words(f, cm->samples, cm->num_samples * 3, sizeof(uint64_t));
+    }
+    return ferror(f) ? -1 : 0;
+}
+
+/**
+ * Initializes a timer with the encoded engine parameters
+ * @return 0 on success, -1 if they are not valid.
+ */
+static int init_engine(cursor *c, uint8_t engine, timer *t) {
+    if (engine == TIMER_ENGINE_TDIGEST) {
+        double compression;
+        if (get_f64(c, &compression) || !(compression > 0)) return -1;
+        return init_timer_tdigest(compression, t) ? -1 : 0;
+    } else if (engine == TIMER_ENGINE_HDR) {
+        double eps;
+        if (get_f64(c, &eps)) return -1;
+        return init_timer_hdr(eps, t) ? -1 : 0;
+    } else if (engine == TIMER_ENGINE_STATS) {
+        // The extremes are all there is to it
+        init_timer_stats(t);
+        return (get_f64(c, &t->min) || get_f64(c, &t->max)) ? -1 : 0;
+    } else if (engine != TIMER_ENGINE_CM) return -1;
+
+    double eps;
+    uint32_t num;
+    if (get_f64(c, &eps) || get_u32(c, &num)) return -1;
+    double *quantiles = get_array(c, num, sizeof(double));
+    if (!quantiles) return -1;
+    int res = init_timer(eps, quantiles, num, t);
+    free(quantiles);
+    return (res) ? -1 : 0;
+}
+
+/**
+ * Sets the extremes of a decoded timer from its samples, which
+ * keep them exactly. The engines with their extremes encoded
+ * set them as their parameters.
+ */
+static void decoded_extremes(timer *t) {
+    if (t->num_exact) {
+        t->min = t->max = t->exact[0];
+        for (uint32_t i=1; i < t->num_exact; i++) {
+            if (t->exact[i] < t->min) t->min = t->exact[i];
+            if (t->exact[i] > t->max) t->max = t->exact[i];
+        }
+    } else if (t->engine == TIMER_ENGINE_TDIGEST) {
+        t->min = t->q.td.min;
+        t->max = t->q.td.max;
+    } else if (t->engine == TIMER_ENGINE_HDR) {
+        t->min = t->q.hdr.min;
+        t->max = t->q.hdr.max;
+    } else if (t->q.cm.num_samples) {
+        // The samples were flushed, so they are in order
+        t->min = t->q.cm.samples[0].value;
+        t->max = t->q.cm.samples[t->q.cm.num_samples - 1].value;
+    }
+}
+
+int sketch_decode_timer(const char *buf, size_t len, timer *t) {
+    cursor cur = {buf, buf, buf + len};
+    uint8_t engine, mode;
+    uint64_t count;
+    double sum, squared_sum;
+    if (get_kind(&cur, SKETCH_TIMER) ||
+        get_u8(&cur, &engine) ||
+        get_u8(&cur, &mode) ||
+        get_u64(&cur, &count) ||
+        get_f64(&cur, &sum) ||
+        get_f64(&cur, &squared_sum)) return -1;
+    if (mode != TIMER_MODE_EXACT && mode != TIMER_MODE_SKETCH) return -1;
+    if ((mode == TIMER_MODE_EXACT) != (count <= TIMER_EXACT_MAX)) return -1;
+    if (init_engine(&cur, engine, t)) return -1;
+
+    if (engine == TIMER_ENGINE_STATS) {
+        // Nothing follows the extremes
+    } else if (mode == TIMER_MODE_EXACT) {
+        uint32_t num;
+        if (get_u32(&cur, &num) || num > count) goto INVALID;
+        t->exact = get_array(&cur, num, sizeof(double));
+        if (!t->exact) goto INVALID;
+        t->num_exact = t->exact_size = num;
+        stats_mem_add(MEM_TIMERS, num * sizeof(double));
+        t->finalized = 0;
+
+    } else if (engine == TIMER_ENGINE_TDIGEST) {
+        tdigest *td = &t->q.td;
+        uint32_t num;
+        if (get_f64(&cur, &td->total_weight) ||
+            get_f64(&cur, &td->min) ||
+            get_f64(&cur, &td->max) ||
+            get_u32(&cur, &num)) goto INVALID;
+        if (num > (size_t)(cur.end - cur.pos) / sizeof(td_centroid)) goto INVALID;
+
+        // Keep the buffer the merges expect after the centroids
+        if (num > td->size / 2) td->size = num * 2;
+        td->nodes = malloc(td->size * sizeof(td_centroid));
+        td->scratch = malloc(td->size * sizeof(td_centroid));
+        if (!td->nodes || !td->scratch) goto INVALID;
+        stats_mem_add(MEM_TIMERS, 2 * td->size * sizeof(td_centroid));
+        get_words(&cur, td->nodes, (size_t)num * 2, sizeof(double));
+        td->num_centroids = td->num_nodes = num;
+
+    } else if (engine == TIMER_ENGINE_HDR) {
+        hdr_histogram *h = &t->q.hdr;
+        uint32_t first, num;
+        if (get_u64(&cur, &h->total) ||
+            get_f64(&cur, &h->min) ||
+            get_f64(&cur, &h->max) ||
+            get_u32(&cur, &first) ||
+            get_u32(&cur, &num)) goto INVALID;
+        if (num > h->num_buckets || first > h->num_buckets - num) goto INVALID;
+        h->counts = calloc(h->num_buckets, sizeof(uint64_t));
+        if (!h->counts) goto INVALID;
+        stats_mem_add(MEM_TIMERS, h->num_buckets * sizeof(uint64_t));
+        if (get_words(&cur, h->counts + first, num, sizeof(uint64_t))) goto INVALID;
+
+        // The queries walk the counts up to the total
+        uint64_t total = 0;
+        for (uint32_t i=0; i < num; i++) total += h->counts[first + i];
+        if (total != h->total) goto INVALID;
+
+    } else {
+        cm_quantile *cm = &t->q.cm;
+        uint64_t num;
+        if (get_u64(&cur, &cm->num_values) || get_u64(&cur, &num)) goto INVALID;
+        if (num > (size_t)(cur.end - cur.pos) / sizeof(cm_sample)) goto INVALID;
+        cm_sample *samples = get_array(&cur, num * 3, sizeof(uint64_t));
+        if (!samples) goto INVALID;
+        stats_mem_add(MEM_TIMERS, ((int64_t)num - (int64_t)cm->samples_size) * (int64_t)sizeof(cm_sample));
+        free(cm->samples);
+        cm->samples = samples;
+        cm->samples_size = cm->num_samples = num;
+    }
+
+    t->count = count;
+    t->sum = sum;
+    t->squared_sum = squared_sum;
+    if (engine != TIMER_ENGINE_STATS) decoded_extremes(t);
+    return cur.pos - cur.start;
+
+INVALID:
+    destroy_timer(t);
+    return -1;
+}
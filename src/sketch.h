@@ -0,0 +1,136 @@
+/**
+ * A compact, versioned binary encoding of the aggregates:
+ * counters, sets and timers. The same encoding is read by
+ * any build, so sketches can be moved between hosts and
+ * merged by another tier, or kept across a restart.
+ *
+ * Every sketch starts with its kind and the version of its
+ * encoding, and every value is little-endian. The dense
+ * registers of an HLL are aligned to 8 bytes from the start
+ * of the stream, so a mapped buffer can be read in place.
+ */
+#ifndef SKETCH_H
+#define SKETCH_H
+#include <stdio.h>
+#include <stddef.h>
+#include "counter.h"
+#include "set.h"
+#include "timer.h"
+
+// The kind of each sketch
+typedef enum {
+    SKETCH_COUNTER = 1,
+    SKETCH_SET = 2,
+    SKETCH_HLL = 3,
+    SKETCH_TIMER = 4
+} sketch_kind;
+
+// The version of the encoding that is written
+#define SKETCH_VERSION 1
+
+/**
+ * Returns the kind of an encoded sketch
+ * @arg buf The encoded sketch
+ * @arg len The bytes available
+ * @return The kind, or -1 if it is too short or not a
+ * version this build reads.
+ */
+int sketch_kind_of(const char *buf, size_t len);
+
+/**
+ * Encodes a counter
+ * @arg f The stream to write to
+ * @arg c The counter to encode
+ * @return 0 on success.
+ */
+int sketch_encode_counter(FILE *f, counter *c);
+
+/**
+ * Encodes a set, as the exact hashes or the HLL
+ * @arg f The stream to write to
+ * @arg s The set to encode
+ * @return 0 on success.
+ */
+int sketch_encode_set(FILE *f, set_t *s);
+
+/**
+ * Encodes an HLL, as its sparse list or dense registers
+ * @arg f The stream to write to
+ * @arg h The hll to encode
+ * @return 0 on success.
+ */
+int sketch_encode_hll(FILE *f, hll_t *h);
+
+/**
+ * Encodes a timer, with its raw samples or the sketch
+ * of its quantile engine. The sketch is flushed first.
+ * @arg f The stream to write to
+ * @arg t The timer to encode
+ * @return 0 on success.
+ */
+int sketch_encode_timer(FILE *f, timer *t);
+
+/**
+ * Decodes a counter
+ * @arg buf The encoded sketch
+ * @arg len The bytes available
+ * @arg c Output, the counter
+ * @return The bytes decoded, or -1 if it is not valid.
+ */
+int sketch_decode_counter(const char *buf, size_t len, counter *c);
+
+/**
+ * Decodes a set into a new set, which must be destroyed
+ * @arg buf The encoded sketch
+ * @arg len The bytes available
+ * @arg s Output, the set
+ * @return The bytes decoded, or -1 if it is not valid.
+ */
+int sketch_decode_set(const char *buf, size_t len, set_t *s);
+
+/**
+ * Views the HLL of an encoded set in place, the same as
+ * sketch_view_hll. Exact sets are never viewed.
+ * @arg buf The encoded sketch
+ * @arg len The bytes available
+ * @arg s Output, the set
+ * @return The bytes decoded, or -1 if it cannot be viewed,
+ * in which case sketch_decode_set should be used.
+ */
+int sketch_view_set(const char *buf, size_t len, set_t *s);
+
+/**
+ * Decodes an HLL into a new HLL, which must be destroyed.
+ * Registers of either layout are converted to this build.
+ * @arg buf The encoded sketch
+ * @arg len The bytes available
+ * @arg h Output, the hll
+ * @return The bytes decoded, or -1 if it is not valid.
+ */
+int sketch_decode_hll(const char *buf, size_t len, hll_t *h);
+
+/**
+ * Views the dense registers of an encoded HLL in place,
+ * without copying them. The HLL may only be read or merged
+ * from while the buffer is live, and is not destroyed. This
+ * needs the register layout of this build, and the buffer
+ * aligned as it was written.
+ * @arg buf The encoded sketch
+ * @arg len The bytes available
+ * @arg h Output, the hll
+ * @return The bytes decoded, or -1 if it cannot be viewed,
+ * in which case sketch_decode_hll should be used.
+ */
+int sketch_view_hll(const char *buf, size_t len, hll_t *h);
+
+/**
+ * Decodes a timer into a new timer of the engine it was
+ * encoded with, which must be destroyed.
+ * @arg buf The encoded sketch
+ * @arg len The bytes available
+ * @arg t Output, the timer
+ * @return The bytes decoded, or -1 if it is not valid.
+ */
+int sketch_decode_timer(const char *buf, size_t len, timer *t);
+
+#endif
@@ -0,0 +1,383 @@
+/**
+ * This file defines the methods declared in snapshot.h
+ * A snapshot is a header with the map sizes, followed by a
+ * record for each metric, and the magic again as a trailer.
+ * Each record is the metric type, the key length and the key,
+ * and then the serialized metric. A coalesced K/V pair has a type
+ * of its own, and keeps the sum and count of its samples, so a mean
+ * goes on with the weight it had. Counters, sets and timers are
+ * encoded as sketches, see sketch.h, and merged the same as the
+ * sketches of downstream nodes, which reads the registers of a
+ * dense set in place from the mapping. The rest of the layout is
+ * that of the host.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "sketch.h"
+
+// Marks a snapshot, at the start and at the end
+#define SNAPSHOT_MAGIC 0x50414e53
+#define SNAPSHOT_VERSION 2
+
+// Largest key that is stored
+#define SNAPSHOT_MAX_KEY 65535
+
+// The record type of a coalesced K/V pair, past the metric types
+#define SNAPSHOT_KV_COALESCED 0x80
+
+// The state of writing the records of a shard
+struct snapshot_writer {
+    FILE *f;
+    metrics *m;
+};
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_shards;
+    uint32_t reserved;      // Zero, aligns the inputs
+    uint64_t inputs;        // Inputs received by all the shards
+    metrics_sizes sizes;    // The largest of each map across the shards
+} snapshot_header;
+
+// Reads through the mapped snapshot
+typedef struct {
+    const char *pos;
+    const char *end;
+} cursor;
+
+/**
+ * Copies the next bytes of the snapshot
+ * @return 0 on success, -1 if the snapshot is too short.
+ */
+static int read_bytes(cursor *c, void *out, size_t len) {
+    if ((size_t)(c->end - c->pos) < len) return -1;
+    memcpy(out, c->pos, len);
+    c->pos += len;
+    return 0;
+}
+
+/**
+ * Copies an array of the next bytes into a new buffer
+ * @return The buffer, or NULL if the snapshot is too short.
+ */
+static void* read_array(cursor *c, uint64_t num, size_t size) {
+    if (num > (uint64_t)(c->end - c->pos) / size) return NULL;
+    void *out = malloc((num) ? num * size : 1);
+    if (out) read_bytes(c, out, num * size);
+    return out;
+}
+
+// Serializes a timer sketch, and the fixed histogram counts
+static void write_timer(FILE *f, timer_hist *t) {
+    sketch_encode_timer(f, &t->tm);
+    uint32_t num_bins = (t->conf && t->conf->scale != HISTOGRAM_AUTO) ? t->conf->num_bins : 0;
+    fwrite(&num_bins, sizeof(num_bins), 1, f);
+    for (uint32_t i=0; i < num_bins; i++) {
+        uint64_t count = timer_hist_count(t, i);
+        fwrite(&count, sizeof(count), 1, f);
+    }
+}
+
+// Writes a record for each metric
+static int write_record_cb(void *data, metric_type type, char *name, void *value) {
+    struct snapshot_writer *w = data;
+    FILE *f = w->f;
+    size_t key_len = strlen(name);
+    if (key_len > SNAPSHOT_MAX_KEY) {
+        syslog(LOG_WARNING, "Key too long for the snapshot, skipping: %.64s", name);
+        return 0;
+    }
+
+    // The pairs are coalesced if they are the ones in the map
+    uint8_t t = type;
+    if (type == KEY_VAL && kv_map_get(&w->m->kvs, name) == value) t = SNAPSHOT_KV_COALESCED;
+    uint16_t len = key_len;
+    fwrite(&t, sizeof(t), 1, f);
+    fwrite(&len, sizeof(len), 1, f);
+    fwrite(name, 1, len, f);
+
+    if (t == SNAPSHOT_KV_COALESCED) {
+        kv_value *v = value;
+        uint8_t mode = v->mode;
+        fwrite(&v->val, sizeof(v->val), 1, f);
+        fwrite(&v->sum, sizeof(v->sum), 1, f);
+        fwrite(&v->count, sizeof(v->count), 1, f);
+        fwrite(&mode, sizeof(mode), 1, f);
+        return ferror(f);
+    }
+
+    switch (type) {
+        case KEY_VAL:
+        case COUNTER_SUM:
+            fwrite(value, sizeof(double), 1, f);
+            break;
+        case COUNTER:
+            sketch_encode_counter(f, value);
+            break;
+        case GAUGE: {
+            gauge_t *g = value;
+            uint8_t is_set = g->is_set;
+            fwrite(&g->value, sizeof(g->value), 1, f);
+            fwrite(&is_set, sizeof(is_set), 1, f);
+            break;
+        }
+        case TIMER:
+            write_timer(f, value);
+            break;
+        case SET:
+            sketch_encode_set(f, value);
+            break;
+        default:
+            break;
+    }
+    return ferror(f);
+}
+
+int snapshot_serialize(FILE *f, metrics **shards, int num) {
+    // Size each map for the largest shard
+    snapshot_header header = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, num, 0, 0};
+    metrics_sizes sizes;
+    for (int i=0; i < num; i++) {
+        metrics_get_sizes(shards[i], &sizes);
+        header.inputs += shards[i]->inputs;
+        if (sizes.counters > header.sizes.counters) header.sizes.counters = sizes.counters;
+        if (sizes.timers > header.sizes.timers) header.sizes.timers = sizes.timers;
+        if (sizes.sets > header.sizes.sets) header.sizes.sets = sizes.sets;
+        if (sizes.gauges > header.sizes.gauges) header.sizes.gauges = sizes.gauges;
+        if (sizes.sums > header.sizes.sums) header.sizes.sums = sizes.sums;
+    }
+    fwrite(&header, sizeof(header), 1, f);
+
+    // Write out every shard, they are merged when restored
+    int res = 0;
+    for (int i=0; i < num && !res; i++) {
+        struct snapshot_writer w = {f, shards[i]};
+        res = metrics_iter(shards[i], &w, write_record_cb);
+    }
+
+    // The trailer marks a complete snapshot
+    uint32_t magic = SNAPSHOT_MAGIC;
+    fwrite(&magic, sizeof(magic), 1, f);
+    return (res || ferror(f)) ? -1 : 0;
+}
+
+/**
+ * Writes the metrics of every shard to a snapshot. The file is
+ * written beside the path and renamed over it once complete, so
+ * there is either a complete snapshot or none.
+ * @arg path The path of the snapshot
+ * @arg shards The metrics of each shard
+ * @arg num The number of shards
+ * @return 0 on success.
+ */
+int snapshot_write(char *path, metrics **shards, int num) {
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *f = fopen(tmp_path, "w");
+    if (!f) {
+        syslog(LOG_ERR, "Failed to open snapshot %s! %s", tmp_path, strerror(errno));
+        return -1;
+    }
+
+    int res = snapshot_serialize(f, shards, num);
+    if (fflush(f) || ferror(f) || fsync(fileno(f))) res = -1;
+    if (fclose(f)) res = -1;
+    if (!res && rename(tmp_path, path)) res = -1;
+
+    if (res) {
+        syslog(LOG_ERR, "Failed to write snapshot %s! %s", path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Merges the next sketch of the snapshot into a metric
+static int restore_sketch(cursor *c, metrics *m, char *name) {
+    int used = metrics_merge_sketch(m, name, c->pos, c->end - c->pos);
+    if (used < 0) return -1;
+    c->pos += used;
+    return 0;
+}
+
+// Restores a timer sketch, and then its histogram counts
+static int restore_timer(cursor *c, metrics *m, char *name) {
+    if (restore_sketch(c, m, name)) return -1;
+    metric_type type = TIMER;
+    timer_hist *t = metrics_get_metric(m, &type, name);
+
+    // Add the histogram counts if the bins match
+    uint32_t num_bins;
+    if (read_bytes(c, &num_bins, sizeof(num_bins))) return -1;
+    uint64_t *counts = read_array(c, num_bins, sizeof(uint64_t));
+    if (!counts) return -1;
+    if (t->conf && t->conf->num_bins == num_bins) {
+        for (uint32_t i=0; i < num_bins; i++) {
+            timer_hist_add_count(m, t, i, counts[i]);
+        }
+    }
+    free(counts);
+    return 0;
+}
+
+// Restores the sum of a sum only counter
+static int restore_counter_sum(cursor *c, metrics *m, char *name) {
+    double sum;
+    if (read_bytes(c, &sum, sizeof(sum))) return -1;
+
+    metric_type type = COUNTER;
+    void *dst = metrics_get_metric(m, &type, name);
+    if (!dst) return -1;
+    if (type == COUNTER_SUM) {
+        *(double*)dst += sum;
+        return 0;
+    }
+
+    // The modes differ, so only the sum is known
+    return counter_add_sample(dst, sum);
+}
+
+// Restores a gauge, the same as merging one
+static int restore_gauge(cursor *c, metrics *m, char *name) {
+    double value;
+    uint8_t is_set;
+    if (read_bytes(c, &value, sizeof(value)) ||
+        read_bytes(c, &is_set, sizeof(is_set))) return -1;
+
+    metric_type type = GAUGE;
+    gauge_t *g = metrics_get_metric(m, &type, name);
+    if (!g) return -1;
+    if (is_set) {
+        g->value = value;
+        g->is_set = true;
+    } else {
+        g->value += value;
+    }
+    return 0;
+}
+
+// Restores a coalesced K/V pair, with the weight of its samples
+static int restore_kv_coalesced(cursor *c, metrics *m, char *name) {
+    kv_value v;
+    uint8_t mode;
+    if (read_bytes(c, &v.val, sizeof(v.val)) ||
+        read_bytes(c, &v.sum, sizeof(v.sum)) ||
+        read_bytes(c, &v.count, sizeof(v.count)) ||
+        read_bytes(c, &mode, sizeof(mode))) return -1;
+    if (!v.count || mode > KV_MEAN) return -1;
+    v.mode = mode;
+    return metrics_merge_kv(m, name, &v);
+}
+
+// Restores the records of a validated snapshot
+static int restore_records(cursor *c, metrics *m) {
+    char name[SNAPSHOT_MAX_KEY + 1];
+    uint8_t type;
+    uint16_t len;
+    double val;
+    int res = 0;
+    while (c->pos < c->end && !res) {
+        if (read_bytes(c, &type, sizeof(type)) ||
+            read_bytes(c, &len, sizeof(len)) ||
+            read_bytes(c, name, len)) return -1;
+        name[len] = '\0';
+
+        switch (type) {
+            case KEY_VAL:
+                res = read_bytes(c, &val, sizeof(val));
+                if (!res) res = metrics_add_sample(m, KEY_VAL, name, val);
+                break;
+            case SNAPSHOT_KV_COALESCED:
+                res = restore_kv_coalesced(c, m, name);
+                break;
+            case COUNTER:
+            case SET:
+                res = restore_sketch(c, m, name);
+                break;
+            case COUNTER_SUM:
+                res = restore_counter_sum(c, m, name);
+                break;
+            case GAUGE:
+                res = restore_gauge(c, m, name);
+                break;
+            case TIMER:
+                res = restore_timer(c, m, name);
+                break;
+            default:
+                return -1;
+        }
+    }
+    return res;
+}
+
+int snapshot_restore(const char *buf, size_t len, metrics **shards, int num) {
+    if (len < sizeof(snapshot_header) + sizeof(uint32_t)) return -1;
+
+    // Check the header and the trailer before restoring anything
+    snapshot_header header;
+    uint32_t trailer;
+    memcpy(&header, buf, sizeof(header));
+    memcpy(&trailer, buf + len - sizeof(trailer), sizeof(trailer));
+    if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION || trailer != SNAPSHOT_MAGIC) {
+        return -1;
+    }
+
+    // Size the maps up front, the first shard grows past the others
+    for (int i=0; i < num; i++) {
+        metrics_reserve(shards[i], &header.sizes);
+    }
+    shards[0]->inputs += header.inputs;
+
+    cursor c = {buf + sizeof(header), buf + len - sizeof(trailer)};
+    return (restore_records(&c, shards[0])) ? -1 : 0;
+}
+
+/**
+ * Restores a snapshot. Every shard is sized to hold the largest
+ * shard of the snapshot, and the metrics are merged into the first.
+ * @arg path The path of the snapshot
+ * @arg shards The metrics of each shard
+ * @arg num The number of shards
+ * @return 0 on success, 1 if there is no snapshot, or -1 if
+ * it is not valid. Metrics before an invalid record are kept.
+ */
+int snapshot_load(char *path, metrics **shards, int num) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT) return 1;
+        syslog(LOG_ERR, "Failed to open snapshot %s! %s", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < (off_t)(sizeof(snapshot_header) + sizeof(uint32_t))) {
+        syslog(LOG_ERR, "Snapshot %s is truncated!", path);
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        syslog(LOG_ERR, "Failed to map snapshot %s! %s", path, strerror(errno));
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    int res = snapshot_restore(map, st.st_size, shards, num);
+    munmap(map, st.st_size);
+    if (res) {
+        syslog(LOG_ERR, "Snapshot %s is not valid!", path);
+        return -1;
+    }
+    return 0;
+}
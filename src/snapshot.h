@@ -0,0 +1,57 @@
+/**
+ * Snapshots of the interval in progress. On shutdown the
+ * metrics are written to a file instead of being flushed early,
+ * and the next run restores them when it starts, so a restart
+ * continues the interval without losing the samples.
+ *
+ * The file holds every key with its counter, gauge, set or
+ * timer sketch, and the sizes of the maps, so the restored
+ * metrics start at their old capacity. It is read with mmap.
+ */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include <stdio.h>
+#include "metrics.h"
+
+/**
+ * Serializes the metrics of every shard as a snapshot.
+ * @arg f The stream to write to
+ * @arg shards The metrics of each shard
+ * @arg num The number of shards
+ * @return 0 on success.
+ */
+int snapshot_serialize(FILE *f, metrics **shards, int num);
+
+/**
+ * Restores a serialized snapshot, the same as snapshot_load.
+ * @arg buf The serialized snapshot
+ * @arg len The length of the snapshot
+ * @arg shards The metrics of each shard
+ * @arg num The number of shards
+ * @return 0 on success, or -1 if it is not valid.
+ */
+int snapshot_restore(const char *buf, size_t len, metrics **shards, int num);
+
+/**
+ * Writes the metrics of every shard to a snapshot. The file is
+ * written beside the path and renamed over it once complete, so
+ * there is either a complete snapshot or none.
+ * @arg path The path of the snapshot
+ * @arg shards The metrics of each shard
+ * @arg num The number of shards
+ * @return 0 on success.
+ */
+int snapshot_write(char *path, metrics **shards, int num);
+
+/**
+ * Restores a snapshot. Every shard is sized to hold the largest
+ * shard of the snapshot, and the metrics are merged into the first.
+ * @arg path The path of the snapshot
+ * @arg shards The metrics of each shard
+ * @arg num The number of shards
+ * @return 0 on success, 1 if there is no snapshot, or -1 if
+ * it is not valid. Metrics before an invalid record are kept.
+ */
+int snapshot_load(char *path, metrics **shards, int num);
+
+#endif
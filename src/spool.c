@@ -0,0 +1,441 @@
+/**
+ * This file defines the methods declared in spool.h
+ * Each segment file is a series of records, each with a
+ * header that is rewritten with the magic and length once the
+ * record is complete, and marked again once it is drained. Only
+ * complete records that were not drained are recovered.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "spool.h"
+
+// Marks a complete record, and one that was drained
+#define SPOOL_MAGIC 0x4c4f4f53
+#define SPOOL_DRAINED 0x4e494152
+
+typedef struct {
+    uint32_t magic;         // SPOOL_MAGIC once complete, SPOOL_DRAINED once drained
+    int32_t tv_usec;
+    int64_t tv_sec;
+    uint64_t len;           // Length of the record after the header
+} spool_header;
+
+typedef struct segment {
+    uint64_t seq;           // Orders the segments, part of the file name
+    char *path;
+    uint64_t size;          // Bytes written, only used by the appender
+    int pending;            // Records not yet drained
+    int sealed;             // No more records are appended
+    struct segment *next;
+} segment;
+
+typedef struct record {
+    segment *seg;
+    uint64_t offset;        // Offset of the contents in the segment
+    uint64_t len;
+    struct timeval tv;
+    struct record *next;
+} record;
+
+struct spool {
+    char *dir;
+    uint64_t segment_size;
+    uint64_t next_seq;
+
+    // Serializes the appends, taken before the lock
+    pthread_mutex_t write_lock;
+    segment *writing;       // The segment being appended to, or NULL
+    FILE *out;              // Open on the writing segment
+
+    // Guards the records and segments
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    segment *segments;      // All the segments, oldest first
+    record *head;           // The records to drain, oldest first
+    record *tail;
+    uint64_t pending_bytes;
+    int closed;
+};
+
+// Returns a new segment with the path for a sequence number
+static segment* new_segment(spool *s, uint64_t seq) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/statsite.%llu.spool", s->dir, (unsigned long long)seq);
+    segment *seg = calloc(1, sizeof(segment));
+    seg->seq = seq;
+    seg->path = strdup(path);
+
+    // Keep the list ordered, recovered segments are added in order
+    segment **prev = &s->segments;
+    while (*prev) prev = &(*prev)->next;
+    *prev = seg;
+    return seg;
+}
+
+/**
+ * Removes a segment once it is sealed and drained.
+ * Must be called with the lock held.
+ */
+static void maybe_remove_segment(spool *s, segment *seg) {
+    if (!seg->sealed || seg->pending) return;
+    unlink(seg->path);
+    for (segment **prev = &s->segments; *prev; prev = &(*prev)->next) {
+        if (*prev == seg) {
+            *prev = seg->next;
+            break;
+        }
+    }
+    free(seg->path);
+    free(seg);
+}
+
+/**
+ * Adds a record to the drain queue.
+ * Must be called with the lock held.
+ */
+static void push_record(spool *s, segment *seg, uint64_t offset, spool_header *hdr) {
+    record *r = malloc(sizeof(record));
+    r->seg = seg;
+    r->offset = offset;
+    r->len = hdr->len;
+    r->tv.tv_sec = hdr->tv_sec;
+    r->tv.tv_usec = hdr->tv_usec;
+    r->next = NULL;
+    if (s->tail) s->tail->next = r;
+    else s->head = r;
+    s->tail = r;
+    seg->pending++;
+    s->pending_bytes += hdr->len;
+}
+
+// Sorts the recovered sequence numbers
+static int cmp_seq(const void *a, const void *b) {
+    uint64_t x = *(uint64_t*)a, y = *(uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Queues the complete records of a segment left by an earlier run.
+ * The segment is sealed, and removed at once if it has no records.
+ */
+static void recover_segment(spool *s, uint64_t seq) {
+    segment *seg = new_segment(s, seq);
+    seg->sealed = 1;
+
+    int fd = open(seg->path, O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && !fstat(fd, &st)) {
+        spool_header hdr;
+        uint64_t offset = 0;
+        while (pread(fd, &hdr, sizeof(hdr), offset) == sizeof(hdr) &&
+                (hdr.magic == SPOOL_MAGIC || hdr.magic == SPOOL_DRAINED) &&
+                offset + sizeof(hdr) + hdr.len <= (uint64_t)st.st_size) {
+            if (hdr.magic == SPOOL_MAGIC)
+                push_record(s, seg, offset + sizeof(hdr), &hdr);
+            offset += sizeof(hdr) + hdr.len;
+        }
+    }
+    if (fd >= 0) close(fd);
+    if (seg->pending)
+        syslog(LOG_INFO, "Recovered %d spooled intervals from %s", seg->pending, seg->path);
+    maybe_remove_segment(s, seg);
+}
+
+/**
+ * Opens a spool in a directory, recovering the
+ * records left by an earlier run.
+ * @arg dir The directory of the segment files
+ * @arg segment_size New segments are started past this size
+ * @arg s Output, the spool
+ * @return 0 on success
+ */
+int spool_init(char *dir, uint64_t segment_size, spool **s) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        syslog(LOG_ERR, "Failed to open the spool directory %s!", dir);
+        return -1;
+    }
+
+    spool *sp = calloc(1, sizeof(spool));
+    sp->dir = strdup(dir);
+    sp->segment_size = segment_size;
+    pthread_mutex_init(&sp->write_lock, NULL);
+    pthread_mutex_init(&sp->lock, NULL);
+    pthread_cond_init(&sp->cond, NULL);
+
+    // Find the segments of an earlier run
+    int num = 0, max = 16;
+    uint64_t *seqs = malloc(max * sizeof(uint64_t));
+    struct dirent *ent;
+    while ((ent = readdir(d))) {
+        unsigned long long seq;
+        int end = 0;
+        if (sscanf(ent->d_name, "statsite.%llu.spool%n", &seq, &end) != 1 ||
+                ent->d_name[end] != '\0') continue;
+        if (num == max) {
+            max *= 2;
+            seqs = realloc(seqs, max * sizeof(uint64_t));
+        }
+        seqs[num++] = seq;
+    }
+    closedir(d);
+
+    // Recover them in order, and continue the numbering
+    qsort(seqs, num, sizeof(uint64_t), cmp_seq);
+    for (int i=0; i < num; i++) {
+        recover_segment(sp, seqs[i]);
+        sp->next_seq = seqs[i] + 1;
+    }
+    free(seqs);
+
+    *s = sp;
+    return 0;
+}
+
+/**
+ * Seals the segment being appended to, and starts a new one.
+ * Must be called with the write lock held.
+ * @return 0 on success
+ */
+static int next_segment(spool *s) {
+    if (s->writing) {
+        fclose(s->out);
+        s->out = NULL;
+        pthread_mutex_lock(&s->lock);
+        s->writing->sealed = 1;
+        maybe_remove_segment(s, s->writing);
+        s->writing = NULL;
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    pthread_mutex_lock(&s->lock);
+    segment *seg = new_segment(s, s->next_seq++);
+    pthread_mutex_unlock(&s->lock);
+
+    s->out = fopen(seg->path, "w");
+    if (!s->out) {
+        syslog(LOG_ERR, "Failed to create the spool segment %s!", seg->path);
+        pthread_mutex_lock(&s->lock);
+        seg->sealed = 1;
+        maybe_remove_segment(s, seg);
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+    s->writing = seg;
+    return 0;
+}
+
+/**
+ * Appends a record to the spool. This is safe to call
+ * from many threads, the records are appended in turn.
+ * @arg tv The time of the record
+ * @arg writer Invoked to serialize the record
+ * @arg data Opaque handle passed to the writer
+ * @return 0 on success, -1 if the segment could not be written,
+ * or the value of the writer.
+ */
+int spool_append(spool *s, struct timeval *tv, spool_writer writer, void *data) {
+    pthread_mutex_lock(&s->write_lock);
+    if (!s->writing || s->writing->size >= s->segment_size) {
+        if (next_segment(s)) {
+            pthread_mutex_unlock(&s->write_lock);
+            return -1;
+        }
+    }
+
+    // Write the record with an incomplete header
+    segment *seg = s->writing;
+    uint64_t start = seg->size;
+    spool_header hdr = {0, tv->tv_usec, tv->tv_sec, 0};
+    int res = (fwrite(&hdr, sizeof(hdr), 1, s->out) == 1) ? 0 : -1;
+    if (!res) res = writer(s->out, data);
+    if (!res && fflush(s->out)) res = -1;
+
+    // Complete the header, once the record is in the file
+    off_t end = ftello(s->out);
+    if (!res && end >= 0) {
+        hdr.magic = SPOOL_MAGIC;
+        hdr.len = end - start - sizeof(hdr);
+        if (pwrite(fileno(s->out), &hdr, sizeof(hdr), start) != sizeof(hdr)) res = -1;
+    } else if (!res) {
+        res = -1;
+    }
+
+    // Discard a partial record
+    if (res) {
+        syslog(LOG_ERR, "Failed to append to the spool segment %s!", seg->path);
+        fflush(s->out);
+        clearerr(s->out);
+        if (ftruncate(fileno(s->out), start) || fseeko(s->out, start, SEEK_SET)) {
+            // Leave the segment, the partial record is skipped on recovery
+            seg->size = s->segment_size;
+        }
+        pthread_mutex_unlock(&s->write_lock);
+        return res;
+    }
+    seg->size = end;
+
+    // Queue the record, before another append may seal the segment
+    pthread_mutex_lock(&s->lock);
+    push_record(s, seg, start + sizeof(hdr), &hdr);
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    pthread_mutex_unlock(&s->write_lock);
+    return 0;
+}
+
+/**
+ * Returns the oldest record, waiting until there is one.
+ * There must only be a single drainer.
+ * @arg rec Output, the mapped record. Must be released.
+ * @return 0 on success, 1 if the spool is closed and empty,
+ * or -1 if the record could not be mapped.
+ */
+int spool_next(spool *s, spool_record *rec) {
+    pthread_mutex_lock(&s->lock);
+    while (!s->head && !s->closed) {
+        pthread_cond_wait(&s->cond, &s->lock);
+    }
+    record *r = s->head;
+    pthread_mutex_unlock(&s->lock);
+    if (!r) return 1;
+
+    // Only the drainer removes records, so this one stays
+    rec->len = r->len;
+    rec->tv = r->tv;
+    rec->buf = NULL;
+    rec->map = NULL;
+    rec->map_len = 0;
+    if (!r->len) return 0;
+
+    // Map from the start of the page holding the record
+    int fd = open(r->seg->path, O_RDONLY);
+    if (fd < 0) return -1;
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t map_start = r->offset & ~(page - 1);
+    rec->map_len = r->offset - map_start + r->len;
+    rec->map = mmap(NULL, rec->map_len, PROT_READ, MAP_SHARED, fd, map_start);
+    close(fd);
+    if (rec->map == MAP_FAILED) {
+        rec->map = NULL;
+        return -1;
+    }
+    rec->buf = (char*)rec->map + (r->offset - map_start);
+    return 0;
+}
+
+/**
+ * Releases a record returned by spool_next.
+ * @arg rec The record to release
+ * @arg drained If the record was streamed, and should be removed.
+ * Otherwise it is returned again by the next spool_next.
+ */
+void spool_release(spool *s, spool_record *rec, int drained) {
+    if (rec->map) munmap(rec->map, rec->map_len);
+    rec->map = NULL;
+    rec->buf = NULL;
+    if (!drained) return;
+
+    // Mark the record, so it is not recovered if the segment is kept
+    record *r = s->head;
+    uint32_t magic = SPOOL_DRAINED;
+    int fd = open(r->seg->path, O_WRONLY);
+    if (fd >= 0) {
+        if (pwrite(fd, &magic, sizeof(magic), r->offset - sizeof(spool_header)) != sizeof(magic))
+            syslog(LOG_WARNING, "Failed to mark a drained record in %s", r->seg->path);
+        close(fd);
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->head = r->next;
+    if (!s->head) s->tail = NULL;
+    s->pending_bytes -= r->len;
+    r->seg->pending--;
+    maybe_remove_segment(s, r->seg);
+    pthread_mutex_unlock(&s->lock);
+    free(r);
+}
+
+/**
+ * Waits for the spool to be closed, used to back off
+ * after a record could not be streamed.
+ * @arg ms The most milliseconds to wait
+ * @return 1 if the spool is closed
+ */
+int spool_wait(spool *s, int ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    if (!s->closed) pthread_cond_timedwait(&s->cond, &s->lock, &ts);
+    int closed = s->closed;
+    pthread_mutex_unlock(&s->lock);
+    return closed;
+}
+
+/**
+ * Returns the number of bytes waiting to be drained
+ */
+uint64_t spool_pending_bytes(spool *s) {
+    pthread_mutex_lock(&s->lock);
+    uint64_t bytes = s->pending_bytes;
+    pthread_mutex_unlock(&s->lock);
+    return bytes;
+}
+
+/**
+ * Closes the spool for appends. spool_next returns
+ * 1 once the remaining records are drained.
+ */
+void spool_close(spool *s) {
+    pthread_mutex_lock(&s->lock);
+    s->closed = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * Destroys the spool. Records that were not drained
+ * are kept in their segments, for the next run.
+ * @return The number of records that were not drained
+ */
+int spool_destroy(spool *s) {
+    if (s->out) fclose(s->out);
+
+    // Remove the drained segments, and keep the rest on disk
+    int left = 0;
+    for (record *r = s->head; r; r = s->head) {
+        s->head = r->next;
+        free(r);
+        left++;
+    }
+    for (segment *seg = s->segments; seg; seg = s->segments) {
+        s->segments = seg->next;
+        if (!seg->pending) unlink(seg->path);
+        free(seg->path);
+        free(seg);
+    }
+
+    pthread_mutex_destroy(&s->write_lock);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    free(s->dir);
+    free(s);
+    return left;
+}
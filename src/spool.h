@@ -0,0 +1,107 @@
+/**
+ * A spool of serialized intervals. The flush workers append
+ * each interval to an append-only segment file, and a drainer
+ * streams the records to the sink in order. A slow or failed
+ * sink then only holds the serialized size on disk, instead of
+ * the metrics of every interval in memory.
+ *
+ * Records are read back with mmap, and a segment is removed once
+ * all its records are drained. Segments left by an earlier run are
+ * recovered when the spool is opened, so nothing is lost on restart.
+ */
+#ifndef SPOOL_H
+#define SPOOL_H
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+/**
+ * Opaque spool reference
+ */
+typedef struct spool spool;
+
+/**
+ * Serializes a record to the spool file
+ * @arg f The file to write to
+ * @arg data Opaque handle passed to spool_append
+ * @return 0 on success
+ */
+typedef int(*spool_writer)(FILE *f, void *data);
+
+/**
+ * A record being drained. The contents are mapped until
+ * the record is passed to spool_release.
+ */
+typedef struct {
+    const char *buf;        // The serialized record, NULL if empty
+    uint64_t len;           // Length of the record
+    struct timeval tv;      // Time passed to spool_append
+    void *map;              // The mapping, from the page start
+    size_t map_len;
+} spool_record;
+
+/**
+ * Opens a spool in a directory, recovering the
+ * records left by an earlier run.
+ * @arg dir The directory of the segment files
+ * @arg segment_size New segments are started past this size
+ * @arg s Output, the spool
+ * @return 0 on success
+ */
+int spool_init(char *dir, uint64_t segment_size, spool **s);
+
+/**
+ * Appends a record to the spool. This is safe to call
+ * from many threads, the records are appended in turn.
+ * @arg tv The time of the record
+ * @arg writer Invoked to serialize the record
+ * @arg data Opaque handle passed to the writer
+ * @return 0 on success, -1 if the segment could not be written,
+ * or the value of the writer.
+ */
+int spool_append(spool *s, struct timeval *tv, spool_writer writer, void *data);
+
+/**
+ * Returns the oldest record, waiting until there is one.
+ * There must only be a single drainer.
+ * @arg rec Output, the mapped record. Must be released.
+ * @return 0 on success, 1 if the spool is closed and empty,
+ * or -1 if the record could not be mapped.
+ */
+int spool_next(spool *s, spool_record *rec);
+
+/**
+ * Releases a record returned by spool_next.
+ * @arg rec The record to release
+ * @arg drained If the record was streamed, and should be removed.
+ * Otherwise it is returned again by the next spool_next.
+ */
+void spool_release(spool *s, spool_record *rec, int drained);
+
+/**
+ * Waits for the spool to be closed, used to back off
+ * after a record could not be streamed.
+ * @arg ms The most milliseconds to wait
+ * @return 1 if the spool is closed
+ */
+int spool_wait(spool *s, int ms);
+
+/**
+ * Returns the number of bytes waiting to be drained
+ */
+uint64_t spool_pending_bytes(spool *s);
+
+/**
+ * Closes the spool for appends. spool_next returns
+ * 1 once the remaining records are drained.
+ */
+void spool_close(spool *s);
+
+/**
+ * Destroys the spool. Records that were not drained
+ * are kept in their segments, for the next run.
+ * @return The number of records that were not drained
+ */
+int spool_destroy(spool *s);
+
+#endif
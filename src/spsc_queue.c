@@ -0,0 +1,57 @@
+#include <stdlib.h>
+#include "spsc_queue.h"
+
+struct spsc_queue {
+    void **slots;
+    uint32_t mask;
+    char pad0[52];
+    uint64_t head;          // Pointers pushed, only stored by the producer
+    uint64_t tail_cache;    // The last tail the producer read
+    char pad1[48];
+    uint64_t tail;          // Pointers popped, only stored by the consumer
+    uint64_t head_cache;    // The last head the consumer read
+    char pad2[48];
+};
+
+int spsc_queue_create(uint32_t capacity, spsc_queue **q) {
+    if (!capacity || (capacity & (capacity - 1))) return -1;
+    spsc_queue *queue;
+    if (posix_memalign((void**)&queue, 64, sizeof(spsc_queue))) return -1;
+    queue->slots = calloc(capacity, sizeof(void*));
+    if (!queue->slots) {
+        free(queue);
+        return -1;
+    }
+    queue->mask = capacity - 1;
+    queue->head = queue->tail_cache = 0;
+    queue->tail = queue->head_cache = 0;
+    *q = queue;
+    return 0;
+}
+
+void spsc_queue_destroy(spsc_queue *q) {
+    free(q->slots);
+    free(q);
+}
+
+int spsc_queue_push(spsc_queue *q, void *ptr) {
+    uint64_t head = q->head;
+    if (head - q->tail_cache > q->mask) {
+        q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        if (head - q->tail_cache > q->mask) return -1;
+    }
+    q->slots[head & q->mask] = ptr;
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void* spsc_queue_pop(spsc_queue *q) {
+    uint64_t tail = q->tail;
+    if (tail == q->head_cache) {
+        q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        if (tail == q->head_cache) return NULL;
+    }
+    void *ptr = q->slots[tail & q->mask];
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return ptr;
+}
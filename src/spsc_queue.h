@@ -0,0 +1,43 @@
+/**
+ * A lock-free queue of pointers between two threads, one that
+ * only pushes and one that only pops. The head and the tail are
+ * on their own cache lines, and each side keeps a copy of the
+ * other's index, so a push or pop only reads the other side's
+ * cache line when its copy says the queue is full or empty.
+ */
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+#include <stdint.h>
+
+/**
+ * Opaque queue reference
+ */
+typedef struct spsc_queue spsc_queue;
+
+/**
+ * Creates a queue
+ * @arg capacity The most pointers queued, a power of two
+ * @arg q Output, the queue
+ * @return 0 on success, -1 if the capacity is invalid.
+ */
+int spsc_queue_create(uint32_t capacity, spsc_queue **q);
+
+/**
+ * Destroys a queue. The queued pointers are not freed.
+ */
+void spsc_queue_destroy(spsc_queue *q);
+
+/**
+ * Pushes a pointer, only called by the producer
+ * @arg ptr The pointer, not NULL
+ * @return 0 on success, -1 if the queue is full.
+ */
+int spsc_queue_push(spsc_queue *q, void *ptr);
+
+/**
+ * Pops the oldest pointer, only called by the consumer
+ * @return The pointer, or NULL if the queue is empty.
+ */
+void* spsc_queue_pop(spsc_queue *q);
+
+#endif
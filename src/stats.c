@@ -0,0 +1,165 @@
+/**
+ * Implements the per-thread internal counters. The blocks
+ * of the live threads are kept in a linked list, so they can
+ * be summed, and the counts of exited threads are retired into
+ * a single block by a thread-specific key destructor.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "stats.h"
+
+// The blocks are aligned to this, so threads never share a line
+#define STATS_CACHE_LINE 64
+
+// The copies of a block tried before one torn by an update is taken
+#define STATS_READ_RETRIES 64
+
+typedef struct stats_block {
+    uint64_t counts[STATS_SEQ + 1]; // Must be first, handed out as STATS_LOCAL
+    struct stats_block *next;
+} __attribute__((aligned(STATS_CACHE_LINE))) stats_block;
+
+const char *STAT_NAMES[NUM_STATS] = {
+    "packets_received",
+    "bytes_received",
+    "parse_errors",
+    "samples.kv",
+    "samples.gauges",
+    "samples.counters",
+    "samples.timers",
+    "samples.sets",
+    "sketches_merged",
+    "hashmap_resizes",
+    "buffer_grows",
+    "flush.merged",
+    "flush.spilled",
+    "flush.dropped",
+    "proxy.forwarded",
+    "proxy.dropped",
+    "limits.overflowed",
+    "filter.dropped",
+    "parse_errors.ascii",
+    "parse_errors.binary",
+    "parse_errors.unlogged",
+    "long_lines.dropped",
+    "pipeline.stalls",
+    "rate_limit.dropped",
+    "rate_limit.paused",
+    "loop.iterations.under_100us",
+    "loop.iterations.under_1ms",
+    "loop.iterations.under_10ms",
+    "loop.iterations.under_100ms",
+    "loop.iterations.over_100ms",
+    "samples.timers_skipped",
+};
+
+const char *MEM_NAMES[NUM_MEMS] = {
+    "memory.timers",
+    "memory.sets",
+    "memory.maps",
+    "memory.arenas",
+    "memory.buffers",
+    "memory.mapped",
+};
+
+__thread uint64_t *STATS_LOCAL;
+
+static pthread_mutex_t STATS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static stats_block *BLOCKS;
+static uint64_t RETIRED[NUM_STATS + NUM_MEMS];
+static pthread_key_t STATS_KEY;
+static pthread_once_t STATS_ONCE = PTHREAD_ONCE_INIT;
+
+/**
+ * Invoked when a thread exits, folds its
+ * counters into the retired totals.
+ */
+static void retire_block(void *arg) {
+    stats_block *block = arg;
+    pthread_mutex_lock(&STATS_LOCK);
+    for (int i=0; i < NUM_STATS + NUM_MEMS; i++) {
+        RETIRED[i] += block->counts[i];
+    }
+    stats_block **prev = &BLOCKS;
+    while (*prev != block) prev = &(*prev)->next;
+    *prev = block->next;
+    pthread_mutex_unlock(&STATS_LOCK);
+    free(block);
+}
+
+static void make_key() {
+    pthread_key_create(&STATS_KEY, retire_block);
+}
+
+/**
+ * Allocates and registers the counters of the current thread.
+ * They are folded into the totals when the thread exits.
+ * @return The counters of the thread.
+ */
+uint64_t* stats_register() {
+    pthread_once(&STATS_ONCE, make_key);
+    stats_block *block;
+    if (posix_memalign((void**)&block, STATS_CACHE_LINE, sizeof(stats_block))) abort();
+    memset(block, 0, sizeof(stats_block));
+    pthread_mutex_lock(&STATS_LOCK);
+    block->next = BLOCKS;
+    BLOCKS = block;
+    pthread_mutex_unlock(&STATS_LOCK);
+    pthread_setspecific(STATS_KEY, block);
+    STATS_LOCAL = block->counts;
+    return STATS_LOCAL;
+}
+
+/**
+ * Copies the counts of a block as of a single point between the
+ * updates of its thread. A thread that keeps updating may tear
+ * every copy, so past the retries the last copy is taken, which
+ * still has each counter whole.
+ */
+static void read_block(stats_block *block, int start, int num, uint64_t *out) {
+    for (int tries=0; tries < STATS_READ_RETRIES; tries++) {
+        uint64_t seq = __atomic_load_n(block->counts + STATS_SEQ, __ATOMIC_ACQUIRE);
+        for (int i=0; i < num; i++) {
+            out[i] = __atomic_load_n(block->counts + start + i, __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (!(seq & 1) && seq == __atomic_load_n(block->counts + STATS_SEQ, __ATOMIC_RELAXED)) return;
+    }
+}
+
+// Sums the num counts from the start offset over all the threads
+static void sum_blocks(int start, int num, uint64_t *totals) {
+    uint64_t counts[STATS_SEQ];
+    pthread_mutex_lock(&STATS_LOCK);
+    for (int i=0; i < num; i++) {
+        totals[i] = RETIRED[start + i];
+    }
+    for (stats_block *block = BLOCKS; block; block = block->next) {
+        read_block(block, start, num, counts);
+        for (int i=0; i < num; i++) {
+            totals[i] += counts[i];
+        }
+    }
+    pthread_mutex_unlock(&STATS_LOCK);
+}
+
+/**
+ * Sums the counters of all the threads, including
+ * those that have exited.
+ * @arg totals Output. An array of NUM_STATS totals.
+ */
+void stats_collect(uint64_t *totals) {
+    sum_blocks(0, NUM_STATS, totals);
+}
+
+/**
+ * Sums the bytes held by each user of memory over all the threads
+ * @arg totals Output. An array of NUM_MEMS totals.
+ */
+void stats_mem_collect(int64_t *totals) {
+    // The counts wrap, so the unsigned sum is the signed total
+    uint64_t sums[NUM_MEMS];
+    sum_blocks(NUM_STATS, NUM_MEMS, sums);
+    for (int i=0; i < NUM_MEMS; i++) totals[i] = (int64_t)sums[i];
+}
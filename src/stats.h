@@ -0,0 +1,137 @@
+/**
+ * Internal counters that statsite keeps about itself.
+ * Each thread updates its own block of counters, so an
+ * update is a plain load and store, without locks or atomic
+ * read-modify-write instructions. The blocks are aligned and
+ * padded to cache lines, so no two threads write the same line.
+ * The blocks of all the threads are summed when the counters
+ * are collected.
+ *
+ * Each block has a sequence that its thread makes odd while an
+ * update is in progress, as a seqlock. A collection copies each
+ * block until it reads the same even sequence before and after,
+ * so the totals include every counter of a thread as of the same
+ * update, rather than some counters from before and some after.
+ *
+ * The bytes held by each user of memory are kept the same way.
+ * Memory is often freed by another thread than the one that
+ * allocated it, so the count of a single thread can go negative,
+ * but the sum over all the threads is exact.
+ */
+#ifndef STATS_H
+#define STATS_H
+#include <stdint.h>
+
+typedef enum {
+    STAT_PACKETS,           // UDP datagrams received
+    STAT_BYTES,             // Bytes received from all the clients
+    STAT_PARSE_ERRORS,      // Inputs that failed to parse
+    STAT_KV_SAMPLES,        // Samples received, by metric type
+    STAT_GAUGE_SAMPLES,
+    STAT_COUNTER_SAMPLES,
+    STAT_TIMER_SAMPLES,
+    STAT_SET_SAMPLES,
+    STAT_SKETCHES,          // Sketches merged from downstream nodes
+    STAT_HASHMAP_RESIZES,   // Hashmap tables that were grown
+    STAT_BUFFER_GROWS,      // Connection buffers that were grown
+    STAT_FLUSH_MERGED,      // Intervals handled by the full flush queue policy
+    STAT_FLUSH_SPILLED,
+    STAT_FLUSH_DROPPED,
+    STAT_PROXY_FORWARDED,   // Records queued for the proxy upstreams
+    STAT_PROXY_DROPPED,     // Records the proxy could not send
+    STAT_LIMIT_OVERFLOWS,   // Keys folded into an overflow key by a limit
+    STAT_FILTER_DROPPED,    // Samples dropped by the ingest filter
+    STAT_ASCII_ERRORS,      // Inputs that failed to parse, by protocol
+    STAT_BINARY_ERRORS,
+    STAT_WARNINGS_UNLOGGED, // Warnings about bad input over the log rate
+    STAT_LONG_LINES,        // Lines dropped for being over max_line_length
+    STAT_PIPELINE_STALLS,   // Waits of a worker for a batch of the pipeline
+    STAT_RATE_DROPPED,      // Datagrams dropped for being over the client rate
+    STAT_RATE_PAUSED,       // Stream reads paused for being over the client rate
+    STAT_LOOP_100US,        // Event loop iterations, by how long their callbacks ran
+    STAT_LOOP_1MS,
+    STAT_LOOP_10MS,
+    STAT_LOOP_100MS,
+    STAT_LOOP_SLOWER,
+    STAT_TIMER_SKIPPED,     // Timer samples not inserted into the quantiles, see timer_set_admission
+    NUM_STATS
+} stat_id;
+
+typedef enum {
+    MEM_TIMERS,             // Timer sketches and exact samples
+    MEM_SETS,               // Set hashes and HLL registers
+    MEM_MAPS,               // Hashmap and intern tables, and their entries
+    MEM_ARENAS,             // Arena chunks, which hold the interned names
+    MEM_BUFFERS,            // Client connection buffers
+    MEM_MAPPED,             // Buffers mapped by page_alloc, included above
+    NUM_MEMS
+} mem_id;
+
+// The sequence of a block follows the counters and the memory users
+#define STATS_SEQ (NUM_STATS + NUM_MEMS)
+
+/**
+ * The names of the counters, indexed by stat_id
+ */
+extern const char *STAT_NAMES[NUM_STATS];
+
+/**
+ * The names of the memory users, indexed by mem_id
+ */
+extern const char *MEM_NAMES[NUM_MEMS];
+
+/**
+ * The counters of the current thread, NULL until
+ * the thread first updates a counter.
+ */
+extern __thread uint64_t *STATS_LOCAL;
+
+/**
+ * Allocates and registers the counters of the current thread.
+ * They are folded into the totals when the thread exits.
+ * @return The counters of the thread.
+ */
+uint64_t* stats_register();
+
+/**
+ * Adds to a counter of the current thread. Only the owning
+ * thread writes its counters, so the update is a few plain
+ * stores, bracketed by the sequence of the block. The fences
+ * only order the stores, and compile to nothing on x86.
+ * @arg id The counter to update
+ * @arg n The amount to add
+ */
+static inline void stats_add(stat_id id, uint64_t n) {
+    uint64_t *s = STATS_LOCAL;
+    if (__builtin_expect(!s, 0)) s = stats_register();
+    uint64_t seq = __atomic_load_n(s + STATS_SEQ, __ATOMIC_RELAXED);
+    __atomic_store_n(s + STATS_SEQ, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(s + id, __atomic_load_n(s + id, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+    __atomic_store_n(s + STATS_SEQ, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Adds to the bytes held by a user of memory. The bytes
+ * follow the counters in the block of the current thread.
+ * @arg id The user of the memory
+ * @arg bytes The bytes allocated, negative if freed
+ */
+static inline void stats_mem_add(mem_id id, int64_t bytes) {
+    stats_add((stat_id)(NUM_STATS + id), (uint64_t)bytes);
+}
+
+/**
+ * Sums the counters of all the threads, including
+ * those that have exited.
+ * @arg totals Output. An array of NUM_STATS totals.
+ */
+void stats_collect(uint64_t *totals);
+
+/**
+ * Sums the bytes held by each user of memory over all the threads
+ * @arg totals Output. An array of NUM_MEMS totals.
+ */
+void stats_mem_collect(int64_t *totals);
+
+#endif
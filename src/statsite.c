@@ -27,30 +27,39 @@
  */
 static int SHOULD_RUN = 1;
 
+/**
+ * The configuration file, read again on SIGHUP
+ */
+static char *CONFIG_FILE;
+
 /**
  * Prints our usage to stderr
  */
 void show_usage() {
-    fprintf(stderr, "usage: statsite [-h] [-f filename]\n\
+    fprintf(stderr, "usage: statsite [-h] [-f filename] [-b file ...]\n\
 \n\
     -h : Displays this help info\n\
     -f : Reads the configuration from this file\n\
+    -b : Aggregates the lines of the files, flushes once and exits\n\
 \n");
 }
 
 /**
  * Invoked to parse the command line options
  */
-int parse_cmd_line_args(int argc, char **argv, char **config_file) {
+int parse_cmd_line_args(int argc, char **argv, char **config_file, int *bulk) {
     int enable_help = 0;
 
     int c;
     opterr = 0;
-    while ((c = getopt(argc, argv, "hf:w:")) != -1) {
+    while ((c = getopt(argc, argv, "hbf:w:")) != -1) {
         switch (c) {
             case 'h':
                 enable_help = 1;
                 break;
+            case 'b':
+                *bulk = 1;
+                break;
             case 'f':
                 *config_file = optarg;
                 break;
@@ -65,6 +74,12 @@ int parse_cmd_line_args(int argc, char **argv, char **config_file) {
         }
     }
 
+    // Bulk mode needs files to read
+    if (*bulk && optind >= argc) {
+        fprintf(stderr, "Option -b requires at least one file.\n");
+        return 1;
+    }
+
     // Check if we need to show usage
     if (enable_help) {
         show_usage();
@@ -102,6 +117,15 @@ void signal_handler(int signum) {
 }
 
 
+/**
+ * Invoked on SIGHUP, to reload the configuration
+ * file at the next flush.
+ */
+void reload_handler(int signum) {
+    schedule_config_reload(CONFIG_FILE);
+}
+
+
 /**
  * Writes the pid to the configured pidfile
  */
@@ -126,14 +150,37 @@ int write_pidfile(char *pid_file, pid_t pid) {
 }
 
 
+/**
+ * Aggregates files of ASCII lines in bulk, such as an archive
+ * being backfilled, and streams the result as one flush. The
+ * metrics are not forwarded or snapshotted, and are aggregated
+ * directly instead of through the ingest pipeline.
+ * @return The exit code.
+ */
+int run_bulk(statsite_config *config, char **paths, int num_paths) {
+    config->proxy_upstreams = NULL;
+    config->snapshot_file = NULL;
+    config->ingest_pipeline = false;
+
+    syslog(LOG_INFO, "Aggregating %d files in bulk.", num_paths);
+    init_conn_handler(config);
+    int res = bulk_ingest_files(paths, num_paths);
+    final_flush();
+    free(config);
+    return (res) ? 1 : 0;
+}
+
+
 int main(int argc, char **argv) {
     // Initialize syslog
     setup_syslog();
 
     // Parse the command line
     char *config_file = NULL;
-    int parse_res = parse_cmd_line_args(argc, argv, &config_file);
+    int bulk = 0;
+    int parse_res = parse_cmd_line_args(argc, argv, &config_file, &bulk);
     if (parse_res) return 1;
+    CONFIG_FILE = config_file;
 
     // Parse the config file
     statsite_config *config = calloc(1, sizeof(statsite_config));
@@ -158,6 +205,9 @@ int main(int argc, char **argv) {
     // Set the syslog mask
     setlogmask(config->syslog_log_level);
 
+    // Aggregate the files given and flush them once, with no networking
+    if (bulk) return run_bulk(config, argv + optind, argc - optind);
+
     // Daemonize
     if (config->daemonize) {
         pid_t pid, sid;
@@ -208,7 +258,7 @@ int main(int argc, char **argv) {
 
     // Setup signal handlers
     signal(SIGPIPE, SIG_IGN);       // Ignore SIG_IGN
-    signal(SIGHUP, SIG_IGN);        // Ignore SIG_IGN
+    signal(SIGHUP, reload_handler); // Reload the configuration
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
 
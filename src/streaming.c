@@ -1,42 +1,931 @@
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <syslog.h>
+#include <pthread.h>
 #include "streaming.h"
+#include "affinity.h"
+#include "lz4.h"
+#include "shm_ring.h"
+#include "probes.h"
+#include "hash.h"
+
+// Size of the stdio buffer used for the pipe to the child
+#define PIPE_BUF_SIZE 65536
+
+// Size of the pages filled and spliced into the pipe at once, and
+// of the pipe asked for, see stream_set_splice
+#define SPLICE_BUF_SIZE (256 * 1024)
+
+// Size of the buffers handed to the writer thread, see stream_set_async
+#define ASYNC_BUF_SIZE (256 * 1024)
+
+// Most pieces in a gathered write, the IOV_MAX of Linux
+#define GATHER_IOVS 1024
+
+// Bytes of the copied pieces of a gathered write
+#define GATHER_COPY_SIZE 65536
+
+// Flushes of a lower cost are serialized on the calling thread, see entry_cost
+#define PARALLEL_MIN_METRICS 4096
+
+// Cost of the metrics serialized together by a stream thread
+#define PARTITION_COST 1024
+
+// Cost of the timers finalized together by a thread, see stream_finalize_timers
+#define FINALIZE_COST 256
+
+// How often commands are checked for their exit, without a pidfd
+#define REAP_POLL_US 1000
+
+// How often a full output ring is checked for room
+#define RING_POLL_US 1000
+
+// Ranges of fewer names are insertion sorted, see sort_names
+#define INSERTION_SORT_MAX 16
+
+// Names that share longer prefixes are sorted with qsort,
+// which bounds the stack of the radix sort
+#define RADIX_MAX_DEPTH 256
+
+// Number of threads that serialize the metrics, see stream_set_threads
+static int STREAM_THREADS = 1;
+
+// CPUs of the stream commands, see stream_set_cpus
+static char *STREAM_CPUS;
+
+// Compression of the output to the commands, see stream_set_compression
+static output_compression COMPRESSION = COMPRESS_NONE;
+
+// Set if the metrics are sorted by name, see stream_set_sorted
+static int SORTED = 0;
+
+// The name streamed before the current one, see stream_prev_name
+static __thread char *PREV_NAME;
+
+// Set if the callback is told of the end of each run, see stream_set_block_output
+static int BLOCK_OUTPUT = 0;
+
+// Milliseconds a stream command may run, see stream_set_timeout
+static int TIMEOUT_MS = 0;
+
+// Set if the output to a command is spliced, see stream_set_splice
+static int SPLICE = 0;
+
+// Buffers of the thread that writes the output to a command, see stream_set_async
+static int ASYNC_BUFFERS = 0;
+
+// Set if the output to a command is gathered, see stream_set_gather
+static int GATHER_OUTPUT = 0;
+
+// The gather writer of the current thread, see stream_gather_for
+static __thread stream_gather *GATHER;
+
+// The timings of the last command streamed to by the thread, see stream_get_timings
+static __thread stream_timings TIMINGS;
 
 // Struct to hold the callback info
 struct callback_info {
     FILE *f;
     void *data;
     stream_callback cb;
+    char *prev;     // The name of the last metric
 };
 
+/**
+ * Estimates the work of finalizing and formatting a timer, in
+ * the units of a counter. It walks its raw samples or the samples
+ * of its engine, and formats its quantiles and bins.
+ */
+static uint64_t timer_cost(timer_hist *t) {
+    timer *tm = &t->tm;
+    uint64_t cost = 1 + t->num_quants + t->num_counts;
+    if (t->conf) cost += t->conf->num_bins;
+    if (tm->num_exact) return cost + tm->num_exact;
+    switch (tm->engine) {
+        case TIMER_ENGINE_CM:
+            return cost + tm->q.cm.num_samples + tm->q.cm.buffer_len +
+                cm_sample_heap_size(&tm->q.cm.weighted);
+        case TIMER_ENGINE_TDIGEST:
+            return cost + tm->q.td.num_nodes;
+        case TIMER_ENGINE_HDR:
+            return cost + tm->q.hdr.num_buckets;
+        default:
+            return cost;
+    }
+}
+
+// Estimates the work of serializing a metric, see timer_cost
+static inline uint64_t entry_cost(metric_type type, void *value) {
+    return (type == TIMER) ? timer_cost(value) : 1;
+}
+
 /**
  * Local callback that invokes the user specified callback with the pip
  */
 static int stream_cb(void *data, metric_type type, char *name, void *val) {
     struct callback_info *info = data;
+    PREV_NAME = info->prev;
+    info->prev = name;
     return info->cb(info->f, info->data, type, name, val);
 }
 
 /**
- * Streams the metrics stored in a metrics object to an external command
- * @arg m The metrics object to stream
- * @arg data An opaque handle passed to the callback
- * @arg cb The callback to invoke
- * @arg cmd The command to invoke, invoked with a shell.
+ * A metric to serialize, collected from the metrics
+ * so that they can be split into partitions.
+ */
+typedef struct {
+    metric_type type;
+    char *name;
+    void *value;
+} stream_entry;
+
+// The output of a partition, in memory until it is written in order
+typedef struct {
+    int start;      // The entries of the partition
+    int end;
+    char *buf;
+    size_t len;
+    int res;        // The value of the stream callback
+    int done;       // Set when the output is complete
+} partition;
+
+// Shared by the threads that serialize one flush
+struct parallel_stream {
+    stream_entry *entries;
+    int num_entries;
+    int max_entries;
+    uint64_t cost;  // The estimated cost of the entries, see entry_cost
+    partition *parts;
+    int num_parts;
+    int next_part;  // The next partition to be claimed
+    int aborted;    // Set if the output failed, so work stops early
+    void *data;
+    stream_callback cb;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/**
+ * Sets the number of threads that serialize the metrics of
+ * a flush. With more than one, large flushes are split into
+ * partitions of about the same estimated cost, a heavy timer
+ * counting for its samples and bins, that are serialized in
+ * parallel and written in order, so the callback must be safe
+ * to invoke concurrently.
+ * @arg threads The number of threads
+ */
+void stream_set_threads(int threads) {
+    STREAM_THREADS = threads;
+}
+
+void stream_set_cpus(char *cpus) {
+    STREAM_CPUS = cpus;
+}
+
+void stream_set_compression(output_compression compression) {
+    COMPRESSION = compression;
+}
+
+void stream_set_sorted(int sorted) {
+    SORTED = sorted;
+}
+
+char* stream_prev_name(void) {
+    return PREV_NAME;
+}
+
+void stream_set_block_output(int enabled) {
+    BLOCK_OUTPUT = enabled;
+}
+
+void stream_set_timeout(int timeout_ms) {
+    TIMEOUT_MS = timeout_ms;
+}
+
+void stream_set_splice(int enabled) {
+#ifdef __linux__
+    SPLICE = enabled;
+#else
+    (void)enabled;
+#endif
+}
+
+void stream_set_async(int buffers) {
+    ASYNC_BUFFERS = buffers;
+}
+
+void stream_set_gather(int enabled) {
+    GATHER_OUTPUT = enabled;
+}
+
+/**
+ * Tells the callback a run of metrics has ended, if enabled.
+ * This is done even if the run failed, so its blocks are freed.
+ * @arg res The value of the callback for the run
+ * @return The value of the callback for the run, or for the end of it.
+ */
+static int end_run(FILE *f, void *data, stream_callback cb, int res) {
+    PREV_NAME = NULL;
+    if (!BLOCK_OUTPUT) return res;
+    int end_res = cb(f, data, KEY_VAL, NULL, NULL);
+    return (res) ? res : end_res;
+}
+
+// Collects the metrics into the entries array
+static int collect_cb(void *data, metric_type type, char *name, void *val) {
+    struct parallel_stream *ps = data;
+    if (ps->num_entries == ps->max_entries) {
+        ps->max_entries = (ps->max_entries) ? ps->max_entries * 2 : PARALLEL_MIN_METRICS;
+        ps->entries = realloc(ps->entries, ps->max_entries * sizeof(stream_entry));
+    }
+    ps->entries[ps->num_entries++] = (stream_entry){type, name, val};
+    if (STREAM_THREADS > 1) ps->cost += entry_cost(type, val);
+    return 0;
+}
+
+/**
+ * Splits the entries into partitions of about PARTITION_COST each,
+ * so a heavy timer gets a partition of its own instead of holding
+ * up a thousand other metrics, and the threads finish together.
+ * @return 0 on success, -1 if the partitions could not be allocated.
+ */
+static int split_partitions(struct parallel_stream *ps) {
+    // Each partition but the last reaches the cost
+    ps->parts = calloc(ps->cost / PARTITION_COST + 1, sizeof(partition));
+    if (!ps->parts) return -1;
+    int start = 0;
+    uint64_t cost = 0;
+    for (int i=0; i < ps->num_entries; i++) {
+        cost += entry_cost(ps->entries[i].type, ps->entries[i].value);
+        if (cost < PARTITION_COST && i + 1 < ps->num_entries) continue;
+        ps->parts[ps->num_parts++] = (partition){start, i + 1};
+        start = i + 1;
+        cost = 0;
+    }
+    return 0;
+}
+
+// Compares entries by name
+static int compare_names(const void *a, const void *b) {
+    return strcmp(((const stream_entry*)a)->name, ((const stream_entry*)b)->name);
+}
+
+// Sorts names by their bytes from depth on, they share those before
+static void insertion_sort(stream_entry *e, int n, int depth) {
+    for (int i=1; i < n; i++) {
+        stream_entry cur = e[i];
+        int j = i;
+        for (; j > 0 && strcmp(e[j-1].name + depth, cur.name + depth) > 0; j--) {
+            e[j] = e[j-1];
+        }
+        e[j] = cur;
+    }
+}
+
+/**
+ * Sorts the entries by name with an MSD radix sort. The byte at
+ * the depth of each name is read once into a separate array, so
+ * the counting and the moves do not chase every name pointer twice.
+ * @arg e The entries, which share the first depth bytes of their names
+ * @arg tmp Space for n entries
+ * @arg bytes Space for n bytes
+ * @arg n The number of entries
+ * @arg depth The bytes already sorted on
+ */
+static void sort_names(stream_entry *e, stream_entry *tmp, unsigned char *bytes, int n, int depth) {
+    if (n <= INSERTION_SORT_MAX) {
+        insertion_sort(e, n, depth);
+        return;
+    } else if (depth >= RADIX_MAX_DEPTH) {
+        qsort(e, n, sizeof(stream_entry), compare_names);
+        return;
+    }
+
+    // Count the names by their byte at the depth
+    int ends[256];
+    memset(ends, 0, sizeof(ends));
+    for (int i=0; i < n; i++) {
+        bytes[i] = e[i].name[depth];
+        ends[bytes[i]]++;
+    }
+
+    // A common prefix goes on to the next byte without moving
+    unsigned char first = bytes[0];
+    if (ends[first] == n) {
+        if (first) sort_names(e, tmp, bytes, n, depth + 1);
+        return;
+    }
+
+    // Move them into their buckets, which keeps the order within each
+    for (int c=0, pos=0; c < 256; c++) {
+        int count = ends[c];
+        ends[c] = pos;
+        pos += count;
+    }
+    for (int i=0; i < n; i++) {
+        tmp[ends[bytes[i]]++] = e[i];
+    }
+    memcpy(e, tmp, n * sizeof(stream_entry));
+
+    // Sort each bucket on the next byte. The names that
+    // end at the depth are equal, and are already in place.
+    for (int c=1; c < 256; c++) {
+        int start = ends[c-1], count = ends[c] - start;
+        if (count > 1) sort_names(e + start, tmp, bytes, count, depth + 1);
+    }
+}
+
+// The order of the types in the output, counters of both kinds are sorted together
+static int type_class(metric_type type) {
+    return (type == COUNTER_SUM) ? COUNTER : type;
+}
+
+/**
+ * Sorts the entries by name within each type. The metrics are
+ * iterated a type at a time, so each run of a type is sorted.
+ */
+static void sort_entries(stream_entry *entries, int num) {
+    stream_entry *tmp = malloc(num * sizeof(stream_entry));
+    unsigned char *bytes = malloc(num);
+    if (!tmp || !bytes) {
+        syslog(LOG_WARNING, "Failed to sort the output, streaming it unsorted");
+        free(tmp);
+        free(bytes);
+        return;
+    }
+    for (int start=0, end; start < num; start = end) {
+        int class = type_class(entries[start].type);
+        for (end=start+1; end < num && type_class(entries[end].type) == class; end++);
+        sort_names(entries + start, tmp, bytes, end - start, 0);
+    }
+    free(tmp);
+    free(bytes);
+}
+
+/**
+ * Claims partitions and serializes them into memory,
+ * until there are none left.
+ */
+static void* partition_worker(void *arg) {
+    struct parallel_stream *ps = arg;
+    int i;
+    while ((i = __sync_fetch_and_add(&ps->next_part, 1)) < ps->num_parts) {
+        partition *p = ps->parts + i;
+        FILE *f = open_memstream(&p->buf, &p->len);
+        if (!f) p->res = -1;
+
+        // Serialize the entries of the partition
+        for (int j = p->start; j < p->end && !p->res; j++) {
+            if (__atomic_load_n(&ps->aborted, __ATOMIC_RELAXED)) break;
+            stream_entry *e = ps->entries + j;
+            PREV_NAME = (j > p->start) ? e[-1].name : NULL;
+            p->res = ps->cb(f, ps->data, e->type, e->name, e->value);
+        }
+        if (f) p->res = end_run(f, ps->data, ps->cb, p->res);
+        if (f && fclose(f)) p->res = -1;
+
+        // Hand the output to the writer
+        pthread_mutex_lock(&ps->lock);
+        p->done = 1;
+        pthread_cond_broadcast(&ps->cond);
+        pthread_mutex_unlock(&ps->lock);
+    }
+    return NULL;
+}
+
+// The timers of a flush being finalized
+struct parallel_finalize {
+    timer_hist **timers;
+    int num_timers;
+    int max_timers;
+    int num_heavy;                  // The timers of a batch of their own, at the front
+    uint64_t cost;                  // The estimated cost of the timers, see timer_cost
+    int *batches;                   // The first timer of each batch, and the end
+    int num_batches;
+    int next;                       // The next batch to claim
+};
+
+// Estimates the work of finalizing a timer, see timer_cost
+static inline uint64_t finalize_cost(timer_hist *t) {
+    return (t->tm.finalized) ? 1 : timer_cost(t);
+}
+
+/**
+ * Collects the timers to finalize. With threads, the heavy
+ * timers are moved to the front, so they are claimed first
+ * and a late one does not leave the others waiting on it.
+ */
+static int collect_timer(void *data, const char *key, void *value) {
+    (void)key;
+    struct parallel_finalize *pf = data;
+    if (pf->num_timers == pf->max_timers) {
+        int size = (pf->max_timers) ? pf->max_timers * 2 : PARALLEL_MIN_METRICS;
+        timer_hist **timers = realloc(pf->timers, size * sizeof(timer_hist*));
+        if (!timers) return 1;
+        pf->timers = timers;
+        pf->max_timers = size;
+    }
+    pf->timers[pf->num_timers++] = value;
+    if (STREAM_THREADS <= 1) return 0;
+
+    uint64_t cost = finalize_cost(value);
+    pf->cost += cost;
+    if (cost >= FINALIZE_COST) {
+        pf->timers[pf->num_timers - 1] = pf->timers[pf->num_heavy];
+        pf->timers[pf->num_heavy++] = value;
+    }
+    return 0;
+}
+
+/**
+ * Splits the timers into batches of about FINALIZE_COST each,
+ * a heavy timer being a batch of its own.
+ * @return 0 on success, -1 if the batches could not be allocated.
+ */
+static int split_batches(struct parallel_finalize *pf) {
+    // Each batch but the last reaches the cost
+    pf->batches = malloc((pf->cost / FINALIZE_COST + 2) * sizeof(int));
+    if (!pf->batches) return -1;
+    uint64_t cost = 0;
+    pf->batches[0] = 0;
+    for (int i=0; i < pf->num_timers; i++) {
+        cost += finalize_cost(pf->timers[i]);
+        if (cost < FINALIZE_COST && i + 1 < pf->num_timers) continue;
+        pf->batches[++pf->num_batches] = i + 1;
+        cost = 0;
+    }
+    return 0;
+}
+
+// Claims batches of timers and finalizes them, until there are none left
+static void* finalize_worker(void *arg) {
+    struct parallel_finalize *pf = arg;
+    int b;
+    while ((b = __sync_fetch_and_add(&pf->next, 1)) < pf->num_batches) {
+        for (int i=pf->batches[b]; i < pf->batches[b + 1]; i++) {
+            timer_finalize(&pf->timers[i]->tm);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Finalizes all the timers of a flush ahead of streaming it, so
+ * the output is not held up as each timer sorts its samples or
+ * flushes its quantile buffer on its first query. Large flushes
+ * are finalized by the threads of stream_set_threads, which claim
+ * batches sized by the estimated cost of their timers.
+ * @arg m The metrics to finalize
+ */
+void stream_finalize_timers(metrics *m) {
+    struct parallel_finalize pf;
+    memset(&pf, 0, sizeof(pf));
+    if (hashmap_iter(m->timers, collect_timer, &pf)) {
+        // Any timers left are finalized as they are queried
+        free(pf.timers);
+        return;
+    }
+
+    // Finalize small flushes here
+    if (pf.cost < PARALLEL_MIN_METRICS || STREAM_THREADS <= 1 || split_batches(&pf)) {
+        for (int i=0; i < pf.num_timers; i++) {
+            timer_finalize(&pf.timers[i]->tm);
+        }
+        free(pf.timers);
+        return;
+    }
+
+    // And large ones on the threads too
+    int num_threads = (pf.num_batches < STREAM_THREADS) ? pf.num_batches - 1 : STREAM_THREADS - 1;
+    pthread_t threads[num_threads + 1];
+    int started = 0;
+    for (; started < num_threads; started++) {
+        if (pthread_create(threads + started, NULL, finalize_worker, &pf)) break;
+    }
+    finalize_worker(&pf);
+    for (int i=0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(pf.batches);
+    free(pf.timers);
+}
+
+/**
+ * Serializes the metrics to a stream. Large flushes are split
+ * into partitions, serialized by STREAM_THREADS threads, and
+ * written in order as they complete. The metrics are sorted
+ * first if enabled.
  * @return 0 on success, or the value of stream callback.
  */
-int stream_to_command(metrics *m, void *data, stream_callback cb, char *cmd) {
-    // Create a pipe to the child
+static int stream_metrics(FILE *f, metrics *m, void *data, stream_callback cb) {
+    struct callback_info info = {f, data, cb, NULL};
+    if (STREAM_THREADS <= 1 && !SORTED) {
+        int res = metrics_iter(m, &info, stream_cb);
+        return end_run(f, data, cb, res);
+    }
+
+    // Collect the metrics, in the order they are iterated
+    struct parallel_stream ps;
+    memset(&ps, 0, sizeof(ps));
+    ps.data = data;
+    ps.cb = cb;
+    metrics_iter(m, &ps, collect_cb);
+    if (SORTED) sort_entries(ps.entries, ps.num_entries);
+
+    // Serialize small flushes directly
+    int res = 0;
+    if (ps.cost < PARALLEL_MIN_METRICS || STREAM_THREADS <= 1 || split_partitions(&ps)) {
+        for (int i=0; i < ps.num_entries && !res; i++) {
+            PREV_NAME = (i) ? ps.entries[i-1].name : NULL;
+            res = cb(f, data, ps.entries[i].type, ps.entries[i].name, ps.entries[i].value);
+        }
+        res = end_run(f, data, cb, res);
+        free(ps.entries);
+        return res;
+    }
+
+    // Start the threads
+    pthread_mutex_init(&ps.lock, NULL);
+    pthread_cond_init(&ps.cond, NULL);
+    int num_threads = (STREAM_THREADS < ps.num_parts) ? STREAM_THREADS : ps.num_parts;
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    int started = 0;
+    for (; started < num_threads; started++) {
+        if (pthread_create(threads + started, NULL, partition_worker, &ps)) break;
+    }
+
+    // Serialize here too if no thread could be started
+    if (!started) partition_worker(&ps);
+
+    // Write out the partitions in order
+    for (int i=0; i < ps.num_parts; i++) {
+        partition *p = ps.parts + i;
+        pthread_mutex_lock(&ps.lock);
+        while (!p->done) pthread_cond_wait(&ps.cond, &ps.lock);
+        pthread_mutex_unlock(&ps.lock);
+
+        if (!res) res = p->res;
+        if (!res && p->len && !fwrite(p->buf, p->len, 1, f)) res = 1;
+        if (res) __atomic_store_n(&ps.aborted, 1, __ATOMIC_RELAXED);
+        free(p->buf);
+    }
+
+    // Cleanup
+    for (int i=0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_cond_destroy(&ps.cond);
+    pthread_mutex_destroy(&ps.lock);
+    free(ps.parts);
+    free(ps.entries);
+    return res;
+}
+
+// Returns the monotonic time in milliseconds
+static uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+// Returns the monotonic time in fractional milliseconds, for the timings
+static double precise_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Returns the deadline of a command started now, or 0 for none
+static uint64_t command_deadline() {
+    return (TIMEOUT_MS > 0) ? monotonic_ms() + TIMEOUT_MS : 0;
+}
+
+// Returns the milliseconds left until a deadline, at least 0
+static int remaining_ms(uint64_t deadline) {
+    uint64_t now = monotonic_ms();
+    return (now < deadline) ? (int)(deadline - now) : 0;
+}
+
+/**
+ * Opens a pidfd of a child, which polls readable once it exits.
+ * @return The pidfd, or -1 if the kernel cannot open one.
+ */
+static int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+// The pipe to a command, whose writes are timed
+struct timed_pipe {
+    int fd;
+    uint64_t deadline;  // 0 for a blocking pipe
+};
+
+/**
+ * Waits for room in a non-blocking pipe after a short write
+ * @arg n The result of the write
+ * @arg deadline The monotonic milliseconds to wait until
+ * @return 0 to try again, -1 on an error or the deadline.
+ */
+static int wait_pipe_room(int fd, ssize_t n, uint64_t deadline) {
+    if (n < 0 && errno != EAGAIN && errno != EINTR) return -1;
+    int timeout = remaining_ms(deadline);
+    if (!timeout) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    poll(&pfd, 1, timeout);
+    return 0;
+}
+
+/**
+ * Writes a whole buffer to the pipe, until the deadline if there is one
+ * @return 0 on success, -1 on error.
+ */
+static int write_pipe(int fd, const char *buf, size_t len, uint64_t deadline) {
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(fd, buf + written, len - written);
+        if (n > 0) {
+            written += n;
+            continue;
+        }
+        if (!deadline && n < 0 && errno == EINTR) continue;
+        if (!deadline || wait_pipe_room(fd, n, deadline)) return -1;
+    }
+    return 0;
+}
+
+// Writes to the pipe, polling for room until the deadline if there is one.
+// Short writes are errors to stdio, so all of the buffer is written.
+static ssize_t timed_pipe_write(void *cookie, const char *buf, size_t size) {
+    struct timed_pipe *p = cookie;
+    double start = precise_ms();
+    int res = write_pipe(p->fd, buf, size, p->deadline);
+    TIMINGS.write_ms += precise_ms() - start;
+    return (res) ? 0 : size;
+}
+
+static int timed_pipe_close(void *cookie) {
+    struct timed_pipe *p = cookie;
+    int res = close(p->fd);
+    free(p);
+    return res;
+}
+
+// Wraps the pipe to a command, so its writes are timed and stop at the deadline
+static FILE* open_timed_pipe(int fd, uint64_t deadline) {
+    struct timed_pipe *p = malloc(sizeof(struct timed_pipe));
+    if (!p) return NULL;
+    p->fd = fd;
+    p->deadline = deadline;
+    cookie_io_functions_t funcs = {NULL, timed_pipe_write, NULL, timed_pipe_close};
+    FILE *f = (deadline && fcntl(fd, F_SETFL, O_NONBLOCK)) ? NULL : fopencookie(p, "w", funcs);
+    if (!f) free(p);
+    return f;
+}
+
+#ifdef __linux__
+/*
+ * A spliced pipe is written without a stdio buffer. The output is
+ * copied once, into fresh anonymous pages, which are handed to the
+ * pipe with vmsplice instead of being copied into it by write. The
+ * pages are unmapped once spliced and never written again, so the
+ * pipe may keep referring to them until the command reads them.
+ */
+struct spliced_pipe {
+    int fd;
+    uint64_t deadline;  // 0 for a blocking pipe
+    char *buf;          // The pages being filled, SPLICE_BUF_SIZE of them
+    size_t len;         // The bytes filled
+    int fallback;       // Set if vmsplice failed, the rest is written
+};
+
+/**
+ * Hands the filled pages to the pipe, and maps fresh ones
+ * @return 0 on success, -1 on error.
+ */
+static int splice_pages(struct spliced_pipe *p) {
+    struct iovec iov = {p->buf, p->len};
+    while (iov.iov_len) {
+        ssize_t n = (p->fallback) ? write(p->fd, iov.iov_base, iov.iov_len) :
+            vmsplice(p->fd, &iov, 1, SPLICE_F_GIFT | ((p->deadline) ? SPLICE_F_NONBLOCK : 0));
+        if (n > 0) {
+            iov.iov_base = (char*)iov.iov_base + n;
+            iov.iov_len -= n;
+            continue;
+        }
+        if (n < 0 && !p->fallback && (errno == EINVAL || errno == ENOSYS)) {
+            p->fallback = 1;
+            continue;
+        }
+        if (!p->deadline && n < 0 && errno == EINTR) continue;
+        if (!p->deadline || wait_pipe_room(p->fd, n, p->deadline)) return -1;
+    }
+    p->len = 0;
+
+    // The written pages can be reused, the spliced ones cannot
+    if (p->fallback) return 0;
+    munmap(p->buf, SPLICE_BUF_SIZE);
+    p->buf = mmap(NULL, SPLICE_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p->buf == MAP_FAILED) {
+        p->buf = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Times the splice of the filled pages, see splice_pages
+static int spliced_pipe_push(struct spliced_pipe *p) {
+    double start = precise_ms();
+    int res = splice_pages(p);
+    TIMINGS.write_ms += precise_ms() - start;
+    return res;
+}
+
+// Fills the pages, splicing them as they fill. Short
+// writes are errors to stdio, so all of the buffer is taken.
+static ssize_t spliced_pipe_write(void *cookie, const char *buf, size_t size) {
+    struct spliced_pipe *p = cookie;
+    size_t written = 0;
+    while (written < size) {
+        if (!p->buf) return 0;
+        size_t n = SPLICE_BUF_SIZE - p->len;
+        if (n > size - written) n = size - written;
+        memcpy(p->buf + p->len, buf + written, n);
+        p->len += n;
+        written += n;
+        if (p->len == SPLICE_BUF_SIZE && spliced_pipe_push(p)) return 0;
+    }
+    return written;
+}
+
+static int spliced_pipe_close(void *cookie) {
+    struct spliced_pipe *p = cookie;
+    int res = (p->buf && p->len) ? spliced_pipe_push(p) : 0;
+    if (p->buf) munmap(p->buf, SPLICE_BUF_SIZE);
+    if (close(p->fd)) res = -1;
+    free(p);
+    return res;
+}
+
+// Wraps the pipe to a command, so its output is spliced
+static FILE* open_spliced_pipe(int fd, uint64_t deadline) {
+    struct spliced_pipe *p = calloc(1, sizeof(struct spliced_pipe));
+    if (!p) return NULL;
+    p->fd = fd;
+    p->deadline = deadline;
+    p->buf = mmap(NULL, SPLICE_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p->buf == MAP_FAILED) {
+        free(p);
+        return NULL;
+    }
+
+    // A pipe as large as the pages takes them in one splice
+    fcntl(fd, F_SETPIPE_SZ, SPLICE_BUF_SIZE);
+    cookie_io_functions_t funcs = {NULL, spliced_pipe_write, NULL, spliced_pipe_close};
+    FILE *f = (deadline && fcntl(fd, F_SETFL, O_NONBLOCK)) ? NULL : fopencookie(p, "w", funcs);
+    if (!f) {
+        munmap(p->buf, SPLICE_BUF_SIZE);
+        free(p);
+        return NULL;
+    }
+    setvbuf(f, NULL, _IONBF, 0);
+    return f;
+}
+#endif
+
+/*
+ * A gather writer stands in for the stream of a pipe. The pieces of
+ * the output are kept as iovecs, which point at the names and suffixes
+ * where they are stored, and only the values are copied. They are
+ * written with a single writev once there are GATHER_IOVS of them, so
+ * most of the output is never copied before the pipe.
+ */
+struct stream_gather {
+    FILE *f;            // The stream it stands in for
+    int fd;             // The pipe, non-blocking if there is a deadline
+    uint64_t deadline;  // 0 for a blocking pipe
+    int failed;         // Set once a write fails
+    int num_iovs;
+    size_t copied;      // The bytes used of the copies
+    struct iovec iovs[GATHER_IOVS];
+    char copies[GATHER_COPY_SIZE];
+};
+
+/**
+ * Writes out the pieces of a gather writer
+ * @return 0 on success, -1 on error.
+ */
+int stream_gather_flush(stream_gather *g) {
+    struct iovec *iov = g->iovs;
+    int num = g->num_iovs;
+    double start = precise_ms();
+    while (num && !g->failed) {
+        ssize_t n = writev(g->fd, iov, num);
+        if (n < 0 && !g->deadline && errno == EINTR) continue;
+        if (n <= 0) {
+            if (!g->deadline || wait_pipe_room(g->fd, n, g->deadline)) g->failed = 1;
+            continue;
+        }
+
+        // Skip the pieces that were written, and the start of a partial one
+        while (num && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            num--;
+        }
+        if (num) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    TIMINGS.write_ms += precise_ms() - start;
+    g->num_iovs = 0;
+    g->copied = 0;
+    return (g->failed) ? -1 : 0;
+}
+
+/**
+ * Adds a piece that stays as it is until the writer is flushed
+ * @return 0 on success, -1 on error.
+ */
+int stream_gather_ref(stream_gather *g, const char *buf, size_t len) {
+    if (!len) return 0;
+    struct iovec *last = g->iovs + g->num_iovs - 1;
+    if (g->num_iovs && (char*)last->iov_base + last->iov_len == buf) {
+        last->iov_len += len;
+        return 0;
+    }
+    if (g->num_iovs == GATHER_IOVS && stream_gather_flush(g)) return -1;
+    g->iovs[g->num_iovs++] = (struct iovec){(void*)buf, len};
+    return (g->failed) ? -1 : 0;
+}
+
+/**
+ * Adds a piece that is copied, for one that will not last
+ * @return 0 on success, -1 on error.
+ */
+int stream_gather_copy(stream_gather *g, const char *buf, size_t len) {
+    // Flushed first if it could not be added, since that reuses the copies
+    if ((len > GATHER_COPY_SIZE - g->copied || g->num_iovs == GATHER_IOVS) &&
+            stream_gather_flush(g)) return -1;
+    if (len > GATHER_COPY_SIZE) {
+        if (stream_gather_ref(g, buf, len)) return -1;
+        return stream_gather_flush(g);
+    }
+    char *copy = g->copies + g->copied;
+    memcpy(copy, buf, len);
+    g->copied += len;
+    return stream_gather_ref(g, copy, len);
+}
+
+/**
+ * Returns the gather writer of the current thread
+ * @arg f The stream being written to
+ * @return The writer, or NULL if there is none for the stream.
+ */
+stream_gather* stream_gather_for(FILE *f) {
+    return (GATHER && GATHER->f == f) ? GATHER : NULL;
+}
+
+/**
+ * Starts a command with a shell, with a pipe to its stdin.
+ * @arg cmd The command to invoke
+ * @arg fd Output. Set to the write end of the pipe.
+ * @return The pid of the command, or negative on error.
+ */
+static pid_t spawn_pipe(char *cmd, int *fd) {
+    // Create a pipe to the child. Other commands must not inherit
+    // it, or they would keep it open past the end of the output.
     int filedes[2] = {0, 0};
-    int res = pipe(filedes);
+    int res = pipe2(filedes, O_CLOEXEC);
     if (res < 0) return res;
 
     // Fork and exec
-    int status;
     pid_t pid = fork();
-    if (pid < 0) return res;
+    if (pid < 0) {
+        close(filedes[0]);
+        close(filedes[1]);
+        return pid;
+    }
 
     // Check if we are the child
     if (pid == 0) {
@@ -45,8 +934,12 @@ int stream_to_command(metrics *m, void *data, stream_callback cb, char *cmd) {
             perror("Failed to initialize stdin!");
             exit(250);
         }
+        fcntl(STDIN_FILENO, F_SETFD, 0);
         close(filedes[1]);
 
+        // Move off the CPUs of the flush thread
+        cpu_pin_thread(STREAM_CPUS, -1);
+
         // Try to run the command
         res = execl("/bin/sh", "streaming", "-c", cmd, NULL);
         if (res != 0) perror("Failed to execute command!");
@@ -54,31 +947,1013 @@ int stream_to_command(metrics *m, void *data, stream_callback cb, char *cmd) {
         // Always exit
         exit(255);
     } else {
-        // Close the read end
+        // Close the read end. The child is only reaped by
+        // wait_command, which must see its exit status.
         close(filedes[0]);
-        waitpid(pid, &status, WNOHANG);
     }
+    *fd = filedes[1];
+    return pid;
+}
+
+/*
+ * An async pipe is written by a thread of its own, so the flush goes
+ * on formatting while the command reads. The output fills a ring of
+ * large buffers, and each full one is handed to the writer, so the
+ * flush only waits when the writer is behind by all of them.
+ */
+struct async_pipe {
+    int fd;
+    uint64_t deadline;  // 0 for a blocking pipe
+    int num_bufs;
+    char **bufs;        // The ring, ASYNC_BUF_SIZE each
+    size_t *lens;       // The bytes filled of each buffer
+    int head;           // The buffer being filled
+    int tail;           // The next buffer to write
+    int queued;         // Buffers handed to the writer, not yet written
+    int closing;        // Set once the last buffer is handed over
+    int failed;         // Set once a write fails
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+// Writes out the buffers as they are handed over
+static void* async_pipe_writer(void *arg) {
+    struct async_pipe *p = arg;
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        while (!p->queued && !p->closing) pthread_cond_wait(&p->cond, &p->lock);
+        if (!p->queued) break;
+
+        // The filled buffers are left alone by the flush, so no lock is held
+        int i = p->tail, failed = p->failed;
+        pthread_mutex_unlock(&p->lock);
+        if (!failed && write_pipe(p->fd, p->bufs[i], p->lens[i], p->deadline)) failed = 1;
+        pthread_mutex_lock(&p->lock);
+
+        p->failed = failed;
+        p->tail = (p->tail + 1) % p->num_bufs;
+        p->queued--;
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/**
+ * Hands the buffer being filled to the writer, and
+ * waits for the next one to be written if it is queued
+ * @return 0 on success, -1 if a write failed.
+ */
+static int async_pipe_push(struct async_pipe *p) {
+    pthread_mutex_lock(&p->lock);
+    p->queued++;
+    p->head = (p->head + 1) % p->num_bufs;
+    pthread_cond_broadcast(&p->cond);
+
+    // The flush is only held up by the writer once the ring is full
+    double start = precise_ms();
+    while (p->queued == p->num_bufs && !p->failed) pthread_cond_wait(&p->cond, &p->lock);
+    TIMINGS.write_ms += precise_ms() - start;
+    p->lens[p->head] = 0;
+    int res = (p->failed) ? -1 : 0;
+    pthread_mutex_unlock(&p->lock);
+    return res;
+}
+
+// Fills the buffers, handing them over as they fill. Short
+// writes are errors to stdio, so all of the buffer is taken.
+static ssize_t async_pipe_write(void *cookie, const char *buf, size_t size) {
+    struct async_pipe *p = cookie;
+    size_t written = 0;
+    while (written < size) {
+        size_t *len = p->lens + p->head;
+        size_t n = ASYNC_BUF_SIZE - *len;
+        if (n > size - written) n = size - written;
+        memcpy(p->bufs[p->head] + *len, buf + written, n);
+        *len += n;
+        written += n;
+        if (*len == ASYNC_BUF_SIZE && async_pipe_push(p)) return 0;
+    }
+    return written;
+}
+
+// Frees an async pipe, once its writer is done
+static void free_async_pipe(struct async_pipe *p) {
+    for (int i=0; i < p->num_bufs; i++) free(p->bufs[i]);
+    free(p->bufs);
+    free(p->lens);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
+
+static int async_pipe_close(void *cookie) {
+    struct async_pipe *p = cookie;
+    int res = (p->lens[p->head]) ? async_pipe_push(p) : 0;
+    pthread_mutex_lock(&p->lock);
+    p->closing = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    double start = precise_ms();
+    pthread_join(p->thread, NULL);
+    TIMINGS.write_ms += precise_ms() - start;
+    if (p->failed) res = -1;
+    if (close(p->fd)) res = -1;
+    free_async_pipe(p);
+    return res;
+}
+
+// Wraps the pipe to a command, so its output is written by a thread
+static FILE* open_async_pipe(int fd, uint64_t deadline) {
+    struct async_pipe *p = calloc(1, sizeof(struct async_pipe));
+    if (!p) return NULL;
+    p->fd = fd;
+    p->deadline = deadline;
+    p->num_bufs = ASYNC_BUFFERS;
+    p->bufs = calloc(p->num_bufs, sizeof(char*));
+    p->lens = calloc(p->num_bufs, sizeof(size_t));
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    int ok = p->bufs && p->lens;
+    for (int i=0; ok && i < p->num_bufs; i++) {
+        ok = (p->bufs[i] = malloc(ASYNC_BUF_SIZE)) != NULL;
+    }
+
+    // The writer only waits out the deadline on a non-blocking pipe
+    if (ok && deadline && fcntl(fd, F_SETFL, O_NONBLOCK)) ok = 0;
+    int started = ok && !pthread_create(&p->thread, NULL, async_pipe_writer, p);
+    cookie_io_functions_t funcs = {NULL, async_pipe_write, NULL, async_pipe_close};
+    FILE *f = (started) ? fopencookie(p, "w", funcs) : NULL;
+    if (!f) {
+        if (started) {
+            pthread_mutex_lock(&p->lock);
+            p->closing = 1;
+            pthread_cond_broadcast(&p->cond);
+            pthread_mutex_unlock(&p->lock);
+            pthread_join(p->thread, NULL);
+        }
+        free_async_pipe(p);
+        return NULL;
+    }
+    setvbuf(f, NULL, _IONBF, 0);
+    return f;
+}
+
+/**
+ * Wraps the pipe to a command in a stream
+ * @arg fd The write end of the pipe, closed on error
+ * @arg deadline The monotonic milliseconds at which writes to the
+ * pipe fail, or 0 for blocking writes
+ * @arg direct Set for the output of a single invocation, which is
+ * spliced or written by a thread, if enabled. The output is then only
+ * all pushed once the pipe is closed.
+ * @return The stream, or NULL on error.
+ */
+static FILE* open_pipe(int fd, uint64_t deadline, int direct) {
+    FILE *f;
+#ifdef __linux__
+    if (direct && SPLICE) {
+        f = open_spliced_pipe(fd, deadline);
+        if (f) return f;
+    }
+#endif
+    if (direct && ASYNC_BUFFERS) {
+        f = open_async_pipe(fd, deadline);
+        if (f) return f;
+    }
+    // The fan out polls the descriptor of a plain stream
+    f = (deadline || direct) ? open_timed_pipe(fd, deadline) : fdopen(fd, "w");
+    if (!f) close(fd);
+
+    // Use a buffer the size of a pipe, so each write fills it
+    if (f) setvbuf(f, NULL, _IOFBF, PIPE_BUF_SIZE);
+    return f;
+}
+
+/**
+ * Starts a command with a shell, with a pipe to its stdin.
+ * @arg cmd The command to invoke
+ * @arg deadline The monotonic milliseconds at which writes to the
+ * pipe fail, or 0 for blocking writes
+ * @arg direct Set for the output of a single invocation, which is
+ * spliced or written by a thread, if enabled. The output is then only
+ * all pushed once the pipe is closed.
+ * @arg f Output. Set to the write end of the pipe.
+ * @return The pid of the command, or negative on error.
+ */
+static pid_t spawn_command(char *cmd, uint64_t deadline, int direct, FILE **f) {
+    int fd;
+    pid_t pid = spawn_pipe(cmd, &fd);
+    if (pid >= 0) *f = open_pipe(fd, deadline, direct);
+    return pid;
+}
+
+/**
+ * Opens the stream of the output to a command, which
+ * compresses it into the pipe when enabled.
+ * @arg pipe The pipe to the command
+ * @return The stream, or NULL on error.
+ */
+static FILE* open_output(FILE *pipe) {
+    return (COMPRESSION == COMPRESS_LZ4) ? lz4_frame_open(pipe) : pipe;
+}
+
+/**
+ * Closes a stream from open_output, which ends the frame.
+ * The pipe is left open.
+ * @return 0 on success, -1 on error.
+ */
+static int close_output(FILE *out, FILE *pipe) {
+    if (!out) return -1;
+    return (out != pipe && fclose(out)) ? -1 : 0;
+}
+
+/**
+ * Waits for a command to terminate
+ * @return The exit status of the command, or -1 if it was
+ * killed or could not be waited for.
+ */
+static int wait_command(pid_t pid) {
+    int status = 0;
+    while (1) {
+        if (waitpid(pid, &status, 0) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) break;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/**
+ * Waits for a command to terminate, and kills it at the deadline.
+ * The exit is polled for with a pidfd, so it is noticed at once.
+ * @arg cmd The command, for logging
+ * @arg deadline The monotonic milliseconds to kill it at, or 0 for none
+ * @return The exit status of the command, or -1 if it was killed.
+ */
+static int wait_command_until(pid_t pid, char *cmd, uint64_t deadline) {
+    if (!deadline) return wait_command(pid);
+    int pidfd = open_pidfd(pid);
+    int status = 0, res = -1;
+    while (1) {
+        pid_t r = waitpid(pid, &status, WNOHANG);
+        if (r < 0) break;
+        if (r == pid && (WIFEXITED(status) || WIFSIGNALED(status))) {
+            res = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+            break;
+        }
+        int timeout = remaining_ms(deadline);
+        if (!timeout) {
+            syslog(LOG_WARNING, "Killing streaming command past its timeout: %s", cmd);
+            kill(pid, SIGKILL);
+            wait_command(pid);
+            break;
+        }
+        if (pidfd >= 0) {
+            struct pollfd pfd = {pidfd, POLLIN, 0};
+            poll(&pfd, 1, timeout);
+        } else {
+            usleep(REAP_POLL_US);
+        }
+    }
+    if (pidfd >= 0) close(pidfd);
+    return res;
+}
 
-    // Create a file wrapper
-    FILE *f = fdopen(filedes[1], "w");
+/**
+ * Streams the metrics stored in a metrics object to an external command
+ * @arg m The metrics object to stream
+ * @arg data An opaque handle passed to the callback
+ * @arg cb The callback to invoke
+ * @arg cmd The command to invoke, invoked with a shell.
+ * @return 0 on success, or the value of stream callback.
+ */
+int stream_to_command(metrics *m, void *data, stream_callback cb, char *cmd) {
+    return stream_all_to_command(&m, 1, data, cb, cmd);
+}
 
-    // Wrap the relevant pointers
-    struct callback_info info = {f, data, cb};
+/**
+ * Streams the metrics stored in multiple metrics objects to
+ * a single invocation of an external command. The objects
+ * are streamed in order.
+ * @arg m An array of metrics objects to stream
+ * @arg num_metrics The number of metrics objects
+ * @arg data An opaque handle passed to the callback
+ * @arg cb The callback to invoke
+ * @arg cmd The command to invoke, invoked with a shell.
+ * @return 0 on success, or the value of stream callback.
+ */
+int stream_all_to_command(metrics **m, int num_metrics, void *data, stream_callback cb, char *cmd) {
+    // Start the command
+    STATSITE_PROBE1(stream_start, cmd);
+    TIMINGS = (stream_timings){0, 0, 0};
+    double start = precise_ms();
+    int fd;
+    uint64_t deadline = command_deadline();
+    pid_t pid = spawn_pipe(cmd, &fd);
+    double spawned = precise_ms();
+    TIMINGS.command_ms = spawned - start;
+    if (pid < 0) {
+        STATSITE_PROBE1(stream_done, pid);
+        return pid;
+    }
 
-    // Start iterating
-    metrics_iter(m, &info, stream_cb);
+    // The gather writer takes the place of the pipe, so it is
+    // neither spliced nor written by a thread
+    int gather = GATHER_OUTPUT && COMPRESSION == COMPRESS_NONE;
+    FILE *f = open_pipe(fd, deadline, !gather);
+    if (f && gather) {
+        GATHER = malloc(sizeof(stream_gather));
+        if (GATHER) *GATHER = (stream_gather){.f = f, .fd = fd, .deadline = deadline};
+    }
+
+    // Start streaming, stop if the callback aborts. A flush either
+    // gathers all its output or writes it all to the stream, so the
+    // two are in order if both are emptied after each one.
+    FILE *out = (f) ? open_output(f) : NULL;
+    for (int i=0; i < num_metrics && out; i++) {
+        int res = stream_metrics(out, m[i], data, cb);
+        if (GATHER && (fflush(out) || stream_gather_flush(GATHER))) res = -1;
+        if (res) break;
+    }
 
     // Close everything out
-    fclose(f);
-    close(filedes[1]);
+    free(GATHER);
+    GATHER = NULL;
+    close_output(out, f);
+    if (f) fclose(f);
+    double closed = precise_ms();
+    TIMINGS.format_ms = closed - spawned - TIMINGS.write_ms;
+    if (TIMINGS.format_ms < 0) TIMINGS.format_ms = 0;
 
     // Wait for termination
+    int res = wait_command_until(pid, cmd, deadline);
+    TIMINGS.command_ms += precise_ms() - closed;
+    STATSITE_PROBE1(stream_done, res);
+    return res;
+}
+
+// A command of a partitioned stream, and the metrics that hash to it
+struct command_partition {
+    stream_entry *entries;
+    int num_entries;
+    char *cmd;
+    void *data;
+    stream_callback cb;
+    int res;                // The status of the command
+    stream_timings timings; // Of the thread that ran it
+};
+
+// Runs a command of a partitioned stream, and writes its metrics to it
+static void* command_partition_worker(void *arg) {
+    struct command_partition *cp = arg;
+    STATSITE_PROBE1(stream_start, cp->cmd);
+    TIMINGS = (stream_timings){0, 0, 0};
+    double start = precise_ms();
+    int fd;
+    uint64_t deadline = command_deadline();
+    pid_t pid = spawn_pipe(cp->cmd, &fd);
+    double spawned = precise_ms();
+    TIMINGS.command_ms = spawned - start;
+    if (pid < 0) {
+        STATSITE_PROBE1(stream_done, pid);
+        cp->res = pid;
+        cp->timings = TIMINGS;
+        return NULL;
+    }
+
+    // Serialize the entries, in the order they were collected
+    FILE *f = open_pipe(fd, deadline, 1);
+    FILE *out = (f) ? open_output(f) : NULL;
+    if (out) {
+        int res = 0;
+        for (int i=0; i < cp->num_entries && !res; i++) {
+            stream_entry *e = cp->entries + i;
+            PREV_NAME = (i) ? e[-1].name : NULL;
+            res = cp->cb(out, cp->data, e->type, e->name, e->value);
+        }
+        end_run(out, cp->data, cp->cb, res);
+    }
+    close_output(out, f);
+    if (f) fclose(f);
+    double closed = precise_ms();
+    TIMINGS.format_ms = closed - spawned - TIMINGS.write_ms;
+    if (TIMINGS.format_ms < 0) TIMINGS.format_ms = 0;
+
+    cp->res = wait_command_until(pid, cp->cmd, deadline);
+    TIMINGS.command_ms += precise_ms() - closed;
+    STATSITE_PROBE1(stream_done, cp->res);
+    cp->timings = TIMINGS;
+    return NULL;
+}
+
+/**
+ * Streams the metrics stored in a metrics object to several
+ * invocations of an external command at once. The metrics are
+ * split by the hash of their names, so each invocation always
+ * gets the same keys, and each is written by a thread of its
+ * own, so the callback must be safe to invoke concurrently.
+ * The metrics are sorted first if enabled.
+ * @arg m The metrics object to stream
+ * @arg data An opaque handle passed to the callback
+ * @arg cb The callback to invoke
+ * @arg cmd The command to invoke, invoked with a shell.
+ * @arg num The number of invocations
+ * @return 0 on success, or the first non-zero status of the commands.
+ */
+int stream_partitioned_to_command(metrics *m, void *data, stream_callback cb, char *cmd, int num) {
+    if (num <= 1) return stream_to_command(m, data, cb, cmd);
+
+    // Collect the metrics, and count those of each partition
+    struct parallel_stream ps;
+    memset(&ps, 0, sizeof(ps));
+    metrics_iter(m, &ps, collect_cb);
+    if (SORTED) sort_entries(ps.entries, ps.num_entries);
+    int *parts = malloc(ps.num_entries * sizeof(int) + 1);
+    stream_entry *by_part = malloc(ps.num_entries * sizeof(stream_entry) + 1);
+    if (!parts || !by_part) {
+        free(parts);
+        free(by_part);
+        free(ps.entries);
+        return -1;
+    }
+    struct command_partition cps[num];
+    memset(cps, 0, sizeof(cps));
+    for (int i=0; i < ps.num_entries; i++) {
+        char *name = ps.entries[i].name;
+        parts[i] = hash_key(name, strlen(name)) % num;
+        cps[parts[i]].num_entries++;
+    }
+
+    // Move the entries of each partition together, keeping their order
+    int offset = 0;
+    for (int i=0; i < num; i++) {
+        int count = cps[i].num_entries;
+        cps[i] = (struct command_partition){by_part + offset, 0, cmd, data, cb};
+        offset += count;
+    }
+    for (int i=0; i < ps.num_entries; i++) {
+        struct command_partition *cp = cps + parts[i];
+        cp->entries[cp->num_entries++] = ps.entries[i];
+    }
+    free(parts);
+
+    // Run the commands, on this thread if a thread cannot start
+    pthread_t threads[num];
+    int started[num];
+    for (int i=0; i < num; i++) {
+        started[i] = !pthread_create(threads + i, NULL, command_partition_worker, cps + i);
+        if (!started[i]) command_partition_worker(cps + i);
+    }
+
+    // The flush takes as long as the slowest command
+    int res = 0;
+    TIMINGS = (stream_timings){0, 0, 0};
+    for (int i=0; i < num; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        if (!res) res = cps[i].res;
+        stream_timings *t = &cps[i].timings;
+        if (t->format_ms > TIMINGS.format_ms) TIMINGS.format_ms = t->format_ms;
+        if (t->write_ms > TIMINGS.write_ms) TIMINGS.write_ms = t->write_ms;
+        if (t->command_ms > TIMINGS.command_ms) TIMINGS.command_ms = t->command_ms;
+    }
+    free(by_part);
+    free(ps.entries);
+    return res;
+}
+
+/**
+ * Returns the timings of the last stream_to_command,
+ * stream_all_to_command or stream_partitioned_to_command on the
+ * current thread, the slowest command's for a partitioned stream
+ * @arg t Output, the timings
+ */
+void stream_get_timings(stream_timings *t) {
+    *t = TIMINGS;
+}
+
+/**
+ * Streams the metrics stored in a metrics object to a file,
+ * which is replaced if it exists.
+ * @arg m The metrics object to stream
+ * @arg data An opaque handle passed to the callback
+ * @arg cb The callback to invoke
+ * @arg path The path of the file
+ * @return 0 on success, -1 if the file could not be written,
+ * or the value of stream callback.
+ */
+int stream_to_file(metrics *m, void *data, stream_callback cb, char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) return -1;
+    int res = stream_metrics(f, m, data, cb);
+    if (fclose(f) && !res) res = -1;
+    return res;
+}
+
+/**
+ * Streams the metrics stored in a metrics object to an open file.
+ * @arg f The file to write to, which is not closed
+ * @arg m The metrics object to stream
+ * @arg data An opaque handle passed to the callback
+ * @arg cb The callback to invoke
+ * @return 0 on success, or the value of stream callback.
+ */
+int stream_to_handle(FILE *f, metrics *m, void *data, stream_callback cb) {
+    return stream_metrics(f, m, data, cb);
+}
+
+// Copies the contents of a file to a stream
+static int copy_file(char *path, FILE *out) {
+    FILE *in = fopen(path, "r");
+    if (!in) return -1;
+    char buf[PIPE_BUF_SIZE];
+    size_t n;
+    int res = 0;
+    while (!res && (n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (fwrite(buf, 1, n, out) != n) res = -1;
+    }
+    if (ferror(in)) res = -1;
+    fclose(in);
+    return res;
+}
+
+/**
+ * Streams the contents of a file, as written by stream_to_file,
+ * to an external command.
+ * @arg path The path of the file
+ * @arg cmd The command to invoke, invoked with a shell.
+ * @return 0 on success, -1 if the file could not be read,
+ * or the exit status of the command.
+ */
+int stream_file_to_command(char *path, char *cmd) {
+    FILE *f;
+    uint64_t deadline = command_deadline();
+    pid_t pid = spawn_command(cmd, deadline, 1, &f);
+    if (pid < 0) return pid;
+    FILE *out = (f) ? open_output(f) : NULL;
+    int res = (out) ? copy_file(path, out) : -1;
+    if (close_output(out, f)) res = -1;
+    if (f) fclose(f);
+    int status = wait_command_until(pid, cmd, deadline);
+    return (res) ? res : status;
+}
+
+/**
+ * Streams a buffer to an external command.
+ * @arg buf The contents to stream, may be NULL if empty
+ * @arg len The length of the buffer
+ * @arg cmd The command to invoke, invoked with a shell.
+ * @return 0 on success, -1 if the buffer could not be written,
+ * or the exit status of the command.
+ */
+int stream_buffer_to_command(const char *buf, size_t len, char *cmd) {
+    FILE *f;
+    uint64_t deadline = command_deadline();
+    pid_t pid = spawn_command(cmd, deadline, 1, &f);
+    if (pid < 0) return pid;
+    FILE *out = (f) ? open_output(f) : NULL;
+    int res = (!out || (len && fwrite(buf, 1, len, out) != len)) ? -1 : 0;
+    if (close_output(out, f)) res = -1;
+    if (f) fclose(f);
+    int status = wait_command_until(pid, cmd, deadline);
+    return (res) ? res : status;
+}
+
+// A command that a buffer is fanned out to
+struct fan_out {
+    pid_t pid;          // 0 once reaped
+    int pidfd;          // -1 if the kernel cannot open one
+    FILE *f;            // NULL once the buffer is written, or the pipe failed
+    size_t written;
+    uint64_t deadline;  // In monotonic milliseconds, 0 for none
+};
+
+// Kills a command that is past its deadline, and reaps it
+static void kill_command(struct fan_out *c, char *cmd, int *result) {
+    syslog(LOG_WARNING, "Killing streaming command past its timeout: %s", cmd);
+    if (c->f) fclose(c->f);
+    c->f = NULL;
+    kill(c->pid, SIGKILL);
+    wait_command(c->pid);
+    c->pid = 0;
+    if (c->pidfd >= 0) close(c->pidfd);
+    c->pidfd = -1;
+    *result = -1;
+}
+
+/**
+ * Writes the buffer to the pipes of the commands as each has room,
+ * until it is written to all of them or they are past their deadlines.
+ */
+static void write_fan_out(const char *buf, size_t len, struct fan_out *cmds, char **names,
+        int *results, int num) {
+    struct pollfd fds[num];
+    int idx[num];
+    while (1) {
+        uint64_t now = monotonic_ms();
+        int n = 0, timeout = -1;
+        for (int i=0; i < num; i++) {
+            struct fan_out *c = cmds + i;
+            if (!c->f) continue;
+            if (c->deadline && now >= c->deadline) {
+                kill_command(c, names[i], results + i);
+                continue;
+            }
+            fds[n] = (struct pollfd){fileno(c->f), POLLOUT, 0};
+            idx[n++] = i;
+            if (c->deadline && (timeout < 0 || c->deadline - now < (uint64_t)timeout)) {
+                timeout = c->deadline - now;
+            }
+        }
+        if (!n) return;
+        if (poll(fds, n, timeout) < 0 && errno != EINTR) {
+            syslog(LOG_ERR, "Failed to poll the streaming commands: %s", strerror(errno));
+            timeout = 10;
+        }
+
+        // Write as much as each pipe takes
+        for (int k=0; k < n; k++) {
+            struct fan_out *c = cmds + idx[k];
+            if (!fds[k].revents) continue;
+            ssize_t res = write(fds[k].fd, buf + c->written, len - c->written);
+            if (res > 0) c->written += res;
+            if (res < 0 && errno != EAGAIN && errno != EINTR) results[idx[k]] = -1;
+            if (c->written == len || results[idx[k]]) {
+                fclose(c->f);
+                c->f = NULL;
+            }
+        }
+    }
+}
+
+int stream_buffer_to_commands(const char *buf, size_t len, char **cmds, int *timeouts_ms, int *results, int num) {
+    // Compress once for all of the commands
+    char *compressed = NULL;
+    size_t compressed_len = 0;
+    if (COMPRESSION != COMPRESS_NONE) {
+        FILE *mem = open_memstream(&compressed, &compressed_len);
+        FILE *out = (mem) ? open_output(mem) : NULL;
+        int err = (!out || (len && fwrite(buf, 1, len, out) != len));
+        if (out && close_output(out, mem)) err = 1;
+        if (mem && fclose(mem)) err = 1;
+        if (err) {
+            free(compressed);
+            for (int i=0; i < num; i++) results[i] = -1;
+            return -1;
+        }
+        buf = compressed;
+        len = compressed_len;
+    }
+
+    // Start all the commands
+    struct fan_out fan[num];
+    uint64_t start = monotonic_ms();
+    for (int i=0; i < num; i++) {
+        struct fan_out *c = fan + i;
+        memset(c, 0, sizeof(struct fan_out));
+        c->pidfd = -1;
+        results[i] = 0;
+        pid_t pid = spawn_command(cmds[i], 0, 0, &c->f);
+        if (pid < 0) {
+            results[i] = -1;
+            c->f = NULL;
+            continue;
+        }
+        c->pid = pid;
+        c->pidfd = open_pidfd(pid);
+        if (timeouts_ms[i] > 0) c->deadline = start + timeouts_ms[i];
+        if (c->f && fcntl(fileno(c->f), F_SETFL, O_NONBLOCK)) results[i] = -1;
+        if (!c->f) results[i] = -1;
+        if (c->f && (!len || results[i])) {
+            fclose(c->f);
+            c->f = NULL;
+        }
+    }
+    write_fan_out(buf, len, fan, cmds, results, num);
+    free(compressed);
+
+    // Reap the commands as they exit, or once past their deadlines.
+    // The pidfds are polled, so an exit is noticed at once.
+    struct pollfd fds[num];
+    int running;
     do {
-        usleep(100000);
-        if (waitpid(pid, &status, 0) < 0) break;
-    } while (!WIFEXITED(status));
+        running = 0;
+        int n = 0, timeout = -1, polled = 1;
+        uint64_t now = monotonic_ms();
+        for (int i=0; i < num; i++) {
+            struct fan_out *c = fan + i;
+            if (!c->pid) continue;
+            int status;
+            pid_t res = waitpid(c->pid, &status, WNOHANG);
+            if (res == c->pid && (WIFEXITED(status) || WIFSIGNALED(status))) {
+                if (!results[i]) results[i] = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+                c->pid = 0;
+            } else if (res < 0) {
+                c->pid = 0;
+            } else if (c->deadline && now >= c->deadline) {
+                kill_command(c, cmds[i], results + i);
+            } else {
+                running = 1;
+                if (c->pidfd >= 0) {
+                    fds[n++] = (struct pollfd){c->pidfd, POLLIN, 0};
+                } else {
+                    polled = 0;
+                }
+                if (c->deadline && (timeout < 0 || c->deadline - now < (uint64_t)timeout)) {
+                    timeout = c->deadline - now;
+                }
+            }
+            if (!c->pid && c->pidfd >= 0) {
+                close(c->pidfd);
+                c->pidfd = -1;
+            }
+        }
+        if (!running) break;
+        if (!polled) {
+            usleep(REAP_POLL_US);
+        } else {
+            poll(fds, n, timeout);
+        }
+    } while (running);
 
-    // Return the result of the process
-    return WEXITSTATUS(status);
+    for (int i=0; i < num; i++) {
+        if (results[i]) return results[i];
+    }
+    return 0;
+}
+
+int stream_file_to_commands(char *path, char **cmds, int *timeouts_ms, int *results, int num) {
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *mem = open_memstream(&buf, &len);
+    int res = (mem) ? copy_file(path, mem) : -1;
+    if (mem && fclose(mem)) res = -1;
+    if (res) {
+        for (int i=0; i < num; i++) results[i] = -1;
+    } else {
+        res = stream_buffer_to_commands(buf, len, cmds, timeouts_ms, results, num);
+    }
+    free(buf);
+    return res;
+}
+
+/**
+ * Initializes a persistent sink. The command is started lazily
+ * on the first flush, and restarted if it exits.
+ * @arg cmd The command to invoke, this is not copied.
+ * @arg sink The sink to initialize
+ * @return 0 on success.
+ */
+int init_stream_sink(char *cmd, stream_sink *sink) {
+    sink->cmd = cmd;
+    sink->pid = 0;
+    sink->f = NULL;
+    sink->ring = NULL;
+    return pthread_mutex_init(&sink->lock, NULL);
 }
 
+/*
+ * The output ring is written without a stdio buffer, so the output
+ * is copied once, straight into the ring. The bytes are written
+ * ahead of the published head, which only moves at the end of a
+ * frame, or when the ring fills up and the reader must make room.
+ */
+struct ring_output {
+    shm_ring *ring;
+    uint64_t head;      // Bytes written, published or not
+    int timeout_ms;     // How long to wait for room
+};
+
+// Copies into the ring, waiting for the reader if it is full.
+// Short writes are errors to stdio, so all of the buffer is taken.
+static ssize_t ring_output_write(void *cookie, const char *buf, size_t size) {
+    struct ring_output *o = cookie;
+    uint32_t ring_size = shm_ring_size(o->ring);
+    uint64_t deadline = 0;
+    size_t written = 0;
+    while (written < size) {
+        // Keep a byte free, a full ring would look empty to the reader
+        uint64_t room = ring_size - (o->head - shm_ring_tail(o->ring)) - 1;
+        if (!room) {
+            shm_ring_publish(o->ring, o->head);
+            if (!deadline) deadline = monotonic_ms() + o->timeout_ms;
+            if (!remaining_ms(deadline)) {
+                errno = ETIMEDOUT;
+                return 0;
+            }
+            usleep(RING_POLL_US);
+            continue;
+        }
+
+        // The data is mapped twice, so a copy may run past the end
+        size_t n = (size - written < room) ? size - written : room;
+        memcpy(shm_ring_data(o->ring) + (o->head & (ring_size - 1)), buf + written, n);
+        o->head += n;
+        written += n;
+    }
+    return written;
+}
+
+// Drops the bytes that were not published, and unmaps the ring
+static int ring_output_close(void *cookie) {
+    struct ring_output *o = cookie;
+    shm_ring_close(o->ring);
+    free(o);
+    return 0;
+}
+
+/**
+ * Initializes a sink that writes the flushes into a shared memory
+ * ring, for a sink process on the same host that reads them in place.
+ * The ring is created, or reused if one of the same size is left.
+ * @arg path The path of the ring file, this is not copied.
+ * @arg size The data size, a power of two multiple of the page size
+ * @arg timeout_ms How long a flush waits for room in a full ring
+ * @arg sink The sink to initialize
+ * @return 0 on success.
+ */
+int init_ring_sink(char *path, uint32_t size, int timeout_ms, stream_sink *sink) {
+    if (init_stream_sink(NULL, sink)) return -1;
+    struct ring_output *o = calloc(1, sizeof(struct ring_output));
+    if (!o || shm_ring_create(path, size, &o->ring)) {
+        free(o);
+        pthread_mutex_destroy(&sink->lock);
+        return -1;
+    }
+    o->head = shm_ring_head(o->ring);
+    o->timeout_ms = timeout_ms;
+
+    cookie_io_functions_t funcs = {NULL, ring_output_write, NULL, ring_output_close};
+    sink->f = fopencookie(o, "w", funcs);
+    if (!sink->f) {
+        ring_output_close(o);
+        pthread_mutex_destroy(&sink->lock);
+        return -1;
+    }
+    setvbuf(sink->f, NULL, _IONBF, 0);
+    sink->ring = o;
+    return 0;
+}
+
+/**
+ * Ends a frame to a persistent sink. The frames written
+ * to a ring are published to the reader.
+ * @return 0 on success, -1 on error.
+ */
+static int flush_sink(stream_sink *sink) {
+    if (fflush(sink->f)) return -1;
+    if (sink->ring) shm_ring_publish(sink->ring->ring, sink->ring->head);
+    return 0;
+}
+
+/**
+ * Closes the pipe to the command and reaps it. The
+ * unpublished bytes of a ring are dropped instead.
+ * Must be called with the lock held.
+ */
+static int close_sink(stream_sink *sink) {
+    if (sink->ring) {
+        sink->ring->head = shm_ring_head(sink->ring->ring);
+        return 0;
+    }
+    if (!sink->pid) return 0;
+    fclose(sink->f);
+    int status = wait_command(sink->pid);
+    sink->f = NULL;
+    sink->pid = 0;
+    return status;
+}
+
+/**
+ * Reaps the command if it has exited since the last flush,
+ * and starts it if it is not running.
+ * Must be called with the lock held.
+ * @return 0 on success, -1 if the command could not be started.
+ */
+static int open_sink(stream_sink *sink) {
+    int status;
+    if (sink->ring) return 0;
+    if (sink->pid && waitpid(sink->pid, &status, WNOHANG) == sink->pid) {
+        syslog(LOG_WARNING, "Persistent sink exited with status %d, restarting",
+                WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        fclose(sink->f);
+        sink->f = NULL;
+        sink->pid = 0;
+    }
+
+    // Start the command if needed
+    if (!sink->pid) {
+        pid_t pid = spawn_command(sink->cmd, 0, 0, &sink->f);
+        if (pid < 0) return -1;
+        sink->pid = pid;
+    }
+    return 0;
+}
+
+/**
+ * Streams the metrics to a persistent sink, followed
+ * by a frame delimiter.
+ * @arg sink The sink to stream to
+ * @arg m The metrics object to stream
+ * @arg data An opaque handle passed to the callback
+ * @arg cb The callback to invoke
+ * @arg delim The frame delimiter written after the metrics
+ * @arg delim_len The length of the delimiter
+ * @return 0 on success, or the value of stream callback, or -1
+ * if the command could not be started or has exited.
+ */
+int stream_to_sink(stream_sink *sink, metrics *m, void *data, stream_callback cb, char *delim, int delim_len) {
+    int res = 0;
+    pthread_mutex_lock(&sink->lock);
+    if (open_sink(sink)) {
+        pthread_mutex_unlock(&sink->lock);
+        return -1;
+    }
+
+    // Stream the metrics and the delimiter, as a frame of their own
+    FILE *out = open_output(sink->f);
+    res = (out) ? stream_metrics(out, m, data, cb) : -1;
+    if (!res && delim_len && !fwrite(delim, delim_len, 1, out)) res = -1;
+    if (close_output(out, sink->f) && !res) res = -1;
+    if (!res && flush_sink(sink)) res = -1;
+
+    // The command is unusable after a failed write
+    if (res) {
+        syslog(LOG_WARNING, "Failed to stream to persistent sink, restarting");
+        close_sink(sink);
+    }
+
+    pthread_mutex_unlock(&sink->lock);
+    return res;
+}
+
+/**
+ * Streams the contents of a file, as written by stream_to_file,
+ * to a persistent sink, followed by a frame delimiter.
+ * @arg sink The sink to stream to
+ * @arg path The path of the file
+ * @arg delim The frame delimiter written after the contents
+ * @arg delim_len The length of the delimiter
+ * @return 0 on success, -1 on error.
+ */
+int stream_file_to_sink(stream_sink *sink, char *path, char *delim, int delim_len) {
+    pthread_mutex_lock(&sink->lock);
+    FILE *out = (open_sink(sink)) ? NULL : open_output(sink->f);
+    int res = (out) ? copy_file(path, out) : -1;
+    if (!res && delim_len && !fwrite(delim, delim_len, 1, out)) res = -1;
+    if (out && close_output(out, sink->f)) res = -1;
+    if (!res && flush_sink(sink)) res = -1;
+    if (res && sink->pid) {
+        syslog(LOG_WARNING, "Failed to stream to persistent sink, restarting");
+        close_sink(sink);
+    }
+    pthread_mutex_unlock(&sink->lock);
+    return res;
+}
+
+/**
+ * Streams a buffer to a persistent sink, followed
+ * by a frame delimiter.
+ * @arg sink The sink to stream to
+ * @arg buf The contents to stream, may be NULL if empty
+ * @arg len The length of the buffer
+ * @arg delim The frame delimiter written after the contents
+ * @arg delim_len The length of the delimiter
+ * @return 0 on success, -1 on error.
+ */
+int stream_buffer_to_sink(stream_sink *sink, const char *buf, size_t len, char *delim, int delim_len) {
+    pthread_mutex_lock(&sink->lock);
+    FILE *out = (open_sink(sink)) ? NULL : open_output(sink->f);
+    int res = (out) ? 0 : -1;
+    if (!res && len && fwrite(buf, 1, len, out) != len) res = -1;
+    if (!res && delim_len && !fwrite(delim, delim_len, 1, out)) res = -1;
+    if (out && close_output(out, sink->f)) res = -1;
+    if (!res && flush_sink(sink)) res = -1;
+    if (res && sink->pid) {
+        syslog(LOG_WARNING, "Failed to stream to persistent sink, restarting");
+        close_sink(sink);
+    }
+    pthread_mutex_unlock(&sink->lock);
+    return res;
+}
+
+/**
+ * Closes the pipe to a persistent sink, and waits
+ * for the command to exit.
+ * @arg sink The sink to destroy
+ * @return The exit status of the command, or 0 if not running.
+ */
+int destroy_stream_sink(stream_sink *sink) {
+    pthread_mutex_lock(&sink->lock);
+    int status = close_sink(sink);
+    if (sink->ring) {
+        fclose(sink->f);
+        sink->f = NULL;
+        sink->ring = NULL;
+    }
+    pthread_mutex_unlock(&sink->lock);
+    pthread_mutex_destroy(&sink->lock);
+    return status;
+}
@@ -1,6 +1,8 @@
 #ifndef STREAMING_H
 #define STREAMING_H
 #include <stdio.h>
+#include <pthread.h>
+#include <sys/types.h>
 #include "metrics.h"
 
 /**
@@ -10,6 +12,142 @@
  */
 typedef int(*stream_callback)(FILE *pipe, void *data, metric_type type, char *name, void *value);
 
+/**
+ * Sets the number of threads that serialize the metrics of
+ * a flush. With more than one, large flushes are split into
+ * partitions of about the same estimated cost, a heavy timer
+ * counting for its samples and bins, that are serialized in
+ * parallel and written in order, so the callback must be safe
+ * to invoke concurrently.
+ * @arg threads The number of threads
+ */
+void stream_set_threads(int threads);
+
+/**
+ * Sets the CPUs the stream commands run on
+ * @arg cpus A list of CPUs, see affinity.h, or NULL for any
+ */
+void stream_set_cpus(char *cpus);
+
+/**
+ * Sets the compression of the output to the stream commands and
+ * the persistent sinks. Each command gets one frame, and each flush
+ * to a persistent sink is a frame of its own, delimiter included,
+ * so the sink decodes the frames as they arrive. The files written
+ * by stream_to_file are not compressed.
+ * @arg compression The compression
+ */
+void stream_set_compression(output_compression compression);
+
+/**
+ * Sets if the metrics of each flush are sorted by name. They
+ * are sorted within each type, counters of both kinds together,
+ * and the types are in their usual order.
+ * @arg sorted Non-zero to sort
+ */
+void stream_set_sorted(int sorted);
+
+/**
+ * Returns the name of the metric streamed before the current one
+ * to the same output, which a callback can front code against.
+ * @return The name, or NULL for the first metric of a flush, or
+ * of a partition serialized in parallel. Only valid in a callback.
+ */
+char* stream_prev_name(void);
+
+/**
+ * Sets if the stream callback is told of the end of each run of
+ * metrics, so a callback can buffer them and write them out in
+ * blocks. It is then invoked with a NULL name and value after
+ * the last metric of a flush, and of a partition serialized in
+ * parallel. Each run is serialized on a single thread, so the
+ * blocks can be buffered in thread local storage.
+ * @arg enabled Non-zero to tell the callback
+ */
+void stream_set_block_output(int enabled);
+
+/**
+ * Sets how long a stream command may run. A command that does
+ * not take its output or exit in time is killed, and the flush
+ * fails, so a hung command does not hold up the flushes. This
+ * applies to each invocation of a command, not to the persistent
+ * sinks, and the fanned out commands have their own timeouts.
+ * @arg timeout_ms The milliseconds a command may run, 0 for no limit
+ */
+void stream_set_timeout(int timeout_ms);
+
+/**
+ * Sets if the output to each invocation of a stream command is
+ * spliced. The output is copied once into fresh pages, which
+ * vmsplice hands to the pipe, instead of going through a stdio
+ * buffer and being copied into the pipe by write. Only on Linux,
+ * elsewhere the output is always written. The persistent sinks
+ * and the fanned out commands are written as before.
+ * @arg enabled Non-zero to splice the output
+ */
+void stream_set_splice(int enabled);
+
+/**
+ * Sets if the output to each invocation of a stream command is
+ * written by a thread of its own. The flush fills a ring of large
+ * buffers, which the thread writes to the pipe, so formatting goes on
+ * while the command reads, and only waits once the thread is behind
+ * by all of the buffers. Spliced output is written as before, and so
+ * are the persistent sinks and the fanned out commands.
+ * @arg buffers The buffers of the ring, at least 2, or 0 to write
+ * the output on the flush thread
+ */
+void stream_set_async(int buffers);
+
+/**
+ * Sets if the output to each invocation of a stream command is
+ * gathered. Callbacks that use stream_gather_for add the pieces of
+ * their output as references, which are written to the pipe with
+ * writev in large batches, so the names and suffixes are never
+ * copied. Others write to their stream as before. The output is
+ * not gathered when it is compressed, and is then not spliced.
+ * @arg enabled Non-zero to gather the output
+ */
+void stream_set_gather(int enabled);
+
+// Assembles the output of a flush in place, see stream_set_gather
+typedef struct stream_gather stream_gather;
+
+/**
+ * Returns the gather writer of the current thread
+ * @arg f The stream being written to
+ * @return The writer, or NULL if there is none for the stream.
+ */
+stream_gather* stream_gather_for(FILE *f);
+
+/**
+ * Adds a piece that stays as it is until the writer is flushed
+ * @return 0 on success, -1 on error.
+ */
+int stream_gather_ref(stream_gather *g, const char *buf, size_t len);
+
+/**
+ * Adds a piece that is copied, for one that will not last
+ * @return 0 on success, -1 on error.
+ */
+int stream_gather_copy(stream_gather *g, const char *buf, size_t len);
+
+/**
+ * Writes out the pieces of a gather writer
+ * @return 0 on success, -1 on error.
+ */
+int stream_gather_flush(stream_gather *g);
+
+/**
+ * Finalizes all the timers of a flush ahead of streaming it, so
+ * the output is not held up as each timer sorts its samples or
+ * flushes its quantile buffer on its first query. Large flushes
+ * are finalized by the threads of stream_set_threads, which claim
+ * batches sized by the estimated cost of their timers.
+ * @arg m The metrics to finalize
+ */
+void stream_finalize_timers(metrics *m);
+
 /**
  * Streams the metrics stored in a metrics object to an external command
  * @arg m The metrics object to stream
@@ -20,5 +158,198 @@ typedef int(*stream_callback)(FILE *pipe, void *data, metric_type type, char *na
  */
 int stream_to_command(metrics *m, void *data, stream_callback cb, char *cmd);
 
+/**
+ * Streams the metrics stored in multiple metrics objects to
+ * a single invocation of an external command. The objects
+ * are streamed in order.
+ * @arg m An array of metrics objects to stream
+ * @arg num_metrics The number of metrics objects
+ * @arg data An opaque handle passed to the callback
+ * @arg cb The callback to invoke
+ * @arg cmd The command to invoke, invoked with a shell.
+ * @return 0 on success, or the value of stream callback.
+ */
+int stream_all_to_command(metrics **m, int num_metrics, void *data, stream_callback cb, char *cmd);
+
+/**
+ * Streams the metrics stored in a metrics object to several
+ * invocations of an external command at once. The metrics are
+ * split by the hash of their names, so each invocation always
+ * gets the same keys, and each is written by a thread of its
+ * own, so the callback must be safe to invoke concurrently.
+ * The metrics are sorted first if enabled.
+ * @arg m The metrics object to stream
+ * @arg data An opaque handle passed to the callback
+ * @arg cb The callback to invoke
+ * @arg cmd The command to invoke, invoked with a shell.
+ * @arg num The number of invocations
+ * @return 0 on success, or the first non-zero status of the commands.
+ */
+int stream_partitioned_to_command(metrics *m, void *data, stream_callback cb, char *cmd, int num);
+
+// The time spent in each part of streaming to a command, in milliseconds
+typedef struct {
+    double format_ms;   // Formatting the output, less the writes
+    double write_ms;    // Blocked on the pipe, or on the writer thread
+    double command_ms;  // Starting the command, and waiting for its exit
+} stream_timings;
+
+/**
+ * Returns the timings of the last stream_to_command,
+ * stream_all_to_command or stream_partitioned_to_command on the
+ * current thread, the slowest command's for a partitioned stream
+ * @arg t Output, the timings
+ */
+void stream_get_timings(stream_timings *t);
+
+/**
+ * A persistent sink keeps a single instance of the
+ * command running across flushes. Each flush is written
+ * to the same pipe, followed by a frame delimiter.
+ */
+typedef struct {
+    char *cmd;      // The command to invoke, invoked with a shell
+    pid_t pid;      // The pid of the command, 0 if not running
+    FILE *f;        // Pipe to the command, or the stream into the ring
+    struct ring_output *ring; // The output ring, NULL for a command
+    pthread_mutex_t lock; // Serializes overlapping flushes
+} stream_sink;
+
+/**
+ * Streams the metrics stored in a metrics object to a file,
+ * which is replaced if it exists.
+ * @arg m The metrics object to stream
+ * @arg data An opaque handle passed to the callback
+ * @arg cb The callback to invoke
+ * @arg path The path of the file
+ * @return 0 on success, -1 if the file could not be written,
+ * or the value of stream callback.
+ */
+int stream_to_file(metrics *m, void *data, stream_callback cb, char *path);
+
+/**
+ * Streams the metrics stored in a metrics object to an open file.
+ * @arg f The file to write to, which is not closed
+ * @arg m The metrics object to stream
+ * @arg data An opaque handle passed to the callback
+ * @arg cb The callback to invoke
+ * @return 0 on success, or the value of stream callback.
+ */
+int stream_to_handle(FILE *f, metrics *m, void *data, stream_callback cb);
+
+/**
+ * Streams a buffer to an external command.
+ * @arg buf The contents to stream, may be NULL if empty
+ * @arg len The length of the buffer
+ * @arg cmd The command to invoke, invoked with a shell.
+ * @return 0 on success, -1 if the buffer could not be written,
+ * or the exit status of the command.
+ */
+int stream_buffer_to_command(const char *buf, size_t len, char *cmd);
+
+/**
+ * Streams a buffer to several external commands at once. They
+ * are started together, and the buffer is written to each of
+ * them as its pipe has room, so a slow command does not hold up
+ * the others. A command still running at its timeout is killed.
+ * @arg buf The contents to stream, may be NULL if empty
+ * @arg len The length of the buffer
+ * @arg cmds The commands to invoke, invoked with a shell.
+ * @arg timeouts_ms The milliseconds each command may run, 0 for no limit
+ * @arg results Output, the exit status of each command, or -1 if it
+ * could not be started or written to, or was killed.
+ * @arg num The number of commands
+ * @return 0 on success, or the first non-zero result.
+ */
+int stream_buffer_to_commands(const char *buf, size_t len, char **cmds, int *timeouts_ms, int *results, int num);
+
+/**
+ * Streams the contents of a file, as written by stream_to_file,
+ * to several external commands at once, as stream_buffer_to_commands.
+ * @arg path The path of the file
+ * @return 0 on success, -1 if the file could not be read,
+ * or the first non-zero result.
+ */
+int stream_file_to_commands(char *path, char **cmds, int *timeouts_ms, int *results, int num);
+
+/**
+ * Streams the contents of a file, as written by stream_to_file,
+ * to an external command.
+ * @arg path The path of the file
+ * @arg cmd The command to invoke, invoked with a shell.
+ * @return 0 on success, -1 if the file could not be read,
+ * or the exit status of the command.
+ */
+int stream_file_to_command(char *path, char *cmd);
+
+/**
+ * Initializes a persistent sink. The command is started lazily
+ * on the first flush, and restarted if it exits.
+ * @arg cmd The command to invoke, this is not copied.
+ * @arg sink The sink to initialize
+ * @return 0 on success.
+ */
+int init_stream_sink(char *cmd, stream_sink *sink);
+
+/**
+ * Initializes a sink that writes the flushes into a shared memory
+ * ring, for a sink process on the same host that reads them in place.
+ * The ring is created, or reused if one of the same size is left.
+ * Each flush and its delimiter is published at once, unless it does
+ * not fit in the ring, in which case it is published as the ring
+ * fills. A flush that fails is not published.
+ * @arg path The path of the ring file, this is not copied.
+ * @arg size The data size, a power of two multiple of the page size
+ * @arg timeout_ms How long a flush waits for room in a full ring
+ * @arg sink The sink to initialize
+ * @return 0 on success.
+ */
+int init_ring_sink(char *path, uint32_t size, int timeout_ms, stream_sink *sink);
+
+/**
+ * Streams the metrics to a persistent sink, followed
+ * by a frame delimiter.
+ * @arg sink The sink to stream to
+ * @arg m The metrics object to stream
+ * @arg data An opaque handle passed to the callback
+ * @arg cb The callback to invoke
+ * @arg delim The frame delimiter written after the metrics
+ * @arg delim_len The length of the delimiter
+ * @return 0 on success, or the value of stream callback, or -1
+ * if the command could not be started or has exited.
+ */
+int stream_to_sink(stream_sink *sink, metrics *m, void *data, stream_callback cb, char *delim, int delim_len);
+
+/**
+ * Streams the contents of a file, as written by stream_to_file,
+ * to a persistent sink, followed by a frame delimiter.
+ * @arg sink The sink to stream to
+ * @arg path The path of the file
+ * @arg delim The frame delimiter written after the contents
+ * @arg delim_len The length of the delimiter
+ * @return 0 on success, -1 on error.
+ */
+int stream_file_to_sink(stream_sink *sink, char *path, char *delim, int delim_len);
+
+/**
+ * Streams a buffer to a persistent sink, followed
+ * by a frame delimiter.
+ * @arg sink The sink to stream to
+ * @arg buf The contents to stream, may be NULL if empty
+ * @arg len The length of the buffer
+ * @arg delim The frame delimiter written after the contents
+ * @arg delim_len The length of the delimiter
+ * @return 0 on success, -1 on error.
+ */
+int stream_buffer_to_sink(stream_sink *sink, const char *buf, size_t len, char *delim, int delim_len);
+
+/**
+ * Closes the pipe to a persistent sink, and waits
+ * for the command to exit.
+ * @arg sink The sink to destroy
+ * @return The exit status of the command, or 0 if not running.
+ */
+int destroy_stream_sink(stream_sink *sink);
+
 #endif
 
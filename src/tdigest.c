@@ -0,0 +1,244 @@
+/**
+ * This module implements a merging t-digest, from
+ * "Computing Extremely Accurate Quantiles Using t-Digests"
+ * by Dunning and Ertl.
+ *
+ * Values are appended to a buffer behind the merged centroids.
+ * When it fills up, the buffer is sorted and merged with the
+ * centroids in a single pass, using the arcsine scale function
+ * to bound the size of each centroid. This keeps the tails
+ * accurate, and bounds the number of centroids by roughly the
+ * compression factor.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "tdigest.h"
+#include "stats.h"
+
+// Number of unmerged values buffered per unit of compression
+#define TD_BUFFER_FACTOR 5
+
+/* Static declarations */
+static int add_node(tdigest *td, double mean, double weight);
+
+// Sorts centroids by their mean
+static int compare_centroids(const void *a, const void *b) {
+    double m1 = ((const td_centroid*)a)->mean;
+    double m2 = ((const td_centroid*)b)->mean;
+    return (m1 < m2) ? -1 : (m1 > m2);
+}
+
+// Scale function, maps a quantile to a k index
+static inline double td_q_to_k(tdigest *td, double q) {
+    return td->compression / (2 * M_PI) * asin(2 * q - 1);
+}
+
+// Inverse of the scale function
+static inline double td_k_to_q(tdigest *td, double k) {
+    double angle = k * 2 * M_PI / td->compression;
+    if (angle >= M_PI / 2) return 1;
+    return (sin(angle) + 1) / 2;
+}
+
+/**
+ * Initializes the t-digest
+ * @arg compression The compression factor. Higher values are
+ * more accurate but use more memory. Must be at least 20.
+ * @arg td The tdigest struct to initialize
+ * @return 0 on success.
+ */
+int init_tdigest(double compression, tdigest *td) {
+    if (compression < 20 || !td) return -1;
+    td->compression = compression;
+    td->num_centroids = 0;
+    td->num_nodes = 0;
+    td->size = ceil(compression) * (TD_BUFFER_FACTOR + 1);
+    td->nodes = NULL;
+    td->scratch = NULL;
+    td->total_weight = 0;
+    td->min = INFINITY;
+    td->max = -INFINITY;
+    return 0;
+}
+
+/**
+ * Destroy the t-digest
+ * @arg td The tdigest to destroy
+ * @return 0 on success.
+ */
+int destroy_tdigest(tdigest *td) {
+    if (td->nodes && td->scratch) stats_mem_add(MEM_TIMERS, -(int64_t)(2 * td->size * sizeof(td_centroid)));
+    free(td->nodes);
+    free(td->scratch);
+    td->nodes = NULL;
+    td->scratch = NULL;
+    return 0;
+}
+
+/**
+ * Adds a new value to the digest
+ * @arg td The tdigest to add to
+ * @arg val The new value
+ * @return 0 on success.
+ */
+int tdigest_add(tdigest *td, double val) {
+    if (val < td->min) td->min = val;
+    if (val > td->max) td->max = val;
+    return add_node(td, val, 1);
+}
+
+/**
+ * Adds a new value that stands for a number of values,
+ * as a single node with that weight.
+ * @arg td The tdigest to add to
+ * @arg val The new value
+ * @arg weight The number of values it stands for, above 0
+ * @return 0 on success.
+ */
+int tdigest_add_weighted(tdigest *td, double val, double weight) {
+    if (val < td->min) td->min = val;
+    if (val > td->max) td->max = val;
+    return add_node(td, val, weight);
+}
+
+/**
+ * Merges the centroids of one digest into another.
+ * @arg dst The tdigest to merge into
+ * @arg src The tdigest to merge from. It is only flushed.
+ * @return 0 on success.
+ */
+int tdigest_merge(tdigest *dst, tdigest *src) {
+    tdigest_flush(src);
+    if (!src->num_centroids) return 0;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+
+    // Treat each centroid of the source as a weighted value
+    for (uint32_t i=0; i < src->num_centroids; i++) {
+        add_node(dst, src->nodes[i].mean, src->nodes[i].weight);
+    }
+    return tdigest_flush(dst);
+}
+
+/**
+ * Merges any buffered values into the centroids.
+ * @arg td The tdigest to flush
+ * @return 0 on success.
+ */
+int tdigest_flush(tdigest *td) {
+    if (td->num_nodes == td->num_centroids) return 0;
+
+    // Sort the buffered values, and get the new total weight
+    td_centroid *nodes = td->nodes;
+    double total = td->total_weight;
+    for (uint32_t i=td->num_centroids; i < td->num_nodes; i++) {
+        total += nodes[i].weight;
+    }
+    qsort(nodes + td->num_centroids, td->num_nodes - td->num_centroids,
+            sizeof(td_centroid), compare_centroids);
+
+    // Merge the sorted centroids and values into the scratch space
+    td_centroid *in = td->scratch;
+    uint32_t a = 0, b = td->num_centroids, n = 0;
+    while (a < td->num_centroids || b < td->num_nodes) {
+        if (b == td->num_nodes || (a < td->num_centroids && nodes[a].mean <= nodes[b].mean))
+            in[n++] = nodes[a++];
+        else
+            in[n++] = nodes[b++];
+    }
+
+    /*
+     * Merge neighbors while the combined centroid spans
+     * less than one unit of the scale function.
+     */
+    double so_far = 0;
+    double q_limit = td_k_to_q(td, td_q_to_k(td, 0) + 1);
+    td_centroid cur = in[0];
+    uint32_t out = 0;
+    for (uint32_t i=1; i < n; i++) {
+        double proposed = cur.weight + in[i].weight;
+        if ((so_far + proposed) / total <= q_limit) {
+            cur.mean += (in[i].mean - cur.mean) * in[i].weight / proposed;
+            cur.weight = proposed;
+        } else {
+            nodes[out++] = cur;
+            so_far += cur.weight;
+            q_limit = td_k_to_q(td, td_q_to_k(td, so_far / total) + 1);
+            cur = in[i];
+        }
+    }
+    nodes[out++] = cur;
+
+    td->num_centroids = out;
+    td->num_nodes = out;
+    td->total_weight = total;
+
+    // Keep the buffer usable if the centroids take up most of the space
+    if (out > td->size / 2) {
+        stats_mem_add(MEM_TIMERS, 2 * td->size * sizeof(td_centroid));
+        td->size *= 2;
+        td->nodes = realloc(td->nodes, td->size * sizeof(td_centroid));
+        td->scratch = realloc(td->scratch, td->size * sizeof(td_centroid));
+    }
+    return 0;
+}
+
+/**
+ * Queries for a quantile value. The digest is flushed first.
+ * @arg td The tdigest to query
+ * @arg quantile The quantile to query, on [0, 1]
+ * @return The value on success or 0.
+ */
+double tdigest_query(tdigest *td, double quantile) {
+    tdigest_flush(td);
+    uint32_t n = td->num_centroids;
+    if (!n) return 0;
+    if (quantile <= 0) return td->min;
+    if (quantile >= 1) return td->max;
+
+    td_centroid *c = td->nodes;
+    if (n == 1) return c[0].mean;
+
+    // Interpolate between the minimum and the first centroid
+    double index = quantile * td->total_weight;
+    if (index < c[0].weight / 2) {
+        return td->min + (index / (c[0].weight / 2)) * (c[0].mean - td->min);
+    }
+
+    // Interpolate between the centers of adjacent centroids
+    double so_far = c[0].weight / 2;
+    for (uint32_t i=0; i < n - 1; i++) {
+        double dw = (c[i].weight + c[i+1].weight) / 2;
+        if (so_far + dw > index) {
+            double frac = (index - so_far) / dw;
+            return c[i].mean + frac * (c[i+1].mean - c[i].mean);
+        }
+        so_far += dw;
+    }
+
+    // Interpolate between the last centroid and the maximum
+    double frac = (index - so_far) / (c[n-1].weight / 2);
+    if (frac > 1) frac = 1;
+    return c[n-1].mean + frac * (td->max - c[n-1].mean);
+}
+
+/**
+ * Appends a weighted value to the buffer,
+ * merging the buffer first if it is full.
+ * The buffer is allocated on first use.
+ */
+static int add_node(tdigest *td, double mean, double weight) {
+    // Allocate on the first value
+    if (!td->nodes) {
+        td->nodes = malloc(td->size * sizeof(td_centroid));
+        td->scratch = malloc(td->size * sizeof(td_centroid));
+        if (!td->nodes || !td->scratch) return -1;
+        stats_mem_add(MEM_TIMERS, 2 * td->size * sizeof(td_centroid));
+    }
+    if (td->num_nodes == td->size) tdigest_flush(td);
+    td->nodes[td->num_nodes].mean = mean;
+    td->nodes[td->num_nodes].weight = weight;
+    td->num_nodes++;
+    return 0;
+}
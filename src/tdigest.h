@@ -0,0 +1,87 @@
+/**
+ * This module implements a merging t-digest, from
+ * "Computing Extremely Accurate Quantiles Using t-Digests"
+ * by Dunning and Ertl. It uses bounded memory, has amortized
+ * constant time inserts, and digests can be merged.
+ */
+#ifndef TDIGEST_H
+#define TDIGEST_H
+#include <stdint.h>
+
+typedef struct {
+    double mean;    // Mean of the values in the centroid
+    double weight;  // Number of values in the centroid
+} td_centroid;
+
+typedef struct {
+    double compression;     // Compression factor, bounds the centroids
+
+    td_centroid *nodes;     // Merged centroids, followed by the unmerged values
+    td_centroid *scratch;   // Scratch space used while merging
+    uint32_t num_centroids; // Number of merged centroids
+    uint32_t num_nodes;     // Number of merged and unmerged nodes
+    uint32_t size;          // Allocated size of nodes
+
+    double total_weight;    // Total weight of the merged centroids
+    double min;             // Minimum value added
+    double max;             // Maximum value added
+} tdigest;
+
+/**
+ * Initializes the t-digest
+ * @arg compression The compression factor. Higher values are
+ * more accurate but use more memory. Must be at least 20.
+ * @arg td The tdigest struct to initialize
+ * @return 0 on success.
+ */
+int init_tdigest(double compression, tdigest *td);
+
+/**
+ * Destroy the t-digest
+ * @arg td The tdigest to destroy
+ * @return 0 on success.
+ */
+int destroy_tdigest(tdigest *td);
+
+/**
+ * Adds a new value to the digest
+ * @arg td The tdigest to add to
+ * @arg val The new value
+ * @return 0 on success.
+ */
+int tdigest_add(tdigest *td, double val);
+
+/**
+ * Adds a new value that stands for a number of values,
+ * as a single node with that weight.
+ * @arg td The tdigest to add to
+ * @arg val The new value
+ * @arg weight The number of values it stands for, above 0
+ * @return 0 on success.
+ */
+int tdigest_add_weighted(tdigest *td, double val, double weight);
+
+/**
+ * Merges the centroids of one digest into another.
+ * @arg dst The tdigest to merge into
+ * @arg src The tdigest to merge from. It is only flushed.
+ * @return 0 on success.
+ */
+int tdigest_merge(tdigest *dst, tdigest *src);
+
+/**
+ * Queries for a quantile value. The digest is flushed first.
+ * @arg td The tdigest to query
+ * @arg quantile The quantile to query, on [0, 1]
+ * @return The value on success or 0.
+ */
+double tdigest_query(tdigest *td, double quantile);
+
+/**
+ * Merges any buffered values into the centroids.
+ * @arg td The tdigest to flush
+ * @return 0 on success.
+ */
+int tdigest_flush(tdigest *td);
+
+#endif
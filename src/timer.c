@@ -1,8 +1,17 @@
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include "timer.h"
+#include "stats.h"
 
 /* Static declarations */
-static void finalize_timer(timer *timer);
+static int engine_add_sample(timer *timer, double sample);
+static int engine_add_weighted(timer *timer, double sample, uint64_t weight);
+static inline void add_extremes(timer *timer, double sample, int first);
+static int exact_add_sample(timer *timer, double sample);
+static inline uint64_t admit_weight(timer *timer);
+static void convert_exact_to_engine(timer *timer);
+static void release_exact(timer *timer);
 
 /**
  * Initializes the timer struct
@@ -16,18 +25,123 @@ int init_timer(double eps, double *quantiles, uint32_t num_quants, timer *timer)
     timer->count = 0;
     timer->sum = 0;
     timer->squared_sum = 0;
+    timer->min = 0;
+    timer->max = 0;
     timer->finalized = 1;
-    int res = init_cm_quantile(eps, quantiles, num_quants, &timer->cm);
+    timer->engine = TIMER_ENGINE_CM;
+    timer->exact = NULL;
+    timer->num_exact = 0;
+    timer->exact_size = 0;
+    timer->exact_arena = NULL;
+    timer->admit_after = 0;
+    int res = init_cm_quantile(eps, quantiles, num_quants, &timer->q.cm);
     return res;
 }
 
+/**
+ * Initializes the timer struct to use a t-digest
+ * @arg compression The compression of the digest
+ * @arg timer The timer struct to initialize
+ * @return 0 on success.
+ */
+int init_timer_tdigest(double compression, timer *timer) {
+    timer->count = 0;
+    timer->sum = 0;
+    timer->squared_sum = 0;
+    timer->min = 0;
+    timer->max = 0;
+    timer->finalized = 1;
+    timer->engine = TIMER_ENGINE_TDIGEST;
+    timer->exact = NULL;
+    timer->num_exact = 0;
+    timer->exact_size = 0;
+    timer->exact_arena = NULL;
+    timer->admit_after = 0;
+    return init_tdigest(compression, &timer->q.td);
+}
+
+/**
+ * Initializes the timer struct to use a log-linear histogram
+ * @arg eps The relative error of the values
+ * @arg timer The timer struct to initialize
+ * @return 0 on success.
+ */
+int init_timer_hdr(double eps, timer *timer) {
+    timer->count = 0;
+    timer->sum = 0;
+    timer->squared_sum = 0;
+    timer->min = 0;
+    timer->max = 0;
+    timer->finalized = 1;
+    timer->engine = TIMER_ENGINE_HDR;
+    timer->exact = NULL;
+    timer->num_exact = 0;
+    timer->exact_size = 0;
+    timer->exact_arena = NULL;
+    timer->admit_after = 0;
+    return init_hdr(eps, &timer->q.hdr);
+}
+
+/**
+ * Initializes the timer struct to keep no quantiles, only
+ * the count, sums, min and max. It allocates nothing and
+ * keeps no raw samples, and its quantiles are all 0.
+ * @arg timer The timer struct to initialize
+ * @return 0 on success.
+ */
+int init_timer_stats(timer *timer) {
+    timer->count = 0;
+    timer->sum = 0;
+    timer->squared_sum = 0;
+    timer->min = 0;
+    timer->max = 0;
+    timer->finalized = 1;
+    timer->engine = TIMER_ENGINE_STATS;
+    timer->exact = NULL;
+    timer->num_exact = 0;
+    timer->exact_size = 0;
+    timer->exact_arena = NULL;
+    timer->admit_after = 0;
+    return 0;
+}
+
 /**
  * Destroy the timer struct.
  * @arg timer The timer to destroy
  * @return 0 on success.
  */
 int destroy_timer(timer *timer) {
-    return destroy_cm_quantile(&timer->cm);
+    if (timer->engine == TIMER_ENGINE_STATS) return 0;
+    release_exact(timer);
+    if (timer->engine == TIMER_ENGINE_TDIGEST)
+        return destroy_tdigest(&timer->q.td);
+    if (timer->engine == TIMER_ENGINE_HDR)
+        return destroy_hdr(&timer->q.hdr);
+    return destroy_cm_quantile(&timer->q.cm);
+}
+
+/**
+ * Allocates the raw samples of the timer from an arena, so they
+ * are released all at once when it is reset, instead of one timer
+ * at a time. The timer must be destroyed before the reset.
+ * @arg timer The timer, before any samples are added
+ * @arg a The arena to allocate from
+ */
+void timer_use_arena(timer *timer, arena *a) {
+    timer->exact_arena = a;
+}
+
+/**
+ * Samples the inserts into the quantile engine once the timer
+ * has many samples, which caps the cost of the hottest keys.
+ * Past the threshold, one of every count / threshold samples is
+ * inserted, weighted by the samples skipped, so the quantiles
+ * stay unbiased. The count, sums, min and max stay exact.
+ * @arg timer The timer, before any samples are added
+ * @arg threshold The samples inserted before sampling, 0 to insert all
+ */
+void timer_set_admission(timer *timer, uint32_t threshold) {
+    timer->admit_after = threshold;
 }
 
 /**
@@ -41,7 +155,102 @@ int timer_add_sample(timer *timer, double sample) {
     timer->sum += sample;
     timer->squared_sum += pow(sample, 2);
     timer->finalized = 0;
-    return cm_add_sample(&timer->cm, sample);
+    add_extremes(timer, sample, timer->count == 1);
+    if (timer->engine == TIMER_ENGINE_STATS) return 0;
+
+    // Keep the raw samples while the timer is small
+    if (timer->count <= TIMER_EXACT_MAX)
+        return exact_add_sample(timer, sample);
+    if (timer->num_exact)
+        convert_exact_to_engine(timer);
+
+    // Past the admission threshold, most samples are skipped
+    if (timer->admit_after && timer->count > timer->admit_after) {
+        uint64_t weight = admit_weight(timer);
+        if (!weight) return 0;
+        if (weight > 1) return engine_add_weighted(timer, sample, weight);
+    }
+    return engine_add_sample(timer, sample);
+}
+
+/**
+ * Adds a new sample that stands for a number of samples, such as
+ * one sent with a sample rate. It counts that many times in the
+ * count and sums, and is inserted into the quantile engine once.
+ * While the timer keeps raw samples, it is stored that many times.
+ * @arg timer The timer to add to
+ * @arg sample The new sample value
+ * @arg weight The number of samples it stands for, at least 1
+ * @return 0 on success.
+ */
+int timer_add_weighted(timer *timer, double sample, uint64_t weight) {
+    if (weight <= 1) return timer_add_sample(timer, sample);
+    timer->count += weight;
+    timer->sum += sample * weight;
+    timer->squared_sum += pow(sample, 2) * weight;
+    timer->finalized = 0;
+    add_extremes(timer, sample, timer->count == weight);
+    if (timer->engine == TIMER_ENGINE_STATS) return 0;
+
+    // The raw samples are bounded, so the copies are too
+    int res = 0;
+    if (timer->count <= TIMER_EXACT_MAX) {
+        for (uint64_t i=0; i < weight; i++) res |= exact_add_sample(timer, sample);
+        return res;
+    }
+    if (timer->num_exact)
+        convert_exact_to_engine(timer);
+    if (timer->admit_after && timer->count > timer->admit_after) {
+        uint64_t every = admit_weight(timer);
+        if (!every) return 0;
+        weight *= every;
+    }
+    return engine_add_weighted(timer, sample, weight);
+}
+
+/**
+ * Merges the samples of one timer into another
+ * @arg dst The timer to merge into
+ * @arg src The timer to merge from
+ * @return 0 on success.
+ */
+int timer_merge(timer *dst, timer *src) {
+    if (dst->engine != src->engine) return -1;
+    if (src->count) {
+        if (!dst->count || src->min < dst->min) dst->min = src->min;
+        if (!dst->count || src->max > dst->max) dst->max = src->max;
+    }
+    dst->count += src->count;
+    dst->sum += src->sum;
+    dst->squared_sum += src->squared_sum;
+    if (dst->engine == TIMER_ENGINE_STATS) return 0;
+
+    // Raw samples are added directly
+    int res = 0;
+    if (src->count <= TIMER_EXACT_MAX) {
+        for (uint32_t i=0; i < src->num_exact; i++) {
+            if (dst->count <= TIMER_EXACT_MAX)
+                res |= exact_add_sample(dst, src->exact[i]);
+            else {
+                if (dst->num_exact) convert_exact_to_engine(dst);
+                res |= engine_add_sample(dst, src->exact[i]);
+            }
+        }
+        dst->finalized = 0;
+        return res;
+    }
+
+    // Merging flushes both quantiles
+    if (dst->num_exact) convert_exact_to_engine(dst);
+    if (dst->engine == TIMER_ENGINE_TDIGEST)
+        res = tdigest_merge(&dst->q.td, &src->q.td);
+    else if (dst->engine == TIMER_ENGINE_HDR)
+        res = hdr_merge(&dst->q.hdr, &src->q.hdr);
+    else
+        res = cm_merge(&dst->q.cm, &src->q.cm);
+    dst->finalized = 1;
+    src->finalized = 1;
+    return res;
 }
 
 /**
@@ -51,8 +260,45 @@ int timer_add_sample(timer *timer, double sample) {
  * @return The value on success or 0.
  */
 double timer_query(timer *timer, double quantile) {
-    finalize_timer(timer);
-    return cm_query(&timer->cm, quantile);
+    timer_finalize(timer);
+
+    // Use the nearest rank of the sorted raw samples
+    if (timer->num_exact) {
+        int64_t idx = ceil(quantile * timer->num_exact) - 1;
+        if (idx < 0) idx = 0;
+        if (idx >= timer->num_exact) idx = timer->num_exact - 1;
+        return timer->exact[idx];
+    }
+
+    if (timer->engine == TIMER_ENGINE_TDIGEST)
+        return tdigest_query(&timer->q.td, quantile);
+    if (timer->engine == TIMER_ENGINE_HDR)
+        return hdr_query(&timer->q.hdr, quantile);
+    if (timer->engine == TIMER_ENGINE_STATS) return 0;
+    return cm_query(&timer->q.cm, quantile);
+}
+
+/**
+ * Queries for several quantile values at once. For the CM
+ * and HDR engines this is a single walk of the samples.
+ * @arg timer The timer to query
+ * @arg quantiles A sorted array of the quantiles to query
+ * @arg num_quants The number of quantiles
+ * @arg values Output. The value of each quantile.
+ */
+void timer_query_many(timer *timer, const double *quantiles, int num_quants, double *values) {
+    timer_finalize(timer);
+    if (!timer->num_exact && timer->engine == TIMER_ENGINE_CM) {
+        cm_query_many(&timer->q.cm, quantiles, num_quants, values);
+        return;
+    }
+    if (!timer->num_exact && timer->engine == TIMER_ENGINE_HDR) {
+        hdr_query_many(&timer->q.hdr, quantiles, num_quants, values);
+        return;
+    }
+    for (int i=0; i < num_quants; i++) {
+        values[i] = timer_query(timer, quantiles[i]);
+    }
 }
 
 /**
@@ -70,9 +316,7 @@ uint64_t timer_count(timer *timer) {
  * @return The number of samples
  */
 double timer_min(timer *timer) {
-    finalize_timer(timer);
-    if (!timer->cm.samples) return 0;
-    return timer->cm.samples->value;
+    return (timer->count) ? timer->min : 0;
 }
 
 /**
@@ -120,19 +364,124 @@ double timer_squared_sum(timer *timer) {
  * @return The maximum value
  */
 double timer_max(timer *timer) {
-    finalize_timer(timer);
-    if (!timer->cm.end) return 0;
-    return timer->cm.end->value;
+    return (timer->count) ? timer->max : 0;
 }
 
-// Finalizes the timer for queries
-static void finalize_timer(timer *timer) {
+/**
+ * Finalizes the timer for queries, which the queries otherwise
+ * do on their first use. Sorts the raw samples, or flushes the
+ * buffer of the quantile engine. Later samples undo this.
+ * @arg timer The timer to finalize
+ */
+void timer_finalize(timer *timer) {
     if (timer->finalized) return;
 
-    // Force the quantile to flush internal
-    // buffers so that queries are accurate.
-    cm_flush(&timer->cm);
+    // Sort the raw samples. There are few, so an
+    // insertion sort is all that is needed.
+    if (timer->num_exact) {
+        double *e = timer->exact, v;
+        for (uint32_t i=1; i < timer->num_exact; i++) {
+            v = e[i];
+            int64_t j = i - 1;
+            for (; j >= 0 && e[j] > v; j--) e[j+1] = e[j];
+            e[j+1] = v;
+        }
+
+    // Force the quantile to flush internal buffers so that
+    // queries are accurate. The histogram has none.
+    } else if (timer->engine == TIMER_ENGINE_TDIGEST)
+        tdigest_flush(&timer->q.td);
+    else if (timer->engine == TIMER_ENGINE_CM)
+        cm_flush(&timer->q.cm);
 
     timer->finalized = 1;
 }
 
+// Adds a sample to the extremes, which all the engines track
+static inline void add_extremes(timer *timer, double sample, int first) {
+    if (first || sample < timer->min) timer->min = sample;
+    if (first || sample > timer->max) timer->max = sample;
+}
+
+// Adds a sample to the quantile engine
+static int engine_add_sample(timer *timer, double sample) {
+    if (timer->engine == TIMER_ENGINE_TDIGEST)
+        return tdigest_add(&timer->q.td, sample);
+    if (timer->engine == TIMER_ENGINE_HDR)
+        return hdr_add(&timer->q.hdr, sample);
+    return cm_add_sample(&timer->q.cm, sample);
+}
+
+// Adds a weighted sample to the quantile engine
+static int engine_add_weighted(timer *timer, double sample, uint64_t weight) {
+    if (timer->engine == TIMER_ENGINE_TDIGEST)
+        return tdigest_add_weighted(&timer->q.td, sample, weight);
+    if (timer->engine == TIMER_ENGINE_HDR)
+        return hdr_add_weighted(&timer->q.hdr, sample, weight);
+    return cm_add_weighted(&timer->q.cm, sample, weight);
+}
+
+/**
+ * Decides if a sample past the admission threshold is inserted.
+ * One of every count / threshold samples is, picked by mixing
+ * the bits of the count, which is cheaper than a generator with
+ * state and differs for each sample. The pick only depends on the
+ * count, so the same samples are kept on every run.
+ * @return 0 if skipped, else the samples it stands for
+ */
+static inline uint64_t admit_weight(timer *timer) {
+    uint64_t every = timer->count / timer->admit_after;
+    if (every <= 1) return 1;
+
+    // The finalizer of splitmix64, on its step from the count
+    uint64_t r = timer->count * 0x9e3779b97f4a7c15ULL;
+    r = (r ^ (r >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    r = (r ^ (r >> 27)) * 0x94d049bb133111ebULL;
+    r ^= r >> 31;
+    if (r % every) {
+        stats_add(STAT_TIMER_SKIPPED, 1);
+        return 0;
+    }
+    return every;
+}
+
+// Adds a raw sample, growing the array as needed
+static int exact_add_sample(timer *timer, double sample) {
+    if (timer->num_exact == timer->exact_size) {
+        uint32_t size = (timer->exact_size) ? timer->exact_size * 2 : 8;
+        if (size > TIMER_EXACT_MAX) size = TIMER_EXACT_MAX;
+        double *exact;
+        if (timer->exact_arena) {
+            // The old array is released with the arena
+            exact = arena_alloc(timer->exact_arena, size * sizeof(double));
+            if (!exact) return -1;
+            if (timer->num_exact) memcpy(exact, timer->exact, timer->num_exact * sizeof(double));
+        } else {
+            exact = realloc(timer->exact, size * sizeof(double));
+            if (!exact) return -1;
+            stats_mem_add(MEM_TIMERS, (size - timer->exact_size) * sizeof(double));
+        }
+        timer->exact = exact;
+        timer->exact_size = size;
+    }
+    timer->exact[timer->num_exact++] = sample;
+    return 0;
+}
+
+// Moves the raw samples into the quantile engine
+static void convert_exact_to_engine(timer *timer) {
+    for (uint32_t i=0; i < timer->num_exact; i++) {
+        engine_add_sample(timer, timer->exact[i]);
+    }
+    release_exact(timer);
+    timer->exact = NULL;
+    timer->num_exact = 0;
+    timer->exact_size = 0;
+}
+
+// Frees the raw samples, unless they belong to an arena
+static void release_exact(timer *timer) {
+    if (timer->exact_arena) return;
+    stats_mem_add(MEM_TIMERS, -(int64_t)(timer->exact_size * sizeof(double)));
+    free(timer->exact);
+}
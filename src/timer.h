@@ -2,15 +2,45 @@
 #define TIMER_H
 #include <stdint.h>
 #include "cm_quantile.h"
+#include "tdigest.h"
+#include "hdr.h"
+#include "arena.h"
+
+// The quantile engines a timer can use
+typedef enum {
+    TIMER_ENGINE_CM,        // Cormode-Muthukrishnan biased quantiles
+    TIMER_ENGINE_TDIGEST,   // Merging t-digest
+    TIMER_ENGINE_HDR,       // Log-linear histogram, to a relative error
+    TIMER_ENGINE_STATS      // No quantiles, only the count, sums, min and max
+} timer_engine;
 
 typedef struct {
     uint64_t count;     // Count of items
     double sum;         // Sum of the values
     double squared_sum; // Sum of the squared values
-    int finalized;      // Is the cm_quantile finalized
-    cm_quantile cm;     // Quantile we use
+    double min;         // Smallest value, exact whatever the engine
+    double max;         // Largest value, exact whatever the engine
+    int finalized;      // Is the quantile finalized
+    timer_engine engine; // Which quantile engine is used
+    double *exact;      // Raw samples, until there are too many. NULL after.
+    uint32_t num_exact; // Number of raw samples
+    uint32_t exact_size; // Allocated size of the raw samples
+    arena *exact_arena; // Holds the raw samples if set, else they are malloced
+    uint32_t admit_after; // Samples inserted before the rest are sampled, 0 to insert all
+    union {
+        cm_quantile cm; // Quantile we use with TIMER_ENGINE_CM
+        tdigest td;     // Digest we use with TIMER_ENGINE_TDIGEST
+        hdr_histogram hdr; // Histogram we use with TIMER_ENGINE_HDR
+    } q;                // TIMER_ENGINE_STATS uses none of them
 } timer;
 
+/**
+ * Timers keep their raw samples and report exact quantiles
+ * until they have more than this many samples, and then
+ * switch to their quantile engine.
+ */
+#define TIMER_EXACT_MAX 128
+
 /**
  * Initializes the timer struct
  * @arg eps The maximum error for the quantiles
@@ -21,6 +51,31 @@ typedef struct {
  */
 int init_timer(double eps, double *quantiles, uint32_t num_quants, timer *timer);
 
+/**
+ * Initializes the timer struct to use a t-digest
+ * @arg compression The compression of the digest
+ * @arg timer The timer struct to initialize
+ * @return 0 on success.
+ */
+int init_timer_tdigest(double compression, timer *timer);
+
+/**
+ * Initializes the timer struct to use a log-linear histogram
+ * @arg eps The relative error of the values
+ * @arg timer The timer struct to initialize
+ * @return 0 on success.
+ */
+int init_timer_hdr(double eps, timer *timer);
+
+/**
+ * Initializes the timer struct to keep no quantiles, only
+ * the count, sums, min and max. It allocates nothing and
+ * keeps no raw samples, and its quantiles are all 0.
+ * @arg timer The timer struct to initialize
+ * @return 0 on success.
+ */
+int init_timer_stats(timer *timer);
+
 /**
  * Destroy the timer struct.
  * @arg timer The timer to destroy
@@ -28,6 +83,26 @@ int init_timer(double eps, double *quantiles, uint32_t num_quants, timer *timer)
  */
 int destroy_timer(timer *timer);
 
+/**
+ * Allocates the raw samples of the timer from an arena, so they
+ * are released all at once when it is reset, instead of one timer
+ * at a time. The timer must be destroyed before the reset.
+ * @arg timer The timer, before any samples are added
+ * @arg a The arena to allocate from
+ */
+void timer_use_arena(timer *timer, arena *a);
+
+/**
+ * Samples the inserts into the quantile engine once the timer
+ * has many samples, which caps the cost of the hottest keys.
+ * Past the threshold, one of every count / threshold samples is
+ * inserted, weighted by the samples skipped, so the quantiles
+ * stay unbiased. The count, sums, min and max stay exact.
+ * @arg timer The timer, before any samples are added
+ * @arg threshold The samples inserted before sampling, 0 to insert all
+ */
+void timer_set_admission(timer *timer, uint32_t threshold);
+
 /**
  * Adds a new sample to the struct
  * @arg timer The timer to add to
@@ -36,6 +111,34 @@ int destroy_timer(timer *timer);
  */
 int timer_add_sample(timer *timer, double sample);
 
+/**
+ * Adds a new sample that stands for a number of samples, such as
+ * one sent with a sample rate. It counts that many times in the
+ * count and sums, and is inserted into the quantile engine once.
+ * While the timer keeps raw samples, it is stored that many times.
+ * @arg timer The timer to add to
+ * @arg sample The new sample value
+ * @arg weight The number of samples it stands for, at least 1
+ * @return 0 on success.
+ */
+int timer_add_weighted(timer *timer, double sample, uint64_t weight);
+
+/**
+ * Merges the samples of one timer into another
+ * @arg dst The timer to merge into
+ * @arg src The timer to merge from
+ * @return 0 on success, -1 if the engines differ.
+ */
+int timer_merge(timer *dst, timer *src);
+
+/**
+ * Finalizes the timer for queries, which the queries otherwise
+ * do on their first use. Sorts the raw samples, or flushes the
+ * buffer of the quantile engine. Later samples undo this.
+ * @arg timer The timer to finalize
+ */
+void timer_finalize(timer *timer);
+
 /**
  * Queries for a quantile value
  * @arg timer The timer to query
@@ -44,6 +147,16 @@ int timer_add_sample(timer *timer, double sample);
  */
 double timer_query(timer *timer, double quantile);
 
+/**
+ * Queries for several quantile values at once. For the CM
+ * and HDR engines this is a single walk of the samples.
+ * @arg timer The timer to query
+ * @arg quantiles A sorted array of the quantiles to query
+ * @arg num_quants The number of quantiles
+ * @arg values Output. The value of each quantile.
+ */
+void timer_query_many(timer *timer, const double *quantiles, int num_quants, double *values);
+
 /**
  * Returns the number of samples in the timer
  * @arg timer The timer to query
@@ -52,9 +165,10 @@ double timer_query(timer *timer, double quantile);
 uint64_t timer_count(timer *timer);
 
 /**
- * Returns the minimum timer value
+ * Returns the minimum timer value. It is tracked as the
+ * samples are added, so the timer is not finalized.
  * @arg timer The timer to query
- * @return The number of samples
+ * @return The minimum value
  */
 double timer_min(timer *timer);
 
@@ -87,7 +201,8 @@ double timer_sum(timer *timer);
 double timer_squared_sum(timer *timer);
 
 /**
- * Returns the maximum timer value
+ * Returns the maximum timer value. It is tracked as the
+ * samples are added, so the timer is not finalized.
  * @arg timer The timer to query
  * @return The maximum value
  */
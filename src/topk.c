@@ -0,0 +1,204 @@
+/**
+ * This file implements the Space-Saving summary declared in topk.h
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "topk.h"
+
+// Moves an entry to a heap position, and points its slot at it
+#define PLACE(t, pos, e) do { \
+    (t)->heap[pos] = e; \
+    (t)->index[(e).slot] = pos; \
+} while (0)
+
+/**
+ * Initializes a summary.
+ * @arg capacity The number of counters to monitor
+ * @arg t The summary to initialize
+ * @return 0 on success.
+ */
+int topk_init(uint32_t capacity, topk *t) {
+    if (!capacity) return -1;
+
+    // Keep the index at most half full
+    uint32_t size = 1;
+    while (size < 2 * capacity) size <<= 1;
+
+    t->capacity = capacity;
+    t->size = 0;
+    t->mask = size - 1;
+    t->heap = malloc(capacity * sizeof(topk_entry));
+    t->index = malloc(size * sizeof(int32_t));
+    if (!t->heap || !t->index) {
+        free(t->heap);
+        free(t->index);
+        return -1;
+    }
+    memset(t->index, 0xff, size * sizeof(int32_t));
+    return 0;
+}
+
+/**
+ * Destroys a summary
+ * @return 0 on success.
+ */
+int topk_destroy(topk *t) {
+    for (uint32_t i=0; i < t->size; i++) {
+        free(t->heap[i].key);
+    }
+    free(t->heap);
+    free(t->index);
+    return 0;
+}
+
+/**
+ * Forgets all the keys, keeping the allocations.
+ */
+void topk_clear(topk *t) {
+    for (uint32_t i=0; i < t->size; i++) {
+        free(t->heap[i].key);
+        t->index[t->heap[i].slot] = -1;
+    }
+    t->size = 0;
+}
+
+// Returns the slot of a key in the index, or the empty slot it would take
+static uint32_t find_slot(topk *t, char *key, uint64_t hash) {
+    uint32_t slot = hash & t->mask;
+    int32_t pos;
+    while ((pos = t->index[slot]) >= 0) {
+        if (t->heap[pos].hash == hash && !strcmp(t->heap[pos].key, key)) break;
+        slot = (slot + 1) & t->mask;
+    }
+    return slot;
+}
+
+/**
+ * Removes a slot from the index. The entries after it in
+ * the same run are shifted back, so lookups need no tombstones.
+ */
+static void remove_slot(topk *t, uint32_t slot) {
+    uint32_t next = slot, home;
+    t->index[slot] = -1;
+    for (;;) {
+        next = (next + 1) & t->mask;
+        if (t->index[next] < 0) return;
+
+        // Only move the entries that would not be found past the hole
+        home = t->heap[t->index[next]].hash & t->mask;
+        if (((next - home) & t->mask) < ((next - slot) & t->mask)) continue;
+        t->index[slot] = t->index[next];
+        t->heap[t->index[slot]].slot = slot;
+        t->index[next] = -1;
+        slot = next;
+    }
+}
+
+// Moves the entry at a heap position towards the root
+static void sift_up(topk *t, uint32_t pos) {
+    topk_entry e = t->heap[pos];
+    while (pos > 0) {
+        uint32_t parent = (pos - 1) >> 1;
+        if (t->heap[parent].count <= e.count) break;
+        PLACE(t, pos, t->heap[parent]);
+        pos = parent;
+    }
+    PLACE(t, pos, e);
+}
+
+// Moves the entry at a heap position towards the leaves
+static void sift_down(topk *t, uint32_t pos) {
+    topk_entry e = t->heap[pos];
+    for (;;) {
+        uint32_t child = (pos << 1) + 1;
+        if (child >= t->size) break;
+        if (child + 1 < t->size && t->heap[child + 1].count < t->heap[child].count) child++;
+        if (t->heap[child].count >= e.count) break;
+        PLACE(t, pos, t->heap[child]);
+        pos = child;
+    }
+    PLACE(t, pos, e);
+}
+
+// Adds weight and error to a key, taking over the smallest counter if needed
+static void topk_update(topk *t, char *key, uint64_t hash, uint64_t weight, uint64_t error) {
+    uint32_t slot = find_slot(t, key, hash);
+    int32_t pos = t->index[slot];
+
+    // Count a monitored key, the count only grows
+    if (pos >= 0) {
+        t->heap[pos].count += weight;
+        t->heap[pos].error += error;
+        sift_down(t, pos);
+        return;
+    }
+
+    // Monitor a new key while there are free counters
+    if (t->size < t->capacity) {
+        pos = t->size++;
+        topk_entry e = {strdup(key), hash, weight, error, slot};
+        t->index[slot] = pos;
+        t->heap[pos] = e;
+        sift_up(t, pos);
+        return;
+    }
+
+    // Replace the smallest counter, whose count becomes the error
+    topk_entry *min = t->heap;
+    remove_slot(t, min->slot);
+    free(min->key);
+    min->key = strdup(key);
+    min->hash = hash;
+    min->error = min->count + error;
+    min->count += weight;
+    min->slot = find_slot(t, key, hash);
+    t->index[min->slot] = 0;
+    sift_down(t, 0);
+}
+
+/**
+ * Adds weight to a key.
+ * @arg key The key, copied if it becomes monitored
+ * @arg hash The hash of the key, from hash_key
+ * @arg weight The weight to add
+ */
+void topk_add(topk *t, char *key, uint64_t hash, uint64_t weight) {
+    topk_update(t, key, hash, weight, 0);
+}
+
+/**
+ * Merges a summary into another. The counts and errors of the
+ * keys are added, as if their weight was seen by the destination.
+ * @arg dst The summary to merge into
+ * @arg src The summary to merge, unchanged
+ */
+void topk_merge(topk *dst, topk *src) {
+    for (uint32_t i=0; i < src->size; i++) {
+        topk_entry *e = src->heap + i;
+        topk_update(dst, e->key, e->hash, e->count, e->error);
+    }
+}
+
+// Orders the entries by descending count
+static int entry_cmp(const void *a, const void *b) {
+    uint64_t ca = ((topk_entry*)a)->count, cb = ((topk_entry*)b)->count;
+    return (ca < cb) - (ca > cb);
+}
+
+/**
+ * Returns the heaviest keys, heaviest first.
+ * @arg out Output. Filled with up to k entries, whose keys
+ * belong to the summary until it is next changed.
+ * @arg k The maximum number of entries
+ * @return The number of entries filled
+ */
+int topk_top(topk *t, topk_entry *out, int k) {
+    if (k <= 0 || !t->size) return 0;
+    topk_entry *sorted = malloc(t->size * sizeof(topk_entry));
+    memcpy(sorted, t->heap, t->size * sizeof(topk_entry));
+    qsort(sorted, t->size, sizeof(topk_entry), entry_cmp);
+    if ((uint32_t)k > t->size) k = t->size;
+    memcpy(out, sorted, k * sizeof(topk_entry));
+    free(sorted);
+    return k;
+}
@@ -0,0 +1,80 @@
+/**
+ * This module finds the heavy hitters of a stream of keys with
+ * the Space-Saving algorithm of Metwally, Agrawal and El Abbadi.
+ * A fixed number of counters is monitored. A key that is not
+ * monitored takes over the counter with the smallest count, and
+ * inherits that count as its error, so a key is never under
+ * counted, and any key with more than 1/capacity of the total
+ * weight is always monitored.
+ *
+ * The counters are kept in a min-heap, with a small open hash
+ * index of the keys, so an update is a lookup and a sift.
+ */
+#ifndef TOPK_H
+#define TOPK_H
+#include <stdint.h>
+
+// A monitored key
+typedef struct {
+    char *key;          // The key, owned by the summary
+    uint64_t hash;      // The hash of the key
+    uint64_t count;     // The weight counted, including the error
+    uint64_t error;     // The most the count may be over counted
+    uint32_t slot;      // The slot of the key in the index
+} topk_entry;
+
+typedef struct {
+    uint32_t capacity;  // The number of counters monitored
+    uint32_t size;      // The number of counters in use
+    topk_entry *heap;   // Min-heap of the counters, by count
+    int32_t *index;     // Open hash of heap positions, -1 if empty
+    uint32_t mask;      // Size of the index minus one
+} topk;
+
+/**
+ * Initializes a summary.
+ * @arg capacity The number of counters to monitor. Monitoring
+ * a few times more keys than are reported keeps the order of
+ * the reported keys accurate.
+ * @arg t The summary to initialize
+ * @return 0 on success.
+ */
+int topk_init(uint32_t capacity, topk *t);
+
+/**
+ * Destroys a summary
+ * @return 0 on success.
+ */
+int topk_destroy(topk *t);
+
+/**
+ * Forgets all the keys, keeping the allocations.
+ */
+void topk_clear(topk *t);
+
+/**
+ * Adds weight to a key.
+ * @arg key The key, copied if it becomes monitored
+ * @arg hash The hash of the key, from hash_key
+ * @arg weight The weight to add
+ */
+void topk_add(topk *t, char *key, uint64_t hash, uint64_t weight);
+
+/**
+ * Merges a summary into another. The counts and errors of the
+ * keys are added, as if their weight was seen by the destination.
+ * @arg dst The summary to merge into
+ * @arg src The summary to merge, unchanged
+ */
+void topk_merge(topk *dst, topk *src);
+
+/**
+ * Returns the heaviest keys, heaviest first.
+ * @arg out Output. Filled with up to k entries, whose keys
+ * belong to the summary until it is next changed.
+ * @arg k The maximum number of entries
+ * @return The number of entries filled
+ */
+int topk_top(topk *t, topk_entry *out, int k);
+
+#endif
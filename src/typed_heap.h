@@ -0,0 +1,119 @@
+/**
+ * This module generates typed binary heaps that store their
+ * entries inline in a contiguous table, instead of as boxed keys
+ * and values compared through a function pointer like heap.h.
+ * They are used where the entries are small structs, so that
+ * ordering them costs no allocation or indirect call per entry.
+ *
+ * TYPED_HEAP_DEFINE(name, type, before, mem) declares the heap
+ * struct `name` and the static inline functions name_init,
+ * name_destroy, name_clear, name_size, name_push, name_top and
+ * name_pop. The expression before(a, b) is given two entries, and
+ * is true if a must come out of the heap before b. The table grows
+ * as needed, and its memory is counted in the mem category.
+ */
+#ifndef TYPED_HEAP_H
+#define TYPED_HEAP_H
+#include <stdint.h>
+#include <stdlib.h>
+#include "stats.h"
+
+// Initial number of entries in the table
+#define TYPED_HEAP_INIT_SIZE 16
+
+#define TYPED_HEAP_DEFINE(name, type, before, mem)                              \
+typedef struct {                                                                \
+    uint32_t size;      /* Number of entries in the heap */                     \
+    uint32_t allocated; /* Number of entries the table can hold */              \
+    type *table;                                                                \
+} name;                                                                         \
+                                                                                \
+/**                                                                             \
+ * Initializes an empty heap. The table is allocated on the first push.         \
+ */                                                                             \
+static inline void name##_init(name *h) {                                       \
+    h->size = 0;                                                                \
+    h->allocated = 0;                                                           \
+    h->table = NULL;                                                            \
+}                                                                               \
+                                                                                \
+/**                                                                             \
+ * Frees the table.                                                             \
+ */                                                                             \
+static inline void name##_destroy(name *h) {                                    \
+    stats_mem_add(mem, -(int64_t)(h->allocated * sizeof(type)));               \
+    free(h->table);                                                             \
+    name##_init(h);                                                             \
+}                                                                               \
+                                                                                \
+/**                                                                             \
+ * Removes all the entries, keeping the capacity.                               \
+ */                                                                             \
+static inline void name##_clear(name *h) {                                      \
+    h->size = 0;                                                                \
+}                                                                               \
+                                                                                \
+/**                                                                             \
+ * Returns the number of entries in the heap.                                   \
+ */                                                                             \
+static inline uint32_t name##_size(name *h) {                                   \
+    return h->size;                                                             \
+}                                                                               \
+                                                                                \
+/**                                                                             \
+ * Adds an entry, moving it up from the leaves into place.                      \
+ * @return 0 on success, -1 if the table could not grow.                        \
+ */                                                                             \
+static inline int name##_push(name *h, type entry) {                            \
+    if (h->size == h->allocated) {                                              \
+        uint32_t size = (h->allocated) ? h->allocated * 2 : TYPED_HEAP_INIT_SIZE; \
+        type *table = realloc(h->table, size * sizeof(type));                   \
+        if (!table) return -1;                                                  \
+        stats_mem_add(mem, (size - h->allocated) * sizeof(type));               \
+        h->table = table;                                                       \
+        h->allocated = size;                                                    \
+    }                                                                           \
+    type *t = h->table;                                                         \
+    uint32_t pos = h->size++;                                                   \
+    while (pos) {                                                               \
+        uint32_t parent = (pos - 1) / 2;                                        \
+        if (!(before(entry, t[parent]))) break;                                 \
+        t[pos] = t[parent];                                                     \
+        pos = parent;                                                           \
+    }                                                                           \
+    t[pos] = entry;                                                             \
+    return 0;                                                                   \
+}                                                                               \
+                                                                                \
+/**                                                                             \
+ * Returns the entry that comes out first, without removing it.                 \
+ * @return 1 if the entry is set, 0 if the heap is empty.                       \
+ */                                                                             \
+static inline int name##_top(name *h, type *entry) {                            \
+    if (!h->size) return 0;                                                     \
+    *entry = h->table[0];                                                       \
+    return 1;                                                                   \
+}                                                                               \
+                                                                                \
+/**                                                                             \
+ * Removes the entry that comes out first, and moves the last                   \
+ * entry down from the root into place.                                         \
+ * @return 1 if the entry is set and removed, 0 if the heap is empty.           \
+ */                                                                             \
+static inline int name##_pop(name *h, type *entry) {                            \
+    if (!h->size) return 0;                                                     \
+    type *t = h->table;                                                         \
+    *entry = t[0];                                                              \
+    type last = t[--h->size];                                                   \
+    uint32_t pos = 0, child;                                                    \
+    while ((child = 2 * pos + 1) < h->size) {                                   \
+        if (child + 1 < h->size && before(t[child + 1], t[child])) child++;     \
+        if (!(before(t[child], last))) break;                                   \
+        t[pos] = t[child];                                                      \
+        pos = child;                                                            \
+    }                                                                           \
+    t[pos] = last;                                                              \
+    return 1;                                                                   \
+}
+
+#endif
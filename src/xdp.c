@@ -0,0 +1,470 @@
+/**
+ * This file defines the methods declared in xdp.h
+ * The XDP program is assembled here instead of being compiled
+ * with clang, so the build needs no BPF toolchain, and is loaded
+ * with the bpf() syscall directly, without libbpf.
+ */
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "xdp.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/if_xdp.h>) && __has_include(<linux/bpf.h>)
+#define HAVE_AF_XDP 1
+#endif
+#endif
+
+// Offsets in the Ethernet, IPv4, IPv6 and UDP headers
+#define ETH_HDR_LEN 14
+#define ETH_TYPE_OFF 12
+#define IP4_HDR_LEN 20
+#define IP4_FRAG_OFF 6
+#define IP4_PROTO_OFF 9
+#define IP6_HDR_LEN 40
+#define IP6_NEXT_OFF 6
+#define UDP_HDR_LEN 8
+#define UDP_PORT_OFF 2
+#define UDP_LEN_OFF 4
+#define ETH_TYPE_IP4 0x0800
+#define ETH_TYPE_IP6 0x86DD
+
+// Reads a big endian 16 bit field
+static inline uint16_t read_be16(const char *p) {
+    return ((uint8_t)p[0] << 8) | (uint8_t)p[1];
+}
+
+int xdp_udp_payload(const char *frame, uint32_t len, uint32_t *offset, uint32_t *payload_len) {
+    if (len < ETH_HDR_LEN) return -1;
+    uint32_t udp;
+    switch (read_be16(frame + ETH_TYPE_OFF)) {
+        case ETH_TYPE_IP4: {
+            const char *ip = frame + ETH_HDR_LEN;
+            if (len < ETH_HDR_LEN + IP4_HDR_LEN) return -1;
+            uint32_t ihl = (ip[0] & 0x0f) * 4;
+            if ((uint8_t)ip[IP4_PROTO_OFF] != IPPROTO_UDP || ihl < IP4_HDR_LEN) return -1;
+
+            // Fragments are left to the kernel to reassemble
+            if (read_be16(ip + IP4_FRAG_OFF) & 0x3fff) return -1;
+            udp = ETH_HDR_LEN + ihl;
+            break;
+        }
+        case ETH_TYPE_IP6:
+            if (len < ETH_HDR_LEN + IP6_HDR_LEN) return -1;
+            if ((uint8_t)frame[ETH_HDR_LEN + IP6_NEXT_OFF] != IPPROTO_UDP) return -1;
+            udp = ETH_HDR_LEN + IP6_HDR_LEN;
+            break;
+        default:
+            return -1;
+    }
+    if (len < udp + UDP_HDR_LEN) return -1;
+
+    // The UDP length excludes the padding of short frames
+    uint32_t udp_len = read_be16(frame + udp + UDP_LEN_OFF);
+    if (udp_len < UDP_HDR_LEN || udp_len > len - udp) return -1;
+    *offset = udp + UDP_HDR_LEN;
+    *payload_len = udp_len - UDP_HDR_LEN;
+    return 0;
+}
+
+#ifdef HAVE_AF_XDP
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_xdp.h>
+
+/**
+ * The frames of each UMEM, and the sizes of its rings. The fill
+ * ring can hold every frame, so released frames always fit.
+ */
+#define XDP_FRAMES 4096
+#define XDP_FILL_SIZE XDP_FRAMES
+#define XDP_RX_SIZE 2048
+#define XDP_COMP_SIZE 64
+
+// The most instructions of the program
+#define XDP_PROG_MAX_INSNS 64
+
+struct xdp_prog {
+    int ifindex;
+    int queues;
+    int map_fd;     // Maps each queue to its socket
+    int prog_fd;
+    int link_fd;    // Detaches the program when closed
+};
+
+// A ring shared with the kernel
+typedef struct {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *descs;
+    uint32_t mask;
+    void *map;
+    size_t map_size;
+} xdp_ring;
+
+struct xdp_socket {
+    int fd;
+    char *umem;
+    uint32_t umem_size;
+    xdp_ring fill;
+    xdp_ring comp;
+    xdp_ring rx;
+};
+
+static int bpf(int cmd, union bpf_attr *attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/**
+ * Assembles the program. The labels are resolved once all the
+ * instructions are emitted, so the jumps can be written forward.
+ */
+enum { L_PASS, L_IP4, L_PORT, NUM_LABELS };
+
+typedef struct {
+    struct bpf_insn insns[XDP_PROG_MAX_INSNS];
+    int len;
+    int labels[NUM_LABELS];
+    int fixups[XDP_PROG_MAX_INSNS];     // The label of each jump, or -1
+} prog_builder;
+
+static void emit(prog_builder *b, uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+    b->fixups[b->len] = -1;
+    b->insns[b->len++] = (struct bpf_insn){.code = code, .dst_reg = dst, .src_reg = src, .off = off, .imm = imm};
+}
+
+// Emits a conditional jump to a label, comparing a register to an immediate
+static void emit_jmp(prog_builder *b, uint8_t op, uint8_t dst, int32_t imm, int label) {
+    emit(b, BPF_JMP | op | BPF_K, dst, 0, 0, imm);
+    b->fixups[b->len - 1] = label;
+}
+
+// Emits a jump if the packet is shorter than a length past the pointer in r2
+static void emit_bounds(prog_builder *b, int32_t len) {
+    emit(b, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+    emit(b, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, len);
+    emit(b, BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, 0);
+    b->fixups[b->len - 1] = L_PASS;
+}
+
+static void emit_load(prog_builder *b, uint8_t size, uint8_t dst, uint8_t src, int16_t off) {
+    emit(b, BPF_LDX | size | BPF_MEM, dst, src, off, 0);
+}
+
+/**
+ * Builds the program, which redirects the unfragmented UDP
+ * packets to a port to the socket of their receive queue, and
+ * passes the rest. The loads are in host order, so the constants
+ * are compared in network order.
+ */
+static int build_prog(prog_builder *b, uint16_t port, int map_fd) {
+    b->len = 0;
+    emit(b, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+    emit_load(b, BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, data));
+    emit_load(b, BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct xdp_md, data_end));
+    emit_bounds(b, ETH_HDR_LEN);
+    emit_load(b, BPF_H, BPF_REG_5, BPF_REG_2, ETH_TYPE_OFF);
+    emit_jmp(b, BPF_JEQ, BPF_REG_5, htons(ETH_TYPE_IP4), L_IP4);
+    emit_jmp(b, BPF_JNE, BPF_REG_5, htons(ETH_TYPE_IP6), L_PASS);
+
+    // IPv6, with the UDP header right after the fixed header
+    emit_bounds(b, ETH_HDR_LEN + IP6_HDR_LEN + UDP_HDR_LEN);
+    emit_load(b, BPF_B, BPF_REG_5, BPF_REG_2, ETH_HDR_LEN + IP6_NEXT_OFF);
+    emit_jmp(b, BPF_JNE, BPF_REG_5, IPPROTO_UDP, L_PASS);
+    emit_load(b, BPF_H, BPF_REG_5, BPF_REG_2, ETH_HDR_LEN + IP6_HDR_LEN + UDP_PORT_OFF);
+    emit(b, BPF_JMP | BPF_JA, 0, 0, 0, 0);
+    b->fixups[b->len - 1] = L_PORT;
+
+    // IPv4, with the UDP header after the options
+    b->labels[L_IP4] = b->len;
+    emit_bounds(b, ETH_HDR_LEN + IP4_HDR_LEN);
+    emit_load(b, BPF_B, BPF_REG_5, BPF_REG_2, ETH_HDR_LEN + IP4_PROTO_OFF);
+    emit_jmp(b, BPF_JNE, BPF_REG_5, IPPROTO_UDP, L_PASS);
+    emit_load(b, BPF_H, BPF_REG_5, BPF_REG_2, ETH_HDR_LEN + IP4_FRAG_OFF);
+    emit(b, BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, htons(0x3fff));
+    emit_jmp(b, BPF_JNE, BPF_REG_5, 0, L_PASS);
+    emit_load(b, BPF_B, BPF_REG_5, BPF_REG_2, ETH_HDR_LEN);
+    emit(b, BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, 0x0f);
+    emit(b, BPF_ALU64 | BPF_LSH | BPF_K, BPF_REG_5, 0, 0, 2);
+    emit_jmp(b, BPF_JLT, BPF_REG_5, IP4_HDR_LEN, L_PASS);
+    emit(b, BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_2, BPF_REG_5, 0, 0);
+    emit_bounds(b, ETH_HDR_LEN + UDP_HDR_LEN);
+    emit_load(b, BPF_H, BPF_REG_5, BPF_REG_2, ETH_HDR_LEN + UDP_PORT_OFF);
+
+    // Redirect to the socket of the queue, or pass if it has none
+    b->labels[L_PORT] = b->len;
+    emit_jmp(b, BPF_JNE, BPF_REG_5, htons(port), L_PASS);
+    emit_load(b, BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index));
+    emit(b, BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd);
+    emit(b, 0, 0, 0, 0, 0);
+    emit(b, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS);
+    emit(b, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+    emit(b, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+    b->labels[L_PASS] = b->len;
+    emit(b, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS);
+    emit(b, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+    // Resolve the jumps, relative to the next instruction
+    for (int i=0; i < b->len; i++) {
+        if (b->fixups[i] >= 0) b->insns[i].off = b->labels[b->fixups[i]] - i - 1;
+    }
+    return b->len;
+}
+
+// Loads the program, logging the output of the verifier if it is rejected
+static int load_prog(prog_builder *b) {
+    static char log[16384];
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uint64_t)(uintptr_t)b->insns;
+    attr.insn_cnt = b->len;
+    attr.license = (uint64_t)(uintptr_t)"BSD";
+    int fd = bpf(BPF_PROG_LOAD, &attr);
+    if (fd >= 0 || errno == EPERM) return fd;
+
+    attr.log_buf = (uint64_t)(uintptr_t)log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    fd = bpf(BPF_PROG_LOAD, &attr);
+    if (fd < 0) syslog(LOG_ERR, "The XDP program was rejected: %s", log);
+    return fd;
+}
+
+int xdp_prog_attach(char *ifname, uint16_t port, int queues, xdp_prog **p) {
+    int ifindex = if_nametoindex(ifname);
+    if (!ifindex) {
+        syslog(LOG_ERR, "Unknown XDP interface '%s'!", ifname);
+        return -1;
+    }
+
+    xdp_prog *prog = calloc(1, sizeof(xdp_prog));
+    prog->ifindex = ifindex;
+    prog->queues = queues;
+    prog->prog_fd = prog->link_fd = -1;
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = queues;
+    prog->map_fd = bpf(BPF_MAP_CREATE, &attr);
+    if (prog->map_fd < 0) {
+        syslog(LOG_ERR, "Failed to create the XDP socket map! Err: %s", strerror(errno));
+        xdp_prog_detach(prog);
+        return -1;
+    }
+
+    prog_builder *b = malloc(sizeof(prog_builder));
+    build_prog(b, port, prog->map_fd);
+    prog->prog_fd = load_prog(b);
+    free(b);
+    if (prog->prog_fd < 0) {
+        syslog(LOG_ERR, "Failed to load the XDP program! Err: %s", strerror(errno));
+        xdp_prog_detach(prog);
+        return -1;
+    }
+
+    // The kernel uses the native mode if the driver supports it
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = prog->prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    prog->link_fd = bpf(BPF_LINK_CREATE, &attr);
+    if (prog->link_fd < 0) {
+        syslog(LOG_ERR, "Failed to attach the XDP program to '%s'! Err: %s", ifname, strerror(errno));
+        xdp_prog_detach(prog);
+        return -1;
+    }
+    *p = prog;
+    return 0;
+}
+
+void xdp_prog_detach(xdp_prog *p) {
+    if (p->link_fd >= 0) close(p->link_fd);
+    if (p->prog_fd >= 0) close(p->prog_fd);
+    if (p->map_fd >= 0) close(p->map_fd);
+    free(p);
+}
+
+// Maps a ring of the socket, given its offsets and entry size
+static int map_ring(int fd, struct xdp_ring_offset *off, uint32_t size,
+        size_t entry_size, off_t pgoff, xdp_ring *r) {
+    r->map_size = off->desc + size * entry_size;
+    r->map = mmap(NULL, r->map_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, pgoff);
+    if (r->map == MAP_FAILED) {
+        r->map = NULL;
+        return -1;
+    }
+    r->producer = (uint32_t*)((char*)r->map + off->producer);
+    r->consumer = (uint32_t*)((char*)r->map + off->consumer);
+    r->flags = (uint32_t*)((char*)r->map + off->flags);
+    r->descs = (char*)r->map + off->desc;
+    r->mask = size - 1;
+    return 0;
+}
+
+// Sets the size of one of the rings of a socket
+static int set_ring_size(int fd, int opt, int size) {
+    return setsockopt(fd, SOL_XDP, opt, &size, sizeof(size));
+}
+
+int xdp_socket_open(xdp_prog *p, int queue, xdp_socket **out) {
+    xdp_socket *s = calloc(1, sizeof(xdp_socket));
+    s->umem_size = XDP_FRAMES * XDP_FRAME_SIZE;
+    s->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (s->fd < 0) {
+        syslog(LOG_ERR, "Failed to create an AF_XDP socket! Err: %s", strerror(errno));
+        free(s);
+        return -1;
+    }
+    s->umem = mmap(NULL, s->umem_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (s->umem == MAP_FAILED) {
+        s->umem = NULL;
+        goto ERROR;
+    }
+
+    // Register the UMEM and size the rings, then map them
+    struct xdp_umem_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = (uint64_t)(uintptr_t)s->umem;
+    reg.len = s->umem_size;
+    reg.chunk_size = XDP_FRAME_SIZE;
+    struct xdp_mmap_offsets off;
+    socklen_t off_len = sizeof(off);
+    if (setsockopt(s->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) ||
+            set_ring_size(s->fd, XDP_UMEM_FILL_RING, XDP_FILL_SIZE) ||
+            set_ring_size(s->fd, XDP_UMEM_COMPLETION_RING, XDP_COMP_SIZE) ||
+            set_ring_size(s->fd, XDP_RX_RING, XDP_RX_SIZE) ||
+            getsockopt(s->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &off_len) ||
+            map_ring(s->fd, &off.fr, XDP_FILL_SIZE, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING, &s->fill) ||
+            map_ring(s->fd, &off.cr, XDP_COMP_SIZE, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING, &s->comp) ||
+            map_ring(s->fd, &off.rx, XDP_RX_SIZE, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING, &s->rx)) {
+        goto ERROR;
+    }
+
+    // Uses zero copy if the driver supports it
+    struct sockaddr_xdp addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sxdp_family = AF_XDP;
+    addr.sxdp_ifindex = p->ifindex;
+    addr.sxdp_queue_id = queue;
+    addr.sxdp_flags = XDP_USE_NEED_WAKEUP;
+    if (bind(s->fd, (struct sockaddr*)&addr, sizeof(addr))) goto ERROR;
+
+    // Give every frame to the kernel
+    uint64_t *addrs = s->fill.descs;
+    for (uint32_t i=0; i < XDP_FRAMES; i++) {
+        addrs[i] = (uint64_t)i * XDP_FRAME_SIZE;
+    }
+    __atomic_store_n(s->fill.producer, XDP_FRAMES, __ATOMIC_RELEASE);
+
+    // Start redirecting the packets of the queue
+    uint32_t key = queue, value = s->fd;
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = p->map_fd;
+    attr.key = (uint64_t)(uintptr_t)&key;
+    attr.value = (uint64_t)(uintptr_t)&value;
+    if (bpf(BPF_MAP_UPDATE_ELEM, &attr)) goto ERROR;
+    *out = s;
+    return 0;
+
+ERROR:
+    syslog(LOG_ERR, "Failed to setup the AF_XDP socket on queue %d! Err: %s", queue, strerror(errno));
+    xdp_socket_close(s);
+    return -1;
+}
+
+void xdp_socket_close(xdp_socket *s) {
+    xdp_ring *rings[] = {&s->fill, &s->comp, &s->rx};
+    for (int i=0; i < 3; i++) {
+        if (rings[i]->map) munmap(rings[i]->map, rings[i]->map_size);
+    }
+    close(s->fd);
+    if (s->umem) munmap(s->umem, s->umem_size);
+    free(s);
+}
+
+int xdp_socket_fd(xdp_socket *s) {
+    return s->fd;
+}
+
+char* xdp_socket_umem(xdp_socket *s) {
+    return s->umem;
+}
+
+uint32_t xdp_socket_umem_size(xdp_socket *s) {
+    return s->umem_size;
+}
+
+uint32_t xdp_socket_recv(xdp_socket *s, xdp_packet *pkts, uint32_t max) {
+    uint32_t cons = *s->rx.consumer;
+    uint32_t num = __atomic_load_n(s->rx.producer, __ATOMIC_ACQUIRE) - cons;
+    if (num > max) num = max;
+    struct xdp_desc *descs = s->rx.descs;
+    for (uint32_t i=0; i < num; i++) {
+        struct xdp_desc *d = descs + ((cons + i) & s->rx.mask);
+        pkts[i].addr = d->addr;
+        pkts[i].len = d->len;
+    }
+    return num;
+}
+
+void xdp_socket_release(xdp_socket *s, xdp_packet *pkts, uint32_t num) {
+    if (!num) return;
+    __atomic_store_n(s->rx.consumer, *s->rx.consumer + num, __ATOMIC_RELEASE);
+
+    // The addresses include the offset of the packet in its frame
+    uint32_t prod = *s->fill.producer;
+    uint64_t *addrs = s->fill.descs;
+    for (uint32_t i=0; i < num; i++) {
+        addrs[(prod + i) & s->fill.mask] = pkts[i].addr & ~(uint64_t)(XDP_FRAME_SIZE - 1);
+    }
+    __atomic_store_n(s->fill.producer, prod + num, __ATOMIC_RELEASE);
+
+    // Wake the kernel if it ran out of frames
+    if (__atomic_load_n(s->fill.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP) {
+        recvfrom(s->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+}
+
+int xdp_socket_drops(xdp_socket *s, uint64_t *drops) {
+    struct xdp_statistics st;
+    socklen_t len = sizeof(st);
+    memset(&st, 0, sizeof(st));
+    if (getsockopt(s->fd, SOL_XDP, XDP_STATISTICS, &st, &len)) return -1;
+    *drops = st.rx_dropped + st.rx_ring_full;
+    return 0;
+}
+
+#else
+struct xdp_prog { int unused; };
+struct xdp_socket { int unused; };
+
+int xdp_prog_attach(char *ifname, uint16_t port, int queues, xdp_prog **p) {
+    syslog(LOG_ERR, "AF_XDP is not supported on this platform!");
+    return -1;
+}
+
+void xdp_prog_detach(xdp_prog *p) {}
+int xdp_socket_open(xdp_prog *p, int queue, xdp_socket **s) { return -1; }
+void xdp_socket_close(xdp_socket *s) {}
+int xdp_socket_fd(xdp_socket *s) { return -1; }
+char* xdp_socket_umem(xdp_socket *s) { return NULL; }
+uint32_t xdp_socket_umem_size(xdp_socket *s) { return 0; }
+uint32_t xdp_socket_recv(xdp_socket *s, xdp_packet *pkts, uint32_t max) { return 0; }
+void xdp_socket_release(xdp_socket *s, xdp_packet *pkts, uint32_t num) {}
+int xdp_socket_drops(xdp_socket *s, uint64_t *drops) { return -1; }
+#endif
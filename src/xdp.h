@@ -0,0 +1,128 @@
+/**
+ * This module receives UDP datagrams with AF_XDP, bypassing the
+ * socket stack of the kernel. An XDP program attached to an
+ * interface redirects the UDP packets to a port to the AF_XDP
+ * socket bound to their receive queue, and passes every other
+ * packet on to the kernel as usual.
+ *
+ * Each socket has a UMEM, a region of frames shared with the
+ * kernel. The free frames are given to the kernel on the fill
+ * ring, and the frames it filled with packets come back on the
+ * receive ring, so the packets are parsed in place without a
+ * syscall per packet. This needs Linux 5.9 or newer, and the
+ * CAP_NET_ADMIN and CAP_BPF capabilities. A socket is not
+ * thread safe.
+ */
+#ifndef XDP_H
+#define XDP_H
+#include <stdint.h>
+
+/**
+ * The size of each frame of the UMEM. A packet does not
+ * span frames, so this bounds the MTU of the interface.
+ */
+#define XDP_FRAME_SIZE 4096
+
+/**
+ * The XDP program and the socket map on an interface
+ */
+typedef struct xdp_prog xdp_prog;
+
+/**
+ * An AF_XDP socket on a receive queue
+ */
+typedef struct xdp_socket xdp_socket;
+
+/**
+ * A packet on the receive ring
+ */
+typedef struct {
+    uint64_t addr;  // Offset of the packet in the UMEM
+    uint32_t len;
+} xdp_packet;
+
+/**
+ * Loads the XDP program and attaches it to an interface.
+ * It is detached when the program is, or when the process exits.
+ * @arg ifname The name of the interface
+ * @arg port The UDP port of the packets to redirect
+ * @arg queues The number of receive queues to redirect
+ * @arg p Output, the program
+ * @return 0 on success
+ */
+int xdp_prog_attach(char *ifname, uint16_t port, int queues, xdp_prog **p);
+
+/**
+ * Detaches the program and frees it. The sockets
+ * must be closed first.
+ */
+void xdp_prog_detach(xdp_prog *p);
+
+/**
+ * Opens a socket on a receive queue of the interface
+ * of a program, and redirects the packets of the queue to it.
+ * @arg p The program
+ * @arg queue The receive queue, less than the queues of the program
+ * @arg s Output, the socket
+ * @return 0 on success
+ */
+int xdp_socket_open(xdp_prog *p, int queue, xdp_socket **s);
+
+/**
+ * Closes a socket and releases its UMEM
+ */
+void xdp_socket_close(xdp_socket *s);
+
+/**
+ * Returns the file descriptor of a socket, which
+ * is readable when there are packets to receive.
+ */
+int xdp_socket_fd(xdp_socket *s);
+
+/**
+ * Returns the UMEM of a socket
+ */
+char* xdp_socket_umem(xdp_socket *s);
+
+/**
+ * Returns the size of the UMEM of a socket
+ */
+uint32_t xdp_socket_umem_size(xdp_socket *s);
+
+/**
+ * Takes packets from the receive ring. Their frames are
+ * owned by the caller until released.
+ * @arg pkts Output, the packets
+ * @arg max The most packets to take
+ * @return The number of packets.
+ */
+uint32_t xdp_socket_recv(xdp_socket *s, xdp_packet *pkts, uint32_t max);
+
+/**
+ * Gives the frames of the packets returned by the
+ * last xdp_socket_recv back to the kernel.
+ * @arg pkts The packets
+ * @arg num The number of packets
+ */
+void xdp_socket_release(xdp_socket *s, xdp_packet *pkts, uint32_t num);
+
+/**
+ * Returns the number of packets the kernel dropped
+ * on a socket since it was opened.
+ * @arg drops Output, the count
+ * @return 0 on success
+ */
+int xdp_socket_drops(xdp_socket *s, uint64_t *drops);
+
+/**
+ * Finds the UDP payload of an Ethernet frame with an IPv4 or
+ * IPv6 header. The Ethernet padding after it is excluded.
+ * @arg frame The frame
+ * @arg len The length of the frame
+ * @arg offset Output, the offset of the payload
+ * @arg payload_len Output, the length of the payload
+ * @return 0 on success, -1 if it is not a whole UDP datagram.
+ */
+int xdp_udp_payload(const char *frame, uint32_t len, uint32_t *offset, uint32_t *payload_len);
+
+#endif
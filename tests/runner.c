@@ -1,9 +1,11 @@
 #include <check.h>
 #include <stdio.h>
 #include <syslog.h>
+#include <signal.h>
 #include "test_hashmap.c"
 #include "test_cm_quantile.c"
 #include "test_heap.c"
+#include "test_typed_heap.c"
 #include "test_timer.c"
 #include "test_counter.c"
 #include "test_metrics.c"
@@ -12,11 +14,42 @@
 #include "test_radix.c"
 #include "test_hll.c"
 #include "test_set.c"
+#include "test_arena.c"
+#include "test_graphite.c"
+#include "test_format.c"
+#include "test_tdigest.c"
+#include "test_hash.c"
+#include "test_ascii_scan.c"
+#include "test_stats.c"
+#include "test_spool.c"
+#include "test_snapshot.c"
+#include "test_shm_ring.c"
+#include "test_libstatsite.c"
+#include "test_sketch.c"
+#include "test_proxy.c"
+#include "test_topk.c"
+#include "test_intern.c"
+#include "test_xdp.c"
+#include "test_affinity.c"
+#include "test_page_alloc.c"
+#include "test_spsc_queue.c"
+#include "test_lz4.c"
+#include "test_gauge_history.c"
+#include "test_hdr.c"
+#include "test_rate_limit.c"
+#include "test_name_map.c"
+#include "test_influx.c"
+#include "test_shared_map.c"
+#include "test_loop_monitor.c"
+#include "test_set_window.c"
 
 int main(void)
 {
     setlogmask(LOG_UPTO(LOG_DEBUG));
 
+    // Commands that exit early should fail the stream, as in statsite
+    signal(SIGPIPE, SIG_IGN);
+
     Suite *s1 = suite_create("Statsite");
     TCase *tc1 = tcase_create("hashmap");
     TCase *tc2 = tcase_create("quantile");
@@ -29,6 +62,34 @@ int main(void)
     TCase *tc9 = tcase_create("radix");
     TCase *tc10 = tcase_create("hyperloglog");
     TCase *tc11 = tcase_create("set");
+    TCase *tc12 = tcase_create("arena");
+    TCase *tc13 = tcase_create("graphite");
+    TCase *tc14 = tcase_create("format");
+    TCase *tc15 = tcase_create("tdigest");
+    TCase *tc16 = tcase_create("hash");
+    TCase *tc17 = tcase_create("ascii_scan");
+    TCase *tc18 = tcase_create("stats");
+    TCase *tc19 = tcase_create("spool");
+    TCase *tc20 = tcase_create("snapshot");
+    TCase *tc21 = tcase_create("shm_ring");
+    TCase *tc22 = tcase_create("libstatsite");
+    TCase *tc23 = tcase_create("sketch");
+    TCase *tc24 = tcase_create("proxy");
+    TCase *tc25 = tcase_create("topk");
+    TCase *tc26 = tcase_create("intern");
+    TCase *tc27 = tcase_create("xdp");
+    TCase *tc28 = tcase_create("affinity");
+    TCase *tc29 = tcase_create("page_alloc");
+    TCase *tc30 = tcase_create("spsc_queue");
+    TCase *tc31 = tcase_create("lz4");
+    TCase *tc32 = tcase_create("gauge_history");
+    TCase *tc33 = tcase_create("hdr");
+    TCase *tc34 = tcase_create("rate_limit");
+    TCase *tc35 = tcase_create("name_map");
+    TCase *tc37 = tcase_create("shared_map");
+    TCase *tc38 = tcase_create("loop_monitor");
+    TCase *tc39 = tcase_create("set_window");
+    TCase *tc36 = tcase_create("influx");
     SRunner *sr = srunner_create(s1);
     int nf;
 
@@ -43,9 +104,17 @@ int main(void)
     tcase_add_test(tc1, test_map_put_delete_get);
     tcase_add_test(tc1, test_map_clear_no_keys);
     tcase_add_test(tc1, test_map_put_clear_get);
+    tcase_add_test(tc1, test_map_put_clear_reuse);
     tcase_add_test(tc1, test_map_iter_no_keys);
     tcase_add_test(tc1, test_map_put_iter_break);
     tcase_add_test(tc1, test_map_put_grow);
+    tcase_add_test(tc1, test_map_grow_mixed);
+    tcase_add_test(tc1, test_map_delete_iter);
+    tcase_add_test(tc1, test_map_iter_hash);
+    tcase_add_test(tc1, test_map_get_or_insert);
+    tcase_add_test(tc1, test_map_precomputed_hash);
+    tcase_add_test(tc1, test_map_arena_keys);
+    tcase_add_test(tc1, test_map_fit);
 
     // Add the quantile tests
     suite_add_tcase(s1, tc2);
@@ -61,6 +130,11 @@ int main(void)
     tcase_add_test(tc2, test_cm_init_add_loop_query_destroy);
     tcase_add_test(tc2, test_cm_init_add_loop_rev_query_destroy);
     tcase_add_test(tc2, test_cm_init_add_loop_random_query_destroy);
+    tcase_add_test(tc2, test_cm_query_many);
+    tcase_add_test(tc2, test_cm_merge_query_destroy);
+    tcase_add_test(tc2, test_cm_add_loop_signed_query_destroy);
+    tcase_add_test(tc2, test_cm_add_weighted);
+    tcase_add_test(tc2, test_cm_many_quantiles);
 
     // Add the heap tests
     suite_add_tcase(s1, tc3);
@@ -70,18 +144,33 @@ int main(void)
     tcase_add_test(tc3, test_heap_delete_order);
     tcase_add_test(tc3, test_heap_for_each);
     tcase_add_test(tc3, test_heap_del_empty);
+    tcase_add_test(tc3, test_heap_grow_shrink);
+    tcase_add_test(tc3, test_typed_heap_empty);
+    tcase_add_test(tc3, test_typed_heap_order);
 
     // Add the timer tests
     suite_add_tcase(s1, tc4);
     tcase_add_test(tc4, test_timer_init_and_destroy);
     tcase_add_test(tc4, test_timer_init_add_destroy);
     tcase_add_test(tc4, test_timer_add_loop);
+    tcase_add_test(tc4, test_timer_merge);
+    tcase_add_test(tc4, test_timer_tdigest);
+    tcase_add_test(tc4, test_timer_hdr);
+    tcase_add_test(tc4, test_timer_exact);
+    tcase_add_test(tc4, test_timer_merge_exact);
+    tcase_add_test(tc4, test_timer_add_weighted);
+    tcase_add_test(tc4, test_timer_arena);
+    tcase_add_test(tc4, test_timer_stats);
+    tcase_add_test(tc4, test_timer_extremes);
+    tcase_add_test(tc4, test_timer_admission);
 
     // Add the counter tests
     suite_add_tcase(s1, tc5);
     tcase_add_test(tc5, test_counter_init);
     tcase_add_test(tc5, test_counter_init_add);
     tcase_add_test(tc5, test_counter_add_loop);
+    tcase_add_test(tc5, test_counter_merge);
+    tcase_add_test(tc5, test_counter_add_samples);
 
     // Add the counter tests
     suite_add_tcase(s1, tc6);
@@ -91,14 +180,62 @@ int main(void)
     tcase_add_test(tc6, test_metrics_add_iter);
     tcase_add_test(tc6, test_metrics_add_all_iter);
     tcase_add_test(tc6, test_metrics_histogram);
+    tcase_add_test(tc6, test_metrics_histogram_kernels);
+    tcase_add_test(tc6, test_metrics_histogram_cache);
+    tcase_add_test(tc6, test_metrics_timer_samples);
+    tcase_add_test(tc6, test_metrics_histogram_log);
+    tcase_add_test(tc6, test_metrics_histogram_sparse);
+    tcase_add_test(tc6, test_metrics_histogram_auto);
+    tcase_add_test(tc6, test_metrics_timer_engines);
+    tcase_add_test(tc6, test_metrics_shared);
     tcase_add_test(tc6, test_metrics_gauges);
+    tcase_add_test(tc6, test_metrics_merge);
+    tcase_add_test(tc6, test_metrics_merge_prefix);
+    tcase_add_test(tc6, test_metrics_merge_accuracy);
+    tcase_add_test(tc6, test_metrics_set_precisions);
+    tcase_add_test(tc6, test_metrics_set_hashes);
+    tcase_add_test(tc6, test_metrics_reconfigure);
+    tcase_add_test(tc6, test_metrics_inputs);
+    tcase_add_test(tc6, test_metrics_clear_reuse);
+    tcase_add_test(tc6, test_metrics_get_metric);
+    tcase_add_test(tc6, test_metrics_kv_chunks);
+    tcase_add_test(tc6, test_metrics_inline_grow);
+    tcase_add_test(tc6, test_metrics_counter_sum_only);
+    tcase_add_test(tc6, test_metrics_kv_coalesce);
+    tcase_add_test(tc6, test_metrics_fit);
+    tcase_add_test(tc6, test_metrics_limits);
+    tcase_add_test(tc6, test_metrics_top_keys);
+    tcase_add_test(tc6, test_metrics_interning);
+    tcase_add_test(tc6, test_metrics_add_sample_hash);
+    tcase_add_test(tc6, test_metrics_merge_sketch);
 
     // Add the streaming tests
     suite_add_tcase(s1, tc7);
     tcase_add_test(tc7, test_stream_empty);
     tcase_add_test(tc7, test_stream_some);
     tcase_add_test(tc7, test_stream_bad_cmd);
+    tcase_add_test(tc7, test_stream_cmd_status);
     tcase_add_test(tc7, test_stream_sigpipe);
+    tcase_add_test(tc7, test_stream_all);
+    tcase_add_test(tc7, test_stream_persistent_sink);
+    tcase_add_test(tc7, test_stream_persistent_sink_restart);
+    tcase_add_test(tc7, test_stream_ring_sink);
+    tcase_add_test(tc7, test_stream_parallel);
+    tcase_add_test(tc7, test_stream_parallel_heavy);
+    tcase_add_test(tc7, test_stream_splice);
+    tcase_add_test(tc7, test_stream_gather);
+    tcase_add_test(tc7, test_stream_async);
+    tcase_add_test(tc7, test_stream_file);
+    tcase_add_test(tc7, test_stream_lz4);
+    tcase_add_test(tc7, test_stream_fan_out);
+    tcase_add_test(tc7, test_stream_timeout);
+    tcase_add_test(tc7, test_stream_timings);
+    tcase_add_test(tc7, test_stream_partitioned);
+    tcase_add_test(tc7, test_stream_sorted);
+    tcase_add_test(tc7, test_stream_front_coded);
+    tcase_add_test(tc7, test_stream_columnar);
+    tcase_add_test(tc7, test_stream_json);
+    tcase_add_test(tc7, test_stream_finalize_timers);
 
     // Add the config tests
     suite_add_tcase(s1, tc8);
@@ -115,7 +252,50 @@ int main(void)
     tcase_add_test(tc8, test_sane_flush_interval);
     tcase_add_test(tc8, test_sane_histograms);
     tcase_add_test(tc8, test_sane_set_eps);
+    tcase_add_test(tc8, test_sane_worker_threads);
+    tcase_add_test(tc8, test_sane_graphite);
+    tcase_add_test(tc8, test_sane_influx);
+    tcase_add_test(tc8, test_sane_tdigest_compression);
+    tcase_add_test(tc8, test_sane_set_max_exact);
+    tcase_add_test(tc8, test_sane_conn_buffers);
+    tcase_add_test(tc8, test_config_conn_buffers);
+    tcase_add_test(tc8, test_sane_tcp_backlog);
+    tcase_add_test(tc8, test_config_tcp_backlog);
+    tcase_add_test(tc8, test_sane_udp_rcvbuf);
+    tcase_add_test(tc8, test_sane_client_rate);
+    tcase_add_test(tc8, test_sane_name_map);
+    tcase_add_test(tc8, test_sane_flush_threads);
+    tcase_add_test(tc8, test_sane_flush_queue);
+    tcase_add_test(tc8, test_sane_flush_spool);
+    tcase_add_test(tc8, test_config_flush_queue);
+    tcase_add_test(tc8, test_config_snapshot_file);
+    tcase_add_test(tc8, test_config_io_uring);
+    tcase_add_test(tc8, test_config_unix_paths);
+    tcase_add_test(tc8, test_config_shm_ring);
+    tcase_add_test(tc8, test_sane_shm_ring_size);
+    tcase_add_test(tc8, test_config_sketch_stream);
+    tcase_add_test(tc8, test_config_proxy);
+    tcase_add_test(tc8, test_sane_proxy);
+    tcase_add_test(tc8, test_sane_quantiles);
+    tcase_add_test(tc8, test_config_quantiles);
+    tcase_add_test(tc8, test_config_udp_rcvbuf);
     tcase_add_test(tc8, test_config_histograms);
+    tcase_add_test(tc8, test_config_histograms_scale);
+    tcase_add_test(tc8, test_config_histograms_auto);
+    tcase_add_test(tc8, test_config_timer_engines);
+    tcase_add_test(tc8, test_config_bad_timer_engine);
+    tcase_add_test(tc8, test_config_counter_modes);
+    tcase_add_test(tc8, test_config_kv_modes);
+    tcase_add_test(tc8, test_config_limits);
+    tcase_add_test(tc8, test_config_set_precisions);
+    tcase_add_test(tc8, test_config_for_reload);
+    tcase_add_test(tc8, test_config_rollups);
+    tcase_add_test(tc8, test_config_sinks);
+    tcase_add_test(tc8, test_config_listeners);
+    tcase_add_test(tc8, test_config_listener_protocol);
+    tcase_add_test(tc8, test_config_filters);
+    tcase_add_test(tc8, test_config_filters_allow_wins);
+    tcase_add_test(tc8, test_config_top_keys);
     tcase_add_test(tc8, test_build_radix);
 
     // Add the radix tests
@@ -125,6 +305,7 @@ int main(void)
     tcase_add_test(tc9, test_radix_search);
     tcase_add_test(tc9, test_radix_longest_prefix);
     tcase_add_test(tc9, test_radix_foreach);
+    tcase_add_test(tc9, test_radix_grow);
 
     // Add the hll tests
     suite_add_tcase(s1, tc10);
@@ -136,6 +317,11 @@ int main(void)
     tcase_add_test(tc10, test_hll_size);
     tcase_add_test(tc10, test_hll_error_bound);
     tcase_add_test(tc10, test_hll_precision_for_error);
+    tcase_add_test(tc10, test_hll_merge);
+    tcase_add_test(tc10, test_hll_sparse);
+    tcase_add_test(tc10, test_hll_merge_sparse_dense);
+    tcase_add_test(tc10, test_hll_fold);
+    tcase_add_test(tc10, test_hll_recount);
 
     // Add the set tests
     suite_add_tcase(s1, tc11);
@@ -143,7 +329,191 @@ int main(void)
     tcase_add_test(tc11, test_set_add_size_exact);
     tcase_add_test(tc11, test_set_add_size_exact_dedup);
     tcase_add_test(tc11, test_set_error_bound);
+    tcase_add_test(tc11, test_set_merge_exact);
+    tcase_add_test(tc11, test_set_merge_approx);
+    tcase_add_test(tc11, test_set_large_exact);
+    tcase_add_test(tc11, test_set_merge_large_exact);
+    tcase_add_test(tc11, test_set_inline);
+
+    // Add the arena tests
+    suite_add_tcase(s1, tc12);
+    tcase_add_test(tc12, test_arena_init_and_destroy);
+    tcase_add_test(tc12, test_arena_alloc);
+    tcase_add_test(tc12, test_arena_calloc_strdup_reset);
+
+    // Add the graphite tests
+    suite_add_tcase(s1, tc13);
+    tcase_add_test(tc13, test_graphite_flush);
+    tcase_add_test(tc13, test_graphite_retry_buffer);
+
+    // Add the format tests
+    suite_add_tcase(s1, tc14);
+    tcase_add_test(tc14, test_format_double_special);
+    tcase_add_test(tc14, test_format_double_random);
+    tcase_add_test(tc14, test_format_int);
+    tcase_add_test(tc14, test_format_quantile_name);
+    tcase_add_test(tc14, test_json_writer);
+    tcase_add_test(tc14, test_parse_double_special);
+    tcase_add_test(tc14, test_parse_double_invalid);
+    tcase_add_test(tc14, test_parse_double_random);
+
+    // Add the t-digest tests
+    suite_add_tcase(s1, tc15);
+    tcase_add_test(tc15, test_td_init_and_destroy);
+    tcase_add_test(tc15, test_td_init_bad_compression);
+    tcase_add_test(tc15, test_td_add_query);
+    tcase_add_test(tc15, test_td_add_loop_query);
+    tcase_add_test(tc15, test_td_merge);
+
+    // Add the hash tests
+    suite_add_tcase(s1, tc16);
+    tcase_add_test(tc16, test_hash_deterministic);
+    tcase_add_test(tc16, test_hash_distribution);
+
+    // Add the ASCII tokenizer tests
+    suite_add_tcase(s1, tc17);
+    tcase_add_test(tc17, test_scan_lines);
+    tcase_add_test(tc17, test_scan_lines_partial);
+    tcase_add_test(tc17, test_scan_lines_max);
+    tcase_add_test(tc17, test_scan_lines_missing);
+    tcase_add_test(tc17, test_scan_lines_long);
+    tcase_add_test(tc17, test_scan_lines_tags);
+    tcase_add_test(tc17, test_canonical_tags);
+    tcase_add_test(tc17, test_scan_lines_kernels);
+    tcase_add_test(tc17, test_simd_levels);
+
+    // Add the internal stats tests
+    suite_add_tcase(s1, tc18);
+    tcase_add_test(tc18, test_stats_add);
+    tcase_add_test(tc18, test_stats_threads);
+    tcase_add_test(tc18, test_stats_mem_threads);
+    tcase_add_test(tc18, test_stats_seq);
+    tcase_add_test(tc18, test_stats_concurrent);
+    tcase_add_test(tc18, test_stats_mem_metrics);
+
+    // Add the flush spool tests
+    suite_add_tcase(s1, tc19);
+    tcase_add_test(tc19, test_spool_append_drain);
+    tcase_add_test(tc19, test_spool_segments);
+    tcase_add_test(tc19, test_spool_recover);
+
+    // Add the snapshot tests
+    suite_add_tcase(s1, tc20);
+    tcase_add_test(tc20, test_snapshot_roundtrip);
+    tcase_add_test(tc20, test_snapshot_sizes);
+    tcase_add_test(tc20, test_snapshot_invalid);
+    tcase_add_test(tc20, test_snapshot_timer_engine);
+    tcase_add_test(tc20, test_snapshot_kv_coalesced);
+
+    // Add the shm ring tests
+    suite_add_tcase(s1, tc21);
+    tcase_add_test(tc21, test_shm_ring_write);
+    tcase_add_test(tc21, test_shm_ring_reopen);
+
+    // Add the library API tests
+    suite_add_tcase(s1, tc22);
+    tcase_add_test(tc22, test_libstatsite_agg);
+    tcase_add_test(tc22, test_libstatsite_serialize);
+
+    // Add the sketch encoding tests
+    suite_add_tcase(s1, tc23);
+    tcase_add_test(tc23, test_sketch_counter);
+    tcase_add_test(tc23, test_sketch_set);
+    tcase_add_test(tc23, test_sketch_hll_layouts);
+    tcase_add_test(tc23, test_sketch_timer);
+
+    // Add the forwarding proxy tests
+    suite_add_tcase(s1, tc24);
+    tcase_add_test(tc24, test_proxy_ring);
+    tcase_add_test(tc24, test_proxy_forward_tcp);
+    tcase_add_test(tc24, test_proxy_forward_udp);
+
+    // Add the heavy hitter tests
+    suite_add_tcase(s1, tc25);
+    tcase_add_test(tc25, test_topk_init_destroy);
+    tcase_add_test(tc25, test_topk_exact);
+    tcase_add_test(tc25, test_topk_heavy_hitters);
+    tcase_add_test(tc25, test_topk_merge);
+
+    // Add the intern table tests
+    suite_add_tcase(s1, tc26);
+    tcase_add_test(tc26, test_intern_init_destroy);
+    tcase_add_test(tc26, test_intern_key);
+    tcase_add_test(tc26, test_intern_sweep);
+    tcase_add_test(tc26, test_intern_expire);
+
+    // Add the AF_XDP tests
+    suite_add_tcase(s1, tc27);
+    tcase_add_test(tc27, test_xdp_udp_payload);
+    tcase_add_test(tc27, test_xdp_udp_payload_invalid);
+
+    // Add the CPU affinity tests
+    suite_add_tcase(s1, tc28);
+    tcase_add_test(tc28, test_cpu_list_parse);
+    tcase_add_test(tc28, test_cpu_pin_thread);
+
+    // Add the huge page allocator tests
+    suite_add_tcase(s1, tc29);
+    tcase_add_test(tc29, test_page_alloc_small_large);
+    tcase_add_test(tc29, test_page_alloc_huge_pages);
+
+    // Add the single-producer, single-consumer queue tests
+    suite_add_tcase(s1, tc30);
+    tcase_add_test(tc30, test_spsc_queue_push_pop);
+    tcase_add_test(tc30, test_spsc_queue_threads);
+
+    // Add the LZ4 compression tests
+    suite_add_tcase(s1, tc31);
+    tcase_add_test(tc31, test_lz4_block);
+    tcase_add_test(tc31, test_lz4_frame);
+
+    // Add the gauge history tests
+    suite_add_tcase(s1, tc32);
+    tcase_add_test(tc32, test_gauge_history_init_destroy);
+    tcase_add_test(tc32, test_gauge_history_changes);
+    tcase_add_test(tc32, test_gauge_history_refresh);
+
+    // Add the HDR histogram tests
+    suite_add_tcase(s1, tc33);
+    tcase_add_test(tc33, test_hdr_init_and_destroy);
+    tcase_add_test(tc33, test_hdr_init_bad_eps);
+    tcase_add_test(tc33, test_hdr_relative_error);
+    tcase_add_test(tc33, test_hdr_query_many);
+    tcase_add_test(tc33, test_hdr_merge);
+    tcase_add_test(tc33, test_hdr_out_of_range);
+
+    // Add the client rate limit tests
+    suite_add_tcase(s1, tc34);
+    tcase_add_test(tc34, test_rate_table_init);
+    tcase_add_test(tc34, test_rate_bucket_refill);
+    tcase_add_test(tc34, test_rate_table_take);
+
+    // Add the name map tests
+    suite_add_tcase(s1, tc35);
+    tcase_add_test(tc35, test_name_map_init);
+    tcase_add_test(tc35, test_name_map_copy);
+    tcase_add_test(tc35, test_name_map_metrics);
+
+    // Add the InfluxDB output tests
+    suite_add_tcase(s1, tc36);
+    tcase_add_test(tc36, test_influx_flush);
+    tcase_add_test(tc36, test_influx_errors);
+
+    // Add the shared map tests
+    suite_add_tcase(s1, tc37);
+    tcase_add_test(tc37, test_shared_map_values);
+    tcase_add_test(tc37, test_shared_map_full);
+    tcase_add_test(tc37, test_shared_map_threads);
+
+    // Add the loop monitor tests
+    suite_add_tcase(s1, tc38);
+    tcase_add_test(tc38, test_loop_monitor_iterations);
 
+    // Add the set window tests
+    suite_add_tcase(s1, tc39);
+    tcase_add_test(tc39, test_set_window_init_destroy);
+    tcase_add_test(tc39, test_set_window_slide);
+    tcase_add_test(tc39, test_set_window_approx);
 
     srunner_run_all(sr, CK_ENV);
     nf = srunner_ntests_failed(sr);
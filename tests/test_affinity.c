@@ -0,0 +1,50 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "affinity.h"
+
+START_TEST(test_cpu_list_parse)
+{
+    int cpus[8];
+    fail_unless(cpu_list_parse("3", cpus, 8) == 1);
+    fail_unless(cpus[0] == 3);
+
+    // Ranges and single CPUs, in the order listed
+    fail_unless(cpu_list_parse("4-6, 0,10-11", cpus, 8) == 6);
+    fail_unless(cpus[0] == 4 && cpus[2] == 6 && cpus[3] == 0 && cpus[5] == 11);
+
+    // Only counted past the output
+    fail_unless(cpu_list_parse("0-15", cpus, 8) == 16);
+    fail_unless(cpu_list_parse("0-15", NULL, 0) == 16);
+
+    // Invalid lists
+    fail_unless(cpu_list_parse("", cpus, 8) == -1);
+    fail_unless(cpu_list_parse("1,", cpus, 8) == -1);
+    fail_unless(cpu_list_parse("3-1", cpus, 8) == -1);
+    fail_unless(cpu_list_parse("a", cpus, 8) == -1);
+    fail_unless(cpu_list_parse("-1", cpus, 8) == -1);
+    fail_unless(cpu_list_parse("2000", cpus, 8) == -1);
+}
+END_TEST
+
+// Pins the calling thread to CPU 0, storing the result
+static void* pin_thread(void *arg) {
+    *(int*)arg = cpu_pin_thread("0", 1);
+    return NULL;
+}
+
+START_TEST(test_cpu_pin_thread)
+{
+    fail_unless(cpu_pin_thread(NULL, 0) == 0);
+    fail_unless(cpu_pin_thread("x", 0) == -1);
+
+    // Pin a thread of its own, so the runner keeps its CPUs
+    pthread_t t;
+    int res = 1;
+    pthread_create(&t, NULL, pin_thread, &res);
+    pthread_join(t, NULL);
+    fail_unless(res == 0);
+}
+END_TEST
@@ -0,0 +1,65 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "arena.h"
+
+START_TEST(test_arena_init_and_destroy)
+{
+    arena a;
+    fail_unless(arena_init(0, &a) == 0);
+    fail_unless(a.chunk_size == ARENA_DEFAULT_CHUNK);
+    fail_unless(arena_destroy(&a) == 0);
+}
+END_TEST
+
+START_TEST(test_arena_alloc)
+{
+    arena a;
+    fail_unless(arena_init(1024, &a) == 0);
+
+    // Many small allocations span several chunks
+    char *ptrs[1000];
+    for (int i=0; i < 1000; i++) {
+        ptrs[i] = arena_alloc(&a, 10);
+        fail_unless(ptrs[i] != NULL);
+        fail_unless(((uintptr_t)ptrs[i] % 16) == 0);
+        memset(ptrs[i], i & 0xff, 10);
+    }
+    for (int i=0; i < 1000; i++) {
+        fail_unless((unsigned char)ptrs[i][9] == (i & 0xff));
+    }
+    fail_unless(a.allocated >= 1000 * 16);
+
+    // Large allocations get their own chunk
+    char *big = arena_alloc(&a, 10000);
+    fail_unless(big != NULL);
+    memset(big, 0, 10000);
+
+    fail_unless(arena_destroy(&a) == 0);
+}
+END_TEST
+
+START_TEST(test_arena_calloc_strdup_reset)
+{
+    arena a;
+    fail_unless(arena_init(0, &a) == 0);
+
+    unsigned int *counts = arena_calloc(&a, 100, sizeof(unsigned int));
+    for (int i=0; i < 100; i++) {
+        fail_unless(counts[i] == 0);
+    }
+
+    char *s = arena_strdup(&a, "foo.bar");
+    fail_unless(strcmp(s, "foo.bar") == 0);
+
+    // Reset and re-use
+    fail_unless(arena_reset(&a) == 0);
+    fail_unless(a.allocated == 0);
+    s = arena_strdup(&a, "baz");
+    fail_unless(strcmp(s, "baz") == 0);
+
+    fail_unless(arena_destroy(&a) == 0);
+}
+END_TEST
+
@@ -0,0 +1,242 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ascii_scan.h"
+#include "cpu_features.h"
+
+START_TEST(test_scan_lines)
+{
+    char buf[] = "foo:1|c\nbar.baz:2.5|ms\nsampled:3|c|@0.1\n";
+    ascii_line lines[8];
+    int num;
+    int consumed = ascii_scan_lines(buf, strlen(buf), lines, 8, &num);
+    fail_unless(consumed == sizeof(buf) - 1);
+    fail_unless(num == 3);
+
+    fail_unless(strcmp(lines[0].key, "foo") == 0);
+    fail_unless(strcmp(lines[0].value, "1") == 0);
+    fail_unless(strcmp(lines[0].type, "c") == 0);
+    fail_unless(lines[0].sample == NULL);
+    fail_unless(lines[0].len == 7);
+
+    fail_unless(strcmp(lines[1].key, "bar.baz") == 0);
+    fail_unless(strcmp(lines[1].value, "2.5") == 0);
+    fail_unless(strcmp(lines[1].type, "ms") == 0);
+
+    fail_unless(strcmp(lines[2].key, "sampled") == 0);
+    fail_unless(strcmp(lines[2].value, "3") == 0);
+    fail_unless(strcmp(lines[2].type, "c|") == 0);
+    fail_unless(strcmp(lines[2].sample, "0.1") == 0);
+}
+END_TEST
+
+START_TEST(test_scan_lines_partial)
+{
+    // The partial line must be left untouched
+    char buf[] = "foo:1|c\nbar:2|";
+    ascii_line lines[8];
+    int num;
+    int consumed = ascii_scan_lines(buf, strlen(buf), lines, 8, &num);
+    fail_unless(num == 1);
+    fail_unless(consumed == 8);
+    fail_unless(strcmp(buf + consumed, "bar:2|") == 0);
+
+    // No complete lines
+    consumed = ascii_scan_lines(buf + 8, strlen(buf + 8), lines, 8, &num);
+    fail_unless(num == 0);
+    fail_unless(consumed == 0);
+}
+END_TEST
+
+START_TEST(test_scan_lines_max)
+{
+    char buf[] = "a:1|c\nb:2|c\nc:3|c\n";
+    ascii_line lines[2];
+    int num;
+    int consumed = ascii_scan_lines(buf, strlen(buf), lines, 2, &num);
+    fail_unless(num == 2);
+    fail_unless(consumed == 12);
+    fail_unless(strcmp(lines[1].key, "b") == 0);
+    fail_unless(strcmp(buf + consumed, "c:3|c\n") == 0);
+}
+END_TEST
+
+START_TEST(test_scan_lines_missing)
+{
+    // Delimiters only count in order, and missing ones are NULL
+    char buf[] = "nocolon|c\nfoo:bar@1\nk@x:1:2|g|h\n";
+    ascii_line lines[8];
+    int num;
+    ascii_scan_lines(buf, strlen(buf), lines, 8, &num);
+    fail_unless(num == 3);
+
+    fail_unless(strcmp(lines[0].key, "nocolon|c") == 0);
+    fail_unless(lines[0].value == NULL);
+    fail_unless(lines[0].type == NULL);
+
+    fail_unless(strcmp(lines[1].value, "bar@1") == 0);
+    fail_unless(lines[1].type == NULL);
+    fail_unless(lines[1].sample == NULL);
+
+    fail_unless(strcmp(lines[2].key, "k@x") == 0);
+    fail_unless(strcmp(lines[2].value, "1:2") == 0);
+    fail_unless(strcmp(lines[2].type, "g|h") == 0);
+}
+END_TEST
+
+START_TEST(test_scan_lines_long)
+{
+    // Lines spanning many blocks, with delimiters at every offset
+    char buf[8192];
+    int len = 0;
+    for (int i=0; i < 100; i++) {
+        len += sprintf(buf + len, "%.*s:%d|ms\n", i + 1,
+                "abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyz", i);
+    }
+
+    ascii_line lines[128];
+    int num;
+    fail_unless(ascii_scan_lines(buf, len, lines, 128, &num) == len);
+    fail_unless(num == 100);
+    for (int i=0; i < 100; i++) {
+        fail_unless(strlen(lines[i].key) == i + 1);
+        fail_unless(atoi(lines[i].value) == i);
+        fail_unless(strcmp(lines[i].type, "ms") == 0);
+    }
+}
+END_TEST
+
+START_TEST(test_scan_lines_tags)
+{
+    // The tags follow the type or the sample rate
+    char buf[] = "foo:1|c|#env:prod,host:x\nbar:2|c|@0.5|#a\nbaz:3|ms|x#y\n";
+    ascii_line lines[8];
+    int num;
+    ascii_scan_lines(buf, strlen(buf), lines, 8, &num);
+    fail_unless(num == 3);
+
+    fail_unless(strcmp(lines[0].key, "foo") == 0);
+    fail_unless(strcmp(lines[0].type, "c") == 0);
+    fail_unless(lines[0].sample == NULL);
+    fail_unless(strcmp(lines[0].tags, "env:prod,host:x") == 0);
+
+    fail_unless(strcmp(lines[1].type, "c|") == 0);
+    fail_unless(strcmp(lines[1].sample, "0.5") == 0);
+    fail_unless(strcmp(lines[1].tags, "a") == 0);
+
+    fail_unless(strcmp(lines[2].type, "ms|x#y") == 0);
+    fail_unless(lines[2].tags == NULL);
+}
+END_TEST
+
+START_TEST(test_canonical_tags)
+{
+    // The tags are sorted and deduplicated into the key
+    char buf[] = "req:1.5|ms|@0.1|#status:200,env:prod,canary,env:prod,,route:a:b\n";
+    ascii_line line;
+    int num;
+    ascii_scan_lines(buf, strlen(buf), &line, 1, &num);
+    fail_unless(num == 1);
+    fail_unless(ascii_canonical_tags(&line) == 0);
+    fail_unless(strcmp(line.key, "req;canary;env=prod;route=a:b;status=200") == 0);
+    fail_unless(strcmp(line.value, "1.5") == 0);
+    fail_unless(strcmp(line.type, "ms|") == 0);
+    fail_unless(strcmp(line.sample, "0.1") == 0);
+    fail_unless(line.tags == NULL);
+
+    // Any order gives the same key, and the tags end at another field
+    char other[] = "req:2|ms|#route:a:b,env:prod,status:200,canary|c:abc\n";
+    ascii_scan_lines(other, strlen(other), &line, 1, &num);
+    fail_unless(ascii_canonical_tags(&line) == 0);
+    fail_unless(strcmp(line.key, "req;canary;env=prod;route=a:b;status=200") == 0);
+    fail_unless(strcmp(line.value, "2") == 0);
+    fail_unless(strcmp(line.type, "ms") == 0);
+
+    // Empty tags leave the key
+    char empty[] = "foo:1|c|#\n";
+    ascii_scan_lines(empty, strlen(empty), &line, 1, &num);
+    fail_unless(ascii_canonical_tags(&line) == 0);
+    fail_unless(strcmp(line.key, "foo") == 0);
+    fail_unless(strcmp(line.type, "c") == 0);
+
+    // Too many tags
+    char many[1024];
+    int len = sprintf(many, "foo:1|c|#t0");
+    for (int i=1; i <= MAX_LINE_TAGS; i++) len += sprintf(many + len, ",t%d", i);
+    strcpy(many + len, "\n");
+    ascii_scan_lines(many, len + 1, &line, 1, &num);
+    fail_unless(ascii_canonical_tags(&line) == -1);
+}
+END_TEST
+
+START_TEST(test_scan_lines_kernels)
+{
+    // Lines of many lengths, so the delimiters fall on every
+    // offset of the blocks, with a partial line at the end
+    char input[8192];
+    int len = 0;
+    srand(42);
+    while (len < (int)sizeof(input) - 256) {
+        int key_len = 1 + rand() % 90;
+        for (int i=0; i < key_len; i++) input[len++] = 'a' + rand() % 26;
+        len += sprintf(input + len, ":%d|%s", rand() % 1000, (rand() % 2) ? "ms" : "c");
+        if (rand() % 3 == 0) len += sprintf(input + len, "|@0.%d", rand() % 10);
+        if (rand() % 3 == 0) len += sprintf(input + len, "|#a:%d,b", rand() % 10);
+        input[len++] = '\n';
+    }
+    len += sprintf(input + len, "partial:1|c");
+
+    // Every kernel the host supports must match the scalar one
+    char expect_buf[8192], buf[8192];
+    ascii_line expect[512], lines[512];
+    int expect_num, num;
+    fail_unless(simd_limit(SIMD_NONE) == SIMD_NONE);
+    memcpy(expect_buf, input, len);
+    int expect_consumed = ascii_scan_lines(expect_buf, len, expect, 512, &expect_num);
+    fail_unless(expect_num > 50);
+
+    simd_level levels[] = {SIMD_SSE2, SIMD_AVX2, SIMD_AVX512, SIMD_NEON};
+    for (int l=0; l < 4; l++) {
+        if (simd_limit(levels[l]) != levels[l]) continue;
+        memcpy(buf, input, len);
+        fail_unless(ascii_scan_lines(buf, len, lines, 512, &num) == expect_consumed);
+        fail_unless(num == expect_num);
+        fail_unless(memcmp(buf, expect_buf, len) == 0);
+        for (int i=0; i < num; i++) {
+            fail_unless(lines[i].key - buf == expect[i].key - expect_buf);
+            fail_unless(lines[i].len == expect[i].len);
+            fail_unless((lines[i].value == NULL) == (expect[i].value == NULL));
+            fail_unless((lines[i].sample == NULL) == (expect[i].sample == NULL));
+            fail_unless((lines[i].tags == NULL) == (expect[i].tags == NULL));
+            if (lines[i].tags) fail_unless(lines[i].tags - buf == expect[i].tags - expect_buf);
+        }
+
+        // The limit also stops early, part way through a block
+        fail_unless(ascii_scan_lines(memcpy(buf, input, len), len, lines, 7, &num) == expect[7].key - expect_buf);
+        fail_unless(num == 7);
+    }
+    fail_unless(simd_limit(SIMD_AUTO) == simd_detect());
+    fail_unless(simd_current() == simd_detect());
+}
+END_TEST
+
+START_TEST(test_simd_levels)
+{
+    simd_level level;
+    fail_unless(simd_parse("auto", &level) == 0 && level == SIMD_AUTO);
+    fail_unless(simd_parse("AVX512", &level) == 0 && level == SIMD_AVX512);
+    fail_unless(simd_parse("none", &level) == 0 && level == SIMD_NONE);
+    fail_unless(simd_parse("mmx", &level) == -1);
+    fail_unless(strcmp(simd_name(SIMD_NEON), "neon") == 0);
+
+    // A limit is never above the host
+    simd_level host = simd_detect();
+    fail_unless(simd_limit(SIMD_NONE) == SIMD_NONE);
+    fail_unless(simd_current() == SIMD_NONE);
+    level = simd_limit(SIMD_AVX512);
+    fail_unless(level == SIMD_AVX512 || (level == host && host != SIMD_NEON) ||
+            (host == SIMD_NEON && level == SIMD_NONE));
+    fail_unless(simd_limit(SIMD_AUTO) == host);
+}
+END_TEST
@@ -129,10 +129,9 @@ START_TEST(test_cm_init_add_negative_query_destroy)
 END_TEST
 
 void print_cm(cm_quantile *cm) {
-    cm_sample *samp = cm->samples;
-    while (samp) {
+    for (uint64_t i=0; i < cm->num_samples; i++) {
+        cm_sample *samp = cm->samples + i;
         printf("%f - %lld %lld\n", samp->value, samp->width, samp->delta);
-        samp = samp->next;
     }
 }
 
@@ -225,3 +224,163 @@ START_TEST(test_cm_init_add_loop_random_query_destroy)
 END_TEST
 
 
+START_TEST(test_cm_merge_query_destroy)
+{
+    cm_quantile cm1, cm2;
+    double quants[] = {0.5, 0.90, 0.99};
+    int res = init_cm_quantile(0.01, (double*)&quants, 3, &cm1);
+    fail_unless(res == 0);
+    res = init_cm_quantile(0.01, (double*)&quants, 3, &cm2);
+    fail_unless(res == 0);
+
+    // Interleave the values between the two
+    for (int i=0; i < 100000; i++) {
+        res = cm_add_sample((i % 2) ? &cm1 : &cm2, i);
+        fail_unless(res == 0);
+    }
+
+    res = cm_merge(&cm1, &cm2);
+    fail_unless(res == 0);
+    fail_unless(cm1.num_values == 100000);
+
+    // Min and max are preserved
+    fail_unless(cm1.samples[0].value == 0);
+    fail_unless(cm1.samples[cm1.num_samples-1].value == 99999);
+
+    double val = cm_query(&cm1, 0.5);
+    fail_unless(val >= 50000 - 1000 && val <= 50000 + 1000);
+
+    val = cm_query(&cm1, 0.90);
+    fail_unless(val >= 90000 - 1000 && val <= 90000 + 1000);
+
+    val = cm_query(&cm1, 0.99);
+    fail_unless(val >= 99000 - 1000 && val <= 99000 + 1000);
+
+    res = destroy_cm_quantile(&cm1);
+    fail_unless(res == 0);
+    res = destroy_cm_quantile(&cm2);
+    fail_unless(res == 0);
+}
+END_TEST
+
+
+START_TEST(test_cm_add_loop_signed_query_destroy)
+{
+    cm_quantile cm;
+    double quants[] = {0.5, 0.90, 0.99};
+    int res = init_cm_quantile(0.01, (double*)&quants, 3, &cm);
+    fail_unless(res == 0);
+
+    // Mix negative and fractional values, so the batches
+    // are sorted across the sign boundary
+    srandom(42);
+    for (int i=0; i < 100000; i++) {
+        double val = (random() % 200000) - 100000 + 0.25;
+        res = cm_add_sample(&cm, val);
+        fail_unless(res == 0);
+    }
+    res = cm_add_sample(&cm, -100001.5);
+    fail_unless(res == 0);
+
+    res = cm_flush(&cm);
+    fail_unless(res == 0);
+
+    // The samples must be sorted, with the minimum kept
+    fail_unless(cm.samples[0].value == -100001.5);
+    for (uint64_t i=1; i < cm.num_samples; i++) {
+        fail_unless(cm.samples[i-1].value <= cm.samples[i].value);
+    }
+
+    double val = cm_query(&cm, 0.5);
+    fail_unless(val >= -2000 && val <= 2000);
+
+    val = cm_query(&cm, 0.9);
+    fail_unless(val >= 80000 - 2000 && val <= 80000 + 2000);
+
+    res = destroy_cm_quantile(&cm);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_cm_query_many)
+{
+    cm_quantile cm;
+    double quants[] = {0.5, 0.90, 0.95, 0.99};
+    int res = init_cm_quantile(0.01, (double*)&quants, 4, &cm);
+    fail_unless(res == 0);
+
+    // Empty summaries return zeros
+    double vals[6] = {1, 1, 1, 1, 1, 1};
+    cm_query_many(&cm, quants, 4, vals);
+    for (int i=0; i < 4; i++) fail_unless(vals[i] == 0);
+
+    srandom(42);
+    for (int i=0; i < 100000; i++) {
+        res = cm_add_sample(&cm, random() % 100000);
+        fail_unless(res == 0);
+    }
+
+    // A single walk should match the separate queries,
+    // including quantiles that are not tracked
+    double query[] = {0.01, 0.25, 0.5, 0.9, 0.95, 0.99};
+    cm_query_many(&cm, query, 6, vals);
+    for (int i=0; i < 6; i++) {
+        fail_unless(vals[i] == cm_query(&cm, query[i]));
+    }
+
+    res = destroy_cm_quantile(&cm);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_cm_add_weighted)
+{
+    cm_quantile cm;
+    double quants[] = {0.5, 0.90, 0.99};
+    int res = init_cm_quantile(0.01, (double*)&quants, 3, &cm);
+    fail_unless(res == 0);
+
+    // Half the values are weighted, the rest are not
+    srandom(42);
+    for (int i=0; i < 10000; i++) {
+        fail_unless(cm_add_weighted(&cm, 5000 + random() % 5000, 3) == 0);
+        fail_unless(cm_add_sample(&cm, random() % 5000) == 0);
+    }
+    fail_unless(cm_flush(&cm) == 0);
+    fail_unless(cm.num_values == 40000);
+
+    // A quarter of the values are below 5000
+    double val = cm_query(&cm, 0.25);
+    fail_unless(val >= 4800 && val <= 5200);
+    val = cm_query(&cm, 0.625);
+    fail_unless(val >= 7300 && val <= 7700);
+
+    res = destroy_cm_quantile(&cm);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_cm_many_quantiles)
+{
+    cm_quantile cm;
+    double quants[] = {0.01, 0.05, 0.1, 0.25, 0.5, 0.5, 0.75, 0.9, 0.95, 0.99, 0.999};
+    int res = init_cm_quantile(0.01, (double*)&quants, 11, &cm);
+    fail_unless(res == 0);
+
+    // The threshold is the least over all of them, at every rank
+    for (int i=0; i < 100000; i++) {
+        res = cm_add_sample(&cm, (i * 7919) % 100000);
+        fail_unless(res == 0);
+    }
+    double vals[11];
+    cm_query_many(&cm, quants, 11, vals);
+    for (int i=0; i < 11; i++) {
+        fail_unless(vals[i] == cm_query(&cm, quants[i]));
+        fail_unless(vals[i] >= quants[i] * 100000 - 2000 && vals[i] <= quants[i] * 100000 + 2000);
+    }
+    fail_unless(vals[4] == vals[5]);
+
+    res = destroy_cm_quantile(&cm);
+    fail_unless(res == 0);
+}
+END_TEST
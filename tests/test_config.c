@@ -25,7 +25,80 @@ START_TEST(test_config_get_default)
     fail_unless(config.binary_stream == false);
     fail_unless(strcmp(config.pid_file, "/var/run/statsite.pid") == 0);
     fail_unless(config.input_counter == NULL);
-
+    fail_unless(config.worker_threads == 1);
+    fail_unless(config.persistent_sink == false);
+    fail_unless(config.graphite_host == NULL);
+    fail_unless(config.graphite_port == 2003);
+    fail_unless(strcmp(config.graphite_prefix, "statsite.") == 0);
+    fail_unless(config.graphite_max_buffer == 16777216);
+    fail_unless(config.timer_engine == TIMER_ENGINE_CM);
+    fail_unless(config.tdigest_compression == 100);
+    fail_unless(config.timer_configs == NULL);
+    fail_unless(config.set_max_exact == 64);
+    fail_unless(config.conn_max_buffer == 4194304);
+    fail_unless(config.conn_buffer_budget == 0);
+    fail_unless(config.priority_buffer_budget == 0);
+    fail_unless(config.tcp_backlog == 1024);
+    fail_unless(config.udp_rcvbuf == 0);
+    fail_unless(config.udp_drop_counter == NULL);
+    fail_unless(config.internal_stats == false);
+    fail_unless(config.binary_stream_grouped == false);
+    fail_unless(config.flush_threads == 1);
+    fail_unless(config.flush_workers == 1);
+    fail_unless(config.flush_queue == 4);
+    fail_unless(config.flush_queue_policy == FLUSH_MERGE);
+    fail_unless(config.flush_spill_dir == NULL);
+    fail_unless(config.num_quantiles == 4);
+    fail_unless(config.quantiles[0] == 0.5 && config.quantiles[3] == 0.99);
+    fail_unless(config.counter_sum_only == false);
+    fail_unless(config.counter_configs == NULL);
+    fail_unless(config.kv_configs == NULL);
+    fail_unless(config.flush_spool == false);
+    fail_unless(config.flush_spool_segment == 67108864);
+    fail_unless(config.snapshot_file == NULL);
+    fail_unless(config.io_uring == false);
+    fail_unless(config.unix_stream_path == NULL);
+    fail_unless(config.unix_dgram_path == NULL);
+    fail_unless(config.shm_ring_path == NULL);
+    fail_unless(config.shm_ring_size == 4194304);
+    fail_unless(config.sketch_stream == false);
+    fail_unless(config.proxy_upstreams == NULL);
+    fail_unless(config.proxy_vnodes == 128);
+    fail_unless(config.proxy_udp == false);
+    fail_unless(config.limit_configs == NULL);
+    fail_unless(config.limits == NULL);
+    fail_unless(config.drop_prefixes == NULL);
+    fail_unless(config.allow_prefixes == NULL);
+    fail_unless(config.drop_unmatched == false);
+    fail_unless(config.filters == NULL);
+    fail_unless(config.top_keys == 0);
+    fail_unless(config.intern_idle_intervals == 0);
+    fail_unless(config.max_line_length == 0);
+    fail_unless(config.udp_gro == true);
+    fail_unless(config.xdp_interface == NULL);
+    fail_unless(config.xdp_queues == 1);
+    fail_unless(config.udp_drop_filter == false);
+    fail_unless(config.worker_cpus == NULL);
+    fail_unless(config.flush_cpus == NULL);
+    fail_unless(config.stream_cpus == NULL);
+    fail_unless(config.huge_pages == HUGE_PAGES_OFF);
+    fail_unless(config.simd == SIMD_AUTO);
+    fail_unless(config.num_set_windows == 0);
+    fail_unless(config.set_window_slots == 12);
+    fail_unless(config.ingest_pipeline == false);
+    fail_unless(config.rollup_configs == NULL);
+    fail_unless(config.output_compression == COMPRESS_NONE);
+    fail_unless(config.sorted_output == false);
+    fail_unless(config.binary_stream_front_coded == false);
+    fail_unless(config.columnar_stream == false);
+    fail_unless(config.sink_configs == NULL);
+    fail_unless(config.stream_timeout_ms == 0);
+    fail_unless(config.gauge_changes_only == false);
+    fail_unless(config.gauge_refresh_intervals == 60);
+    fail_unless(config.admin_socket_path == NULL);
+    fail_unless(config.memory_budget == 0);
+    fail_unless(config.listener_configs == NULL);
+    fail_unless(config.parse_tags == false);
 }
 END_TEST
 
@@ -94,6 +167,15 @@ log_level = INFO\n\
 daemonize = true\n\
 binary_stream = true\n\
 input_counter = foobar\n\
+worker_threads = 4\n\
+persistent_sink = true\n\
+graphite_host = carbon.local\n\
+graphite_port = 2004\n\
+graphite_prefix = stats.\n\
+graphite_max_buffer = 1024\n\
+internal_stats = true\n\
+binary_stream_grouped = true\n\
+flush_threads = 4\n\
 pid_file = /tmp/statsite.pid\n";
     write(fh, buf, strlen(buf));
     fchmod(fh, 777);
@@ -116,6 +198,15 @@ pid_file = /tmp/statsite.pid\n";
     fail_unless(config.binary_stream == true);
     fail_unless(strcmp(config.pid_file, "/tmp/statsite.pid") == 0);
     fail_unless(strcmp(config.input_counter, "foobar") == 0);
+    fail_unless(config.worker_threads == 4);
+    fail_unless(config.persistent_sink == true);
+    fail_unless(strcmp(config.graphite_host, "carbon.local") == 0);
+    fail_unless(config.graphite_port == 2004);
+    fail_unless(strcmp(config.graphite_prefix, "stats.") == 0);
+    fail_unless(config.graphite_max_buffer == 1024);
+    fail_unless(config.internal_stats == true);
+    fail_unless(config.binary_stream_grouped == true);
+    fail_unless(config.flush_threads == 4);
 
     unlink("/tmp/basic_config");
 }
@@ -228,6 +319,18 @@ START_TEST(test_sane_histograms)
     c = (histogram_config){"foo", 0, 100, 5, 0, NULL, 0};
     fail_unless(sane_histograms(&c) == 0);
     fail_unless(c.num_bins == 22);
+    fail_unless(c.inv_bin_width == 0.2);
+
+    // Log bins need a positive min, and grow by the width
+    c = (histogram_config){"foo", 1, 1000, 10, 0, NULL, 0, HISTOGRAM_LOG};
+    fail_unless(sane_histograms(&c) == 0);
+    fail_unless(c.num_bins == 5);
+
+    c = (histogram_config){"foo", 0, 1000, 10, 0, NULL, 0, HISTOGRAM_LOG};
+    fail_unless(sane_histograms(&c) == 1);
+
+    c = (histogram_config){"foo", 1, 1000, 1, 0, NULL, 0, HISTOGRAM_LOG};
+    fail_unless(sane_histograms(&c) == 1);
 }
 END_TEST
 
@@ -251,59 +354,1183 @@ START_TEST(test_sane_set_eps)
 }
 END_TEST
 
+START_TEST(test_sane_graphite)
+{
+    fail_unless(sane_graphite(NULL, 0, 0) == 0);
+    fail_unless(sane_graphite("localhost", 2003, 1024) == 0);
+    fail_unless(sane_graphite("localhost", 0, 1024) == 1);
+    fail_unless(sane_graphite("localhost", 70000, 1024) == 1);
+    fail_unless(sane_graphite("localhost", 2003, -1) == 1);
+}
+END_TEST
 
+START_TEST(test_sane_influx)
+{
+    fail_unless(sane_influx(NULL, 0, NULL, 0, 0, NULL, false) == 0);
+    fail_unless(sane_influx("localhost", 8086, NULL, 5000, 4, NULL, false) == 0);
+    fail_unless(sane_influx("localhost", 8086, "stats-1.a_b", 1, 64, NULL, false) == 0);
+    fail_unless(sane_influx("localhost", 0, NULL, 5000, 4, NULL, false) == 1);
+    fail_unless(sane_influx("localhost", 8086, "", 5000, 4, NULL, false) == 1);
+    fail_unless(sane_influx("localhost", 8086, "a&b", 5000, 4, NULL, false) == 1);
+    fail_unless(sane_influx("localhost", 8086, NULL, 0, 4, NULL, false) == 1);
+    fail_unless(sane_influx("localhost", 8086, NULL, 5000, 0, NULL, false) == 1);
+    fail_unless(sane_influx("localhost", 8086, NULL, 5000, 65, NULL, false) == 1);
+    fail_unless(sane_influx("localhost", 8086, NULL, 5000, 4, "localhost", false) == 1);
+    fail_unless(sane_influx("localhost", 8086, NULL, 5000, 4, NULL, true) == 1);
+}
+END_TEST
 
-START_TEST(test_config_histograms)
+START_TEST(test_sane_worker_threads)
 {
-    int fh = open("/tmp/histogram_basic", O_CREAT|O_RDWR, 0777);
+    fail_unless(sane_worker_threads(-1) == 1);
+    fail_unless(sane_worker_threads(0) == 1);
+    fail_unless(sane_worker_threads(1) == 0);
+    fail_unless(sane_worker_threads(8) == 0);
+    fail_unless(sane_worker_threads(65) == 1);
+}
+END_TEST
+
+
+
+START_TEST(test_sane_tdigest_compression)
+{
+    fail_unless(sane_tdigest_compression(10) == 1);
+    fail_unless(sane_tdigest_compression(20) == 0);
+    fail_unless(sane_tdigest_compression(100) == 0);
+    fail_unless(sane_tdigest_compression(100000) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_set_max_exact)
+{
+    fail_unless(sane_set_max_exact(-1) == 1);
+    fail_unless(sane_set_max_exact(0) == 0);
+    fail_unless(sane_set_max_exact(2048) == 0);
+    fail_unless(sane_set_max_exact(1 << 20) == 0);
+    fail_unless(sane_set_max_exact((1 << 20) + 1) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_conn_buffers)
+{
+    fail_unless(sane_conn_buffers(1024, 0) == 1);
+    fail_unless(sane_conn_buffers(32768, 0) == 0);
+    fail_unless(sane_conn_buffers(4194304, 1024) == 0);
+    fail_unless(sane_conn_buffers(4194304, 8589934592ULL) == 0);
+}
+END_TEST
+
+START_TEST(test_config_conn_buffers)
+{
+    int fh = open("/tmp/conn_buffers", O_CREAT|O_RDWR, 0777);
     char *buf = "[statsite]\n\
-port = 10000\n\
-udp_port = 10001\n\
-flush_interval = 120\n\
-timer_eps = 0.005\n\
-stream_cmd = foo\n\
-log_level = INFO\n\
-daemonize = true\n\
-binary_stream = true\n\
-input_counter = foobar\n\
-pid_file = /tmp/statsite.pid\n\
+conn_max_buffer = 1048576\n\
+conn_buffer_budget = 8589934592\n\
+priority_buffer_budget = 67108864\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/conn_buffers", &config);
+    fail_unless(res == 0);
+    fail_unless(config.conn_max_buffer == 1048576);
+    fail_unless(config.conn_buffer_budget == 8589934592ULL);
+    fail_unless(config.priority_buffer_budget == 67108864);
+    fail_unless(validate_config(&config) == 0);
+
+    unlink("/tmp/conn_buffers");
+}
+END_TEST
+
+START_TEST(test_sane_tcp_backlog)
+{
+    fail_unless(sane_tcp_backlog(-1) == 1);
+    fail_unless(sane_tcp_backlog(0) == 1);
+    fail_unless(sane_tcp_backlog(64) == 0);
+    fail_unless(sane_tcp_backlog(1 << 20) == 0);
+}
+END_TEST
+
+START_TEST(test_config_tcp_backlog)
+{
+    int fh = open("/tmp/tcp_backlog", O_CREAT|O_RDWR, 0777);
+    char *buf = "[statsite]\n\
+tcp_backlog = 4096\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/tcp_backlog", &config);
+    fail_unless(res == 0);
+    fail_unless(config.tcp_backlog == 4096);
+    fail_unless(validate_config(&config) == 0);
+
+    unlink("/tmp/tcp_backlog");
+}
+END_TEST
+
+START_TEST(test_sane_client_rate)
+{
+    fail_unless(sane_client_rate(0, 0) == 0);
+    fail_unless(sane_client_rate(-1, 0) == 1);
+    fail_unless(sane_client_rate(1000, -1) == 1);
+    fail_unless(sane_client_rate(1000, 0) == 0);
+    fail_unless(sane_client_rate(1000, 65536) == 0);
+    fail_unless(sane_client_rate(0, 65536) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_name_map)
+{
+    fail_unless(sane_name_map(NULL, NULL, NULL, NULL) == 0);
+    fail_unless(sane_name_map("/:\\s", "_", "statsite.", NULL) == 0);
+    fail_unless(sane_name_map(NULL, NULL, NULL, ".host") == 0);
+    fail_unless(sane_name_map("/", NULL, NULL, NULL) == 1);
+    fail_unless(sane_name_map("/", "_-", NULL, NULL) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_udp_rcvbuf)
+{
+    fail_unless(sane_udp_rcvbuf(-1) == 1);
+    fail_unless(sane_udp_rcvbuf(0) == 0);
+    fail_unless(sane_udp_rcvbuf(1024) == 0);
+    fail_unless(sane_udp_rcvbuf(33554432) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_flush_threads)
+{
+    fail_unless(sane_flush_threads(0) == 1);
+    fail_unless(sane_flush_threads(-1) == 1);
+    fail_unless(sane_flush_threads(1) == 0);
+    fail_unless(sane_flush_threads(64) == 0);
+    fail_unless(sane_flush_threads(65) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_flush_queue)
+{
+    fail_unless(sane_flush_queue(1, 4, FLUSH_MERGE, NULL, NULL) == 0);
+    fail_unless(sane_flush_queue(0, 4, FLUSH_MERGE, NULL, NULL) == 1);
+    fail_unless(sane_flush_queue(65, 4, FLUSH_MERGE, NULL, NULL) == 1);
+    fail_unless(sane_flush_queue(1, 0, FLUSH_DROP, NULL, NULL) == 1);
+    fail_unless(sane_flush_queue(1, 1, FLUSH_DROP, NULL, "carbon") == 0);
+
+    // Spilling needs a directory, and does not work with Graphite
+    fail_unless(sane_flush_queue(1, 4, FLUSH_SPILL, NULL, NULL) == 1);
+    fail_unless(sane_flush_queue(1, 4, FLUSH_SPILL, "/tmp", NULL) == 0);
+    fail_unless(sane_flush_queue(1, 4, FLUSH_SPILL, "/tmp", "carbon") == 1);
+}
+END_TEST
+
+START_TEST(test_sane_flush_spool)
+{
+    fail_unless(sane_flush_spool(false, 0, NULL, NULL) == 0);
+    fail_unless(sane_flush_spool(true, 67108864, "/tmp", NULL) == 0);
+
+    // Spooling needs a directory, and does not work with Graphite
+    fail_unless(sane_flush_spool(true, 67108864, NULL, NULL) == 1);
+    fail_unless(sane_flush_spool(true, 67108864, "/tmp", "carbon") == 1);
+    fail_unless(sane_flush_spool(true, 4096, "/tmp", NULL) == 1);
+}
+END_TEST
+
+START_TEST(test_config_snapshot_file)
+{
+    int fh = open("/tmp/snapshot_file", O_CREAT|O_RDWR, 0777);
+    char *buf = "[statsite]\n\
+snapshot_file = /var/lib/statsite/snapshot\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/snapshot_file", &config);
+    fail_unless(res == 0);
+    fail_unless(strcmp(config.snapshot_file, "/var/lib/statsite/snapshot") == 0);
+    fail_unless(validate_config(&config) == 0);
+    unlink("/tmp/snapshot_file");
+}
+END_TEST
+
+START_TEST(test_config_io_uring)
+{
+    int fh = open("/tmp/io_uring", O_CREAT|O_RDWR, 0777);
+    char *buf = "[statsite]\n\
+io_uring = true\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/io_uring", &config);
+    fail_unless(res == 0);
+    fail_unless(config.io_uring == true);
+    unlink("/tmp/io_uring");
+}
+END_TEST
+
+START_TEST(test_config_unix_paths)
+{
+    int fh = open("/tmp/unix_paths", O_CREAT|O_RDWR, 0777);
+    char *buf = "[statsite]\n\
+unix_stream_path = /var/run/statsite.sock\n\
+unix_dgram_path = /var/run/statsite.dgram\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/unix_paths", &config);
+    fail_unless(res == 0);
+    fail_unless(strcmp(config.unix_stream_path, "/var/run/statsite.sock") == 0);
+    fail_unless(strcmp(config.unix_dgram_path, "/var/run/statsite.dgram") == 0);
+    unlink("/tmp/unix_paths");
+}
+END_TEST
+
+START_TEST(test_config_shm_ring)
+{
+    int fh = open("/tmp/shm_ring", O_CREAT|O_RDWR, 0777);
+    char *buf = "[statsite]\n\
+shm_ring_path = /dev/shm/statsite\n\
+shm_ring_size = 1048576\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/shm_ring", &config);
+    fail_unless(res == 0);
+    fail_unless(strcmp(config.shm_ring_path, "/dev/shm/statsite") == 0);
+    fail_unless(config.shm_ring_size == 1048576);
+    fail_unless(validate_config(&config) == 0);
+    unlink("/tmp/shm_ring");
+}
+END_TEST
+
+START_TEST(test_sane_shm_ring_size)
+{
+    fail_unless(sane_shm_ring_size(65536) == 0);
+    fail_unless(sane_shm_ring_size(4096) == 1);
+    fail_unless(sane_shm_ring_size(100000) == 1);
+}
+END_TEST
+
+START_TEST(test_config_sketch_stream)
+{
+    int fh = open("/tmp/sketch_stream", O_CREAT|O_RDWR, 0777);
+    char *buf = "[statsite]\n\
+sketch_stream = true\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/sketch_stream", &config);
+    fail_unless(res == 0);
+    fail_unless(config.sketch_stream == true);
+    unlink("/tmp/sketch_stream");
+}
+END_TEST
+
+START_TEST(test_config_proxy)
+{
+    int fh = open("/tmp/proxy", O_CREAT|O_RDWR, 0777);
+    char *buf = "[statsite]\n\
+proxy_upstreams = agg1:8125, agg2:8125,[::1]:9000\n\
+proxy_vnodes = 64\n\
+proxy_udp = true\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/proxy", &config);
+    fail_unless(res == 0);
+    fail_unless(strcmp(config.proxy_upstreams, "agg1:8125, agg2:8125,[::1]:9000") == 0);
+    fail_unless(config.proxy_vnodes == 64);
+    fail_unless(config.proxy_udp == true);
+    fail_unless(validate_config(&config) == 0);
+    unlink("/tmp/proxy");
+}
+END_TEST
+
+START_TEST(test_sane_proxy)
+{
+    fail_unless(sane_proxy(NULL, 0) == 0);
+    fail_unless(sane_proxy("agg1:8125", 128) == 0);
+    fail_unless(sane_proxy("agg1:8125", 0) == 1);
+    fail_unless(sane_proxy("agg1", 128) == 1);
+    fail_unless(sane_proxy("agg1:8125,agg2:99999", 128) == 1);
+    fail_unless(sane_proxy(":8125", 128) == 1);
+    fail_unless(sane_proxy(" , ", 128) == 1);
+}
+END_TEST
+
+START_TEST(test_config_flush_queue)
+{
+    int fh = open("/tmp/flush_queue", O_CREAT|O_RDWR, 0777);
+    char *buf = "[statsite]\n\
+flush_workers = 2\n\
+flush_queue = 8\n\
+flush_queue_policy = spill\n\
+flush_spill_dir = /var/spool/statsite\n\
+flush_spool = true\n\
+flush_spool_segment = 1048576\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/flush_queue", &config);
+    fail_unless(res == 0);
+    fail_unless(config.flush_workers == 2);
+    fail_unless(config.flush_queue == 8);
+    fail_unless(config.flush_queue_policy == FLUSH_SPILL);
+    fail_unless(strcmp(config.flush_spill_dir, "/var/spool/statsite") == 0);
+    fail_unless(config.flush_spool == true);
+    fail_unless(config.flush_spool_segment == 1048576);
+    fail_unless(validate_config(&config) == 0);
+    unlink("/tmp/flush_queue");
+
+    // Unknown policies are rejected
+    fh = open("/tmp/flush_queue_bad", O_CREAT|O_RDWR, 0777);
+    buf = "[statsite]\n\
+flush_queue_policy = block\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+    res = config_from_filename("/tmp/flush_queue_bad", &config);
+    fail_unless(res != 0);
+    unlink("/tmp/flush_queue_bad");
+}
+END_TEST
+
+START_TEST(test_sane_quantiles)
+{
+    double ok[] = {0.5, 0.9, 0.999};
+    double dup[] = {0.5, 0.5};
+    double low[] = {0, 0.5};
+    double high[] = {0.5, 1};
+    fail_unless(sane_quantiles(ok, 3) == 0);
+    fail_unless(sane_quantiles(ok, 0) == 1);
+    fail_unless(sane_quantiles(dup, 2) == 1);
+    fail_unless(sane_quantiles(low, 2) == 1);
+    fail_unless(sane_quantiles(high, 2) == 1);
+}
+END_TEST
+
+START_TEST(test_config_quantiles)
+{
+    int fh = open("/tmp/quantiles", O_CREAT|O_RDWR, 0777);
+    char *buf = "[statsite]\n\
+quantiles = 0.99, 0.5\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/quantiles", &config);
+    fail_unless(res == 0);
+    fail_unless(config.num_quantiles == 2);
+    fail_unless(config.quantiles[0] == 0.5);
+    fail_unless(config.quantiles[1] == 0.99);
+    fail_unless(validate_config(&config) == 0);
+    unlink("/tmp/quantiles");
+
+    // Values that are not numbers are rejected
+    fh = open("/tmp/quantiles_bad", O_CREAT|O_RDWR, 0777);
+    buf = "[statsite]\n\
+quantiles = 0.5, p99\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+    res = config_from_filename("/tmp/quantiles_bad", &config);
+    fail_unless(res != 0);
+    unlink("/tmp/quantiles_bad");
+}
+END_TEST
+
+START_TEST(test_config_udp_rcvbuf)
+{
+    int fh = open("/tmp/udp_rcvbuf", O_CREAT|O_RDWR, 0777);
+    char *buf = "[statsite]\n\
+udp_rcvbuf = 33554432\n\
+udp_drop_counter = udp.drops\n\
+udp_gro = false\n\
+xdp_interface = eth0\n\
+xdp_queues = 4\n\
+worker_cpus = 0-3\n\
+flush_cpus = 4,5\n\
+stream_cpus = 6\n\
+huge_pages = transparent\n\
+ingest_pipeline = true\n\
+output_compression = lz4\n\
+sorted_output = true\n\
+binary_stream_front_coded = true\n\
+columnar_stream = true\n\
+stream_timeout_ms = 5000\n\
+gauge_changes_only = true\n\
+gauge_refresh_intervals = 30\n\
+admin_socket_path = /tmp/statsite.admin\n\
+memory_budget = 4294967296\n\
+parse_tags = true\n\
+simd = AVX2\n\
+set_windows = 86400, 3600\n\
+set_window_slots = 24\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/udp_rcvbuf", &config);
+    fail_unless(res == 0);
+    fail_unless(config.udp_rcvbuf == 33554432);
+    fail_unless(strcmp(config.udp_drop_counter, "udp.drops") == 0);
+    fail_unless(config.udp_gro == false);
+    fail_unless(strcmp(config.xdp_interface, "eth0") == 0);
+    fail_unless(config.xdp_queues == 4);
+    fail_unless(strcmp(config.worker_cpus, "0-3") == 0);
+    fail_unless(strcmp(config.flush_cpus, "4,5") == 0);
+    fail_unless(strcmp(config.stream_cpus, "6") == 0);
+    fail_unless(config.huge_pages == HUGE_PAGES_TRANSPARENT);
+    fail_unless(config.simd == SIMD_AVX2);
+    fail_unless(config.num_set_windows == 2);
+    fail_unless(config.set_windows[0] == 3600 && config.set_windows[1] == 86400);
+    fail_unless(config.set_window_slots == 24);
+    fail_unless(config.ingest_pipeline == true);
+    fail_unless(config.output_compression == COMPRESS_LZ4);
+    fail_unless(config.sorted_output == true);
+    fail_unless(config.binary_stream_front_coded == true);
+    fail_unless(config.columnar_stream == true);
+    fail_unless(config.stream_timeout_ms == 5000);
+    fail_unless(validate_config(&config) == 0);
+    fail_unless(sane_stream_timeout(-1) == 1);
+    fail_unless(config.gauge_changes_only == true);
+    fail_unless(config.gauge_refresh_intervals == 30);
+    fail_unless(strcmp(config.admin_socket_path, "/tmp/statsite.admin") == 0);
+    fail_unless(config.memory_budget == 4294967296ULL);
+    fail_unless(config.parse_tags == true);
+    fail_unless(sane_gauge_refresh_intervals(true, 0) == 1);
+    fail_unless(sane_gauge_refresh_intervals(false, 0) == 0);
+    fail_unless(sane_stream_async_buffers(0) == 0);
+    fail_unless(sane_stream_async_buffers(1) == 1);
+    fail_unless(sane_stream_async_buffers(4) == 0);
+    fail_unless(sane_stream_async_buffers(65) == 1);
+    fail_unless(sane_shared_counter_keys(0) == 0);
+    fail_unless(sane_shared_counter_keys(-1) == 1);
+    fail_unless(sane_shared_counter_keys(1000000) == 0);
+    fail_unless(sane_busy_poll_us(0) == 0);
+    fail_unless(sane_busy_poll_us(50) == 0);
+    fail_unless(sane_busy_poll_us(-1) == 1);
+    fail_unless(sane_busy_poll_us(1000001) == 1);
+    fail_unless(sane_sink_parallelism(1) == 0);
+    fail_unless(sane_sink_parallelism(8) == 0);
+    fail_unless(sane_sink_parallelism(0) == 1);
+    fail_unless(sane_sink_parallelism(65) == 1);
+    fail_unless(sane_timer_admission_threshold(0) == 0);
+    fail_unless(sane_timer_admission_threshold(10000) == 0);
+    fail_unless(sane_timer_admission_threshold(-1) == 1);
+    fail_unless(sane_timer_admission_threshold(TIMER_EXACT_MAX - 1) == 1);
+    int windows[] = {3600, 86400};
+    fail_unless(sane_set_windows(NULL, 0, 0, 10) == 0);
+    fail_unless(sane_set_windows(windows, 2, 12, 10) == 0);
+    fail_unless(sane_set_windows(windows, 2, 0, 10) == 1);
+    fail_unless(sane_set_windows(windows, 2, 65, 10) == 1);
+    fail_unless(sane_set_windows(windows, 2, 7, 10) == 1);
+    fail_unless(sane_set_windows(windows, 2, 12, 7) == 1);
+    fail_unless(sane_set_windows(windows, 1, 1, 3600) == 1);
+    fail_unless(sane_json_stream(true, false, false, false) == 0);
+    fail_unless(sane_json_stream(true, true, false, false) == 1);
+    fail_unless(sane_json_stream(true, false, false, true) == 1);
+    fail_unless(sane_xdp_queues(0) == 1);
+    fail_unless(sane_xdp_queues(257) == 1);
+    fail_unless(sane_cpu_list("worker_cpus", "0-3,x") == 1);
+    fail_unless(sane_cpu_list("worker_cpus", NULL) == 0);
+
+    unlink("/tmp/udp_rcvbuf");
+}
+END_TEST
+
+START_TEST(test_config_timer_engines)
+{
+    int fh = open("/tmp/timer_engines", O_CREAT|O_RDWR, 0777);
+    char *buf = "[statsite]\n\
+timer_engine = tdigest\n\
+tdigest_compression = 200\n\
 \n\
-[histogram_n1]\n\
+[timer_heat]\n\
+prefix=heat.\n\
+engine=stats\n\
+\n\
+[timer_slo]\n\
+prefix=slo.\n\
+engine=hdr\n\
+\n\
+[timer_api]\n\
 prefix=api.\n\
-min=0\n\
-max=100\n\
-width=10\n\
+engine=cm\n\
 \n\
-[histogram_n2]\n\
-prefix=site.\n\
-min=0\n\
-max=200\n\
-width=10\n\
+[timer_db]\n\
+prefix=db.\n\
+engine=tdigest\n\
+compression=50\n\
 \n\
-[histogram_n3]\n\
-prefix=\n\
-min=-500\n\
-max=500\n\
-width=25\n\
+[timer_web]\n\
+quantiles = 0.99 0.5\n\
+prefix=web.\n\
 \n\
+[timer_search]\n\
+prefix=search.\n\
+quantiles = 0.999\n\
+eps = 0.001\n\
 ";
     write(fh, buf, strlen(buf));
     fchmod(fh, 777);
     close(fh);
 
     statsite_config config;
-    int res = config_from_filename("/tmp/histogram_basic", &config);
+    int res = config_from_filename("/tmp/timer_engines", &config);
     fail_unless(res == 0);
+    fail_unless(config.timer_engine == TIMER_ENGINE_TDIGEST);
+    fail_unless(config.tdigest_compression == 200);
 
-    // Should get the config
-    fail_unless(config.tcp_port == 10000);
-    fail_unless(config.udp_port == 10001);
-    fail_unless(strcmp(config.log_level, "INFO") == 0);
-    fail_unless(config.timer_eps == 0.005);
-    fail_unless(strcmp(config.stream_cmd, "foo") == 0);
-    fail_unless(config.flush_interval == 120);
-    fail_unless(config.daemonize == true);
-    fail_unless(config.binary_stream == true);
+    // Sections only need a prefix, the settings may come in any order
+    timer_config *c = config.timer_configs;
+    fail_unless(strcmp(c->prefix, "search.") == 0);
+    fail_unless(c->has_engine == false);
+    fail_unless(c->num_quantiles == 1 && c->quantiles[0] == 0.999);
+    fail_unless(c->eps == 0.001 && c->compression == 0);
+
+    c = c->next;
+    fail_unless(strcmp(c->prefix, "web.") == 0);
+    fail_unless(c->has_engine == false);
+    fail_unless(c->num_quantiles == 2);
+    fail_unless(c->quantiles[0] == 0.5 && c->quantiles[1] == 0.99);
+
+    c = c->next;
+    fail_unless(c != NULL);
+    fail_unless(strcmp(c->prefix, "db.") == 0);
+    fail_unless(c->has_engine == true);
+    fail_unless(c->quantiles == NULL);
+    fail_unless(c->engine == TIMER_ENGINE_TDIGEST);
+    fail_unless(c->eps == 0 && c->compression == 50);
+
+    c = c->next;
+    fail_unless(strcmp(c->prefix, "api.") == 0);
+    fail_unless(c->engine == TIMER_ENGINE_CM);
+
+    c = c->next;
+    fail_unless(strcmp(c->prefix, "slo.") == 0);
+    fail_unless(c->engine == TIMER_ENGINE_HDR);
+
+    c = c->next;
+    fail_unless(strcmp(c->prefix, "heat.") == 0);
+    fail_unless(c->engine == TIMER_ENGINE_STATS);
+    fail_unless(c->next == NULL);
+    fail_unless(sane_timer_configs(config.timer_configs) == 0);
+
+    // Build the prefix tree
+    fail_unless(build_prefix_tree(&config) == 0);
+    fail_unless(config.histograms == NULL);
+    fail_unless(config.timer_engines != NULL);
+
+    timer_config *conf = NULL;
+    fail_unless(radix_longest_prefix(config.timer_engines, "api.foo", (void**)&conf) == 0);
+    fail_unless(conf->engine == TIMER_ENGINE_CM);
+
+    // The accuracy is checked as the global one
+    c = config.timer_configs;
+    c->eps = 2;
+    fail_unless(sane_timer_configs(config.timer_configs) == 1);
+    unlink("/tmp/timer_engines");
+}
+END_TEST
+
+START_TEST(test_config_counter_modes)
+{
+    int fh = open("/tmp/counter_modes", O_CREAT|O_RDWR, 0777);
+    char *buf = "[statsite]\n\
+counter_sum_only = true\n\
+\n\
+[counter_api]\n\
+prefix=api.\n\
+\n\
+[counter_db]\n\
+sum_only = false\n\
+prefix=db.\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/counter_modes", &config);
+    fail_unless(res == 0);
+    fail_unless(config.counter_sum_only == true);
+
+    // Sections only need a prefix, and default to sum only
+    counter_config *c = config.counter_configs;
+    fail_unless(strcmp(c->prefix, "db.") == 0);
+    fail_unless(c->sum_only == false);
+
+    c = c->next;
+    fail_unless(strcmp(c->prefix, "api.") == 0);
+    fail_unless(c->sum_only == true);
+    fail_unless(c->next == NULL);
+
+    // Build the prefix tree
+    fail_unless(build_prefix_tree(&config) == 0);
+    fail_unless(config.counter_modes != NULL);
+
+    counter_config *conf = NULL;
+    fail_unless(radix_longest_prefix(config.counter_modes, "db.foo", (void**)&conf) == 0);
+    fail_unless(conf->sum_only == false);
+
+    unlink("/tmp/counter_modes");
+}
+END_TEST
+
+START_TEST(test_config_kv_modes)
+{
+    int fh = open("/tmp/kv_modes", O_CREAT|O_RDWR, 0777);
+    char *buf = "[statsite]\n\
+\n\
+[kv_api]\n\
+prefix=api.\n\
+\n\
+[kv_db]\n\
+prefix=db.\n\
+coalesce = mean\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/kv_modes", &config);
+    fail_unless(res == 0);
+
+    // Sections only need a prefix, and default to the last value
+    kv_config *c = config.kv_configs;
+    fail_unless(strcmp(c->prefix, "db.") == 0);
+    fail_unless(c->mode == KV_MEAN);
+
+    c = c->next;
+    fail_unless(strcmp(c->prefix, "api.") == 0);
+    fail_unless(c->mode == KV_LAST);
+    fail_unless(c->next == NULL);
+
+    // Build the prefix tree
+    fail_unless(build_prefix_tree(&config) == 0);
+    fail_unless(config.kv_modes != NULL);
+
+    kv_config *conf = NULL;
+    fail_unless(radix_longest_prefix(config.kv_modes, "db.foo", (void**)&conf) == 0);
+    fail_unless(conf->mode == KV_MEAN);
+
+    unlink("/tmp/kv_modes");
+}
+END_TEST
+
+START_TEST(test_config_limits)
+{
+    int fh = open("/tmp/limits", O_CREAT|O_RDWR, 0777);
+    char *buf = "[limit_api]\n\
+prefix=api.\n\
+max_keys=1000\n\
+\n\
+[limit_db]\n\
+max_keys=50\n\
+prefix=db.\n\
+\n\
+[limit_partial]\n\
+prefix=partial.\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/limits", &config);
+    fail_unless(res == 0);
+
+    // Sections need both a prefix and the max keys
+    limit_config *l = config.limit_configs;
+    fail_unless(strcmp(l->prefix, "db.") == 0);
+    fail_unless(l->max_keys == 50);
+    l = l->next;
+    fail_unless(strcmp(l->prefix, "api.") == 0);
+    fail_unless(l->max_keys == 1000);
+    fail_unless(l->next == NULL);
+    fail_unless(sane_limits(config.limit_configs) == 0);
+
+    // Build the prefix tree, which numbers the limits
+    fail_unless(build_prefix_tree(&config) == 0);
+    fail_unless(config.num_limits == 2);
+    limit_config *conf = NULL;
+    fail_unless(radix_longest_prefix(config.limits, "db.foo", (void**)&conf) == 0);
+    fail_unless(conf->index == 0 && conf->max_keys == 50);
+    fail_unless(strcmp(conf->overflow_key, "db.__overflow__") == 0);
+
+    // Limits need room for a key
+    conf->max_keys = 0;
+    fail_unless(sane_limits(config.limit_configs) == 1);
+    unlink("/tmp/limits");
+}
+END_TEST
+
+START_TEST(test_config_set_precisions)
+{
+    int fh = open("/tmp/set_precisions", O_CREAT|O_RDWR, 0777);
+    char *buf = "[set_users]\n\
+prefix=users.\n\
+eps=0.005\n\
+\n\
+[set_ips]\n\
+eps=0.05\n\
+prefix=ips.\n\
+\n\
+[set_partial]\n\
+prefix=partial.\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/set_precisions", &config);
+    fail_unless(res == 0);
+
+    // Sections need both a prefix and the eps
+    set_config *s = config.set_configs;
+    fail_unless(strcmp(s->prefix, "ips.") == 0);
+    fail_unless(s->eps == 0.05);
+    s = s->next;
+    fail_unless(strcmp(s->prefix, "users.") == 0);
+    fail_unless(s->eps == 0.005);
+    fail_unless(s->next == NULL);
+
+    // The eps is turned into a precision
+    fail_unless(sane_set_configs(config.set_configs) == 0);
+    fail_unless(config.set_configs->precision == 9);
+    fail_unless(s->precision == 16);
+
+    fail_unless(build_prefix_tree(&config) == 0);
+    set_config *conf = NULL;
+    fail_unless(radix_longest_prefix(config.set_precisions, "users.daily", (void**)&conf) == 0);
+    fail_unless(conf == s);
+
+    s->eps = 1.5;
+    fail_unless(sane_set_configs(config.set_configs) == 1);
+    unlink("/tmp/set_precisions");
+}
+END_TEST
+
+START_TEST(test_config_for_reload)
+{
+    int fh = open("/tmp/reload", O_CREAT|O_RDWR|O_TRUNC, 0777);
+    char *buf = "[statsite]\n\
+port = 9000\n\
+flush_interval = 20\n\
+timer_eps = 0.005\n\
+quantiles = 0.5\n\
+stream_cmd = cat\n\
+\n\
+[histogram_api]\n\
+prefix=api.\n\
+min=0\n\
+max=100\n\
+width=10\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config running, loaded;
+    fail_unless(config_from_filename(NULL, &running) == 0);
+    fail_unless(config_from_filename("/tmp/reload", &loaded) == 0);
+    fail_unless(validate_config(&loaded) == 0);
+    fail_unless(build_prefix_tree(&loaded) == 0);
+
+    // The settings of the metrics change, the sockets do not
+    statsite_config *config = config_for_reload(&running, &loaded);
+    fail_unless(config != NULL);
+    fail_unless(config->tcp_port == 8125);
+    fail_unless(config->flush_interval == 20);
+    fail_unless(config->timer_eps == 0.005);
+    fail_unless(config->num_quantiles == 1 && config->quantiles[0] == 0.5);
+    fail_unless(strcmp(config->stream_cmd, "cat") == 0);
+    fail_unless(config->histograms == loaded.histograms && config->histograms != NULL);
+    free(config);
+
+    // The flush interval must still suit the rollups
+    rollup_config r = {60, "cat", NULL, 3};
+    running.rollup_configs = &r;
+    loaded.flush_interval = 7;
+    fail_unless(config_for_reload(&running, &loaded) == NULL);
+    unlink("/tmp/reload");
+}
+END_TEST
+
+START_TEST(test_config_rollups)
+{
+    int fh = open("/tmp/rollups", O_CREAT|O_RDWR, 0777);
+    char *buf = "[statsite]\n\
+flush_interval = 10\n\
+\n\
+[rollup_minute]\n\
+interval = 60\n\
+stream_cmd = cat > /tmp/minute\n\
+\n\
+[rollup_hour]\n\
+stream_cmd = cat > /tmp/hour\n\
+interval = 3600\n\
+\n\
+[rollup_partial]\n\
+interval = 120\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/rollups", &config);
+    fail_unless(res == 0);
+
+    // Sections need both an interval and a command
+    rollup_config *r = config.rollup_configs;
+    fail_unless(r->interval == 3600);
+    fail_unless(strcmp(r->stream_cmd, "cat > /tmp/hour") == 0);
+    r = r->next;
+    fail_unless(r->interval == 60);
+    fail_unless(strcmp(r->stream_cmd, "cat > /tmp/minute") == 0);
+    fail_unless(r->next == NULL);
+    fail_unless(validate_config(&config) == 0);
+
+    // The interval must be a larger multiple of the flush interval
+    r->interval = 65;
+    fail_unless(sane_rollups(config.rollup_configs, 10) == 1);
+    r->interval = 10;
+    fail_unless(sane_rollups(config.rollup_configs, 10) == 1);
+    r->interval = 60;
+    fail_unless(sane_rollups(config.rollup_configs, 10) == 0);
+    unlink("/tmp/rollups");
+}
+END_TEST
+
+START_TEST(test_config_sinks)
+{
+    int fh = open("/tmp/sinks", O_CREAT|O_RDWR, 0777);
+    char *buf = "[statsite]\n\
+stream_cmd = cat > /tmp/primary\n\
+\n\
+[sink_archive]\n\
+stream_cmd = cat > /tmp/archive\n\
+\n\
+[sink_alerts]\n\
+stream_cmd = cat > /tmp/alerts\n\
+timeout_ms = 500\n\
+\n\
+[sink_partial]\n\
+timeout_ms = 100\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/sinks", &config);
+    fail_unless(res == 0);
+
+    // Sections need a command, and the timeout is optional
+    sink_config *s = config.sink_configs;
+    fail_unless(strcmp(s->name, "alerts") == 0);
+    fail_unless(strcmp(s->stream_cmd, "cat > /tmp/alerts") == 0);
+    fail_unless(s->timeout_ms == 500);
+    s = s->next;
+    fail_unless(strcmp(s->name, "archive") == 0);
+    fail_unless(strcmp(s->stream_cmd, "cat > /tmp/archive") == 0);
+    fail_unless(s->timeout_ms == 0);
+    fail_unless(s->next == NULL);
+    fail_unless(validate_config(&config) == 0);
+
+    // Sinks replace the persistent sink and graphite
+    fail_unless(sane_sinks(config.sink_configs, true, NULL) == 1);
+    fail_unless(sane_sinks(config.sink_configs, false, "localhost") == 1);
+    fail_unless(sane_sinks(NULL, true, "localhost") == 0);
+    s->timeout_ms = -1;
+    fail_unless(sane_sinks(config.sink_configs, false, NULL) == 1);
+    unlink("/tmp/sinks");
+}
+END_TEST
+
+START_TEST(test_config_listeners)
+{
+    int fh = open("/tmp/listeners", O_CREAT|O_RDWR, 0777);
+    char *buf = "[statsite]\n\
+worker_threads = 4\n\
+udp_rcvbuf = 65536\n\
+\n\
+[listener_eth1]\n\
+protocol = udp\n\
+bind_address = 10.0.0.2\n\
+port = 8125\n\
+udp_rcvbuf = 1048576\n\
+\n\
+[listener_queue3]\n\
+port = 8126\n\
+protocol = UDP\n\
+worker = 3\n\
+\n\
+[listener_admin]\n\
+protocol = tcp\n\
+port = 9125\n\
+priority = true\n\
+\n\
+[listener_partial]\n\
+bind_address = 10.0.0.3\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/listeners", &config);
+    fail_unless(res == 0);
+
+    // Sections need a protocol and port, the rest is optional
+    listener_config *l = config.listener_configs;
+    fail_unless(strcmp(l->name, "admin") == 0);
+    fail_unless(l->protocol == LISTEN_TCP);
+    fail_unless(l->port == 9125);
+    fail_unless(l->bind_address == NULL);
+    fail_unless(l->udp_rcvbuf == 0);
+    fail_unless(l->worker == -1);
+    fail_unless(l->priority);
+    l = l->next;
+    fail_unless(strcmp(l->name, "queue3") == 0);
+    fail_unless(!l->priority);
+    fail_unless(l->protocol == LISTEN_UDP);
+    fail_unless(l->port == 8126);
+    fail_unless(l->worker == 3);
+    l = l->next;
+    fail_unless(strcmp(l->name, "eth1") == 0);
+    fail_unless(l->protocol == LISTEN_UDP);
+    fail_unless(strcmp(l->bind_address, "10.0.0.2") == 0);
+    fail_unless(l->port == 8125);
+    fail_unless(l->udp_rcvbuf == 1048576);
+    fail_unless(l->worker == -1);
+    fail_unless(l->next == NULL);
+    fail_unless(validate_config(&config) == 0);
+
+    // Listeners may only be pinned to one of the workers
+    fail_unless(sane_listeners(config.listener_configs, 3) == 1);
+    l->worker = -2;
+    fail_unless(sane_listeners(config.listener_configs, 4) == 1);
+    l->worker = -1;
+    l->port = 0;
+    fail_unless(sane_listeners(config.listener_configs, 4) == 1);
+    l->port = 8125;
+    l->udp_rcvbuf = -1;
+    fail_unless(sane_listeners(config.listener_configs, 4) == 1);
+    unlink("/tmp/listeners");
+}
+END_TEST
+
+START_TEST(test_config_listener_protocol)
+{
+    int fh = open("/tmp/listener_protocol", O_CREAT|O_RDWR, 0777);
+    char *buf = "[listener_bad]\n\
+protocol = sctp\n\
+port = 8125\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    fail_unless(config_from_filename("/tmp/listener_protocol", &config) != 0);
+    unlink("/tmp/listener_protocol");
+}
+END_TEST
+
+START_TEST(test_config_filters)
+{
+    int fh = open("/tmp/filters", O_CREAT|O_RDWR, 0777);
+    char *buf = "[statsite]\n\
+drop_prefixes = debug., tmp.,api.trace.\n\
+allow_prefixes = debug.keep.\n\
+drop_unmatched = true\n\
+udp_drop_filter = true\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/filters", &config);
+    fail_unless(res == 0);
+    fail_unless(strcmp(config.drop_prefixes, "debug., tmp.,api.trace.") == 0);
+    fail_unless(strcmp(config.allow_prefixes, "debug.keep.") == 0);
+    fail_unless(config.drop_unmatched == true);
+    fail_unless(config.udp_drop_filter == true);
+
+    // The longest matching prefix decides
+    fail_unless(build_prefix_tree(&config) == 0);
+    void *action = NULL;
+    fail_unless(radix_longest_prefix(config.filters, "tmp.foo", &action) == 0);
+    fail_unless((uintptr_t)action == FILTER_DROP);
+    fail_unless(radix_longest_prefix(config.filters, "api.trace.foo", &action) == 0);
+    fail_unless((uintptr_t)action == FILTER_DROP);
+    fail_unless(radix_longest_prefix(config.filters, "debug.keep.foo", &action) == 0);
+    fail_unless((uintptr_t)action == FILTER_ALLOW);
+    fail_unless(radix_longest_prefix(config.filters, "api.foo", &action) != 0);
+    unlink("/tmp/filters");
+}
+END_TEST
+
+START_TEST(test_config_filters_allow_wins)
+{
+    int fh = open("/tmp/filters_allow", O_CREAT|O_RDWR, 0777);
+    char *buf = "[statsite]\n\
+drop_prefixes = api.\n\
+allow_prefixes = api.\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/filters_allow", &config);
+    fail_unless(res == 0);
+
+    // An allowed prefix wins over the same dropped prefix
+    fail_unless(build_prefix_tree(&config) == 0);
+    void *action = NULL;
+    fail_unless(radix_longest_prefix(config.filters, "api.foo", &action) == 0);
+    fail_unless((uintptr_t)action == FILTER_ALLOW);
+    unlink("/tmp/filters_allow");
+}
+END_TEST
+
+START_TEST(test_config_top_keys)
+{
+    int fh = open("/tmp/top_keys", O_CREAT|O_RDWR, 0777);
+    char *buf = "[statsite]\n\
+internal_stats = true\n\
+top_keys = 20\n\
+intern_idle_intervals = 6\n\
+max_line_length = 65536\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/top_keys", &config);
+    fail_unless(res == 0);
+    fail_unless(config.top_keys == 20);
+    fail_unless(config.intern_idle_intervals == 6);
+    fail_unless(config.max_line_length == 65536);
+    fail_unless(validate_config(&config) == 0);
+    fail_unless(sane_intern_idle_intervals(-1) == 1);
+    fail_unless(sane_max_line_length(-1, 32768) == 1);
+    fail_unless(sane_max_line_length(65536, 32768) == 0);
+
+    fail_unless(sane_top_keys(0, false) == 0);
+    fail_unless(sane_top_keys(20, false) == 0);
+    fail_unless(sane_top_keys(-1, true) == 1);
+    fail_unless(sane_top_keys(1001, true) == 1);
+    unlink("/tmp/top_keys");
+}
+END_TEST
+
+START_TEST(test_config_bad_timer_engine)
+{
+    int fh = open("/tmp/timer_engine_bad", O_CREAT|O_RDWR, 0777);
+    char *buf = "[statsite]\n\
+timer_engine = magic\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/timer_engine_bad", &config);
+    fail_unless(res != 0);
+    unlink("/tmp/timer_engine_bad");
+}
+END_TEST
+
+START_TEST(test_config_histograms)
+{
+    int fh = open("/tmp/histogram_basic", O_CREAT|O_RDWR, 0777);
+    char *buf = "[statsite]\n\
+port = 10000\n\
+udp_port = 10001\n\
+flush_interval = 120\n\
+timer_eps = 0.005\n\
+stream_cmd = foo\n\
+log_level = INFO\n\
+daemonize = true\n\
+binary_stream = true\n\
+input_counter = foobar\n\
+pid_file = /tmp/statsite.pid\n\
+\n\
+[histogram_n1]\n\
+prefix=api.\n\
+min=0\n\
+max=100\n\
+width=10\n\
+\n\
+[histogram_n2]\n\
+prefix=site.\n\
+min=0\n\
+max=200\n\
+width=10\n\
+\n\
+[histogram_n3]\n\
+prefix=\n\
+min=-500\n\
+max=500\n\
+width=25\n\
+\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/histogram_basic", &config);
+    fail_unless(res == 0);
+
+    // Should get the config
+    fail_unless(config.tcp_port == 10000);
+    fail_unless(config.udp_port == 10001);
+    fail_unless(strcmp(config.log_level, "INFO") == 0);
+    fail_unless(config.timer_eps == 0.005);
+    fail_unless(strcmp(config.stream_cmd, "foo") == 0);
+    fail_unless(config.flush_interval == 120);
+    fail_unless(config.daemonize == true);
+    fail_unless(config.binary_stream == true);
     fail_unless(strcmp(config.pid_file, "/tmp/statsite.pid") == 0);
     fail_unless(strcmp(config.input_counter, "foobar") == 0);
 
@@ -330,6 +1557,104 @@ width=25\n\
 }
 END_TEST
 
+START_TEST(test_config_histograms_scale)
+{
+    int fh = open("/tmp/histogram_scale", O_CREAT|O_RDWR, 0777);
+    char *buf = "[statsite]\n\
+port = 10000\n\
+\n\
+[histogram_n1]\n\
+prefix=api.\n\
+min=1\n\
+max=1000\n\
+width=10\n\
+scale=log\n\
+\n\
+[histogram_n2]\n\
+scale=linear\n\
+prefix=site.\n\
+min=0\n\
+max=200\n\
+width=10\n\
+\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/histogram_scale", &config);
+    fail_unless(res == 0);
+
+    histogram_config *c = config.hist_configs;
+    fail_unless(strcmp(c->prefix, "site.") == 0);
+    fail_unless(c->scale == HISTOGRAM_LINEAR);
+
+    c = c->next;
+    fail_unless(strcmp(c->prefix, "api.") == 0);
+    fail_unless(c->scale == HISTOGRAM_LOG);
+    fail_unless(c->next == NULL);
+
+    unlink("/tmp/histogram_scale");
+}
+END_TEST
+
+START_TEST(test_config_histograms_auto)
+{
+    int fh = open("/tmp/histogram_auto", O_CREAT|O_RDWR, 0777);
+    char *buf = "[statsite]\n\
+port = 10000\n\
+\n\
+[histogram_lat]\n\
+prefix=lat.\n\
+scale=auto\n\
+\n\
+[histogram_db]\n\
+scale=auto\n\
+prefix=db.\n\
+eps=0.05\n\
+max_bins=64\n\
+min=0.01\n\
+skip_empty=true\n\
+\n\
+";
+    write(fh, buf, strlen(buf));
+    fchmod(fh, 777);
+    close(fh);
+
+    statsite_config config;
+    int res = config_from_filename("/tmp/histogram_auto", &config);
+    fail_unless(res == 0);
+    fail_unless(sane_histograms(config.hist_configs) == 0);
+
+    histogram_config *c = config.hist_configs;
+    fail_unless(strcmp(c->prefix, "db.") == 0);
+    fail_unless(c->scale == HISTOGRAM_AUTO);
+    fail_unless(c->eps == 0.05);
+    fail_unless(c->max_bins == 64);
+    fail_unless(c->min_val == 0.01);
+    fail_unless(c->skip_empty);
+
+    // Only the prefix is needed
+    c = c->next;
+    fail_unless(strcmp(c->prefix, "lat.") == 0);
+    fail_unless(c->scale == HISTOGRAM_AUTO);
+    fail_unless(c->eps == HISTOGRAM_AUTO_EPS);
+    fail_unless(c->max_bins == HISTOGRAM_AUTO_MAX_BINS);
+    fail_unless(c->min_val == HISTOGRAM_AUTO_MIN);
+    fail_unless(!c->skip_empty);
+    fail_unless(c->next == NULL);
+
+    c->eps = 0.5;
+    fail_unless(sane_histograms(config.hist_configs) == 1);
+    c->eps = 0.01;
+    c->max_bins = 1;
+    fail_unless(sane_histograms(config.hist_configs) == 1);
+
+    unlink("/tmp/histogram_auto");
+}
+END_TEST
+
 START_TEST(test_build_radix)
 {
     statsite_config config;
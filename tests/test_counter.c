@@ -53,3 +53,56 @@ START_TEST(test_counter_add_loop)
 }
 END_TEST
 
+START_TEST(test_counter_merge)
+{
+    counter c1, c2, empty;
+    fail_unless(init_counter(&c1) == 0);
+    fail_unless(init_counter(&c2) == 0);
+    fail_unless(init_counter(&empty) == 0);
+
+    for (int i=1; i<=50; i++)
+        fail_unless(counter_add_sample(&c1, i) == 0);
+    for (int i=51; i<=100; i++)
+        fail_unless(counter_add_sample(&c2, i) == 0);
+
+    fail_unless(counter_merge(&c1, &c2) == 0);
+    fail_unless(counter_merge(&c1, &empty) == 0);
+
+    fail_unless(counter_count(&c1) == 100);
+    fail_unless(counter_sum(&c1) == 5050);
+    fail_unless(counter_squared_sum(&c1) == 338350);
+    fail_unless(counter_min(&c1) == 1);
+    fail_unless(counter_max(&c1) == 100);
+
+    // Merging into an empty counter copies
+    fail_unless(counter_merge(&empty, &c2) == 0);
+    fail_unless(counter_count(&empty) == 50);
+    fail_unless(counter_min(&empty) == 51);
+    fail_unless(counter_max(&empty) == 100);
+}
+END_TEST
+
+
+START_TEST(test_counter_add_samples)
+{
+    counter c1, c2;
+    fail_unless(init_counter(&c1) == 0);
+    fail_unless(init_counter(&c2) == 0);
+
+    // Should match adding each sample
+    fail_unless(counter_add_samples(&c1, 3, 0) == 0);
+    fail_unless(counter_count(&c1) == 0);
+    fail_unless(counter_add_samples(&c1, 3, 40) == 0);
+    fail_unless(counter_add_samples(&c1, 1, 10) == 0);
+    for (int i=0; i < 40; i++)
+        fail_unless(counter_add_sample(&c2, 3) == 0);
+    for (int i=0; i < 10; i++)
+        fail_unless(counter_add_sample(&c2, 1) == 0);
+
+    fail_unless(counter_count(&c1) == counter_count(&c2));
+    fail_unless(counter_sum(&c1) == counter_sum(&c2));
+    fail_unless(counter_squared_sum(&c1) == counter_squared_sum(&c2));
+    fail_unless(counter_min(&c1) == 1);
+    fail_unless(counter_max(&c1) == 3);
+}
+END_TEST
@@ -0,0 +1,169 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "format.h"
+#include "json.h"
+
+/**
+ * Checks the fast formatter against snprintf
+ */
+static int format_matches(double val, int precision) {
+    char fast[FORMAT_DOUBLE_MAX], slow[FORMAT_DOUBLE_MAX];
+    int len = format_double(fast, val, precision);
+    snprintf(slow, sizeof(slow), "%.*f", precision, val);
+    return len == strlen(slow) && strcmp(fast, slow) == 0;
+}
+
+START_TEST(test_format_double_special)
+{
+    double vals[] = {0.0, -0.0, 1.0, -1.0, 0.5, 1.5, 2.5, -2.5, 0.125, 0.0078125,
+        1e-7, 5e-7, 0.0000005, 1.0000005, 99.9999995, 0.9999999, 123456789.123456789,
+        9007199254740991.0, 9007199254740992.0, 1e20, -1e300, 0.1, 0.2, 0.3,
+        INFINITY, -INFINITY, NAN};
+    int num = sizeof(vals) / sizeof(double);
+    for (int i=0; i < num; i++) {
+        for (int p=0; p <= 9; p++) {
+            fail_unless(format_matches(vals[i], p));
+        }
+    }
+}
+END_TEST
+
+START_TEST(test_format_double_random)
+{
+    srandom(42);
+    for (int i=0; i < 200000; i++) {
+        // Random magnitudes, including exact ties
+        double val = (double)random() / (1 << (random() % 40));
+        if (i % 3 == 0) val = (random() % 100000) / 8.0;
+        if (i % 5 == 0) val = -val;
+        fail_unless(format_matches(val, 6));
+        fail_unless(format_matches(val, i % 10));
+    }
+}
+END_TEST
+
+START_TEST(test_format_int)
+{
+    long long vals[] = {0, 1, -1, 9, 10, 12345, -98765, 9223372036854775807LL, -9223372036854775807LL - 1};
+    int num = sizeof(vals) / sizeof(long long);
+    char fast[FORMAT_INT_MAX], slow[FORMAT_INT_MAX];
+    for (int i=0; i < num; i++) {
+        int len = format_int(fast, vals[i]);
+        snprintf(slow, sizeof(slow), "%lld", vals[i]);
+        fail_unless(len == strlen(slow));
+        fail_unless(strcmp(fast, slow) == 0);
+    }
+}
+END_TEST
+
+START_TEST(test_format_quantile_name)
+{
+    char buf[FORMAT_QUANTILE_MAX];
+    fail_unless(format_quantile_name(buf, 0.5) == 6);
+    fail_unless(strcmp(buf, "median") == 0);
+    fail_unless(format_quantile_name(buf, 0.9) == 8);
+    fail_unless(strcmp(buf, "upper_90") == 0);
+    format_quantile_name(buf, 0.99);
+    fail_unless(strcmp(buf, "upper_99") == 0);
+    format_quantile_name(buf, 0.999);
+    fail_unless(strcmp(buf, "upper_99.9") == 0);
+    format_quantile_name(buf, 0.05);
+    fail_unless(strcmp(buf, "upper_5") == 0);
+}
+END_TEST
+
+/**
+ * Checks the fast parser against strtod
+ */
+static int parse_matches(char *str) {
+    char *fast_end, *slow_end;
+    double fast = parse_double(str, str + strlen(str) + 1, &fast_end);
+    double slow = strtod(str, &slow_end);
+    return fast_end == slow_end && memcmp(&fast, &slow, sizeof(double)) == 0;
+}
+
+START_TEST(test_parse_double_special)
+{
+    char *vals[] = {"0", "-0", "1", "-1", "0.5", "1.5", "-2.5", "100", "42.000000",
+        "0.1", "0.2", "0.3", "123456789.123456789", "9007199254740993", "1e10", "1E-5",
+        "2.5e+3", "1e22", "1e23", "-1e-22", "1e-400", "1e400", "0.000000000000000000001",
+        "12345678901234567890", "1234567890123456789012345", "0.12345678901234567890123",
+        "00000000000000000000001", "1.00000000000000000000001", "179769313486231570000e288",
+        "5e-324", "2.2250738585072014e-308", "1e", "1e+", "3.14|ms", "17:", ".5", "-.25", "5."};
+    int num = sizeof(vals) / sizeof(char*);
+    for (int i=0; i < num; i++) {
+        fail_unless(parse_matches(vals[i]));
+    }
+}
+END_TEST
+
+START_TEST(test_parse_double_invalid)
+{
+    char *vals[] = {"", "-", "abc", ".", "-.", "e5", "|c"};
+    int num = sizeof(vals) / sizeof(char*);
+    char *end;
+    for (int i=0; i < num; i++) {
+        fail_unless(parse_double(vals[i], NULL, &end) == 0);
+        fail_unless(end == vals[i]);
+    }
+}
+END_TEST
+
+START_TEST(test_parse_double_random)
+{
+    char buf[64];
+    srandom(42);
+    for (int i=0; i < 200000; i++) {
+        // Integers, fixed point values and scientific notation
+        double val = (double)random() / (1 << (random() % 40));
+        if (i % 5 == 0) val = -val;
+        switch (i % 4) {
+            case 0: snprintf(buf, sizeof(buf), "%ld", random()); break;
+            case 1: snprintf(buf, sizeof(buf), "%.*f", (int)(random() % 12), val); break;
+            case 2: snprintf(buf, sizeof(buf), "%.17g", val * pow(10, random() % 60 - 30)); break;
+            case 3: snprintf(buf, sizeof(buf), "%.*e", (int)(random() % 25), val); break;
+        }
+        fail_unless(parse_matches(buf));
+    }
+}
+END_TEST
+
+START_TEST(test_json_writer)
+{
+    char *buf;
+    size_t len;
+    FILE *f = open_memstream(&buf, &len);
+    json_writer w;
+    json_init(f, &w);
+    json_open(&w, NULL, 0);
+    json_open(&w, "a\"b\\c\n", 6);
+    json_string(&w, "type", 4, "timer");
+    json_int(&w, "count", 5, -3);
+    json_double(&w, "nan", 3, NAN);
+    json_open(&w, "h", 1);
+    json_double(&w, "<1.00", 5, 0.5);
+    fail_unless(json_end_line(&w) == 0);
+
+    // Longer than the buffer
+    json_init(f, &w);
+    json_open(&w, NULL, 0);
+    char key[10000];
+    memset(key, 'k', sizeof(key));
+    json_int(&w, key, sizeof(key), 1);
+    json_int(&w, "x", 1, 2);
+    fail_unless(json_end_line(&w) == 0);
+    fclose(f);
+
+    char *expected = "{\"a\\\"b\\\\c\\u000a\":{\"type\":\"timer\",\"count\":-3,"
+        "\"nan\":null,\"h\":{\"<1.00\":0.500000}}}\n";
+    fail_unless(!strncmp(buf, expected, strlen(expected)));
+    char *second = buf + strlen(expected);
+    fail_unless(len == strlen(expected) + sizeof(key) + 13);
+    fail_unless(!strncmp(second, "{\"kkk", 5));
+    fail_unless(!strcmp(buf + len - 11, "\":1,\"x\":2}\n"));
+    free(buf);
+}
+END_TEST
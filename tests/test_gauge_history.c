@@ -0,0 +1,85 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gauge_history.h"
+#include "metrics.h"
+
+// Adds a gauge sample for each of a set of gauges
+static void add_gauges(metrics *m, int num, double val) {
+    char name[32];
+    for (int i=0; i < num; i++) {
+        snprintf(name, sizeof(name), "gauge.%d", i);
+        fail_unless(metrics_add_sample(m, GAUGE, name, val) == 0);
+    }
+}
+
+START_TEST(test_gauge_history_init_destroy)
+{
+    gauge_history h;
+    fail_unless(gauge_history_init(0, &h) != 0);
+    fail_unless(gauge_history_init(10, &h) == 0);
+    fail_unless(gauge_history_size(&h) == 0);
+    fail_unless(gauge_history_destroy(&h) == 0);
+}
+END_TEST
+
+START_TEST(test_gauge_history_changes)
+{
+    gauge_history h;
+    fail_unless(gauge_history_init(100, &h) == 0);
+    metrics m;
+    fail_unless(init_metrics_defaults(&m) == 0);
+
+    // The first interval streams everything
+    add_gauges(&m, 1000, 1);
+    fail_unless(gauge_history_filter(&h, &m) == 0);
+    fail_unless(gauge_map_size(&m.gauges) == 1000);
+    fail_unless(gauge_history_size(&h) == 1000);
+
+    // The unchanged gauges are removed
+    fail_unless(metrics_clear(&m) == 0);
+    add_gauges(&m, 1000, 1);
+    fail_unless(metrics_add_sample(&m, GAUGE, "gauge.7", 2) == 0);
+    fail_unless(metrics_add_sample(&m, GAUGE, "gauge.new", 1) == 0);
+    fail_unless(gauge_history_filter(&h, &m) == 999);
+    fail_unless(gauge_map_size(&m.gauges) == 2);
+    fail_unless(gauge_map_get(&m.gauges, "gauge.7")->value == 2);
+    fail_unless(gauge_map_get(&m.gauges, "gauge.new") != NULL);
+    fail_unless(gauge_map_get(&m.gauges, "gauge.8") == NULL);
+
+    // The new value is the one compared to
+    fail_unless(metrics_clear(&m) == 0);
+    fail_unless(metrics_add_sample(&m, GAUGE, "gauge.7", 2) == 0);
+    fail_unless(gauge_history_filter(&h, &m) == 1);
+    fail_unless(gauge_map_size(&m.gauges) == 0);
+
+    fail_unless(destroy_metrics(&m) == 0);
+    fail_unless(gauge_history_destroy(&h) == 0);
+}
+END_TEST
+
+START_TEST(test_gauge_history_refresh)
+{
+    gauge_history h;
+    fail_unless(gauge_history_init(3, &h) == 0);
+    metrics m;
+    fail_unless(init_metrics_defaults(&m) == 0);
+
+    // Every third interval streams all the gauges
+    int removed[] = {0, 100, 100, 0, 100, 100, 0};
+    for (int i=0; i < 7; i++) {
+        fail_unless(metrics_clear(&m) == 0);
+        add_gauges(&m, 100, 5);
+        if (i < 2) fail_unless(metrics_add_sample(&m, GAUGE, "gauge.idle", 5) == 0);
+        fail_unless(gauge_history_filter(&h, &m) == removed[i] + (i == 1));
+        if (i == 3) fail_unless(gauge_history_size(&h) == 101);
+    }
+
+    // A refresh releases the gauges not seen since the one before
+    fail_unless(gauge_history_size(&h) == 100);
+
+    fail_unless(destroy_metrics(&m) == 0);
+    fail_unless(gauge_history_destroy(&h) == 0);
+}
+END_TEST
@@ -0,0 +1,126 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "graphite.h"
+
+/**
+ * Opens a listening socket on an ephemeral local port
+ */
+static int graphite_test_listen(int *port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(*port);
+    int optval = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    fail_unless(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    fail_unless(listen(fd, 4) == 0);
+
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr*)&addr, &len);
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+/**
+ * Accepts a connection and reads until the
+ * expected number of lines is received.
+ */
+static int graphite_test_read(int listen_fd, char *buf, int buf_len, int lines) {
+    int fd = accept(listen_fd, NULL, NULL);
+    fail_unless(fd >= 0);
+    int len = 0, seen = 0, res;
+    while (seen < lines && len < buf_len - 1) {
+        res = read(fd, buf + len, buf_len - 1 - len);
+        if (res <= 0) break;
+        for (int i=len; i < len + res; i++) {
+            if (buf[i] == '\n') seen++;
+        }
+        len += res;
+    }
+    buf[len] = '\0';
+    close(fd);
+    return seen;
+}
+
+START_TEST(test_graphite_flush)
+{
+    int port = 0;
+    int listen_fd = graphite_test_listen(&port);
+
+    metrics m;
+    fail_unless(init_metrics_defaults(&m) == 0);
+    fail_unless(metrics_add_sample(&m, KEY_VAL, "test", 100) == 0);
+    fail_unless(metrics_add_sample(&m, COUNTER, "foo", 4) == 0);
+    fail_unless(metrics_add_sample(&m, TIMER, "baz", 1) == 0);
+
+    graphite_output g;
+    fail_unless(init_graphite_output("127.0.0.1", port, "pre.", 1024, &g) == 0);
+
+    struct timeval tv = {1000, 0};
+    fail_unless(graphite_flush(&g, &m, &tv) == 0);
+
+    // 1 k/v, 1 counter, 11 timer lines
+    char buf[4096];
+    fail_unless(graphite_test_read(listen_fd, buf, sizeof(buf), 13) == 13);
+    fail_unless(strstr(buf, "pre.test 100.000000 1000\n") != NULL);
+    fail_unless(strstr(buf, "pre.foo 4.000000 1000\n") != NULL);
+    fail_unless(strstr(buf, "pre.timers.baz.count 1 1000\n") != NULL);
+
+    fail_unless(destroy_graphite_output(&g) == 0);
+    fail_unless(destroy_metrics(&m) == 0);
+    close(listen_fd);
+}
+END_TEST
+
+START_TEST(test_graphite_retry_buffer)
+{
+    // Reserve a port, but do not listen yet
+    int port = 0;
+    int listen_fd = graphite_test_listen(&port);
+    close(listen_fd);
+
+    metrics m;
+    fail_unless(init_metrics_defaults(&m) == 0);
+    fail_unless(metrics_add_sample(&m, KEY_VAL, "test", 1) == 0);
+
+    graphite_output g;
+    fail_unless(init_graphite_output("127.0.0.1", port, "", 1024, &g) == 0);
+
+    // Should be retained
+    struct timeval tv = {1000, 0};
+    fail_unless(graphite_flush(&g, &m, &tv) == -1);
+    fail_unless(g.buf_len == strlen("test 1.000000 1000\n"));
+
+    // Should be bounded, with whole lines
+    for (int i=0; i < 200; i++) {
+        fail_unless(graphite_flush(&g, &m, &tv) == -1);
+    }
+    fail_unless(g.buf_len <= 1024);
+    fail_unless(g.buf_len % strlen("test 1.000000 1000\n") == 0);
+    int retained = g.buf_len / strlen("test 1.000000 1000\n");
+
+    // Now sent with the next flush
+    listen_fd = graphite_test_listen(&port);
+    tv.tv_sec = 2000;
+    fail_unless(graphite_flush(&g, &m, &tv) == 0);
+    fail_unless(g.buf_len == 0);
+
+    char buf[4096];
+    fail_unless(graphite_test_read(listen_fd, buf, sizeof(buf), retained + 1) == retained + 1);
+    fail_unless(strncmp(buf, "test 1.000000 1000\n", 19) == 0);
+    fail_unless(strstr(buf, "test 1.000000 2000\n") != NULL);
+
+    fail_unless(destroy_graphite_output(&g) == 0);
+    fail_unless(destroy_metrics(&m) == 0);
+    close(listen_fd);
+}
+END_TEST
+
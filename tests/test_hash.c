@@ -0,0 +1,43 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "hash.h"
+
+START_TEST(test_hash_deterministic)
+{
+    char *key = "servers.host1.requests";
+    fail_unless(hash_key(key, strlen(key)) == hash_key(key, strlen(key)));
+
+    // Every prefix length hashes differently
+    for (size_t i=1; i < strlen(key); i++) {
+        fail_unless(hash_key(key, i) != hash_key(key, i + 1));
+    }
+
+    // Only the given bytes are hashed
+    char buf[32];
+    strcpy(buf, key);
+    buf[strlen(key)] = 'x';
+    fail_unless(hash_key(buf, strlen(key)) == hash_key(key, strlen(key)));
+}
+END_TEST
+
+START_TEST(test_hash_distribution)
+{
+    // Similar keys should spread over both the low and high bits,
+    // since hashmaps use the former and HLLs the latter
+    int low[16] = {0}, high[16] = {0};
+    char buf[64];
+    for (int i=0; i < 16000; i++) {
+        int len = snprintf(buf, sizeof(buf), "servers.host%d.cpu", i);
+        uint64_t h = hash_key(buf, len);
+        low[h & 15]++;
+        high[h >> 60]++;
+    }
+    for (int i=0; i < 16; i++) {
+        fail_unless(low[i] > 800 && low[i] < 1200);
+        fail_unless(high[i] > 800 && high[i] < 1200);
+    }
+}
+END_TEST
@@ -6,7 +6,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <stdint.h>
 #include "hashmap.h"
+#include "hash.h"
 
 START_TEST(test_map_init_and_destroy)
 {
@@ -205,6 +207,34 @@ int iter_test(void *data, const char *key, void *value) {
     return 0;
 }
 
+START_TEST(test_map_put_clear_reuse)
+{
+    hashmap *map;
+    int res = hashmap_init(0, &map);
+    fail_unless(res == 0);
+
+    // Fill the chains, clear, and fill them again, the
+    // table slots must not keep links to freed entries
+    char buf[100];
+    void *out;
+    for (int round=0; round < 3; round++) {
+        for (int i=0; i<2000;i++) {
+            snprintf((char*)&buf, 100, "test%d.%d", round, i);
+            fail_unless(hashmap_put(map, (char*)buf, NULL) == 1);
+        }
+        fail_unless(hashmap_size(map) == 2000);
+        for (int i=0; i<2000;i++) {
+            snprintf((char*)&buf, 100, "test%d.%d", round, i);
+            fail_unless(hashmap_get(map, (char*)buf, &out) == 0);
+        }
+        fail_unless(hashmap_clear(map) == 0);
+    }
+
+    res = hashmap_destroy(map);
+    fail_unless(res == 0);
+}
+END_TEST
+
 START_TEST(test_map_iter_no_keys)
 {
     hashmap *map;
@@ -294,3 +324,257 @@ START_TEST(test_map_put_grow)
 }
 END_TEST
 
+START_TEST(test_map_grow_mixed)
+{
+    hashmap *map;
+    fail_unless(hashmap_init(32, &map) == 0);
+
+    // The earlier keys are found while the table grows
+    char buf[100];
+    void *out;
+    for (uintptr_t i=0; i < 5000; i++) {
+        snprintf(buf, 100, "test%d", (int)i);
+        fail_unless(hashmap_put(map, buf, (void*)i) == 1);
+        snprintf(buf, 100, "test%d", (int)i / 2);
+        fail_unless(hashmap_get(map, buf, &out) == 0);
+        fail_unless(out == (void*)(i / 2));
+    }
+
+    // Delete and update some keys part way through a resize
+    for (uintptr_t i=0; i < 5000; i++) {
+        snprintf(buf, 100, "test%d", (int)i);
+        if (i % 3 == 0)
+            fail_unless(hashmap_delete(map, buf) == 0);
+        else if (i % 3 == 1)
+            fail_unless(hashmap_put(map, buf, (void*)(i + 1)) == 0);
+    }
+    for (uintptr_t i=0; i < 5000; i++) {
+        snprintf(buf, 100, "test%d", (int)i);
+        if (i % 3 == 0) {
+            fail_unless(hashmap_get(map, buf, &out) == -1);
+        } else {
+            fail_unless(hashmap_get(map, buf, &out) == 0);
+            fail_unless(out == (void*)((i % 3 == 1) ? i + 1 : i));
+        }
+    }
+    int val = 0;
+    fail_unless(hashmap_iter(map, iter_test, (void*)&val) == 0);
+    fail_unless(val == 3333);
+    fail_unless(hashmap_size(map) == 3333);
+
+    // Cleared, and re-used
+    fail_unless(hashmap_clear(map) == 0);
+    fail_unless(hashmap_size(map) == 0);
+    fail_unless(hashmap_get(map, "test1", &out) == -1);
+    fail_unless(hashmap_put(map, "test1", NULL) == 1);
+    fail_unless(hashmap_destroy(map) == 0);
+}
+END_TEST
+
+int iter_value_test(void *data, const char *key, void *value) {
+    // Check the value matches the key, and sum them
+    uintptr_t *sum = data;
+    fail_unless(atoi(key + 4) == (int)(uintptr_t)value);
+    *sum += (uintptr_t)value;
+    return 0;
+}
+
+START_TEST(test_map_delete_iter)
+{
+    hashmap *map;
+    fail_unless(hashmap_init(32, &map) == 0);
+
+    char buf[100];
+    for (uintptr_t i=0; i < 1000; i++) {
+        snprintf(buf, 100, "test%d", (int)i);
+        fail_unless(hashmap_put(map, buf, (void*)i) == 1);
+    }
+
+    // Deleting moves the other entries, which are still found
+    uintptr_t sum = 0;
+    for (uintptr_t i=0; i < 1000; i += 2) {
+        snprintf(buf, 100, "test%d", (int)i);
+        fail_unless(hashmap_delete(map, buf) == 0);
+        fail_unless(hashmap_delete(map, buf) == -1);
+    }
+    fail_unless(hashmap_iter(map, iter_value_test, &sum) == 0);
+    fail_unless(sum == 250000);
+    fail_unless(hashmap_size(map) == 500);
+
+    void *out;
+    for (uintptr_t i=0; i < 1000; i++) {
+        snprintf(buf, 100, "test%d", (int)i);
+        fail_unless(hashmap_get(map, buf, &out) == ((i % 2) ? 0 : -1));
+        if (i % 2) fail_unless(out == (void*)i);
+    }
+
+    // Deleted down to empty, and filled again
+    for (uintptr_t i=1; i < 1000; i += 2) {
+        snprintf(buf, 100, "test%d", (int)i);
+        fail_unless(hashmap_delete(map, buf) == 0);
+    }
+    fail_unless(hashmap_size(map) == 0);
+    for (uintptr_t i=0; i < 100; i++) {
+        snprintf(buf, 100, "test%d", (int)i);
+        fail_unless(hashmap_put(map, buf, (void*)i) == 1);
+    }
+    sum = 0;
+    fail_unless(hashmap_iter(map, iter_value_test, &sum) == 0);
+    fail_unless(sum == 4950);
+    fail_unless(hashmap_destroy(map) == 0);
+}
+END_TEST
+
+int iter_hash_test(void *data, const char *key, uint64_t hash, void *value) {
+    // The hash is the one of the key
+    fail_unless(hash == hash_key(key, strlen(key)));
+    *(int*)data += 1;
+    return 0;
+}
+
+START_TEST(test_map_iter_hash)
+{
+    hashmap *map;
+    fail_unless(hashmap_init(32, &map) == 0);
+
+    char buf[100];
+    for (int i=0; i < 1000; i++) {
+        snprintf(buf, 100, "test%d", i);
+        fail_unless(hashmap_put(map, buf, NULL) == 1);
+    }
+
+    int val = 0;
+    fail_unless(hashmap_iter_hash(map, iter_hash_test, &val) == 0);
+    fail_unless(val == 1000);
+    fail_unless(hashmap_destroy(map) == 0);
+}
+END_TEST
+
+START_TEST(test_map_get_or_insert)
+{
+    hashmap *map;
+    int res = hashmap_init(32, &map);  // Only 32 slots, forces growth
+    fail_unless(res == 0);
+
+    char buf[100];
+    void **slot;
+    for (int i=0; i<1000;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        fail_unless(hashmap_get_or_insert(map, (char*)buf, &slot) == 1);
+        fail_unless(*slot == NULL);
+        *slot = (void*)(uintptr_t)(i + 1);
+    }
+    fail_unless(hashmap_size(map) == 1000);
+
+    void *out;
+    for (int i=0; i<1000;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        fail_unless(hashmap_get_or_insert(map, (char*)buf, &slot) == 0);
+        fail_unless(*slot == (void*)(uintptr_t)(i + 1));
+        fail_unless(hashmap_get(map, (char*)buf, &out) == 0);
+        fail_unless(out == *slot);
+    }
+    fail_unless(hashmap_size(map) == 1000);
+
+    res = hashmap_destroy(map);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_map_precomputed_hash)
+{
+    hashmap *map;
+    int res = hashmap_init(32, &map);
+    fail_unless(res == 0);
+
+    char buf[100];
+    void **slot;
+    for (int i=0; i<1000;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        uint64_t hash = hash_key(buf, strlen(buf));
+        fail_unless(hashmap_get_or_insert_hash(map, (char*)buf, hash, &slot) == 1);
+        *slot = (void*)(uintptr_t)(i + 1);
+    }
+
+    // Both ways of hashing find the same keys
+    void *out;
+    for (int i=0; i<1000;i++) {
+        snprintf((char*)&buf, 100, "test%d", i);
+        uint64_t hash = hash_key(buf, strlen(buf));
+        fail_unless(hashmap_get_hash(map, (char*)buf, hash, &out) == 0);
+        fail_unless(out == (void*)(uintptr_t)(i + 1));
+        fail_unless(hashmap_get_or_insert(map, (char*)buf, &slot) == 0);
+        fail_unless(*slot == out);
+    }
+    fail_unless(hashmap_get_hash(map, "missing", hash_key("missing", 7), &out) == -1);
+    fail_unless(hashmap_size(map) == 1000);
+
+    res = hashmap_destroy(map);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_map_arena_keys)
+{
+    arena a;
+    fail_unless(arena_init(0, &a) == 0);
+
+    hashmap *map;
+    int res = hashmap_init_arena(32, &a, &map);
+    fail_unless(res == 0);
+
+    char buf[100];
+    void *out;
+    for (int i=0; i<1000;i++) {
+        snprintf((char*)&buf, 100, "a.long.enough.key.to.not.be.inlined.%d", i);
+        fail_unless(hashmap_put(map, (char*)buf, NULL) == 1);
+    }
+    fail_unless(hashmap_size(map) == 1000);
+    fail_unless(a.allocated > 0);
+
+    for (int i=0; i<1000;i++) {
+        snprintf((char*)&buf, 100, "a.long.enough.key.to.not.be.inlined.%d", i);
+        fail_unless(hashmap_get(map, (char*)buf, &out) == 0);
+        if (i % 2) fail_unless(hashmap_delete(map, (char*)buf) == 0);
+    }
+    fail_unless(hashmap_size(map) == 500);
+
+    fail_unless(hashmap_clear(map) == 0);
+    res = hashmap_destroy(map);
+    fail_unless(res == 0);
+    fail_unless(arena_destroy(&a) == 0);
+}
+END_TEST
+
+
+START_TEST(test_map_fit)
+{
+    hashmap *map;
+    fail_unless(hashmap_init(0, &map) == 0);
+
+    char buf[100];
+    for (int i=0; i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(hashmap_put(map, (char*)buf, NULL) == 1);
+    }
+
+    // Only an empty map is fit
+    fail_unless(hashmap_fit(map, 10) == -1);
+    fail_unless(hashmap_clear(map) == 0);
+    fail_unless(hashmap_fit(map, 10) == 0);
+    fail_unless(hashmap_size(map) == 0);
+
+    // The shrunk map still grows
+    void *out;
+    for (int i=0; i<1000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(hashmap_put(map, (char*)buf, NULL) == 1);
+    }
+    fail_unless(hashmap_size(map) == 1000);
+    for (int i=0; i<1000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(hashmap_get(map, (char*)buf, &out) == 0);
+    }
+    fail_unless(hashmap_destroy(map) == 0);
+}
+END_TEST
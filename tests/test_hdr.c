@@ -0,0 +1,135 @@
+#include <check.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include "hdr.h"
+
+START_TEST(test_hdr_init_and_destroy)
+{
+    hdr_histogram h;
+    fail_unless(init_hdr(0.01, &h) == 0);
+    fail_unless(h.total == 0);
+    fail_unless(hdr_query(&h, 0.5) == 0);
+    fail_unless(destroy_hdr(&h) == 0);
+}
+END_TEST
+
+START_TEST(test_hdr_init_bad_eps)
+{
+    hdr_histogram h;
+    fail_unless(init_hdr(0, &h) == -1);
+    fail_unless(init_hdr(-0.1, &h) == -1);
+    fail_unless(init_hdr(0.5, &h) == -1);
+    fail_unless(init_hdr(NAN, &h) == -1);
+}
+END_TEST
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(double*)a, y = *(double*)b;
+    return (x > y) - (x < y);
+}
+
+START_TEST(test_hdr_relative_error)
+{
+    hdr_histogram h;
+    fail_unless(init_hdr(0.01, &h) == 0);
+
+    // Log-uniform values over the whole range
+    int num = 20000;
+    double *vals = malloc(num * sizeof(double));
+    srandom(42);
+    for (int i=0; i < num; i++) {
+        vals[i] = HDR_LOWEST * pow(HDR_HIGHEST / HDR_LOWEST, (double)random() / RAND_MAX);
+        fail_unless(hdr_add(&h, vals[i]) == 0);
+    }
+    qsort(vals, num, sizeof(double), cmp_double);
+    fail_unless(h.total == (uint64_t)num);
+    fail_unless(h.min == vals[0]);
+    fail_unless(h.max == vals[num-1]);
+
+    // Each quantile is the nearest rank to the relative error
+    double quants[] = {0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99, 0.999};
+    for (int i=0; i < 8; i++) {
+        double exact = vals[(int)ceil(quants[i] * num) - 1];
+        double val = hdr_query(&h, quants[i]);
+        fail_unless(fabs(val - exact) <= 0.01 * exact);
+    }
+    fail_unless(hdr_query(&h, 0) == vals[0]);
+    fail_unless(hdr_query(&h, 1) == vals[num-1]);
+    free(vals);
+    fail_unless(destroy_hdr(&h) == 0);
+}
+END_TEST
+
+START_TEST(test_hdr_query_many)
+{
+    hdr_histogram h;
+    fail_unless(init_hdr(0.001, &h) == 0);
+    for (int i=1; i <= 1000; i++)
+        fail_unless(hdr_add(&h, i) == 0);
+
+    double quants[] = {0.5, 0.9, 0.99};
+    double values[3];
+    hdr_query_many(&h, quants, 3, values);
+    for (int i=0; i < 3; i++) {
+        fail_unless(values[i] == hdr_query(&h, quants[i]));
+        fail_unless(fabs(values[i] - quants[i] * 1000) <= 0.001 * quants[i] * 1000);
+    }
+    fail_unless(destroy_hdr(&h) == 0);
+}
+END_TEST
+
+START_TEST(test_hdr_merge)
+{
+    hdr_histogram h1, h2, h3;
+    fail_unless(init_hdr(0.01, &h1) == 0);
+    fail_unless(init_hdr(0.01, &h2) == 0);
+    fail_unless(init_hdr(0.1, &h3) == 0);
+
+    // Merging an empty histogram is a no-op
+    fail_unless(hdr_merge(&h1, &h2) == 0);
+    fail_unless(h1.total == 0);
+
+    for (int i=1; i <= 1000; i++) {
+        fail_unless(hdr_add((i % 2) ? &h1 : &h2, i) == 0);
+        fail_unless(hdr_add(&h3, i + 1000) == 0);
+    }
+    fail_unless(hdr_merge(&h1, &h2) == 0);
+    fail_unless(h1.total == 1000);
+    fail_unless(h1.min == 1);
+    fail_unless(h1.max == 1000);
+    fail_unless(fabs(hdr_query(&h1, 0.5) - 500) <= 5);
+
+    // A coarser histogram is re-added at the finer accuracy
+    fail_unless(hdr_merge(&h1, &h3) == 0);
+    fail_unless(h1.total == 2000);
+    fail_unless(h1.min == 1);
+    fail_unless(h1.max == 2000);
+    fail_unless(fabs(hdr_query(&h1, 0.75) - 1500) <= 0.1 * 1500);
+
+    fail_unless(destroy_hdr(&h1) == 0);
+    fail_unless(destroy_hdr(&h2) == 0);
+    fail_unless(destroy_hdr(&h3) == 0);
+}
+END_TEST
+
+START_TEST(test_hdr_out_of_range)
+{
+    hdr_histogram h;
+    fail_unless(init_hdr(0.01, &h) == 0);
+    fail_unless(hdr_add(&h, -5) == 0);
+    fail_unless(hdr_add(&h, 0) == 0);
+    fail_unless(hdr_add(&h, 1e9) == 0);
+    fail_unless(h.total == 3);
+
+    // The extremes are counted at the ends but kept exactly
+    fail_unless(h.min == -5);
+    fail_unless(h.max == 1e9);
+    fail_unless(hdr_query(&h, 0) == -5);
+    fail_unless(hdr_query(&h, 1) == 1e9);
+    fail_unless(hdr_query(&h, 0.5) < 1);
+    fail_unless(destroy_hdr(&h) == 0);
+}
+END_TEST
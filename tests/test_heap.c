@@ -136,3 +136,40 @@ START_TEST(test_heap_del_empty)
 }
 END_TEST
 
+
+START_TEST(test_heap_grow_shrink)
+{
+    heap h;
+    heap_create(&h, 0, NULL);
+
+    // Small heaps use the inline table
+    fail_unless(h.table == h.inline_table);
+
+    int keys[1000];
+    for (int i=0; i < 1000; i++) {
+        keys[i] = 1000 - i;
+        heap_insert(&h, keys + i, NULL);
+    }
+    fail_unless(heap_size(&h) == 1000);
+    fail_unless(h.table != h.inline_table);
+    fail_unless(h.allocated_entries >= 1000);
+
+    // Drain in order, the table shrinks back to inline
+    int *val;
+    for (int i=1; i <= 1000; i++) {
+        fail_unless(heap_delmin(&h, (void**)&val, NULL) == 1);
+        fail_unless(*val == i);
+    }
+    fail_unless(h.table == h.inline_table);
+    fail_unless(h.allocated_entries == HEAP_INLINE_ENTRIES);
+    heap_destroy(&h);
+
+    // A large initial size is kept as the minimum
+    heap_create(&h, 100, NULL);
+    fail_unless(h.allocated_entries == 100);
+    heap_insert(&h, keys, NULL);
+    fail_unless(heap_delmin(&h, NULL, NULL) == 1);
+    fail_unless(h.allocated_entries == 100);
+    heap_destroy(&h);
+}
+END_TEST
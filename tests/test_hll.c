@@ -121,3 +121,183 @@ START_TEST(test_hll_precision_for_error)
 END_TEST
 
 
+START_TEST(test_hll_merge)
+{
+    hll_t h1, h2, h3;
+    fail_unless(hll_init(14, &h1) == 0);
+    fail_unless(hll_init(14, &h2) == 0);
+    fail_unless(hll_init(12, &h3) == 0);
+
+    // Overlapping halves
+    char buf[100];
+    for (int i=0; i < 10000; i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        if (i < 6000) hll_add(&h1, (char*)&buf);
+        if (i >= 4000) hll_add(&h2, (char*)&buf);
+    }
+
+    fail_unless(hll_merge(&h1, &h2) == 0);
+    double s = hll_size(&h1);
+    fail_unless(s > 9900 && s < 10100);
+
+    // Mismatched precision is merged at the lower one
+    fail_unless(hll_merge(&h3, &h1) == 0);
+    fail_unless(h3.precision == 12);
+    s = hll_size(&h3);
+    fail_unless(s > 9600 && s < 10400);
+    fail_unless(hll_merge(&h1, &h3) == 0);
+    fail_unless(h1.precision == 12);
+
+    fail_unless(hll_destroy(&h1) == 0);
+    fail_unless(hll_destroy(&h2) == 0);
+    fail_unless(hll_destroy(&h3) == 0);
+}
+END_TEST
+
+
+START_TEST(test_hll_sparse)
+{
+    hll_t h;
+    fail_unless(hll_init(14, &h) == 0);
+
+    // Small cardinalities stay sparse
+    char buf[100];
+    for (int i=0; i < 500; i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        hll_add(&h, (char*)&buf);
+    }
+    fail_unless(h.registers == NULL);
+    // The keys share about 8 of the registers
+    fail_unless(h.sparse_len > 480 && h.sparse_len <= 500);
+    double sparse_est = hll_size(&h);
+    fail_unless(sparse_est > 490 && sparse_est < 510);
+
+    // The sparse list is kept sorted
+    for (uint32_t i=1; i < h.sparse_len; i++) {
+        fail_unless(h.sparse[i-1] < h.sparse[i]);
+    }
+
+    // Re-adding the same keys changes nothing
+    for (int i=0; i < 500; i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        hll_add(&h, (char*)&buf);
+    }
+    fail_unless(hll_size(&h) == sparse_est);
+
+    // Converts to dense past the dense size
+    for (int i=500; i < 10000; i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        hll_add(&h, (char*)&buf);
+    }
+    fail_unless(h.registers != NULL);
+    fail_unless(h.sparse == NULL);
+    double s = hll_size(&h);
+    fail_unless(s > 9900 && s < 10100);
+
+    fail_unless(hll_destroy(&h) == 0);
+}
+END_TEST
+
+START_TEST(test_hll_fold)
+{
+    // Folding matches adding the hashes at the lower precision
+    int counts[] = {50, 20000};
+    char buf[100];
+    for (int c=0; c < 2; c++) {
+        hll_t high, low;
+        fail_unless(hll_init(14, &high) == 0);
+        fail_unless(hll_init(10, &low) == 0);
+        for (int i=0; i < counts[c]; i++) {
+            fail_unless(sprintf((char*)&buf, "test%d", i));
+            hll_add(&high, (char*)&buf);
+            hll_add(&low, (char*)&buf);
+        }
+        fail_unless(hll_fold(&high, 10) == 0);
+        fail_unless(high.precision == 10);
+        fail_unless(hll_size(&high) == hll_size(&low));
+        fail_unless(hll_fold(&high, 10) == -1);
+        fail_unless(hll_destroy(&high) == 0);
+        fail_unless(hll_destroy(&low) == 0);
+    }
+}
+END_TEST
+
+START_TEST(test_hll_merge_sparse_dense)
+{
+    hll_t dense, sparse, empty;
+    fail_unless(hll_init(12, &dense) == 0);
+    fail_unless(hll_init(12, &sparse) == 0);
+    fail_unless(hll_init(12, &empty) == 0);
+
+    char buf[100];
+    for (int i=0; i < 5000; i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        hll_add(&dense, (char*)&buf);
+    }
+    for (int i=5000; i < 5100; i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        hll_add(&sparse, (char*)&buf);
+    }
+    fail_unless(dense.registers != NULL);
+    fail_unless(sparse.registers == NULL);
+
+    // Sparse into empty stays sparse
+    fail_unless(hll_merge(&empty, &sparse) == 0);
+    fail_unless(empty.registers == NULL);
+    fail_unless(hll_size(&empty) == hll_size(&sparse));
+
+    // Dense into sparse converts it
+    fail_unless(hll_merge(&sparse, &dense) == 0);
+    fail_unless(sparse.registers != NULL);
+    double s = hll_size(&sparse);
+    fail_unless(s > 5100 * 0.95 && s < 5100 * 1.05);
+
+    // Sparse into dense
+    fail_unless(hll_merge(&dense, &empty) == 0);
+    fail_unless(hll_size(&dense) == s);
+
+    fail_unless(hll_destroy(&dense) == 0);
+    fail_unless(hll_destroy(&sparse) == 0);
+    fail_unless(hll_destroy(&empty) == 0);
+}
+END_TEST
+
+START_TEST(test_hll_recount)
+{
+    // The sums kept on update match a recount of the registers
+    hll_t h, other;
+    fail_unless(hll_init(10, &h) == 0);
+    fail_unless(hll_init(12, &other) == 0);
+    fail_unless(h.num_zero == 1024);
+
+    char buf[100];
+    for (int i=0; i < 20000; i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        if (i < 300 || i > 15000) hll_add(&h, (char*)&buf);
+        hll_add(&other, (char*)&buf);
+
+        // Check across the conversion to dense
+        if (i == 299 || i == 19999) {
+            double s = hll_size(&h);
+            uint32_t num_zero = h.num_zero;
+            uint64_t inv_hi = h.inv_hi, inv_lo = h.inv_lo;
+            hll_recount(&h);
+            fail_unless(h.num_zero == num_zero);
+            fail_unless(h.inv_hi == inv_hi && h.inv_lo == inv_lo);
+            fail_unless(hll_size(&h) == s);
+        }
+    }
+    fail_unless(h.registers != NULL);
+
+    // Merging folds the higher precision
+    fail_unless(hll_merge(&h, &other) == 0);
+    double s = hll_size(&h);
+    fail_unless(s > 20000 * 0.9 && s < 20000 * 1.1);
+    hll_recount(&h);
+    fail_unless(hll_size(&h) == s);
+    fail_unless(h.num_zero == 0);
+
+    fail_unless(hll_destroy(&h) == 0);
+    fail_unless(hll_destroy(&other) == 0);
+}
+END_TEST
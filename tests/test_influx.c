@@ -0,0 +1,191 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "influx.h"
+
+/**
+ * A minimal HTTP server, which answers each request with
+ * the next of its statuses and keeps the bodies
+ */
+struct influx_test_server {
+    int listen_fd;
+    int port;
+    int *statuses;      // The status of each request, the last repeats
+    int num_statuses;
+    int requests;
+    int conns;          // Connections accepted
+    char body[65536];   // The bodies of the requests that succeeded
+    int body_len;
+    int stop;
+    pthread_t thread;
+};
+
+// Handles the requests read so far on a connection
+static int influx_test_handle(struct influx_test_server *s, int fd, char *buf, int *len) {
+    char *end;
+    while ((end = strstr(buf, "\r\n\r\n"))) {
+        char *cl = strstr(buf, "Content-Length: ");
+        int body_len = (cl && cl < end) ? atoi(cl + 16) : 0;
+        int head_len = end + 4 - buf;
+        if (*len < head_len + body_len) return 0;
+
+        int i = (s->requests < s->num_statuses) ? s->requests : s->num_statuses - 1;
+        int status = s->statuses[i];
+        s->requests++;
+        if (status == 204) {
+            memcpy(s->body + s->body_len, buf + head_len, body_len);
+            s->body_len += body_len;
+        }
+        char resp[128];
+        int resp_len = (status == 204) ? sprintf(resp, "HTTP/1.1 204 No Content\r\n\r\n") :
+            sprintf(resp, "HTTP/1.1 %d Error\r\nContent-Length: 5\r\n\r\nerror", status);
+        if (write(fd, resp, resp_len) != resp_len) return -1;
+
+        *len -= head_len + body_len;
+        memmove(buf, buf + head_len + body_len, *len);
+        buf[*len] = 0;
+    }
+    return 0;
+}
+
+static void* influx_test_serve(void *arg) {
+    struct influx_test_server *s = arg;
+    struct pollfd pfds[9] = {{s->listen_fd, POLLIN, 0}};
+    char bufs[8][65536];
+    int lens[8], num = 1;
+    while (!__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE)) {
+        if (poll(pfds, num, 50) <= 0) continue;
+        if ((pfds[0].revents & POLLIN) && num < 9) {
+            pfds[num] = (struct pollfd){accept(s->listen_fd, NULL, NULL), POLLIN, 0};
+            lens[num - 1] = 0;
+            num++;
+            s->conns++;
+        }
+        for (int i=1; i < num; i++) {
+            if (!pfds[i].revents || pfds[i].fd < 0) continue;
+            int res = read(pfds[i].fd, bufs[i-1] + lens[i-1], sizeof(bufs[0]) - 1 - lens[i-1]);
+            if (res <= 0) {
+                close(pfds[i].fd);
+                pfds[i].fd = -1;
+                continue;
+            }
+            lens[i-1] += res;
+            bufs[i-1][lens[i-1]] = 0;
+            influx_test_handle(s, pfds[i].fd, bufs[i-1], lens + i - 1);
+        }
+    }
+    for (int i=1; i < num; i++) {
+        if (pfds[i].fd >= 0) close(pfds[i].fd);
+    }
+    return NULL;
+}
+
+// Starts a server on an ephemeral local port
+static void influx_test_start(struct influx_test_server *s, int *statuses, int num_statuses) {
+    memset(s, 0, sizeof(struct influx_test_server));
+    s->statuses = statuses;
+    s->num_statuses = num_statuses;
+    s->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fail_unless(bind(s->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    fail_unless(listen(s->listen_fd, 8) == 0);
+    socklen_t len = sizeof(addr);
+    getsockname(s->listen_fd, (struct sockaddr*)&addr, &len);
+    s->port = ntohs(addr.sin_port);
+    pthread_create(&s->thread, NULL, influx_test_serve, s);
+}
+
+static void influx_test_stop(struct influx_test_server *s) {
+    __atomic_store_n(&s->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(s->thread, NULL);
+    close(s->listen_fd);
+}
+
+START_TEST(test_influx_flush)
+{
+    int statuses[] = {204};
+    struct influx_test_server s;
+    influx_test_start(&s, statuses, 1);
+
+    metrics m;
+    fail_unless(init_metrics_defaults(&m) == 0);
+    fail_unless(metrics_add_sample(&m, KEY_VAL, "test", 100) == 0);
+    fail_unless(metrics_add_sample(&m, COUNTER, "req;env=prod;host=a b", 4) == 0);
+    fail_unless(metrics_add_sample(&m, GAUGE, "a,b c", 2) == 0);
+    fail_unless(metrics_set_update(&m, "users", "alice") == 0);
+    fail_unless(metrics_add_sample(&m, TIMER, "baz", 1) == 0);
+
+    // Batches of two, over two connections
+    influx_output o;
+    fail_unless(init_influx_output("127.0.0.1", s.port, "stats", 2, 2, 1, &o) == 0);
+    struct timeval tv = {1000, 0};
+    fail_unless(influx_flush(&o, &m, &tv) == 0);
+    tv.tv_sec = 2000;
+    fail_unless(influx_flush(&o, &m, &tv) == 0);
+    fail_unless(destroy_influx_output(&o) == 0);
+    influx_test_stop(&s);
+
+    // The connections are kept alive between the flushes
+    fail_unless(s.requests == 6);
+    fail_unless(s.conns <= 2);
+    s.body[s.body_len] = 0;
+    fail_unless(strstr(s.body, "test value=100.000000 1000\n") != NULL);
+    fail_unless(strstr(s.body, "req,env=prod,host=a\\ b value=4.000000 1000\n") != NULL);
+    fail_unless(strstr(s.body, "a\\,b\\ c value=2.000000 1000\n") != NULL);
+    fail_unless(strstr(s.body, "users value=1i 1000\n") != NULL);
+    fail_unless(strstr(s.body, "baz sum=1.000000,sum_sq=1.000000,mean=1.000000,"
+                "lower=1.000000,upper=1.000000,count=1i,stdev=0.000000,") != NULL);
+    fail_unless(strstr(s.body, "users value=1i 2000\n") != NULL);
+
+    fail_unless(destroy_metrics(&m) == 0);
+}
+END_TEST
+
+START_TEST(test_influx_errors)
+{
+    metrics m;
+    fail_unless(init_metrics_defaults(&m) == 0);
+    fail_unless(metrics_add_sample(&m, KEY_VAL, "test", 1) == 0);
+    struct timeval tv = {1000, 0};
+    influx_output o;
+
+    // A server error is posted again
+    int retried[] = {503, 204};
+    struct influx_test_server s;
+    influx_test_start(&s, retried, 2);
+    fail_unless(init_influx_output("127.0.0.1", s.port, "stats", 100, 1, 0, &o) == 0);
+    fail_unless(influx_flush(&o, &m, &tv) == 0);
+    fail_unless(destroy_influx_output(&o) == 0);
+    influx_test_stop(&s);
+    fail_unless(s.requests == 2);
+    s.body[s.body_len] = 0;
+    fail_unless(!strcmp(s.body, "test value=1.000000 1000\n"));
+
+    // A rejected batch is not
+    int rejected[] = {400};
+    influx_test_start(&s, rejected, 1);
+    fail_unless(init_influx_output("127.0.0.1", s.port, "stats", 100, 1, 0, &o) == 0);
+    fail_unless(influx_flush(&o, &m, &tv) == -1);
+    fail_unless(destroy_influx_output(&o) == 0);
+    influx_test_stop(&s);
+    fail_unless(s.requests == 1);
+
+    // Nothing is listening
+    int port = s.port;
+    fail_unless(init_influx_output("127.0.0.1", port, "stats", 100, 1, 0, &o) == 0);
+    fail_unless(influx_flush(&o, &m, &tv) == -1);
+    fail_unless(destroy_influx_output(&o) == 0);
+
+    fail_unless(destroy_metrics(&m) == 0);
+}
+END_TEST
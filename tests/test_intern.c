@@ -0,0 +1,100 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "intern.h"
+#include "hash.h"
+
+// Interns a key, hashing it
+#define INTERN(t, key) intern_key(t, key, hash_key(key, strlen(key)))
+
+START_TEST(test_intern_init_destroy)
+{
+    intern_table t;
+    fail_unless(intern_init(0, &t) != 0);
+    fail_unless(intern_init(4, &t) == 0);
+    fail_unless(intern_size(&t) == 0);
+    fail_unless(intern_destroy(&t) == 0);
+}
+END_TEST
+
+START_TEST(test_intern_key)
+{
+    intern_table t;
+    fail_unless(intern_init(4, &t) == 0);
+
+    // The same name gives the same copy
+    char buf[32];
+    strcpy(buf, "api.requests");
+    char *k = INTERN(&t, buf);
+    fail_unless(k != buf && strcmp(k, "api.requests") == 0);
+    fail_unless(INTERN(&t, "api.requests") == k);
+    fail_unless(INTERN(&t, "api.errors") != k);
+    fail_unless(intern_size(&t) == 2);
+
+    // Grow the table, the copies do not move
+    char key[32];
+    for (int i=0; i < 10000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        fail_unless(INTERN(&t, key) != NULL);
+    }
+    fail_unless(intern_size(&t) == 10002);
+    fail_unless(INTERN(&t, "api.requests") == k);
+    fail_unless(intern_destroy(&t) == 0);
+}
+END_TEST
+
+START_TEST(test_intern_sweep)
+{
+    intern_table t;
+    fail_unless(intern_init(2, &t) == 0);
+
+    // Use a stable name every interval, and many names only once
+    char key[32];
+    for (int i=0; i < 100; i++) {
+        snprintf(key, sizeof(key), "once%d", i);
+        INTERN(&t, key);
+    }
+    for (int i=0; i < 6; i++) {
+        INTERN(&t, "stable");
+        intern_advance(&t);
+    }
+
+    // The unused names were swept, the stable one is kept
+    fail_unless(intern_size(&t) == 1);
+    fail_unless(strcmp(INTERN(&t, "stable"), "stable") == 0);
+    fail_unless(intern_size(&t) == 1);
+    fail_unless(intern_destroy(&t) == 0);
+}
+END_TEST
+
+START_TEST(test_intern_expire)
+{
+    intern_table t;
+    fail_unless(intern_init(2, &t) == 0);
+
+    // A few idle names expire, but are not yet swept
+    char key[32];
+    for (int i=0; i < 100; i++) {
+        snprintf(key, sizeof(key), "stable%d", i);
+        INTERN(&t, key);
+    }
+    char *k = INTERN(&t, "idle");
+    for (int i=0; i < 4; i++) {
+        for (int j=0; j < 100; j++) {
+            snprintf(key, sizeof(key), "stable%d", j);
+            INTERN(&t, key);
+        }
+        intern_advance(&t);
+    }
+    fail_unless(intern_size(&t) == 101);
+    fail_unless(intern_live(&t) == 100);
+
+    // Used again, an expired name is revived in place
+    fail_unless(INTERN(&t, "idle") == k);
+    fail_unless(intern_live(&t) == 101);
+    intern_advance(&t);
+    fail_unless(intern_live(&t) == 101);
+    fail_unless(intern_destroy(&t) == 0);
+}
+END_TEST
@@ -0,0 +1,98 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libstatsite.h"
+
+struct seen {
+    int counters, timers, sets, gauges;
+    double p50;
+};
+
+static int record_cb(void *data, statsite_type type, const char *name, const statsite_value *v) {
+    struct seen *s = data;
+    switch (type) {
+        case STATSITE_COUNTER:
+            fail_unless(strcmp(name, "c") == 0 && v->count == 2 && v->value == 5);
+            s->counters++;
+            break;
+        case STATSITE_TIMER:
+            fail_unless(v->count == 1000 && v->min == 0 && v->max == 999);
+            s->p50 = statsite_quantile(v, 0.5);
+            s->timers++;
+            break;
+        case STATSITE_SET:
+            fail_unless(v->count == 2);
+            s->sets++;
+            break;
+        case STATSITE_GAUGE:
+            fail_unless(v->value == 3);
+            s->gauges++;
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+START_TEST(test_libstatsite_agg)
+{
+    statsite_agg *agg;
+    fail_unless(statsite_api_version() == STATSITE_API_VERSION);
+    fail_unless(statsite_agg_create(-1, 0, &agg) == -1);
+    fail_unless(statsite_agg_create(0, 0, &agg) == 0);
+    fail_unless(statsite_agg_add(agg, STATSITE_SET, "s", 1) == -1);
+
+    fail_unless(statsite_agg_add(agg, STATSITE_COUNTER, "c", 2) == 0);
+    fail_unless(statsite_agg_add(agg, STATSITE_COUNTER, "c", 3) == 0);
+    fail_unless(statsite_agg_add(agg, STATSITE_GAUGE, "g", 3) == 0);
+    fail_unless(statsite_agg_set_add(agg, "s", "a") == 0);
+    fail_unless(statsite_agg_set_add(agg, "s", "b") == 0);
+    for (int i=0; i < 1000; i++) {
+        fail_unless(statsite_agg_add(agg, STATSITE_TIMER, "t", i) == 0);
+    }
+
+    struct seen s = {0, 0, 0, 0, 0};
+    fail_unless(statsite_agg_iter(agg, &s, record_cb) == 0);
+    fail_unless(s.counters == 1 && s.timers == 1 && s.sets == 1 && s.gauges == 1);
+    fail_unless(s.p50 > 480 && s.p50 < 520);
+
+    // A reset starts a new interval
+    fail_unless(statsite_agg_reset(agg) == 0);
+    memset(&s, 0, sizeof(s));
+    fail_unless(statsite_agg_iter(agg, &s, record_cb) == 0);
+    fail_unless(s.counters == 0 && s.timers == 0);
+    statsite_agg_destroy(agg);
+}
+END_TEST
+
+START_TEST(test_libstatsite_serialize)
+{
+    statsite_agg *src, *dst;
+    fail_unless(statsite_agg_create(0, 0, &src) == 0);
+    fail_unless(statsite_agg_create(0, 0, &dst) == 0);
+    fail_unless(statsite_agg_add(src, STATSITE_COUNTER, "c", 2) == 0);
+    fail_unless(statsite_agg_add(src, STATSITE_COUNTER, "c", 3) == 0);
+    fail_unless(statsite_agg_add(src, STATSITE_GAUGE, "g", 3) == 0);
+    fail_unless(statsite_agg_set_add(src, "s", "a") == 0);
+    fail_unless(statsite_agg_set_add(src, "s", "b") == 0);
+    for (int i=0; i < 1000; i++) {
+        fail_unless(statsite_agg_add(src, STATSITE_TIMER, "t", i) == 0);
+    }
+
+    char *buf;
+    size_t len;
+    fail_unless(statsite_agg_serialize(src, &buf, &len) == 0);
+    fail_unless(statsite_agg_merge(dst, buf, len) == 0);
+    struct seen s = {0, 0, 0, 0, 0};
+    fail_unless(statsite_agg_iter(dst, &s, record_cb) == 0);
+    fail_unless(s.counters == 1 && s.timers == 1 && s.sets == 1 && s.gauges == 1);
+
+    // Truncated input is rejected
+    fail_unless(statsite_agg_merge(dst, buf, len - 1) == -1);
+    fail_unless(statsite_agg_merge(dst, buf, 3) == -1);
+    free(buf);
+    statsite_agg_destroy(src);
+    statsite_agg_destroy(dst);
+}
+END_TEST
@@ -0,0 +1,44 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "loop_monitor.h"
+#include "stats.h"
+
+START_TEST(test_loop_monitor_iterations)
+{
+    loop_report r;
+    uint64_t before[NUM_STATS], after[NUM_STATS];
+    loop_monitor_collect(&r);
+    stats_collect(before);
+
+    // Each iteration is binned, only the stalls are kept
+    double ms[] = {0.05, 0.5, 5, 20, 50, 15, 30, 200};
+    for (int i=0; i < 8; i++) loop_monitor_iteration(i % 2, ms[i]);
+    loop_monitor_lag(3);
+    loop_monitor_lag(1);
+    stats_collect(after);
+    fail_unless(after[STAT_LOOP_100US] - before[STAT_LOOP_100US] == 1);
+    fail_unless(after[STAT_LOOP_1MS] - before[STAT_LOOP_1MS] == 1);
+    fail_unless(after[STAT_LOOP_10MS] - before[STAT_LOOP_10MS] == 1);
+    fail_unless(after[STAT_LOOP_100MS] - before[STAT_LOOP_100MS] == 4);
+    fail_unless(after[STAT_LOOP_SLOWER] - before[STAT_LOOP_SLOWER] == 1);
+
+    // The longest stalls come first
+    loop_monitor_collect(&r);
+    fail_unless(r.max_iteration_ms == 200);
+    fail_unless(r.max_lag_ms == 3);
+    fail_unless(r.num_stalls == LOOP_WORST_STALLS);
+    fail_unless(r.stalls[0].ms == 200 && r.stalls[0].worker == 1);
+    fail_unless(r.stalls[1].ms == 50 && r.stalls[1].worker == 0);
+    fail_unless(r.stalls[2].ms == 30);
+    fail_unless(r.stalls[3].ms == 20);
+
+    // Collecting starts a new interval
+    loop_monitor_iteration(0, 0.01);
+    loop_monitor_collect(&r);
+    fail_unless(r.max_iteration_ms == 0.01);
+    fail_unless(r.max_lag_ms == 0);
+    fail_unless(r.num_stalls == 0);
+}
+END_TEST
@@ -0,0 +1,98 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lz4.h"
+
+START_TEST(test_lz4_block)
+{
+    char *src = malloc(LZ4_BLOCK_SIZE), *dst = malloc(LZ4_BLOCK_SIZE), *out = malloc(LZ4_BLOCK_SIZE);
+
+    // Repetitive lines compress well, and round trip
+    int len = 0;
+    for (int i=0; len < LZ4_BLOCK_SIZE - 64; i++) {
+        len += sprintf(src + len, "timers.api.requests%d.upper_99|%d|1760431200\n", i % 7, i);
+    }
+    int clen = lz4_compress_block(src, len, dst, LZ4_BLOCK_SIZE);
+    fail_unless(clen > 0 && clen < len / 3);
+    fail_unless(lz4_decompress_block(dst, clen, out, LZ4_BLOCK_SIZE) == len);
+    fail_unless(memcmp(src, out, len) == 0);
+
+    // Too small an output buffer
+    fail_unless(lz4_decompress_block(dst, clen, out, len - 1) == -1);
+    fail_unless(lz4_compress_block(src, len, dst, clen - 1) == 0);
+
+    // Short and random blocks round trip
+    fail_unless(lz4_compress_block("abc", 3, dst, 16) == 4);
+    fail_unless(lz4_decompress_block(dst, 4, out, 16) == 3);
+    fail_unless(memcmp(out, "abc", 3) == 0);
+    srand(42);
+    for (int i=0; i < LZ4_BLOCK_SIZE; i++) src[i] = rand() % 4;
+    clen = lz4_compress_block(src, LZ4_BLOCK_SIZE, dst, LZ4_BLOCK_SIZE);
+    fail_unless(clen > 0);
+    fail_unless(lz4_decompress_block(dst, clen, out, LZ4_BLOCK_SIZE) == LZ4_BLOCK_SIZE);
+    fail_unless(memcmp(src, out, LZ4_BLOCK_SIZE) == 0);
+
+    // A match before the start of the output is invalid
+    char bad[] = {0x10, 'a', 0x02, 0x00};
+    fail_unless(lz4_decompress_block(bad, sizeof(bad), out, 16) == -1);
+
+    free(src);
+    free(dst);
+    free(out);
+}
+END_TEST
+
+START_TEST(test_lz4_frame)
+{
+    FILE *f = tmpfile();
+    fail_unless(f != NULL);
+
+    // Write two frames, the first spanning several blocks
+    FILE *z = lz4_frame_open(f);
+    fail_unless(z != NULL);
+    for (int i=0; i < 20000; i++) fprintf(z, "counts.requests%d|%d\n", i % 13, i);
+    fail_unless(fclose(z) == 0);
+    long first = ftell(f);
+    z = lz4_frame_open(f);
+    fputs("--\n", z);
+    fail_unless(fclose(z) == 0);
+
+    // Check the header, with its descriptor checksum
+    rewind(f);
+    unsigned char header[7];
+    fail_unless(fread(header, 7, 1, f) == 1);
+    unsigned char expected[] = {0x04, 0x22, 0x4D, 0x18, 0x60, 0x40, 0x82};
+    fail_unless(memcmp(header, expected, 7) == 0);
+
+    // The frames decode to their concatenation
+    rewind(f);
+    char *buf;
+    size_t len;
+    FILE *out = open_memstream(&buf, &len);
+    fail_unless(lz4_frame_decode(f, out) == 0);
+    fclose(out);
+    char line[64];
+    int pos = 0;
+    for (int i=0; i < 20000; i++) {
+        int n = sprintf(line, "counts.requests%d|%d\n", i % 13, i);
+        fail_unless(memcmp(buf + pos, line, n) == 0);
+        pos += n;
+    }
+    fail_unless(len == pos + 3);
+    fail_unless(memcmp(buf + pos, "--\n", 3) == 0);
+    free(buf);
+
+    // A truncated frame is invalid
+    FILE *t = tmpfile();
+    rewind(f);
+    for (int i=0; i < first - 1; i++) fputc(fgetc(f), t);
+    rewind(t);
+    out = open_memstream(&buf, &len);
+    fail_unless(lz4_frame_decode(t, out) == -1);
+    fclose(out);
+    free(buf);
+    fclose(t);
+    fclose(f);
+}
+END_TEST
@@ -8,6 +8,8 @@
 #include <errno.h>
 #include <math.h>
 #include "metrics.h"
+#include "cpu_features.h"
+#include "sketch.h"
 
 START_TEST(test_metrics_init_and_destroy)
 {
@@ -190,6 +192,280 @@ START_TEST(test_metrics_histogram)
     fail_unless(metrics_iter(&m, (void*)&okay, iter_test_histogram) == 0);
     fail_unless(okay == 3);
 
+    // A weighted sample counts its weight in its bin
+    fail_unless(metrics_add_timer_weighted(&m, "foo", hash_key("foo", 3), 30, 5) == 0);
+    metric_type type = TIMER;
+    timer_hist *t = metrics_get_metric(&m, &type, "foo");
+    fail_unless(t && type == TIMER && t->counts[2] == 5);
+    fail_unless(timer_count(&t->tm) == 5);
+
+    res = destroy_metrics(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_histogram_kernels)
+{
+    statsite_config config;
+    fail_unless(config_from_filename(NULL, &config) == 0);
+    histogram_config c1 = {"foo", 0, 200, 20, 12, NULL, 0};
+    config.hist_configs = &c1;
+    fail_unless(build_prefix_tree(&config) == 0);
+
+    metrics m;
+    double quants[] = {0.5, 0.90, 0.99};
+    fail_unless(init_metrics(0.01, (double*)&quants, 3, config.histograms, 12, &m) == 0);
+
+    // The edges, the values out of range and NaN, in odd batches
+    double vals[103];
+    for (int i=0; i < 100; i++) vals[i] = i * 2.5 - 20;
+    vals[100] = NAN;
+    vals[101] = 200;
+    vals[102] = 0;
+
+    // Each kernel must bin the same as the scalar code
+    simd_level levels[] = {SIMD_NONE, SIMD_SSE2, SIMD_AVX2, SIMD_AVX512};
+    char *names[] = {"foo.none", "foo.sse2", "foo.avx2", "foo.avx512"};
+    for (int l=0; l < 4; l++) {
+        simd_limit(levels[l]);
+        fail_unless(metrics_add_timer_samples(&m, names[l], vals, 103) == 0);
+        fail_unless(metrics_add_timer_samples(&m, names[l], vals + 1, 7) == 0);
+    }
+    simd_limit(SIMD_AUTO);
+
+    metric_type type = TIMER;
+    timer_hist *expect = metrics_get_metric(&m, &type, names[0]);
+    fail_unless(expect && expect->counts[0] > 0 && expect->counts[11] > 0);
+    for (int l=1; l < 4; l++) {
+        type = TIMER;
+        timer_hist *t = metrics_get_metric(&m, &type, names[l]);
+        fail_unless(memcmp(t->counts, expect->counts, 12 * sizeof(uint64_t)) == 0);
+    }
+    fail_unless(destroy_metrics(&m) == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_histogram_cache)
+{
+    statsite_config config;
+    int res = config_from_filename(NULL, &config);
+
+    // Build a histogram config
+    histogram_config c1 = {"foo", 0, 200, 20, 12, NULL, 0};
+    config.hist_configs = &c1;
+    fail_unless(build_prefix_tree(&config) == 0);
+
+    metrics m;
+    double quants[] = {0.5, 0.90, 0.99};
+    res = init_metrics(0.01, (double*)&quants, 3, config.histograms, 12, &m);
+    fail_unless(res == 0);
+
+    // The lookups are cached across clears, including the misses
+    timer_hist *t;
+    for (int i=0; i < 3; i++) {
+        fail_unless(metrics_add_sample(&m, TIMER, "foo.bar", 10) == 0);
+        fail_unless(metrics_add_sample(&m, TIMER, "zip", 10) == 0);
+        fail_unless(hashmap_get(m.timers, "foo.bar", (void**)&t) == 0);
+        fail_unless(t->conf == &c1);
+        fail_unless(t->counts[1] == 1);
+        fail_unless(hashmap_get(m.timers, "zip", (void**)&t) == 0);
+        fail_unless(t->conf == NULL);
+        fail_unless(m.prefix_cache != NULL);
+        fail_unless(metrics_clear(&m) == 0);
+    }
+
+    res = destroy_metrics(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_timer_samples)
+{
+    statsite_config config;
+    int res = config_from_filename(NULL, &config);
+
+    // Bins that are not exact in binary, so the reciprocal rounds
+    histogram_config c1 = {"foo", 0.1, 2.1, 0.1, 12, NULL, 0};
+    config.hist_configs = &c1;
+    fail_unless(sane_histograms(config.hist_configs) == 0);
+    fail_unless(build_prefix_tree(&config) == 0);
+
+    metrics m;
+    double quants[] = {0.5, 0.90, 0.99};
+    res = init_metrics(0.01, (double*)&quants, 3, config.histograms, 12, &m);
+    fail_unless(res == 0);
+
+    // The batch and single paths must pick the same bins
+    double vals[1001];
+    for (int i=0; i < 1000; i++) {
+        vals[i] = (i - 100) * 0.003;
+    }
+    vals[1000] = NAN;
+    fail_unless(metrics_add_timer_samples(&m, "foo.batch", vals, 1001) == 0);
+    for (int i=0; i < 1001; i++) {
+        fail_unless(metrics_add_sample(&m, TIMER, "foo.single", vals[i]) == 0);
+    }
+
+    timer_hist *batch, *single;
+    fail_unless(hashmap_get(m.timers, "foo.batch", (void**)&batch) == 0);
+    fail_unless(hashmap_get(m.timers, "foo.single", (void**)&single) == 0);
+    fail_unless(timer_count(&batch->tm) == 1001);
+    uint64_t total = 0;
+    for (int i=0; i < c1.num_bins; i++) {
+        fail_unless(batch->counts[i] == single->counts[i]);
+        total += batch->counts[i];
+    }
+    fail_unless(total == 1001);
+
+    res = destroy_metrics(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_histogram_log)
+{
+    statsite_config config;
+    int res = config_from_filename(NULL, &config);
+
+    // Bins of [1, 10), [10, 100) and [100, 1000)
+    histogram_config c1 = {"foo", 1, 1000, 10, 0, NULL, 0, HISTOGRAM_LOG};
+    config.hist_configs = &c1;
+    fail_unless(sane_histograms(config.hist_configs) == 0);
+    fail_unless(build_prefix_tree(&config) == 0);
+
+    metrics m;
+    double quants[] = {0.5, 0.90, 0.99};
+    res = init_metrics(0.01, (double*)&quants, 3, config.histograms, 12, &m);
+    fail_unless(res == 0);
+
+    double vals[] = {0.5, 1, 5, 10, 99, 100, 500, 999, 1000, 5000};
+    fail_unless(metrics_add_timer_samples(&m, "foo", vals, 10) == 0);
+
+    timer_hist *t;
+    fail_unless(hashmap_get(m.timers, "foo", (void**)&t) == 0);
+    fail_unless(t->counts[0] == 1);
+    fail_unless(t->counts[1] == 2);
+    fail_unless(t->counts[2] == 2);
+    fail_unless(t->counts[3] == 3);
+    fail_unless(t->counts[4] == 2);
+    fail_unless(histogram_bin_start(&c1, 2) == 100);
+
+    res = destroy_metrics(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_histogram_auto)
+{
+    statsite_config config;
+    int res = config_from_filename(NULL, &config);
+
+    // Keeps at most 8 bins to a 2% error
+    histogram_config c1 = {"foo", 0, 0, 0, 0, NULL, 1, HISTOGRAM_AUTO};
+    c1.eps = 0.02;
+    c1.max_bins = 8;
+    fail_unless(sane_histograms(&c1) == 0);
+    config.hist_configs = &c1;
+    fail_unless(build_prefix_tree(&config) == 0);
+    int bin10 = floor(log(10) / log(c1.bin_width));
+    fail_unless(floor(log(10.5) / log(c1.bin_width)) == bin10 + 1);
+
+    metrics m1, m2;
+    double quants[] = {0.5, 0.90, 0.99};
+    res = init_metrics(0.01, (double*)&quants, 3, config.histograms, 12, &m1);
+    fail_unless(res == 0);
+    res = init_metrics(0.01, (double*)&quants, 3, config.histograms, 12, &m2);
+    fail_unless(res == 0);
+
+    // The 1 is too far below the 10, so it is merged into the below bin
+    double vals[] = {1, 10};
+    fail_unless(metrics_add_timer_samples(&m1, "foo", vals, 2) == 0);
+    timer_hist *t;
+    fail_unless(hashmap_get(m1.timers, "foo", (void**)&t) == 0);
+    fail_unless(timer_hist_num_bins(t) == 9);
+    fail_unless(t->bin_offset == bin10 - 7);
+    fail_unless(t->counts[0] == 1);
+    fail_unless(t->counts[8] == 1);
+    fail_unless(timer_hist_bin_start(t, 8) <= 10 && timer_hist_bin_start(t, 8) * c1.bin_width > 10);
+    fail_unless(timer_hist_bin_start(t, 0) == timer_hist_bin_start(t, 1));
+
+    // The values at or below the min share its bin
+    fail_unless(metrics_add_sample(&m1, TIMER, "foo", 0) == 0);
+    fail_unless(t->counts[0] == 2);
+
+    // Merging moves the run of bins up to the highest
+    double vals2[] = {10, 10.5};
+    fail_unless(metrics_add_timer_samples(&m2, "foo", vals2, 2) == 0);
+    fail_unless(metrics_merge(&m1, &m2) == 0);
+    fail_unless(timer_hist_num_bins(t) == 9);
+    fail_unless(t->bin_offset == bin10 - 6);
+    fail_unless(t->counts[0] == 2);
+    fail_unless(t->counts[7] == 2);
+    fail_unless(t->counts[8] == 1);
+    fail_unless(timer_count(&t->tm) == 5);
+
+    fail_unless(destroy_metrics(&m1) == 0);
+    fail_unless(destroy_metrics(&m2) == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_timer_engines)
+{
+    statsite_config config;
+    int res = config_from_filename(NULL, &config);
+
+    // Use a t-digest for the "db." prefix, and only the p99 for "web."
+    double web_quants[] = {0.99};
+    timer_config c3 = {"heat.", TIMER_ENGINE_STATS, NULL, 1, true};
+    timer_config c2 = {"web.", TIMER_ENGINE_CM, &c3, 1, false, web_quants, 1, 0.001};
+    timer_config c1 = {"db.", TIMER_ENGINE_TDIGEST, &c2, 1, true, NULL, 0, 0, 50};
+    config.timer_configs = &c1;
+    fail_unless(build_prefix_tree(&config) == 0);
+
+    metrics m;
+    double quants[] = {0.5, 0.90, 0.99};
+    res = init_metrics(0.01, (double*)&quants, 3, NULL, 12, &m);
+    fail_unless(res == 0);
+    metrics_set_timer_engine(&m, TIMER_ENGINE_CM, 100, config.timer_engines);
+
+    fail_unless(metrics_add_sample(&m, TIMER, "db.query", 1) == 0);
+    fail_unless(metrics_add_sample(&m, TIMER, "api.call", 1) == 0);
+
+    timer_hist *t;
+    fail_unless(hashmap_get(m.timers, "db.query", (void**)&t) == 0);
+    fail_unless(t->tm.engine == TIMER_ENGINE_TDIGEST);
+    fail_unless(t->tm.q.td.compression == 50);
+    fail_unless(timer_query(&t->tm, 0.5) == 1);
+    fail_unless(hashmap_get(m.timers, "api.call", (void**)&t) == 0);
+    fail_unless(t->tm.engine == TIMER_ENGINE_CM);
+    fail_unless(t->tm.q.cm.eps == 0.01);
+    fail_unless(t->num_quants == 3);
+    fail_unless(t->tm.q.cm.num_quantiles == 3);
+
+    // The per-prefix quantiles drive the CM summary too
+    fail_unless(metrics_add_sample(&m, TIMER, "web.page", 1) == 0);
+    fail_unless(hashmap_get(m.timers, "web.page", (void**)&t) == 0);
+    fail_unless(t->tm.engine == TIMER_ENGINE_CM);
+    fail_unless(t->num_quants == 1 && t->quantiles[0] == 0.99);
+    fail_unless(t->tm.q.cm.num_quantiles == 1);
+    fail_unless(t->tm.q.cm.eps == 0.001);
+
+    // Timers without quantiles report none
+    fail_unless(metrics_add_sample(&m, TIMER, "heat.map", 3) == 0);
+    fail_unless(metrics_add_sample(&m, TIMER, "heat.map", 1) == 0);
+    fail_unless(hashmap_get(m.timers, "heat.map", (void**)&t) == 0);
+    fail_unless(t->tm.engine == TIMER_ENGINE_STATS);
+    fail_unless(t->num_quants == 0);
+    fail_unless(t->tm.num_exact == 0);
+    fail_unless(timer_min(&t->tm) == 1 && timer_max(&t->tm) == 3);
+
+    // Switch the default engine
+    metrics_clear(&m);
+    metrics_set_timer_engine(&m, TIMER_ENGINE_TDIGEST, 100, NULL);
+    fail_unless(metrics_add_sample(&m, TIMER, "api.call", 1) == 0);
+    fail_unless(hashmap_get(m.timers, "api.call", (void**)&t) == 0);
+    fail_unless(t->tm.engine == TIMER_ENGINE_TDIGEST);
+
     res = destroy_metrics(&m);
     fail_unless(res == 0);
 }
@@ -229,3 +505,898 @@ START_TEST(test_metrics_gauges)
 }
 END_TEST
 
+static int iter_test_shared(void *data, metric_type type, char *key, void *val) {
+    int *o = data;
+    if (type == COUNTER && strcmp(key, "c") == 0 && counter_sum(val) == 30 && counter_count(val) == 2) {
+        *o = *o | (1 << 3);
+        return 0;
+    }
+    return (type == GAUGE) ? iter_test_gauge(data, type, key, val) : 1;
+}
+
+START_TEST(test_metrics_shared)
+{
+    metrics m1, m2;
+    fail_unless(init_metrics_defaults(&m1) == 0);
+    fail_unless(init_metrics_defaults(&m2) == 0);
+    shared_map *s;
+    fail_unless(shared_map_create(2, &s) == 0);
+    metrics_set_shared(&m1, s);
+    metrics_set_shared(&m2, s);
+
+    // Both objects update the same keys, until the map is full
+    fail_unless(metrics_add_sample(&m1, COUNTER, "c", 10) == 0);
+    fail_unless(metrics_add_sample(&m2, COUNTER, "c", 20) == 0);
+    fail_unless(metrics_add_sample(&m1, GAUGE, "g1", 1) == 0);
+    fail_unless(metrics_add_sample(&m2, GAUGE_DELTA, "g1", 41) == 0);
+    fail_unless(metrics_add_sample(&m2, GAUGE_DELTA, "g2", 100) == 0);
+    fail_unless(counter_map_size(&m1.counters) == 0);
+    fail_unless(gauge_map_size(&m1.gauges) == 0);
+    fail_unless(gauge_map_size(&m2.gauges) == 1);
+
+    // Folded into an object with its own keys
+    fail_unless(metrics_add_sample(&m2, GAUGE_DELTA, "g3", -100) == 0);
+    metrics_set_shared(&m2, NULL);
+    fail_unless(metrics_merge_shared(&m2, s, NULL) == 0);
+    fail_unless(metrics_merge(&m2, &m1) == 0);
+
+    int okay = 0;
+    fail_unless(metrics_iter(&m2, (void*)&okay, iter_test_shared) == 0);
+    fail_unless(okay == 15);
+
+    fail_unless(destroy_metrics(&m1) == 0);
+    fail_unless(destroy_metrics(&m2) == 0);
+    shared_map_destroy(s);
+}
+END_TEST
+
+static int iter_test_merge(void *data, metric_type type, char *key, void *val) {
+    int *o = data;
+    if (type == KEY_VAL && strcmp(key, "kv") == 0 && *(double*)val == 7) {
+        *o = *o | 1;
+    } else if (type == COUNTER && strcmp(key, "c") == 0 && counter_sum(val) == 30) {
+        *o = *o | (1 << 1);
+    } else if (type == TIMER && strcmp(key, "t") == 0 && timer_count(&((timer_hist*)val)->tm) == 3) {
+        *o = *o | (1 << 2);
+    } else if (type == SET && strcmp(key, "s") == 0 && set_size(val) == 3) {
+        *o = *o | (1 << 3);
+    } else if (type == GAUGE && strcmp(key, "g1") == 0 && ((gauge_t*)val)->value == 5) {
+        *o = *o | (1 << 4);
+    } else if (type == GAUGE && strcmp(key, "g2") == 0 && ((gauge_t*)val)->value == 3) {
+        *o = *o | (1 << 5);
+    } else
+        return 1;
+    return 0;
+}
+
+START_TEST(test_metrics_merge)
+{
+    metrics m1, m2;
+    fail_unless(init_metrics_defaults(&m1) == 0);
+    fail_unless(init_metrics_defaults(&m2) == 0);
+
+    fail_unless(metrics_add_sample(&m2, KEY_VAL, "kv", 7) == 0);
+    fail_unless(metrics_add_sample(&m1, COUNTER, "c", 10) == 0);
+    fail_unless(metrics_add_sample(&m2, COUNTER, "c", 20) == 0);
+    fail_unless(metrics_add_sample(&m1, TIMER, "t", 1) == 0);
+    fail_unless(metrics_add_sample(&m2, TIMER, "t", 2) == 0);
+    fail_unless(metrics_add_sample(&m2, TIMER, "t", 3) == 0);
+    fail_unless(metrics_set_update(&m1, "s", "a") == 0);
+    fail_unless(metrics_set_update(&m1, "s", "b") == 0);
+    fail_unless(metrics_set_update(&m2, "s", "b") == 0);
+    fail_unless(metrics_set_update(&m2, "s", "c") == 0);
+
+    // Set gauges take the value of src, deltas are added
+    fail_unless(metrics_add_sample(&m1, GAUGE, "g1", 1) == 0);
+    fail_unless(metrics_add_sample(&m2, GAUGE, "g1", 5) == 0);
+    fail_unless(metrics_add_sample(&m1, GAUGE, "g2", 1) == 0);
+    fail_unless(metrics_add_sample(&m2, GAUGE_DELTA, "g2", 2) == 0);
+
+    fail_unless(metrics_merge(&m1, &m2) == 0);
+
+    int okay = 0;
+    fail_unless(metrics_iter(&m1, (void*)&okay, iter_test_merge) == 0);
+    fail_unless(okay == 63);
+
+    fail_unless(destroy_metrics(&m1) == 0);
+    fail_unless(destroy_metrics(&m2) == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_merge_prefix)
+{
+    metrics m1, m2;
+    fail_unless(init_metrics_defaults(&m1) == 0);
+    fail_unless(init_metrics_defaults(&m2) == 0);
+
+    fail_unless(metrics_add_sample(&m2, KEY_VAL, "api.kv", 7) == 0);
+    fail_unless(metrics_add_sample(&m2, KEY_VAL, "db.kv", 7) == 0);
+    fail_unless(metrics_add_sample(&m2, COUNTER, "api.c", 20) == 0);
+    fail_unless(metrics_add_sample(&m2, COUNTER, "db.c", 20) == 0);
+    fail_unless(metrics_add_sample(&m2, TIMER, "api.t", 2) == 0);
+    fail_unless(metrics_add_sample(&m2, GAUGE, "api.g", 5) == 0);
+    fail_unless(metrics_add_sample(&m2, GAUGE, "db.g", 5) == 0);
+    fail_unless(metrics_set_update(&m2, "api.s", "a") == 0);
+    fail_unless(metrics_set_update(&m2, "db.s", "a") == 0);
+    m2.inputs = 10;
+
+    // Only the names under the prefix are merged
+    fail_unless(metrics_add_sample(&m1, COUNTER, "api.c", 10) == 0);
+    fail_unless(metrics_merge_prefix(&m1, &m2, "api.") == 0);
+    fail_unless(counter_sum(counter_map_get(&m1.counters, "api.c")) == 30);
+    fail_unless(counter_map_get(&m1.counters, "db.c") == NULL);
+    fail_unless(gauge_map_get(&m1.gauges, "api.g")->value == 5);
+    fail_unless(gauge_map_get(&m1.gauges, "db.g") == NULL);
+    fail_unless(hashmap_size(m1.timers) == 1);
+    fail_unless(hashmap_size(m1.sets) == 1);
+    fail_unless(m1.kv_head->num_vals == 1);
+    fail_unless(m1.inputs == 0);
+
+    // The source is unchanged
+    fail_unless(counter_sum(counter_map_get(&m2.counters, "api.c")) == 20);
+    fail_unless(counter_map_size(&m2.counters) == 2);
+
+    fail_unless(destroy_metrics(&m1) == 0);
+    fail_unless(destroy_metrics(&m2) == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_merge_accuracy)
+{
+    metrics m1, m2;
+    fail_unless(init_metrics_defaults(&m1) == 0);
+    fail_unless(init_metrics_defaults(&m2) == 0);
+
+    // The second object makes smaller timers and sets
+    metrics_set_accuracy(&m2, m1.timer_eps * 4, m1.tdigest_compression / 4, m1.set_precision - 2);
+    char val[32];
+    for (int i=0; i < 10000; i++) {
+        snprintf(val, sizeof(val), "%d", i);
+        metrics_add_sample((i % 2) ? &m1 : &m2, TIMER, "t", i);
+        metrics_set_update((i % 2) ? &m1 : &m2, "s", val);
+    }
+
+    // They merge at the lower accuracy
+    fail_unless(metrics_merge(&m1, &m2) == 0);
+    set_t *s = metrics_get_set(&m1, "s");
+    fail_unless(s->store.h.precision == m2.set_precision);
+    double size = set_size(s);
+    fail_unless(size > 9500 && size < 10500);
+    metric_type type = TIMER;
+    timer_hist *t = metrics_get_metric(&m1, &type, "t");
+    fail_unless(timer_count(&t->tm) == 10000);
+    double p50 = timer_query(&t->tm, 0.5);
+    fail_unless(p50 > 4500 && p50 < 5500);
+
+    fail_unless(destroy_metrics(&m1) == 0);
+    fail_unless(destroy_metrics(&m2) == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_set_precisions)
+{
+    set_config c2 = {"ips.", 0.05, 9};
+    set_config c1 = {"users.", 0.005, 16, &c2};
+    statsite_config config;
+    fail_unless(config_from_filename(NULL, &config) == 0);
+    config.set_configs = &c1;
+    fail_unless(build_prefix_tree(&config) == 0);
+
+    metrics m;
+    fail_unless(init_metrics_defaults(&m) == 0);
+    metrics_set_precisions(&m, config.set_precisions);
+
+    // Sets under a prefix get its precision, which the budget does not lower
+    metrics_set_accuracy(&m, m.timer_eps, m.tdigest_compression, 10);
+    fail_unless(metrics_set_update(&m, "users.daily", "a") == 0);
+    fail_unless(metrics_set_update(&m, "ips.seen", "a") == 0);
+    fail_unless(metrics_set_update(&m, "other", "a") == 0);
+    fail_unless(metrics_get_set(&m, "users.daily")->store.s.precision == 16);
+    fail_unless(metrics_get_set(&m, "ips.seen")->store.s.precision == 9);
+    fail_unless(metrics_get_set(&m, "other")->store.s.precision == 10);
+
+    fail_unless(destroy_metrics(&m) == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_reconfigure)
+{
+    metrics m;
+    double quants[] = {0.5, 0.9};
+    fail_unless(init_metrics(0.01, quants, 2, NULL, 12, &m) == 0);
+    double *old = m.quantiles;
+
+    // The same settings keep the copy of the quantiles
+    fail_unless(metrics_reconfigure(&m, 0.01, quants, 2, NULL, 12) == 0);
+    fail_unless(m.quantiles == old);
+
+    // New quantiles are used by the new timers
+    double new_quants[] = {0.99};
+    fail_unless(metrics_reconfigure(&m, 0.02, new_quants, 1, NULL, 10) == 0);
+    fail_unless(m.num_quants == 1 && m.quantiles[0] == 0.99);
+    fail_unless(m.timer_eps == 0.02 && m.set_precision == 10);
+    fail_unless(metrics_add_sample(&m, TIMER, "t", 1) == 0);
+    timer_hist *t;
+    fail_unless(hashmap_get(m.timers, "t", (void**)&t) == 0);
+    fail_unless(t->num_quants == 1 && t->tm.q.cm.eps == 0.02);
+
+    fail_unless(destroy_metrics(&m) == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_set_hashes)
+{
+    metrics m;
+    fail_unless(init_metrics_defaults(&m) == 0);
+
+    // Hashed members are added as is, including the zero hash
+    uint64_t hashes[] = {0x9e3779b97f4a7c15, 0, 0xbf58476d1ce4e5b9, 0};
+    fail_unless(metrics_add_set_hashes(&m, "s", hashes, 4) == 0);
+    fail_unless(metrics_add_set_hashes(&m, "s", hashes, 1) == 0);
+    set_t *s = metrics_get_set(&m, "s");
+    fail_unless(set_size(s) == 3);
+
+    // They match the hashes of string members
+    uint64_t h = hash_key("foo", 3);
+    fail_unless(metrics_set_update(&m, "s2", "foo") == 0);
+    fail_unless(metrics_add_set_hashes(&m, "s2", &h, 1) == 0);
+    fail_unless(set_size(metrics_get_set(&m, "s2")) == 1);
+
+    fail_unless(destroy_metrics(&m) == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_inputs)
+{
+    metrics m1, m2;
+    fail_unless(init_metrics_defaults(&m1) == 0);
+    fail_unless(init_metrics_defaults(&m2) == 0);
+    fail_unless(m1.inputs == 0);
+
+    // Input counts are added on merge
+    m1.inputs = 10;
+    m2.inputs = 32;
+    fail_unless(metrics_merge(&m1, &m2) == 0);
+    fail_unless(m1.inputs == 42);
+
+    // Folded into a counter with a single lookup
+    fail_unless(metrics_add_counter_samples(&m1, "inputs", 1, m1.inputs) == 0);
+    counter *c = counter_map_get(&m1.counters, "inputs");
+    fail_unless(c != NULL);
+    fail_unless(counter_count(c) == 42);
+    fail_unless(counter_sum(c) == 42);
+
+    fail_unless(metrics_clear(&m1) == 0);
+    fail_unless(m1.inputs == 0);
+
+    fail_unless(destroy_metrics(&m1) == 0);
+    fail_unless(destroy_metrics(&m2) == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_clear_reuse)
+{
+    metrics m;
+    fail_unless(init_metrics_defaults(&m) == 0);
+
+    char buf[100];
+    for (int i=0; i < 1000; i++) {
+        snprintf((char*)&buf, 100, "key%d", i);
+        fail_unless(metrics_add_sample(&m, COUNTER, (char*)&buf, 1) == 0);
+        fail_unless(metrics_add_sample(&m, TIMER, (char*)&buf, i) == 0);
+        fail_unless(metrics_set_update(&m, (char*)&buf, "a") == 0);
+        fail_unless(metrics_add_sample(&m, GAUGE, (char*)&buf, i) == 0);
+    }
+    fail_unless(metrics_add_sample(&m, KEY_VAL, "kv", 1) == 0);
+
+    // Nothing should remain
+    fail_unless(metrics_clear(&m) == 0);
+    fail_unless(m.kv_head == NULL);
+    fail_unless(counter_map_size(&m.counters) == 0);
+    fail_unless(hashmap_size(m.timers) == 0);
+    fail_unless(hashmap_size(m.sets) == 0);
+    fail_unless(gauge_map_size(&m.gauges) == 0);
+
+    // Should be usable again
+    fail_unless(metrics_add_sample(&m, KEY_VAL, "test", 100) == 0);
+    fail_unless(metrics_add_sample(&m, COUNTER, "foo", 4) == 0);
+    fail_unless(counter_map_size(&m.counters) == 1);
+
+    int okay = 0;
+    fail_unless(metrics_iter(&m, (void*)&okay, iter_test_cb) == 0);
+    fail_unless(okay == 1);
+
+    fail_unless(destroy_metrics(&m) == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_get_metric)
+{
+    metrics m;
+    fail_unless(init_metrics_defaults(&m) == 0);
+    uint64_t gen = m.generation;
+
+    // Samples can be added to the resolved metrics
+    double vals[] = {1, 2, 3};
+    metric_type type = COUNTER;
+    counter *c = metrics_get_metric(&m, &type, "foo");
+    fail_unless(c != NULL);
+    fail_unless(type == COUNTER);
+    fail_unless(metrics_add_to(&m, COUNTER, c, vals, 3) == 0);
+    fail_unless(counter_sum(c) == 6);
+    fail_unless(metrics_get_metric(&m, &type, "foo") == c);
+
+    type = TIMER;
+    timer_hist *t = metrics_get_metric(&m, &type, "foo");
+    fail_unless(metrics_add_to(&m, TIMER, t, vals, 3) == 0);
+    fail_unless(timer_count(&t->tm) == 3);
+
+    type = GAUGE_DELTA;
+    gauge_t *g = metrics_get_metric(&m, &type, "foo");
+    fail_unless(type == GAUGE_DELTA);
+    fail_unless(metrics_add_to(&m, GAUGE_DELTA, g, vals, 3) == 0);
+    fail_unless(g->value == 6);
+    fail_unless(metrics_add_to(&m, GAUGE, g, vals, 1) == 0);
+    fail_unless(g->value == 1);
+
+    // K/V pairs and sets have no metric struct
+    type = KEY_VAL;
+    fail_unless(metrics_get_metric(&m, &type, "foo") == NULL);
+    type = SET;
+    fail_unless(metrics_get_metric(&m, &type, "foo") == NULL);
+
+    // Clearing changes the generation
+    fail_unless(m.generation == gen);
+    fail_unless(metrics_clear(&m) == 0);
+    fail_unless(m.generation != gen);
+
+    fail_unless(destroy_metrics(&m) == 0);
+}
+END_TEST
+
+static int iter_kv_order(void *data, metric_type type, char *key, void *val) {
+    int *next = data;
+    char buf[32];
+    snprintf(buf, sizeof(buf), "kv%d", *next);
+    if (type != KEY_VAL || strcmp(key, buf) || *(double*)val != *next) return 1;
+    (*next)++;
+    return 0;
+}
+
+START_TEST(test_metrics_kv_chunks)
+{
+    metrics m, m2;
+    fail_unless(init_metrics_defaults(&m) == 0);
+    fail_unless(init_metrics_defaults(&m2) == 0);
+
+    // Span several chunks
+    char buf[32];
+    int num = KV_CHUNK_SIZE * 3 + 10;
+    for (int i=0; i < num; i++) {
+        snprintf(buf, sizeof(buf), "kv%d", i);
+        fail_unless(metrics_add_sample(&m, KEY_VAL, buf, i) == 0);
+    }
+    fail_unless(m.kv_tail->num_vals == 10);
+
+    // The pairs are iterated in the order they were added
+    int next = 0;
+    fail_unless(metrics_iter(&m, &next, iter_kv_order) == 0);
+    fail_unless(next == num);
+
+    // Merging keeps the order, and copies the names
+    fail_unless(metrics_merge(&m2, &m) == 0);
+    fail_unless(metrics_clear(&m) == 0);
+    next = 0;
+    fail_unless(metrics_iter(&m2, &next, iter_kv_order) == 0);
+    fail_unless(next == num);
+
+    fail_unless(destroy_metrics(&m) == 0);
+    fail_unless(destroy_metrics(&m2) == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_inline_grow)
+{
+    metrics m;
+    fail_unless(init_metrics_defaults(&m) == 0);
+
+    // Cache a pointer, as the bound keys do
+    metric_type type = COUNTER;
+    counter *c = metrics_get_metric(&m, &type, "first");
+    fail_unless(c != NULL);
+    uint64_t gen = m.generation;
+
+    // Growing the maps moves the values, and changes the generation
+    char buf[100];
+    for (int i=0; i < 1000; i++) {
+        snprintf((char*)&buf, 100, "key%d", i);
+        fail_unless(metrics_add_sample(&m, COUNTER, (char*)&buf, i) == 0);
+        fail_unless(metrics_add_sample(&m, GAUGE, (char*)&buf, i) == 0);
+    }
+    fail_unless(m.generation != gen);
+    fail_unless(counter_map_size(&m.counters) == 1001);
+    fail_unless(gauge_map_size(&m.gauges) == 1000);
+
+    // The values are kept when moved
+    for (int i=0; i < 1000; i++) {
+        snprintf((char*)&buf, 100, "key%d", i);
+        c = counter_map_get(&m.counters, (char*)&buf);
+        fail_unless(c != NULL);
+        fail_unless(counter_count(c) == 1);
+        fail_unless(counter_sum(c) == i);
+
+        gauge_t *g = gauge_map_get(&m.gauges, (char*)&buf);
+        fail_unless(g != NULL);
+        fail_unless(g->value == i);
+        fail_unless(g->is_set);
+    }
+    fail_unless(counter_map_get(&m.counters, "missing") == NULL);
+
+    // Updating existing keys does not
+    gen = m.generation;
+    fail_unless(metrics_add_sample(&m, COUNTER, "key1", 1) == 0);
+    fail_unless(metrics_add_sample(&m, GAUGE_DELTA, "key1", 1) == 0);
+    fail_unless(m.generation == gen);
+    fail_unless(gauge_map_get(&m.gauges, "key1")->value == 2);
+
+    fail_unless(destroy_metrics(&m) == 0);
+}
+END_TEST
+
+static int iter_sums(void *data, metric_type type, char *key, void *val) {
+    int *seen = data;
+    if (type == COUNTER_SUM && !strcmp(key, "sum.a")) {
+        fail_unless(*(double*)val == 11);
+        seen[0]++;
+    } else if (type == COUNTER && !strcmp(key, "sum.full.b")) {
+        fail_unless(counter_count(val) == 2);
+        fail_unless(counter_sum(val) == 3);
+        seen[1]++;
+    } else if (type == COUNTER && !strcmp(key, "other")) {
+        fail_unless(counter_sum(val) == 4);
+        seen[2]++;
+    } else {
+        fail_unless(0);
+    }
+    return 0;
+}
+
+START_TEST(test_metrics_counter_sum_only)
+{
+    // Counters under sum. only keep a sum, except under sum.full.
+    counter_config c1 = {"sum.", true, NULL, 1};
+    counter_config c2 = {"sum.full.", false, &c1, 1};
+    statsite_config config;
+    memset(&config, 0, sizeof(config));
+    config.counter_configs = &c2;
+    fail_unless(build_prefix_tree(&config) == 0);
+
+    metrics m, m2;
+    fail_unless(init_metrics_defaults(&m) == 0);
+    fail_unless(init_metrics_defaults(&m2) == 0);
+    metrics_set_counter_mode(&m, false, config.counter_modes);
+    metrics_set_counter_mode(&m2, false, config.counter_modes);
+
+    fail_unless(metrics_add_sample(&m, COUNTER, "sum.a", 1) == 0);
+    fail_unless(metrics_add_counter_samples(&m, "sum.a", 2, 2) == 0);
+    fail_unless(metrics_add_sample(&m, COUNTER, "sum.full.b", 1) == 0);
+    fail_unless(metrics_add_sample(&m, COUNTER, "sum.full.b", 2) == 0);
+    fail_unless(metrics_add_sample(&m, COUNTER, "other", 4) == 0);
+    fail_unless(sum_map_size(&m.sums) == 1);
+    fail_unless(counter_map_size(&m.counters) == 2);
+
+    // Bound keys add to the sum
+    double vals[] = {1, 1};
+    metric_type type = COUNTER;
+    double *sum = metrics_get_metric(&m, &type, "sum.a");
+    fail_unless(type == COUNTER_SUM);
+    fail_unless(metrics_add_to(&m, type, sum, vals, 2) == 0);
+    fail_unless(*sum == 7);
+
+    // Merging keeps the modes
+    fail_unless(metrics_add_sample(&m2, COUNTER, "sum.a", 4) == 0);
+    fail_unless(metrics_merge(&m2, &m) == 0);
+    int seen[3] = {0, 0, 0};
+    fail_unless(metrics_iter(&m2, seen, iter_sums) == 0);
+    fail_unless(seen[0] == 1 && seen[1] == 1 && seen[2] == 1);
+
+    // The default applies without a matching prefix
+    metrics_set_counter_mode(&m, true, NULL);
+    fail_unless(metrics_clear(&m) == 0);
+    fail_unless(metrics_add_sample(&m, COUNTER, "other", 4) == 0);
+    fail_unless(sum_map_size(&m.sums) == 1);
+    fail_unless(counter_map_size(&m.counters) == 0);
+
+    fail_unless(destroy_metrics(&m) == 0);
+    fail_unless(destroy_metrics(&m2) == 0);
+}
+END_TEST
+
+// Counts the K/V pairs streamed, checking the coalesced values
+static int iter_kv_coalesce(void *data, metric_type type, char *key, void *val) {
+    int *seen = data;
+    if (type != KEY_VAL) return 0;
+    double v = *(double*)val;
+    if (!strcmp(key, "last.a")) fail_unless(v == 3);
+    else if (!strcmp(key, "sum.a")) fail_unless(v == 12);
+    else if (!strcmp(key, "min.a")) fail_unless(v == 1);
+    else if (!strcmp(key, "max.a")) fail_unless(v == 5);
+    else if (!strcmp(key, "mean.a")) fail_unless(v == 3);
+    else if (!strcmp(key, "all.a")) seen[1]++;
+    seen[0]++;
+    return 0;
+}
+
+START_TEST(test_metrics_kv_coalesce)
+{
+    kv_config c1 = {"last.", KV_LAST, NULL, 1};
+    kv_config c2 = {"sum.", KV_SUM, &c1, 1};
+    kv_config c3 = {"min.", KV_MIN, &c2, 1};
+    kv_config c4 = {"max.", KV_MAX, &c3, 1};
+    kv_config c5 = {"mean.", KV_MEAN, &c4, 1};
+    kv_config c6 = {"sum.all.", KV_ALL, &c5, 1};
+    statsite_config config;
+    memset(&config, 0, sizeof(config));
+    config.kv_configs = &c6;
+    fail_unless(build_prefix_tree(&config) == 0);
+
+    metrics m, m2;
+    fail_unless(init_metrics_defaults(&m) == 0);
+    fail_unless(init_metrics_defaults(&m2) == 0);
+    metrics_set_kv_modes(&m, config.kv_modes);
+    metrics_set_kv_modes(&m2, config.kv_modes);
+
+    // Each coalesced key is kept once, the rest every sample
+    char *names[] = {"last.a", "sum.a", "min.a", "max.a", "mean.a", "all.a"};
+    double first[] = {5, 1, 3}, second[] = {3};
+    for (int i=0; i < 6; i++) {
+        for (int j=0; j < 3; j++) {
+            fail_unless(metrics_add_sample(&m, KEY_VAL, names[i], first[j]) == 0);
+        }
+        fail_unless(metrics_add_sample(&m2, KEY_VAL, names[i], second[0]) == 0);
+    }
+    fail_unless(metrics_add_sample(&m, KEY_VAL, "sum.all.b", 1) == 0);
+    fail_unless(kv_map_size(&m.kvs) == 5);
+
+    // Merging coalesces the later interval into the values
+    fail_unless(metrics_merge(&m, &m2) == 0);
+    fail_unless(kv_map_size(&m.kvs) == 5);
+    int seen[2] = {0, 0};
+    fail_unless(metrics_iter(&m, seen, iter_kv_coalesce) == 0);
+    fail_unless(seen[0] == 10);
+    fail_unless(seen[1] == 4);
+
+    // Clearing drops the coalesced pairs
+    fail_unless(metrics_clear(&m) == 0);
+    fail_unless(kv_map_size(&m.kvs) == 0);
+
+    fail_unless(destroy_metrics(&m) == 0);
+    fail_unless(destroy_metrics(&m2) == 0);
+}
+END_TEST
+
+static int iter_limits(void *data, metric_type type, char *key, void *val) {
+    int *seen = data;
+    if (type == COUNTER && !strcmp(key, "req.__overflow__")) {
+        fail_unless(counter_count(val) == 11);
+        seen[0]++;
+    } else if (type == TIMER && !strcmp(key, "req.__overflow__")) {
+        fail_unless(timer_count(&((timer_hist*)val)->tm) == 2);
+        seen[1]++;
+    } else if (!strncmp(key, "req.", 4)) {
+        seen[2]++;
+    } else {
+        seen[3]++;
+    }
+    return 0;
+}
+
+// Records the name of each metric by its type
+static int iter_names(void *data, metric_type type, char *key, void *val) {
+    char **names = data;
+    names[type] = key;
+    return 0;
+}
+
+START_TEST(test_metrics_interning)
+{
+    metrics m;
+    fail_unless(init_metrics_defaults(&m) == 0);
+    fail_unless(metrics_set_interning(&m, 2) == 0);
+
+    char *first[COUNTER_SUM + 1] = {0}, *second[COUNTER_SUM + 1] = {0};
+    char *long_timer = "a.long.timer.name.that.is.not.stored.inline";
+    fail_unless(metrics_add_sample(&m, COUNTER, "api.requests", 1) == 0);
+    fail_unless(metrics_add_sample(&m, GAUGE, "api.queue", 1) == 0);
+    fail_unless(metrics_add_sample(&m, TIMER, long_timer, 1) == 0);
+    fail_unless(metrics_set_update(&m, "api.users", "bob") == 0);
+    fail_unless(metrics_iter(&m, first, iter_names) == 0);
+
+    // The next interval takes the same copies of the names
+    fail_unless(metrics_clear(&m) == 0);
+    fail_unless(metrics_add_sample(&m, COUNTER, "api.requests", 2) == 0);
+    fail_unless(metrics_add_sample(&m, GAUGE, "api.queue", 2) == 0);
+    fail_unless(metrics_add_sample(&m, TIMER, long_timer, 2) == 0);
+    fail_unless(metrics_set_update(&m, "api.users", "alice") == 0);
+    fail_unless(metrics_iter(&m, second, iter_names) == 0);
+    fail_unless(first[COUNTER] == second[COUNTER]);
+    fail_unless(first[GAUGE] == second[GAUGE]);
+    fail_unless(first[TIMER] == second[TIMER]);
+    fail_unless(first[SET] == second[SET]);
+    fail_unless(strcmp(second[TIMER], long_timer) == 0);
+    // The open addressing hashmap stores the short set name inline
+    fail_unless(intern_size(m.names) >= 3);
+
+    // Names unused for longer than the idle intervals are released
+    for (int i=0; i < 4; i++) fail_unless(metrics_clear(&m) == 0);
+    fail_unless(intern_size(m.names) == 0);
+    fail_unless(destroy_metrics(&m) == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_top_keys)
+{
+    metrics m, m2;
+    fail_unless(init_metrics_defaults(&m) == 0);
+    fail_unless(init_metrics_defaults(&m2) == 0);
+    fail_unless(m.top_samples == NULL);
+    fail_unless(metrics_set_top_keys(&m, 8) == 0);
+    fail_unless(metrics_set_top_keys(&m2, 8) == 0);
+
+    metrics_track_key(&m, "small", 1, 100);
+    metrics_track_key(&m, "busy", 10, 10);
+    metrics_track_key(&m2, "busy", 5, 5);
+
+    // The summaries of the shards are merged
+    fail_unless(metrics_merge(&m, &m2) == 0);
+    topk_entry top[2];
+    fail_unless(topk_top(m.top_samples, top, 2) == 2);
+    fail_unless(strcmp(top[0].key, "busy") == 0 && top[0].count == 15);
+    fail_unless(topk_top(m.top_bytes, top, 2) == 2);
+    fail_unless(strcmp(top[0].key, "small") == 0 && top[0].count == 100);
+
+    // Each interval starts over
+    fail_unless(metrics_clear(&m) == 0);
+    fail_unless(topk_top(m.top_samples, top, 2) == 0);
+    fail_unless(destroy_metrics(&m) == 0);
+    fail_unless(destroy_metrics(&m2) == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_add_sample_hash)
+{
+    metrics m;
+    fail_unless(init_metrics_defaults(&m) == 0);
+
+    // Prefetched and hashed samples update the same metrics
+    uint64_t hash = hash_key("api.requests", strlen("api.requests"));
+    metrics_prefetch(&m, COUNTER, hash);
+    fail_unless(metrics_add_sample_hash(&m, COUNTER, "api.requests", hash, 2) == 0);
+    fail_unless(metrics_add_sample(&m, COUNTER, "api.requests", 3) == 0);
+    counter *c = counter_map_get(&m.counters, "api.requests");
+    fail_unless(c != NULL && counter_count(c) == 2 && counter_sum(c) == 5);
+
+    hash = hash_key("api.latency", strlen("api.latency"));
+    metrics_prefetch(&m, TIMER, hash);
+    fail_unless(metrics_add_sample_hash(&m, TIMER, "api.latency", hash, 10) == 0);
+    fail_unless(metrics_add_sample(&m, TIMER, "api.latency", 20) == 0);
+    fail_unless(hashmap_size(m.timers) == 1);
+
+    hash = hash_key("api.users", strlen("api.users"));
+    metrics_prefetch(&m, SET, hash);
+    fail_unless(metrics_set_update_hash(&m, "api.users", hash, "bob") == 0);
+    fail_unless(metrics_set_update(&m, "api.users", "alice") == 0);
+    fail_unless(set_size(metrics_get_set(&m, "api.users")) == 2);
+    fail_unless(destroy_metrics(&m) == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_limits)
+{
+    // Keys under req. are limited to 4, and the rest are not
+    limit_config l1 = {"req.", 4, NULL, 3, 0, NULL};
+    statsite_config config;
+    memset(&config, 0, sizeof(config));
+    config.limit_configs = &l1;
+    fail_unless(build_prefix_tree(&config) == 0);
+
+    metrics m, m2;
+    fail_unless(init_metrics_defaults(&m) == 0);
+    fail_unless(init_metrics_defaults(&m2) == 0);
+    metrics_set_limits(&m, config.limits, config.num_limits);
+    metrics_set_limits(&m2, config.limits, config.num_limits);
+
+    // The first keys are kept, and seen again without counting
+    char key[32];
+    for (int i=0; i < 3; i++) {
+        snprintf(key, sizeof(key), "req.%d", i);
+        fail_unless(metrics_add_sample(&m, COUNTER, key, 1) == 0);
+        fail_unless(metrics_add_sample(&m, COUNTER, key, 1) == 0);
+    }
+    fail_unless(metrics_set_update(&m, "req.set", "a") == 0);
+    fail_unless(m.limit_keys[0] == 4);
+
+    // Later keys of every type fold into the overflow key
+    for (int i=3; i < 8; i++) {
+        snprintf(key, sizeof(key), "req.%d", i);
+        fail_unless(metrics_add_sample(&m, COUNTER, key, 1) == 0);
+    }
+    fail_unless(metrics_add_sample(&m, TIMER, "req.t1", 1) == 0);
+    fail_unless(metrics_add_sample(&m, TIMER, "req.t2", 2) == 0);
+    fail_unless(metrics_add_sample(&m, GAUGE, "req.g", 2) == 0);
+    fail_unless(metrics_set_update(&m, "req.set", "b") == 0);
+    fail_unless(metrics_add_sample(&m, COUNTER, "other.a", 1) == 0);
+    fail_unless(counter_map_size(&m.counters) == 5);
+    fail_unless(gauge_map_size(&m.gauges) == 1);
+
+    // Merging applies the limits again, so the kept keys
+    // of m are folded too, as m2 already has its 4 keys
+    for (int i=0; i < 4; i++) {
+        snprintf(key, sizeof(key), "req.m%d", i);
+        fail_unless(metrics_add_sample(&m2, COUNTER, key, 1) == 0);
+    }
+    fail_unless(metrics_merge(&m2, &m) == 0);
+    int seen[4] = {0, 0, 0, 0};
+    fail_unless(metrics_iter(&m2, seen, iter_limits) == 0);
+    fail_unless(seen[0] == 1 && seen[1] == 1);
+    fail_unless(seen[2] == 6);
+    fail_unless(seen[3] == 1);
+
+    // Each interval starts with the full limits
+    fail_unless(metrics_clear(&m) == 0);
+    fail_unless(m.limit_keys[0] == 0);
+    fail_unless(metrics_add_sample(&m, COUNTER, "req.new", 1) == 0);
+    fail_unless(counter_map_get(&m.counters, "req.new") != NULL);
+
+    fail_unless(destroy_metrics(&m) == 0);
+    fail_unless(destroy_metrics(&m2) == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_merge_sketch)
+{
+    metrics m, up;
+    fail_unless(init_metrics_defaults(&m) == 0);
+    fail_unless(init_metrics_defaults(&up) == 0);
+    char key[32];
+    for (int i=0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "v%d", i);
+        fail_unless(metrics_set_update(&m, "s", key) == 0);
+        fail_unless(metrics_add_sample(&m, TIMER, "t", i) == 0);
+    }
+    fail_unless(metrics_add_sample(&m, COUNTER, "c", 2) == 0);
+    fail_unless(metrics_add_sample(&m, COUNTER, "c", 3) == 0);
+    fail_unless(metrics_add_sample(&up, COUNTER, "c", 1) == 0);
+
+    // Merge the sketches of each metric, as an upstream node would
+    char *buf;
+    size_t len;
+    FILE *f = open_memstream(&buf, &len);
+    fail_unless(sketch_encode_counter(f, counter_map_get(&m.counters, "c")) == 0);
+    fclose(f);
+    fail_unless(metrics_merge_sketch(&up, "c", buf, len) == (int)len);
+    free(buf);
+
+    set_t *s;
+    fail_unless(hashmap_get(m.sets, "s", (void**)&s) == 0);
+    f = open_memstream(&buf, &len);
+    fail_unless(sketch_encode_set(f, s) == 0);
+    fclose(f);
+    fail_unless(metrics_merge_sketch(&up, "s", buf, len) == (int)len);
+    fail_unless(metrics_merge_sketch(&up, "s", buf, len - 1) == -1);
+    free(buf);
+
+    timer_hist *t;
+    fail_unless(hashmap_get(m.timers, "t", (void**)&t) == 0);
+    f = open_memstream(&buf, &len);
+    fail_unless(sketch_encode_timer(f, &t->tm) == 0);
+    fclose(f);
+    fail_unless(metrics_merge_sketch(&up, "t", buf, len) == (int)len);
+    fail_unless(metrics_merge_sketch(&up, "t", buf, len) == (int)len);
+    free(buf);
+
+    counter *c = counter_map_get(&up.counters, "c");
+    fail_unless(counter_count(c) == 3 && counter_sum(c) == 6 && counter_min(c) == 1);
+    fail_unless(hashmap_get(up.sets, "s", (void**)&s) == 0);
+    fail_unless(s->type == APPROX && fabs(set_size(s) - 1000.0) < 30);
+    timer_hist *ut;
+    fail_unless(hashmap_get(up.timers, "t", (void**)&ut) == 0);
+    fail_unless(timer_count(&ut->tm) == 2000 && timer_sum(&ut->tm) == 2 * timer_sum(&t->tm));
+    fail_unless(fabs(timer_query(&ut->tm, 0.5) - 500) < 20);
+
+    // Unknown kinds are rejected
+    char bad[] = {9, SKETCH_VERSION, 0, 0};
+    fail_unless(metrics_merge_sketch(&up, "x", bad, sizeof(bad)) == -1);
+    fail_unless(destroy_metrics(&m) == 0);
+    fail_unless(destroy_metrics(&up) == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_fit)
+{
+    metrics m;
+    fail_unless(init_metrics_defaults(&m) == 0);
+
+    char name[32];
+    for (int i=0; i < 5000; i++) {
+        snprintf(name, sizeof(name), "c%d", i);
+        fail_unless(metrics_add_sample(&m, COUNTER, name, 1) == 0);
+        snprintf(name, sizeof(name), "t%d", i);
+        fail_unless(metrics_add_sample(&m, TIMER, name, 1) == 0);
+    }
+
+    // Fit to the keys of a quiet interval once cleared
+    metrics_sizes sizes;
+    memset(&sizes, 0, sizeof(sizes));
+    sizes.counters = 10;
+    sizes.timers = 10;
+    fail_unless(metrics_fit(&m, &sizes) == -1);
+    fail_unless(metrics_clear(&m) == 0);
+    fail_unless(metrics_fit(&m, &sizes) == 0);
+
+    // The fit maps still take and find keys
+    counter *c;
+    for (int i=0; i < 100; i++) {
+        snprintf(name, sizeof(name), "c%d", i);
+        fail_unless(metrics_add_sample(&m, COUNTER, name, 2) == 0);
+    }
+    for (int i=0; i < 100; i++) {
+        snprintf(name, sizeof(name), "c%d", i);
+        c = counter_map_get(&m.counters, name);
+        fail_unless(c && counter_sum(c) == 2);
+    }
+    fail_unless(destroy_metrics(&m) == 0);
+}
+END_TEST
+
+START_TEST(test_metrics_histogram_sparse)
+{
+    statsite_config config;
+    int res = config_from_filename(NULL, &config);
+
+    // A wide histogram of 1002 bins
+    histogram_config c1 = {"foo", 0, 1000, 1, 0, NULL, 0};
+    config.hist_configs = &c1;
+    fail_unless(sane_histograms(config.hist_configs) == 0);
+    fail_unless(build_prefix_tree(&config) == 0);
+
+    metrics m, other;
+    double quants[] = {0.5, 0.90, 0.99};
+    fail_unless(init_metrics(0.01, (double*)&quants, 3, config.histograms, 12, &m) == 0);
+    fail_unless(init_metrics(0.01, (double*)&quants, 3, config.histograms, 12, &other) == 0);
+
+    // The few used bins are kept sparsely, out of order
+    double vals[] = {500.5, -1, 2000, 3.5, 500.2};
+    fail_unless(metrics_add_timer_samples(&m, "foo", vals, 5) == 0);
+    timer_hist *t;
+    fail_unless(hashmap_get(m.timers, "foo", (void**)&t) == 0);
+    fail_unless(t->counts == NULL && t->num_sparse == 4);
+    fail_unless(timer_hist_num_bins(t) == 1002);
+    fail_unless(timer_hist_count(t, 0) == 1);
+    fail_unless(timer_hist_count(t, 4) == 1);
+    fail_unless(timer_hist_count(t, 501) == 2);
+    fail_unless(timer_hist_count(t, 1001) == 1);
+    fail_unless(timer_hist_count(t, 5) == 0);
+
+    // Merged into a sparse timer, it stays sparse
+    fail_unless(metrics_add_sample(&other, TIMER, "foo", 3.5) == 0);
+    fail_unless(metrics_merge(&other, &m) == 0);
+    timer_hist *o;
+    fail_unless(hashmap_get(other.timers, "foo", (void**)&o) == 0);
+    fail_unless(o->counts == NULL && timer_hist_count(o, 4) == 2 && timer_hist_count(o, 501) == 2);
+
+    // Past its sparse bins, the counts of every bin are allocated
+    for (int i=0; i < HISTOGRAM_SPARSE_BINS; i++) {
+        fail_unless(metrics_add_sample(&m, TIMER, "foo", 100 + i) == 0);
+    }
+    fail_unless(t->counts != NULL && t->sparse == NULL);
+    fail_unless(timer_hist_count(t, 0) == 1);
+    fail_unless(timer_hist_count(t, 501) == 2);
+    fail_unless(timer_hist_count(t, 1 + 100 + HISTOGRAM_SPARSE_BINS - 1) == 1);
+    fail_unless(metrics_merge(&other, &m) == 0);
+    fail_unless(o->counts != NULL && timer_hist_count(o, 4) == 3 && timer_hist_count(o, 501) == 4);
+
+    fail_unless(destroy_metrics(&m) == 0);
+    fail_unless(destroy_metrics(&other) == 0);
+}
+END_TEST
@@ -0,0 +1,109 @@
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "name_map.h"
+#include "metrics.h"
+
+START_TEST(test_name_map_init)
+{
+    name_map m;
+    fail_unless(init_name_map(NULL, NULL, NULL, NULL, &m) == 0);
+    fail_unless(m.chars['a'] == 'a');
+    fail_unless(m.prefix_len == 0 && m.suffix_len == 0);
+    destroy_name_map(&m);
+
+    // The last replacement repeats, as tr does
+    fail_unless(init_name_map("/:\\s", "_", "statsite.", "-host", &m) == 0);
+    fail_unless(m.chars['/'] == '_');
+    fail_unless(m.chars[':'] == '_');
+    fail_unless(m.chars[' '] == '_');
+    fail_unless(m.chars['.'] == '.');
+    fail_unless(m.prefix_len == 9 && m.suffix_len == 5);
+    destroy_name_map(&m);
+
+    fail_unless(init_name_map("ab\\\\", "xy\\t", NULL, NULL, &m) == 0);
+    fail_unless(m.chars['a'] == 'x');
+    fail_unless(m.chars['b'] == 'y');
+    fail_unless(m.chars['\\'] == '\t');
+    destroy_name_map(&m);
+
+    // The characters must pair up
+    fail_unless(init_name_map("/", NULL, NULL, NULL, &m) == -1);
+    fail_unless(init_name_map("/", "", NULL, NULL, &m) == -1);
+    fail_unless(init_name_map("/", "_-", NULL, NULL, &m) == -1);
+    fail_unless(init_name_map("\\x", "_", NULL, NULL, &m) == -1);
+}
+END_TEST
+
+START_TEST(test_name_map_copy)
+{
+    char buf[64];
+    fail_unless(name_copy_size(3) == 4);
+    name_copy(buf, "a/b", 3);
+    fail_unless(!strcmp(output_name(buf), "a/b"));
+
+    name_map m;
+    fail_unless(init_name_map("/", "_", "pre.", ".suf", &m) == 0);
+    NAME_MAP = &m;
+    fail_unless(name_copy_size(3) == 4 + 4 + 3 + 4 + 1);
+    name_copy(buf, "a/b", 3);
+    fail_unless(!strcmp(buf, "a/b"));
+    fail_unless(!strcmp(output_name(buf), "pre.a_b.suf"));
+
+    arena a;
+    arena_init(0, &a);
+    char *copy = name_arena_copy(&a, "x/y/z");
+    fail_unless(!strcmp(copy, "x/y/z"));
+    fail_unless(!strcmp(output_name(copy), "pre.x_y_z.suf"));
+    arena_destroy(&a);
+
+    NAME_MAP = NULL;
+    destroy_name_map(&m);
+}
+END_TEST
+
+static int name_map_iter_cb(void *data, metric_type type, char *name, void *val) {
+    int *found = data;
+    char *out = output_name(name);
+    if (!strcmp(name, "api/req:ms") && !strcmp(out, "s.api_req_ms")) (*found)++;
+    else if (!strcmp(name, "a very long key, that does not fit a map entry") &&
+            !strcmp(out, "s.a_very_long_key__that_does_not_fit_a_map_entry")) (*found)++;
+    return 0;
+}
+
+START_TEST(test_name_map_metrics)
+{
+    name_map map;
+    fail_unless(init_name_map("/: ,", "_", "s.", NULL, &map) == 0);
+    NAME_MAP = &map;
+
+    // Every type keeps the output name with its key, across
+    // the interned intervals too
+    metrics m;
+    fail_unless(init_metrics_defaults(&m) == 0);
+    fail_unless(metrics_set_interning(&m, 1) == 0);
+    for (int i=0; i < 3; i++) {
+        metric_type types[] = {COUNTER, GAUGE, TIMER, SET};
+        for (int t=0; t < 4; t++) {
+            if (types[t] == SET) {
+                fail_unless(metrics_set_update(&m, "api/req:ms", "a") == 0);
+                fail_unless(metrics_set_update(&m,
+                            "a very long key, that does not fit a map entry", "a") == 0);
+                continue;
+            }
+            fail_unless(metrics_add_sample(&m, types[t], "api/req:ms", 1) == 0);
+            fail_unless(metrics_add_sample(&m, types[t],
+                        "a very long key, that does not fit a map entry", 1) == 0);
+        }
+        int found = 0;
+        fail_unless(metrics_iter(&m, &found, name_map_iter_cb) == 0);
+        fail_unless(found == 8);
+        fail_unless(metrics_clear(&m) == 0);
+    }
+    fail_unless(destroy_metrics(&m) == 0);
+
+    NAME_MAP = NULL;
+    destroy_name_map(&map);
+}
+END_TEST
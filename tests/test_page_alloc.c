@@ -0,0 +1,54 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "page_alloc.h"
+#include "arena.h"
+
+START_TEST(test_page_alloc_small_large)
+{
+    // Small buffers come from the heap
+    char *small = page_calloc(4096);
+    fail_unless(small != NULL);
+    for (int i=0; i < 4096; i++) fail_unless(small[i] == 0);
+    page_free(small, 4096);
+
+    // Large ones are mapped on a huge page boundary, and zeroed
+    size_t size = HUGE_PAGE_SIZE + 100;
+    char *large = page_calloc(size);
+    fail_unless(large != NULL);
+    fail_unless((uintptr_t)large % HUGE_PAGE_SIZE == 0);
+    fail_unless(large[0] == 0 && large[size-1] == 0);
+    memset(large, 1, size);
+    page_free(large, size);
+    page_free(NULL, size);
+}
+END_TEST
+
+START_TEST(test_page_alloc_huge_pages)
+{
+    // Works, with or without huge pages on this host
+    page_alloc_set_mode(HUGE_PAGES_EXPLICIT);
+    fail_unless(page_alloc_mode() == HUGE_PAGES_EXPLICIT);
+    char *buf = page_alloc(2 * HUGE_PAGE_SIZE);
+    fail_unless(buf != NULL);
+    memset(buf, 1, 2 * HUGE_PAGE_SIZE);
+    page_free(buf, 2 * HUGE_PAGE_SIZE);
+
+    page_alloc_set_mode(HUGE_PAGES_TRANSPARENT);
+    buf = page_alloc(HUGE_PAGE_SIZE);
+    fail_unless(buf != NULL);
+    memset(buf, 1, HUGE_PAGE_SIZE);
+    page_free(buf, HUGE_PAGE_SIZE);
+    page_alloc_set_mode(HUGE_PAGES_OFF);
+
+    // An arena chunk fills exactly a huge page
+    arena a;
+    fail_unless(arena_init(ARENA_HUGE_CHUNK, &a) == 0);
+    fail_unless(arena_alloc(&a, 64) != NULL);
+    fail_unless(a.allocated == ARENA_HUGE_CHUNK);
+    fail_unless((uintptr_t)a.head % HUGE_PAGE_SIZE == 0);
+    fail_unless(arena_destroy(&a) == 0);
+}
+END_TEST
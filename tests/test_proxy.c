@@ -0,0 +1,149 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "proxy.h"
+
+/**
+ * Binds a socket on an ephemeral local port,
+ * listening if it is a stream
+ */
+static int proxy_test_bind(int type, int *port) {
+    int fd = socket(AF_INET, type, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fail_unless(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    if (type == SOCK_STREAM) fail_unless(listen(fd, 4) == 0);
+
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr*)&addr, &len);
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+START_TEST(test_proxy_ring)
+{
+    proxy *p, *fewer;
+    fail_unless(proxy_init("a:8125, b:8125,c:8125", 128, false, 1, &p) == 0);
+    fail_unless(p->num_upstreams == 3 && p->num_points == 384);
+    fail_unless(proxy_init("a:8125,c:8125", 128, false, 1, &fewer) == 0);
+
+    // The keys are spread over the upstreams, and the same
+    // key lands on the same upstream however it is framed
+    int counts[3] = {0}, moved = 0;
+    char key[32];
+    for (int i=0; i < 30000; i++) {
+        int len = snprintf(key, sizeof(key), "metric.%d", i);
+        int u = proxy_route(p, key, len);
+        fail_unless(u >= 0 && u < 3);
+        fail_unless(proxy_route(p, key, len) == u);
+        counts[u]++;
+
+        // Removing an upstream only moves its own keys
+        int f = proxy_route(fewer, key, len);
+        if (u == 1) moved++;
+        else fail_unless(f == ((u == 0) ? 0 : 1));
+    }
+    for (int u=0; u < 3; u++) {
+        fail_unless(counts[u] > 7000 && counts[u] < 13000);
+    }
+    fail_unless(moved == counts[1]);
+    proxy_destroy(p);
+    proxy_destroy(fewer);
+
+    // Upstreams need a host and a port
+    fail_unless(proxy_init("a", 128, false, 1, &p) == -1);
+    fail_unless(proxy_init("a:8125,:8125", 128, false, 1, &p) == -1);
+    fail_unless(proxy_init(",", 128, false, 1, &p) == -1);
+    fail_unless(proxy_init("[::1]:8125", 16, false, 1, &p) == 0);
+    fail_unless(strcmp(p->upstreams[0].host, "::1") == 0);
+    proxy_destroy(p);
+}
+END_TEST
+
+START_TEST(test_proxy_forward_tcp)
+{
+    int port = 0;
+    int listen_fd = proxy_test_bind(SOCK_STREAM, &port);
+    char spec[64];
+    snprintf(spec, sizeof(spec), "127.0.0.1:%d", port);
+
+    proxy *p;
+    fail_unless(proxy_init(spec, 16, false, 2, &p) == 0);
+    fail_unless(proxy_forward(p, 1, 0, false, "foo:1|c\n", 8) == 0);
+    fail_unless(proxy_forward(p, 1, 0, false, "bar:2|ms\n", 9) == 0);
+    fail_unless(p->outs[2].len == 17 && p->outs[2].records == 2);
+
+    // The lines are batched until the flush
+    proxy_flush(p, 1);
+    int fd = accept(listen_fd, NULL, NULL);
+    fail_unless(fd >= 0);
+
+    // The connect may still have been in progress
+    proxy_flush(p, 1);
+    char buf[64];
+    int len = 0, res;
+    while (len < 17 && (res = read(fd, buf + len, sizeof(buf) - len)) > 0) len += res;
+    fail_unless(len == 17 && memcmp(buf, "foo:1|c\nbar:2|ms\n", 17) == 0);
+    fail_unless(p->outs[2].len == 0 && p->outs[2].records == 0);
+
+    // Binary frames use their own connection
+    unsigned char frame[] = {0xaa, 0x2, 2, 0, 0, 0, 0, 0, 0, 0, 0xf0, 0x3f, 'a', 0};
+    fail_unless(proxy_forward(p, 1, 0, true, (char*)frame, sizeof(frame)) == 0);
+    proxy_flush(p, 1);
+    int bin_fd = accept(listen_fd, NULL, NULL);
+    fail_unless(bin_fd >= 0);
+    proxy_flush(p, 1);
+    len = 0;
+    while (len < (int)sizeof(frame) && (res = read(bin_fd, buf + len, sizeof(buf) - len)) > 0) len += res;
+    fail_unless(len == sizeof(frame) && memcmp(buf, frame, sizeof(frame)) == 0);
+
+    // A record queued at shutdown is still sent
+    fail_unless(proxy_forward(p, 0, 0, false, "baz:3|g\n", 8) == 0);
+    proxy_destroy(p);
+    int last_fd = accept(listen_fd, NULL, NULL);
+    fail_unless(last_fd >= 0);
+    fail_unless(read(last_fd, buf, sizeof(buf)) == 8);
+    close(fd);
+    close(bin_fd);
+    close(last_fd);
+    close(listen_fd);
+}
+END_TEST
+
+START_TEST(test_proxy_forward_udp)
+{
+    int port = 0;
+    int udp_fd = proxy_test_bind(SOCK_DGRAM, &port);
+    char spec[64];
+    snprintf(spec, sizeof(spec), "127.0.0.1:%d", port);
+
+    proxy *p;
+    fail_unless(proxy_init(spec, 16, true, 1, &p) == 0);
+
+    // Lines fill a datagram without being split
+    char line[101], buf[2048];
+    memset(line, 'x', 99);
+    line[99] = '\n';
+    for (int i=0; i < 20; i++) {
+        fail_unless(proxy_forward(p, 0, 0, false, line, 100) == 0);
+    }
+    fail_unless(recv(udp_fd, buf, sizeof(buf), 0) == 1400);
+    proxy_flush(p, 0);
+    fail_unless(recv(udp_fd, buf, sizeof(buf), 0) == 600);
+    fail_unless(buf[599] == '\n');
+
+    // Records past the largest datagram are dropped
+    char *big = calloc(1, 70000);
+    fail_unless(proxy_forward(p, 0, 0, true, big, 70000) == -1);
+    free(big);
+    proxy_destroy(p);
+    close(udp_fd);
+}
+END_TEST
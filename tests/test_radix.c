@@ -151,3 +151,60 @@ START_TEST(test_radix_foreach)
 }
 END_TEST
 
+
+static int check_order(void *d, char *key, void *val) {
+    char **last = d;
+    if (*last && strcmp(*last, key) >= 0) return 1;
+    *last = key;
+    return 0;
+}
+
+START_TEST(test_radix_grow)
+{
+    radix_tree t;
+    fail_unless(radix_init(&t) == 0);
+
+    // Fan out on every byte value, so the nodes grow to
+    // all the sizes, both at the root and below a prefix
+    char key[4];
+    void *val;
+    for (int i=1; i < 256; i++) {
+        key[0] = i;
+        key[1] = 0;
+        val = (void*)(uintptr_t)i;
+        fail_unless(radix_insert(&t, key, &val) == 0);
+        key[0] = 'a';
+        key[1] = i;
+        key[2] = 'x';
+        key[3] = 0;
+        val = (void*)(uintptr_t)(i + 256);
+        fail_unless(radix_insert(&t, key, &val) == 0);
+    }
+
+    for (int i=1; i < 256; i++) {
+        key[0] = i;
+        key[1] = 0;
+        fail_unless(radix_search(&t, key, &val) == 0);
+        fail_unless((uintptr_t)val == (uintptr_t)i);
+        key[0] = 'a';
+        key[1] = i;
+        key[2] = 'x';
+        key[3] = 0;
+        fail_unless(radix_search(&t, key, &val) == 0);
+        fail_unless((uintptr_t)val == (uintptr_t)(i + 256));
+
+        // Longer keys match the longest prefix
+        key[3] = 'y';
+        fail_unless(radix_longest_prefix(&t, key, &val) == 0);
+        fail_unless((uintptr_t)val == (uintptr_t)(i + 256));
+    }
+
+    // Missing keys are not found
+    fail_unless(radix_search(&t, "ab", &val) == 1);
+
+    // Iteration is in byte order
+    char *last = NULL;
+    fail_unless(radix_foreach(&t, &last, check_order) == 0);
+    fail_unless(radix_destroy(&t) == 0);
+}
+END_TEST
@@ -0,0 +1,85 @@
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+#include "rate_limit.h"
+
+START_TEST(test_rate_table_init)
+{
+    rate_table t;
+    fail_unless(init_rate_table(0, 100, &t) == -1);
+    fail_unless(init_rate_table(100, 0, &t) == -1);
+    fail_unless(init_rate_table(100, 200, &t) == 0);
+    fail_unless(t.rate == 100);
+    fail_unless(t.burst == 200);
+    destroy_rate_table(&t);
+}
+END_TEST
+
+START_TEST(test_rate_bucket_refill)
+{
+    rate_table t;
+    rate_bucket b;
+    fail_unless(init_rate_table(100, 200, &t) == 0);
+
+    // Starts full, and refills at the rate up to the burst
+    rate_bucket_init(&t, &b, 10);
+    fail_unless(rate_bucket_refill(&t, &b, 10) == 200);
+    b.tokens = -50;
+    fail_unless(rate_bucket_wait(&t, &b) == 0.51);
+    fail_unless(rate_bucket_refill(&t, &b, 11) == 50);
+    fail_unless(rate_bucket_wait(&t, &b) == 0);
+    fail_unless(rate_bucket_refill(&t, &b, 20) == 200);
+
+    // Time going back does not take tokens
+    fail_unless(rate_bucket_refill(&t, &b, 5) == 200);
+    destroy_rate_table(&t);
+}
+END_TEST
+
+START_TEST(test_rate_table_take)
+{
+    rate_table t;
+    fail_unless(init_rate_table(1000, 1500, &t) == 0);
+
+    struct sockaddr_in a1, a2;
+    memset(&a1, 0, sizeof(a1));
+    a1.sin_family = AF_INET;
+    inet_pton(AF_INET, "10.0.0.1", &a1.sin_addr);
+    a2 = a1;
+    inet_pton(AF_INET, "10.0.0.2", &a2.sin_addr);
+
+    // The burst is used up, and the datagram over it is dropped whole
+    fail_unless(rate_table_take(&t, (struct sockaddr*)&a1, 0, 1000) == 1);
+    fail_unless(rate_table_take(&t, (struct sockaddr*)&a1, 0, 1000) == 0);
+    fail_unless(rate_table_take(&t, (struct sockaddr*)&a1, 0, 500) == 1);
+
+    // The port is not part of the source
+    a1.sin_port = htons(1234);
+    fail_unless(rate_table_take(&t, (struct sockaddr*)&a1, 0, 1) == 0);
+
+    // Other sources have their own bucket
+    fail_unless(rate_table_take(&t, (struct sockaddr*)&a2, 0, 1500) == 1);
+
+    // The bucket refills with time
+    fail_unless(rate_table_take(&t, (struct sockaddr*)&a1, 0.5, 600) == 0);
+    fail_unless(rate_table_take(&t, (struct sockaddr*)&a1, 0.5, 500) == 1);
+
+    // IPv6 sources are limited too
+    struct sockaddr_in6 a6;
+    memset(&a6, 0, sizeof(a6));
+    a6.sin6_family = AF_INET6;
+    inet_pton(AF_INET6, "fe80::1", &a6.sin6_addr);
+    fail_unless(rate_table_take(&t, (struct sockaddr*)&a6, 0, 1500) == 1);
+    fail_unless(rate_table_take(&t, (struct sockaddr*)&a6, 0, 1) == 0);
+
+    // Other families are not
+    struct sockaddr_un un;
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    fail_unless(rate_table_take(&t, (struct sockaddr*)&un, 0, 1e9) == 1);
+    destroy_rate_table(&t);
+}
+END_TEST
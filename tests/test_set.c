@@ -63,7 +63,7 @@ START_TEST(test_set_error_bound)
         set_add(&s, (char*)&buf);
     }
 
-    // Should be within 1 %
+    // Should be within 1%
     uint64_t size = set_size(&s);
     fail_unless(size > 9900 && size < 10100);
 
@@ -72,3 +72,162 @@ START_TEST(test_set_error_bound)
 END_TEST
 
 
+START_TEST(test_set_merge_exact)
+{
+    set_t s1, s2;
+    fail_unless(set_init(14, &s1) == 0);
+    fail_unless(set_init(14, &s2) == 0);
+
+    char buf[100];
+    for (int i=0; i < 30; i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        if (i < 20) set_add(&s1, (char*)&buf);
+        if (i >= 10) set_add(&s2, (char*)&buf);
+    }
+
+    fail_unless(set_merge(&s1, &s2) == 0);
+    fail_unless(set_size(&s1) == 30);
+
+    fail_unless(set_destroy(&s1) == 0);
+    fail_unless(set_destroy(&s2) == 0);
+}
+END_TEST
+
+START_TEST(test_set_merge_approx)
+{
+    set_t s1, s2, s3;
+    fail_unless(set_init(14, &s1) == 0);
+    fail_unless(set_init(14, &s2) == 0);
+    fail_unless(set_init(14, &s3) == 0);
+
+    // s1 is exact, s2 is approximate
+    char buf[100];
+    for (int i=0; i < 10000; i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        if (i < 10) set_add(&s1, (char*)&buf);
+        if (i >= 5) set_add(&s2, (char*)&buf);
+    }
+
+    // Exact into approx, and approx into exact
+    fail_unless(set_merge(&s3, &s2) == 0);
+    fail_unless(set_merge(&s3, &s1) == 0);
+    fail_unless(set_merge(&s1, &s2) == 0);
+
+    uint64_t size = set_size(&s1);
+    fail_unless(size > 9900 && size < 10100);
+    fail_unless(size == set_size(&s3));
+
+    fail_unless(set_destroy(&s1) == 0);
+    fail_unless(set_destroy(&s2) == 0);
+    fail_unless(set_destroy(&s3) == 0);
+}
+END_TEST
+
+
+START_TEST(test_set_large_exact)
+{
+    set_t s;
+    fail_unless(set_init_exact(12, 2000, &s) == 0);
+
+    // Every item is counted exactly, with duplicates ignored
+    char buf[100];
+    for (int r=0; r < 2; r++) {
+        for (int i=0; i < 2000; i++) {
+            fail_unless(sprintf((char*)&buf, "test%d", i));
+            set_add(&s, (char*)&buf);
+        }
+    }
+    fail_unless(s.type == EXACT);
+    fail_unless(set_size(&s) == 2000);
+
+    // One more item converts to an estimate
+    set_add(&s, "final");
+    fail_unless(s.type == APPROX);
+    uint64_t size = set_size(&s);
+    fail_unless(size > 1900 && size < 2100);
+
+    fail_unless(set_destroy(&s) == 0);
+}
+END_TEST
+
+START_TEST(test_set_merge_large_exact)
+{
+    set_t s1, s2;
+    fail_unless(set_init_exact(12, 1000, &s1) == 0);
+    fail_unless(set_init_exact(12, 1000, &s2) == 0);
+
+    // Overlapping halves
+    char buf[100];
+    for (int i=0; i < 600; i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        set_add(&s1, (char*)&buf);
+        fail_unless(sprintf((char*)&buf, "test%d", i + 300));
+        set_add(&s2, (char*)&buf);
+    }
+
+    fail_unless(set_merge(&s1, &s2) == 0);
+    fail_unless(s1.type == EXACT);
+    fail_unless(set_size(&s1) == 900);
+
+    // Merging past the limit converts
+    fail_unless(set_merge(&s2, &s1) == 0);
+    fail_unless(set_merge(&s1, &s2) == 0);
+    fail_unless(set_size(&s1) == 900);
+    for (int i=0; i < 200; i++) {
+        fail_unless(sprintf((char*)&buf, "other%d", i));
+        set_add(&s2, (char*)&buf);
+    }
+    fail_unless(set_merge(&s1, &s2) == 0);
+    fail_unless(s1.type == APPROX);
+    uint64_t size = set_size(&s1);
+    fail_unless(size > 1050 && size < 1150);
+
+    fail_unless(set_destroy(&s1) == 0);
+    fail_unless(set_destroy(&s2) == 0);
+}
+END_TEST
+
+START_TEST(test_set_inline)
+{
+    set_t s, s2;
+    fail_unless(sizeof(exact_set) <= sizeof(hll_t));
+    fail_unless(set_init(12, &s) == 0);
+    fail_unless(set_init(12, &s2) == 0);
+
+    // A few hashes are kept without a table
+    for (uint64_t h=0; h < SET_INLINE_HASHES; h++) {
+        set_add_hash(&s, h);
+        set_add_hash(&s, h);
+    }
+    fail_unless(s.store.s.hashes == NULL);
+    fail_unless(set_size(&s) == SET_INLINE_HASHES);
+
+    // Merging an inline set
+    set_add_hash(&s2, 1);
+    set_add_hash(&s2, 100);
+    fail_unless(set_merge(&s2, &s) == 0);
+    fail_unless(set_size(&s2) == SET_INLINE_HASHES + 1);
+
+    // More spill into a table, keeping the ones inline
+    for (uint64_t h=0; h < 20; h++) {
+        set_add_hash(&s, h);
+    }
+    fail_unless(s.store.s.hashes != NULL);
+    fail_unless(set_size(&s) == 20);
+
+    // An inline set converts to an estimate
+    set_t s3;
+    fail_unless(set_init_exact(12, 2, &s3) == 0);
+    set_add(&s3, "a");
+    set_add(&s3, "b");
+    fail_unless(s3.type == EXACT);
+    set_add(&s3, "c");
+    fail_unless(s3.type == APPROX);
+    uint64_t size = set_size(&s3);
+    fail_unless(size >= 2 && size <= 4);
+
+    fail_unless(set_destroy(&s) == 0);
+    fail_unless(set_destroy(&s2) == 0);
+    fail_unless(set_destroy(&s3) == 0);
+}
+END_TEST
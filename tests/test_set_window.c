@@ -0,0 +1,111 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "set_window.h"
+#include "metrics.h"
+
+// Returns the size of a set of the metrics, or -1 if there is none
+static int64_t window_set_size(metrics *m, char *name) {
+    set_t *s;
+    if (hashmap_get(m->sets, name, (void**)&s)) return -1;
+    return set_size(s);
+}
+
+// Adds the members of a set for one interval, and updates the windows
+static int window_interval(set_window *w, metrics *m, time_t now, char **members, int num) {
+    fail_unless(init_metrics_defaults(m) == 0);
+    for (int i=0; i < num; i++) {
+        fail_unless(metrics_set_update(m, "users", members[i]) == 0);
+    }
+    return set_window_update(w, m, now);
+}
+
+START_TEST(test_set_window_init_destroy)
+{
+    set_window w;
+    int windows[] = {60, 3600};
+    fail_unless(set_window_init(windows, 0, 6, &w) != 0);
+    fail_unless(set_window_init(windows, 2, 0, &w) != 0);
+    fail_unless(set_window_init(windows, 2, 7, &w) != 0);
+    fail_unless(set_window_init(windows, 2, 6, &w) == 0);
+    fail_unless(set_window_size(&w) == 0);
+    fail_unless(set_window_destroy(&w) == 0);
+}
+END_TEST
+
+START_TEST(test_set_window_slide)
+{
+    set_window w;
+    int windows[] = {60, 120};
+    fail_unless(set_window_init(windows, 2, 6, &w) == 0);
+    metrics m;
+
+    char *first[] = {"a", "b"};
+    fail_unless(window_interval(&w, &m, 10, first, 2) == 2);
+    fail_unless(window_set_size(&m, "users.60s") == 2);
+    destroy_metrics(&m);
+
+    // The windows are the union of the intervals
+    char *second[] = {"b", "c"};
+    fail_unless(window_interval(&w, &m, 20, second, 2) == 2);
+    fail_unless(window_set_size(&m, "users") == 2);
+    fail_unless(window_set_size(&m, "users.60s") == 3);
+    fail_unless(window_set_size(&m, "users.120s") == 3);
+    destroy_metrics(&m);
+
+    // The first interval slid out of the short window only
+    char *third[] = {"d"};
+    fail_unless(window_interval(&w, &m, 70, third, 1) == 2);
+    fail_unless(window_set_size(&m, "users.60s") == 3);
+    fail_unless(window_set_size(&m, "users.120s") == 4);
+    destroy_metrics(&m);
+
+    // A late interval is older than the slot of the short window
+    char *late[] = {"e"};
+    fail_unless(window_interval(&w, &m, 10, late, 1) == 2);
+    fail_unless(window_set_size(&m, "users.60s") == 3);
+    fail_unless(window_set_size(&m, "users.120s") == 5);
+    destroy_metrics(&m);
+
+    // The windows are streamed while the set is quiet
+    fail_unless(window_interval(&w, &m, 100, NULL, 0) == 2);
+    fail_unless(window_set_size(&m, "users.60s") == 1);
+    fail_unless(window_set_size(&m, "users.120s") == 5);
+    destroy_metrics(&m);
+
+    // Out of every window, the set is released
+    fail_unless(window_interval(&w, &m, 400, NULL, 0) == 0);
+    fail_unless(window_set_size(&m, "users.120s") == -1);
+    fail_unless(set_window_size(&w) == 0);
+    destroy_metrics(&m);
+    fail_unless(set_window_destroy(&w) == 0);
+}
+END_TEST
+
+START_TEST(test_set_window_approx)
+{
+    set_window w;
+    int windows[] = {3600};
+    fail_unless(set_window_init(windows, 1, 12, &w) == 0);
+    metrics m;
+
+    // Each interval is over the exact sets, so the windows merge HLLs
+    char name[32];
+    for (int i=0; i < 10; i++) {
+        fail_unless(init_metrics_defaults(&m) == 0);
+        for (int j=0; j < 1000; j++) {
+            snprintf(name, sizeof(name), "user.%d", 500 * i + j);
+            fail_unless(metrics_set_update(&m, "users", name) == 0);
+        }
+        fail_unless(set_window_update(&w, &m, 300 * (i + 1)) == 1);
+        if (i < 9) destroy_metrics(&m);
+    }
+
+    // The window covers all the intervals, with 5500 users
+    int64_t size = window_set_size(&m, "users.3600s");
+    fail_unless(size > 5500 * 0.95 && size < 5500 * 1.05);
+    destroy_metrics(&m);
+    fail_unless(set_window_destroy(&w) == 0);
+}
+END_TEST
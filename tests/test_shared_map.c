@@ -0,0 +1,155 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "shared_map.h"
+#include "hash.h"
+
+// Sums up the keys seen by shared_map_iter
+struct shared_test_sums {
+    int counters;
+    int gauges;
+    double sum;
+    uint64_t count;
+};
+
+static int shared_test_cb(void *data, const char *key, uint64_t hash, counter *c, shared_gauge *g) {
+    struct shared_test_sums *s = data;
+    fail_unless(hash == hash_key(key, strlen(key)));
+    if (c) {
+        s->counters++;
+        s->sum += c->sum;
+        s->count += c->count;
+    } else {
+        s->gauges++;
+        s->sum += g->value;
+    }
+    return 0;
+}
+
+static int shared_test_value_cb(void *data, const char *key, uint64_t hash, counter *c, shared_gauge *g) {
+    if (c) {
+        fail_unless(!strcmp(key, "foo"));
+        fail_unless(c->count == 4);
+        fail_unless(c->sum == 10);
+        fail_unless(c->squared_sum == 28);
+        fail_unless(c->min == 1);
+        fail_unless(c->max == 3);
+    } else {
+        shared_gauge *out = data;
+        *out = *g;
+    }
+    return 0;
+}
+
+#define SHARED_ADD_COUNTER(s, name, val, count) \
+    shared_map_add_counter(s, name, hash_key(name, strlen(name)), val, count)
+#define SHARED_UPDATE_GAUGE(s, name, val, delta) \
+    shared_map_update_gauge(s, name, hash_key(name, strlen(name)), val, delta)
+
+START_TEST(test_shared_map_values)
+{
+    shared_map *s;
+    fail_unless(shared_map_create(0, &s) == -1);
+    fail_unless(shared_map_create(16, &s) == 0);
+    fail_unless(shared_map_size(s) == 0);
+
+    // A counter and a gauge with the same name are apart
+    fail_unless(SHARED_ADD_COUNTER(s, "foo", 1, 1) == 0);
+    fail_unless(SHARED_ADD_COUNTER(s, "foo", 3, 3) == 0);
+    fail_unless(SHARED_UPDATE_GAUGE(s, "foo", 5, false) == 0);
+    fail_unless(SHARED_UPDATE_GAUGE(s, "foo", 2, true) == 0);
+    fail_unless(shared_map_size(s) == 2);
+
+    shared_gauge g = {0, false};
+    fail_unless(shared_map_iter(s, NULL, &g, shared_test_value_cb) == 0);
+    fail_unless(g.value == 7);
+    fail_unless(g.is_set);
+
+    // A gauge with only deltas is not set
+    fail_unless(SHARED_UPDATE_GAUGE(s, "bar", -2, true) == 0);
+    fail_unless(shared_map_iter(s, "bar", &g, shared_test_value_cb) == 0);
+    fail_unless(g.value == -2);
+    fail_unless(!g.is_set);
+
+    shared_map_clear(s);
+    fail_unless(shared_map_size(s) == 0);
+    struct shared_test_sums sums = {0, 0, 0, 0};
+    fail_unless(shared_map_iter(s, NULL, &sums, shared_test_cb) == 0);
+    fail_unless(sums.counters == 0 && sums.gauges == 0);
+    shared_map_destroy(s);
+}
+END_TEST
+
+START_TEST(test_shared_map_full)
+{
+    shared_map *s;
+    fail_unless(shared_map_create(4, &s) == 0);
+
+    char name[32];
+    for (int i=0; i < 4; i++) {
+        snprintf(name, sizeof(name), "api.%d", i);
+        fail_unless(SHARED_ADD_COUNTER(s, name, 1, 1) == 0);
+    }
+    fail_unless(SHARED_ADD_COUNTER(s, "other", 1, 1) == -1);
+    fail_unless(SHARED_UPDATE_GAUGE(s, "other", 1, false) == -1);
+    fail_unless(shared_map_size(s) == 4);
+
+    // The keys held are still updated
+    fail_unless(SHARED_ADD_COUNTER(s, "api.0", 1, 1) == 0);
+
+    struct shared_test_sums sums = {0, 0, 0, 0};
+    fail_unless(shared_map_iter(s, "api.", &sums, shared_test_cb) == 0);
+    fail_unless(sums.counters == 4);
+    fail_unless(sums.count == 5);
+    memset(&sums, 0, sizeof(sums));
+    fail_unless(shared_map_iter(s, "other", &sums, shared_test_cb) == 0);
+    fail_unless(sums.counters == 0);
+
+    // Cleared, it takes new keys
+    shared_map_clear(s);
+    fail_unless(SHARED_ADD_COUNTER(s, "other", 1, 1) == 0);
+    shared_map_destroy(s);
+}
+END_TEST
+
+#define SHARED_TEST_THREADS 4
+#define SHARED_TEST_KEYS 64
+#define SHARED_TEST_ROUNDS 2000
+
+static void* shared_test_worker(void *arg) {
+    shared_map *s = arg;
+    char name[32];
+    for (int r=0; r < SHARED_TEST_ROUNDS; r++) {
+        snprintf(name, sizeof(name), "key.%d", r % SHARED_TEST_KEYS);
+        SHARED_ADD_COUNTER(s, name, 1, 1);
+        SHARED_UPDATE_GAUGE(s, name, 1, true);
+    }
+    return NULL;
+}
+
+START_TEST(test_shared_map_threads)
+{
+    shared_map *s;
+    fail_unless(shared_map_create(2 * SHARED_TEST_KEYS, &s) == 0);
+
+    pthread_t threads[SHARED_TEST_THREADS];
+    for (int i=0; i < SHARED_TEST_THREADS; i++) {
+        pthread_create(threads + i, NULL, shared_test_worker, s);
+    }
+    for (int i=0; i < SHARED_TEST_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Every key is held once, with no update lost
+    fail_unless(shared_map_size(s) == 2 * SHARED_TEST_KEYS);
+    struct shared_test_sums sums = {0, 0, 0, 0};
+    fail_unless(shared_map_iter(s, NULL, &sums, shared_test_cb) == 0);
+    fail_unless(sums.counters == SHARED_TEST_KEYS);
+    fail_unless(sums.gauges == SHARED_TEST_KEYS);
+    fail_unless(sums.count == SHARED_TEST_THREADS * SHARED_TEST_ROUNDS);
+    fail_unless(sums.sum == 2 * SHARED_TEST_THREADS * SHARED_TEST_ROUNDS);
+    shared_map_destroy(s);
+}
+END_TEST
@@ -0,0 +1,61 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "shm_ring.h"
+
+START_TEST(test_shm_ring_write)
+{
+    shm_ring *r, *p;
+    unlink("/tmp/shm_ring_test");
+    fail_unless(shm_ring_create("/tmp/shm_ring_test", 1000, &r) == -1);
+    fail_unless(shm_ring_create("/tmp/shm_ring_test", 65536, &r) == 0);
+    fail_unless(shm_ring_open("/tmp/shm_ring_test", &p) == 0);
+    fail_unless(shm_ring_size(p) == 65536);
+
+    // Frames are visible to the consumer once written
+    fail_unless(shm_ring_write(p, "hello", 5) == 0);
+    fail_unless(shm_ring_head(r) == 5 && shm_ring_tail(r) == 0);
+    fail_unless(memcmp(shm_ring_data(r), "hello", 5) == 0);
+
+    // A frame that does not fit is not written
+    char *buf = calloc(1, 65536);
+    fail_unless(shm_ring_write(p, buf, 65531) == -1);
+    fail_unless(shm_ring_write(p, buf, 65530) == 0);
+    fail_unless(shm_ring_write(p, "x", 1) == -1);
+    shm_ring_consume(r, 65535);
+    fail_unless(shm_ring_tail(p) == 65535);
+
+    // Frames that wrap around are contiguous
+    fail_unless(shm_ring_write(p, "wrapped", 7) == 0);
+    fail_unless(memcmp(shm_ring_data(r) + 65535, "wrapped", 7) == 0);
+    free(buf);
+    shm_ring_close(p);
+    shm_ring_close(r);
+    unlink("/tmp/shm_ring_test");
+}
+END_TEST
+
+START_TEST(test_shm_ring_reopen)
+{
+    shm_ring *r;
+    unlink("/tmp/shm_ring_reopen");
+    fail_unless(shm_ring_open("/tmp/shm_ring_reopen", &r) == -1);
+    fail_unless(shm_ring_create("/tmp/shm_ring_reopen", 65536, &r) == 0);
+    fail_unless(shm_ring_write(r, "abc", 3) == 0);
+    shm_ring_close(r);
+
+    // The pending frames are kept with the same size
+    fail_unless(shm_ring_create("/tmp/shm_ring_reopen", 65536, &r) == 0);
+    fail_unless(shm_ring_head(r) == 3 && shm_ring_tail(r) == 0);
+    fail_unless(memcmp(shm_ring_data(r), "abc", 3) == 0);
+    shm_ring_close(r);
+
+    // A different size starts a new ring
+    fail_unless(shm_ring_create("/tmp/shm_ring_reopen", 131072, &r) == 0);
+    fail_unless(shm_ring_head(r) == 0 && shm_ring_size(r) == 131072);
+    shm_ring_close(r);
+    unlink("/tmp/shm_ring_reopen");
+}
+END_TEST
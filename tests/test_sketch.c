@@ -0,0 +1,194 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sketch.h"
+
+// Encodes into a new buffer, with the writer
+#define ENCODE(expr, buf, len) do { \
+    FILE *f = open_memstream(&buf, &len); \
+    fail_unless(expr == 0); \
+    fclose(f); \
+} while (0)
+
+START_TEST(test_sketch_counter)
+{
+    counter c, out;
+    init_counter(&c);
+    counter_add_sample(&c, 1);
+    counter_add_sample(&c, 4);
+    char *buf;
+    size_t len;
+    ENCODE(sketch_encode_counter(f, &c), buf, len);
+    fail_unless(len == 42);
+
+    fail_unless(sketch_decode_counter(buf, len, &out) == (int)len);
+    fail_unless(counter_count(&out) == 2 && counter_sum(&out) == 5);
+    fail_unless(counter_min(&out) == 1 && counter_max(&out) == 4);
+
+    // Short, or of another kind or version
+    fail_unless(sketch_decode_counter(buf, len - 1, &out) == -1);
+    buf[1] = SKETCH_VERSION + 1;
+    fail_unless(sketch_decode_counter(buf, len, &out) == -1);
+    timer t;
+    fail_unless(sketch_decode_timer(buf, len, &t) == -1);
+    free(buf);
+}
+END_TEST
+
+START_TEST(test_sketch_set)
+{
+    set_t s, out;
+    char *buf;
+    size_t len;
+    fail_unless(set_init(14, &s) == 0);
+    set_add(&s, "a");
+    set_add(&s, "b");
+    ENCODE(sketch_encode_set(f, &s), buf, len);
+    fail_unless(sketch_view_set(buf, len, &out) == -1);
+    fail_unless(sketch_decode_set(buf, len, &out) == (int)len);
+    fail_unless(out.type == EXACT && set_size(&out) == 2);
+    set_destroy(&out);
+    free(buf);
+
+    // Sparse, and then dense
+    char key[32];
+    for (int i=0; i < 100; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        set_add(&s, key);
+    }
+    fail_unless(s.type == APPROX && s.store.h.sparse);
+    ENCODE(sketch_encode_set(f, &s), buf, len);
+    fail_unless(sketch_decode_set(buf, len, &out) == (int)len);
+    fail_unless(out.type == APPROX && set_size(&out) == set_size(&s));
+    set_destroy(&out);
+    free(buf);
+
+    for (int i=0; i < 20000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        set_add(&s, key);
+    }
+    fail_unless(s.store.h.registers != NULL);
+    ENCODE(sketch_encode_set(f, &s), buf, len);
+
+    // The registers are read in place
+    fail_unless(sketch_view_set(buf, len, &out) == (int)len);
+    fail_unless((char*)out.store.h.registers > buf && (char*)out.store.h.registers < buf + len);
+    fail_unless(set_size(&out) == set_size(&s));
+
+    // Packed words are not viewed misaligned, but are still decoded
+    char *moved = malloc(len + 1);
+    memcpy(moved + 1, buf, len);
+#ifndef HLL_BYTE_REGISTERS
+    fail_unless(sketch_view_set(moved + 1, len, &out) == -1);
+#endif
+    fail_unless(sketch_decode_set(moved + 1, len, &out) == (int)len);
+    fail_unless(set_size(&out) == set_size(&s));
+    set_destroy(&out);
+
+    fail_unless(sketch_decode_set(buf, len - 1, &out) == -1);
+    free(moved);
+    free(buf);
+    set_destroy(&s);
+}
+END_TEST
+
+START_TEST(test_sketch_hll_layouts)
+{
+    // The same registers, a byte each and packed five to a word
+    unsigned char regs[16];
+    hll_t ref, h;
+    fail_unless(hll_init(4, &ref) == 0);
+    for (int i=0; i < 16; i++) {
+        regs[i] = (i * 7) % 13;
+        if (regs[i]) hll_set_max(&ref, i, regs[i]);
+    }
+
+    char bytes[48] = {SKETCH_HLL, SKETCH_VERSION, 4, 2, 16, 0, 0, 0, 7};
+    memcpy(bytes + 16, regs, 16);
+    char packed[48] = {SKETCH_HLL, SKETCH_VERSION, 4, 1, 16, 0, 0, 0, 7};
+    for (int i=0; i < 16; i++) {
+        unsigned char *word = (unsigned char*)packed + 16 + (i / 5) * 4;
+        uint32_t val = (uint32_t)regs[i] << 6 * (i % 5);
+        for (int b=0; b < 4; b++) {
+            word[b] |= val >> (8 * b);
+        }
+    }
+
+    // Either layout is read by any build
+    fail_unless(sketch_decode_hll(bytes, 32, &h) == 32);
+    fail_unless(hll_size(&h) == hll_size(&ref));
+    hll_destroy(&h);
+    fail_unless(sketch_decode_hll(packed, 32, &h) == 32);
+    fail_unless(hll_size(&h) == hll_size(&ref));
+    hll_destroy(&h);
+
+    // Only the layout of the build is viewed
+#ifdef HLL_BYTE_REGISTERS
+    fail_unless(sketch_view_hll(bytes, 32, &h) == 32);
+    fail_unless(sketch_view_hll(packed, 32, &h) == -1);
+#else
+    fail_unless(sketch_view_hll(bytes, 32, &h) == -1);
+    fail_unless(sketch_view_hll(packed, 32, &h) == 32);
+#endif
+    fail_unless(hll_size(&h) == hll_size(&ref));
+
+    // The register size must match the precision
+    packed[4] = 12;
+    fail_unless(sketch_decode_hll(packed, 32, &h) == -1);
+    packed[4] = 16;
+    packed[2] = 3;
+    fail_unless(sketch_decode_hll(packed, 32, &h) == -1);
+    hll_destroy(&ref);
+}
+END_TEST
+
+START_TEST(test_sketch_timer)
+{
+    double quants[] = {0.5, 0.9, 0.99};
+    timer cm, td, hdr, st, out;
+    fail_unless(init_timer(0.01, quants, 3, &cm) == 0);
+    fail_unless(init_timer_tdigest(100, &td) == 0);
+    fail_unless(init_timer_hdr(0.01, &hdr) == 0);
+    fail_unless(init_timer_stats(&st) == 0);
+    char *buf;
+    size_t len;
+
+    // The raw samples, and then each sketch
+    for (int round=0; round < 2; round++) {
+        int num = (round) ? 10000 : 50;
+        for (int i=0; i < num; i++) {
+            timer_add_sample(&cm, i);
+            timer_add_sample(&td, i);
+            timer_add_sample(&hdr, i);
+            timer_add_sample(&st, i);
+        }
+        timer *timers[] = {&cm, &td, &hdr, &st};
+        for (int j=0; j < 4; j++) {
+            timer *t = timers[j];
+            ENCODE(sketch_encode_timer(f, t), buf, len);
+            fail_unless(sketch_decode_timer(buf, len, &out) == (int)len);
+            fail_unless(out.engine == t->engine);
+            fail_unless(timer_count(&out) == timer_count(t));
+            fail_unless(timer_sum(&out) == timer_sum(t));
+            fail_unless(timer_min(&out) == timer_min(t) && timer_max(&out) == timer_max(t));
+            fail_unless(fabs(timer_query(&out, 0.9) - timer_query(t, 0.9)) < 1e-9);
+
+            // The decoded timer keeps taking samples
+            fail_unless(timer_add_sample(&out, 1) == 0);
+            fail_unless(timer_count(&out) == timer_count(t) + 1);
+            destroy_timer(&out);
+
+            for (size_t cut=0; cut < len; cut += 7) {
+                fail_unless(sketch_decode_timer(buf, cut, &out) == -1);
+            }
+            free(buf);
+        }
+    }
+    destroy_timer(&cm);
+    destroy_timer(&td);
+    destroy_timer(&hdr);
+    destroy_timer(&st);
+}
+END_TEST
@@ -0,0 +1,225 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include "snapshot.h"
+
+START_TEST(test_snapshot_roundtrip)
+{
+    statsite_config config;
+    int res = config_from_filename(NULL, &config);
+    histogram_config c1 = {"hist", 0, 100, 10, 12, NULL, 0};
+    config.hist_configs = &c1;
+    fail_unless(sane_histograms(config.hist_configs) == 0);
+    fail_unless(build_prefix_tree(&config) == 0);
+
+    // Two shards, with every kind of metric
+    double quants[] = {0.5, 0.90, 0.99};
+    metrics a, b, *shards[] = {&a, &b};
+    for (int i=0; i < 2; i++) {
+        res = init_metrics(0.01, (double*)&quants, 3, config.histograms, 12, shards[i]);
+        fail_unless(res == 0);
+    }
+    fail_unless(metrics_add_sample(&a, KEY_VAL, "kv", 42) == 0);
+    fail_unless(metrics_add_sample(&a, COUNTER, "c", 1) == 0);
+    fail_unless(metrics_add_sample(&b, COUNTER, "c", 3) == 0);
+    fail_unless(metrics_add_sample(&a, GAUGE, "g", 5) == 0);
+    fail_unless(metrics_add_sample(&b, GAUGE_DELTA, "gd", 2) == 0);
+    fail_unless(metrics_set_update(&a, "exact", "x") == 0);
+    fail_unless(metrics_set_update(&b, "exact", "y") == 0);
+    char buf[32];
+    for (int i=0; i < 5000; i++) {
+        snprintf(buf, sizeof(buf), "v%d", i);
+        fail_unless(metrics_set_update(&a, "approx", buf) == 0);
+        fail_unless(metrics_add_sample(&b, TIMER, "sketch", i) == 0);
+    }
+    for (int i=0; i < 10; i++) {
+        fail_unless(metrics_add_sample(&a, TIMER, "hist.t", i * 10 + 5) == 0);
+    }
+    a.inputs = 7;
+    b.inputs = 3;
+    fail_unless(snapshot_write("/tmp/snapshot_test", shards, 2) == 0);
+    fail_unless(access("/tmp/snapshot_test.tmp", F_OK) != 0);
+
+    // Restore into a fresh pair of shards
+    metrics ra, rb, *restored[] = {&ra, &rb};
+    for (int i=0; i < 2; i++) {
+        res = init_metrics(0.01, (double*)&quants, 3, config.histograms, 12, restored[i]);
+        fail_unless(res == 0);
+    }
+    fail_unless(snapshot_load("/tmp/snapshot_test", restored, 2) == 0);
+    unlink("/tmp/snapshot_test");
+    fail_unless(ra.inputs == 10);
+    fail_unless(ra.kv_head->num_vals == 1 && ra.kv_head->vals[0].val == 42);
+
+    counter *c = counter_map_get(&ra.counters, "c");
+    fail_unless(c && counter_count(c) == 2 && counter_sum(c) == 4);
+    fail_unless(counter_min(c) == 1 && counter_max(c) == 3);
+    gauge_t *g = gauge_map_get(&ra.gauges, "g");
+    fail_unless(g && g->value == 5 && g->is_set);
+    g = gauge_map_get(&ra.gauges, "gd");
+    fail_unless(g && g->value == 2 && !g->is_set);
+
+    set_t *s;
+    fail_unless(hashmap_get(ra.sets, "exact", (void**)&s) == 0);
+    fail_unless(set_size(s) == 2);
+    set_t *orig;
+    fail_unless(hashmap_get(a.sets, "approx", (void**)&orig) == 0);
+    fail_unless(hashmap_get(ra.sets, "approx", (void**)&s) == 0);
+    fail_unless(s->type == APPROX && set_size(s) == set_size(orig));
+
+    timer_hist *t, *t_orig;
+    fail_unless(hashmap_get(b.timers, "sketch", (void**)&t_orig) == 0);
+    fail_unless(hashmap_get(ra.timers, "sketch", (void**)&t) == 0);
+    fail_unless(timer_count(&t->tm) == 5000);
+    fail_unless(timer_sum(&t->tm) == timer_sum(&t_orig->tm));
+    fail_unless(fabs(timer_query(&t->tm, 0.5) - timer_query(&t_orig->tm, 0.5)) < 50);
+    fail_unless(timer_max(&t->tm) == 4999);
+
+    fail_unless(hashmap_get(ra.timers, "hist.t", (void**)&t) == 0);
+    fail_unless(timer_count(&t->tm) == 10 && timer_min(&t->tm) == 5);
+    for (int i=1; i <= 10; i++) {
+        fail_unless(t->counts[i] == 1);
+    }
+
+    // The second shard is only sized
+    fail_unless(counter_map_size(&rb.counters) == 0);
+    for (int i=0; i < 2; i++) {
+        destroy_metrics(shards[i]);
+        destroy_metrics(restored[i]);
+    }
+}
+END_TEST
+
+START_TEST(test_snapshot_sizes)
+{
+    metrics m, r, *shards[] = {&m};
+    fail_unless(init_metrics_defaults(&m) == 0);
+    char buf[32];
+    for (int i=0; i < 1000; i++) {
+        snprintf(buf, sizeof(buf), "counter.%d", i);
+        fail_unless(metrics_add_sample(&m, COUNTER, buf, 1) == 0);
+    }
+    fail_unless(snapshot_write("/tmp/snapshot_sizes", shards, 1) == 0);
+    destroy_metrics(&m);
+
+    // The map is sized before the keys are restored
+    fail_unless(init_metrics_defaults(&r) == 0);
+    shards[0] = &r;
+    uint64_t gen = r.generation;
+    fail_unless(snapshot_load("/tmp/snapshot_sizes", shards, 1) == 0);
+    unlink("/tmp/snapshot_sizes");
+    fail_unless(r.generation != gen);
+    fail_unless(counter_map_size(&r.counters) == 1000);
+    fail_unless(r.counters.mask + 1 == 2048);
+
+    metrics_sizes sizes = {0, 5000, 5000, 0, 0};
+    fail_unless(metrics_reserve(&r, &sizes) == 0);
+    fail_unless(r.counters.mask + 1 == 2048);
+    destroy_metrics(&r);
+}
+END_TEST
+
+START_TEST(test_snapshot_invalid)
+{
+    metrics m, *shards[] = {&m};
+    fail_unless(init_metrics_defaults(&m) == 0);
+    unlink("/tmp/snapshot_missing");
+    fail_unless(snapshot_load("/tmp/snapshot_missing", shards, 1) == 1);
+
+    // Write a snapshot, and cut off the trailer
+    fail_unless(metrics_add_sample(&m, COUNTER, "c", 1) == 0);
+    fail_unless(snapshot_write("/tmp/snapshot_bad", shards, 1) == 0);
+    int fd = open("/tmp/snapshot_bad", O_RDWR);
+    off_t len = lseek(fd, 0, SEEK_END);
+    fail_unless(ftruncate(fd, len - 1) == 0);
+    close(fd);
+
+    metrics r;
+    fail_unless(init_metrics_defaults(&r) == 0);
+    shards[0] = &r;
+    fail_unless(snapshot_load("/tmp/snapshot_bad", shards, 1) == -1);
+    fail_unless(counter_map_size(&r.counters) == 0);
+    unlink("/tmp/snapshot_bad");
+    destroy_metrics(&m);
+    destroy_metrics(&r);
+}
+END_TEST
+
+START_TEST(test_snapshot_timer_engine)
+{
+    // A t-digest timer, and one with only raw samples
+    metrics m, *shards[] = {&m};
+    fail_unless(init_metrics_defaults(&m) == 0);
+    metrics_set_timer_engine(&m, TIMER_ENGINE_TDIGEST, 100, NULL);
+    for (int i=0; i < 1000; i++) {
+        fail_unless(metrics_add_sample(&m, TIMER, "td", i) == 0);
+    }
+    fail_unless(metrics_add_sample(&m, TIMER, "small", 3) == 0);
+    fail_unless(snapshot_write("/tmp/snapshot_engine", shards, 1) == 0);
+
+    metrics r;
+    fail_unless(init_metrics_defaults(&r) == 0);
+    metrics_set_timer_engine(&r, TIMER_ENGINE_TDIGEST, 100, NULL);
+    shards[0] = &r;
+    fail_unless(snapshot_load("/tmp/snapshot_engine", shards, 1) == 0);
+    timer_hist *t, *t_orig;
+    fail_unless(hashmap_get(m.timers, "td", (void**)&t_orig) == 0);
+    fail_unless(hashmap_get(r.timers, "td", (void**)&t) == 0);
+    fail_unless(timer_count(&t->tm) == 1000);
+    fail_unless(fabs(timer_query(&t->tm, 0.9) - timer_query(&t_orig->tm, 0.9)) < 10);
+    fail_unless(timer_min(&t->tm) == 0 && timer_max(&t->tm) == 999);
+    destroy_metrics(&r);
+
+    // Sketches of another engine are added as weighted values
+    fail_unless(init_metrics_defaults(&r) == 0);
+    fail_unless(snapshot_load("/tmp/snapshot_engine", shards, 1) == 0);
+    unlink("/tmp/snapshot_engine");
+    fail_unless(hashmap_get(r.timers, "td", (void**)&t) == 0);
+    fail_unless(timer_count(&t->tm) == 1000);
+    fail_unless(timer_sum(&t->tm) == timer_sum(&t_orig->tm));
+    fail_unless(fabs(timer_query(&t->tm, 0.5) - 500) < 20);
+    fail_unless(hashmap_get(r.timers, "small", (void**)&t) == 0);
+    fail_unless(timer_count(&t->tm) == 1 && timer_max(&t->tm) == 3);
+    destroy_metrics(&m);
+    destroy_metrics(&r);
+}
+END_TEST
+
+START_TEST(test_snapshot_kv_coalesced)
+{
+    kv_config c1 = {"mean.", KV_MEAN, NULL, 1};
+    statsite_config config;
+    memset(&config, 0, sizeof(config));
+    config.kv_configs = &c1;
+    fail_unless(build_prefix_tree(&config) == 0);
+
+    metrics m, *shards[] = {&m};
+    fail_unless(init_metrics_defaults(&m) == 0);
+    metrics_set_kv_modes(&m, config.kv_modes);
+    for (int i=0; i < 3; i++) {
+        fail_unless(metrics_add_sample(&m, KEY_VAL, "mean.a", 2) == 0);
+    }
+    fail_unless(metrics_add_sample(&m, KEY_VAL, "raw", 7) == 0);
+    fail_unless(snapshot_write("/tmp/snapshot_kv", shards, 1) == 0);
+
+    // The mean keeps the weight of its samples
+    metrics r;
+    fail_unless(init_metrics_defaults(&r) == 0);
+    metrics_set_kv_modes(&r, config.kv_modes);
+    shards[0] = &r;
+    fail_unless(snapshot_load("/tmp/snapshot_kv", shards, 1) == 0);
+    unlink("/tmp/snapshot_kv");
+    kv_value *v = kv_map_get(&r.kvs, "mean.a");
+    fail_unless(v && v->mode == KV_MEAN && v->count == 3 && v->val == 2);
+    fail_unless(metrics_add_sample(&r, KEY_VAL, "mean.a", 6) == 0);
+    fail_unless(v->count == 4 && v->val == 3);
+    fail_unless(r.kv_head->num_vals == 1 && r.kv_head->vals[0].val == 7);
+
+    destroy_metrics(&m);
+    destroy_metrics(&r);
+}
+END_TEST
@@ -0,0 +1,149 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "spool.h"
+
+static int write_str(FILE *f, void *data) {
+    return (fputs(data, f) < 0) ? -1 : 0;
+}
+
+static int fail_write(FILE *f, void *data) {
+    fputs("partial", f);
+    return 7;
+}
+
+// Counts the segment files in a directory
+static int count_segments(char *dir) {
+    DIR *d = opendir(dir);
+    struct dirent *ent;
+    int num = 0;
+    while ((ent = readdir(d))) {
+        if (strstr(ent->d_name, ".spool")) num++;
+    }
+    closedir(d);
+    return num;
+}
+
+// Drains the next record, and checks its contents
+static void drain_str(spool *s, char *expect) {
+    spool_record rec;
+    fail_unless(spool_next(s, &rec) == 0);
+    fail_unless(rec.len == strlen(expect));
+    fail_unless(memcmp(rec.buf, expect, rec.len) == 0);
+    spool_release(s, &rec, 1);
+}
+
+START_TEST(test_spool_append_drain)
+{
+    char dir[] = "/tmp/spool_test.XXXXXX";
+    fail_unless(mkdtemp(dir) != NULL);
+
+    spool *s;
+    fail_unless(spool_init(dir, 1 << 20, &s) == 0);
+    struct timeval tv = {1000, 5};
+    fail_unless(spool_append(s, &tv, write_str, "first\n") == 0);
+    tv.tv_sec++;
+    fail_unless(spool_append(s, &tv, write_str, "") == 0);
+    tv.tv_sec++;
+    fail_unless(spool_append(s, &tv, write_str, "third\n") == 0);
+    fail_unless(spool_pending_bytes(s) == 12);
+
+    // A failed write is discarded
+    fail_unless(spool_append(s, &tv, fail_write, NULL) == 7);
+    fail_unless(spool_pending_bytes(s) == 12);
+
+    // Records are drained in order, and kept until released as done
+    spool_record rec;
+    fail_unless(spool_next(s, &rec) == 0);
+    fail_unless(rec.tv.tv_sec == 1000 && rec.tv.tv_usec == 5);
+    spool_release(s, &rec, 0);
+    drain_str(s, "first\n");
+
+    fail_unless(spool_next(s, &rec) == 0);
+    fail_unless(rec.len == 0 && rec.buf == NULL);
+    spool_release(s, &rec, 1);
+    drain_str(s, "third\n");
+    fail_unless(spool_pending_bytes(s) == 0);
+
+    // Closed and empty
+    spool_close(s);
+    fail_unless(spool_wait(s, 1000) == 1);
+    fail_unless(spool_next(s, &rec) == 1);
+    fail_unless(spool_destroy(s) == 0);
+    fail_unless(count_segments(dir) == 0);
+    rmdir(dir);
+}
+END_TEST
+
+START_TEST(test_spool_segments)
+{
+    char dir[] = "/tmp/spool_test.XXXXXX";
+    fail_unless(mkdtemp(dir) != NULL);
+
+    // Each record starts a new segment
+    spool *s;
+    fail_unless(spool_init(dir, 16, &s) == 0);
+    struct timeval tv = {1000, 0};
+    char *recs[] = {"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\n", "b\n", "c\n", "d\n"};
+    for (int i=0; i < 4; i++) {
+        fail_unless(spool_append(s, &tv, write_str, recs[i]) == 0);
+    }
+    fail_unless(count_segments(dir) == 4);
+
+    // Drained segments are removed, but not the one being written
+    drain_str(s, recs[0]);
+    drain_str(s, recs[1]);
+    fail_unless(count_segments(dir) == 2);
+    drain_str(s, recs[2]);
+    drain_str(s, recs[3]);
+    fail_unless(count_segments(dir) == 1);
+
+    spool_close(s);
+    fail_unless(spool_destroy(s) == 0);
+    fail_unless(count_segments(dir) == 0);
+    rmdir(dir);
+}
+END_TEST
+
+START_TEST(test_spool_recover)
+{
+    char dir[] = "/tmp/spool_test.XXXXXX";
+    fail_unless(mkdtemp(dir) != NULL);
+
+    spool *s;
+    fail_unless(spool_init(dir, 32, &s) == 0);
+    struct timeval tv = {1000, 0};
+    fail_unless(spool_append(s, &tv, write_str, "one\n") == 0);
+    fail_unless(spool_append(s, &tv, write_str, "two\n") == 0);
+    fail_unless(spool_append(s, &tv, write_str, "three\n") == 0);
+    drain_str(s, "one\n");
+
+    // The records that were not drained are kept
+    spool_close(s);
+    fail_unless(spool_destroy(s) == 2);
+    fail_unless(count_segments(dir) > 0);
+
+    // An incomplete record at the end is skipped
+    char path[256];
+    snprintf(path, sizeof(path), "%s/statsite.100.spool", dir);
+    FILE *f = fopen(path, "w");
+    fwrite("\0\0\0\0incomplete", 14, 1, f);
+    fclose(f);
+
+    // Recovered in order, and appends continue after them
+    fail_unless(spool_init(dir, 32, &s) == 0);
+    fail_unless(spool_pending_bytes(s) == 10);
+    fail_unless(spool_append(s, &tv, write_str, "four\n") == 0);
+    drain_str(s, "two\n");
+    drain_str(s, "three\n");
+    drain_str(s, "four\n");
+
+    spool_close(s);
+    fail_unless(spool_destroy(s) == 0);
+    fail_unless(count_segments(dir) == 0);
+    rmdir(dir);
+}
+END_TEST
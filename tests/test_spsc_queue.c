@@ -0,0 +1,56 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include "spsc_queue.h"
+
+START_TEST(test_spsc_queue_push_pop)
+{
+    spsc_queue *q;
+    fail_unless(spsc_queue_create(0, &q) == -1);
+    fail_unless(spsc_queue_create(6, &q) == -1);
+    fail_unless(spsc_queue_create(4, &q) == 0);
+    fail_unless(spsc_queue_pop(q) == NULL);
+
+    // Fill it, then wrap around
+    for (uintptr_t i=1; i <= 4; i++) fail_unless(spsc_queue_push(q, (void*)i) == 0);
+    fail_unless(spsc_queue_push(q, (void*)5) == -1);
+    for (uintptr_t i=1; i <= 2; i++) fail_unless(spsc_queue_pop(q) == (void*)i);
+    fail_unless(spsc_queue_push(q, (void*)5) == 0);
+    fail_unless(spsc_queue_push(q, (void*)6) == 0);
+    for (uintptr_t i=3; i <= 6; i++) fail_unless(spsc_queue_pop(q) == (void*)i);
+    fail_unless(spsc_queue_pop(q) == NULL);
+    spsc_queue_destroy(q);
+}
+END_TEST
+
+#define SPSC_TEST_COUNT 100000
+
+static void* spsc_producer(void *arg) {
+    spsc_queue *q = arg;
+    for (uintptr_t i=1; i <= SPSC_TEST_COUNT; i++) {
+        while (spsc_queue_push(q, (void*)i)) sched_yield();
+    }
+    return NULL;
+}
+
+START_TEST(test_spsc_queue_threads)
+{
+    spsc_queue *q;
+    fail_unless(spsc_queue_create(64, &q) == 0);
+    pthread_t t;
+    pthread_create(&t, NULL, spsc_producer, q);
+
+    // Every pointer arrives once, in order
+    void *ptr;
+    for (uintptr_t i=1; i <= SPSC_TEST_COUNT; i++) {
+        while (!(ptr = spsc_queue_pop(q))) sched_yield();
+        fail_unless(ptr == (void*)i);
+    }
+    pthread_join(t, NULL);
+    fail_unless(spsc_queue_pop(q) == NULL);
+    spsc_queue_destroy(q);
+}
+END_TEST
@@ -0,0 +1,152 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "stats.h"
+#include "metrics.h"
+
+START_TEST(test_stats_add)
+{
+    uint64_t before[NUM_STATS], after[NUM_STATS];
+    stats_collect(before);
+    stats_add(STAT_PACKETS, 1);
+    stats_add(STAT_BYTES, 100);
+    stats_add(STAT_BYTES, 23);
+    stats_collect(after);
+    fail_unless(after[STAT_PACKETS] - before[STAT_PACKETS] == 1);
+    fail_unless(after[STAT_BYTES] - before[STAT_BYTES] == 123);
+    fail_unless(after[STAT_PARSE_ERRORS] == before[STAT_PARSE_ERRORS]);
+}
+END_TEST
+
+static void* stats_thread(void *arg) {
+    for (int i=0; i < 1000; i++) {
+        stats_add(STAT_COUNTER_SAMPLES, 1);
+    }
+    return NULL;
+}
+
+START_TEST(test_stats_threads)
+{
+    uint64_t before[NUM_STATS], after[NUM_STATS];
+    stats_collect(before);
+
+    // The counts of exited threads must be kept
+    pthread_t threads[4];
+    for (int i=0; i < 4; i++) {
+        pthread_create(threads + i, NULL, stats_thread, NULL);
+    }
+    for (int i=0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    stats_add(STAT_COUNTER_SAMPLES, 1);
+
+    stats_collect(after);
+    fail_unless(after[STAT_COUNTER_SAMPLES] - before[STAT_COUNTER_SAMPLES] == 4001);
+}
+END_TEST
+
+static void* free_thread(void *arg) {
+    stats_mem_add(MEM_BUFFERS, -4096);
+    return NULL;
+}
+
+START_TEST(test_stats_mem_threads)
+{
+    int64_t before[NUM_MEMS], after[NUM_MEMS];
+    stats_mem_collect(before);
+
+    // Memory freed by another thread is still subtracted
+    stats_mem_add(MEM_BUFFERS, 4096);
+    stats_mem_add(MEM_BUFFERS, 8192);
+    pthread_t t;
+    pthread_create(&t, NULL, free_thread, NULL);
+    pthread_join(t, NULL);
+
+    stats_mem_collect(after);
+    fail_unless(after[MEM_BUFFERS] - before[MEM_BUFFERS] == 8192);
+    fail_unless(after[MEM_TIMERS] == before[MEM_TIMERS]);
+}
+END_TEST
+
+START_TEST(test_stats_mem_metrics)
+{
+    int64_t before[NUM_MEMS], during[NUM_MEMS], after[NUM_MEMS];
+    stats_mem_collect(before);
+
+    metrics m;
+    fail_unless(init_metrics_defaults(&m) == 0);
+    char key[32], val[32];
+    for (int i=0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "key%d", i % 100);
+        snprintf(val, sizeof(val), "%d", i);
+        metrics_add_sample(&m, TIMER, key, i);
+        metrics_set_update(&m, key, val);
+        metrics_add_sample(&m, COUNTER, key, i);
+
+        // Grow past the exact samples and hashes
+        metrics_add_sample(&m, TIMER, "big", i);
+        metrics_set_update(&m, "big", val);
+    }
+    stats_mem_collect(during);
+    fail_unless(during[MEM_TIMERS] > before[MEM_TIMERS]);
+    fail_unless(during[MEM_SETS] > before[MEM_SETS]);
+    fail_unless(during[MEM_MAPS] > before[MEM_MAPS]);
+    fail_unless(during[MEM_ARENAS] > before[MEM_ARENAS]);
+
+    // All of it is given back
+    fail_unless(destroy_metrics(&m) == 0);
+    stats_mem_collect(after);
+    for (int i=0; i < NUM_MEMS; i++) {
+        fail_unless(after[i] == before[i]);
+    }
+}
+END_TEST
+
+START_TEST(test_stats_seq)
+{
+    // Each update leaves the sequence of the block even
+    stats_add(STAT_PACKETS, 1);
+    uint64_t seq = STATS_LOCAL[STATS_SEQ];
+    fail_unless(!(seq & 1));
+    stats_add(STAT_PACKETS, 1);
+    stats_mem_add(MEM_BUFFERS, 16);
+    stats_mem_add(MEM_BUFFERS, -16);
+    fail_unless(STATS_LOCAL[STATS_SEQ] == seq + 6);
+}
+END_TEST
+
+#define STATS_TEST_UPDATES 200000
+
+static void* stats_writer(void *arg) {
+    for (int i=0; i < STATS_TEST_UPDATES; i++) {
+        stats_add(STAT_SKETCHES, 1);
+        stats_add(STAT_BUFFER_GROWS, 2);
+    }
+    return NULL;
+}
+
+START_TEST(test_stats_concurrent)
+{
+    uint64_t before[NUM_STATS], during[NUM_STATS], last[NUM_STATS], after[NUM_STATS];
+    stats_collect(before);
+    memcpy(last, before, sizeof(last));
+
+    // Collect along with the updates, the totals never go back
+    pthread_t t;
+    pthread_create(&t, NULL, stats_writer, NULL);
+    for (int i=0; i < 1000; i++) {
+        stats_collect(during);
+        fail_unless(during[STAT_SKETCHES] >= last[STAT_SKETCHES]);
+        fail_unless(during[STAT_BUFFER_GROWS] >= last[STAT_BUFFER_GROWS]);
+        memcpy(last, during, sizeof(last));
+    }
+    pthread_join(t, NULL);
+
+    stats_collect(after);
+    fail_unless(after[STAT_SKETCHES] - before[STAT_SKETCHES] == STATS_TEST_UPDATES);
+    fail_unless(after[STAT_BUFFER_GROWS] - before[STAT_BUFFER_GROWS] == 2 * STATS_TEST_UPDATES);
+}
+END_TEST
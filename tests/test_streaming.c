@@ -2,12 +2,16 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <math.h>
 #include "streaming.h"
+#include "lz4.h"
+#include "shm_ring.h"
+#include "conn_handler.h"
 
 static int empty_cb(FILE *pipe, void *data, metric_type type, char *name, void *value) {
     int *o = data;
@@ -62,6 +66,26 @@ static int some_cb(FILE *pipe, void *data, metric_type type, char *name, void *v
     return 0;
 }
 
+static int cmp_lines(const void *a, const void *b) {
+    return strcmp(*(char**)a, *(char**)b);
+}
+
+// Sorts the lines of a buffer in place, since the maps are
+// iterated in the order of the hashes of their keys
+static void sort_lines(char *buf) {
+    char *lines[64];
+    int num = 0;
+    char *copy = strdup(buf);
+    for (char *l = strtok(copy, "\n"); l && num < 64; l = strtok(NULL, "\n")) lines[num++] = l;
+    qsort(lines, num, sizeof(char*), cmp_lines);
+    buf[0] = 0;
+    for (int i=0; i < num; i++) {
+        strcat(buf, lines[i]);
+        strcat(buf, "\n");
+    }
+    free(copy);
+}
+
 START_TEST(test_stream_some)
 {
     metrics m;
@@ -88,11 +112,13 @@ START_TEST(test_stream_some)
     ssize_t read = fread(&buf, 1, 256, f);
     buf[read] = 0;
 
-    char *check = "kv.test2.42.000000\n\
-kv.test.100.000000\n\
+    char check[] = "kv.test.100.000000\n\
+kv.test2.42.000000\n\
 counts.foo.10.000000\n\
 counts.bar.30.000000\n\
 timers.baz.11.000000\n";
+    sort_lines(check);
+    sort_lines(buf);
     fail_unless(strcmp(check, (char*)&buf) == 0);
 
     res = destroy_metrics(&m);
@@ -100,6 +126,20 @@ timers.baz.11.000000\n";
 }
 END_TEST
 
+START_TEST(test_stream_cmd_status)
+{
+    metrics m;
+    fail_unless(init_metrics_defaults(&m) == 0);
+
+    // A command that exits at once still reports its status
+    int called = 0;
+    for (int i=0; i < 20; i++) {
+        fail_unless(stream_to_command(&m, &called, some_cb, "exit 3") == 3);
+    }
+    fail_unless(destroy_metrics(&m) == 0);
+}
+END_TEST
+
 START_TEST(test_stream_bad_cmd)
 {
     metrics m;
@@ -150,3 +190,928 @@ START_TEST(test_stream_sigpipe)
 }
 END_TEST
 
+
+START_TEST(test_stream_all)
+{
+    metrics m1, m2;
+    int res = init_metrics_defaults(&m1);
+    fail_unless(res == 0);
+    res = init_metrics_defaults(&m2);
+    fail_unless(res == 0);
+
+    // Add some metrics to each
+    fail_unless(metrics_add_sample(&m1, KEY_VAL, "test", 100) == 0);
+    fail_unless(metrics_add_sample(&m1, COUNTER, "foo", 4) == 0);
+    fail_unless(metrics_add_sample(&m2, COUNTER, "bar", 10) == 0);
+    fail_unless(metrics_add_sample(&m2, TIMER, "baz", 1) == 0);
+
+    int called = 0;
+    metrics *all[] = {&m1, &m2};
+    res = stream_all_to_command((metrics**)&all, 2, &called, some_cb, "cat > /tmp/stream_all");
+    fail_unless(res == 0);
+    fail_unless(called == 4);
+
+    FILE *f = fopen("/tmp/stream_all", "r");
+    char buf[256];
+    ssize_t read = fread(&buf, 1, 256, f);
+    buf[read] = 0;
+
+    char *check = "kv.test.100.000000\n\
+counts.foo.4.000000\n\
+counts.bar.10.000000\n\
+timers.baz.1.000000\n";
+    fail_unless(strcmp(check, (char*)&buf) == 0);
+
+    res = destroy_metrics(&m1);
+    fail_unless(res == 0);
+    res = destroy_metrics(&m2);
+    fail_unless(res == 0);
+}
+END_TEST
+static int line_cb(FILE *pipe, void *data, metric_type type, char *name, void *value) {
+    if (type == KEY_VAL) fprintf(pipe, "%s|%f\n", name, *(double*)value);
+    return 0;
+}
+
+START_TEST(test_stream_persistent_sink)
+{
+    metrics m;
+    int res = init_metrics_defaults(&m);
+    fail_unless(res == 0);
+    fail_unless(metrics_add_sample(&m, KEY_VAL, "test", 100) == 0);
+
+    // Each line is prefixed with the pid, so we can
+    // check that a single process handled every flush
+    unlink("/tmp/stream_persistent");
+    stream_sink sink;
+    fail_unless(init_stream_sink("while read l; do echo \"$$ $l\"; done > /tmp/stream_persistent", &sink) == 0);
+
+    for (int i=0; i < 3; i++) {
+        res = stream_to_sink(&sink, &m, NULL, line_cb, "--\n", 3);
+        fail_unless(res == 0);
+    }
+    fail_unless(destroy_stream_sink(&sink) == 0);
+
+    FILE *f = fopen("/tmp/stream_persistent", "r");
+    fail_unless(f != NULL);
+
+    char line[256], first_pid[32] = "";
+    char pid[32], body[200];
+    int records = 0, frames = 0;
+    while (fgets(line, sizeof(line), f)) {
+        fail_unless(sscanf(line, "%31s %199s", pid, body) == 2);
+        if (!*first_pid) strcpy(first_pid, pid);
+        fail_unless(strcmp(pid, first_pid) == 0);
+        if (strcmp(body, "--") == 0)
+            frames++;
+        else if (strcmp(body, "test|100.000000") == 0)
+            records++;
+    }
+    fclose(f);
+    fail_unless(records == 3);
+    fail_unless(frames == 3);
+
+    unlink("/tmp/stream_persistent");
+    res = destroy_metrics(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_stream_persistent_sink_restart)
+{
+    metrics m;
+    int res = init_metrics_defaults(&m);
+    fail_unless(res == 0);
+    fail_unless(metrics_add_sample(&m, KEY_VAL, "test", 100) == 0);
+
+    // The command exits after the first frame
+    unlink("/tmp/stream_restart");
+    stream_sink sink;
+    fail_unless(init_stream_sink("head -n 1 >> /tmp/stream_restart", &sink) == 0);
+
+    res = stream_to_sink(&sink, &m, NULL, line_cb, NULL, 0);
+    fail_unless(res == 0);
+    usleep(100000);
+
+    // Should be restarted
+    res = stream_to_sink(&sink, &m, NULL, line_cb, NULL, 0);
+    fail_unless(res == 0);
+    destroy_stream_sink(&sink);
+
+    FILE *f = fopen("/tmp/stream_restart", "r");
+    fail_unless(f != NULL);
+    char line[256];
+    int lines = 0;
+    while (fgets(line, sizeof(line), f)) lines++;
+    fclose(f);
+    fail_unless(lines == 2);
+
+    unlink("/tmp/stream_restart");
+    res = destroy_metrics(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+
+static int parallel_cb(FILE *pipe, void *data, metric_type type, char *name, void *value) {
+    if (type == COUNTER) return fprintf(pipe, "%s|%f\n", name, counter_sum(value)) < 0;
+    if (type == TIMER) return fprintf(pipe, "%s|%f\n", name, timer_sum(value)) < 0;
+    return 0;
+}
+
+// Reads a whole file into a malloc'ed buffer
+static char* read_file(char *path, long *len) {
+    FILE *f = fopen(path, "r");
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    rewind(f);
+    char *buf = malloc(*len + 1);
+    fail_unless(fread(buf, 1, *len, f) == (size_t)*len);
+    buf[*len] = 0;
+    fclose(f);
+    return buf;
+}
+
+static int fail_cb(FILE *pipe, void *data, metric_type type, char *name, void *value) {
+    fprintf(pipe, "partial");
+    return 1;
+}
+
+START_TEST(test_stream_ring_sink)
+{
+    metrics m;
+    int res = init_metrics_defaults(&m);
+    fail_unless(res == 0);
+    fail_unless(metrics_add_sample(&m, KEY_VAL, "test", 100) == 0);
+
+    // Each flush is published with its delimiter
+    unlink("/tmp/stream_ring");
+    stream_sink sink;
+    fail_unless(init_ring_sink("/tmp/stream_ring", 65536, 100, &sink) == 0);
+    shm_ring *r;
+    fail_unless(shm_ring_open("/tmp/stream_ring", &r) == 0);
+    fail_unless(stream_to_sink(&sink, &m, NULL, line_cb, "--\n", 3) == 0);
+    fail_unless(stream_to_sink(&sink, &m, NULL, line_cb, "--\n", 3) == 0);
+    const char *expected = "test|100.000000\n--\ntest|100.000000\n--\n";
+    fail_unless(shm_ring_head(r) - shm_ring_tail(r) == strlen(expected));
+    fail_unless(memcmp(shm_ring_data(r) + shm_ring_tail(r), expected, strlen(expected)) == 0);
+    shm_ring_consume(r, strlen(expected));
+
+    // A failed flush is not published
+    fail_unless(stream_to_sink(&sink, &m, NULL, fail_cb, "--\n", 3) != 0);
+    fail_unless(shm_ring_head(r) == shm_ring_tail(r));
+    fail_unless(stream_to_sink(&sink, &m, NULL, line_cb, "--\n", 3) == 0);
+    fail_unless(shm_ring_head(r) - shm_ring_tail(r) == 19);
+    fail_unless(memcmp(shm_ring_data(r) + (shm_ring_tail(r) & 65535), expected, 19) == 0);
+    shm_ring_consume(r, 19);
+
+    // A flush larger than the ring waits for the reader, and
+    // a reader that does not make room fails it
+    size_t len = 65536 * 3;
+    char *buf = calloc(1, len);
+    fail_unless(stream_buffer_to_sink(&sink, buf, len, "--\n", 3) != 0);
+    fail_unless(shm_ring_head(r) - shm_ring_tail(r) == 65535);
+    free(buf);
+
+    shm_ring_close(r);
+    fail_unless(destroy_stream_sink(&sink) == 0);
+    unlink("/tmp/stream_ring");
+    res = destroy_metrics(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_stream_async)
+{
+    metrics m;
+    int res = init_metrics_defaults(&m);
+    fail_unless(res == 0);
+
+    // More output than all of the buffers
+    char name[64];
+    for (int i=0; i < 60000; i++) {
+        snprintf(name, sizeof(name), "key%d", i);
+        fail_unless(metrics_add_sample(&m, (i % 10) ? COUNTER : TIMER, name, i) == 0);
+    }
+
+    res = stream_to_command(&m, NULL, parallel_cb, "cat > /tmp/stream_written");
+    fail_unless(res == 0);
+
+    // Written by a thread blocking, with a deadline, and in parallel
+    stream_set_async(2);
+    res = stream_to_command(&m, NULL, parallel_cb, "cat > /tmp/stream_async");
+    fail_unless(res == 0);
+    stream_set_timeout(5000);
+    res = stream_to_command(&m, NULL, parallel_cb, "sleep 0.1; cat > /tmp/stream_async_timed");
+    fail_unless(res == 0);
+    stream_set_timeout(0);
+    stream_set_async(4);
+    stream_set_threads(4);
+    res = stream_to_command(&m, NULL, parallel_cb, "cat > /tmp/stream_async_parallel");
+    stream_set_threads(1);
+    fail_unless(res == 0);
+
+    // A command that does not read is still killed
+    stream_set_timeout(200);
+    fail_unless(stream_to_command(&m, NULL, parallel_cb, "sleep 5") == -1);
+    stream_set_timeout(0);
+    stream_set_async(0);
+
+    // The output should be identical
+    long written_len, len;
+    char *written = read_file("/tmp/stream_written", &written_len);
+    fail_unless(written_len > 4 * 256 * 1024);
+    char *paths[] = {"/tmp/stream_async", "/tmp/stream_async_timed", "/tmp/stream_async_parallel"};
+    for (int i=0; i < 3; i++) {
+        char *out = read_file(paths[i], &len);
+        fail_unless(len == written_len);
+        fail_unless(memcmp(out, written, len) == 0);
+        free(out);
+        unlink(paths[i]);
+    }
+    free(written);
+    unlink("/tmp/stream_written");
+
+    res = destroy_metrics(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+// Writes the lines of parallel_cb, gathering them when it can
+static int gather_cb(FILE *pipe, void *data, metric_type type, char *name, void *value) {
+    stream_gather *g = stream_gather_for(pipe);
+    if (!g) return parallel_cb(pipe, data, type, name, value);
+    if (type != COUNTER && type != TIMER) return 0;
+    char val[64];
+    double v = (type == COUNTER) ? counter_sum(value) : timer_sum(value);
+    int len = snprintf(val, sizeof(val), "|%f\n", v);
+    return stream_gather_ref(g, name, strlen(name)) || stream_gather_copy(g, val, len);
+}
+
+START_TEST(test_stream_gather)
+{
+    metrics m;
+    int res = init_metrics_defaults(&m);
+    fail_unless(res == 0);
+
+    // More lines than are written at once
+    char name[64];
+    for (int i=0; i < 10000; i++) {
+        snprintf(name, sizeof(name), "key%d", i);
+        fail_unless(metrics_add_sample(&m, (i % 10) ? COUNTER : TIMER, name, i) == 0);
+    }
+
+    res = stream_to_command(&m, NULL, parallel_cb, "cat > /tmp/stream_written");
+    fail_unless(res == 0);
+
+    // Gathered blocking, with a deadline, and in parallel, which writes
+    stream_set_gather(1);
+    res = stream_to_command(&m, NULL, gather_cb, "cat > /tmp/stream_gathered");
+    fail_unless(res == 0);
+    stream_set_timeout(5000);
+    res = stream_to_command(&m, NULL, gather_cb, "sleep 0.1; cat > /tmp/stream_gathered_timed");
+    fail_unless(res == 0);
+    stream_set_timeout(0);
+    stream_set_threads(4);
+    res = stream_to_command(&m, NULL, gather_cb, "cat > /tmp/stream_gathered_parallel");
+    stream_set_threads(1);
+    fail_unless(res == 0);
+
+    // A command that does not read is still killed
+    stream_set_timeout(200);
+    fail_unless(stream_to_command(&m, NULL, gather_cb, "sleep 5") == -1);
+    stream_set_timeout(0);
+    stream_set_gather(0);
+
+    // The output should be identical
+    long written_len, len;
+    char *written = read_file("/tmp/stream_written", &written_len);
+    fail_unless(written_len > 0);
+    char *paths[] = {"/tmp/stream_gathered", "/tmp/stream_gathered_timed", "/tmp/stream_gathered_parallel"};
+    for (int i=0; i < 3; i++) {
+        char *out = read_file(paths[i], &len);
+        fail_unless(len == written_len);
+        fail_unless(memcmp(out, written, len) == 0);
+        free(out);
+        unlink(paths[i]);
+    }
+    free(written);
+    unlink("/tmp/stream_written");
+
+    res = destroy_metrics(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_stream_parallel)
+{
+    metrics m;
+    int res = init_metrics_defaults(&m);
+    fail_unless(res == 0);
+
+    // Enough metrics for several partitions
+    char name[64];
+    for (int i=0; i < 10000; i++) {
+        snprintf(name, sizeof(name), "key%d", i);
+        fail_unless(metrics_add_sample(&m, (i % 10) ? COUNTER : TIMER, name, i) == 0);
+    }
+
+    res = stream_to_command(&m, NULL, parallel_cb, "cat > /tmp/stream_serial");
+    fail_unless(res == 0);
+
+    stream_set_threads(4);
+    res = stream_to_command(&m, NULL, parallel_cb, "cat > /tmp/stream_parallel");
+    stream_set_threads(1);
+    fail_unless(res == 0);
+
+    // The output should be identical
+    long serial_len, parallel_len;
+    char *serial = read_file("/tmp/stream_serial", &serial_len);
+    char *parallel = read_file("/tmp/stream_parallel", &parallel_len);
+    fail_unless(serial_len > 0);
+    fail_unless(serial_len == parallel_len);
+    fail_unless(memcmp(serial, parallel, serial_len) == 0);
+
+    free(serial);
+    free(parallel);
+    unlink("/tmp/stream_serial");
+    unlink("/tmp/stream_parallel");
+
+    res = destroy_metrics(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_stream_parallel_heavy)
+{
+    metrics m;
+    int res = init_metrics_defaults(&m);
+    fail_unless(res == 0);
+
+    // Too few metrics to split by their number, but the
+    // timers make up for it with their samples
+    char name[64];
+    for (int i=0; i < 200; i++) {
+        snprintf(name, sizeof(name), "key%d", i);
+        fail_unless(metrics_add_sample(&m, COUNTER, name, i) == 0);
+        for (int j=0; j < 1000; j++) {
+            fail_unless(metrics_add_sample(&m, TIMER, name, (j * 7919) % 1000) == 0);
+        }
+    }
+
+    res = stream_to_command(&m, NULL, parallel_cb, "cat > /tmp/stream_serial");
+    fail_unless(res == 0);
+
+    stream_set_threads(4);
+    stream_finalize_timers(&m);
+    res = stream_to_command(&m, NULL, parallel_cb, "cat > /tmp/stream_parallel");
+    stream_set_threads(1);
+    fail_unless(res == 0);
+
+    // The output should be identical
+    long serial_len, parallel_len;
+    char *serial = read_file("/tmp/stream_serial", &serial_len);
+    char *parallel = read_file("/tmp/stream_parallel", &parallel_len);
+    fail_unless(serial_len > 0);
+    fail_unless(serial_len == parallel_len);
+    fail_unless(memcmp(serial, parallel, serial_len) == 0);
+
+    free(serial);
+    free(parallel);
+    unlink("/tmp/stream_serial");
+    unlink("/tmp/stream_parallel");
+
+    res = destroy_metrics(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_stream_splice)
+{
+    metrics m;
+    int res = init_metrics_defaults(&m);
+    fail_unless(res == 0);
+
+    // More output than the pages spliced at once
+    char name[64];
+    for (int i=0; i < 40000; i++) {
+        snprintf(name, sizeof(name), "key%d", i);
+        fail_unless(metrics_add_sample(&m, (i % 10) ? COUNTER : TIMER, name, i) == 0);
+    }
+
+    res = stream_to_command(&m, NULL, parallel_cb, "cat > /tmp/stream_written");
+    fail_unless(res == 0);
+
+    // Spliced blocking, with a deadline, and in parallel
+    stream_set_splice(1);
+    res = stream_to_command(&m, NULL, parallel_cb, "cat > /tmp/stream_spliced");
+    fail_unless(res == 0);
+    stream_set_timeout(5000);
+    res = stream_to_command(&m, NULL, parallel_cb, "sleep 0.1; cat > /tmp/stream_spliced_timed");
+    fail_unless(res == 0);
+    stream_set_timeout(0);
+    stream_set_threads(4);
+    res = stream_to_command(&m, NULL, parallel_cb, "cat > /tmp/stream_spliced_parallel");
+    stream_set_threads(1);
+    fail_unless(res == 0);
+
+    // A command that does not read is still killed
+    stream_set_timeout(200);
+    fail_unless(stream_to_command(&m, NULL, parallel_cb, "sleep 5") == -1);
+    stream_set_timeout(0);
+    stream_set_splice(0);
+
+    // The output should be identical
+    long written_len, len;
+    char *written = read_file("/tmp/stream_written", &written_len);
+    fail_unless(written_len > 256 * 1024);
+    char *paths[] = {"/tmp/stream_spliced", "/tmp/stream_spliced_timed", "/tmp/stream_spliced_parallel"};
+    for (int i=0; i < 3; i++) {
+        char *out = read_file(paths[i], &len);
+        fail_unless(len == written_len);
+        fail_unless(memcmp(out, written, len) == 0);
+        free(out);
+        unlink(paths[i]);
+    }
+    free(written);
+    unlink("/tmp/stream_written");
+
+    res = destroy_metrics(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_stream_file)
+{
+    metrics m;
+    int res = init_metrics_defaults(&m);
+    fail_unless(res == 0);
+    fail_unless(metrics_add_sample(&m, COUNTER, "foo", 4) == 0);
+    fail_unless(metrics_add_sample(&m, COUNTER, "bar", 10) == 0);
+
+    // Write to a file, then stream the file to a command
+    res = stream_to_file(&m, NULL, parallel_cb, "/tmp/stream_spill");
+    fail_unless(res == 0);
+    res = stream_file_to_command("/tmp/stream_spill", "cat > /tmp/stream_spill_out");
+    fail_unless(res == 0);
+
+    long len;
+    char *out = read_file("/tmp/stream_spill_out", &len);
+    fail_unless(strcmp(out, "foo|4.000000\nbar|10.000000\n") == 0 ||
+                strcmp(out, "bar|10.000000\nfoo|4.000000\n") == 0);
+    free(out);
+
+    // Missing files are an error
+    unlink("/tmp/stream_spill");
+    res = stream_file_to_command("/tmp/stream_spill", "cat > /dev/null");
+    fail_unless(res == -1);
+    unlink("/tmp/stream_spill_out");
+
+    res = destroy_metrics(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_stream_lz4)
+{
+    metrics m;
+    int res = init_metrics_defaults(&m);
+    fail_unless(res == 0);
+    fail_unless(metrics_add_sample(&m, KEY_VAL, "test", 100) == 0);
+
+    // A command gets a frame, and each flush to a sink is one
+    stream_set_compression(COMPRESS_LZ4);
+    res = stream_to_command(&m, NULL, line_cb, "cat > /tmp/stream_lz4");
+    fail_unless(res == 0);
+    stream_sink sink;
+    fail_unless(init_stream_sink("cat >> /tmp/stream_lz4", &sink) == 0);
+    for (int i=0; i < 2; i++) {
+        fail_unless(stream_to_sink(&sink, &m, NULL, line_cb, "--\n", 3) == 0);
+    }
+    fail_unless(destroy_stream_sink(&sink) == 0);
+    stream_set_compression(COMPRESS_NONE);
+
+    // The frames decode to the plain output
+    FILE *f = fopen("/tmp/stream_lz4", "r");
+    fail_unless(f != NULL);
+    char *out;
+    size_t len;
+    FILE *o = open_memstream(&out, &len);
+    fail_unless(lz4_frame_decode(f, o) == 0);
+    fclose(o);
+    fclose(f);
+    fail_unless(strcmp(out, "test|100.000000\ntest|100.000000\n--\ntest|100.000000\n--\n") == 0);
+    free(out);
+
+    unlink("/tmp/stream_lz4");
+    res = destroy_metrics(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_stream_timeout)
+{
+    metrics m;
+    int res = init_metrics_defaults(&m);
+    fail_unless(res == 0);
+    fail_unless(metrics_add_sample(&m, KEY_VAL, "test", 100) == 0);
+
+    // A command that does not read or exit is killed
+    struct timeval start, end;
+    size_t len = 1 << 20;
+    char *buf = calloc(1, len);
+    stream_set_timeout(200);
+    gettimeofday(&start, NULL);
+    fail_unless(stream_buffer_to_command(buf, len, "sleep 5") == -1);
+    fail_unless(stream_to_command(&m, NULL, line_cb, "sleep 5") == -1);
+    gettimeofday(&end, NULL);
+    fail_unless(end.tv_sec - start.tv_sec < 3);
+
+    // Others finish as usual
+    fail_unless(stream_buffer_to_command(buf, len, "cat > /dev/null") == 0);
+    fail_unless(stream_to_command(&m, NULL, line_cb, "cat > /dev/null; exit 2") == 2);
+    stream_set_timeout(0);
+    free(buf);
+
+    res = destroy_metrics(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_stream_timings)
+{
+    metrics m;
+    int res = init_metrics_defaults(&m);
+    fail_unless(res == 0);
+
+    // More output than the pipe holds, read once the command wakes
+    char name[64];
+    for (int i=0; i < 20000; i++) {
+        snprintf(name, sizeof(name), "key%d", i);
+        fail_unless(metrics_add_sample(&m, COUNTER, name, i) == 0);
+    }
+    stream_timings t;
+    res = stream_to_command(&m, NULL, parallel_cb, "sleep 0.2; cat > /dev/null");
+    fail_unless(res == 0);
+    stream_get_timings(&t);
+    fail_unless(t.write_ms >= 100);
+    fail_unless(t.command_ms >= 0);
+    fail_unless(t.format_ms >= 0);
+
+    // A command that only exits late is waited on
+    res = stream_to_command(&m, NULL, line_cb, "cat > /dev/null; sleep 0.2");
+    fail_unless(res == 0);
+    stream_get_timings(&t);
+    fail_unless(t.command_ms >= 150);
+    fail_unless(t.write_ms < 100);
+
+    res = destroy_metrics(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_stream_partitioned)
+{
+    metrics m;
+    int res = init_metrics_defaults(&m);
+    fail_unless(res == 0);
+    char name[64];
+    for (int i=0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "key%d", i);
+        fail_unless(metrics_add_sample(&m, COUNTER, name, i) == 0);
+    }
+
+    // Each command counts its lines, which add up to all of the metrics
+    unlink("/tmp/stream_partitioned");
+    res = stream_partitioned_to_command(&m, NULL, parallel_cb, "wc -l >> /tmp/stream_partitioned", 4);
+    fail_unless(res == 0);
+    FILE *f = fopen("/tmp/stream_partitioned", "r");
+    fail_unless(f != NULL);
+    int lines = 0, count, total = 0;
+    while (fscanf(f, "%d", &count) == 1) {
+        fail_unless(count > 0 && count < 1000);
+        lines++;
+        total += count;
+    }
+    fclose(f);
+    fail_unless(lines == 4);
+    fail_unless(total == 1000);
+
+    // The first failing status is returned
+    res = stream_partitioned_to_command(&m, NULL, parallel_cb, "cat > /dev/null; exit 3", 3);
+    fail_unless(res == 3);
+    unlink("/tmp/stream_partitioned");
+
+    res = destroy_metrics(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_stream_fan_out)
+{
+    // Each command gets the buffer, and a stuck one is killed at its timeout
+    char *cmds[] = {"cat > /tmp/fan_out_a", "cat > /tmp/fan_out_b", "sleep 5", "cat > /dev/null; exit 3"};
+    int timeouts[] = {0, 0, 200, 0};
+    int results[4];
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    int res = stream_buffer_to_commands("test|1\n", 7, cmds, timeouts, results, 4);
+    gettimeofday(&end, NULL);
+    fail_unless(res == -1);
+    fail_unless(results[0] == 0);
+    fail_unless(results[1] == 0);
+    fail_unless(results[2] == -1);
+    fail_unless(results[3] == 3);
+    fail_unless(end.tv_sec - start.tv_sec < 3);
+
+    for (int i=0; i < 2; i++) {
+        char buf[16] = {0};
+        FILE *f = fopen(i ? "/tmp/fan_out_b" : "/tmp/fan_out_a", "r");
+        fail_unless(f != NULL);
+        fail_unless(fread(buf, 1, sizeof(buf), f) == 7);
+        fclose(f);
+        fail_unless(strcmp(buf, "test|1\n") == 0);
+    }
+    unlink("/tmp/fan_out_a");
+    unlink("/tmp/fan_out_b");
+}
+END_TEST
+
+// Writes each metric with its type, checking the name before it when serial
+static int sorted_cb(FILE *pipe, void *data, metric_type type, char *name, void *value) {
+    char **prev = data;
+    if (prev && stream_prev_name() != *prev) return 1;
+    if (prev) *prev = name;
+    return fprintf(pipe, "%d %s\n", type, name) < 0;
+}
+
+START_TEST(test_stream_sorted)
+{
+    metrics m;
+    int res = init_metrics_defaults(&m);
+    fail_unless(res == 0);
+
+    // Keys of several types, added out of order
+    char name[64];
+    metric_type types[] = {COUNTER, TIMER, GAUGE};
+    for (int i=0; i < 10000; i++) {
+        int k = (i * 7919) % 10000;
+        snprintf(name, sizeof(name), "api.host%d.requests.%d", k % 13, k);
+        fail_unless(metrics_add_sample(&m, types[k % 3], name, i) == 0);
+    }
+
+    // Sort serially and in parallel
+    stream_set_sorted(1);
+    for (int threads=1; threads <= 4; threads += 3) {
+        stream_set_threads(threads);
+        char *prev = NULL;
+        res = stream_to_file(&m, (threads == 1) ? &prev : NULL, sorted_cb, "/tmp/stream_sorted");
+        fail_unless(res == 0);
+
+        // Each type is together, and sorted by name
+        FILE *f = fopen("/tmp/stream_sorted", "r");
+        char line[128], last[128] = "";
+        int type, last_type = -1, runs = 0, lines = 0;
+        while (fscanf(f, "%d %127s", &type, line) == 2) {
+            if (type != last_type) {
+                runs++;
+                last_type = type;
+            } else {
+                fail_unless(strcmp(last, line) < 0);
+            }
+            strcpy(last, line);
+            lines++;
+        }
+        fclose(f);
+        fail_unless(lines == 10000);
+        fail_unless(runs == 3);
+    }
+    stream_set_threads(1);
+    stream_set_sorted(0);
+    unlink("/tmp/stream_sorted");
+
+    res = destroy_metrics(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_stream_front_coded)
+{
+    metrics m;
+    int res = init_metrics_defaults(&m);
+    fail_unless(res == 0);
+    char name[64];
+    for (int i=0; i < 100; i++) {
+        snprintf(name, sizeof(name), "api.host%d.requests", 99 - i);
+        fail_unless(metrics_add_sample(&m, GAUGE, name, i) == 0);
+    }
+
+    statsite_config config;
+    fail_unless(config_from_filename(NULL, &config) == 0);
+    config.binary_stream = true;
+    config.binary_stream_front_coded = true;
+    struct timeval tv = {1000, 0};
+    stream_set_sorted(1);
+    res = stream_to_file(&m, &tv, output_formatter(&config), "/tmp/stream_front_coded");
+    stream_set_sorted(0);
+    fail_unless(res == 0);
+
+    // Decode the keys, each shares a prefix with the one before
+    long len;
+    char *out = read_file("/tmp/stream_front_coded", &len);
+    char key[64] = "", last[64] = "";
+    int pos = 0, records = 0;
+    while (pos < len) {
+        uint16_t num_values, shared, suffix;
+        memcpy(&num_values, out + pos + 9, 2);
+        memcpy(&shared, out + pos + 13, 2);
+        memcpy(&suffix, out + pos + 15, 2);
+        fail_unless(shared <= strlen(key));
+        fail_unless(records == 0 || shared >= 8);
+        memcpy(key + shared, out + pos + 17, suffix);
+        fail_unless(strcmp(last, key) < 0);
+        strcpy(last, key);
+        pos += 17 + suffix + num_values * 9;
+        records++;
+    }
+    fail_unless(pos == len);
+    fail_unless(records == 100);
+    fail_unless(strcmp(last, "api.host99.requests") == 0);
+    free(out);
+    unlink("/tmp/stream_front_coded");
+
+    res = destroy_metrics(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_stream_json)
+{
+    metrics m;
+    int res = init_metrics_defaults(&m);
+    fail_unless(res == 0);
+    fail_unless(metrics_add_sample(&m, KEY_VAL, "k\"v", 1) == 0);
+    fail_unless(metrics_add_sample(&m, GAUGE, "g", 2) == 0);
+    fail_unless(metrics_add_sample(&m, COUNTER, "c", 3) == 0);
+    fail_unless(metrics_set_update(&m, "s", "a") == 0);
+    fail_unless(metrics_add_sample(&m, TIMER, "t", 4) == 0);
+
+    statsite_config config;
+    fail_unless(config_from_filename(NULL, &config) == 0);
+    config.json_stream = true;
+    struct timeval tv = {1000, 0};
+    res = stream_to_file(&m, &tv, output_formatter(&config), "/tmp/stream_json");
+    fail_unless(res == 0);
+
+    // A line for each metric, keyed by its name
+    long len;
+    char *out = read_file("/tmp/stream_json", &len);
+    fail_unless(strstr(out, "{\"k\\\"v\":{\"type\":\"kv\",\"ts\":1000,\"kv\":1.000000}}\n") != NULL);
+    fail_unless(strstr(out, "{\"g\":{\"type\":\"gauge\",\"ts\":1000,\"kv\":2.000000}}\n") != NULL);
+    fail_unless(strstr(out, "{\"c\":{\"type\":\"counter\",\"ts\":1000,\"sum\":3.000000,"
+                "\"sumsqrt\":9.000000,\"mean\":3.000000,\"count\":1,") != NULL);
+    fail_unless(strstr(out, "{\"s\":{\"type\":\"set\",\"ts\":1000,\"sum\":1}}\n") != NULL);
+    fail_unless(strstr(out, "{\"t\":{\"type\":\"timer\",\"ts\":1000,\"sum\":4.000000,") != NULL);
+    fail_unless(strstr(out, "\"P50\":4.000000,\"P90\":4.000000,\"P95\":4.000000,\"P99\":4.000000}}\n") != NULL);
+    int lines = 0;
+    for (long i=0; i < len; i++) lines += (out[i] == '\n');
+    fail_unless(lines == 5);
+    free(out);
+    unlink("/tmp/stream_json");
+
+    res = destroy_metrics(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_stream_columnar)
+{
+    metrics m;
+    int res = init_metrics_defaults(&m);
+    fail_unless(res == 0);
+
+    // Enough counters for several blocks, and a few timers and gauges
+    char name[64];
+    for (int i=0; i < 10000; i++) {
+        snprintf(name, sizeof(name), "c%d", i);
+        fail_unless(metrics_add_sample(&m, COUNTER, name, i) == 0);
+    }
+    for (int i=0; i < 10; i++) {
+        snprintf(name, sizeof(name), "t%d", i);
+        fail_unless(metrics_add_sample(&m, TIMER, name, i) == 0);
+        fail_unless(metrics_add_sample(&m, TIMER, name, i + 10) == 0);
+        snprintf(name, sizeof(name), "g%d", i);
+        fail_unless(metrics_add_sample(&m, GAUGE, name, i) == 0);
+    }
+
+    statsite_config config;
+    fail_unless(config_from_filename(NULL, &config) == 0);
+    config.columnar_stream = true;
+    struct timeval tv = {1000, 0};
+    stream_set_block_output(1);
+    for (int threads=1; threads <= 4; threads += 3) {
+        stream_set_threads(threads);
+        res = stream_to_file(&m, &tv, output_formatter(&config), "/tmp/stream_columnar");
+        fail_unless(res == 0);
+
+        // Decode the blocks, each value is stored in its name
+        long len;
+        char *out = read_file("/tmp/stream_columnar", &len);
+        long pos = 0;
+        int counters = 0, timers = 0, gauges = 0, blocks = 0;
+        while (pos < len) {
+            uint64_t ts;
+            uint8_t type;
+            uint16_t num_columns;
+            uint32_t num_metrics, names_len;
+            memcpy(&ts, out + pos, 8);
+            type = out[pos + 8];
+            memcpy(&num_columns, out + pos + 9, 2);
+            memcpy(&num_metrics, out + pos + 11, 4);
+            memcpy(&names_len, out + pos + 15, 4);
+            fail_unless(ts == 1000);
+            fail_unless(num_metrics > 0 && num_metrics <= 4096);
+            pos += 19;
+
+            // The first column is the sum, or the value
+            fail_unless(out[pos] == (type == 5 ? 0 : 1));
+            pos += num_columns * 9;
+            char *names = out + pos;
+            double *values = (double*)(names + names_len);
+            for (uint32_t i=0; i < num_metrics; i++) {
+                int n = atoi(names + 1);
+                if (type == 2) {
+                    fail_unless(num_columns == 7 && values[i] == n);
+                    fail_unless(values[2 * num_metrics + i] == n);
+                    fail_unless(values[4 * num_metrics + i] == 0);
+                    counters++;
+                } else if (type == 3) {
+                    // The mean and stddev are computed for the whole block
+                    fail_unless(values[i] == 2 * n + 10);
+                    fail_unless(values[2 * num_metrics + i] == n + 5);
+                    fail_unless(values[3 * num_metrics + i] == 2);
+                    fail_unless(fabs(values[4 * num_metrics + i] - sqrt(50)) < 1e-9);
+                    timers++;
+                } else if (type == 5) {
+                    fail_unless(num_columns == 1 && values[i] == n);
+                    gauges++;
+                }
+                names += strlen(names) + 1;
+            }
+            fail_unless(names == out + pos + names_len);
+            pos += names_len + num_columns * num_metrics * sizeof(double);
+            blocks++;
+        }
+        fail_unless(pos == len);
+        fail_unless(counters == 10000 && timers == 10 && gauges == 10);
+        fail_unless(blocks >= 5);
+        free(out);
+    }
+    stream_set_threads(1);
+    stream_set_block_output(0);
+    unlink("/tmp/stream_columnar");
+
+    res = destroy_metrics(&m);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_stream_finalize_timers)
+{
+    metrics m;
+    int res = init_metrics_defaults(&m);
+    fail_unless(res == 0);
+
+    // Enough timers to finalize on several threads, with unsorted
+    // samples, and one with enough samples for the quantile engine
+    char name[64];
+    for (int i=0; i < 5000; i++) {
+        snprintf(name, sizeof(name), "t%d", i);
+        for (int j=3; j > 0; j--) {
+            fail_unless(metrics_add_sample(&m, TIMER, name, i + j) == 0);
+        }
+    }
+    for (int j=0; j < 10000; j++) {
+        fail_unless(metrics_add_sample(&m, TIMER, "big", j) == 0);
+    }
+
+    stream_set_threads(4);
+    stream_finalize_timers(&m);
+    stream_set_threads(1);
+    for (int i=0; i < 5000; i++) {
+        snprintf(name, sizeof(name), "t%d", i);
+        timer_hist *t;
+        fail_unless(hashmap_get(m.timers, name, (void**)&t) == 0);
+        fail_unless(t->tm.finalized);
+        fail_unless(t->tm.exact[0] == i + 1 && t->tm.exact[2] == i + 3);
+    }
+    timer_hist *t;
+    fail_unless(hashmap_get(m.timers, "big", (void**)&t) == 0);
+    fail_unless(t->tm.finalized);
+    double p50 = timer_query(&t->tm, 0.5);
+    fail_unless(p50 > 4900 && p50 < 5100);
+
+    res = destroy_metrics(&m);
+    fail_unless(res == 0);
+}
+END_TEST
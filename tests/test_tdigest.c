@@ -0,0 +1,91 @@
+#include <check.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "tdigest.h"
+
+START_TEST(test_td_init_and_destroy)
+{
+    tdigest td;
+    fail_unless(init_tdigest(100, &td) == 0);
+    fail_unless(tdigest_query(&td, 0.5) == 0);
+    fail_unless(destroy_tdigest(&td) == 0);
+}
+END_TEST
+
+START_TEST(test_td_init_bad_compression)
+{
+    tdigest td;
+    fail_unless(init_tdigest(10, &td) == -1);
+}
+END_TEST
+
+START_TEST(test_td_add_query)
+{
+    tdigest td;
+    fail_unless(init_tdigest(100, &td) == 0);
+    fail_unless(tdigest_add(&td, -100.0) == 0);
+    fail_unless(tdigest_query(&td, 0.5) == -100.0);
+    fail_unless(tdigest_query(&td, 0.99) == -100.0);
+    fail_unless(destroy_tdigest(&td) == 0);
+}
+END_TEST
+
+START_TEST(test_td_add_loop_query)
+{
+    tdigest td;
+    fail_unless(init_tdigest(100, &td) == 0);
+
+    srandom(42);
+    for (int i=0; i < 1000000; i++) {
+        fail_unless(tdigest_add(&td, random() % 100000) == 0);
+    }
+
+    // The memory is bounded by the compression
+    fail_unless(tdigest_flush(&td) == 0);
+    fail_unless(td.num_centroids <= 100);
+    fail_unless(td.total_weight == 1000000);
+
+    double val = tdigest_query(&td, 0.5);
+    fail_unless(val >= 50000 - 1000 && val <= 50000 + 1000);
+
+    val = tdigest_query(&td, 0.90);
+    fail_unless(val >= 90000 - 500 && val <= 90000 + 500);
+
+    // The tails are the most accurate
+    val = tdigest_query(&td, 0.99);
+    fail_unless(val >= 99000 - 100 && val <= 99000 + 100);
+
+    fail_unless(tdigest_query(&td, 0) == 0);
+    fail_unless(tdigest_query(&td, 1) == 99999);
+
+    fail_unless(destroy_tdigest(&td) == 0);
+}
+END_TEST
+
+START_TEST(test_td_merge)
+{
+    tdigest td1, td2;
+    fail_unless(init_tdigest(100, &td1) == 0);
+    fail_unless(init_tdigest(100, &td2) == 0);
+
+    // Disjoint ranges make the merge order matter
+    for (int i=0; i < 100000; i++) {
+        fail_unless(tdigest_add((i < 50000) ? &td1 : &td2, i) == 0);
+    }
+    fail_unless(tdigest_merge(&td1, &td2) == 0);
+    fail_unless(td1.total_weight == 100000);
+    fail_unless(td1.min == 0);
+    fail_unless(td1.max == 99999);
+
+    double val = tdigest_query(&td1, 0.5);
+    fail_unless(val >= 50000 - 1000 && val <= 50000 + 1000);
+
+    val = tdigest_query(&td1, 0.99);
+    fail_unless(val >= 99000 - 200 && val <= 99000 + 200);
+
+    fail_unless(destroy_tdigest(&td1) == 0);
+    fail_unless(destroy_tdigest(&td2) == 0);
+}
+END_TEST
@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <math.h>
 #include "timer.h"
+#include "stats.h"
 
 START_TEST(test_timer_init_and_destroy)
 {
@@ -69,3 +70,335 @@ START_TEST(test_timer_add_loop)
 }
 END_TEST
 
+START_TEST(test_timer_merge)
+{
+    timer t1, t2;
+    double quants[] = {0.5, 0.90, 0.99};
+    fail_unless(init_timer(0.01, (double*)&quants, 3, &t1) == 0);
+    fail_unless(init_timer(0.01, (double*)&quants, 3, &t2) == 0);
+
+    for (int i=1; i<=100; i++)
+        fail_unless(timer_add_sample((i % 2) ? &t1 : &t2, i) == 0);
+
+    fail_unless(timer_merge(&t1, &t2) == 0);
+
+    fail_unless(timer_count(&t1) == 100);
+    fail_unless(timer_sum(&t1) == 5050);
+    fail_unless(timer_squared_sum(&t1) == 338350);
+    fail_unless(timer_min(&t1) == 1);
+    fail_unless(timer_max(&t1) == 100);
+    fail_unless(timer_query(&t1, 0.5) >= 49 && timer_query(&t1, 0.5) <= 51);
+    fail_unless(timer_query(&t1, 0.90) >= 89 && timer_query(&t1, 0.90) <= 91);
+
+    fail_unless(destroy_timer(&t1) == 0);
+    fail_unless(destroy_timer(&t2) == 0);
+}
+END_TEST
+
+
+START_TEST(test_timer_tdigest)
+{
+    timer t1, t2;
+    fail_unless(init_timer_tdigest(100, &t1) == 0);
+    fail_unless(init_timer_tdigest(100, &t2) == 0);
+
+    for (int i=1; i<=100; i++)
+        fail_unless(timer_add_sample((i % 2) ? &t1 : &t2, i) == 0);
+    fail_unless(timer_merge(&t1, &t2) == 0);
+
+    fail_unless(timer_count(&t1) == 100);
+    fail_unless(timer_sum(&t1) == 5050);
+    fail_unless(timer_min(&t1) == 1);
+    fail_unless(timer_max(&t1) == 100);
+    fail_unless(timer_query(&t1, 0.5) >= 49 && timer_query(&t1, 0.5) <= 52);
+    fail_unless(timer_query(&t1, 0.90) >= 89 && timer_query(&t1, 0.90) <= 91);
+
+    // Timers with different engines cannot be merged
+    timer t3;
+    double quants[] = {0.5, 0.90, 0.99};
+    fail_unless(init_timer(0.01, (double*)&quants, 3, &t3) == 0);
+    fail_unless(timer_merge(&t1, &t3) == -1);
+
+    fail_unless(destroy_timer(&t1) == 0);
+    fail_unless(destroy_timer(&t2) == 0);
+    fail_unless(destroy_timer(&t3) == 0);
+}
+END_TEST
+
+START_TEST(test_timer_hdr)
+{
+    timer t1, t2;
+    fail_unless(init_timer_hdr(0.01, &t1) == 0);
+    fail_unless(init_timer_hdr(0.01, &t2) == 0);
+
+    for (int i=1; i<=100; i++)
+        fail_unless(timer_add_sample((i % 2) ? &t1 : &t2, i) == 0);
+    fail_unless(timer_merge(&t1, &t2) == 0);
+
+    fail_unless(timer_count(&t1) == 100);
+    fail_unless(timer_sum(&t1) == 5050);
+    fail_unless(timer_min(&t1) == 1);
+    fail_unless(timer_max(&t1) == 100);
+    fail_unless(fabs(timer_query(&t1, 0.5) - 50) <= 0.5);
+    fail_unless(fabs(timer_query(&t1, 0.90) - 90) <= 0.9);
+
+    // Timers with different engines cannot be merged
+    timer t3;
+    fail_unless(init_timer_tdigest(100, &t3) == 0);
+    fail_unless(timer_merge(&t1, &t3) == -1);
+
+    fail_unless(destroy_timer(&t1) == 0);
+    fail_unless(destroy_timer(&t2) == 0);
+    fail_unless(destroy_timer(&t3) == 0);
+}
+END_TEST
+
+START_TEST(test_timer_exact)
+{
+    timer t;
+    double quants[] = {0.5, 0.90, 0.99};
+    fail_unless(init_timer(0.01, (double*)&quants, 3, &t) == 0);
+
+    // Add in reverse, small timers are exact
+    for (int i=10; i >= 1; i--)
+        fail_unless(timer_add_sample(&t, i) == 0);
+    fail_unless(t.num_exact == 10);
+    fail_unless(timer_min(&t) == 1);
+    fail_unless(timer_max(&t) == 10);
+    fail_unless(timer_query(&t, 0.5) == 5);
+    fail_unless(timer_query(&t, 0.90) == 9);
+    fail_unless(timer_query(&t, 0.99) == 10);
+
+    double vals[3];
+    timer_query_many(&t, quants, 3, vals);
+    fail_unless(vals[0] == 5 && vals[1] == 9 && vals[2] == 10);
+
+    // Past the threshold the quantile engine is used
+    for (int i=11; i <= 1000; i++)
+        fail_unless(timer_add_sample(&t, i) == 0);
+    fail_unless(t.num_exact == 0);
+    fail_unless(t.exact == NULL);
+    fail_unless(timer_count(&t) == 1000);
+    fail_unless(timer_min(&t) == 1);
+    fail_unless(timer_max(&t) == 1000);
+    fail_unless(timer_query(&t, 0.5) >= 490 && timer_query(&t, 0.5) <= 510);
+    timer_query_many(&t, quants, 3, vals);
+    for (int i=0; i < 3; i++) fail_unless(vals[i] == timer_query(&t, quants[i]));
+
+    fail_unless(destroy_timer(&t) == 0);
+}
+END_TEST
+
+START_TEST(test_timer_merge_exact)
+{
+    timer t1, t2, t3;
+    double quants[] = {0.5, 0.90, 0.99};
+    fail_unless(init_timer(0.01, (double*)&quants, 3, &t1) == 0);
+    fail_unless(init_timer(0.01, (double*)&quants, 3, &t2) == 0);
+    fail_unless(init_timer(0.01, (double*)&quants, 3, &t3) == 0);
+
+    // Two exact timers stay exact
+    for (int i=1; i<=20; i++)
+        fail_unless(timer_add_sample((i % 2) ? &t1 : &t2, i) == 0);
+    fail_unless(timer_merge(&t1, &t2) == 0);
+    fail_unless(t1.num_exact == 20);
+    fail_unless(timer_query(&t1, 0.5) == 10);
+    fail_unless(timer_max(&t1) == 20);
+
+    // Merging a large timer converts the exact one
+    for (int i=21; i<=1000; i++)
+        fail_unless(timer_add_sample(&t3, i) == 0);
+    fail_unless(timer_merge(&t1, &t3) == 0);
+    fail_unless(t1.num_exact == 0);
+    fail_unless(timer_count(&t1) == 1000);
+    fail_unless(timer_min(&t1) == 1);
+    fail_unless(timer_max(&t1) == 1000);
+    fail_unless(timer_query(&t1, 0.5) >= 490 && timer_query(&t1, 0.5) <= 510);
+
+    fail_unless(destroy_timer(&t1) == 0);
+    fail_unless(destroy_timer(&t2) == 0);
+    fail_unless(destroy_timer(&t3) == 0);
+}
+END_TEST
+
+START_TEST(test_timer_add_weighted)
+{
+    timer t1, t2;
+    double quants[] = {0.5, 0.90, 0.99};
+    fail_unless(init_timer(0.01, (double*)&quants, 3, &t1) == 0);
+    fail_unless(init_timer_tdigest(100, &t2) == 0);
+
+    // A small weighted timer keeps the copies exact
+    fail_unless(timer_add_weighted(&t1, 5, 4) == 0);
+    fail_unless(timer_add_weighted(&t1, 1, 1) == 0);
+    fail_unless(t1.num_exact == 5);
+    fail_unless(timer_count(&t1) == 5);
+    fail_unless(timer_sum(&t1) == 21);
+    fail_unless(timer_query(&t1, 0.5) == 5);
+
+    // Past the threshold each sample spans its weight
+    for (int i=1; i <= 1000; i++) {
+        fail_unless(timer_add_weighted(&t1, i, 10) == 0);
+        fail_unless(timer_add_weighted(&t2, i, 10) == 0);
+    }
+    fail_unless(t1.num_exact == 0);
+    fail_unless(timer_count(&t1) == 10005);
+    fail_unless(timer_count(&t2) == 10000);
+    fail_unless(timer_sum(&t2) == 5005000);
+    fail_unless(timer_squared_sum(&t2) == 10 * 333833500.0);
+    fail_unless(timer_min(&t2) == 1);
+    fail_unless(timer_max(&t2) == 1000);
+    fail_unless(timer_query(&t1, 0.5) >= 490 && timer_query(&t1, 0.5) <= 510);
+    fail_unless(timer_query(&t2, 0.5) >= 490 && timer_query(&t2, 0.5) <= 510);
+    fail_unless(timer_query(&t1, 0.90) >= 890 && timer_query(&t1, 0.90) <= 910);
+    fail_unless(timer_query(&t2, 0.90) >= 890 && timer_query(&t2, 0.90) <= 910);
+
+    fail_unless(destroy_timer(&t1) == 0);
+    fail_unless(destroy_timer(&t2) == 0);
+}
+END_TEST
+
+START_TEST(test_timer_arena)
+{
+    arena a;
+    timer t;
+    double quants[] = {0.5, 0.90, 0.99};
+    fail_unless(arena_init(0, &a) == 0);
+    fail_unless(init_timer(0.01, (double*)&quants, 3, &t) == 0);
+    timer_use_arena(&t, &a);
+
+    // The raw samples grow in the arena
+    for (int i=100; i >= 1; i--)
+        fail_unless(timer_add_sample(&t, i) == 0);
+    fail_unless(t.num_exact == 100);
+    fail_unless(a.allocated > 0);
+    fail_unless(timer_query(&t, 0.5) == 50);
+    fail_unless(timer_min(&t) == 1);
+
+    // And are left to the arena past the threshold
+    for (int i=101; i <= 1000; i++)
+        fail_unless(timer_add_sample(&t, i) == 0);
+    fail_unless(t.num_exact == 0);
+    fail_unless(t.exact == NULL);
+    fail_unless(timer_query(&t, 0.5) >= 490 && timer_query(&t, 0.5) <= 510);
+
+    fail_unless(destroy_timer(&t) == 0);
+    fail_unless(arena_destroy(&a) == 0);
+}
+END_TEST
+
+START_TEST(test_timer_stats)
+{
+    timer t1, t2;
+    fail_unless(init_timer_stats(&t1) == 0);
+    fail_unless(init_timer_stats(&t2) == 0);
+    fail_unless(timer_min(&t1) == 0 && timer_max(&t1) == 0);
+
+    // Only the count, sums and extremes are kept
+    for (int i=1; i<=200; i++)
+        fail_unless(timer_add_sample((i % 2) ? &t1 : &t2, i) == 0);
+    fail_unless(t1.exact == NULL && t2.exact == NULL);
+    fail_unless(timer_add_weighted(&t2, 500, 10) == 0);
+    fail_unless(timer_merge(&t1, &t2) == 0);
+
+    fail_unless(timer_count(&t1) == 210);
+    fail_unless(timer_sum(&t1) == 20100 + 5000);
+    fail_unless(timer_min(&t1) == 1);
+    fail_unless(timer_max(&t1) == 500);
+    fail_unless(timer_query(&t1, 0.5) == 0);
+
+    // The first weighted sample sets both extremes
+    timer t3;
+    fail_unless(init_timer_stats(&t3) == 0);
+    fail_unless(timer_add_weighted(&t3, -4, 3) == 0);
+    fail_unless(timer_min(&t3) == -4 && timer_max(&t3) == -4);
+    fail_unless(timer_merge(&t3, &t1) == 0);
+    fail_unless(timer_min(&t3) == -4 && timer_max(&t3) == 500);
+
+    // They cannot be merged with quantiles
+    timer t4;
+    fail_unless(init_timer_hdr(0.01, &t4) == 0);
+    fail_unless(timer_merge(&t1, &t4) == -1);
+
+    fail_unless(destroy_timer(&t1) == 0);
+    fail_unless(destroy_timer(&t2) == 0);
+    fail_unless(destroy_timer(&t3) == 0);
+    fail_unless(destroy_timer(&t4) == 0);
+}
+END_TEST
+
+START_TEST(test_timer_extremes)
+{
+    timer t1, t2;
+    double quants[] = {0.5, 0.90, 0.99};
+    fail_unless(init_timer(0.01, (double*)&quants, 3, &t1) == 0);
+    fail_unless(init_timer_tdigest(100, &t2) == 0);
+
+    // The extremes are read without flushing the summary
+    for (int i=1000; i > 0; i--) {
+        fail_unless(timer_add_sample(&t1, i) == 0);
+        fail_unless(timer_add_sample(&t2, -i) == 0);
+    }
+    fail_unless(timer_min(&t1) == 1 && timer_max(&t1) == 1000);
+    fail_unless(timer_min(&t2) == -1000 && timer_max(&t2) == -1);
+    fail_unless(!t1.finalized && !t2.finalized);
+
+    // They follow the weighted samples and the merges
+    fail_unless(timer_add_weighted(&t1, 5000, 3) == 0);
+    fail_unless(timer_max(&t1) == 5000);
+    timer t3;
+    fail_unless(init_timer(0.01, (double*)&quants, 3, &t3) == 0);
+    fail_unless(timer_add_sample(&t3, -7) == 0);
+    fail_unless(timer_merge(&t1, &t3) == 0);
+    fail_unless(timer_min(&t1) == -7 && timer_max(&t1) == 5000);
+
+    fail_unless(destroy_timer(&t1) == 0);
+    fail_unless(destroy_timer(&t2) == 0);
+    fail_unless(destroy_timer(&t3) == 0);
+}
+END_TEST
+
+START_TEST(test_timer_admission)
+{
+    timer t1, t2;
+    double quants[] = {0.5, 0.90, 0.99};
+    fail_unless(init_timer(0.01, (double*)&quants, 3, &t1) == 0);
+    fail_unless(init_timer_tdigest(100, &t2) == 0);
+    timer_set_admission(&t1, 1000);
+    timer_set_admission(&t2, 1000);
+
+    uint64_t before[NUM_STATS + NUM_MEMS], after[NUM_STATS + NUM_MEMS];
+    stats_collect(before);
+
+    // The values cycle through 1 to 1000 out of order
+    double sum = 0;
+    for (int i=0; i < 1000000; i++) {
+        double v = (i * 7919) % 1000 + 1;
+        sum += v;
+        fail_unless(timer_add_sample(&t1, v) == 0);
+        fail_unless(timer_add_weighted(&t2, v, 2) == 0);
+    }
+
+    // Most samples are skipped, the rest stand for them
+    stats_collect(after);
+    fail_unless(after[STAT_TIMER_SKIPPED] - before[STAT_TIMER_SKIPPED] > 1900000);
+
+    // The count, sums and extremes are exact
+    fail_unless(timer_count(&t1) == 1000000);
+    fail_unless(timer_count(&t2) == 2000000);
+    fail_unless(timer_sum(&t1) == sum);
+    fail_unless(timer_min(&t1) == 1 && timer_max(&t1) == 1000);
+    fail_unless(timer_min(&t2) == 1 && timer_max(&t2) == 1000);
+
+    // The quantiles stay close
+    fail_unless(timer_query(&t1, 0.5) >= 470 && timer_query(&t1, 0.5) <= 530);
+    fail_unless(timer_query(&t2, 0.5) >= 470 && timer_query(&t2, 0.5) <= 530);
+    fail_unless(timer_query(&t1, 0.9) >= 870 && timer_query(&t1, 0.9) <= 930);
+    fail_unless(timer_query(&t2, 0.9) >= 870 && timer_query(&t2, 0.9) <= 930);
+    fail_unless(timer_query(&t1, 0.99) >= 960);
+    fail_unless(timer_query(&t2, 0.99) >= 960);
+
+    fail_unless(destroy_timer(&t1) == 0);
+    fail_unless(destroy_timer(&t2) == 0);
+}
+END_TEST
@@ -0,0 +1,109 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "topk.h"
+#include "hash.h"
+
+// Adds weight to a key, hashing it
+#define ADD(t, key, weight) topk_add(t, key, hash_key(key, strlen(key)), weight)
+
+START_TEST(test_topk_init_destroy)
+{
+    topk t;
+    fail_unless(topk_init(0, &t) != 0);
+    fail_unless(topk_init(10, &t) == 0);
+    topk_entry out[10];
+    fail_unless(topk_top(&t, out, 10) == 0);
+    fail_unless(topk_destroy(&t) == 0);
+}
+END_TEST
+
+START_TEST(test_topk_exact)
+{
+    topk t;
+    fail_unless(topk_init(8, &t) == 0);
+
+    // Under the capacity, every count is exact
+    char key[16];
+    for (int i=0; i < 8; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        ADD(&t, key, i + 1);
+        ADD(&t, key, i + 1);
+    }
+    topk_entry out[8];
+    fail_unless(topk_top(&t, out, 3) == 3);
+    fail_unless(strcmp(out[0].key, "key7") == 0 && out[0].count == 16 && out[0].error == 0);
+    fail_unless(strcmp(out[1].key, "key6") == 0 && out[1].count == 14);
+    fail_unless(strcmp(out[2].key, "key5") == 0 && out[2].count == 12);
+    fail_unless(topk_top(&t, out, 20) == 8);
+
+    // The keys are forgotten
+    topk_clear(&t);
+    fail_unless(topk_top(&t, out, 8) == 0);
+    ADD(&t, "key1", 5);
+    fail_unless(topk_top(&t, out, 8) == 1);
+    fail_unless(out[0].count == 5);
+    fail_unless(topk_destroy(&t) == 0);
+}
+END_TEST
+
+START_TEST(test_topk_heavy_hitters)
+{
+    topk t;
+    fail_unless(topk_init(32, &t) == 0);
+
+    // A few keys over 1/32 of the weight among many unique keys,
+    // which keep taking over the smallest counters and moving
+    // through the index
+    char key[32];
+    for (int i=0; i < 100000; i++) {
+        if (i % 10 == 0) {
+            ADD(&t, "hot.a", 1);
+        } else if (i % 25 == 1) {
+            ADD(&t, "hot.b", 1);
+        } else {
+            snprintf(key, sizeof(key), "cold.%d", i);
+            ADD(&t, key, 1);
+        }
+    }
+
+    // Never under counted, and over counted by at most the error
+    topk_entry out[2];
+    fail_unless(topk_top(&t, out, 2) == 2);
+    fail_unless(strcmp(out[0].key, "hot.a") == 0);
+    fail_unless(out[0].count >= 10000 && out[0].count - out[0].error <= 10000);
+    fail_unless(strcmp(out[1].key, "hot.b") == 0);
+    fail_unless(out[1].count >= 4000 && out[1].count - out[1].error <= 4000);
+
+    // The monitored keys are still found after the evictions
+    ADD(&t, "hot.b", 100000);
+    fail_unless(topk_top(&t, out, 1) == 1);
+    fail_unless(strcmp(out[0].key, "hot.b") == 0 && out[0].count >= 104000);
+    fail_unless(topk_destroy(&t) == 0);
+}
+END_TEST
+
+START_TEST(test_topk_merge)
+{
+    topk t1, t2;
+    fail_unless(topk_init(4, &t1) == 0);
+    fail_unless(topk_init(4, &t2) == 0);
+    ADD(&t1, "a", 10);
+    ADD(&t1, "b", 5);
+    ADD(&t2, "b", 20);
+    ADD(&t2, "c", 1);
+
+    topk_merge(&t1, &t2);
+    topk_entry out[4];
+    fail_unless(topk_top(&t1, out, 4) == 3);
+    fail_unless(strcmp(out[0].key, "b") == 0 && out[0].count == 25);
+    fail_unless(strcmp(out[1].key, "a") == 0 && out[1].count == 10);
+    fail_unless(strcmp(out[2].key, "c") == 0 && out[2].count == 1);
+
+    // The source is unchanged
+    fail_unless(topk_top(&t2, out, 4) == 2);
+    fail_unless(topk_destroy(&t1) == 0);
+    fail_unless(topk_destroy(&t2) == 0);
+}
+END_TEST
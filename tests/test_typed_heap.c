@@ -0,0 +1,58 @@
+#include <check.h>
+#include <stdlib.h>
+#include "typed_heap.h"
+
+typedef struct {
+    double key;
+    int id;
+} test_entry;
+
+#define TEST_ENTRY_BEFORE(a, b) ((a).key < (b).key)
+TYPED_HEAP_DEFINE(test_heap, test_entry, TEST_ENTRY_BEFORE, MEM_TIMERS)
+
+START_TEST(test_typed_heap_empty)
+{
+    test_heap h;
+    test_heap_init(&h);
+    fail_unless(test_heap_size(&h) == 0);
+
+    test_entry e;
+    fail_unless(test_heap_top(&h, &e) == 0);
+    fail_unless(test_heap_pop(&h, &e) == 0);
+    test_heap_destroy(&h);
+}
+END_TEST
+
+START_TEST(test_typed_heap_order)
+{
+    test_heap h;
+    test_heap_init(&h);
+
+    // Push past the initial size in a random order
+    srandom(42);
+    for (int i=0; i < 1000; i++) {
+        test_entry e = {random() % 100, i};
+        fail_unless(test_heap_push(&h, e) == 0);
+    }
+    fail_unless(test_heap_size(&h) == 1000);
+
+    test_entry top, e;
+    double last = -1;
+    for (int i=0; i < 1000; i++) {
+        fail_unless(test_heap_top(&h, &top) == 1);
+        fail_unless(test_heap_pop(&h, &e) == 1);
+        fail_unless(top.key == e.key && top.id == e.id);
+        fail_unless(e.key >= last);
+        last = e.key;
+    }
+    fail_unless(test_heap_size(&h) == 0);
+
+    // Clearing keeps the table
+    test_entry one = {1, 0};
+    fail_unless(test_heap_push(&h, one) == 0);
+    test_heap_clear(&h);
+    fail_unless(test_heap_size(&h) == 0);
+    fail_unless(h.allocated > 0);
+    test_heap_destroy(&h);
+}
+END_TEST
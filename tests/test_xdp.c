@@ -0,0 +1,81 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xdp.h"
+
+// Builds an Ethernet frame of a UDP datagram, returning its length
+static uint32_t build_udp_frame(char *frame, int ipv6, int ip_options, const char *payload, int padding) {
+    uint32_t plen = strlen(payload), ip_len = ipv6 ? 40 : 20 + ip_options;
+    memset(frame, 0, 128);
+    frame[12] = ipv6 ? 0x86 : 0x08;
+    frame[13] = ipv6 ? 0xDD : 0x00;
+    char *ip = frame + 14;
+    if (ipv6) {
+        ip[0] = 0x60;
+        ip[6] = 17;
+    } else {
+        ip[0] = 0x40 | (ip_len / 4);
+        ip[9] = 17;
+    }
+    char *udp = ip + ip_len;
+    udp[4] = (plen + 8) >> 8;
+    udp[5] = (plen + 8) & 0xff;
+    memcpy(udp + 8, payload, plen);
+    return 14 + ip_len + 8 + plen + padding;
+}
+
+START_TEST(test_xdp_udp_payload)
+{
+    char frame[128];
+    uint32_t offset, len;
+
+    // IPv4, with and without options
+    uint32_t flen = build_udp_frame(frame, 0, 0, "a:1|c", 0);
+    fail_unless(xdp_udp_payload(frame, flen, &offset, &len) == 0);
+    fail_unless(offset == 42 && len == 5);
+    fail_unless(memcmp(frame + offset, "a:1|c", 5) == 0);
+    flen = build_udp_frame(frame, 0, 8, "a:1|c", 0);
+    fail_unless(xdp_udp_payload(frame, flen, &offset, &len) == 0);
+    fail_unless(offset == 50 && len == 5);
+
+    // IPv6, and the padding of a short frame is excluded
+    flen = build_udp_frame(frame, 1, 0, "b:2|g", 0);
+    fail_unless(xdp_udp_payload(frame, flen, &offset, &len) == 0);
+    fail_unless(offset == 62 && len == 5);
+    flen = build_udp_frame(frame, 0, 0, "c", 17);
+    fail_unless(flen == 60);
+    fail_unless(xdp_udp_payload(frame, flen, &offset, &len) == 0);
+    fail_unless(len == 1);
+}
+END_TEST
+
+START_TEST(test_xdp_udp_payload_invalid)
+{
+    char frame[128];
+    uint32_t offset, len;
+
+    // Truncated, the UDP length is past the end of the frame
+    uint32_t flen = build_udp_frame(frame, 0, 0, "a:1|c", 0);
+    fail_unless(xdp_udp_payload(frame, flen - 1, &offset, &len) == -1);
+    fail_unless(xdp_udp_payload(frame, 20, &offset, &len) == -1);
+
+    // A fragment
+    frame[14 + 6] = 0x20;
+    fail_unless(xdp_udp_payload(frame, flen, &offset, &len) == -1);
+
+    // Not UDP, nor IP
+    flen = build_udp_frame(frame, 0, 0, "a:1|c", 0);
+    frame[14 + 9] = 6;
+    fail_unless(xdp_udp_payload(frame, flen, &offset, &len) == -1);
+    flen = build_udp_frame(frame, 0, 0, "a:1|c", 0);
+    frame[12] = 0x08;
+    frame[13] = 0x06;
+    fail_unless(xdp_udp_payload(frame, flen, &offset, &len) == -1);
+
+    // A header length under the minimum
+    flen = build_udp_frame(frame, 0, 0, "a:1|c", 0);
+    frame[14] = 0x44;
+    fail_unless(xdp_udp_payload(frame, flen, &offset, &len) == -1);
+}
+END_TEST